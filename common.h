@@ -14,6 +14,12 @@
 //Print A LOT of vUART debug messages
 //#define VUART_DEBUG_LOG
 
+//Expose every vUART as /dev/vuart_ttySN with mmap()-able TX/RX rings (see internal/uart/vuart_chardev.h)
+//#define VUART_CHARDEV
+
+//Intercept execve() using a binfmt handler instead of overriding the syscall (see internal/intercept_execve.c); x86_64
+//#define EXECVE_INTERCEPT_BINFMT
+
 //Enabled printing of all ioctl() calls (hooked or not)
 //#define DBG_SMART_PRINT_ALL_IOCTL
 
@@ -28,6 +34,7 @@
 /**********************************************************************************************************************/
 
 #include "internal/stealth.h"
+#include "internal/mem_accounting.h" //rp_mem_alloced(), rp_kfree()
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/errno.h>
@@ -36,6 +43,8 @@
 #include <linux/string.h>
 #include "compat/string_compat.h"
 #include <linux/types.h> //bool & others
+#include <linux/jiffies.h> //jiffies, time_after()
+#include <linux/ratelimit.h> //DEFAULT_RATELIMIT_*
 
 /************************************************** Strings handling **************************************************/
 #define get_static_name(variable) #variable
@@ -57,16 +66,18 @@
 #define kalloc_error_int(variable, size) do { __kalloc_err_report_clean(variable, size, -ENOMEM); } while(0)
 #define kalloc_error_ptr(variable, size) do { __kalloc_err_report_clean(variable, size, ERR_PTR(-ENOMEM)); } while(0)
 
-//[internal] Reserves memory & checks result
-#define __kalloc_or_exit(type, variable, size, exit_type) \
+//[internal] Reserves memory, checks result & accounts it for the owner
+#define __kalloc_or_exit(type, variable, size, exit_type, owner) \
     (variable) = (type)(size, GFP_KERNEL); \
-    if (unlikely(!(variable))) { kalloc_error_ ## exit_type (variable, size); }
-
-//Use these to do a standard malloc with error reporting
-#define kmalloc_or_exit_int(variable, size) do { __kalloc_or_exit(kmalloc, variable, size, int); } while(0)
-#define kmalloc_or_exit_ptr(variable, size) do { __kalloc_or_exit(kmalloc, variable, size, ptr); } while(0)
-#define kzalloc_or_exit_int(variable, size) do { __kalloc_or_exit(kzalloc, variable, size, int); } while(0)
-#define kzalloc_or_exit_ptr(variable, size) do { __kalloc_or_exit(kzalloc, variable, size, ptr); } while(0)
+    if (unlikely(!(variable))) { kalloc_error_ ## exit_type (variable, size); } \
+    rp_mem_alloced(owner, variable);
+
+//Use these to do a standard malloc with error reporting; owner is enum rp_mem_owner & memory must be freed with
+// rp_kfree() using the same owner (see internal/mem_accounting.h)
+#define kmalloc_or_exit_int(var, size, owner) do { __kalloc_or_exit(kmalloc, var, size, int, owner); } while(0)
+#define kmalloc_or_exit_ptr(var, size, owner) do { __kalloc_or_exit(kmalloc, var, size, ptr, owner); } while(0)
+#define kzalloc_or_exit_int(var, size, owner) do { __kalloc_or_exit(kzalloc, var, size, int, owner); } while(0)
+#define kzalloc_or_exit_ptr(var, size, owner) do { __kalloc_or_exit(kzalloc, var, size, ptr, owner); } while(0)
 #define try_kfree(variable) do { if(variable) { kfree(variable); } } while(0)
 /**********************************************************************************************************************/
 
@@ -83,6 +94,16 @@
         WARN(1, "BUG log triggered");                                                                          \
     } while(0)
 
+//[internal] Backends of pr_loc_inf & pr_loc_dbg; with LOG_TRACE=y they're trace events (see debug/debug_log_trace.c)
+#ifdef RPDBG_LOG_TRACE
+#include "debug/debug_log_trace.h"
+#define __pr_loc_inf(fmt, ...) rp_log_trace(RP_LOG_INF, __FILENAME__, __LINE__, pr_fmt(fmt), ##__VA_ARGS__)
+#define __pr_loc_dbg(fmt, ...) rp_log_trace(RP_LOG_DBG, __FILENAME__, __LINE__, pr_fmt(fmt), ##__VA_ARGS__)
+#else
+#define __pr_loc_inf _pr_loc_inf
+#define __pr_loc_dbg _pr_loc_dbg
+#endif
+
 #if STEALTH_MODE >= STEALTH_MODE_FULL //all logs will be disabled in full
 #define pr_loc_crt(fmt, ...)
 #define pr_loc_err(fmt, ...)
@@ -97,8 +118,13 @@
 #define pr_loc_crt _pr_loc_crt
 #define pr_loc_err _pr_loc_err
 #define pr_loc_wrn _pr_loc_wrn
+#ifdef RPDBG_LOG_TRACE //trace events never reach the console, so they can be kept on in test builds
+#define pr_loc_inf __pr_loc_inf
+#define pr_loc_dbg __pr_loc_dbg
+#else
 #define pr_loc_inf(fmt, ...)
 #define pr_loc_dbg(fmt, ...)
+#endif
 #define pr_loc_dbg_raw(fmt, ...)
 #define pr_loc_bug _pr_loc_bug
 #define DBG_ALLOW_UNUSED(var) ((void)var) //in debug modes some variables are seen as unused (as they're only for dbg)
@@ -106,14 +132,75 @@
 #else
 #define pr_loc_crt _pr_loc_crt
 #define pr_loc_err _pr_loc_err
-#define pr_loc_inf _pr_loc_inf
+#define pr_loc_inf __pr_loc_inf
 #define pr_loc_wrn _pr_loc_wrn
-#define pr_loc_dbg _pr_loc_dbg
+#define pr_loc_dbg __pr_loc_dbg
 #define pr_loc_dbg_raw _pr_loc_dbg_raw
 #define pr_loc_bug _pr_loc_bug
 #define DBG_ALLOW_UNUSED(var) //when debug logs are enables we don't silence unused variables warnings
 
 #endif //STEALTH_MODE
+
+/*
+ * Rate-limited variants (pr_loc_*_rl) for messages on per-byte/per-call paths, so that an error storm cannot turn into
+ * a CPU (and console) storm. Every callsite is limited separately to DEFAULT_RATELIMIT_BURST messages per
+ * DEFAULT_RATELIMIT_INTERVAL. The number of suppressed messages is reported by the callsite before the next message it
+ * prints. Arguments of suppressed messages aren't evaluated nor formatted.
+ * The state is lock-less (as these are used e.g. under vUART spinlocks); under races a message may slip through or be
+ * miscounted, which doesn't matter for logs.
+ */
+struct __pr_loc_rl_state {
+    unsigned long begin; //jiffies when the current interval started
+    unsigned int printed; //in the current interval
+    unsigned int missed; //in the current interval
+};
+
+//[internal] Returns whether a message can be printed; sets *missed to # of messages suppressed since the last printed
+static inline bool __pr_loc_rl_allow(struct __pr_loc_rl_state *rs, unsigned int *missed)
+{
+    unsigned long now = jiffies;
+
+    *missed = 0;
+    if (unlikely(!rs->begin) || time_after(now, rs->begin + DEFAULT_RATELIMIT_INTERVAL)) {
+        *missed = rs->missed;
+        rs->begin = now;
+        rs->printed = 0;
+        rs->missed = 0;
+    }
+
+    if (likely(rs->printed < DEFAULT_RATELIMIT_BURST)) {
+        ++rs->printed;
+        return true;
+    }
+
+    ++rs->missed;
+    return false;
+}
+
+#define __pr_loc_rl(printer, fmt, ...)                                                          \
+    do {                                                                                        \
+        static struct __pr_loc_rl_state __rl_state;                                             \
+        unsigned int __rl_missed;                                                               \
+        if (__pr_loc_rl_allow(&__rl_state, &__rl_missed)) {                                     \
+            if (unlikely(__rl_missed))                                                          \
+                printer("%u message(s) from here were suppressed (rate limit)", __rl_missed);   \
+            printer(fmt, ##__VA_ARGS__);                                                        \
+        }                                                                                       \
+    } while(0)
+
+#if STEALTH_MODE >= STEALTH_MODE_FULL
+#define pr_loc_err_rl(fmt, ...)
+#define pr_loc_wrn_rl(fmt, ...)
+#define pr_loc_inf_rl(fmt, ...)
+#else
+#define pr_loc_err_rl(fmt, ...) __pr_loc_rl(pr_loc_err, fmt, ##__VA_ARGS__)
+#define pr_loc_wrn_rl(fmt, ...) __pr_loc_rl(pr_loc_wrn, fmt, ##__VA_ARGS__)
+#if STEALTH_MODE >= STEALTH_MODE_NORMAL && !defined(RPDBG_LOG_TRACE)
+#define pr_loc_inf_rl(fmt, ...)
+#else
+#define pr_loc_inf_rl(fmt, ...) __pr_loc_rl(pr_loc_inf, fmt, ##__VA_ARGS__)
+#endif
+#endif
 /**********************************************************************************************************************/
 
 #ifndef RP_MODULE_TARGET_VER
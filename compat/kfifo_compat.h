@@ -0,0 +1,15 @@
+#ifndef REDPILL_KFIFO_COMPAT_H
+#define REDPILL_KFIFO_COMPAT_H
+
+#include <linux/version.h> //KERNEL_VERSION()
+#include <linux/kfifo.h> //kfifo_put()
+
+//Before v3.13 the kfifo_put() accepted a pointer, since then it accepts a value
+//ffs... https://github.com/torvalds/linux/commit/498d319bb512992ef0784c278fa03679f2f5649d
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+#define kfifo_put_val(fifo, val) kfifo_put(fifo, &val)
+#else
+#define kfifo_put_val(fifo, val) kfifo_put(fifo, val)
+#endif
+
+#endif //REDPILL_KFIFO_COMPAT_H
@@ -0,0 +1,30 @@
+#ifndef REDPILL_STATIC_KEY_COMPAT_H
+#define REDPILL_STATIC_KEY_COMPAT_H
+
+#include <linux/version.h> //KERNEL_VERSION()
+#include <linux/jump_label.h> //static_key_*, static_branch_*
+
+/**
+ * Boolean jump labels which are off by default, used to make disabled fast paths cost just a NOP
+ *
+ * The static_branch_*() API with idempotent enable/disable exists since v4.3; older kernels only have refcounted
+ * static_key_slow_inc()/dec(). There the enable/disable are emulated by checking the current state first, so callers
+ * must serialize flipping the same key (which they do anyway, as they flip it while changing what it guards).
+ * Flipping a key patches the kernel text & may sleep - it must never be done in atomic context.
+ * See https://github.com/torvalds/linux/commit/11276d5306b8e5b438a36bbff855fe792d7eaa61
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+#define RP_DEFINE_STATIC_KEY_FALSE(name) DEFINE_STATIC_KEY_FALSE(name)
+#define RP_DECLARE_STATIC_KEY_FALSE(name) DECLARE_STATIC_KEY_FALSE(name)
+#define rp_static_branch_unlikely(key) static_branch_unlikely(key)
+#define rp_static_branch_enable(key) static_branch_enable(key)
+#define rp_static_branch_disable(key) static_branch_disable(key)
+#else
+#define RP_DEFINE_STATIC_KEY_FALSE(name) struct static_key name = STATIC_KEY_INIT_FALSE
+#define RP_DECLARE_STATIC_KEY_FALSE(name) extern struct static_key name
+#define rp_static_branch_unlikely(key) static_key_false(key)
+#define rp_static_branch_enable(key) do { if (!static_key_enabled(key)) static_key_slow_inc(key); } while(0)
+#define rp_static_branch_disable(key) do { if (static_key_enabled(key)) static_key_slow_dec(key); } while(0)
+#endif
+
+#endif //REDPILL_STATIC_KEY_COMPAT_H
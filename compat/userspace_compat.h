@@ -0,0 +1,40 @@
+#ifndef REDPILL_USERSPACE_COMPAT_H
+#define REDPILL_USERSPACE_COMPAT_H
+
+/**
+ * Minimal kernel environment for pure-logic units which are also built as a userspace library
+ *
+ * Some parts of the module are pure computation (e.g. ATA checksums or temporally stable random readings). They include
+ * this header instead of kernel headers & common.h, so that the very same sources can be built with "make userspace"
+ * and benchmarked with perf or fuzzed with libFuzzer outside of the kernel. Only things such units actually use are
+ * provided here - anything else (locking, allocations, kernel state) doesn't belong in them.
+ */
+#ifdef __KERNEL__
+#include "../common.h" //pr_loc_*, likely(), unlikely()
+#include <linux/types.h> //u8, u16, u32, u64
+#include <linux/string.h> //memset(), memcpy()
+#include <linux/random.h> //prandom_u32()
+#include <linux/ata.h> //ATA_SECT_SIZE
+#else //userspace
+#include <stdint.h> //uint*_t
+#include <stdio.h> //fprintf()
+#include <stdlib.h> //random()
+#include <string.h> //memset(), memcpy()
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define pr_loc_bug(fmt, ...) fprintf(stderr, "BUG %s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+//random() is only 31 bits; this is good enough for the ranges used by pure-logic units
+#define prandom_u32() ((u32)random())
+
+#define ATA_SECT_SIZE 512
+#endif //__KERNEL__
+
+#endif //REDPILL_USERSPACE_COMPAT_H
@@ -2,55 +2,48 @@
 #include "../common.h" //commonly used headers in this module
 #include "../internal/call_protected.h" //used to call cmdline_proc_show()
 #include <linux/seq_file.h> //struct seq_file
-
-#define ensure_cmdline_param(cmdline_param) \
-    if (strncmp(param_pointer, cmdline_param, strlen_static(cmdline_param)) != 0) { return false; }
-
-#define ensure_cmdline_token(cmdline_param) \
-    if (strncmp(param_pointer, cmdline_param, sizeof(cmdline_param)) != 0) { return false; }
+#include <linux/bsearch.h> //bsearch()
+#include <linux/init.h> //__init, __initconst
+#include <linux/sched.h> //SCHED_*
+#include "../internal/uart/virtual_uart.h" //VUART_VIRQ_CPU_*
+
+/*
+ * Extractors below are called from extract_config_from_cmdline() via the cmdline_options[] table, only for tokens
+ * matching their option. They receive the whole token (e.g. "vid=0x1234"), so the value starts right after the option.
+ * The cmdline is parsed once when the module loads, so all of the parsing lives in init sections. Only the cmdline
+ * cache and visible spans (used by /proc/cmdline sanitization) stay resident.
+ */
 
 /**
  * Extracts device model (syno_hw_version=<string>) from kernel cmd line
- *
- * @param model pointer to save model to
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
  */
-static bool extract_hw(syno_hw *model, const char *param_pointer)
+static void __init extract_hw(struct runtime_config *config, const char *param_pointer)
 {
-    ensure_cmdline_param(CMDLINE_KT_HW);
-
+    syno_hw *model = &config->hw;
     if (strscpy((char *)model, param_pointer + strlen_static(CMDLINE_KT_HW), sizeof(syno_hw)) < 0)
         pr_loc_wrn("HW version truncated to %zu", sizeof(syno_hw)-1);
 
     pr_loc_dbg("HW version set to: %s", (char *)model);
-
-    return true;
 }
 
 /**
  * Extracts serial number (sn=<string>) from kernel cmd line
- *
- * @param sn pointer to save s/n to
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
  */
-static bool extract_sn(serial_no *sn, const char *param_pointer)
+static void __init extract_sn(struct runtime_config *config, const char *param_pointer)
 {
-    ensure_cmdline_param(CMDLINE_KT_SN);
-
+    serial_no *sn = &config->sn;
     if(strscpy((char *)sn, param_pointer + strlen_static(CMDLINE_KT_SN), sizeof(serial_no)) < 0)
         pr_loc_wrn("S/N truncated to %zu", sizeof(serial_no)-1);
 
     pr_loc_dbg("S/N set to: %s", (char *)sn);
-
-    return true;
 }
 
-static bool extract_boot_media_type(struct boot_media *boot_media, const char *param_pointer)
+/**
+ * Extracts boot media type (synoboot_satadom=<0|1|2>) from kernel cmd line
+ */
+static void __init extract_boot_media_type(struct runtime_config *config, const char *param_pointer)
 {
-    ensure_cmdline_param(CMDLINE_KT_SATADOM);
-
+    struct boot_media *boot_media = &config->boot_media;
     char value = param_pointer[strlen_static(CMDLINE_KT_SATADOM)];
 
     switch (value) {
@@ -72,31 +65,24 @@ static bool extract_boot_media_type(struct boot_media *boot_media, const char *p
         default:
             pr_loc_err("Option \"%s%c\" is invalid (value should be 0/1/2)", CMDLINE_KT_SATADOM, value);
     }
-
-    return true;
 }
 
 /**
  * Extracts VID override (vid=<uint>) from kernel cmd line
- *
- * @param user_vid pointer to save VID
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
  */
-static bool extract_vid(device_id *user_vid, const char *param_pointer)
+static void __init extract_vid(struct runtime_config *config, const char *param_pointer)
 {
-    ensure_cmdline_param(CMDLINE_CT_VID);
-
+    device_id *user_vid = &config->boot_media.vid;
     long long numeric_param;
     int tmp_call_res = kstrtoll(param_pointer + strlen_static(CMDLINE_CT_VID), 0, &numeric_param);
     if (unlikely(tmp_call_res != 0)) {
         pr_loc_err("Call to %s() failed => %d", "kstrtoll", tmp_call_res);
-        return true;
+        return;
     }
 
     if (unlikely(numeric_param > VID_PID_MAX)) {
         pr_loc_err("Cmdline %s is invalid (value larger than %d)", CMDLINE_CT_VID, VID_PID_MAX);
-        return true;
+        return;
     }
 
     if (unlikely(*user_vid) != 0)
@@ -106,31 +92,24 @@ static bool extract_vid(device_id *user_vid, const char *param_pointer)
 
     *user_vid = (unsigned int)numeric_param;
     pr_loc_dbg("VID override: 0x%04x", *user_vid);
-
-    return true;
 }
 
 /**
  * Extracts PID override (pid=<uint>) from kernel cmd line
- *
- * @param user_pid pointer to save PID
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
  */
-static bool extract_pid(device_id *user_pid, const char *param_pointer)
+static void __init extract_pid(struct runtime_config *config, const char *param_pointer)
 {
-    ensure_cmdline_param(CMDLINE_CT_PID);
-
+    device_id *user_pid = &config->boot_media.pid;
     long long numeric_param;
     int tmp_call_res = kstrtoll(param_pointer + strlen_static(CMDLINE_CT_PID), 0, &numeric_param);
     if (unlikely(tmp_call_res != 0)) {
         pr_loc_err("Call to %s() failed => %d", "kstrtoll", tmp_call_res);
-        return true;
+        return;
     }
 
     if (unlikely(numeric_param > VID_PID_MAX)) {
         pr_loc_err("Cmdline %s is invalid (value larger than %d)", CMDLINE_CT_PID, VID_PID_MAX);
-        return true;
+        return;
     }
 
     if (unlikely(*user_pid) != 0)
@@ -140,57 +119,157 @@ static bool extract_pid(device_id *user_pid, const char *param_pointer)
 
     *user_pid = (unsigned int)numeric_param;
     pr_loc_dbg("PID override: 0x%04x", *user_pid);
-
-    return true;
 }
 
 /**
  * Extracts MFG mode enable switch (mfg<noval>) from kernel cmd line
+ */
+static void __init extract_mfg(struct runtime_config *config, const char *param_pointer)
+{
+    config->boot_media.mfg_mode = true;
+    pr_loc_dbg("MFG boot requested");
+}
+
+/**
+ * Extracts mfgBIOS vtable dumping switch (dbg_vtable) from kernel cmd line
+ */
+static void __init extract_dbg_vtable(struct runtime_config *config, const char *param_pointer)
+{
+    config->dbg_vtable = true;
+    pr_loc_dbg("mfgBIOS vtable dumps requested");
+}
+
+/**
+ * Extracts external platform database file name (platdb=<file>) from kernel cmd line
+ */
+static void __init extract_platform_db(struct runtime_config *config, const char *param_pointer)
+{
+    if (strscpy(config->platform_db, param_pointer + strlen_static(CMDLINE_CT_PLATDB), sizeof(platform_db_file)) < 0)
+        pr_loc_wrn("Platform DB file name truncated to %zu", sizeof(platform_db_file)-1);
+
+    pr_loc_dbg("Platform DB set to: %s", config->platform_db);
+}
+
+/**
+ * Extracts file where emulated SMART state is persisted (smart_state=<absolute path>) from kernel cmd line
  *
- * @param is_mfg_boot pointer to flag
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
+ * The path is only validated when the SMART shim starts (see shim/storage/smart_state.c).
  */
-static bool extract_mfg(bool *is_mfg_boot, const char *param_pointer)
+static void __init extract_smart_state(struct runtime_config *config, const char *param_pointer)
 {
-    ensure_cmdline_token(CMDLINE_CT_MFG);
+    if (strscpy(config->smart_state, param_pointer + strlen_static(CMDLINE_CT_SMART_STATE),
+                sizeof(smart_state_file)) < 0)
+        pr_loc_wrn("SMART state file path truncated to %zu", sizeof(smart_state_file)-1);
 
-    *is_mfg_boot = true;
-    pr_loc_dbg("MFG boot requested");
+    pr_loc_dbg("SMART state file set to: %s", config->smart_state);
+}
 
-    return true;
+/**
+ * Extracts vUART UDP sink target (vuart_net=<ttyS#>:<netconsole target>) from kernel cmd line
+ *
+ * The value is only validated when the sink starts (see debug/debug_vuart_net.c).
+ */
+static void __init extract_vuart_net(struct runtime_config *config, const char *param_pointer)
+{
+#ifndef RPDBG_VUART_NET
+    pr_loc_wrn("%s was specified but the module was built without DBG_VUART_NET=y - ignoring", CMDLINE_CT_VUART_NET);
+#else
+    if (strscpy(config->vuart_net, param_pointer + strlen_static(CMDLINE_CT_VUART_NET), sizeof(vuart_net_target)) < 0)
+        pr_loc_wrn("vUART UDP sink target truncated to %zu", sizeof(vuart_net_target)-1);
+
+    pr_loc_dbg("vUART UDP sink target set to: %s", config->vuart_net);
+#endif
 }
 
 /**
- * Extracts maximum size of SATA DOM (dom_szmax=<number of MiB>) from kernel cmd line
+ * Extracts vIRQ dispatcher scheduling (vuart_irq=<other|fifo|rr>[:<prio>][@<cpu#|follow>]) from kernel cmd line
+ *
+ * E.g. "vuart_irq=fifo:10@follow". Values are only validated when they're applied (see vuart_set_virq_sched()).
  */
-static bool extract_dom_max_size(struct boot_media *boot_media, const char *param_pointer)
+static void __init extract_vuart_irq_sched(struct runtime_config *config, const char *param_pointer)
 {
-    ensure_cmdline_param(CMDLINE_CT_DOM_SZMAX);
+    const char *value = param_pointer + strlen_static(CMDLINE_CT_VUART_IRQ);
+    struct vuart_irq_sched sched = { .policy = SCHED_NORMAL, .priority = 0, .cpu = VUART_VIRQ_CPU_ANY };
+    char *end;
+
+    size_t policy_len = strcspn(value, ":@");
+    if (policy_len == strlen_static("other") && strncmp(value, "other", policy_len) == 0) {
+        sched.policy = SCHED_NORMAL;
+    } else if (policy_len == strlen_static("fifo") && strncmp(value, "fifo", policy_len) == 0) {
+        sched.policy = SCHED_FIFO;
+        sched.priority = 1; //the lowest RT priority is still above any SCHED_NORMAL thread
+    } else if (policy_len == strlen_static("rr") && strncmp(value, "rr", policy_len) == 0) {
+        sched.policy = SCHED_RR;
+        sched.priority = 1;
+    } else {
+        goto out_invalid;
+    }
+    value += policy_len;
 
+    if (*value == ':') {
+        sched.priority = simple_strtol(++value, &end, 10);
+        if (end == value)
+            goto out_invalid;
+        value = end;
+    }
+
+    if (*value == '@') {
+        if (strcmp(++value, "follow") == 0) {
+            sched.cpu = VUART_VIRQ_CPU_FOLLOW;
+        } else {
+            sched.cpu = simple_strtol(value, &end, 10);
+            if (end == value || *end != '\0' || sched.cpu < 0)
+                goto out_invalid;
+        }
+    } else if (*value != '\0') {
+        goto out_invalid;
+    }
+
+    config->vuart_irq = sched;
+    pr_loc_dbg("vIRQ dispatcher scheduling set to policy=%d prio=%d cpu=%d", sched.policy, sched.priority, sched.cpu);
+    return;
+
+    out_invalid:
+    pr_loc_err("Invalid vIRQ dispatcher scheduling (\"%s\") - expected %s<other|fifo|rr>[:<prio>][@<cpu#|follow>]",
+               param_pointer, CMDLINE_CT_VUART_IRQ);
+}
+
+/**
+ * Extracts maximum size of SATA DOM (dom_szmax=<number of MiB>) from kernel cmd line
+ */
+static void __init extract_dom_max_size(struct runtime_config *config, const char *param_pointer)
+{
     long size_mib = simple_strtol(param_pointer + strlen_static(CMDLINE_CT_DOM_SZMAX), NULL, 10);
     if (size_mib <= 0) {
         pr_loc_err("Invalid maximum size of SATA DoM (\"%s=%ld\")", CMDLINE_CT_DOM_SZMAX, size_mib);
-        return true;
+        return;
     }
 
-    boot_media->dom_size_mib = size_mib;
+    config->boot_media.dom_size_mib = size_mib;
     pr_loc_dbg("Set maximum SATA DoM to %ld", size_mib);
+}
+
+/**
+ * Extracts interval of reading real sensors (hwmon_pt=<seconds>) from kernel cmd line
+ */
+static void __init extract_hwmon_pt_interval(struct runtime_config *config, const char *param_pointer)
+{
+    long interval_sec = simple_strtol(param_pointer + strlen_static(CMDLINE_CT_HWMON_PT), NULL, 10);
+    if (interval_sec < 0 || interval_sec > HWMON_PT_INTERVAL_MAX) {
+        pr_loc_err("Invalid real sensors refresh interval (\"%s%ld\")", CMDLINE_CT_HWMON_PT, interval_sec);
+        return;
+    }
 
-    return true;
+    config->hwmon_pt_interval = interval_sec;
+    pr_loc_dbg("Set real sensors refresh interval to %lds (0 = disabled)", interval_sec);
 }
 
 /**
  * Extracts MFG mode enable switch (syno_port_thaw=<1|0>) from kernel cmd line
- *
- * @param port_thaw pointer to flag
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
  */
-static bool extract_port_thaw(bool *port_thaw, const char *param_pointer)
+static void __init extract_port_thaw(struct runtime_config *config, const char *param_pointer)
 {
-    ensure_cmdline_param(CMDLINE_KT_THAW);
-
+    bool *port_thaw = &config->port_thaw;
     short value = param_pointer[strlen_static(CMDLINE_KT_THAW)];
 
     if (value == '0') {
@@ -204,54 +283,42 @@ static bool extract_port_thaw(bool *port_thaw, const char *param_pointer)
 
     if (value == '\0') {
         pr_loc_err("Option \"%s%d\" is invalid (value should be 0 or 1)", CMDLINE_KT_THAW, value);
-        return true;
+        return;
     }
 
     out_found:
         pr_loc_dbg("Port thaw set to: %d", port_thaw?1:0);
-        return true;
 }
 
 /**
  * Extracts number of expected network interfaces (netif_num=<number>) from kernel cmd line
- *
- * @param netif_num pointer to save number
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
  */
-static bool extract_netif_num(unsigned short *netif_num, const char *param_pointer)
+static void __init extract_netif_num(struct runtime_config *config, const char *param_pointer)
 {
-    ensure_cmdline_param(CMDLINE_KT_NETIF_NUM);
-
     short value = *(param_pointer + strlen_static(CMDLINE_KT_NETIF_NUM)) - 48; //ASCII: 0=48 and 9=57
 
     if (value == 0) {
         pr_loc_wrn("You specified no network interfaces (\"%s=0\")", CMDLINE_KT_NETIF_NUM);
-        return true;
+        return;
     }
 
     if (value < 1 || value > 9) {
         pr_loc_err("Invalid number of network interfaces set (\"%s%d\")", CMDLINE_KT_NETIF_NUM, value);
-        return true;
+        return;
     }
 
-    *netif_num = value;
+    config->netif_num = value;
     pr_loc_dbg("Declared network ifaces # as %d", value);
-
-    return true;
 }
 
 /**
- * Extracts network interfaces MAC addresses (mac1...mac4=<MAC> **OR** macs=<mac1,mac2,macN>)
+ * Extracts network interfaces MAC addresses (mac1...mac8=<MAC> **OR** macs=<mac1,mac2,macN>)
  *
  * Note: mixing two notations may lead to undefined behaviors
- *
- * @param macs pointer to save macs
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
  */
-static bool extract_netif_macs(mac_address *macs[MAX_NET_IFACES], const char *param_pointer)
+static void __init extract_netif_macs(struct runtime_config *config, const char *param_pointer)
 {
+    mac_address **macs = config->macs;
     if (strncmp(param_pointer, CMDLINE_KT_MACS, strlen_static(CMDLINE_KT_MACS)) == 0) {
         unsigned short i = 0;
         const char *pBegin = param_pointer + strlen_static(CMDLINE_KT_MACS);
@@ -265,6 +332,7 @@ static bool extract_netif_macs(mac_address *macs[MAX_NET_IFACES], const char *pa
                            i);
                 goto out_found;
             }
+            rp_mem_alloced(RP_MEM_CONFIG, macs[i]);
             if(strscpy((char *)macs[i], pBegin, sizeof(mac_address)) < 0)
                 pr_loc_wrn("MAC #%d truncated to %zu", i+1, sizeof(mac_address)-1);
             pr_loc_dbg("Set MAC #%d: %s", i+1, (char *)macs[i]);
@@ -280,6 +348,7 @@ static bool extract_netif_macs(mac_address *macs[MAX_NET_IFACES], const char *pa
                            i);
                 goto out_found;
             }
+            rp_mem_alloced(RP_MEM_CONFIG, macs[i]);
             if(strscpy((char *)macs[i], pBegin, sizeof(mac_address)) < 0)
                 pr_loc_wrn("MAC #%d truncated to %zu", i+1, sizeof(mac_address)-1);
             pr_loc_dbg("Set MAC #%d: %s", i+1, (char *)macs[i]);
@@ -289,9 +358,10 @@ static bool extract_netif_macs(mac_address *macs[MAX_NET_IFACES], const char *pa
     }
 
     //mac1=...mac8= are valid options. ASCII for 1 is 49, ASCII for MAX_NET_IFACES is (49 + (MAX_NET_IFACES - 1)) # MAX_NET_IFACES must <=9
-    if (strncmp(param_pointer, "mac", 3) != 0 || *(param_pointer + 4) != '=' || *(param_pointer + 3) < 49 ||
-        *(param_pointer + 3) > (49 + (MAX_NET_IFACES - 1)))
-        return false;
+    if (*(param_pointer + 3) < 49 || *(param_pointer + 3) > (49 + (MAX_NET_IFACES - 1))) {
+        pr_loc_err("Option \"%s\" is invalid (only %d interfaces are supported)", param_pointer, MAX_NET_IFACES);
+        return;
+    }
 
     //Find free spot
     unsigned short i = 0;
@@ -305,6 +375,7 @@ static bool extract_netif_macs(mac_address *macs[MAX_NET_IFACES], const char *pa
                        i);
             goto out_found;
         }
+        rp_mem_alloced(RP_MEM_CONFIG, macs[i]);
 
         if(strscpy((char *)macs[i], param_pointer + strlen_static(CMDLINE_KT_MAC1), sizeof(mac_address)) < 0)
             pr_loc_wrn("MAC #%d truncated to %zu", i+1, sizeof(mac_address)-1);
@@ -316,18 +387,115 @@ static bool extract_netif_macs(mac_address *macs[MAX_NET_IFACES], const char *pa
     pr_loc_err("You set more than MAC addresses! Only first %d will be honored.", MAX_NET_IFACES);
 
     out_found:
-        return true;
+        return;
 }
 
-static bool report_unrecognized_option(const char *param_pointer)
+static void __init report_unrecognized_option(const char *param_pointer)
 {
     pr_loc_dbg("Option \"%s\" not recognized - ignoring", param_pointer);
-
-    return true;
 }
 
 /************************************************* End of extractors **************************************************/
 
+#define CMDLINE_OPT_SWITCH      (1 << 0) //option takes no value (e.g. "mfg"); tokens with a value aren't extracted
+#define CMDLINE_OPT_BLACKLISTED (1 << 1) //option is hidden from /proc/cmdline (see internal/stealth/sanitize_cmdline.c)
+
+#ifndef NATIVE_SATA_DOM_SUPPORTED //on kernels without SATA DOM support we shouldn't reveal that it's a SATA DOM-boot
+#define CMDLINE_OPT_SATADOM_FLAGS CMDLINE_OPT_BLACKLISTED
+#else
+#define CMDLINE_OPT_SATADOM_FLAGS 0
+#endif
+
+typedef void (cmdline_extractor)(struct runtime_config *config, const char *param_pointer);
+struct cmdline_option {
+    const char *name; //option with the "=" if it takes a value (i.e. one of the CMDLINE_* constants)
+    unsigned short name_len;
+    unsigned short flags; //CMDLINE_OPT_*
+    cmdline_extractor *extract; //may be NULL if the option is only blacklisted
+};
+#define CMDLINE_OPTION(opt_name, opt_flags, opt_extract) \
+    { .name = (opt_name), .name_len = strlen_static(opt_name), .flags = (opt_flags), .extract = (opt_extract) }
+
+/**
+ * All options known to the module, both to extract values from and to hide from the userspace
+ *
+ * Options are looked up with a binary search by their key (the text before "="), so this table MUST be kept sorted by
+ * the key (with the end of the key sorting before any other character, e.g. "log_buf_len" < "loglevel").
+ */
+static const struct cmdline_option cmdline_options[] __initconst = {
+    CMDLINE_OPTION(CMDLINE_CT_DBG_VTABLE, CMDLINE_OPT_SWITCH | CMDLINE_OPT_BLACKLISTED, extract_dbg_vtable),
+    CMDLINE_OPTION(CMDLINE_CT_DOM_SZMAX, CMDLINE_OPT_BLACKLISTED, extract_dom_max_size),
+    CMDLINE_OPTION(CMDLINE_KT_EARLY_PK, CMDLINE_OPT_BLACKLISTED, NULL),
+    CMDLINE_OPTION(CMDLINE_KT_ELEVATOR, CMDLINE_OPT_BLACKLISTED, NULL),
+    CMDLINE_OPTION(CMDLINE_CT_HWMON_PT, CMDLINE_OPT_BLACKLISTED, extract_hwmon_pt_interval),
+    CMDLINE_OPTION(CMDLINE_KT_PK_BUFFER, CMDLINE_OPT_BLACKLISTED, NULL),
+    CMDLINE_OPTION(CMDLINE_KT_LOGLEVEL, CMDLINE_OPT_BLACKLISTED, NULL),
+    CMDLINE_OPTION(CMDLINE_KT_MAC1, 0, extract_netif_macs),
+    CMDLINE_OPTION(CMDLINE_KT_MAC2, 0, extract_netif_macs),
+    CMDLINE_OPTION(CMDLINE_KT_MAC3, 0, extract_netif_macs),
+    CMDLINE_OPTION(CMDLINE_KT_MAC4, 0, extract_netif_macs),
+    CMDLINE_OPTION(CMDLINE_KT_MAC5, 0, extract_netif_macs),
+    CMDLINE_OPTION(CMDLINE_KT_MAC6, 0, extract_netif_macs),
+    CMDLINE_OPTION(CMDLINE_KT_MAC7, 0, extract_netif_macs),
+    CMDLINE_OPTION(CMDLINE_KT_MAC8, 0, extract_netif_macs),
+    CMDLINE_OPTION(CMDLINE_KT_MACS, 0, extract_netif_macs),
+    CMDLINE_OPTION(CMDLINE_CT_MFG, CMDLINE_OPT_SWITCH | CMDLINE_OPT_BLACKLISTED, extract_mfg),
+    CMDLINE_OPTION(CMDLINE_KT_NETIF_NUM, 0, extract_netif_num),
+    CMDLINE_OPTION(CMDLINE_CT_PID, CMDLINE_OPT_BLACKLISTED, extract_pid),
+    CMDLINE_OPTION(CMDLINE_CT_PLATDB, CMDLINE_OPT_BLACKLISTED, extract_platform_db),
+    CMDLINE_OPTION(CMDLINE_CT_SMART_STATE, CMDLINE_OPT_BLACKLISTED, extract_smart_state),
+    CMDLINE_OPTION(CMDLINE_KT_SN, 0, extract_sn),
+    CMDLINE_OPTION(CMDLINE_KT_HW, 0, extract_hw),
+    CMDLINE_OPTION(CMDLINE_KT_THAW, CMDLINE_OPT_BLACKLISTED, extract_port_thaw),
+    CMDLINE_OPTION(CMDLINE_KT_SATADOM, CMDLINE_OPT_SATADOM_FLAGS, extract_boot_media_type),
+    CMDLINE_OPTION(CMDLINE_CT_VID, CMDLINE_OPT_BLACKLISTED, extract_vid),
+    CMDLINE_OPTION(CMDLINE_CT_VUART_IRQ, CMDLINE_OPT_BLACKLISTED, extract_vuart_irq_sched),
+    CMDLINE_OPTION(CMDLINE_CT_VUART_NET, CMDLINE_OPT_BLACKLISTED, extract_vuart_net),
+};
+
+struct cmdline_key {
+    const char *str;
+    size_t len;
+};
+
+static int __init compare_cmdline_option(const void *key, const void *elt)
+{
+    const struct cmdline_key *token_key = key;
+    const char *name = ((const struct cmdline_option *)elt)->name;
+
+    size_t i = 0;
+    for (; i < token_key->len && name[i] != '\0' && name[i] != '='; i++) {
+        if (token_key->str[i] != name[i])
+            return (unsigned char)token_key->str[i] - (unsigned char)name[i];
+    }
+
+    if (i < token_key->len) //option key ended first
+        return 1;
+
+    return (name[i] == '\0' || name[i] == '=') ? 0 : -1;
+}
+
+/**
+ * Finds an option matching a cmdline token (e.g. "vid=0x1234" will match CMDLINE_CT_VID)
+ *
+ * @return option or NULL if the token is not known
+ */
+static const struct cmdline_option __init *find_cmdline_option(const char *param_pointer, size_t param_len)
+{
+    const char *value_sep = strnchr(param_pointer, param_len, '=');
+    struct cmdline_key token_key = {
+        .str = param_pointer,
+        .len = value_sep ? value_sep - param_pointer : param_len,
+    };
+
+    return bsearch(&token_key, cmdline_options, ARRAY_SIZE(cmdline_options), sizeof(cmdline_options[0]),
+                   compare_cmdline_option);
+}
+
+//Tokens which weren't blacklisted, populated by extract_config_from_cmdline(); see get_visible_cmdline_spans()
+static struct cmdline_span visible_cmdline_spans[CMDLINE_MAX_TOKENS];
+static unsigned int visible_cmdline_spans_num = 0;
+
 static char cmdline_cache[CMDLINE_MAX] = { '\0' };
 /**
  * Extracts the cmdline from kernel and caches it for later use
@@ -377,36 +545,18 @@ long get_kernel_cmdline(char *cmdline_out, size_t maxlen)
     return strscpy(cmdline_out, cmdline_cache, maxlen);
 }
 
-#define ADD_BLACKLIST_ENTRY(idx, token) kmalloc_or_exit_int(cmdline_blacklist[idx], sizeof(token));  \
-                                        strcpy((char *)cmdline_blacklist[idx], token);               \
-                                        pr_loc_dbg("Add cmdline blacklist \"%s\" @ %d",              \
-                                                   (char *)cmdline_blacklist[idx], idx);
-int populate_cmdline_blacklist(cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS], syno_hw *model)
+unsigned int get_visible_cmdline_spans(const char **cmdline, const struct cmdline_span **spans)
 {
-    //Currently, this list is static. However, it's prepared to be dynamic based on the model
-    //Make sure you don't go over MAX_BLACKLISTED_CMDLINE_TOKENS (and if so adjust it)
-    ADD_BLACKLIST_ENTRY(0, CMDLINE_CT_VID);
-    ADD_BLACKLIST_ENTRY(1, CMDLINE_CT_PID);
-    ADD_BLACKLIST_ENTRY(2, CMDLINE_CT_MFG);
-    ADD_BLACKLIST_ENTRY(3, CMDLINE_CT_DOM_SZMAX);
-    ADD_BLACKLIST_ENTRY(4, CMDLINE_KT_ELEVATOR);
-    ADD_BLACKLIST_ENTRY(5, CMDLINE_KT_LOGLEVEL);
-    ADD_BLACKLIST_ENTRY(6, CMDLINE_KT_PK_BUFFER);
-    ADD_BLACKLIST_ENTRY(7, CMDLINE_KT_EARLY_PK);
-    ADD_BLACKLIST_ENTRY(8, CMDLINE_KT_THAW);
-
-#ifndef NATIVE_SATA_DOM_SUPPORTED //on kernels without SATA DOM support we shouldn't reveal that it's a SATA DOM-boot
-    ADD_BLACKLIST_ENTRY(9, CMDLINE_KT_SATADOM);
-#endif
-
-    return 0;
+    *cmdline = cmdline_cache;
+    *spans = visible_cmdline_spans;
+    return visible_cmdline_spans_num;
 }
 
-int extract_config_from_cmdline(struct runtime_config *config)
+int __init extract_config_from_cmdline(struct runtime_config *config)
 {
     int out = 0;
     char *cmdline_txt;
-    kzalloc_or_exit_int(cmdline_txt, strlen_to_size(CMDLINE_MAX));
+    kzalloc_or_exit_int(cmdline_txt, strlen_to_size(CMDLINE_MAX), RP_MEM_CONFIG);
 
     if(get_kernel_cmdline(cmdline_txt, CMDLINE_MAX) <= 0) {
         pr_loc_crt("Failed to extract cmdline");
@@ -420,36 +570,36 @@ int extract_config_from_cmdline(struct runtime_config *config)
      * Temporary variables
      */
     unsigned int param_counter = 0;
+    char *cmdline_itr = cmdline_txt; //strsep() moves it, while cmdline_txt is needed for offsets & freeing
     char *single_param_chunk; //Pointer to the beginning of the cmdline token
     DBG_ALLOW_UNUSED(param_counter);
 
-    while ((single_param_chunk = strsep(&cmdline_txt, CMDLINE_SEP)) != NULL ) {
+    visible_cmdline_spans_num = 0;
+    while ((single_param_chunk = strsep(&cmdline_itr, CMDLINE_SEP)) != NULL ) {
         if (unlikely(single_param_chunk[0] == '\0')) //Skip empty params (e.g. last one)
             continue;
         pr_loc_dbg("Param #%d: |%s|", param_counter++, single_param_chunk);
 
-        //Stop after the first one matches
-        extract_hw(&config->hw, single_param_chunk)                      ||
-        extract_sn(&config->sn, single_param_chunk)                      ||
-        extract_boot_media_type(&config->boot_media, single_param_chunk) ||
-        extract_vid(&config->boot_media.vid, single_param_chunk)         ||
-        extract_pid(&config->boot_media.pid, single_param_chunk)         ||
-        extract_dom_max_size(&config->boot_media, single_param_chunk)    ||
-        extract_mfg(&config->boot_media.mfg_mode, single_param_chunk)    ||
-        extract_port_thaw(&config->port_thaw, single_param_chunk)        ||
-        extract_netif_num(&config->netif_num, single_param_chunk)        ||
-        extract_netif_macs(config->macs, single_param_chunk)             ||
-        report_unrecognized_option(single_param_chunk)                   ;
-    }
+        size_t param_len = strlen(single_param_chunk); //must be taken before extracting as extractors may modify it
+        const struct cmdline_option *opt = find_cmdline_option(single_param_chunk, param_len);
 
-    if (populate_cmdline_blacklist(config->cmdline_blacklist, &config->hw) != 0) {
-        out = -EIO;
-        goto exit_free;
+        if (opt && (opt->flags & CMDLINE_OPT_BLACKLISTED)) {
+            pr_loc_dbg("Cmdline param \"%s\" blacklisted", single_param_chunk);
+        } else if (likely(visible_cmdline_spans_num < CMDLINE_MAX_TOKENS)) {
+            visible_cmdline_spans[visible_cmdline_spans_num].offset = single_param_chunk - cmdline_txt;
+            visible_cmdline_spans[visible_cmdline_spans_num].len = param_len;
+            visible_cmdline_spans_num++;
+        }
+
+        if (opt && opt->extract && (!(opt->flags & CMDLINE_OPT_SWITCH) || param_len == opt->name_len))
+            opt->extract(config, single_param_chunk);
+        else
+            report_unrecognized_option(single_param_chunk);
     }
 
     pr_loc_inf("CmdLine processed successfully, tokens=%d", param_counter);
 
     exit_free:
-    kfree(cmdline_txt);
+    rp_kfree(cmdline_txt, RP_MEM_CONFIG);
     return out;
 }
@@ -28,4 +28,23 @@ long get_kernel_cmdline(char *cmdline_out, unsigned long maxlen);
  */
 int extract_config_from_cmdline(struct runtime_config *config);
 
+#define CMDLINE_MAX_TOKENS (CMDLINE_MAX / 2) //every token needs at least one char + one separator
+
+//Position of a single token in the cmdline returned by get_kernel_cmdline()
+struct cmdline_span {
+    unsigned short offset;
+    unsigned short len;
+};
+
+/**
+ * Gets positions of cmdline tokens which are not blacklisted (i.e. are safe to show to the userspace)
+ *
+ * Spans are computed while extract_config_from_cmdline() parses the cmdline, so there's no need to parse it again.
+ *
+ * @param cmdline pointer to save the (read-only) cached cmdline to; spans are offsets in this string
+ * @param spans pointer to save the (read-only) array of spans to; these are in the order of the cmdline
+ * @return number of spans
+ */
+unsigned int get_visible_cmdline_spans(const char **cmdline, const struct cmdline_span **spans);
+
 #endif //REDPILLLKM_CMDLINE_DELEGATE_H
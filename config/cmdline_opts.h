@@ -15,6 +15,12 @@
 #define CMDLINE_CT_PID "pid=" //Boot media Product ID override
 #define CMDLINE_CT_MFG "mfg" //VID & PID override will use force-reinstall VID/PID combo
 #define CMDLINE_CT_DOM_SZMAX "dom_szmax=" //Max size of SATA device (MiB) to be considered a DOM (usually you should NOT use this)
+#define CMDLINE_CT_HWMON_PT "hwmon_pt=" //Read real sensors every N seconds instead of faking them (bare-metal only)
+#define CMDLINE_CT_DBG_VTABLE "dbg_vtable" //Dump mfgBIOS vtable every time it's (re)shimmed (debug only)
+#define CMDLINE_CT_PLATDB "platdb=" //Load platform definition from a firmware file (see platform_db.h)
+#define CMDLINE_CT_SMART_STATE "smart_state=" //Persist emulated SMART counters & logs in a file (see smart_state.c)
+#define CMDLINE_CT_VUART_IRQ "vuart_irq=" //vIRQ dispatcher scheduling: <other|fifo|rr>[:<prio>][@<cpu#|follow>]
+#define CMDLINE_CT_VUART_NET "vuart_net=" //Send vUART TX over UDP: <ttyS#>:<netconsole target> (DBG_VUART_NET only)
 
 //Standard Linux cmdline tokens
 #define CMDLINE_KT_ELEVATOR  "elevator=" //Sets I/O scheduler (we use it to load RP LKM earlier than normally possible)
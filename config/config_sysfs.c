@@ -0,0 +1,223 @@
+/**
+ * Runtime reconfiguration through sysfs
+ *
+ * The configuration comes from the kernel cmdline & is applied once during load (see extract_config_from_cmdline()).
+ * Settings which can be safely changed without a reboot are additionally exposed in /sys/kernel/redpill/ and applied
+ * using the same register/unregister pairs of their shims which applied them during load:
+ *  - execve_block (write-only): "<path>" blocks execution of a file, "<path>=<replacement>" executes the replacement
+ *    instead of it (see add_redirected_execve_filename()), "-<path>" removes either; paths containing "*" or "?" are
+ *    glob patterns (see add_blocked_execve_glob()) which can only be blocked
+ *  - smart_emulation: 1/0 enables/disables SMART emulation (shim/storage/smart_shim.c)
+ *  - hwmon_pt: real sensors refresh interval in seconds or 0 to fake them (same as hwmon_pt= on the cmdline)
+ *  - vuart_net: vUART UDP sink target or empty to stop it (same as vuart_net= on the cmdline; DBG_VUART_NET only)
+ * e.g. "echo 0 > /sys/kernel/redpill/smart_emulation". Everything else (MACs, boot device VID/PID, port thaw etc.) is
+ * consumed by the kernel or DSM early during boot, so changing it still requires a reboot.
+ *
+ * Stores are serialized & return the error of the shim on failure. Changes aren't persisted anywhere - after a reboot
+ * the cmdline applies again.
+ */
+#include "config_sysfs.h"
+#include "../common.h"
+
+#if STEALTH_MODE < STEALTH_MODE_NORMAL
+#include "runtime_config.h" //current_config, HWMON_PT_INTERVAL_MAX
+#include "../internal/intercept_execve.h" //add_blocked_execve_*(), remove_blocked_execve_*()
+#include "../shim/storage/smart_shim.h" //register_disk_smart_shim(), unregister_disk_smart_shim()
+#include "../shim/bios/bios_hwmon_shim.h" //set_bios_hwmon_pt_interval()
+#ifdef RPDBG_VUART_NET
+#include "../debug/debug_vuart_net.h" //register_vuart_net(), unregister_vuart_net()
+#endif
+#include <linux/kobject.h> //kobject_create_and_add(), kobject_put(), kernel_kobj, struct kobj_attribute
+#include <linux/sysfs.h> //sysfs_create_group(), __ATTR()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+
+#define CONFIG_SYSFS_DIR "redpill" //in /sys/kernel/
+
+static struct kobject *config_kobj = NULL;
+static DEFINE_MUTEX(config_sysfs_lock); //shims' register/unregister functions are not meant to run concurrently
+
+/**
+ * Copies a stored value & strips whitespaces around it (echo adds a newline); the copy must be kfree()d
+ *
+ * @return pointer to the trimmed value (within *copy) or ERR_PTR(-E) on error
+ */
+static char *dup_store_value(const char *buf, size_t count, char **copy)
+{
+    *copy = kstrndup(buf, count, GFP_KERNEL); //short-lived, so it's not accounted
+    if (unlikely(!*copy))
+        return ERR_PTR(-ENOMEM);
+
+    return strim(*copy);
+}
+
+static ssize_t execve_block_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    char *copy;
+    char *path = dup_store_value(buf, count, &copy);
+    if (unlikely(IS_ERR(path)))
+        return PTR_ERR(path);
+
+    bool remove = *path == '-';
+    if (remove)
+        ++path;
+
+    char *replacement = remove ? NULL : strchr(path, '=');
+    if (replacement)
+        *replacement++ = '\0';
+
+    int out;
+    if (*path == '\0' || (replacement && (*replacement == '\0' || strpbrk(path, "*?")))) {
+        out = -EINVAL;
+    } else if (replacement) {
+        out = add_redirected_execve_filename(path, replacement);
+    } else if (strpbrk(path, "*?")) { //execve rules are safe to change at any time - no need for config_sysfs_lock
+        out = remove ? remove_blocked_execve_glob(path) : add_blocked_execve_glob(path);
+    } else {
+        out = remove ? remove_blocked_execve_filename(path) : add_blocked_execve_filename(path);
+    }
+
+    kfree(copy);
+    return out == 0 ? count : out;
+}
+
+static ssize_t smart_emulation_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", is_disk_smart_shim_registered() ? 1 : 0);
+}
+
+static ssize_t smart_emulation_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    bool enable;
+    int out = strtobool(buf, &enable);
+    if (unlikely(out != 0))
+        return out;
+
+    mutex_lock(&config_sysfs_lock);
+    if (enable != is_disk_smart_shim_registered())
+        out = enable ? register_disk_smart_shim() : unregister_disk_smart_shim();
+    mutex_unlock(&config_sysfs_lock);
+
+    return out == 0 ? count : out;
+}
+
+static ssize_t hwmon_pt_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", current_config.hwmon_pt_interval);
+}
+
+static ssize_t hwmon_pt_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int interval_sec;
+    int out = kstrtouint(buf, 10, &interval_sec);
+    if (unlikely(out != 0))
+        return out;
+
+    if (unlikely(interval_sec > HWMON_PT_INTERVAL_MAX))
+        return -ERANGE;
+
+    mutex_lock(&config_sysfs_lock);
+    out = set_bios_hwmon_pt_interval(interval_sec);
+    mutex_unlock(&config_sysfs_lock);
+
+    return out == 0 ? count : out;
+}
+
+#ifdef RPDBG_VUART_NET
+static ssize_t vuart_net_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    mutex_lock(&config_sysfs_lock);
+    ssize_t len = sprintf(buf, "%s\n", current_config.vuart_net);
+    mutex_unlock(&config_sysfs_lock);
+
+    return len;
+}
+
+static ssize_t vuart_net_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    char *copy;
+    char *target = dup_store_value(buf, count, &copy);
+    if (unlikely(IS_ERR(target)))
+        return PTR_ERR(target);
+
+    int out = 0;
+    if (unlikely(strlen(target) >= sizeof(vuart_net_target))) {
+        out = -ENAMETOOLONG;
+        goto out_free;
+    }
+
+    mutex_lock(&config_sysfs_lock);
+    if ((out = unregister_vuart_net()) != 0) {
+        pr_loc_err("Failed to stop vUART UDP sink - error=%d", out);
+        goto out_unlock;
+    }
+
+    strscpy(current_config.vuart_net, target, sizeof(vuart_net_target));
+    if ((out = register_vuart_net(&current_config)) != 0)
+        current_config.vuart_net[0] = '\0'; //it's not running, so it shouldn't be shown as such
+
+    out_unlock:
+    mutex_unlock(&config_sysfs_lock);
+    out_free:
+    kfree(copy);
+    return out == 0 ? count : out;
+}
+#endif //RPDBG_VUART_NET
+
+static struct kobj_attribute execve_block_attr = __ATTR(execve_block, 0200, NULL, execve_block_store);
+static struct kobj_attribute smart_emulation_attr = __ATTR(smart_emulation, 0600, smart_emulation_show,
+                                                           smart_emulation_store);
+static struct kobj_attribute hwmon_pt_attr = __ATTR(hwmon_pt, 0600, hwmon_pt_show, hwmon_pt_store);
+#ifdef RPDBG_VUART_NET
+static struct kobj_attribute vuart_net_attr = __ATTR(vuart_net, 0600, vuart_net_show, vuart_net_store);
+#endif
+
+static struct attribute *config_attrs[] = {
+    &execve_block_attr.attr,
+    &smart_emulation_attr.attr,
+    &hwmon_pt_attr.attr,
+#ifdef RPDBG_VUART_NET
+    &vuart_net_attr.attr,
+#endif
+    NULL,
+};
+
+static const struct attribute_group config_attr_group = {
+    .attrs = config_attrs,
+};
+
+int register_config_sysfs(void)
+{
+    if (unlikely(config_kobj)) {
+        pr_loc_bug("Config sysfs is already registered");
+        return -EEXIST;
+    }
+
+    config_kobj = kobject_create_and_add(CONFIG_SYSFS_DIR, kernel_kobj);
+    if (unlikely(!config_kobj)) {
+        pr_loc_err("Failed to create /sys/kernel/%s", CONFIG_SYSFS_DIR);
+        return -ENOMEM;
+    }
+
+    int out = sysfs_create_group(config_kobj, &config_attr_group);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to create attributes in /sys/kernel/%s - error=%d", CONFIG_SYSFS_DIR, out);
+        kobject_put(config_kobj);
+        config_kobj = NULL;
+        return out;
+    }
+
+    pr_loc_inf("Runtime config available in /sys/kernel/%s/", CONFIG_SYSFS_DIR);
+    return 0;
+}
+
+int unregister_config_sysfs(void)
+{
+    if (!config_kobj)
+        return 0;
+
+    kobject_put(config_kobj); //removes attributes too; it waits for stores in progress to finish
+    config_kobj = NULL;
+
+    return 0;
+}
+#endif //STEALTH_MODE < STEALTH_MODE_NORMAL
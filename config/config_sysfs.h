@@ -0,0 +1,27 @@
+#ifndef REDPILL_CONFIG_SYSFS_H
+#define REDPILL_CONFIG_SYSFS_H
+
+#include "../internal/stealth.h" //STEALTH_MODE
+
+#if STEALTH_MODE < STEALTH_MODE_NORMAL
+/**
+ * Exposes settings which can be safely changed at runtime in /sys/kernel/redpill/ (see config_sysfs.c)
+ *
+ * It should be registered after all shims it reconfigures.
+ *
+ * @return 0 on success or -E on error
+ */
+int register_config_sysfs(void);
+
+/**
+ * Removes the sysfs interface; stores in progress are finished before it returns
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_config_sysfs(void);
+#else //a sysfs directory would be a dead giveaway
+static inline int register_config_sysfs(void) { return 0; }
+static inline int unregister_config_sysfs(void) { return 0; }
+#endif //STEALTH_MODE < STEALTH_MODE_NORMAL
+
+#endif //REDPILL_CONFIG_SYSFS_H
@@ -0,0 +1,231 @@
+/**
+ * Loads platform definitions from an external database instead of the compiled-in config/platforms.h
+ *
+ * Adding a model normally requires rebuilding every module variant. With the "platdb=<file>" option the platform
+ * definition is taken from a compact binary file (see platform_db.h for the format), loaded using
+ * request_firmware_direct(), i.e. never through the usermode helper fallback which can block the load for a minute.
+ * Only the entry of the selected model is parsed, so the cost doesn't depend on how many models the file contains.
+ * If the file or the model in it cannot be found the compiled-in table is used as a fallback.
+ *
+ * As request_firmware*() needs a device (for the usermode helper fallback in some kernels) a dummy platform device is
+ * registered just for the time of loading.
+ */
+#include "platform_db.h"
+#include "platform_types.h" //struct hw_config, HWMON_*
+#include "../common.h"
+#include <linux/firmware.h> //request_firmware(), request_firmware_direct(), release_firmware()
+#include <linux/platform_device.h> //platform_device_register_simple()
+#include <linux/bsearch.h> //bsearch()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
+#include <asm/unaligned.h> //get_unaligned_le*()
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+#include <linux/namei.h> //kern_path()
+#include <linux/utsname.h> //UTS_RELEASE
+#endif
+
+#define PLATFORM_DB_DEV_NAME "rp_platdb"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+/**
+ * request_firmware_direct() doesn't exist before v3.14 - request_firmware() falls back to the usermode helper (and
+ * waits for it for up to a minute) when the file isn't found. To avoid that we only call it when the file exists in
+ * one of the paths the direct loader looks in [drivers/base/firmware_class.c:fw_path of v3.10].
+ */
+static int __init request_firmware_direct(const struct firmware **fw, const char *name, struct device *dev)
+{
+    static const char * const fw_paths[] __initconst = {
+        "/lib/firmware/updates/" UTS_RELEASE,
+        "/lib/firmware/updates",
+        "/lib/firmware/" UTS_RELEASE,
+        "/lib/firmware",
+    };
+    char file_path[PATH_MAX];
+    struct path path;
+
+    for (int i = 0; i < ARRAY_SIZE(fw_paths); i++) {
+        snprintf(file_path, sizeof(file_path), "%s/%s", fw_paths[i], name);
+        if (kern_path(file_path, LOOKUP_FOLLOW, &path) != 0)
+            continue;
+
+        path_put(&path);
+        return request_firmware(fw, name, dev);
+    }
+
+    return -ENOENT;
+}
+#endif
+
+static struct vpci_device_stub *db_pci_stubs = NULL; //PCI stubs of the loaded platform
+
+static int __init compare_db_entry_name(const void *key, const void *elt)
+{
+    return strncmp(key, ((const struct platform_db_entry *)elt)->name, PLATFORM_DB_NAME_LEN);
+}
+
+/**
+ * Validates whether all hwmon ids are known (as there's no point using a file generated for a different module)
+ */
+#define validate_db_ids(entry, field, max_id) ({                                                              \
+    bool __valid = true;                                                                                      \
+    for (int __i = 0; __i < ARRAY_SIZE((entry)->field); __i++) {                                              \
+        if (unlikely((entry)->field[__i] > (max_id))) {                                                       \
+            pr_loc_err("Platform DB entry has invalid " #field "[%d]=%u (max=%d)", __i, (entry)->field[__i],  \
+                       (max_id));                                                                             \
+            __valid = false;                                                                                  \
+        }                                                                                                     \
+    }                                                                                                         \
+    __valid;                                                                                                  \
+})
+
+#define copy_db_ids(hw, entry, field, type)                        \
+    for (int __i = 0; __i < ARRAY_SIZE((hw)->hwmon.field); __i++) \
+        (hw)->hwmon.field[__i] = (type)(entry)->field[__i];
+
+static int __init parse_db_pci_stubs(const struct firmware *fw, const struct platform_db_entry *entry,
+                                     struct hw_config *hw)
+{
+    hw->pci_stubs = NULL;
+    hw->pci_stubs_num = 0;
+    if (entry->pci_stubs_num == 0)
+        return 0;
+
+    size_t offset = get_unaligned_le32(&entry->pci_stubs_offset);
+    if (unlikely(offset > fw->size ||
+                 entry->pci_stubs_num > (fw->size - offset) / sizeof(struct platform_db_pci_stub))) {
+        pr_loc_err("Platform DB entry PCI stubs are out of bounds (offset=%zu num=%u size=%zu)", offset,
+                   entry->pci_stubs_num, fw->size);
+        return -EINVAL;
+    }
+
+    kmalloc_or_exit_int(db_pci_stubs, sizeof(struct vpci_device_stub) * entry->pci_stubs_num, RP_MEM_CONFIG);
+    const struct platform_db_pci_stub *db_stub = (const struct platform_db_pci_stub *)(fw->data + offset);
+    for (int i = 0; i < entry->pci_stubs_num; i++, db_stub++) {
+        if (unlikely(db_stub->type == __VPD_TERMINATOR__ || db_stub->type > VPD_INTEL_CPU_SMBUS)) {
+            pr_loc_err("Platform DB entry has unknown PCI stub type %u", db_stub->type);
+            rp_kfree(db_pci_stubs, RP_MEM_CONFIG);
+            db_pci_stubs = NULL;
+            return -EINVAL;
+        }
+
+        db_pci_stubs[i].type = db_stub->type;
+        db_pci_stubs[i].bus = db_stub->bus;
+        db_pci_stubs[i].dev = db_stub->dev;
+        db_pci_stubs[i].fn = db_stub->fn;
+        db_pci_stubs[i].multifunction = (db_stub->flags & PLATFORM_DB_STUB_F_MULTIFUNCTION) != 0;
+    }
+
+    hw->pci_stubs = db_pci_stubs;
+    hw->pci_stubs_num = entry->pci_stubs_num;
+
+    return 0;
+}
+
+static int __init parse_db_entry(const struct firmware *fw, const struct platform_db_entry *entry,
+                                 struct hw_config *hw)
+{
+    if (!validate_db_ids(entry, sys_thermal, HWMON_SYS_TZONE_ADT2_LOC_ID) ||
+        !validate_db_ids(entry, sys_voltage, HWMON_SYS_VSENS_ADT2_V33_ID) ||
+        !validate_db_ids(entry, sys_fan_speed_rpm, HWMON_SYS_FAN4_ID) ||
+        !validate_db_ids(entry, hdd_backplane, HWMON_SYS_HDD_BP_ENABLE_ID) ||
+        !validate_db_ids(entry, psu_status, HWMON_PSU_STATUS_ID) ||
+        !validate_db_ids(entry, sys_current, HWMON_SYS_CURR_ADC_ID))
+        return -EINVAL;
+
+    u32 flags = get_unaligned_le32(&entry->flags);
+    hw->emulate_rtc = (flags & PLATFORM_DB_F_EMULATE_RTC) != 0;
+    hw->swap_serial = (flags & PLATFORM_DB_F_SWAP_SERIAL) != 0;
+    hw->reinit_ttyS0 = (flags & PLATFORM_DB_F_REINIT_TTYS0) != 0;
+    hw->fix_disk_led_ctrl = (flags & PLATFORM_DB_F_FIX_DISK_LED_CTRL) != 0;
+    hw->has_cpu_temp = (flags & PLATFORM_DB_F_HAS_CPU_TEMP) != 0;
+    hw->is_dt = (flags & PLATFORM_DB_F_IS_DT) != 0;
+    hw->no_pmu = (flags & PLATFORM_DB_F_NO_PMU) != 0;
+
+    copy_db_ids(hw, entry, sys_thermal, enum hwmon_sys_thermal_zone_id);
+    copy_db_ids(hw, entry, sys_voltage, enum hwmon_sys_voltage_sensor_id);
+    copy_db_ids(hw, entry, sys_fan_speed_rpm, enum hwmon_sys_fan_rpm_id);
+    copy_db_ids(hw, entry, hdd_backplane, enum hwmon_sys_hdd_bp_id);
+    copy_db_ids(hw, entry, psu_status, enum hw_psu_sensor_id);
+    copy_db_ids(hw, entry, sys_current, enum hwmon_sys_current_id);
+
+    return parse_db_pci_stubs(fw, entry, hw);
+}
+
+static int __init find_db_entry(const struct firmware *fw, const char *model, struct hw_config *hw)
+{
+    const struct platform_db_header *hdr = (const struct platform_db_header *)fw->data;
+    if (unlikely(fw->size < sizeof(*hdr) || memcmp(hdr->magic, PLATFORM_DB_MAGIC, sizeof(hdr->magic)) != 0)) {
+        pr_loc_err("Platform DB is not a valid database (size=%zu)", fw->size);
+        return -EINVAL;
+    }
+
+    if (unlikely(get_unaligned_le16(&hdr->version) != PLATFORM_DB_VERSION || hdr->target_ver != RP_MODULE_TARGET_VER)) {
+        pr_loc_err("Platform DB version %u for v%u is not supported (expected %u for v%u)",
+                   get_unaligned_le16(&hdr->version), hdr->target_ver, PLATFORM_DB_VERSION, RP_MODULE_TARGET_VER);
+        return -EINVAL;
+    }
+
+    u32 entries_num = get_unaligned_le32(&hdr->entries_num);
+    if (unlikely(entries_num > (fw->size - sizeof(*hdr)) / sizeof(struct platform_db_entry))) {
+        pr_loc_err("Platform DB is truncated (entries=%u size=%zu)", entries_num, fw->size);
+        return -EINVAL;
+    }
+
+    const struct platform_db_entry *entry = bsearch(model, fw->data + sizeof(*hdr), entries_num,
+                                                    sizeof(struct platform_db_entry), compare_db_entry_name);
+    if (!entry) {
+        pr_loc_wrn("Platform \"%s\" not found in platform DB (entries=%u)", model, entries_num);
+        return -ENOENT;
+    }
+
+    int out = parse_db_entry(fw, entry, hw);
+    if (unlikely(out != 0))
+        return out;
+
+    hw->name = model;
+    return 0;
+}
+
+int __init load_platform_from_db(const char *db_name, const char *model, struct hw_config *hw)
+{
+    BUILD_BUG_ON(HWMON_SYS_THERMAL_ZONE_IDS != PLATFORM_DB_THERMAL_IDS);
+    BUILD_BUG_ON(HWMON_SYS_VOLTAGE_SENSOR_IDS != PLATFORM_DB_VOLTAGE_IDS);
+    BUILD_BUG_ON(HWMON_SYS_FAN_RPM_IDS != PLATFORM_DB_FAN_RPM_IDS);
+    BUILD_BUG_ON(HWMON_SYS_HDD_BP_IDS != PLATFORM_DB_HDD_BP_IDS);
+    BUILD_BUG_ON(HWMON_PSU_SENSOR_IDS > PLATFORM_DB_PSU_IDS);
+    BUILD_BUG_ON(HWMON_SYS_CURRENT_IDS != PLATFORM_DB_CURRENT_IDS);
+
+    pr_loc_dbg("Loading platform \"%s\" from platform DB \"%s\"", model, db_name);
+
+    struct platform_device *pdev = platform_device_register_simple(PLATFORM_DB_DEV_NAME, -1, NULL, 0);
+    if (IS_ERR(pdev)) {
+        pr_loc_err("Failed to register platform DB device - error=%ld", PTR_ERR(pdev));
+        return PTR_ERR(pdev);
+    }
+
+    const struct firmware *fw;
+    int out = request_firmware_direct(&fw, db_name, &pdev->dev);
+    if (out != 0) {
+        pr_loc_wrn("Failed to load platform DB \"%s\" - error=%d", db_name, out);
+        goto out_unregister;
+    }
+
+    out = find_db_entry(fw, model, hw);
+    if (out == 0)
+        pr_loc_inf("Loaded platform \"%s\" from platform DB \"%s\"", model, db_name);
+
+    release_firmware(fw);
+
+    out_unregister:
+    platform_device_unregister(pdev);
+    return out;
+}
+
+void platform_db_free(void)
+{
+    if (!db_pci_stubs)
+        return;
+
+    rp_kfree(db_pci_stubs, RP_MEM_CONFIG);
+    db_pci_stubs = NULL;
+}
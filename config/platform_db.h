@@ -0,0 +1,85 @@
+#ifndef REDPILL_PLATFORM_DB_H
+#define REDPILL_PLATFORM_DB_H
+
+#include <linux/types.h> //u8, __le16, __le32
+
+/**
+ * External platform database format
+ *
+ * The file is loaded with request_firmware_direct() (so it's looked up in e.g. /lib/firmware of the loader's
+ * initramfs) and consists of a header followed by entries_num of fixed-size entries sorted by name (as in strncmp()).
+ * PCI stubs of all entries are stored after the entries, at offsets specified by every entry. All numbers are
+ * little-endian and all enum values have the same meaning as in config/platform_types.h of the same
+ * RP_MODULE_TARGET_VER.
+ */
+#define PLATFORM_DB_MAGIC "RPDB"
+#define PLATFORM_DB_VERSION 1
+
+#define PLATFORM_DB_NAME_LEN 16
+#define PLATFORM_DB_THERMAL_IDS 5
+#define PLATFORM_DB_VOLTAGE_IDS 7
+#define PLATFORM_DB_FAN_RPM_IDS 4
+#define PLATFORM_DB_HDD_BP_IDS 2
+#define PLATFORM_DB_PSU_IDS 8
+#define PLATFORM_DB_CURRENT_IDS 1
+
+#define PLATFORM_DB_F_EMULATE_RTC       (1 << 0)
+#define PLATFORM_DB_F_SWAP_SERIAL       (1 << 1)
+#define PLATFORM_DB_F_REINIT_TTYS0      (1 << 2)
+#define PLATFORM_DB_F_FIX_DISK_LED_CTRL (1 << 3)
+#define PLATFORM_DB_F_HAS_CPU_TEMP      (1 << 4)
+#define PLATFORM_DB_F_IS_DT             (1 << 5)
+#define PLATFORM_DB_F_NO_PMU            (1 << 6)
+
+#define PLATFORM_DB_STUB_F_MULTIFUNCTION (1 << 0)
+
+struct platform_db_header {
+    char magic[4]; //PLATFORM_DB_MAGIC without the nullbyte
+    __le16 version; //PLATFORM_DB_VERSION
+    u8 target_ver; //RP_MODULE_TARGET_VER the DB was generated for (some hwmon enums differ between them)
+    u8 reserved;
+    __le32 entries_num;
+} __packed;
+
+struct platform_db_pci_stub {
+    u8 type; //enum pci_shim_device_type
+    u8 bus;
+    u8 dev;
+    u8 fn;
+    u8 flags; //PLATFORM_DB_STUB_F_*
+} __packed;
+
+struct platform_db_entry {
+    char name[PLATFORM_DB_NAME_LEN]; //nullbyte-padded
+    __le32 flags; //PLATFORM_DB_F_*
+    u8 sys_thermal[PLATFORM_DB_THERMAL_IDS];
+    u8 sys_voltage[PLATFORM_DB_VOLTAGE_IDS];
+    u8 sys_fan_speed_rpm[PLATFORM_DB_FAN_RPM_IDS];
+    u8 hdd_backplane[PLATFORM_DB_HDD_BP_IDS];
+    u8 psu_status[PLATFORM_DB_PSU_IDS];
+    u8 sys_current[PLATFORM_DB_CURRENT_IDS];
+    u8 pci_stubs_num;
+    __le32 pci_stubs_offset; //from the beginning of the file
+} __packed;
+
+struct hw_config;
+
+/**
+ * Loads definition of a single platform from an external platform database
+ *
+ * Only the entry of the requested platform is parsed; the database is released before returning. On success the
+ * hw->name points to model passed (so it must outlive hw) and PCI stubs are allocated (see platform_db_free()).
+ *
+ * @param db_name name of the file to load via request_firmware_direct()
+ * @param model platform name to look for
+ * @param hw platform definition to populate
+ * @return 0 on success, -ENOENT if the platform is not in the database, -E on other errors
+ */
+int load_platform_from_db(const char *db_name, const char *model, struct hw_config *hw);
+
+/**
+ * Frees resources allocated by load_platform_from_db() (it's a noop if nothing was loaded)
+ */
+void platform_db_free(void);
+
+#endif //REDPILL_PLATFORM_DB_H
@@ -1,7 +1,7 @@
 #ifndef REDPILL_PLATFORM_TYPES_H
 #define REDPILL_PLATFORM_TYPES_H
 
-#include "vpci_types.h" //vpci_device_stub, MAX_VPCI_DEVS
+#include "vpci_types.h" //vpci_device_stub, VPCI_STUBS
 
 #ifndef RP_MODULE_TARGET_VER
 #error "The RP_MODULE_TARGET_VER is not defined - it is required to properly set VTKs"
@@ -85,16 +85,18 @@ enum hwmon_sys_current_id {
 };
 #define HWMON_SYS_CURRENT_IDS 1 //number of current sensors minus the fake NULL_ID
 
+//Platforms are defined in platforms.h; the one selected is copied (see populate_hw_config()) so members aren't const
 struct hw_config {
     const char *name; //the longest so far is "RR36015xs+++" (12+1)
 
-    const struct vpci_device_stub pci_stubs[MAX_VPCI_DEVS];
+    const struct vpci_device_stub *pci_stubs; //set with VPCI_STUBS() or VPCI_NO_STUBS
+    unsigned int pci_stubs_num;
 
     //All custom flags
-    const bool emulate_rtc:1;
-    const bool swap_serial:1; //Whether ttyS0 and ttyS1 are swapped (reverses CONFIG_SYNO_X86_SERIAL_PORT_SWAP)
-    const bool reinit_ttyS0:1; //Should the ttyS0 be forcefully re-initialized after module loads
-    const bool fix_disk_led_ctrl:1; //Disabled libata-scsi bespoke disk led control (which often crashes some v4 platforms)
+    bool emulate_rtc:1;
+    bool swap_serial:1; //Whether ttyS0 and ttyS1 are swapped (reverses CONFIG_SYNO_X86_SERIAL_PORT_SWAP)
+    bool reinit_ttyS0:1; //Should the ttyS0 be forcefully re-initialized after module loads
+    bool fix_disk_led_ctrl:1; //Disabled libata-scsi bespoke disk led control (which often crashes some v4 platforms)
 
     //See SYNO_HWMON_SUPPORT_ID in include/linux/synobios.h GPLed sources - it defines which ones are possible
     //These define which parts of ACPI HWMON should be emulated
@@ -103,10 +105,11 @@ struct hw_config {
     //Supported hwmon sensors; order of sensors within type IS IMPORTANT to be accurate with a real hardware. The number
     // of sensors is derived from the enums defining their types. Internally the absolute maximum number is determined
     // by MAX_SENSOR_NUM defined in include/linux/synobios.h
-    const bool has_cpu_temp:1; //GetHwCapability(id = CAPABILITY_CPU_TEMP)
+    bool has_cpu_temp:1; //GetHwCapability(id = CAPABILITY_CPU_TEMP)
     // Device-tree models
-    const bool is_dt:1;
-    const struct hw_config_hwmon {
+    bool is_dt:1;
+    bool no_pmu:1; //Platform doesn't talk to a PMU over ttyS1 so there's no need to emulate it
+    struct hw_config_hwmon {
         enum hwmon_sys_thermal_zone_id sys_thermal[HWMON_SYS_THERMAL_ZONE_IDS]; //GetHwCapability(id = CAPABILITY_THERMAL)
         enum hwmon_sys_voltage_sensor_id sys_voltage[HWMON_SYS_VOLTAGE_SENSOR_IDS];
         enum hwmon_sys_fan_rpm_id sys_fan_speed_rpm[HWMON_SYS_FAN_RPM_IDS]; //GetHwCapability(id = CAPABILITY_FAN_RPM_RPT)
@@ -116,11 +119,35 @@ struct hw_config {
     } hwmon;
 };
 
-#define platform_has_hwmon_thermal(hw_config_ptr) ((hw_config_ptr)->hwmon.sys_thermal[0] != HWMON_SYS_TZONE_NULL_ID)
-#define platform_has_hwmon_voltage(hw_config_ptr) ((hw_config_ptr)->hwmon.sys_voltage[0] != HWMON_SYS_VSENS_NULL_ID)
-#define platform_has_hwmon_fan_rpm(hw_config_ptr) ((hw_config_ptr)->hwmon.sys_fan_speed_rpm[0] != HWMON_SYS_FAN_NULL_ID)
-#define platform_has_hwmon_hdd_bpl(hw_config_ptr) ((hw_config_ptr)->hwmon.hdd_backplane[0] != HWMON_SYS_HDD_BP_NULL_ID)
-#define platform_has_hwmon_psu_status(hw_config_ptr) ((hw_config_ptr)->hwmon.psu_status[0] != HWMON_PSU_NULL_ID)
-#define platform_has_hwmon_current_sens(hw_config_ptr) ((hw_config_ptr)->hwmon.sys_current[0] != HWMON_SYS_CURR_NULL_ID)
+/**
+ * Reads a property of the platform
+ *
+ * Shims should use it instead of accessing struct hw_config directly. Normally it's just a plain member access. When
+ * the module is built for a single platform (make PLATFORM=<model> ...) it reads the compiled-in definition instead, so
+ * that all checks are folded at compile time and shims/branches the platform doesn't use are dropped.
+ */
+#ifdef RP_PLATFORM
+#define rp_fixed_platform (supported_platforms[0]) //see platforms.h
+#define hw_cfg(hw_config_ptr, field) ((void)(hw_config_ptr), rp_fixed_platform.field)
+#else
+#define hw_cfg(hw_config_ptr, field) ((hw_config_ptr)->field)
+#endif
+
+#define platform_has_hwmon_thermal(hw_config_ptr) \
+    (hw_cfg(hw_config_ptr, hwmon.sys_thermal[0]) != HWMON_SYS_TZONE_NULL_ID)
+#define platform_has_hwmon_voltage(hw_config_ptr) \
+    (hw_cfg(hw_config_ptr, hwmon.sys_voltage[0]) != HWMON_SYS_VSENS_NULL_ID)
+#define platform_has_hwmon_fan_rpm(hw_config_ptr) \
+    (hw_cfg(hw_config_ptr, hwmon.sys_fan_speed_rpm[0]) != HWMON_SYS_FAN_NULL_ID)
+#define platform_has_hwmon_hdd_bpl(hw_config_ptr) \
+    (hw_cfg(hw_config_ptr, hwmon.hdd_backplane[0]) != HWMON_SYS_HDD_BP_NULL_ID)
+#define platform_has_hwmon_psu_status(hw_config_ptr) \
+    (hw_cfg(hw_config_ptr, hwmon.psu_status[0]) != HWMON_PSU_NULL_ID)
+#define platform_has_hwmon_current_sens(hw_config_ptr) \
+    (hw_cfg(hw_config_ptr, hwmon.sys_current[0]) != HWMON_SYS_CURR_NULL_ID)
+
+#ifdef RP_PLATFORM
+#include "platforms.h" //rp_fixed_platform; it must be included after everything above is defined
+#endif
 
 #endif //REDPILL_PLATFORM_TYPES_H
@@ -1,36 +1,33 @@
 /*
  * DO NOT include this file anywhere besides runtime_config.c - its format is meant to be internal to the configuration
- * parsing.
+ * parsing. The only exception is platform_types.h in single-platform builds (see RP_PLATFORM below).
  */
 #ifndef REDPILLLKM_PLATFORMS_H
 #define REDPILLLKM_PLATFORMS_H
 
 #include "../shim/pci_shim.h"
 #include "platform_types.h"
-const struct hw_config supported_platforms[] = {
-    {
-        .name = "DS916+",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
-        .emulate_rtc = true,
-        .swap_serial = false,
-        .reinit_ttyS0 = true,
-        .fix_disk_led_ctrl = true,
-        .has_cpu_temp = true,
-        .is_dt = false,
-        .hwmon = {
-            .sys_thermal = { HWMON_SYS_TZONE_NULL_ID },
-            .sys_voltage = { HWMON_SYS_VSENS_NULL_ID },
-            .sys_fan_speed_rpm = { HWMON_SYS_FAN_NULL_ID },
-            .hdd_backplane = { HWMON_SYS_HDD_BP_DETECT_ID, HWMON_SYS_HDD_BP_ENABLE_ID },
-            .psu_status = { HWMON_PSU_NULL_ID },
-            .sys_current = { HWMON_SYS_CURR_NULL_ID },
-        }
-    },
+#include <linux/init.h> //__initconst
+#include <linux/compiler.h> //__maybe_unused
+
+//When built for a single platform (make PLATFORM=<model> ...) only its entry is compiled in and the table is included
+// in every unit via platform_types.h, so that hw_cfg() reads are folded by the compiler (see rp_fixed_platform). The
+// model is selected by RP_PLATFORM_ID_<model with "+" replaced by "P"> defined by the Makefile.
+#ifdef RP_PLATFORM
+#define RP_PLATFORM_ALL 0
+#define RP_PLATFORMS_STORAGE __maybe_unused //only referenced through hw_cfg(), unused copies are dropped
+#else
+#define RP_PLATFORM_ALL 1
+#define RP_PLATFORMS_STORAGE __initconst
+#endif
+
+//This table MUST be kept sorted by name (as in strcmp()) - see find_platform() in runtime_config.c
+//It's only used during init (to find the selected platform which is then copied) and freed afterwards
+static const struct hw_config supported_platforms[] RP_PLATFORMS_STORAGE = {
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS1019P)
     {
-        .name = "DS918+",
-        .pci_stubs = {
+        .name = "DS1019+",
+        VPCI_STUBS(
             { .type = VPD_MARVELL_88SE9215,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
             { .type = VPD_INTEL_I211,          .bus = 0x02, .dev = 0x00, .fn = 0x00, .multifunction = false },
             { .type = VPD_INTEL_I211,          .bus = 0x03, .dev = 0x00, .fn = 0x00, .multifunction = false },
@@ -44,8 +41,7 @@ const struct hw_config supported_platforms[] = {
             { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x00, .multifunction = true },
             { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x01, .multifunction = true },
             { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x00, .multifunction = true },
-            { .type = __VPD_TERMINATOR__ }
-        },
+        ),
         .emulate_rtc = true,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -61,30 +57,19 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS1520P)
     {
-        .name = "DS1019+",
-        .pci_stubs = {
-            { .type = VPD_MARVELL_88SE9215,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = VPD_INTEL_I211,          .bus = 0x02, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = VPD_INTEL_I211,          .bus = 0x03, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = VPD_INTEL_CPU_AHCI_CTRL, .bus = 0x00, .dev = 0x12, .fn = 0x00, .multifunction = false },
-            { .type = VPD_INTEL_CPU_PCIE_PA,   .bus = 0x00, .dev = 0x13, .fn = 0x00, .multifunction = false },
-            { .type = VPD_INTEL_CPU_PCIE_PB,   .bus = 0x00, .dev = 0x14, .fn = 0x00, .multifunction = false },
-            { .type = VPD_INTEL_CPU_USB_XHCI,  .bus = 0x00, .dev = 0x15, .fn = 0x00, .multifunction = false },
-            { .type = VPD_INTEL_CPU_I2C,       .bus = 0x00, .dev = 0x16, .fn = 0x00, .multifunction = false },
-            { .type = VPD_INTEL_CPU_HSUART,    .bus = 0x00, .dev = 0x18, .fn = 0x00, .multifunction = false },
-            { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x02, .multifunction = true },
-            { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x00, .multifunction = true },
-            { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x01, .multifunction = true },
-            { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x00, .multifunction = true },
-            { .type = __VPD_TERMINATOR__ }
-        },
+        .name = "DS1520+",
+        VPCI_STUBS(
+            { .type = VPD_MARVELL_88SE9235, .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
+        ),
         .emulate_rtc = true,
         .swap_serial = false,
         .reinit_ttyS0 = true,
         .fix_disk_led_ctrl = true,
         .has_cpu_temp = true,
-        .is_dt = false,
+        .is_dt = true,
         .hwmon = {
             .sys_thermal = { HWMON_SYS_TZONE_NULL_ID },
             .sys_voltage = { HWMON_SYS_VSENS_NULL_ID },
@@ -94,38 +79,41 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS1621P)
     {
-        .name = "DS920+",
-        .pci_stubs = {
-            { .type = VPD_MARVELL_88SE9235,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
-        .emulate_rtc = true,
+        .name = "DS1621+",
+        VPCI_NO_STUBS,
+        .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
         .fix_disk_led_ctrl = true,
         .has_cpu_temp = true,
         .is_dt = true,
         .hwmon = {
-            .sys_thermal = { HWMON_SYS_TZONE_NULL_ID },
-            .sys_voltage = { HWMON_SYS_VSENS_NULL_ID },
-            .sys_fan_speed_rpm = { HWMON_SYS_FAN_NULL_ID },
-            .hdd_backplane = { HWMON_SYS_HDD_BP_DETECT_ID, HWMON_SYS_HDD_BP_ENABLE_ID },
+            .sys_thermal = { HWMON_SYS_TZONE_REMOTE1_ID, HWMON_SYS_TZONE_LOCAL_ID, HWMON_SYS_TZONE_REMOTE2_ID },
+            .sys_voltage = { HWMON_SYS_VSENS_VCC_ID, HWMON_SYS_VSENS_VPP_ID, HWMON_SYS_VSENS_V33_ID,
+                             HWMON_SYS_VSENS_V5_ID, HWMON_SYS_VSENS_V12_ID },
+            .sys_fan_speed_rpm = { HWMON_SYS_FAN1_ID, HWMON_SYS_FAN2_ID },
+            .hdd_backplane = { HWMON_SYS_HDD_BP_NULL_ID },
             .psu_status = { HWMON_PSU_NULL_ID },
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS1621xsP)
     {
-        .name = "DS923+",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        .name = "DS1621xs+",
+        VPCI_STUBS(
+            { .type = VPD_MARVELL_88SE9235, .bus = 0x09, .dev = 0x00, .fn = 0x00, .multifunction = false },
+            { .type = VPD_MARVELL_88SE9235, .bus = 0x0c, .dev = 0x00, .fn = 0x00, .multifunction = false },
+        ),
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
         .fix_disk_led_ctrl = true,
         .has_cpu_temp = true,
-        .is_dt = true,
+        .is_dt = false,
         .hwmon = {
             .sys_thermal = { HWMON_SYS_TZONE_REMOTE1_ID, HWMON_SYS_TZONE_LOCAL_ID, HWMON_SYS_TZONE_REMOTE2_ID },
             .sys_voltage = { HWMON_SYS_VSENS_VCC_ID, HWMON_SYS_VSENS_VPP_ID, HWMON_SYS_VSENS_V33_ID,
@@ -136,80 +124,89 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS1823xsP)
     {
-        .name = "DS720+",
-        .pci_stubs = {
-            { .type = VPD_MARVELL_88SE9235,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
-        .emulate_rtc = true,
+        .name = "DS1823xs+",
+        VPCI_NO_STUBS,
+        .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
         .fix_disk_led_ctrl = true,
         .has_cpu_temp = true,
         .is_dt = true,
         .hwmon = {
-            .sys_thermal = { HWMON_SYS_TZONE_NULL_ID },
-            .sys_voltage = { HWMON_SYS_VSENS_NULL_ID },
-            .sys_fan_speed_rpm = { HWMON_SYS_FAN_NULL_ID },
-            .hdd_backplane = { HWMON_SYS_HDD_BP_DETECT_ID, HWMON_SYS_HDD_BP_ENABLE_ID },
+            .sys_thermal = { HWMON_SYS_TZONE_REMOTE1_ID, HWMON_SYS_TZONE_LOCAL_ID, HWMON_SYS_TZONE_REMOTE2_ID },
+            .sys_voltage = { HWMON_SYS_VSENS_VCC_ID, HWMON_SYS_VSENS_VPP_ID, HWMON_SYS_VSENS_V33_ID,
+                             HWMON_SYS_VSENS_V5_ID, HWMON_SYS_VSENS_V12_ID },
+            .sys_fan_speed_rpm = { HWMON_SYS_FAN1_ID, HWMON_SYS_FAN2_ID },
+            .hdd_backplane = { HWMON_SYS_HDD_BP_NULL_ID },
             .psu_status = { HWMON_PSU_NULL_ID },
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS2422P)
     {
-        .name = "DS723+",
-        .pci_stubs = {
-            { .type = VPD_MARVELL_88SE9235,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
-        .emulate_rtc = true,
+        .name = "DS2422+",
+        VPCI_NO_STUBS,
+        .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
         .fix_disk_led_ctrl = true,
         .has_cpu_temp = true,
         .is_dt = true,
         .hwmon = {
-            .sys_thermal = { HWMON_SYS_TZONE_NULL_ID },
-            .sys_voltage = { HWMON_SYS_VSENS_NULL_ID },
-            .sys_fan_speed_rpm = { HWMON_SYS_FAN_NULL_ID },
-            .hdd_backplane = { HWMON_SYS_HDD_BP_DETECT_ID, HWMON_SYS_HDD_BP_ENABLE_ID },
+            .sys_thermal = { HWMON_SYS_TZONE_REMOTE1_ID, HWMON_SYS_TZONE_LOCAL_ID, HWMON_SYS_TZONE_REMOTE2_ID },
+            .sys_voltage = { HWMON_SYS_VSENS_VCC_ID, HWMON_SYS_VSENS_VPP_ID, HWMON_SYS_VSENS_V33_ID,
+                             HWMON_SYS_VSENS_V5_ID, HWMON_SYS_VSENS_V12_ID },
+            .sys_fan_speed_rpm = { HWMON_SYS_FAN1_ID, HWMON_SYS_FAN2_ID },
+            .hdd_backplane = { HWMON_SYS_HDD_BP_NULL_ID },
             .psu_status = { HWMON_PSU_NULL_ID },
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS3615xs)
     {
-        .name = "DS1520+",
-        .pci_stubs = {
-            { .type = VPD_MARVELL_88SE9235, .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
-        .emulate_rtc = true,
-        .swap_serial = false,
-        .reinit_ttyS0 = true,
-        .fix_disk_led_ctrl = true,
+        .name = "DS3615xs",
+        VPCI_STUBS(
+            { .type = VPD_MARVELL_88SE9235, .bus = 0x07, .dev = 0x00, .fn = 0x00, .multifunction = false },
+            { .type = VPD_MARVELL_88SE9235, .bus = 0x08, .dev = 0x00, .fn = 0x00, .multifunction = false },
+            { .type = VPD_MARVELL_88SE9235, .bus = 0x09, .dev = 0x00, .fn = 0x00, .multifunction = false },
+            { .type = VPD_MARVELL_88SE9235, .bus = 0x0a, .dev = 0x00, .fn = 0x00, .multifunction = false },
+        ),
+        .emulate_rtc = false,
+        .swap_serial = true,
+        .reinit_ttyS0 = false,
+        .fix_disk_led_ctrl = false,
         .has_cpu_temp = true,
-        .is_dt = true,
+        .is_dt = false,
         .hwmon = {
-            .sys_thermal = { HWMON_SYS_TZONE_NULL_ID },
-            .sys_voltage = { HWMON_SYS_VSENS_NULL_ID },
-            .sys_fan_speed_rpm = { HWMON_SYS_FAN_NULL_ID },
-            .hdd_backplane = { HWMON_SYS_HDD_BP_DETECT_ID, HWMON_SYS_HDD_BP_ENABLE_ID },
+            .sys_thermal = { HWMON_SYS_TZONE_REMOTE1_ID, HWMON_SYS_TZONE_LOCAL_ID, HWMON_SYS_TZONE_REMOTE2_ID },
+            .sys_voltage = { HWMON_SYS_VSENS_VCC_ID, HWMON_SYS_VSENS_VPP_ID, HWMON_SYS_VSENS_V33_ID,
+                             HWMON_SYS_VSENS_V5_ID, HWMON_SYS_VSENS_V12_ID },
+            .sys_fan_speed_rpm = { HWMON_SYS_FAN1_ID, HWMON_SYS_FAN2_ID },
+            .hdd_backplane = { HWMON_SYS_HDD_BP_NULL_ID },
             .psu_status = { HWMON_PSU_NULL_ID },
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS3617xs)
     {
-        .name = "DS1621+",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        .name = "DS3617xs",
+        VPCI_STUBS(
+            { .type = VPD_MARVELL_88SE9215, .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
+            { .type = VPD_MARVELL_88SE9215, .bus = 0x02, .dev = 0x00, .fn = 0x00, .multifunction = false },
+            { .type = VPD_MARVELL_88SE9235, .bus = 0x08, .dev = 0x00, .fn = 0x00, .multifunction = false },
+        ),
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
-        .fix_disk_led_ctrl = true,
+        .fix_disk_led_ctrl = false,
         .has_cpu_temp = true,
-        .is_dt = true,
+        .is_dt = false,
         .hwmon = {
             .sys_thermal = { HWMON_SYS_TZONE_REMOTE1_ID, HWMON_SYS_TZONE_LOCAL_ID, HWMON_SYS_TZONE_REMOTE2_ID },
             .sys_voltage = { HWMON_SYS_VSENS_VCC_ID, HWMON_SYS_VSENS_VPP_ID, HWMON_SYS_VSENS_V33_ID,
@@ -220,13 +217,14 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS3622xsP)
     {
-        .name = "DS1621xs+",
-        .pci_stubs = {
+        .name = "DS3622xs+",
+        VPCI_STUBS(
             { .type = VPD_MARVELL_88SE9235, .bus = 0x09, .dev = 0x00, .fn = 0x00, .multifunction = false },
             { .type = VPD_MARVELL_88SE9235, .bus = 0x0c, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
+        ),
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -243,110 +241,137 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS720P)
     {
-        .name = "DS2422+",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
-        .emulate_rtc = false,
+        .name = "DS720+",
+        VPCI_STUBS(
+            { .type = VPD_MARVELL_88SE9235,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
+        ),
+        .emulate_rtc = true,
         .swap_serial = false,
         .reinit_ttyS0 = true,
         .fix_disk_led_ctrl = true,
         .has_cpu_temp = true,
         .is_dt = true,
         .hwmon = {
-            .sys_thermal = { HWMON_SYS_TZONE_REMOTE1_ID, HWMON_SYS_TZONE_LOCAL_ID, HWMON_SYS_TZONE_REMOTE2_ID },
-            .sys_voltage = { HWMON_SYS_VSENS_VCC_ID, HWMON_SYS_VSENS_VPP_ID, HWMON_SYS_VSENS_V33_ID,
-                             HWMON_SYS_VSENS_V5_ID, HWMON_SYS_VSENS_V12_ID },
-            .sys_fan_speed_rpm = { HWMON_SYS_FAN1_ID, HWMON_SYS_FAN2_ID },
-            .hdd_backplane = { HWMON_SYS_HDD_BP_NULL_ID },
+            .sys_thermal = { HWMON_SYS_TZONE_NULL_ID },
+            .sys_voltage = { HWMON_SYS_VSENS_NULL_ID },
+            .sys_fan_speed_rpm = { HWMON_SYS_FAN_NULL_ID },
+            .hdd_backplane = { HWMON_SYS_HDD_BP_DETECT_ID, HWMON_SYS_HDD_BP_ENABLE_ID },
             .psu_status = { HWMON_PSU_NULL_ID },
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS723P)
     {
-        .name = "DS1823xs+",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
-        .emulate_rtc = false,
+        .name = "DS723+",
+        VPCI_STUBS(
+            { .type = VPD_MARVELL_88SE9235,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
+        ),
+        .emulate_rtc = true,
         .swap_serial = false,
         .reinit_ttyS0 = true,
         .fix_disk_led_ctrl = true,
         .has_cpu_temp = true,
         .is_dt = true,
         .hwmon = {
-            .sys_thermal = { HWMON_SYS_TZONE_REMOTE1_ID, HWMON_SYS_TZONE_LOCAL_ID, HWMON_SYS_TZONE_REMOTE2_ID },
-            .sys_voltage = { HWMON_SYS_VSENS_VCC_ID, HWMON_SYS_VSENS_VPP_ID, HWMON_SYS_VSENS_V33_ID,
-                             HWMON_SYS_VSENS_V5_ID, HWMON_SYS_VSENS_V12_ID },
-            .sys_fan_speed_rpm = { HWMON_SYS_FAN1_ID, HWMON_SYS_FAN2_ID },
-            .hdd_backplane = { HWMON_SYS_HDD_BP_NULL_ID },
+            .sys_thermal = { HWMON_SYS_TZONE_NULL_ID },
+            .sys_voltage = { HWMON_SYS_VSENS_NULL_ID },
+            .sys_fan_speed_rpm = { HWMON_SYS_FAN_NULL_ID },
+            .hdd_backplane = { HWMON_SYS_HDD_BP_DETECT_ID, HWMON_SYS_HDD_BP_ENABLE_ID },
             .psu_status = { HWMON_PSU_NULL_ID },
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS916P)
     {
-        .name = "DS3615xs",
-        .pci_stubs = {
-            { .type = VPD_MARVELL_88SE9235, .bus = 0x07, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = VPD_MARVELL_88SE9235, .bus = 0x08, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = VPD_MARVELL_88SE9235, .bus = 0x09, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = VPD_MARVELL_88SE9235, .bus = 0x0a, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
-        .emulate_rtc = false,
-        .swap_serial = true,
-        .reinit_ttyS0 = false,
-        .fix_disk_led_ctrl = false,
+        .name = "DS916+",
+        VPCI_NO_STUBS,
+        .emulate_rtc = true,
+        .swap_serial = false,
+        .reinit_ttyS0 = true,
+        .fix_disk_led_ctrl = true,
         .has_cpu_temp = true,
         .is_dt = false,
         .hwmon = {
-            .sys_thermal = { HWMON_SYS_TZONE_REMOTE1_ID, HWMON_SYS_TZONE_LOCAL_ID, HWMON_SYS_TZONE_REMOTE2_ID },
-            .sys_voltage = { HWMON_SYS_VSENS_VCC_ID, HWMON_SYS_VSENS_VPP_ID, HWMON_SYS_VSENS_V33_ID,
-                             HWMON_SYS_VSENS_V5_ID, HWMON_SYS_VSENS_V12_ID },
-            .sys_fan_speed_rpm = { HWMON_SYS_FAN1_ID, HWMON_SYS_FAN2_ID },
-            .hdd_backplane = { HWMON_SYS_HDD_BP_NULL_ID },
+            .sys_thermal = { HWMON_SYS_TZONE_NULL_ID },
+            .sys_voltage = { HWMON_SYS_VSENS_NULL_ID },
+            .sys_fan_speed_rpm = { HWMON_SYS_FAN_NULL_ID },
+            .hdd_backplane = { HWMON_SYS_HDD_BP_DETECT_ID, HWMON_SYS_HDD_BP_ENABLE_ID },
             .psu_status = { HWMON_PSU_NULL_ID },
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS918P)
     {
-        .name = "DS3617xs",
-        .pci_stubs = {
-            { .type = VPD_MARVELL_88SE9215, .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = VPD_MARVELL_88SE9215, .bus = 0x02, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = VPD_MARVELL_88SE9235, .bus = 0x08, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
-        .emulate_rtc = false,
+        .name = "DS918+",
+        VPCI_STUBS(
+            { .type = VPD_MARVELL_88SE9215,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
+            { .type = VPD_INTEL_I211,          .bus = 0x02, .dev = 0x00, .fn = 0x00, .multifunction = false },
+            { .type = VPD_INTEL_I211,          .bus = 0x03, .dev = 0x00, .fn = 0x00, .multifunction = false },
+            { .type = VPD_INTEL_CPU_AHCI_CTRL, .bus = 0x00, .dev = 0x12, .fn = 0x00, .multifunction = false },
+            { .type = VPD_INTEL_CPU_PCIE_PA,   .bus = 0x00, .dev = 0x13, .fn = 0x00, .multifunction = false },
+            { .type = VPD_INTEL_CPU_PCIE_PB,   .bus = 0x00, .dev = 0x14, .fn = 0x00, .multifunction = false },
+            { .type = VPD_INTEL_CPU_USB_XHCI,  .bus = 0x00, .dev = 0x15, .fn = 0x00, .multifunction = false },
+            { .type = VPD_INTEL_CPU_I2C,       .bus = 0x00, .dev = 0x16, .fn = 0x00, .multifunction = false },
+            { .type = VPD_INTEL_CPU_HSUART,    .bus = 0x00, .dev = 0x18, .fn = 0x00, .multifunction = false },
+            { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x02, .multifunction = true },
+            { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x00, .multifunction = true },
+            { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x01, .multifunction = true },
+            { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x00, .multifunction = true },
+        ),
+        .emulate_rtc = true,
         .swap_serial = false,
         .reinit_ttyS0 = true,
-        .fix_disk_led_ctrl = false,
+        .fix_disk_led_ctrl = true,
         .has_cpu_temp = true,
         .is_dt = false,
         .hwmon = {
-            .sys_thermal = { HWMON_SYS_TZONE_REMOTE1_ID, HWMON_SYS_TZONE_LOCAL_ID, HWMON_SYS_TZONE_REMOTE2_ID },
-            .sys_voltage = { HWMON_SYS_VSENS_VCC_ID, HWMON_SYS_VSENS_VPP_ID, HWMON_SYS_VSENS_V33_ID,
-                             HWMON_SYS_VSENS_V5_ID, HWMON_SYS_VSENS_V12_ID },
-            .sys_fan_speed_rpm = { HWMON_SYS_FAN1_ID, HWMON_SYS_FAN2_ID },
-            .hdd_backplane = { HWMON_SYS_HDD_BP_NULL_ID },
+            .sys_thermal = { HWMON_SYS_TZONE_NULL_ID },
+            .sys_voltage = { HWMON_SYS_VSENS_NULL_ID },
+            .sys_fan_speed_rpm = { HWMON_SYS_FAN_NULL_ID },
+            .hdd_backplane = { HWMON_SYS_HDD_BP_DETECT_ID, HWMON_SYS_HDD_BP_ENABLE_ID },
             .psu_status = { HWMON_PSU_NULL_ID },
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS920P)
     {
-        .name = "DS3622xs+",
-        .pci_stubs = {
-            { .type = VPD_MARVELL_88SE9235, .bus = 0x09, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = VPD_MARVELL_88SE9235, .bus = 0x0c, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
+        .name = "DS920+",
+        VPCI_STUBS(
+            { .type = VPD_MARVELL_88SE9235,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
+        ),
+        .emulate_rtc = true,
+        .swap_serial = false,
+        .reinit_ttyS0 = true,
+        .fix_disk_led_ctrl = true,
+        .has_cpu_temp = true,
+        .is_dt = true,
+        .hwmon = {
+            .sys_thermal = { HWMON_SYS_TZONE_NULL_ID },
+            .sys_voltage = { HWMON_SYS_VSENS_NULL_ID },
+            .sys_fan_speed_rpm = { HWMON_SYS_FAN_NULL_ID },
+            .hdd_backplane = { HWMON_SYS_HDD_BP_DETECT_ID, HWMON_SYS_HDD_BP_ENABLE_ID },
+            .psu_status = { HWMON_PSU_NULL_ID },
+            .sys_current = { HWMON_SYS_CURR_NULL_ID },
+        }
+    },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DS923P)
+    {
+        .name = "DS923+",
+        VPCI_NO_STUBS,
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
         .fix_disk_led_ctrl = true,
         .has_cpu_temp = true,
-        .is_dt = false,
+        .is_dt = true,
         .hwmon = {
             .sys_thermal = { HWMON_SYS_TZONE_REMOTE1_ID, HWMON_SYS_TZONE_LOCAL_ID, HWMON_SYS_TZONE_REMOTE2_ID },
             .sys_voltage = { HWMON_SYS_VSENS_VCC_ID, HWMON_SYS_VSENS_VPP_ID, HWMON_SYS_VSENS_V33_ID,
@@ -357,12 +382,13 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DVA1622)
     {
         .name = "DVA1622",
-        .pci_stubs = {
+        VPCI_STUBS(
             { .type = VPD_MARVELL_88SE9235,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
+        ),
         .emulate_rtc = true,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -378,11 +404,11 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
-	{
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DVA3219)
+    {
         .name = "DVA3219",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        VPCI_NO_STUBS,
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -399,11 +425,11 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_DVA3221)
     {
         .name = "DVA3221",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        VPCI_NO_STUBS,
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -420,11 +446,11 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_FS2500)
     {
         .name = "FS2500",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        VPCI_NO_STUBS,
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -441,12 +467,13 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_FS6400)
     {
         .name = "FS6400",
-        .pci_stubs = {
+        VPCI_STUBS(
             { .type = VPD_INTEL_CPU_I2C,    .bus = 0x00, .dev = 0x16, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
+        ),
         .emulate_rtc = false,
         .swap_serial = true,
         .reinit_ttyS0 = true,
@@ -463,11 +490,11 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_RS1221P)
     {
         .name = "RS1221+",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        VPCI_NO_STUBS,
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -484,11 +511,11 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_RS1619xsP)
     {
         .name = "RS1619xs+",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        VPCI_NO_STUBS,
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -505,15 +532,16 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_RS3413xsP)
     {
         .name = "RS3413xs+",
-        .pci_stubs = {
+        VPCI_STUBS(
             { .type = VPD_MARVELL_88SE9235, .bus = 0x07, .dev = 0x00, .fn = 0x00, .multifunction = false },
             { .type = VPD_MARVELL_88SE9235, .bus = 0x08, .dev = 0x00, .fn = 0x00, .multifunction = false },
             { .type = VPD_MARVELL_88SE9235, .bus = 0x09, .dev = 0x00, .fn = 0x00, .multifunction = false },
             { .type = VPD_MARVELL_88SE9235, .bus = 0x0a, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
+        ),
         .emulate_rtc = false,
         .swap_serial = true,
         .reinit_ttyS0 = false,
@@ -530,14 +558,15 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_RS3618xs)
     {
         .name = "RS3618xs",
-        .pci_stubs = {
+        VPCI_STUBS(
             { .type = VPD_MARVELL_88SE9215, .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
             { .type = VPD_MARVELL_88SE9215, .bus = 0x02, .dev = 0x00, .fn = 0x00, .multifunction = false },
             { .type = VPD_MARVELL_88SE9235, .bus = 0x08, .dev = 0x00, .fn = 0x00, .multifunction = false },
-            { .type = __VPD_TERMINATOR__ }
-        },
+        ),
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -554,11 +583,11 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_RS3621xsP)
     {
         .name = "RS3621xs+",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        VPCI_NO_STUBS,
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -575,11 +604,11 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_RS4021xsP)
     {
         .name = "RS4021xs+",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        VPCI_NO_STUBS,
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -596,11 +625,11 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_SA3400)
     {
         .name = "SA3400",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        VPCI_NO_STUBS,
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -617,11 +646,11 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_SA3600)
     {
         .name = "SA3600",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        VPCI_NO_STUBS,
         .emulate_rtc = false,
         .swap_serial = false,
         .reinit_ttyS0 = true,
@@ -638,11 +667,11 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if RP_PLATFORM_ALL || defined(RP_PLATFORM_ID_SA6400)
     {
         .name = "SA6400",
-        .pci_stubs = {
-            { .type = __VPD_TERMINATOR__ }
-        },
+        VPCI_NO_STUBS,
         .emulate_rtc = true,
         .swap_serial = false,
         .reinit_ttyS0 = false,
@@ -660,6 +689,7 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     }
+#endif
 };
 
 #endif //REDPILLLKM_PLATFORMS_H
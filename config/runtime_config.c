@@ -3,6 +3,10 @@
 #include "../common.h"
 #include "cmdline_delegate.h"
 #include "uart_defs.h"
+#include "platform_db.h" //load_platform_from_db()
+#include <linux/bsearch.h> //bsearch()
+#include <linux/sched.h> //SCHED_NORMAL
+#include "../internal/uart/virtual_uart.h" //VUART_VIRQ_CPU_ANY
 
 struct runtime_config current_config = {
     .hw = { '\0' },
@@ -16,12 +20,21 @@ struct runtime_config current_config = {
     },
     .port_thaw = true,
     .netif_num = 0,
+    .hwmon_pt_interval = 0,
+    .dbg_vtable = false,
+    .platform_db = { '\0' },
+    .vuart_net = { '\0' },
+    .smart_state = { '\0' },
+    .vuart_irq = {
+        .policy = SCHED_NORMAL,
+        .priority = 0,
+        .cpu = VUART_VIRQ_CPU_ANY,
+    },
     .macs = { '\0' },
-    .cmdline_blacklist = { '\0' },
     .hw_config = NULL,
 };
 
-static inline bool validate_sn(const serial_no *sn) {
+static inline bool __init validate_sn(const serial_no *sn) {
     if (*sn[0] == '\0') {
         pr_loc_err("Serial number is empty");
         return false;
@@ -32,7 +45,7 @@ static inline bool validate_sn(const serial_no *sn) {
     return true;
 }
 
-static __always_inline bool validate_boot_dev_usb(const struct boot_media *boot)
+static __always_inline bool __init validate_boot_dev_usb(const struct boot_media *boot)
 {
     if (boot->vid == VID_PID_EMPTY && boot->pid == VID_PID_EMPTY) {
         pr_loc_wrn("Empty/no \"%s\" and \"%s\" specified - first USB storage device will be used", CMDLINE_CT_VID,
@@ -50,7 +63,7 @@ static __always_inline bool validate_boot_dev_usb(const struct boot_media *boot)
     //not checking for >VID_PID_MAX as vid type is already ushort
 }
 
-static __always_inline bool validate_boot_dev_sata_dom(const struct boot_media *boot)
+static __always_inline bool __init validate_boot_dev_sata_dom(const struct boot_media *boot)
 {
 #ifndef NATIVE_SATA_DOM_SUPPORTED
     pr_loc_err("Kernel you are running a kernel was built without SATA DoM support, you cannot use %s%c. "
@@ -77,7 +90,7 @@ static __always_inline bool validate_boot_dev_sata_dom(const struct boot_media *
     return true;
 }
 
-static __always_inline bool validate_boot_dev_sata_disk(const struct boot_media *boot)
+static __always_inline bool __init validate_boot_dev_sata_disk(const struct boot_media *boot)
 {
 #ifdef NATIVE_SATA_DOM_SUPPORTED
     pr_loc_wrn("The kernel you are running supports native SATA DoM (%s%c). You're currently using an experimental "
@@ -95,7 +108,7 @@ static __always_inline bool validate_boot_dev_sata_disk(const struct boot_media
     return true;
 }
 
-static inline bool validate_boot_dev(const struct boot_media *boot)
+static inline bool __init validate_boot_dev(const struct boot_media *boot)
 {
     switch (boot->type) {
         case BOOT_MEDIA_USB:
@@ -112,7 +125,7 @@ static inline bool validate_boot_dev(const struct boot_media *boot)
     }
 }
 
-static inline bool validate_nets(const unsigned short if_num, mac_address * const macs[MAX_NET_IFACES])
+static inline bool __init validate_nets(const unsigned short if_num, mac_address * const macs[MAX_NET_IFACES])
 {
     size_t mac_len;
     unsigned short macs_num = 0;
@@ -155,7 +168,7 @@ static inline bool validate_nets(const unsigned short if_num, mac_address * cons
  * (but partially too) but the match between platform config chosen vs. kernel currently attempting to run that
  * platform.
  */
-static inline bool validate_platform_config(const struct hw_config *hw)
+static inline bool __init validate_platform_config(const struct hw_config *hw)
 {
 #ifdef UART_BUG_SWAPPED
     const bool kernel_serial_swapped = true;
@@ -172,7 +185,26 @@ static inline bool validate_platform_config(const struct hw_config *hw)
     return true;
 }
 
-static int populate_hw_config(struct runtime_config *config)
+static int __init compare_platform_name(const void *key, const void *elt)
+{
+    return strcmp(key, ((const struct hw_config *)elt)->name);
+}
+
+/**
+ * Finds platform definition by its name (supported_platforms are sorted by name)
+ *
+ * @return platform or NULL if not found
+ */
+static const struct hw_config __init *find_platform(const char *name)
+{
+    return bsearch(name, supported_platforms, ARRAY_SIZE(supported_platforms), sizeof(supported_platforms[0]),
+                   compare_platform_name);
+}
+
+//Copy of the selected platform; supported_platforms are freed after init
+static struct hw_config selected_platform;
+
+static int __init populate_hw_config(struct runtime_config *config)
 {
     //We cannot run with empty model or model which didn't match
     if (config->hw[0] == '\0') {
@@ -180,20 +212,40 @@ static int populate_hw_config(struct runtime_config *config)
         return -ENOENT;
     }
 
-    for (int i = 0; i < ARRAY_SIZE(supported_platforms); i++) {
-        if (strcmp(supported_platforms[i].name, (char *)config->hw) != 0)
-            continue;
+#ifdef RP_PLATFORM
+    //Shims use the compiled-in definition directly (see hw_cfg()) so no other model or definition can be used
+    BUILD_BUG_ON_MSG(ARRAY_SIZE(supported_platforms) != 1, "PLATFORM= doesn't match any of config/platforms.h");
+    if (strcmp((char *)config->hw, RP_PLATFORM) != 0) {
+        pr_loc_crt("This module was built for %s only but \"%s%s\" was set", RP_PLATFORM, CMDLINE_KT_HW, config->hw);
+        return -EINVAL;
+    }
 
-        pr_loc_dbg("Found platform definition for \"%s\"", config->hw);
-        config->hw_config = &supported_platforms[i];
-        return 0;
+    if (config->platform_db[0] != '\0')
+        pr_loc_wrn("This module was built for %s only - ignoring the platform DB", RP_PLATFORM);
+#else
+    if (config->platform_db[0] != '\0') {
+        if (load_platform_from_db(config->platform_db, (char *)config->hw, &selected_platform) == 0) {
+            config->hw_config = &selected_platform;
+            return 0;
+        }
+
+        pr_loc_wrn("Platform DB unusable for \"%s\" - using built-in platforms definitions", config->hw);
     }
+#endif
 
-    pr_loc_crt("The model set using \"%s%s\" is not valid", CMDLINE_KT_HW, config->hw);
-    return -EINVAL;
+    const struct hw_config *platform = find_platform((char *)config->hw);
+    if (!platform) {
+        pr_loc_crt("The model set using \"%s%s\" is not valid", CMDLINE_KT_HW, config->hw);
+        return -EINVAL;
+    }
+
+    pr_loc_dbg("Found platform definition for \"%s\"", config->hw);
+    selected_platform = *platform;
+    config->hw_config = &selected_platform;
+    return 0;
 }
 
-static bool validate_runtime_config(const struct runtime_config *config)
+static bool __init validate_runtime_config(const struct runtime_config *config)
 {
     pr_loc_dbg("Validating runtime config...");
     bool valid = true;
@@ -212,7 +264,7 @@ static bool validate_runtime_config(const struct runtime_config *config)
     }
 }
 
-int populate_runtime_config(struct runtime_config *config)
+int __init populate_runtime_config(struct runtime_config *config)
 {
     int out = 0;
 
@@ -231,16 +283,11 @@ void free_runtime_config(struct runtime_config *config)
     for (int i = 0; i < MAX_NET_IFACES; i++) {
         if (config->macs[i]) {
             pr_loc_dbg("Free MAC%d @ %p", i, config->macs[i]);
-            kfree(config->macs[i]);
+            rp_kfree(config->macs[i], RP_MEM_CONFIG);
         }
     }
 
-    for (int i = 0; i < MAX_BLACKLISTED_CMDLINE_TOKENS; i++) {
-        if (config->cmdline_blacklist[i]) {
-            pr_loc_dbg("Free cmdline blacklist entry %d @ %p", i, config->cmdline_blacklist[i]);
-            kfree(config->cmdline_blacklist[i]);
-        }
-    }
+    platform_db_free();
 
     pr_loc_inf("Runtime config freed");
 }
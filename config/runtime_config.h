@@ -7,7 +7,6 @@
 //These below are currently known runtime limitations
 #define MAX_NET_IFACES 8
 #define MAC_ADDR_LEN 12
-#define MAX_BLACKLISTED_CMDLINE_TOKENS 10
 
 #ifdef CONFIG_SYNO_BOOT_SATA_DOM
 #define NATIVE_SATA_DOM_SUPPORTED //whether SCSI sd.c driver supports native SATA DOM
@@ -16,6 +15,10 @@
 //UART-related constants were moved to uart_defs.h, to allow subcomponents to importa a smaller subset than this header
 #define MODEL_MAX_LENGTH 10
 #define SN_MAX_LENGTH 13
+#define PLATFORM_DB_MAX_LENGTH 63
+#define VUART_NET_MAX_LENGTH 127
+#define SMART_STATE_PATH_MAX_LENGTH 127
+#define HWMON_PT_INTERVAL_MAX 3600 //s
 
 #define VID_PID_EMPTY 0x0000
 #define VID_PID_MAX   0xFFFF
@@ -24,7 +27,9 @@ typedef unsigned short device_id;
 typedef char syno_hw[MODEL_MAX_LENGTH + 1];
 typedef char mac_address[MAC_ADDR_LEN + 1];
 typedef char serial_no[SN_MAX_LENGTH + 1];
-typedef char cmdline_token[];
+typedef char platform_db_file[PLATFORM_DB_MAX_LENGTH + 1];
+typedef char vuart_net_target[VUART_NET_MAX_LENGTH + 1];
+typedef char smart_state_file[SMART_STATE_PATH_MAX_LENGTH + 1];
 
 enum boot_media_type {
     BOOT_MEDIA_USB,
@@ -44,6 +49,13 @@ struct boot_media {
     unsigned long dom_size_mib; //Max size of SATA DOM            Default: 1024 <valid, READ native_sata_boot_shim.c!!!>
 };
 
+//See vuart_set_virq_sched() for details of each field
+struct vuart_irq_sched {
+    int policy; //SCHED_NORMAL, SCHED_FIFO, or SCHED_RR           Default: SCHED_NORMAL <valid>
+    int priority; //RT priority or nice (for SCHED_NORMAL)        Default: 0 <valid>
+    int cpu; //CPU#, VUART_VIRQ_CPU_ANY or VUART_VIRQ_CPU_FOLLOW  Default: VUART_VIRQ_CPU_ANY <valid>
+};
+
 struct hw_config;
 struct runtime_config {
     syno_hw hw; //used to determine quirks.                                Default: empty <invalid>
@@ -51,8 +63,13 @@ struct runtime_config {
     struct boot_media boot_media;
     bool port_thaw; //Currently unknown.                                   Default: true  <valid>
     unsigned short netif_num; //Number of eth interfaces.                  Default: 0     <invalid>
+    unsigned int hwmon_pt_interval; //Real sensors refresh interval (s).   Default: 0 (fake sensors) <valid>
+    bool dbg_vtable; //Dump mfgBIOS vtable when shimming.                  Default: false <valid>
+    platform_db_file platform_db; //External platforms definitions file.   Default: empty (compiled-in) <valid>
+    vuart_net_target vuart_net; //vUART UDP sink (see debug_vuart_net.c).  Default: empty (disabled) <valid>
+    smart_state_file smart_state; //Emulated SMART state file (absolute).  Default: empty (not persisted) <valid>
+    struct vuart_irq_sched vuart_irq; //vIRQ dispatcher scheduling.        Default: see vuart_irq_sched <valid>
     mac_address *macs[MAX_NET_IFACES]; //MAC addresses of eth interfaces.  Default: []    <invalid>
-    cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS];//    Default: []
     const struct hw_config *hw_config;
 };
 extern struct runtime_config current_config;
@@ -3,10 +3,6 @@
 
 #include "../shim/pci_shim.h" //pci_shim_device_type
 
-//Defines below are experimentally determined to be sufficient but can often be changed
-#define MAX_VPCI_BUSES 8 //adjust if needed, max 256
-#define MAX_VPCI_DEVS 16 //adjust if needed, max 256*32=8192
-
 struct vpci_device_stub {
     enum pci_shim_device_type type;
     u8 bus;
@@ -15,4 +11,10 @@ struct vpci_device_stub {
     bool multifunction:1;
 };
 
+//Use these in platform definitions to set hw_config.pci_stubs and its length (the list can be of any length)
+#define VPCI_STUBS(...) \
+    .pci_stubs = (const struct vpci_device_stub[]) { __VA_ARGS__ }, \
+    .pci_stubs_num = sizeof((const struct vpci_device_stub[]) { __VA_ARGS__ }) / sizeof(struct vpci_device_stub)
+#define VPCI_NO_STUBS .pci_stubs = NULL, .pci_stubs_num = 0
+
 #endif //REDPILL_VPCI_LIMITS_H
@@ -0,0 +1,185 @@
+/**
+ * Timeline of driver registrations & driver watchers activity (enabled with DBG_DRIVER_PROFILE=y make option)
+ *
+ * Every driver_register() going through our shim, every driver bind seen by bus notifiers and every watcher callback is
+ * recorded with its start time (relative to the module load) & duration. The timeline, sorted by the start time, can be
+ * read from /sys/kernel/debug/redpill_driver_profile. It's meant to tune the boot ordering (e.g. how long vUART ports
+ * wait for serial8250 or how long SCSI notifier waits for sd).
+ *
+ * Recording is lockless: a slot is reserved with a single atomic increment and marked as valid once it's filled. Only
+ * the first DPROF_MAX_EVENTS events are kept - this is a boot-time tool.
+ */
+#include "debug_driver_profile.h"
+#include "../common.h"
+#include <linux/atomic.h> //atomic_t, atomic_inc_return()
+#include <linux/vmalloc.h> //vzalloc(), vmalloc(), vfree()
+#include <linux/sort.h> //sort()
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+
+#define DPROF_MAX_EVENTS 2048
+#define DPROF_NAME_LEN 32
+#define DPROF_DEBUGFS_NAME "redpill_driver_profile"
+
+struct dprof_event {
+    bool valid;
+    dprof_event_type type;
+    int state;
+    int result;
+    u64 start_ns;
+    u64 end_ns;
+    const void *cb;
+    char drv_name[DPROF_NAME_LEN];
+};
+
+static struct dprof_event *events = NULL;
+static atomic_t events_next = ATOMIC_INIT(0);
+static u64 load_ns = 0;
+static struct dentry *debugfs_file = NULL;
+//Protects events array lifetime vs. readers: debugfs_remove() doesn't wait for files which are already open
+static DEFINE_MUTEX(events_read_lock);
+
+void dprof_record(dprof_event_type type, const char *drv_name, const void *cb, int state, u64 start_ns, int result)
+{
+    u64 end_ns = local_clock();
+    struct dprof_event *evs = events;
+    if (unlikely(!evs))
+        return;
+
+    int idx = atomic_inc_return(&events_next) - 1;
+    if (unlikely(idx >= DPROF_MAX_EVENTS))
+        return; //the overflow is reported when reading
+
+    struct dprof_event *ev = &evs[idx];
+    ev->type = type;
+    ev->state = state;
+    ev->result = result;
+    ev->start_ns = start_ns;
+    ev->end_ns = end_ns;
+    ev->cb = cb;
+    strlcpy(ev->drv_name, drv_name, sizeof(ev->drv_name));
+    smp_wmb(); //readers only look at events marked valid
+    ev->valid = true;
+}
+
+static int dprof_event_cmp(const void *a, const void *b)
+{
+    const struct dprof_event *ev_a = a, *ev_b = b;
+    if (ev_a->start_ns == ev_b->start_ns)
+        return 0;
+
+    return ev_a->start_ns < ev_b->start_ns ? -1 : 1;
+}
+
+static const char *dprof_type_name(const struct dprof_event *ev)
+{
+    switch (ev->type) {
+        case DPROF_EV_REGISTER:
+            return "register";
+        case DPROF_EV_BOUND:
+            return "bound";
+        case DPROF_EV_CALLBACK:
+            return "callback";
+        default:
+            return "?";
+    }
+}
+
+static int dprof_show(struct seq_file *m, void *v)
+{
+    int total = atomic_read(&events_next);
+    int num = min(total, DPROF_MAX_EVENTS);
+
+    struct dprof_event *sorted = vmalloc(sizeof(struct dprof_event) * (num ? num : 1));
+    if (unlikely(!sorted))
+        return -ENOMEM;
+
+    int copied = 0;
+    mutex_lock(&events_read_lock);
+    for (int i = 0; events && i < num; i++) {
+        if (!events[i].valid)
+            continue; //still being written
+
+        smp_rmb();
+        sorted[copied++] = events[i];
+    }
+    mutex_unlock(&events_read_lock);
+    sort(sorted, copied, sizeof(struct dprof_event), dprof_event_cmp, NULL);
+
+    seq_printf(m, "# events=%d recorded=%d (times in us since module load)\n", total, copied);
+    for (int i = 0; i < copied; i++) {
+        struct dprof_event *ev = &sorted[i];
+        u64 start_us = (ev->start_ns > load_ns) ? (ev->start_ns - load_ns) / NSEC_PER_USEC : 0;
+        u64 took_us = (ev->end_ns - ev->start_ns) / NSEC_PER_USEC;
+        if (ev->type == DPROF_EV_CALLBACK) {
+            seq_printf(m, "%10llu +%-8llu %-8s %s cb=%ps state=%d result=%d\n", start_us, took_us,
+                       dprof_type_name(ev), ev->drv_name, ev->cb, ev->state, ev->result);
+        } else {
+            seq_printf(m, "%10llu +%-8llu %-8s %s result=%d\n", start_us, took_us, dprof_type_name(ev),
+                       ev->drv_name, ev->result);
+        }
+    }
+
+    vfree(sorted);
+    return 0;
+}
+
+static int dprof_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, dprof_show, NULL);
+}
+
+static const struct file_operations dprof_fops = {
+    .owner = THIS_MODULE,
+    .open = dprof_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int register_driver_profile(void)
+{
+    if (unlikely(events)) {
+        pr_loc_bug("Driver profile is already registered");
+        return -EEXIST;
+    }
+
+    struct dprof_event *evs = vzalloc(sizeof(struct dprof_event) * DPROF_MAX_EVENTS);
+    if (unlikely(!evs)) {
+        pr_loc_crt("Failed to allocate driver profile events");
+        return -ENOMEM;
+    }
+
+    debugfs_file = debugfs_create_file(DPROF_DEBUGFS_NAME, 0400, NULL, NULL, &dprof_fops);
+    if (IS_ERR_OR_NULL(debugfs_file)) {
+        int out = debugfs_file ? PTR_ERR(debugfs_file) : -ENOMEM;
+        debugfs_file = NULL;
+        pr_loc_err("Failed to create debugfs entry %s - error=%d", DPROF_DEBUGFS_NAME, out);
+        vfree(evs);
+        return out;
+    }
+
+    load_ns = local_clock();
+    atomic_set(&events_next, 0);
+    smp_wmb();
+    events = evs;
+
+    pr_loc_inf("Driver profile available in debugfs as %s", DPROF_DEBUGFS_NAME);
+    return 0;
+}
+
+int unregister_driver_profile(void)
+{
+    debugfs_remove(debugfs_file);
+    debugfs_file = NULL;
+
+    //This a debug tool: recording after this point is not expected as all watchers & overrides are gone by now
+    mutex_lock(&events_read_lock);
+    struct dprof_event *evs = events;
+    events = NULL;
+    mutex_unlock(&events_read_lock);
+    vfree(evs);
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef REDPILL_DEBUG_DRIVER_PROFILE_H
+#define REDPILL_DEBUG_DRIVER_PROFILE_H
+
+#include <linux/types.h> //u64
+
+typedef enum {
+    DPROF_EV_REGISTER, //driver_register() passed through our shim
+    DPROF_EV_BOUND, //driver was bound to a device (seen by bus notifier)
+    DPROF_EV_CALLBACK, //driver watcher callback was called
+} dprof_event_type;
+
+#ifdef RPDBG_DRIVER_PROFILE
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/clock.h> //local_clock()
+#else
+#include <linux/sched.h> //local_clock()
+#endif
+
+/**
+ * Records a single event on the timeline
+ *
+ * @param type Type of the event
+ * @param drv_name Name of the driver
+ * @param cb Callback called (for DPROF_EV_CALLBACK) or NULL
+ * @param state Watcher state (for DPROF_EV_CALLBACK) or 0
+ * @param start_ns local_clock() when the event started (see dprof_time_begin())
+ * @param result Return value of the call
+ */
+void dprof_record(dprof_event_type type, const char *drv_name, const void *cb, int state, u64 start_ns, int result);
+
+/**
+ * Allocates the timeline & creates debugfs entry exposing it; the time of this call is the "zero" on the timeline
+ *
+ * @return 0 on success or -E on error
+ */
+int register_driver_profile(void);
+
+/**
+ * Removes debugfs entry & frees the timeline created by register_driver_profile()
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_driver_profile(void);
+
+#define dprof_time_begin(var) u64 var = local_clock()
+#else //RPDBG_DRIVER_PROFILE
+#define dprof_time_begin(var)
+#define dprof_record(type, drv_name, cb, state, start_ns, result) do { } while(0)
+#endif //RPDBG_DRIVER_PROFILE
+
+#endif //REDPILL_DEBUG_DRIVER_PROFILE_H
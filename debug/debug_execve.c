@@ -1,9 +1,52 @@
+/**
+ * Tracing of execve() calls (enabled with DBG_EXECVE=y make option)
+ *
+ * Printing every exec inline (with all of its arguments!) slows the boot to a crawl, as the exec path has to wait for
+ * the console. Instead every call is recorded into a per-CPU ring buffer and formatted only when somebody reads
+ * /sys/kernel/debug/redpill_execve_trace. Writers never take any locks: a CPU only writes to its own ring (with
+ * preemption disabled) and every record is guarded by a seqcount so that readers can skip records being overwritten.
+ *
+ * Rings hold the most recent EXECVE_TRACE_RING_SIZE calls per CPU; older ones are silently overwritten. Records contain
+ * a timestamp so they can be sorted across CPUs. Filenames & arguments are truncated to fixed lengths.
+ */
 #include "debug_execve.h"
 #include "../common.h"
-#include <linux/sched.h> //task_struct
-#include <asm/uaccess.h> //get_user
+#include <linux/sched.h> //task_struct, current, TASK_COMM_LEN
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/clock.h> //local_clock()
+#endif
+#include <asm/uaccess.h> //get_user, strncpy_from_user()
 #include <linux/compat.h> //compat_uptr_t
 #include <linux/binfmts.h> //MAX_ARG_STRINGS
+#include <linux/seqlock.h> //seqcount_t
+#include <linux/rcupdate.h> //rcu_*
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+
+#define EXECVE_TRACE_RING_SIZE 128 //records per CPU; must be a power of 2
+#define EXECVE_TRACE_FILENAME_LEN 128
+#define EXECVE_TRACE_ARGS_LEN 256
+#define EXECVE_TRACE_DEBUGFS_NAME "redpill_execve_trace"
+
+struct execve_trace_rec {
+    seqcount_t seq;
+    u64 ts;
+    pid_t pid;
+    int argc;
+    char comm[TASK_COMM_LEN];
+    char filename[EXECVE_TRACE_FILENAME_LEN];
+    char args[EXECVE_TRACE_ARGS_LEN];
+};
+
+struct execve_trace_ring {
+    unsigned long head; //total number of records ever written on this CPU
+    struct execve_trace_rec recs[EXECVE_TRACE_RING_SIZE];
+};
+
+//The array pointer is the RCU-protected one (published at once); its per-CPU elements are plain pointers
+static struct execve_trace_ring * __rcu *execve_trace_rings = NULL; //[nr_cpu_ids]
+static struct dentry *debugfs_file = NULL;
 
 /*
  * Struct copied 1:1 from:
@@ -52,84 +95,208 @@ static const char __user *get_user_arg_ptr(struct user_arg_ptr argv, int nr)
     return native;
 }
 
-/*
- * Modified for simplicity from count() in:
- *
- *  linux/fs/exec.c
+/**
+ * Copies arguments separated by spaces (as much as fits)
  *
- *  Copyright (C) 1991, 1992  Linus Torvalds
+ * @return number of arguments (even ones which didn't fit) or -E on error
  */
-static int count_args(struct user_arg_ptr argv)
+static int snapshot_args(struct user_arg_ptr argv, char *buf, size_t size)
 {
+    char *ptr = buf;
+    size_t left = size - 1; //space for the final nullbyte is always reserved
+    int argc;
+
+    buf[0] = '\0';
     if (argv.ptr.native == NULL)
         return 0;
 
-    int i = 0;
-
-    for (;;) {
-        const char __user *p = get_user_arg_ptr(argv, i);
-
+    for (argc = 0; argc < MAX_ARG_STRINGS; argc++) {
+        const char __user *p = get_user_arg_ptr(argv, argc);
         if (!p)
             break;
 
-        if (IS_ERR(p) || i >= MAX_ARG_STRINGS)
-            return -EFAULT;
+        if (IS_ERR(p))
+            return PTR_ERR(p);
 
-        ++i;
+        if (left <= 1) //we still want to know argc
+            continue;
 
-        if (fatal_signal_pending(current))
-            return -ERESTARTNOHAND;
-        cond_resched();
+        if (argc != 0) {
+            *ptr++ = ' ';
+            --left;
+        }
+
+        long len = strncpy_from_user(ptr, p, left);
+        if (len < 0) {
+            strlcpy(ptr, "..?", left + 1);
+            len = strlen(ptr);
+        }
+        len = min_t(long, len, left); //strncpy_from_user() returns the full size when the string was truncated
+        ptr += len;
+        left -= len;
     }
 
-    return i;
-}
-
-static void inline fixup_arg_str(char *arg_ptr, int cur_argc, const char *what)
-{
-    pr_loc_wrn("Failed to copy %d arg - %s failed", cur_argc, what);
-    memcpy(arg_ptr, "..?\0", 4);
+    *ptr = '\0';
+    return argc;
 }
 
 void RPDBG_print_execve_call(const char *filename, const char __user *const __user *argv)
 {
-    struct task_struct *caller = get_cpu_var(current_task);
-
+    struct execve_trace_rec rec;
     struct user_arg_ptr argv_up = { .ptr.native = argv };
-    int argc = count_args(argv_up);
 
-    char *arg_str = kzalloc(MAX_ARG_STRLEN, GFP_KERNEL);
-    if (unlikely(!arg_str)) {
-        pr_loc_crt("kzalloc failed");
+    //Everything touching userspace memory (which may fault & sleep) has to be done before we reserve a slot
+    rec.argc = snapshot_args(argv_up, rec.args, sizeof(rec.args));
+    rec.pid = current->pid;
+    get_task_comm(rec.comm, current);
+    strlcpy(rec.filename, filename, sizeof(rec.filename));
+
+    rcu_read_lock();
+    struct execve_trace_ring **rings = rcu_dereference(execve_trace_rings);
+    if (unlikely(!rings)) {
+        rcu_read_unlock();
+        pr_loc_dbg("execve: %s[%d]=>%s[%d] {%s}", rec.comm, rec.pid, rec.filename, rec.argc, rec.args);
         return;
     }
 
-    char *arg_ptr = &arg_str[0];
-    for (int i = 0; i < argc; i++) {
-        const char __user *p = get_user_arg_ptr(argv_up, i);
-        if (IS_ERR(p)) {
-            fixup_arg_str(arg_ptr, i, "get_user_arg_ptr");
-            goto out_free;
-        }
+    struct execve_trace_ring *ring = rings[get_cpu()];
+    struct execve_trace_rec *slot = &ring->recs[ring->head++ & (EXECVE_TRACE_RING_SIZE - 1)];
+
+    write_seqcount_begin(&slot->seq);
+    slot->ts = local_clock();
+    slot->pid = rec.pid;
+    slot->argc = rec.argc;
+    memcpy(slot->comm, rec.comm, sizeof(slot->comm));
+    memcpy(slot->filename, rec.filename, sizeof(slot->filename));
+    memcpy(slot->args, rec.args, sizeof(slot->args));
+    write_seqcount_end(&slot->seq);
+
+    put_cpu();
+    rcu_read_unlock();
+}
+
+/**
+ * Copies a consistent snapshot of a record
+ *
+ * @return true if the record was copied, false if it was being overwritten during the whole time
+ */
+static bool read_trace_rec(const struct execve_trace_rec *slot, struct execve_trace_rec *rec)
+{
+    for (int tries = 0; tries < 3; tries++) {
+        unsigned int seq = read_seqcount_begin(&slot->seq);
+        memcpy(rec, slot, sizeof(*rec));
+        if (!read_seqcount_retry(&slot->seq, seq))
+            return true;
+    }
 
-        int len = strnlen_user(p, MAX_ARG_STRLEN); //includes nullbyte
-        if (!len) {
-            fixup_arg_str(arg_ptr, i, "strnlen_user");
-            goto out_free;
+    return false;
+}
+
+static int execve_trace_show(struct seq_file *m, void *v)
+{
+    struct execve_trace_rec *rec = kmalloc(sizeof(struct execve_trace_rec), GFP_KERNEL);
+    if (unlikely(!rec))
+        return -ENOMEM;
+
+    rcu_read_lock();
+    struct execve_trace_ring **rings = rcu_dereference(execve_trace_rings);
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        if (!rings)
+            break;
+
+        struct execve_trace_ring *ring = rings[cpu];
+        unsigned long head = ring->head;
+        unsigned long i = head > EXECVE_TRACE_RING_SIZE ? head - EXECVE_TRACE_RING_SIZE : 0;
+        for (; i < head; i++) {
+            if (!read_trace_rec(&ring->recs[i & (EXECVE_TRACE_RING_SIZE - 1)], rec))
+                continue;
+
+            seq_printf(m, "[%llu] cpu%d: %s[%d]=>%s[%d] {%s}\n", rec->ts, cpu, rec->comm, rec->pid, rec->filename,
+                       rec->argc, rec->args);
         }
-        --len; //we want to copy without nullbyte as we handle it ourselves while attaching to arg_ptr
+    }
+    rcu_read_unlock();
+
+    kfree(rec);
+    return 0;
+}
+
+static int execve_trace_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, execve_trace_show, NULL);
+}
+
+static const struct file_operations execve_trace_fops = {
+    .owner = THIS_MODULE,
+    .open = execve_trace_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void free_trace_rings(struct execve_trace_ring **rings)
+{
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        kfree(rings[cpu]);
+    }
+    kfree(rings);
+}
+
+int register_execve_trace(void)
+{
+    if (unlikely(execve_trace_rings)) {
+        pr_loc_bug("execve() trace is already registered");
+        return -EEXIST;
+    }
 
-        if (copy_from_user(arg_ptr, p, len)) {
-            fixup_arg_str(arg_ptr, i, "copy_from_user");
-            goto out_free;
-         }
+    struct execve_trace_ring **rings = kcalloc(nr_cpu_ids, sizeof(struct execve_trace_ring *), GFP_KERNEL);
+    if (unlikely(!rings))
+        goto error_nomem;
 
-        arg_ptr += len;
-        *arg_ptr = (i + 1 == argc) ? '\0' : ' '; //separate by spaces UNLESS it's the last argument
-        ++arg_ptr;
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        rings[cpu] = kzalloc_node(sizeof(struct execve_trace_ring), GFP_KERNEL, cpu_to_node(cpu));
+        if (unlikely(!rings[cpu]))
+            goto error_nomem;
+
+        for (int i = 0; i < EXECVE_TRACE_RING_SIZE; i++)
+            seqcount_init(&rings[cpu]->recs[i].seq);
+    }
+
+    debugfs_file = debugfs_create_file(EXECVE_TRACE_DEBUGFS_NAME, 0400, NULL, NULL, &execve_trace_fops);
+    if (IS_ERR_OR_NULL(debugfs_file)) {
+        int out = debugfs_file ? PTR_ERR(debugfs_file) : -ENOMEM;
+        debugfs_file = NULL;
+        pr_loc_err("Failed to create debugfs entry %s - error=%d", EXECVE_TRACE_DEBUGFS_NAME, out);
+        free_trace_rings(rings);
+        return out;
     }
 
-    out_free:
-    pr_loc_dbg("execve@cpu%d: %s[%d]=>%s[%d] {%s}", caller->on_cpu, caller->comm, caller->pid, filename, argc, arg_str);
-    kfree(arg_str);
-}
\ No newline at end of file
+    rcu_assign_pointer(execve_trace_rings, rings);
+    pr_loc_inf("execve() trace available in debugfs as %s", EXECVE_TRACE_DEBUGFS_NAME);
+    return 0;
+
+    error_nomem:
+    pr_loc_crt("Failed to allocate execve() trace rings");
+    if (rings)
+        free_trace_rings(rings); //kcalloc() zeroed it so kfree() of not-yet-allocated ones is a noop
+    return -ENOMEM;
+}
+
+int unregister_execve_trace(void)
+{
+    if (!execve_trace_rings)
+        return 0;
+
+    debugfs_remove(debugfs_file);
+    debugfs_file = NULL;
+
+    struct execve_trace_ring **rings = rcu_dereference_protected(execve_trace_rings, 1);
+    rcu_assign_pointer(execve_trace_rings, NULL);
+    synchronize_rcu(); //writers & readers may still be using them
+    free_trace_rings(rings);
+
+    return 0;
+}
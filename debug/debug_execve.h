@@ -1,6 +1,28 @@
 #ifndef REDPILL_DEBUG_EXECVE_H
 #define REDPILL_DEBUG_EXECVE_H
 
-void RPDBG_print_execve_call(const char *filename, const char *const *argv);
+#include <linux/compiler.h> //__user
+
+/**
+ * Records a single execve() call in the trace (or prints it if the trace isn't registered)
+ *
+ * @param filename Kernel-space copy of the filename
+ * @param argv Userspace argv as passed to execve()
+ */
+void RPDBG_print_execve_call(const char *filename, const char __user *const __user *argv);
+
+/**
+ * Allocates trace buffers & creates debugfs entry to read them
+ *
+ * @return 0 on success or -E on error
+ */
+int register_execve_trace(void);
+
+/**
+ * Removes debugfs entry & frees trace buffers created by register_execve_trace()
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_execve_trace(void);
 
 #endif //REDPILL_DEBUG_EXECVE_H
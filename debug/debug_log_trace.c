@@ -0,0 +1,34 @@
+/**
+ * Tracepoint-based backend for info & debug logs (enabled with LOG_TRACE=y make option)
+ *
+ * Normally every pr_loc_inf() & pr_loc_dbg() goes through printk() which formats the whole line and pushes it to all
+ * consoles synchronously. Some of these consoles are our own virtual UARTs, so logging from the vUART (or anything it
+ * calls) feeds back into the very path being debugged and changes its timing.
+ * With this backend these messages are recorded as "redpill:rp_log" trace events in the ftrace ring buffer instead and
+ * never touch the console. When the event is not enabled a message costs just a call to a function with a NOP inside
+ * (tracepoints are jump labels). This makes it cheap enough to keep on in test builds, where info & debug logs are
+ * normally compiled out completely (see common.h).
+ *
+ * Usage:
+ *     echo 1 > /sys/kernel/debug/tracing/events/redpill/rp_log/enable
+ *     cat /sys/kernel/debug/tracing/trace_pipe
+ *
+ * Warnings, errors & bugs are still printed normally as they shouldn't be missed when tracing is not enabled.
+ */
+#include "debug_log_trace.h"
+#include <linux/kernel.h> //va_list, va_start(), va_end()
+
+#define CREATE_TRACE_POINTS
+#include "trace_rp_log.h"
+
+void rp_log_trace(enum rp_log_level level, const char *file, int line, const char *fmt, ...)
+{
+    struct va_format vaf;
+    va_list args;
+
+    va_start(args, fmt);
+    vaf.fmt = fmt;
+    vaf.va = &args;
+    trace_rp_log(level, file, line, &vaf);
+    va_end(args);
+}
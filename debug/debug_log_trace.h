@@ -0,0 +1,25 @@
+#ifndef REDPILL_DEBUG_LOG_TRACE_H
+#define REDPILL_DEBUG_LOG_TRACE_H
+
+#include <linux/types.h> //u8
+#include <linux/compiler.h> //__printf
+
+#define RP_LOG_TRACE_MSG_MAX 256 //longer messages are truncated in the trace record
+
+enum rp_log_level {
+    RP_LOG_INF,
+    RP_LOG_DBG,
+};
+
+/**
+ * Records a log message as a "redpill:rp_log" trace event (if the event is enabled) instead of printing it
+ *
+ * This is a backend of pr_loc_inf() & pr_loc_dbg() (see common.h) - you shouldn't need to call it directly.
+ *
+ * @param level One of RP_LOG_*
+ * @param file Basename of the source file (it's copied into the record)
+ * @param line Line in the source file
+ */
+__printf(4, 5) void rp_log_trace(enum rp_log_level level, const char *file, int line, const char *fmt, ...);
+
+#endif //REDPILL_DEBUG_LOG_TRACE_H
@@ -0,0 +1,217 @@
+/**
+ * Invocation counters & latency histograms for overrides (enabled with DBG_OVS_STATS=y make option)
+ *
+ * Every override_symbol() & override_syscall() gets its stats automatically. Instead of pointing straight to the
+ * replacement the trampoline (or syscall table entry) points to a tiny thunk which increments a per-CPU hit counter and
+ * jumps to the real replacement:
+ *     movabs $hits, %rax ; incq %gs:(%rax) ; movabs $target, %rax ; jmp *%rax
+ * The %rax is used as a scratch register by the override trampoline already & syscall handlers don't read it, so the
+ * thunk doesn't change anything from the callee's perspective. Other replacements (e.g. ones installed into ops
+ * structures) can use ovs_stats_target() directly.
+ * Additionally any code can measure its own latency using ovs_stats_time_begin()/ovs_stats_time_end() - samples are
+ * collected in log2 buckets of CPU cycles.
+ *
+ * Everything can be read from /sys/kernel/debug/redpill_ovs_stats
+ *
+ * Keep in mind this is a DEBUG tool: thunks are freed right after the override is removed without waiting for CPUs
+ * which may still be executing it.
+ */
+#include "debug_ovs_stats.h"
+#include "../common.h"
+#include "../internal/helper/memory_helper.h" //memcpy_to_ro_mem()
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+#include <linux/percpu.h> //alloc_percpu(), free_percpu(), this_cpu_inc()
+#include <linux/bitops.h> //fls64(), test_and_set_bit(), clear_bit()
+#include <linux/list.h> //list_*
+#include <linux/spinlock.h> //spin_lock_irqsave(), spin_unlock_irqrestore()
+#include <linux/stringify.h> //__stringify
+
+#define OVS_STATS_MAX 64 //max number of stats existing at the same time
+#define OVS_STATS_THUNK_LEN 32
+#define OVS_STATS_LAT_BUCKETS 64 //bucket N counts samples between 2^(N-1) and 2^N-1 cycles (last one: everything above)
+#define OVS_STATS_DEBUGFS_NAME "redpill_ovs_stats"
+
+#define THUNK_HITS_POS 2
+#define THUNK_TARGET_POS 16
+#define THUNK_SIZE (10 + 4 + 10 + 2)
+static const unsigned char thunk_tpl[THUNK_SIZE] =
+    "\x48\xb8" "\x00\x00\x00\x00\x00\x00\x00\x00" /* MOVQ 64-bit-hits-ptr, %rax */
+    "\x65\x48\xff\x00" /* INCQ %gs:(%rax) */
+    "\x48\xb8" "\x00\x00\x00\x00\x00\x00\x00\x00" /* MOVQ 64-bit-vaddr, %rax */
+    "\xff\xe0" /* JMP *%rax */
+;
+
+//Thunks have to be executable - they live in our .text just like override_symbol.c detours
+asm(".pushsection .text\n"
+    ".balign 16\n"
+    "ovs_stats_thunk_pool:\n"
+    ".fill " __stringify(OVS_STATS_MAX * OVS_STATS_THUNK_LEN) ",1,0xcc\n"
+    ".popsection\n");
+extern unsigned char ovs_stats_thunk_pool[];
+static DECLARE_BITMAP(ovs_stats_slots, OVS_STATS_MAX);
+
+struct ovs_stats_pcpu {
+    u64 hits; //incremented by the thunk
+    u64 lat_samples;
+    u64 lat[OVS_STATS_LAT_BUCKETS];
+};
+
+struct ovs_stats {
+    struct list_head list;
+    struct ovs_stats_pcpu __percpu *pcpu;
+    const void *target;
+    unsigned char *thunk;
+    char name[];
+};
+
+static LIST_HEAD(ovs_stats_list);
+static DEFINE_SPINLOCK(ovs_stats_lock);
+static struct dentry *debugfs_file = NULL;
+
+struct ovs_stats *ovs_stats_create(const char *name, const void *target)
+{
+    struct ovs_stats *stats = kzalloc(sizeof(struct ovs_stats) + strsize(name), GFP_KERNEL);
+    if (unlikely(!stats)) {
+        pr_loc_wrn("Failed to allocate stats for %s", name);
+        return NULL;
+    }
+
+    stats->pcpu = alloc_percpu(struct ovs_stats_pcpu);
+    if (unlikely(!stats->pcpu)) {
+        pr_loc_wrn("Failed to allocate per-CPU stats for %s", name);
+        goto error_free;
+    }
+
+    int slot;
+    do {
+        slot = find_first_zero_bit(ovs_stats_slots, OVS_STATS_MAX);
+        if (slot >= OVS_STATS_MAX) {
+            pr_loc_wrn("No more stats slots available - %s will not be counted", name);
+            goto error_free_pcpu;
+        }
+    } while (test_and_set_bit(slot, ovs_stats_slots));
+
+    unsigned char code[THUNK_SIZE];
+    memcpy(code, thunk_tpl, THUNK_SIZE);
+    *(unsigned long *)&code[THUNK_HITS_POS] = (unsigned long)&stats->pcpu->hits;
+    *(unsigned long *)&code[THUNK_TARGET_POS] = (unsigned long)target;
+    stats->thunk = ovs_stats_thunk_pool + (slot * OVS_STATS_THUNK_LEN);
+    memcpy_to_ro_mem(stats->thunk, code, THUNK_SIZE);
+
+    stats->target = target;
+    strcpy(stats->name, name);
+
+    unsigned long flags;
+    spin_lock_irqsave(&ovs_stats_lock, flags);
+    list_add_tail(&stats->list, &ovs_stats_list);
+    spin_unlock_irqrestore(&ovs_stats_lock, flags);
+
+    pr_loc_dbg("Created stats for %s @ slot %d <%p>", name, slot, stats->thunk);
+    return stats;
+
+    error_free_pcpu:
+    free_percpu(stats->pcpu);
+    error_free:
+    kfree(stats);
+    return NULL;
+}
+
+const void *ovs_stats_target(struct ovs_stats *stats, const void *target)
+{
+    return (stats && stats->target == target) ? stats->thunk : target;
+}
+
+void ovs_stats_destroy(struct ovs_stats *stats)
+{
+    if (!stats)
+        return;
+
+    unsigned long flags;
+    spin_lock_irqsave(&ovs_stats_lock, flags);
+    list_del(&stats->list);
+    spin_unlock_irqrestore(&ovs_stats_lock, flags);
+
+    clear_bit((stats->thunk - ovs_stats_thunk_pool) / OVS_STATS_THUNK_LEN, ovs_stats_slots);
+    free_percpu(stats->pcpu);
+    kfree(stats);
+}
+
+void ovs_stats_add_latency(struct ovs_stats *stats, u64 cycles)
+{
+    if (!stats)
+        return;
+
+    this_cpu_inc(stats->pcpu->lat[min_t(int, fls64(cycles), OVS_STATS_LAT_BUCKETS - 1)]);
+    this_cpu_inc(stats->pcpu->lat_samples);
+}
+
+static int ovs_stats_show(struct seq_file *m, void *v)
+{
+    struct ovs_stats *stats;
+    u64 lat[OVS_STATS_LAT_BUCKETS];
+    unsigned long flags;
+    int cpu, i;
+
+    spin_lock_irqsave(&ovs_stats_lock, flags);
+    list_for_each_entry(stats, &ovs_stats_list, list) {
+        u64 hits = 0, samples = 0;
+        memset(lat, 0, sizeof(lat));
+        for_each_possible_cpu(cpu) {
+            struct ovs_stats_pcpu *pcpu = per_cpu_ptr(stats->pcpu, cpu);
+            hits += pcpu->hits;
+            samples += pcpu->lat_samples;
+            for (i = 0; i < OVS_STATS_LAT_BUCKETS; i++)
+                lat[i] += pcpu->lat[i];
+        }
+
+        seq_printf(m, "%s -> %ps: hits=%llu latency_samples=%llu\n", stats->name, stats->target, hits, samples);
+        for (i = 0; i < OVS_STATS_LAT_BUCKETS; i++) {
+            if (lat[i])
+                seq_printf(m, "    < 2^%02d cycles: %llu\n", i, lat[i]);
+        }
+    }
+    spin_unlock_irqrestore(&ovs_stats_lock, flags);
+
+    return 0;
+}
+
+static int ovs_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, ovs_stats_show, NULL);
+}
+
+static const struct file_operations ovs_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = ovs_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int register_ovs_stats(void)
+{
+    if (unlikely(debugfs_file)) {
+        pr_loc_bug("Stats are already registered");
+        return -EEXIST;
+    }
+
+    debugfs_file = debugfs_create_file(OVS_STATS_DEBUGFS_NAME, 0400, NULL, NULL, &ovs_stats_fops);
+    if (IS_ERR_OR_NULL(debugfs_file)) {
+        int out = debugfs_file ? PTR_ERR(debugfs_file) : -ENOMEM;
+        debugfs_file = NULL;
+        pr_loc_err("Failed to create debugfs entry %s - error=%d", OVS_STATS_DEBUGFS_NAME, out);
+        return out;
+    }
+
+    pr_loc_inf("Override stats available in debugfs as %s", OVS_STATS_DEBUGFS_NAME);
+    return 0;
+}
+
+int unregister_ovs_stats(void)
+{
+    debugfs_remove(debugfs_file);
+    debugfs_file = NULL;
+
+    return 0;
+}
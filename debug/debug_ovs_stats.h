@@ -0,0 +1,63 @@
+#ifndef REDPILL_DEBUG_OVS_STATS_H
+#define REDPILL_DEBUG_OVS_STATS_H
+
+#include <linux/types.h> //u64
+
+struct ovs_stats;
+
+#ifdef RPDBG_OVS_STATS
+#include <linux/timex.h> //get_cycles(), cycles_t
+
+/**
+ * Creates stats for a given replacement function
+ *
+ * @param name Name visible in debugfs
+ * @param target Replacement function which should be counted
+ *
+ * @return stats ptr on success or NULL on error (stats are a debug tool - callers should proceed without them)
+ */
+struct ovs_stats *ovs_stats_create(const char *name, const void *target);
+
+/**
+ * Returns the address which should be called instead of the target for invocations to be counted
+ *
+ * @param stats Stats ptr from ovs_stats_create(); if NULL the target is returned as-is
+ * @param target The same target as passed to ovs_stats_create()
+ */
+const void *ovs_stats_target(struct ovs_stats *stats, const void *target);
+
+/**
+ * Removes stats created with ovs_stats_create(); NULL is a noop
+ */
+void ovs_stats_destroy(struct ovs_stats *stats);
+
+/**
+ * Adds a single latency sample (in CPU cycles); NULL stats is a noop
+ */
+void ovs_stats_add_latency(struct ovs_stats *stats, u64 cycles);
+
+/**
+ * Creates debugfs entry exposing all stats
+ *
+ * @return 0 on success or -E on error
+ */
+int register_ovs_stats(void);
+
+/**
+ * Removes debugfs entry created by register_ovs_stats()
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_ovs_stats(void);
+
+#define ovs_stats_time_begin(var) cycles_t var = get_cycles()
+#define ovs_stats_time_end(stats, var) ovs_stats_add_latency(stats, get_cycles() - (var))
+#else //RPDBG_OVS_STATS
+#define ovs_stats_create(name, target) (NULL)
+#define ovs_stats_target(stats, target) (target)
+#define ovs_stats_destroy(stats) do { } while(0)
+#define ovs_stats_time_begin(var)
+#define ovs_stats_time_end(stats, var) do { } while(0)
+#endif //RPDBG_OVS_STATS
+
+#endif //REDPILL_DEBUG_OVS_STATS_H
@@ -0,0 +1,424 @@
+/**
+ * Record/replay of the PMU traffic (enabled with DBG_PMU_TRACE=y make option)
+ *
+ * The PMU shim parser has to guess where commands end (see pmu_rx_callback()), so its tuning should be checked against
+ * real mfgBIOS traffic and not against what comments say it sends:
+ *  - capture: every delivery of the vUART to the PMU shim (with its flush reason) and every command routed out of it is
+ *    appended to a compact binary trace, which can be read from /sys/kernel/debug/redpill_pmu_trace. Only the first
+ *    RPDBG_PMU_TRACE_LEN bytes are kept - this is a boot-time tool.
+ *  - replay: writing N to /sys/kernel/debug/redpill_pmu_replay feeds the trace (the captured one, or one written to
+ *    redpill_pmu_trace before) back through the PMU shim parser at N times the original speed (0 = with no delays at
+ *    all). Results go to the kernel log as a "PMU replay: ..." line: commands/s, commands routed differently than in the
+ *    trace (misrouted), unknown commands and the latency from a delivery to dispatching a command out of it.
+ * Replayed commands are never executed. While replaying the shim is detached from its vUART, so anything mfgBIOS sends
+ * during that time is lost.
+ *
+ * Trace format (little endian): struct pmu_trace_header followed by records; every record is a struct pmu_trace_rec
+ * followed by len bytes of payload (data delivered for PMU_TRACE_RX or data routed for PMU_TRACE_CMD). Commands routed
+ * while processing a delivery are recorded right after it.
+ */
+#include "debug_pmu_trace.h"
+#include "../common.h"
+#include "../shim/pmu_shim.h" //pmu_shim_replay_*()
+#include <linux/vmalloc.h> //vmalloc(), vfree()
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/spinlock.h> //DEFINE_SPINLOCK, spin_lock_irqsave(), spin_unlock_irqrestore()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+#include <linux/delay.h> //usleep_range()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/clock.h> //local_clock()
+#else
+#include <linux/sched.h> //local_clock()
+#endif
+
+#ifndef RPDBG_PMU_TRACE_LEN
+#define RPDBG_PMU_TRACE_LEN (256 * 1024)
+#endif
+
+#define PMU_TRACE_MAGIC 0x54505052 //"RPPT"
+#define PMU_TRACE_VERSION 1
+#define PMU_TRACE_DEBUGFS_NAME "redpill_pmu_trace"
+#define PMU_REPLAY_DEBUGFS_NAME "redpill_pmu_replay"
+#define PMU_REPLAY_MIN_SLEEP_US 10 //shorter gaps are replayed without any delay
+
+typedef enum {
+    PMU_TRACE_RX = 1, //payload: data delivered to pmu_rx_callback()
+    PMU_TRACE_CMD = 2, //payload: data of a routed command (signature & whatever followed it)
+} pmu_trace_rec_type;
+
+struct pmu_trace_header {
+    __le32 magic;
+    u8 version;
+    u8 reserved[3];
+} __packed;
+
+struct pmu_trace_rec {
+    __le32 delta_ns; //since the previous record (or the start of the capture); saturated at U32_MAX
+    u8 type; //pmu_trace_rec_type
+    u8 reason; //vuart_flush_reason for PMU_TRACE_RX
+    __le16 len; //of the payload
+} __packed;
+
+struct pmu_replay_stats {
+    unsigned int deliveries;
+    unsigned int commands;
+    unsigned int misrouted; //routed differently than in the trace, routed when they weren't or not routed at all
+    unsigned int unknown;
+    u64 latency_sum_ns;
+    u64 latency_max_ns;
+};
+
+static char *trace = NULL;
+static size_t trace_len = 0;
+static bool capturing = false; //capture stops when the trace is full or a trace is written from the userspace
+static u64 last_ns = 0;
+static DEFINE_SPINLOCK(trace_lock); //protects the above against capture hooks (which run under the vUART lock)
+static DEFINE_MUTEX(trace_mutex); //serializes debugfs readers, writers & replays
+
+//Replay state; it's only touched by the replaying thread (the shim is detached from the vUART when it's set)
+static bool replaying = false;
+static u64 replay_delivery_ns = 0; //when the delivery being replayed entered the shim
+static size_t replay_cmd_pos = 0; //next CMD record expected for the delivery being replayed
+static size_t replay_len = 0; //part of the trace being replayed
+static struct pmu_replay_stats replay_stats;
+
+static struct dentry *trace_file = NULL;
+static struct dentry *replay_file = NULL;
+
+/**
+ * Appends a record to the trace; trace_lock must be held
+ */
+static void trace_append(pmu_trace_rec_type type, u8 reason, const struct vuart_tx_segment *segs,
+                         unsigned int nsegs, unsigned int len)
+{
+    if (unlikely(trace_len + sizeof(struct pmu_trace_rec) + len > RPDBG_PMU_TRACE_LEN)) {
+        capturing = false;
+        pr_loc_wrn("PMU trace is full - capture stopped after %zu bytes", trace_len);
+        return;
+    }
+
+    u64 now_ns = local_clock();
+    struct pmu_trace_rec rec = {
+        .delta_ns = cpu_to_le32(min_t(u64, now_ns - last_ns, U32_MAX)),
+        .type = type,
+        .reason = reason,
+        .len = cpu_to_le16(len),
+    };
+    last_ns = now_ns;
+
+    size_t pos = trace_len;
+    memcpy(&trace[pos], &rec, sizeof(rec));
+    pos += sizeof(rec);
+    for (unsigned int i = 0; i < nsegs; ++i) {
+        memcpy(&trace[pos], segs[i].data, segs[i].len);
+        pos += segs[i].len;
+    }
+    trace_len = pos;
+}
+
+static void trace_capture(pmu_trace_rec_type type, u8 reason, const struct vuart_tx_segment *segs,
+                          unsigned int nsegs, unsigned int len)
+{
+    unsigned long flags;
+
+    if (!capturing) //racy on purpose; it's rechecked under the lock
+        return;
+
+    spin_lock_irqsave(&trace_lock, flags);
+    if (likely(capturing))
+        trace_append(type, reason, segs, nsegs, len);
+    spin_unlock_irqrestore(&trace_lock, flags);
+}
+
+/**
+ * Gets a CMD record at a given position of the trace
+ *
+ * @return record or NULL if there's no (valid) CMD record there
+ */
+static const struct pmu_trace_rec *get_cmd_rec(size_t pos, size_t len)
+{
+    if (pos + sizeof(struct pmu_trace_rec) > len)
+        return NULL;
+
+    const struct pmu_trace_rec *rec = (const struct pmu_trace_rec *)&trace[pos];
+    if (rec->type != PMU_TRACE_CMD || pos + sizeof(*rec) + le16_to_cpu(rec->len) > len)
+        return NULL;
+
+    return rec;
+}
+
+void pmu_trace_rx(const struct vuart_tx_segment *segs, unsigned int nsegs, unsigned int len,
+                  vuart_flush_reason reason)
+{
+    if (replaying) {
+        replay_delivery_ns = local_clock();
+        return;
+    }
+
+    trace_capture(PMU_TRACE_RX, reason, segs, nsegs, len);
+}
+
+bool pmu_trace_cmd(const char *data, unsigned int len)
+{
+    if (!replaying) {
+        struct vuart_tx_segment seg = { .data = data, .len = len };
+        trace_capture(PMU_TRACE_CMD, 0, &seg, 1, len);
+        return false;
+    }
+
+    u64 latency_ns = local_clock() - replay_delivery_ns;
+    ++replay_stats.commands;
+    replay_stats.latency_sum_ns += latency_ns;
+    replay_stats.latency_max_ns = max(replay_stats.latency_max_ns, latency_ns);
+
+    const struct pmu_trace_rec *rec = get_cmd_rec(replay_cmd_pos, replay_len);
+    if (!rec) {
+        ++replay_stats.misrouted; //wasn't routed out of this delivery originally
+        return true;
+    }
+
+    replay_cmd_pos += sizeof(*rec) + le16_to_cpu(rec->len);
+    if (le16_to_cpu(rec->len) != len || memcmp(rec + 1, data, len) != 0)
+        ++replay_stats.misrouted;
+
+    return true;
+}
+
+bool pmu_trace_unknown(const char *data, unsigned int len)
+{
+    if (!replaying)
+        return false;
+
+    ++replay_stats.unknown;
+    return true;
+}
+
+static void replay_sleep(u64 gap_ns, unsigned int speedup)
+{
+    u64 sleep_us = div64_u64(gap_ns, (u64)speedup * NSEC_PER_USEC);
+    if (sleep_us >= PMU_REPLAY_MIN_SLEEP_US)
+        usleep_range(sleep_us, sleep_us + PMU_REPLAY_MIN_SLEEP_US);
+}
+
+/**
+ * Feeds the whole trace through the PMU shim & reports results; trace_mutex must be held
+ *
+ * @param speedup How many times faster than captured the trace should be replayed; 0 means with no delays at all
+ *
+ * @return 0 on success or -E on error
+ */
+static int replay_trace(unsigned int speedup)
+{
+    const struct pmu_trace_header *hdr = (const struct pmu_trace_header *)trace;
+    unsigned long flags;
+    size_t pos = sizeof(*hdr);
+    u64 gap_ns = 0;
+    u64 feed_ns = 0;
+    int out;
+
+    spin_lock_irqsave(&trace_lock, flags);
+    size_t len = trace_len; //capture may still append, but it will stop once the shim is detached
+    spin_unlock_irqrestore(&trace_lock, flags);
+
+    if (len < sizeof(*hdr) || le32_to_cpu(hdr->magic) != PMU_TRACE_MAGIC || hdr->version != PMU_TRACE_VERSION) {
+        pr_loc_err("Invalid PMU trace header (or unsupported version)");
+        return -EINVAL;
+    }
+
+    if ((out = pmu_shim_replay_begin()) != 0) {
+        pr_loc_err("Failed to attach PMU replay - error=%d", out);
+        return out;
+    }
+
+    memset(&replay_stats, 0, sizeof(replay_stats));
+    replay_len = len;
+    replaying = true;
+    while (pos < len) {
+        const struct pmu_trace_rec *rec = (const struct pmu_trace_rec *)&trace[pos];
+        if (unlikely(pos + sizeof(*rec) > len || pos + sizeof(*rec) + le16_to_cpu(rec->len) > len)) {
+            pr_loc_err("PMU trace is truncated at %zu", pos);
+            out = -EINVAL;
+            break;
+        }
+
+        unsigned int rec_len = le16_to_cpu(rec->len);
+
+        pos += sizeof(*rec);
+        gap_ns += le32_to_cpu(rec->delta_ns);
+        if (rec->type != PMU_TRACE_RX) { //CMD records which weren't consumed by the previous delivery
+            if (rec->type == PMU_TRACE_CMD)
+                ++replay_stats.misrouted;
+            pos += rec_len;
+            continue;
+        }
+
+        if (unlikely(rec_len == 0 || rec_len > VUART_FIFO_LEN_MAX || rec->reason > VUART_FLUSH_FULL)) {
+            pr_loc_err("Invalid PMU trace RX record at %zu (len=%u reason=%u)", pos, rec_len, rec->reason);
+            out = -EINVAL;
+            break;
+        }
+
+        if (speedup)
+            replay_sleep(gap_ns, speedup);
+        gap_ns = 0;
+
+        replay_cmd_pos = pos + rec_len;
+        u64 start_ns = local_clock();
+        pmu_shim_replay_feed(&trace[pos], rec_len, rec->reason);
+        feed_ns += local_clock() - start_ns;
+        ++replay_stats.deliveries;
+
+        //Commands routed out of this delivery in the trace are right after it; the ones not matched are skipped
+        pos = replay_cmd_pos;
+    }
+    replaying = false;
+    pmu_shim_replay_end();
+
+    if (out != 0)
+        return out;
+
+    unsigned int cmds = replay_stats.commands;
+    pr_loc_inf("PMU replay: %u deliveries & %u commands in %llu us => %llu cmds/s; misrouted=%u unknown=%u; dispatch "
+               "latency avg=%llu ns max=%llu ns", replay_stats.deliveries, cmds, feed_ns / NSEC_PER_USEC,
+               div64_u64((u64)cmds * NSEC_PER_SEC, max_t(u64, feed_ns, 1)), replay_stats.misrouted,
+               replay_stats.unknown, div64_u64(replay_stats.latency_sum_ns, max_t(u64, cmds, 1)),
+               replay_stats.latency_max_ns);
+
+    return 0;
+}
+
+static ssize_t trace_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    unsigned long flags;
+
+    mutex_lock(&trace_mutex);
+    spin_lock_irqsave(&trace_lock, flags);
+    size_t len = trace_len; //capture only appends past it
+    spin_unlock_irqrestore(&trace_lock, flags);
+
+    ssize_t out = simple_read_from_buffer(buf, count, ppos, trace, len);
+    mutex_unlock(&trace_mutex);
+
+    return out;
+}
+
+/**
+ * Replaces the trace with one from the userspace (e.g. captured during another boot); it stops the capture
+ */
+static ssize_t trace_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    unsigned long flags;
+
+    mutex_lock(&trace_mutex);
+    spin_lock_irqsave(&trace_lock, flags);
+    if (capturing) {
+        capturing = false;
+        pr_loc_inf("PMU trace capture stopped - replacing the trace");
+    }
+    if (*ppos == 0)
+        trace_len = 0;
+    spin_unlock_irqrestore(&trace_lock, flags);
+
+    //Without the capture running nothing else touches the trace
+    ssize_t out = simple_write_to_buffer(trace, RPDBG_PMU_TRACE_LEN, ppos, buf, count);
+    if (out > 0)
+        trace_len = max_t(size_t, trace_len, *ppos);
+    mutex_unlock(&trace_mutex);
+
+    return out;
+}
+
+static ssize_t replay_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    unsigned int speedup;
+    int out = kstrtouint_from_user(buf, count, 10, &speedup);
+    if (out != 0)
+        return out;
+
+    mutex_lock(&trace_mutex);
+    out = replay_trace(speedup);
+    mutex_unlock(&trace_mutex);
+
+    return out != 0 ? out : count;
+}
+
+static const struct file_operations trace_fops = {
+    .owner = THIS_MODULE,
+    .read = trace_read,
+    .write = trace_write,
+    .llseek = default_llseek,
+};
+
+static const struct file_operations replay_fops = {
+    .owner = THIS_MODULE,
+    .write = replay_write,
+    .llseek = noop_llseek,
+};
+
+int register_pmu_trace(void)
+{
+    if (unlikely(trace)) {
+        pr_loc_bug("PMU trace is already registered");
+        return -EEXIST;
+    }
+
+    char *buf = vmalloc(RPDBG_PMU_TRACE_LEN);
+    if (unlikely(!buf)) {
+        pr_loc_crt("Failed to allocate PMU trace of %d bytes", RPDBG_PMU_TRACE_LEN);
+        return -ENOMEM;
+    }
+
+    int out = 0;
+    trace_file = debugfs_create_file(PMU_TRACE_DEBUGFS_NAME, 0600, NULL, NULL, &trace_fops);
+    replay_file = debugfs_create_file(PMU_REPLAY_DEBUGFS_NAME, 0200, NULL, NULL, &replay_fops);
+    if (IS_ERR_OR_NULL(trace_file) || IS_ERR_OR_NULL(replay_file)) {
+        out = IS_ERR(trace_file) ? PTR_ERR(trace_file) : (IS_ERR(replay_file) ? PTR_ERR(replay_file) : -ENOMEM);
+        pr_loc_err("Failed to create debugfs entries for PMU trace - error=%d", out);
+        if (!IS_ERR(trace_file))
+            debugfs_remove(trace_file);
+        if (!IS_ERR(replay_file))
+            debugfs_remove(replay_file);
+        trace_file = replay_file = NULL;
+        vfree(buf);
+        return out;
+    }
+
+    struct pmu_trace_header *hdr = (struct pmu_trace_header *)buf;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = cpu_to_le32(PMU_TRACE_MAGIC);
+    hdr->version = PMU_TRACE_VERSION;
+
+    unsigned long flags;
+    spin_lock_irqsave(&trace_lock, flags);
+    trace = buf;
+    trace_len = sizeof(*hdr);
+    last_ns = local_clock();
+    capturing = true;
+    spin_unlock_irqrestore(&trace_lock, flags);
+
+    pr_loc_inf("PMU trace available in debugfs as %s (replay with %s)", PMU_TRACE_DEBUGFS_NAME,
+               PMU_REPLAY_DEBUGFS_NAME);
+    return 0;
+}
+
+int unregister_pmu_trace(void)
+{
+    unsigned long flags;
+
+    debugfs_remove(replay_file);
+    debugfs_remove(trace_file);
+    replay_file = trace_file = NULL;
+
+    mutex_lock(&trace_mutex);
+    spin_lock_irqsave(&trace_lock, flags);
+    capturing = false;
+    char *buf = trace;
+    trace = NULL;
+    trace_len = 0;
+    spin_unlock_irqrestore(&trace_lock, flags);
+    mutex_unlock(&trace_mutex);
+
+    vfree(buf);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef REDPILL_DEBUG_PMU_TRACE_H
+#define REDPILL_DEBUG_PMU_TRACE_H
+
+#include <linux/types.h> //bool
+
+#ifdef RPDBG_PMU_TRACE
+#include "../internal/uart/virtual_uart.h" //struct vuart_tx_segment, vuart_flush_reason
+
+/**
+ * Records a single delivery of the vUART to the PMU shim (or stamps the start of it when replaying)
+ */
+void pmu_trace_rx(const struct vuart_tx_segment *segs, unsigned int nsegs, unsigned int len,
+                  vuart_flush_reason reason);
+
+/**
+ * Records a command routed by the PMU shim (or checks it against the trace when replaying)
+ *
+ * @return true if the command must not be executed (i.e. it comes from a replay), false otherwise
+ */
+bool pmu_trace_cmd(const char *data, unsigned int len);
+
+/**
+ * Counts an unknown command when replaying
+ *
+ * @return true if it should be ignored by the shim (i.e. it comes from a replay), false otherwise
+ */
+bool pmu_trace_unknown(const char *data, unsigned int len);
+
+/**
+ * Allocates the trace buffer & creates debugfs entries for it; capturing starts right away
+ *
+ * @return 0 on success or -E on error
+ */
+int register_pmu_trace(void);
+
+/**
+ * Removes debugfs entries & frees the trace buffer created by register_pmu_trace()
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_pmu_trace(void);
+#else //RPDBG_PMU_TRACE
+#define pmu_trace_rx(segs, nsegs, len, reason) do { } while(0)
+#define pmu_trace_cmd(data, len) false
+#define pmu_trace_unknown(data, len) false
+#endif //RPDBG_PMU_TRACE
+
+#endif //REDPILL_DEBUG_PMU_TRACE_H
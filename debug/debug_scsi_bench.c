@@ -0,0 +1,312 @@
+/**
+ * SCSI hotplug storm benchmark (enabled with DBG_SCSI_BENCH=y make option)
+ *
+ * Cold boots, enclosure power cycles and HBA resets probe dozens of disks at once. Every one of them goes through
+ * sd_probe_shim() and all SCSI notifier subscribers (boot shims, SATA port shim etc.). This measures what they add:
+ *  - every subscriber call is timed (since the module load, so the boot-time storm is covered too) and summarized per
+ *    subscriber callback & event
+ *  - after the module loads a kernel thread removes RPDBG_SCSI_BENCH_DISKS disks of a scsi_debug host and adds them
+ *    back all at once (like an enclosure powering up), RPDBG_SCSI_BENCH_ROUNDS times; scsi_add_device() latencies &
+ *    wall time of whole storms are collected in sbench_* metrics
+ * A probe on a stock kernel costs what scsi_sd_probe_ns metric shows (original sd_probe() only), while
+ * scsi_probe_shim_ns covers the same probe with everything we add on top; the difference is the per-probe overhead.
+ *
+ * Results go to the kernel log as "SCSI bench: ..." lines and to the scsi_notifier metrics group. The scsi_debug module
+ * must be loaded with enough targets and a non-zero disk size, e.g. "num_tgts=24 max_luns=1 dev_size_mb=8".
+ *
+ * Keep in mind this is a DEBUG tool - disks of the host are removed and re-added over and over for a while after load
+ * (and they're left removed at the end).
+ */
+#include "debug_scsi_bench.h"
+#include "../common.h"
+#include "../internal/scsi/scsi_notifier.h" //SCSI_EVT_*
+#include "../internal/metrics.h" //RP_METRIC(), rp_metric_*()
+#include <linux/kthread.h> //kthread_run()
+#include <linux/delay.h> //msleep()
+#include <linux/atomic.h> //atomic64_*
+#include <linux/compiler.h> //READ_ONCE()
+#include <linux/ktime.h> //ktime_get()
+#include <linux/workqueue.h> //alloc_workqueue(), queue_work(), flush_workqueue()
+#include <linux/device.h> //wait_for_device_probe()
+#include <scsi/scsi_host.h> //struct Scsi_Host, scsi_host_lookup(), scsi_host_put()
+#include <scsi/scsi_device.h> //scsi_add_device(), scsi_device_lookup(), scsi_remove_device()
+
+#ifndef RPDBG_SCSI_BENCH_DISKS
+#define RPDBG_SCSI_BENCH_DISKS 24 //it's capped by targets of the host
+#endif
+
+#ifndef RPDBG_SCSI_BENCH_ROUNDS
+#define RPDBG_SCSI_BENCH_ROUNDS 5
+#endif
+
+#ifndef RPDBG_SCSI_BENCH_HOST
+#define RPDBG_SCSI_BENCH_HOST "scsi_debug" //proc_name of the host template
+#endif
+
+#define SBENCH_MAX_HOSTS 64 //host numbers looked at when searching for the host
+#define SBENCH_HOST_TRIES 60 //how many times (every SBENCH_HOST_DELAY_MS) to look for the host before giving up
+#define SBENCH_HOST_DELAY_MS 1000
+#define SBENCH_MAX_SUBS 16 //calls of subscribers above that are not accounted
+#define SBENCH_EVTS (SCSI_EVT_DEV_REMOVED + 1)
+
+#define bench_report(fmt, ...) pr_loc_inf("SCSI bench: " fmt, ##__VA_ARGS__)
+
+/******************************************** Subscribers calls accounting ********************************************/
+struct sbench_sub_stats {
+    const void *cb; //claimed with cmpxchg() on the first call & never released
+    atomic64_t calls[SBENCH_EVTS];
+    atomic64_t total_ns[SBENCH_EVTS];
+};
+
+static struct sbench_sub_stats sub_stats[SBENCH_MAX_SUBS];
+
+static const char *const evt_names[SBENCH_EVTS] = {
+    [SCSI_EVT_DEV_PROBING] = "PROBING",
+    [SCSI_EVT_DEV_PROBED_OK] = "PROBED_OK",
+    [SCSI_EVT_DEV_PROBED_ERR] = "PROBED_ERR",
+    [SCSI_EVT_DEV_REMOVED] = "REMOVED",
+};
+
+void sbench_record_sub(const void *cb, int evt, u64 start_ns)
+{
+    u64 time_ns = local_clock() - start_ns;
+    if (unlikely(evt < 0 || evt >= SBENCH_EVTS))
+        return;
+
+    for (int i = 0; i < SBENCH_MAX_SUBS; i++) {
+        const void *slot_cb = READ_ONCE(sub_stats[i].cb);
+        if (!slot_cb && !(slot_cb = cmpxchg(&sub_stats[i].cb, NULL, cb)))
+            slot_cb = cb; //we claimed the slot
+
+        if (slot_cb != cb)
+            continue;
+
+        atomic64_inc(&sub_stats[i].calls[evt]);
+        atomic64_add(time_ns, &sub_stats[i].total_ns[evt]);
+        return;
+    }
+}
+
+static void report_subs(const char *phase)
+{
+    for (int i = 0; i < SBENCH_MAX_SUBS; i++) {
+        const void *cb = READ_ONCE(sub_stats[i].cb);
+        if (!cb)
+            break;
+
+        for (int evt = 0; evt < SBENCH_EVTS; evt++) {
+            s64 calls = atomic64_read(&sub_stats[i].calls[evt]);
+            if (!calls)
+                continue;
+
+            bench_report("%s: subscriber %pF<%p> on %s: %lld calls, avg %lld ns", phase, cb, cb, evt_names[evt], calls,
+                         div64_s64(atomic64_read(&sub_stats[i].total_ns[evt]), calls));
+        }
+    }
+}
+
+/**
+ * Zeroes accounted calls (racing with calls in progress is harmless for a debug tool)
+ */
+static void reset_subs(void)
+{
+    for (int i = 0; i < SBENCH_MAX_SUBS; i++) {
+        for (int evt = 0; evt < SBENCH_EVTS; evt++) {
+            atomic64_set(&sub_stats[i].calls[evt], 0);
+            atomic64_set(&sub_stats[i].total_ns[evt], 0);
+        }
+    }
+}
+
+/************************************************** Hotplug storms ****************************************************/
+static RP_METRIC(sbench_add_ns, RP_MG_SCSI_NOTIFIER, RP_METRIC_HISTOGRAM); //a single scsi_add_device() in a storm
+static RP_METRIC(sbench_storm_ns, RP_MG_SCSI_NOTIFIER, RP_METRIC_HISTOGRAM); //whole storm, until all probes finish
+static struct rp_metric *const sbench_metrics[] = { &sbench_add_ns, &sbench_storm_ns };
+
+struct sbench_disk {
+    struct work_struct work;
+    struct Scsi_Host *shost;
+    unsigned int id;
+    int result;
+};
+
+static struct task_struct *bench_thread = NULL;
+
+static void add_disk_work(struct work_struct *work)
+{
+    struct sbench_disk *disk = container_of(work, struct sbench_disk, work);
+
+    rp_metric_time_begin(start);
+    struct scsi_device *sdev = scsi_add_device(disk->shost, 0, disk->id, 0);
+    rp_metric_time_end(&sbench_add_ns, start);
+
+    if (IS_ERR(sdev)) {
+        disk->result = PTR_ERR(sdev);
+        return;
+    }
+
+    scsi_device_put(sdev); //scsi_add_device() returns the device with a reference held
+    disk->result = 0;
+}
+
+static void remove_disks(struct Scsi_Host *shost, unsigned int num)
+{
+    for (unsigned int id = 0; id < num; id++) {
+        struct scsi_device *sdev = scsi_device_lookup(shost, 0, id, 0);
+        if (!sdev)
+            continue;
+
+        scsi_remove_device(sdev);
+        scsi_device_put(sdev);
+    }
+}
+
+/**
+ * Waits for the benchmark host to show up (scsi_debug may be loaded after us) & takes a reference to it
+ */
+static struct Scsi_Host *find_bench_host(void)
+{
+    for (int i = 0; i < SBENCH_HOST_TRIES && !kthread_should_stop(); i++) {
+        for (unsigned short hostnum = 0; hostnum < SBENCH_MAX_HOSTS; hostnum++) {
+            struct Scsi_Host *shost = scsi_host_lookup(hostnum);
+            if (IS_ERR_OR_NULL(shost))
+                continue;
+
+            if (shost->hostt->proc_name && strcmp(shost->hostt->proc_name, RPDBG_SCSI_BENCH_HOST) == 0)
+                return shost;
+
+            scsi_host_put(shost);
+        }
+
+        msleep(SBENCH_HOST_DELAY_MS);
+    }
+
+    return NULL;
+}
+
+/**
+ * Adds all disks at once & waits for all their probes to finish
+ *
+ * @return number of disks which failed to be added
+ */
+static int run_storm(struct workqueue_struct *wq, struct sbench_disk *disks, unsigned int num, int round)
+{
+    ktime_t start = ktime_get();
+    for (unsigned int i = 0; i < num; i++)
+        queue_work(wq, &disks[i].work);
+
+    flush_workqueue(wq);
+    wait_for_device_probe(); //newer kernels probe sd asynchronously
+    s64 time_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    rp_metric_observe(&sbench_storm_ns, time_ns);
+
+    int failed = 0;
+    for (unsigned int i = 0; i < num; i++) {
+        if (disks[i].result == 0)
+            continue;
+
+        pr_loc_err("Failed to add disk id=%u - error=%d", disks[i].id, disks[i].result);
+        failed++;
+    }
+
+    bench_report("round %d: %u disks in %lld us => %lld us/disk (failed=%d)", round, num, time_ns / NSEC_PER_USEC,
+                 div64_s64(time_ns, num) / NSEC_PER_USEC, failed);
+    return failed;
+}
+
+/**
+ * Parks the thread until kthread_stop() is called (so that unregister_scsi_bench() never touches a dead thread)
+ */
+static void bench_wait_for_stop(void)
+{
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+}
+
+static int bench_thread_fn(void *data)
+{
+    int out = 0, failed = 0;
+    struct sbench_disk *disks = NULL;
+    struct workqueue_struct *wq = NULL;
+
+    report_subs("since load"); //this is the boot-time storm
+
+    struct Scsi_Host *shost = find_bench_host();
+    if (!shost) {
+        pr_loc_err("No \"%s\" SCSI host found - storms will not be run", RPDBG_SCSI_BENCH_HOST);
+        out = -ENODEV;
+        goto out_finish;
+    }
+
+    unsigned int num = min_t(unsigned int, RPDBG_SCSI_BENCH_DISKS, shost->max_id);
+    if (num < RPDBG_SCSI_BENCH_DISKS)
+        pr_loc_wrn("Host %d has only %u targets - using %u disks instead of %d", shost->host_no, shost->max_id, num,
+                   RPDBG_SCSI_BENCH_DISKS);
+    bench_report("starting (host=%d, disks=%u, rounds=%d)", shost->host_no, num, RPDBG_SCSI_BENCH_ROUNDS);
+
+    disks = kcalloc(num, sizeof(struct sbench_disk), GFP_KERNEL); //no kzalloc_or_exit_int() as we cannot return early
+    wq = alloc_workqueue("scsi-bench", WQ_UNBOUND, num); //every disk must be added in parallel
+    if (unlikely(!disks || !wq)) {
+        pr_loc_crt("Failed to allocate %u disks storm", num);
+        out = -ENOMEM;
+        goto out_free;
+    }
+
+    for (unsigned int i = 0; i < num; i++) {
+        INIT_WORK(&disks[i].work, add_disk_work);
+        disks[i].shost = shost;
+        disks[i].id = i;
+    }
+
+    remove_disks(shost, num); //scsi_debug adds its disks when it loads
+    reset_subs();
+    for (int round = 0; round < RPDBG_SCSI_BENCH_ROUNDS && !kthread_should_stop(); round++) {
+        failed += run_storm(wq, disks, num, round);
+        remove_disks(shost, num);
+    }
+    report_subs("storms");
+
+    out_free:
+    if (wq)
+        destroy_workqueue(wq);
+    kfree(disks);
+    scsi_host_put(shost);
+    out_finish:
+    bench_report("finished (failed disks=%d, exit=%d)", failed, out);
+
+    bench_wait_for_stop();
+    return out;
+}
+
+int register_scsi_bench(void)
+{
+    if (unlikely(bench_thread)) {
+        pr_loc_bug("SCSI benchmark is already running");
+        return -EBUSY;
+    }
+
+    rp_metrics_register(sbench_metrics, ARRAY_SIZE(sbench_metrics));
+    struct task_struct *task = kthread_run(bench_thread_fn, NULL, "scsi-bench");
+    if (IS_ERR(task)) {
+        pr_loc_err("Failed to start SCSI benchmark thread - error=%ld", PTR_ERR(task));
+        return PTR_ERR(task);
+    }
+
+    bench_thread = task;
+    return 0;
+}
+
+int unregister_scsi_bench(void)
+{
+    if (!bench_thread)
+        return 0;
+
+    kthread_stop(bench_thread);
+    bench_thread = NULL;
+
+    return 0;
+}
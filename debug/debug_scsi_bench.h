@@ -0,0 +1,43 @@
+#ifndef REDPILL_DEBUG_SCSI_BENCH_H
+#define REDPILL_DEBUG_SCSI_BENCH_H
+
+#include <linux/types.h> //u64
+
+#ifdef RPDBG_SCSI_BENCH
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/clock.h> //local_clock()
+#else
+#include <linux/sched.h> //local_clock()
+#endif
+
+/**
+ * Records time spent in a single SCSI notifier subscriber call; it's safe in any context
+ *
+ * @param cb Subscriber callback called
+ * @param evt scsi_event delivered
+ * @param start_ns local_clock() before the call (see sbench_time_begin())
+ */
+void sbench_record_sub(const void *cb, int evt, u64 start_ns);
+
+/**
+ * Starts the SCSI hotplug storm benchmark in the background; results are printed to the kernel log & metrics
+ *
+ * @return 0 on success or -E on error
+ */
+int register_scsi_bench(void);
+
+/**
+ * Stops the SCSI hotplug storm benchmark (if it's still running)
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_scsi_bench(void);
+
+#define sbench_time_begin(var) u64 var = local_clock()
+#else //RPDBG_SCSI_BENCH
+#define sbench_time_begin(var)
+#define sbench_record_sub(cb, evt, start_ns) do { } while(0)
+#endif //RPDBG_SCSI_BENCH
+
+#endif //REDPILL_DEBUG_SCSI_BENCH_H
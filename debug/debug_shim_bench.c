@@ -0,0 +1,413 @@
+/**
+ * In-kernel sanity checks & microbenchmark of emulated subsystems (enabled with DBG_SHIM_BENCH=y make option)
+ *
+ * Most of the code paths emulating hardware or hiding things are only exercised during a real DSM boot, which makes
+ * any performance work on them impossible to measure. After the module loads a kernel thread drives them through the
+ * same public interfaces the rest of the kernel (or userspace) uses, checks that results look sane and reports ns/op:
+ *  - cmdline: RPDBG_SHIM_BENCH_ITERS renders of /proc/cmdline contents (cmdline_proc_show(), i.e. the sanitizer once
+ *             stealth is on) into memory; the output is checked against tokens left visible by cmdline extraction
+ *  - /proc/cmdline: RPDBG_SHIM_BENCH_IO_ITERS reads of it (which goes through the sanitizer once stealth is on)
+ *  - vPCI: RPDBG_SHIM_BENCH_ITERS config space dword reads spread over all stubs of the current platform
+ *  - SMART: RPDBG_SHIM_BENCH_IO_ITERS HDIO_DRIVE_CMD SMART READ VALUES calls on RPDBG_SHIM_BENCH_DISK (skipped if the
+ *           disk doesn't show up)
+ *
+ * Results go to the kernel log as "Shim bench: ..." lines. Values emulated for the PMU aren't covered as they're only
+ * reachable through ttyS1 which is owned by the PMU shim (use DBG_VUART_BENCH to measure the vUART itself).
+ *
+ * Keep in mind this is a DEBUG tool - it hammers the disk with SMART requests for a moment after load.
+ */
+#include "debug_shim_bench.h"
+#include "../common.h"
+#include "../config/cmdline_delegate.h" //get_kernel_cmdline(), get_visible_cmdline_spans(), CMDLINE_MAX
+#include "../internal/call_protected.h" //cmdline_proc_show()
+#include "../config/runtime_config.h" //current_config
+#include "../config/platform_types.h" //hw_config, hw_cfg()
+#include "../config/vpci_types.h" //struct vpci_device_stub
+#include "../internal/scsi/hdparam.h" //HDIO_DRIVE_CMD_*, ata_ioctl_buf_size()
+#include <linux/kthread.h> //kthread_run()
+#include <linux/delay.h> //msleep()
+#include <linux/fs.h> //filp_open(), vfs_read()
+#include <linux/pci.h> //pci_get_domain_bus_and_slot(), pci_read_config_dword()
+#include <linux/ktime.h> //ktime_get()
+#include <linux/sched.h> //cond_resched()
+#include <linux/seq_file.h> //struct seq_file
+#include <asm/uaccess.h> //get_fs(), set_fs()
+
+#ifndef RPDBG_SHIM_BENCH_ITERS
+#define RPDBG_SHIM_BENCH_ITERS 1000000 //for ops which stay in memory
+#endif
+
+#ifndef RPDBG_SHIM_BENCH_IO_ITERS
+#define RPDBG_SHIM_BENCH_IO_ITERS 1000 //for ops which go through VFS or may hit a real device
+#endif
+
+#ifndef RPDBG_SHIM_BENCH_DISK
+#define RPDBG_SHIM_BENCH_DISK "/dev/sda"
+#endif
+
+#define BENCH_OPEN_TRIES 120 //tries
+#define BENCH_OPEN_DELAY_MS 500
+#define BENCH_RESCHED_EVERY 1024 //iterations
+#define BENCH_PCI_CFG_DWORDS (PCI_STD_HEADER_SIZEOF / 4)
+
+#define bench_report(fmt, ...) pr_loc_inf("Shim bench: " fmt, ##__VA_ARGS__)
+
+static struct task_struct *bench_thread = NULL;
+
+static void bench_report_rate(const char *phase, unsigned int iters, s64 time_ns)
+{
+    bench_report("%s: %u ops in %lld us => %lld ns/op", phase, iters, time_ns / NSEC_PER_USEC,
+                 div64_s64(time_ns, max_t(s64, iters, 1)));
+}
+
+/**
+ * Waits for a file to show up (e.g. a disk which is still being probed) and opens it
+ */
+static struct file *bench_open(const char *path, int flags)
+{
+    struct file *filp = ERR_PTR(-ENOENT);
+
+    for (int i = 0; i < BENCH_OPEN_TRIES && !kthread_should_stop(); i++) {
+        filp = filp_open(path, flags, 0);
+        if (!IS_ERR(filp))
+            break;
+
+        msleep(BENCH_OPEN_DELAY_MS);
+    }
+
+    return filp;
+}
+
+static ssize_t bench_file_read(struct file *filp, char *buf, size_t len)
+{
+    loff_t pos = 0;
+    mm_segment_t old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    ssize_t out = vfs_read(filp, (char __user *)buf, len, &pos);
+    set_fs(old_fs);
+
+    return out;
+}
+
+/**
+ * Builds what /proc/cmdline should contain: visible tokens + newline (sanitized) or the cached cmdline (no stealth)
+ *
+ * @return length on success or -E on error
+ */
+static ssize_t bench_expected_cmdline(char *buf)
+{
+#if STEALTH_MODE > STEALTH_MODE_OFF
+    const char *cmdline;
+    const struct cmdline_span *spans;
+    unsigned int spans_num = get_visible_cmdline_spans(&cmdline, &spans);
+    size_t len = 0;
+
+    for (unsigned int i = 0; i < spans_num; i++) {
+        if (unlikely(len + 1 + spans[i].len + 1 > CMDLINE_MAX))
+            return -E2BIG;
+
+        if (i > 0)
+            buf[len++] = ' ';
+        memcpy(&buf[len], cmdline + spans[i].offset, spans[i].len);
+        len += spans[i].len;
+    }
+    buf[len++] = '\n';
+
+    return len;
+#else
+    return get_kernel_cmdline(buf, CMDLINE_MAX); //it's cached straight from cmdline_proc_show(), with the newline
+#endif
+}
+
+/**
+ * Renders /proc/cmdline contents into buf (the same way extracting cmdline from the kernel does)
+ *
+ * @return length on success or -E on error
+ */
+static ssize_t bench_render_cmdline(char *buf)
+{
+    struct seq_file seq = {
+        .buf = buf,
+        .size = CMDLINE_MAX,
+    };
+
+    int out = _cmdline_proc_show(&seq, NULL);
+    return out == 0 ? seq.count : out;
+}
+
+static int bench_cmdline(char *buf)
+{
+    int out = 0;
+    char *expected = kmalloc(CMDLINE_MAX, GFP_KERNEL);
+    if (unlikely(!expected)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate %d bytes for expected", CMDLINE_MAX);
+        return -ENOMEM;
+    }
+
+    ssize_t expected_len = bench_expected_cmdline(expected);
+    if (unlikely(expected_len < 0)) {
+        pr_loc_err("Failed to build expected cmdline - error=%zd", expected_len);
+        out = (int)expected_len;
+        goto out_free;
+    }
+
+    //The bench starts before stealth is initialized - wait for the sanitizer so that it's the one being measured
+    ssize_t len = 0;
+    for (int i = 0; i < BENCH_OPEN_TRIES && !kthread_should_stop(); i++) {
+        len = bench_render_cmdline(buf);
+        if (len == expected_len && memcmp(buf, expected, len) == 0)
+            break;
+
+        msleep(BENCH_OPEN_DELAY_MS);
+    }
+
+    if (unlikely(len != expected_len || memcmp(buf, expected, len) != 0)) {
+        pr_loc_err("cmdline_proc_show() rendered %zd bytes \"%.*s\" (expected %zd bytes \"%.*s\")", len,
+                   (int)max_t(ssize_t, len, 0), buf, expected_len, (int)expected_len, expected);
+        out = len < 0 ? (int)len : -EINVAL;
+        goto out_free;
+    }
+
+    unsigned int i = 0;
+    ktime_t start = ktime_get();
+    for (; i < RPDBG_SHIM_BENCH_ITERS && !kthread_should_stop(); i++) {
+        if (unlikely((len = bench_render_cmdline(buf)) != expected_len)) {
+            pr_loc_err("cmdline_proc_show() rendered %zd bytes during iteration %u (expected %zd)", len, i,
+                       expected_len);
+            out = len < 0 ? (int)len : -EINVAL;
+            goto out_free;
+        }
+
+        if (unlikely(i % BENCH_RESCHED_EVERY == 0))
+            cond_resched();
+    }
+    bench_report_rate("cmdline render", i, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+    //Every render is the same, so checking the last one is enough to know the timed ones were valid
+    if (unlikely(memcmp(buf, expected, expected_len) != 0)) {
+        pr_loc_err("cmdline_proc_show() output changed during the benchmark");
+        out = -EINVAL;
+    }
+
+    out_free:
+    kfree(expected);
+    return out;
+}
+
+static int bench_proc_cmdline(char *buf)
+{
+    ssize_t len = 0;
+    unsigned int i = 0;
+    int out = 0;
+
+    struct file *filp = filp_open("/proc/cmdline", O_RDONLY, 0);
+    if (IS_ERR(filp)) {
+        pr_loc_err("Failed to open /proc/cmdline - error=%ld", PTR_ERR(filp));
+        return PTR_ERR(filp);
+    }
+
+    ktime_t start = ktime_get();
+    for (; i < RPDBG_SHIM_BENCH_IO_ITERS && !kthread_should_stop(); i++) {
+        ssize_t read = bench_file_read(filp, buf, CMDLINE_MAX);
+        if (unlikely(read <= 0 || (len && read != len))) {
+            pr_loc_err("Read of /proc/cmdline returned %zd during iteration %u (expected %zd)", read, i, len);
+            out = read < 0 ? (int)read : -EINVAL;
+            goto out_close;
+        }
+        len = read;
+    }
+    bench_report_rate("/proc/cmdline read", i, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+    out_close:
+    filp_close(filp, NULL);
+    return out;
+}
+
+static int bench_vpci(void)
+{
+    const struct hw_config *hw = current_config.hw_config;
+    struct pci_dev **devs;
+    unsigned int found = 0;
+    int out = 0;
+    u32 val;
+
+    unsigned int stubs_num = hw ? hw_cfg(hw, pci_stubs_num) : 0;
+    if (stubs_num == 0) {
+        bench_report("vPCI: platform has no stubs - skipping");
+        return 0;
+    }
+
+    kzalloc_or_exit_int(devs, sizeof(struct pci_dev *) * stubs_num, RP_MEM_DEBUG);
+    for (unsigned int i = 0; i < stubs_num; i++) {
+        const struct vpci_device_stub *stub = &hw_cfg(hw, pci_stubs)[i];
+        devs[found] = pci_get_domain_bus_and_slot(0, stub->bus, PCI_DEVFN(stub->dev, stub->fn));
+        if (unlikely(!devs[found])) {
+            pr_loc_err("vPCI stub %02x:%02x.%d not found on the bus", stub->bus, stub->dev, stub->fn);
+            out = -ENODEV;
+            continue;
+        }
+
+        if (unlikely(pci_read_config_dword(devs[found], PCI_VENDOR_ID, &val) != 0 || (val & 0xffff) == 0xffff)) {
+            pr_loc_err("vPCI stub %02x:%02x.%d returned invalid vendor/device 0x%08x", stub->bus, stub->dev,
+                       stub->fn, val);
+            out = -EIO;
+        }
+        found++;
+    }
+
+    if (!found)
+        goto out_free;
+
+    ktime_t start = ktime_get();
+    for (unsigned int i = 0; i < RPDBG_SHIM_BENCH_ITERS && !kthread_should_stop(); i++) {
+        pci_read_config_dword(devs[i % found], ((i / found) % BENCH_PCI_CFG_DWORDS) * 4, &val);
+        if (unlikely(i % BENCH_RESCHED_EVERY == 0))
+            cond_resched();
+    }
+    bench_report_rate("vPCI config dword read", RPDBG_SHIM_BENCH_ITERS, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+    out_free:
+    for (unsigned int i = 0; i < found; i++)
+        pci_dev_put(devs[i]);
+    rp_kfree(devs, RP_MEM_DEBUG);
+    return out;
+}
+
+static int bench_smart_ioctl(struct file *disk, u8 *buf)
+{
+    memset(buf, 0, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS));
+    buf[HDIO_DRIVE_CMD_HDR_CMD] = ATA_CMD_SMART;
+    buf[HDIO_DRIVE_CMD_HDR_FEATURE] = ATA_SMART_READ_VALUES;
+    buf[HDIO_DRIVE_CMD_HDR_SEC_CNT] = ATA_SMART_READ_VALUES_SECTORS;
+
+    mm_segment_t old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    long out = disk->f_op->unlocked_ioctl(disk, HDIO_DRIVE_CMD, (unsigned long)buf);
+    set_fs(old_fs);
+
+    return (int)out;
+}
+
+static int bench_smart(void)
+{
+    u8 *buf;
+    unsigned int i = 0;
+    int out;
+
+    struct file *disk = bench_open(RPDBG_SHIM_BENCH_DISK, O_RDONLY | O_NONBLOCK);
+    if (IS_ERR(disk)) {
+        bench_report("SMART: cannot open %s (error=%ld) - skipping", RPDBG_SHIM_BENCH_DISK, PTR_ERR(disk));
+        return 0;
+    }
+
+    if (unlikely(!disk->f_op->unlocked_ioctl)) {
+        bench_report("SMART: %s doesn't support ioctl() - skipping", RPDBG_SHIM_BENCH_DISK);
+        out = 0;
+        goto out_close;
+    }
+
+    buf = kmalloc(ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS), GFP_KERNEL); //we need to close the disk
+    if (unlikely(!buf)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate %d bytes for buf",
+                   ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS));
+        out = -ENOMEM;
+        goto out_close;
+    }
+
+    //SMART data always start with a 2-byte revision, and the shim emulates it as non-zero as well
+    if ((out = bench_smart_ioctl(disk, buf)) != 0 ||
+        (buf[HDIO_DRIVE_CMD_HDR_SIZE] == 0 && buf[HDIO_DRIVE_CMD_HDR_SIZE + 1] == 0)) {
+        pr_loc_err("SMART READ VALUES on %s failed - error=%d status=0x%02x", RPDBG_SHIM_BENCH_DISK, out,
+                   buf[HDIO_DRIVE_CMD_RET_STATUS]);
+        out = out ? out : -EIO;
+        goto out_free;
+    }
+
+    ktime_t start = ktime_get();
+    for (; i < RPDBG_SHIM_BENCH_IO_ITERS && !kthread_should_stop(); i++) {
+        if (unlikely((out = bench_smart_ioctl(disk, buf)) != 0)) {
+            pr_loc_err("SMART READ VALUES on %s failed during iteration %u - error=%d", RPDBG_SHIM_BENCH_DISK, i, out);
+            goto out_free;
+        }
+    }
+    bench_report_rate("SMART READ VALUES", i, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+    out_free:
+    kfree(buf);
+    out_close:
+    filp_close(disk, NULL);
+    return out;
+}
+
+/**
+ * Parks the thread until kthread_stop() is called (so that unregister_shim_bench() never touches a dead thread)
+ */
+static void bench_wait_for_stop(void)
+{
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+}
+
+static int bench_thread_fn(void *data)
+{
+    char *buf;
+    int out, failed = 0;
+
+    bench_report("starting (%u iterations, %u for I/O)", RPDBG_SHIM_BENCH_ITERS, RPDBG_SHIM_BENCH_IO_ITERS);
+    buf = kmalloc(CMDLINE_MAX, GFP_KERNEL); //not using kmalloc_or_exit_int() as we cannot return early
+    if (unlikely(!buf)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate %d bytes for buf", CMDLINE_MAX);
+        out = -ENOMEM;
+        goto out_finish;
+    }
+
+    //Phases are independent so a failure of one doesn't stop others
+    if ((out = bench_cmdline(buf)) != 0)
+        failed++;
+    if ((out = bench_proc_cmdline(buf)) != 0)
+        failed++;
+    if ((out = bench_vpci()) != 0)
+        failed++;
+    if ((out = bench_smart()) != 0)
+        failed++;
+
+    kfree(buf);
+
+    out_finish:
+    bench_report("finished (failed phases=%d, last exit=%d)", failed, out);
+
+    bench_wait_for_stop();
+    return out;
+}
+
+int register_shim_bench(void)
+{
+    if (unlikely(bench_thread)) {
+        pr_loc_bug("Shim benchmark is already running");
+        return -EBUSY;
+    }
+
+    struct task_struct *task = kthread_run(bench_thread_fn, NULL, "shim-bench");
+    if (IS_ERR(task)) {
+        pr_loc_err("Failed to start shim benchmark thread - error=%ld", PTR_ERR(task));
+        return PTR_ERR(task);
+    }
+
+    bench_thread = task;
+    return 0;
+}
+
+int unregister_shim_bench(void)
+{
+    if (!bench_thread)
+        return 0;
+
+    kthread_stop(bench_thread);
+    bench_thread = NULL;
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef REDPILL_DEBUG_SHIM_BENCH_H
+#define REDPILL_DEBUG_SHIM_BENCH_H
+
+/**
+ * Starts the emulated subsystems benchmark in the background; results are printed to the kernel log
+ *
+ * @return 0 on success or -E on error
+ */
+int register_shim_bench(void);
+
+/**
+ * Stops the emulated subsystems benchmark (if it's still running)
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_shim_bench(void);
+
+#endif //REDPILL_DEBUG_SHIM_BENCH_H
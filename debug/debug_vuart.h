@@ -11,6 +11,7 @@
 #define reg_read_dump(d, rF, rN) reg_read(rN); dump_##rF(d);
 #define reg_write_dump(d, rF, rN) reg_write(rN); dump_##rF(d);
 #define dri(vdev, reg, flag) ((vdev)->reg&(flag)) ? 1:0 //Dump Register as 1-0 Integer
+#define drv(val, flag) ((val)&(flag)) ? 1:0 //Dump Value as 1-0 Integer
 #define diiri(vdev, flag) (((vdev)->iir&UART_IIR_ID) == (flag)) ? 1:0 //Dump IIR Interrupt type as 1-0 integer
 #define dump_ier(d) \
     uart_prdbg("IER[0x%02x]: DR_int=%d | THRe_int=%d | RLS_int=%d | " \
@@ -44,13 +45,15 @@
                "Out2/IntE=%d | Loop=%d", \
                (d)->mcr, dri(d,mcr,UART_MCR_DTR), dri(d,mcr,UART_MCR_RTS), dri(d,mcr,UART_MCR_OUT1), \
                dri(d,mcr,UART_MCR_OUT2), dri(d,mcr,UART_MCR_LOOP));
-#define dump_lsr(d) \
+#define dump_lsr(d) { \
+    u8 __lsr = vuart_lsr(d); /* composed from RX & TX halves (see serial8250_16550A_vdev) */ \
     uart_prdbg("LSR[0x%02x]: data_ready=%d | ovrunE=%d | pairE=%d | " \
                 "frE=%d | break_req=%d | THRemp=%d | TransEMP=%d | " \
                 "FIFOdE=%d", \
-                (d)->lsr, dri(d,lsr,UART_LSR_DR), dri(d,lsr,UART_LSR_OE), dri(d,lsr,UART_LSR_PE),  \
-                dri(d,lsr,UART_LSR_FE), dri(d,lsr,UART_LSR_BI), dri(d,lsr,UART_LSR_THRE), dri(d,lsr,UART_LSR_TEMT), \
-                dri(d,lsr,UART_LSR_FIFOE));
+                __lsr, drv(__lsr,UART_LSR_DR), drv(__lsr,UART_LSR_OE), drv(__lsr,UART_LSR_PE),  \
+                drv(__lsr,UART_LSR_FE), drv(__lsr,UART_LSR_BI), drv(__lsr,UART_LSR_THRE), drv(__lsr,UART_LSR_TEMT), \
+                drv(__lsr,UART_LSR_FIFOE)); \
+    }
 #define dump_msr(d) \
     uart_prdbg("MSR[0x%02x]: delCTS=%d | delDSR=%d | trEdgRI=%d | " \
                "delCD=%d | CTS=%d | DSR=%d | RI=%d | "              \
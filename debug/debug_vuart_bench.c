@@ -0,0 +1,376 @@
+/**
+ * In-kernel throughput & latency benchmark for the vUART (enabled with DBG_VUART_BENCH=y make option)
+ *
+ * After the module loads a kernel thread adds a vUART on RPDBG_VUART_BENCH_LINE, waits for the serial8250 driver to
+ * expose it, sets it into raw mode and drives it through the normal tty layer (exactly like userspace would):
+ *  - TX: writes RPDBG_VUART_BENCH_TX_LEN bytes to the tty and measures how long it takes until they all reach a vUART
+ *        TX subscriber
+ *  - RX: injects RPDBG_VUART_BENCH_RX_LEN bytes using vuart_inject_rx_wait() and reads them back from the tty
+ *  - latency: injects a single byte RPDBG_VUART_BENCH_LAT_SAMPLES times and measures time until read() returns it
+ *
+ * For every phase it reports bytes/s and vIRQ dispatcher wakeups & handler calls per KB. The benchmark uses whichever
+ * interrupt mode the module was compiled with (vIRQ or VUART_USE_TIMER_FALLBACK) - build it twice to compare them.
+ * Results go to the kernel log as "vUART bench: ..." lines.
+ *
+ * Keep in mind this is a DEBUG tool - it takes the line for itself for a couple of seconds after load.
+ */
+#include "debug_vuart_bench.h"
+#include "../common.h"
+#include "../internal/uart/virtual_uart.h" //vuart_add_device(), vuart_add_tx_zc_subscriber(), vuart_inject_rx*()
+#include "../internal/uart/vuart_virtual_irq.h" //vuart_virq_get_stats(); CHECKS VUART_USE_TIMER_FALLBACK
+#include "../config/uart_defs.h" //STD_COMX_DEV_NAME
+#include <linux/kthread.h> //kthread_run()
+#include <linux/delay.h> //msleep()
+#include <linux/fs.h> //filp_open(), vfs_read(), vfs_write()
+#include <linux/termios.h> //struct termios, TCGETS/TCSETS
+#include <linux/ktime.h> //ktime_get()
+#include <linux/sort.h> //sort()
+#include <linux/wait.h> //tx_done_wq
+#include <asm/uaccess.h> //get_fs(), set_fs()
+
+#ifndef RPDBG_VUART_BENCH_LINE
+#define RPDBG_VUART_BENCH_LINE 2 //ttyS2 is unused on all supported platforms (ttyS0=console, ttyS1=PMU)
+#endif
+
+#ifndef RPDBG_VUART_BENCH_TX_LEN
+#define RPDBG_VUART_BENCH_TX_LEN (1024 * 1024)
+#endif
+
+#ifndef RPDBG_VUART_BENCH_RX_LEN
+#define RPDBG_VUART_BENCH_RX_LEN (256 * 1024)
+#endif
+
+#ifndef RPDBG_VUART_BENCH_LAT_SAMPLES
+#define RPDBG_VUART_BENCH_LAT_SAMPLES 1000
+#endif
+
+#define BENCH_CHUNK_LEN 4096
+#define BENCH_OPEN_TRIES 120 //tries
+#define BENCH_OPEN_DELAY_MS 500
+#define BENCH_IO_TIMEOUT (5 * HZ)
+
+#ifdef VUART_USE_TIMER_FALLBACK
+#define BENCH_MODE_NAME "timer fallback"
+#else
+#define BENCH_MODE_NAME "vIRQ"
+#endif
+
+#define bench_report(fmt, ...) pr_loc_inf("vUART bench: " fmt, ##__VA_ARGS__)
+
+static struct task_struct *bench_thread = NULL;
+static atomic_t tx_received = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(tx_done_wq);
+
+static unsigned int bench_tx_callback(int line, const struct vuart_tx_segment *segs, unsigned int nsegs,
+                                      unsigned int len, vuart_flush_reason reason)
+{
+    if (atomic_add_return(len, &tx_received) >= RPDBG_VUART_BENCH_TX_LEN)
+        wake_up(&tx_done_wq);
+
+    return len;
+}
+
+/**
+ * Calls tty ioctl() with a kernel buffer; we're interacting with tty exactly like userspace would
+ */
+static int bench_tty_ioctl(struct file *tty, unsigned int cmd, struct termios *termios)
+{
+    mm_segment_t old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    long out = tty->f_op->unlocked_ioctl(tty, cmd, (unsigned long)termios);
+    set_fs(old_fs);
+
+    return (int)out;
+}
+
+static ssize_t bench_tty_write(struct file *tty, const char *buf, size_t len)
+{
+    loff_t pos = 0;
+    mm_segment_t old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    ssize_t out = vfs_write(tty, (const char __user *)buf, len, &pos);
+    set_fs(old_fs);
+
+    return out;
+}
+
+static ssize_t bench_tty_read(struct file *tty, char *buf, size_t len)
+{
+    loff_t pos = 0;
+    mm_segment_t old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    ssize_t out = vfs_read(tty, (char __user *)buf, len, &pos);
+    set_fs(old_fs);
+
+    return out;
+}
+
+/**
+ * Opens the benchmarked tty & puts it in raw mode (no echo, no translation, read() returns after 1s at most)
+ */
+static struct file *bench_open_tty(void)
+{
+    char path[16];
+    struct file *tty = NULL;
+    struct termios termios;
+    int out;
+
+    snprintf(path, sizeof(path), "/dev/" STD_COMX_DEV_NAME "%d", RPDBG_VUART_BENCH_LINE);
+
+    //The serial8250 driver may not be loaded yet (or may not picked up the vUART yet)
+    for (int i = 0; i < BENCH_OPEN_TRIES && !kthread_should_stop(); i++) {
+        tty = filp_open(path, O_RDWR | O_NOCTTY, 0);
+        if (!IS_ERR(tty))
+            break;
+
+        msleep(BENCH_OPEN_DELAY_MS);
+    }
+
+    if (IS_ERR_OR_NULL(tty)) {
+        pr_loc_err("Failed to open %s - error=%ld", path, PTR_ERR(tty));
+        return tty ? tty : ERR_PTR(-ENODEV);
+    }
+
+    if ((out = bench_tty_ioctl(tty, TCGETS, &termios)) != 0)
+        goto error_close;
+
+    termios.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF);
+    termios.c_oflag &= ~OPOST;
+    termios.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    termios.c_cflag &= ~(CSIZE | PARENB | CRTSCTS);
+    termios.c_cflag |= CS8 | CREAD | CLOCAL;
+    termios.c_cc[VMIN] = 0;
+    termios.c_cc[VTIME] = 10; //in 1/10s
+
+    if ((out = bench_tty_ioctl(tty, TCSETS, &termios)) != 0)
+        goto error_close;
+
+    return tty;
+
+    error_close:
+    pr_loc_err("Failed to set %s into raw mode - error=%d", path, out);
+    filp_close(tty, NULL);
+    return ERR_PTR(out);
+}
+
+/**
+ * Reads exactly len bytes (or fails trying)
+ */
+static int bench_read_all(struct file *tty, char *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t out;
+
+    while (done < len) {
+        out = bench_tty_read(tty, buf + done, len - done);
+        if (out < 0)
+            return (int)out;
+
+        if (out == 0) //VTIME expired
+            return -ETIMEDOUT;
+
+        done += out;
+    }
+
+    return 0;
+}
+
+static void bench_report_rate(const char *phase, size_t bytes, s64 time_ns, const struct vuart_virq_stats *before)
+{
+    struct vuart_virq_stats after;
+    vuart_virq_get_stats(&after);
+
+    u64 kbs = max_t(u64, bytes / 1024, 1);
+    bench_report("%s %s: %zu bytes in %lld us => %llu B/s; vIRQ wakeups/KB=%lu, handler calls/KB=%lu", BENCH_MODE_NAME,
+                 phase, bytes, time_ns / NSEC_PER_USEC, div64_u64((u64)bytes * NSEC_PER_SEC, max_t(u64, time_ns, 1)),
+                 (unsigned long)div64_u64(after.wakeups - before->wakeups, kbs),
+                 (unsigned long)div64_u64(after.dispatches - before->dispatches, kbs));
+}
+
+static int bench_tx(struct file *tty, char *buf)
+{
+    struct vuart_virq_stats stats;
+    size_t done = 0;
+    ssize_t out;
+
+    for (int i = 0; i < BENCH_CHUNK_LEN; i++)
+        buf[i] = 'A' + (i % 26);
+
+    atomic_set(&tx_received, 0);
+    vuart_virq_get_stats(&stats);
+    ktime_t start = ktime_get();
+    while (done < RPDBG_VUART_BENCH_TX_LEN && !kthread_should_stop()) {
+        out = bench_tty_write(tty, buf, min_t(size_t, BENCH_CHUNK_LEN, RPDBG_VUART_BENCH_TX_LEN - done));
+        if (out < 0) {
+            pr_loc_err("TX write failed - error=%zd", out);
+            return (int)out;
+        }
+        done += out;
+    }
+
+    if (!wait_event_timeout(tx_done_wq, atomic_read(&tx_received) >= RPDBG_VUART_BENCH_TX_LEN, BENCH_IO_TIMEOUT)) {
+        pr_loc_err("TX timed out - vUART received only %d/%d bytes", atomic_read(&tx_received),
+                   RPDBG_VUART_BENCH_TX_LEN);
+        return -ETIMEDOUT;
+    }
+
+    bench_report_rate("TX", RPDBG_VUART_BENCH_TX_LEN, ktime_to_ns(ktime_sub(ktime_get(), start)), &stats);
+    return 0;
+}
+
+static int bench_rx(struct file *tty, char *buf)
+{
+    struct vuart_virq_stats stats;
+    size_t done = 0;
+    int out;
+
+    vuart_virq_get_stats(&stats);
+    ktime_t start = ktime_get();
+    while (done < RPDBG_VUART_BENCH_RX_LEN && !kthread_should_stop()) {
+        int chunk = min_t(size_t, BENCH_CHUNK_LEN, RPDBG_VUART_BENCH_RX_LEN - done);
+        out = vuart_inject_rx_wait(RPDBG_VUART_BENCH_LINE, buf, chunk, BENCH_IO_TIMEOUT);
+        if (out != chunk) {
+            pr_loc_err("RX inject failed - injected=%d/%d", out, chunk);
+            return out < 0 ? out : -EIO;
+        }
+
+        if ((out = bench_read_all(tty, buf, chunk)) != 0) {
+            pr_loc_err("RX read failed - error=%d", out);
+            return out;
+        }
+        done += chunk;
+    }
+
+    bench_report_rate("RX", done, ktime_to_ns(ktime_sub(ktime_get(), start)), &stats);
+    return 0;
+}
+
+static int cmp_s64(const void *a, const void *b)
+{
+    s64 l = *(const s64 *)a, r = *(const s64 *)b;
+    return (l > r) - (l < r);
+}
+
+static int bench_latency(struct file *tty, char *buf)
+{
+    s64 *samples;
+    int out = 0;
+    int taken = 0;
+
+    kmalloc_or_exit_int(samples, sizeof(s64) * RPDBG_VUART_BENCH_LAT_SAMPLES, RP_MEM_DEBUG);
+    for (; taken < RPDBG_VUART_BENCH_LAT_SAMPLES && !kthread_should_stop(); taken++) {
+        buf[0] = 'x';
+        ktime_t start = ktime_get();
+        if ((out = vuart_inject_rx(RPDBG_VUART_BENCH_LINE, buf, 1)) != 1) {
+            pr_loc_err("Latency inject failed - error=%d", out);
+            out = out < 0 ? out : -EIO;
+            goto out_free;
+        }
+
+        if ((out = bench_read_all(tty, buf, 1)) != 0) {
+            pr_loc_err("Latency read failed - error=%d", out);
+            goto out_free;
+        }
+        samples[taken] = ktime_to_ns(ktime_sub(ktime_get(), start));
+    }
+
+    if (taken) {
+        sort(samples, taken, sizeof(s64), cmp_s64, NULL);
+        bench_report("%s inject-to-read latency (%d samples): p50=%lld ns p99=%lld ns max=%lld ns", BENCH_MODE_NAME,
+                     taken, samples[taken / 2], samples[(taken * 99) / 100], samples[taken - 1]);
+    }
+
+    out_free:
+    rp_kfree(samples, RP_MEM_DEBUG);
+    return out;
+}
+
+/**
+ * Parks the thread until kthread_stop() is called (so that unregister_vuart_bench() never touches a dead thread)
+ */
+static void bench_wait_for_stop(void)
+{
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+}
+
+static int bench_thread_fn(void *data)
+{
+    vuart_tx_subscriber *sub = NULL;
+    struct file *tty = NULL;
+    char *buf = NULL;
+    int out;
+
+    bench_report("starting on ttyS%d (%s mode)", RPDBG_VUART_BENCH_LINE, BENCH_MODE_NAME);
+    buf = kmalloc(BENCH_CHUNK_LEN, GFP_KERNEL); //not using kmalloc_or_exit_int() as we cannot return early
+    if (unlikely(!buf)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate %d bytes for buf", BENCH_CHUNK_LEN);
+        out = -ENOMEM;
+        goto out_free;
+    }
+
+    if ((out = vuart_add_device(RPDBG_VUART_BENCH_LINE)) != 0)
+        goto out_free;
+
+    sub = vuart_add_tx_zc_subscriber(RPDBG_VUART_BENCH_LINE, bench_tx_callback, VUART_FIFO_LEN_MAX);
+    if (IS_ERR(sub)) {
+        out = PTR_ERR(sub);
+        goto out_remove;
+    }
+
+    tty = bench_open_tty();
+    if (IS_ERR(tty)) {
+        out = PTR_ERR(tty);
+        goto out_unsubscribe;
+    }
+
+    if ((out = bench_tx(tty, buf)) == 0 && (out = bench_rx(tty, buf)) == 0)
+        out = bench_latency(tty, buf);
+
+    filp_close(tty, NULL);
+
+    out_unsubscribe:
+    vuart_remove_tx_subscriber(sub);
+
+    out_remove:
+    vuart_remove_device(RPDBG_VUART_BENCH_LINE);
+
+    out_free:
+    kfree(buf);
+    bench_report("finished (exit=%d)", out);
+
+    bench_wait_for_stop();
+    return out;
+}
+
+int register_vuart_bench(void)
+{
+    if (unlikely(bench_thread)) {
+        pr_loc_bug("vUART benchmark is already running");
+        return -EBUSY;
+    }
+
+    struct task_struct *task = kthread_run(bench_thread_fn, NULL, "vuart-bench");
+    if (IS_ERR(task)) {
+        pr_loc_err("Failed to start vUART benchmark thread - error=%ld", PTR_ERR(task));
+        return PTR_ERR(task);
+    }
+
+    bench_thread = task;
+    return 0;
+}
+
+int unregister_vuart_bench(void)
+{
+    if (!bench_thread)
+        return 0;
+
+    kthread_stop(bench_thread);
+    bench_thread = NULL;
+
+    return 0;
+}
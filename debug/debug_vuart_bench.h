@@ -0,0 +1,18 @@
+#ifndef REDPILL_DEBUG_VUART_BENCH_H
+#define REDPILL_DEBUG_VUART_BENCH_H
+
+/**
+ * Starts the vUART benchmark in the background; results are printed to the kernel log
+ *
+ * @return 0 on success or -E on error
+ */
+int register_vuart_bench(void);
+
+/**
+ * Stops the vUART benchmark (if it's still running)
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_vuart_bench(void);
+
+#endif //REDPILL_DEBUG_VUART_BENCH_H
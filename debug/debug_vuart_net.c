@@ -0,0 +1,224 @@
+/**
+ * Network sink for vUART TX (enabled with DBG_VUART_NET=y make option)
+ *
+ * A real ttyS tops out at STD_COMX_BAUD, which makes capturing full debug logs of e.g. a console redirected to a vUART
+ * painfully slow (and impossible on hosts without a serial port at all). This sink subscribes to TX of a vUART line and
+ * forwards everything as UDP datagrams using netpoll, exactly like netconsole does (so it works from any context the
+ * vUART flushes in, including with IRQs disabled). Data is batched up to RPDBG_VUART_NET_BATCH_LEN bytes per datagram
+ * and the batch is sent as soon as the vUART reports the transmitter went idle (VUART_FLUSH_IDLE).
+ *
+ * It's configured with "vuart_net=<ttyS#>:<netconsole target>" on the kernel cmdline, where the target uses the
+ * netconsole syntax of "[src-port]@[src-ip]/[dev],[tgt-port]@<tgt-ip>/[tgt-macaddr]", e.g.:
+ *     vuart_net=0:@/eth0,6666@192.168.1.10/
+ * and can be received with e.g. "nc -u -l 6666". If the line isn't a vUART already it is added as one (so that data
+ * stop going to the real port).
+ *
+ * The module loads long before the network is up, so the netpoll is set up in the background, retrying every
+ * VUART_NET_RETRY_DELAY up to VUART_NET_RETRY_TRIES times. Data sent before that are dropped (and their count is
+ * logged once the sink is connected) as there's nowhere to keep them.
+ *
+ * Keep in mind this is a DEBUG tool. If the line is owned by a different vUART user which removes the device, the
+ * subscription goes away with it.
+ */
+#include "debug_vuart_net.h"
+#include "../common.h"
+#include "../config/runtime_config.h" //struct runtime_config, VUART_NET_MAX_LENGTH
+#include "../config/cmdline_opts.h" //CMDLINE_CT_VUART_NET
+#include "../internal/uart/virtual_uart.h" //vuart_add_device(), vuart_add_tx_zc_subscriber()
+#include <linux/netpoll.h> //struct netpoll, netpoll_*()
+#include <linux/workqueue.h> //delayed_work, system_long_wq
+#include <linux/atomic.h> //atomic_t
+
+#if !IS_ENABLED(CONFIG_NETPOLL)
+#error "DBG_VUART_NET requires a kernel built with CONFIG_NETPOLL"
+#endif
+
+#ifndef RPDBG_VUART_NET_BATCH_LEN
+#define RPDBG_VUART_NET_BATCH_LEN 1000 //same as netconsole's MAX_PRINT_CHUNK; it must fit in a single frame
+#endif
+
+#define VUART_NET_NAME "rp_vuart_net"
+#define VUART_NET_RETRY_DELAY (2 * HZ)
+#define VUART_NET_RETRY_TRIES 150 //5 minutes should be enough for any NIC driver & DHCP
+#define VUART_NET_NO_LINE (-1) //value of line when sink is not configured
+
+static struct netpoll np;
+static char np_config[VUART_NET_MAX_LENGTH + 1]; //netpoll_parse_options() modifies the string
+static int line = VUART_NET_NO_LINE;
+static bool vuart_added = false; //whether we added the vUART (and thus should remove it)
+static vuart_tx_subscriber *tx_sub = NULL;
+static bool np_ready = false; //set only after netpoll is fully set up; read from within TX callback
+static atomic_t dropped = ATOMIC_INIT(0);
+static unsigned int setup_tries = 0;
+static void np_setup_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(np_setup_work, np_setup_work_fn);
+
+//TX callbacks of a single line are serialized by the vUART (they're called with its lock held)
+static char batch[RPDBG_VUART_NET_BATCH_LEN];
+static unsigned int batch_len = 0;
+
+static inline void send_batch(void)
+{
+    if (batch_len == 0)
+        return;
+
+    netpoll_send_udp(&np, batch, batch_len);
+    batch_len = 0;
+}
+
+static unsigned int vuart_net_tx_callback(int tx_line, const struct vuart_tx_segment *segs, unsigned int nsegs,
+                                          unsigned int len, vuart_flush_reason reason)
+{
+    if (unlikely(!READ_ONCE(np_ready))) {
+        atomic_add(len, &dropped);
+        return len;
+    }
+    smp_rmb(); //pairs with smp_wmb() in np_setup_work_fn()
+
+    for (unsigned int i = 0; i < nsegs; i++) {
+        const char *data = segs[i].data;
+        unsigned int left = segs[i].len;
+        while (left) {
+            unsigned int chunk = min_t(unsigned int, left, RPDBG_VUART_NET_BATCH_LEN - batch_len);
+            memcpy(batch + batch_len, data, chunk);
+            batch_len += chunk;
+            data += chunk;
+            left -= chunk;
+            if (batch_len == RPDBG_VUART_NET_BATCH_LEN)
+                send_batch();
+        }
+    }
+
+    if (reason == VUART_FLUSH_IDLE)
+        send_batch();
+
+    return len;
+}
+
+static void np_setup_work_fn(struct work_struct *work)
+{
+    int out = netpoll_setup(&np); //it may sleep waiting for the carrier
+    if (out != 0) {
+        if (++setup_tries < VUART_NET_RETRY_TRIES) {
+            pr_loc_dbg("vUART UDP sink not ready (error=%d) - retrying in %ds", out, VUART_NET_RETRY_DELAY / HZ);
+            queue_delayed_work(system_long_wq, &np_setup_work, VUART_NET_RETRY_DELAY);
+        } else {
+            pr_loc_err("Failed to set up vUART UDP sink for ttyS%d after %u tries - error=%d", line, setup_tries, out);
+        }
+        return;
+    }
+
+    smp_wmb(); //netpoll must be fully set up before the TX callback uses it
+    WRITE_ONCE(np_ready, true);
+    pr_loc_inf("vUART ttyS%d is now sent to UDP port %d via %s (%d bytes were dropped before)", line, np.remote_port,
+               np.dev_name, atomic_read(&dropped));
+}
+
+/**
+ * Parses "<ttyS#>:<netconsole target>" into line & np
+ *
+ * @return 0 on success, -E on error
+ */
+static int parse_vuart_net_config(const char *config)
+{
+    const char *sep = strchr(config, ':');
+    if (unlikely(!sep || sep == config)) {
+        pr_loc_err("Invalid %s%s - expected <ttyS#>:<netconsole target>", CMDLINE_CT_VUART_NET, config);
+        return -EINVAL;
+    }
+
+    long parsed_line = simple_strtol(config, NULL, 10);
+    if (unlikely(parsed_line < 0 || parsed_line > INT_MAX)) {
+        pr_loc_err("Invalid line %ld in %s", parsed_line, CMDLINE_CT_VUART_NET);
+        return -EINVAL;
+    }
+
+    strscpy(np_config, sep + 1, sizeof(np_config));
+    memset(&np, 0, sizeof(np));
+    np.name = VUART_NET_NAME;
+    np.local_port = 6665; //same defaults as netconsole
+    np.remote_port = 6666;
+    strscpy(np.dev_name, "eth0", IFNAMSIZ);
+    memset(np.remote_mac, 0xff, ETH_ALEN);
+    if (unlikely(netpoll_parse_options(&np, np_config) != 0)) {
+        pr_loc_err("Invalid netconsole target \"%s\" in %s", sep + 1, CMDLINE_CT_VUART_NET);
+        return -EINVAL;
+    }
+
+    line = (int)parsed_line;
+    return 0;
+}
+
+int register_vuart_net(const struct runtime_config *config)
+{
+    if (config->vuart_net[0] == '\0') {
+        pr_loc_dbg("vUART UDP sink not requested");
+        return 0;
+    }
+
+    if (unlikely(tx_sub)) {
+        pr_loc_bug("vUART UDP sink is already registered");
+        return -EEXIST;
+    }
+
+    int out = parse_vuart_net_config(config->vuart_net);
+    if (unlikely(out != 0))
+        return out;
+
+    out = vuart_add_device(line);
+    if (out == 0) {
+        vuart_added = true;
+    } else if (out == -EBUSY) { //someone else already made it a vUART - we will just listen
+        pr_loc_dbg("ttyS%d is already a vUART - subscribing to it", line);
+    } else {
+        pr_loc_err("Failed to add vUART for UDP sink at ttyS%d - error=%d", line, out);
+        goto error_out;
+    }
+
+    tx_sub = vuart_add_tx_zc_subscriber(line, vuart_net_tx_callback, VUART_THRESHOLD_MAX);
+    if (unlikely(IS_ERR(tx_sub))) {
+        out = PTR_ERR(tx_sub);
+        tx_sub = NULL;
+        pr_loc_err("Failed to subscribe to ttyS%d vUART - error=%d", line, out);
+        goto error_remove;
+    }
+
+    setup_tries = 0;
+    queue_delayed_work(system_long_wq, &np_setup_work, 0);
+    pr_loc_inf("vUART UDP sink for ttyS%d registered - waiting for %s", line, np.dev_name);
+
+    return 0;
+
+    error_remove:
+    if (vuart_added) {
+        vuart_remove_device(line);
+        vuart_added = false;
+    }
+    error_out:
+    line = VUART_NET_NO_LINE;
+    return out;
+}
+
+int unregister_vuart_net(void)
+{
+    if (!tx_sub)
+        return 0;
+
+    cancel_delayed_work_sync(&np_setup_work);
+
+    int out = vuart_remove_tx_subscriber(tx_sub); //after that the callback is guaranteed not to run
+    tx_sub = NULL;
+    if (vuart_added) {
+        vuart_remove_device(line);
+        vuart_added = false;
+    }
+
+    if (np_ready) {
+        WRITE_ONCE(np_ready, false);
+        netpoll_cleanup(&np);
+    }
+    batch_len = 0;
+    line = VUART_NET_NO_LINE;
+
+    return out;
+}
@@ -0,0 +1,20 @@
+#ifndef REDPILL_DEBUG_VUART_NET_H
+#define REDPILL_DEBUG_VUART_NET_H
+
+struct runtime_config;
+
+/**
+ * Starts forwarding TX of a vUART line as UDP datagrams (if requested with vuart_net= on the kernel cmdline)
+ *
+ * @return 0 on success or noop, -E on error
+ */
+int register_vuart_net(const struct runtime_config *config);
+
+/**
+ * Stops forwarding started by register_vuart_net() (it's a noop if it wasn't started)
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_vuart_net(void);
+
+#endif //REDPILL_DEBUG_VUART_NET_H
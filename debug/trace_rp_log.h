@@ -0,0 +1,45 @@
+/**
+ * Trace event used by debug/debug_log_trace.c; this file is read multiple times by the tracing macros
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM redpill
+
+#if !defined(REDPILL_TRACE_RP_LOG_H) || defined(TRACE_HEADER_MULTI_READ)
+#define REDPILL_TRACE_RP_LOG_H
+
+#include <linux/tracepoint.h> //TRACE_EVENT()
+#include <linux/printk.h> //struct va_format
+#include "debug_log_trace.h" //RP_LOG_*
+
+//Only the message itself is formatted when recorded (its arguments may be gone later); the level, file & line are
+// stored raw and formatted only when the trace is read
+TRACE_EVENT(rp_log,
+    TP_PROTO(u8 level, const char *file, int line, struct va_format *vaf),
+    TP_ARGS(level, file, line, vaf),
+
+    TP_STRUCT__entry(
+        __field(u8, level)
+        __field(int, line)
+        __string(file, file)
+        __dynamic_array(char, msg, RP_LOG_TRACE_MSG_MAX)
+    ),
+
+    TP_fast_assign(
+        __entry->level = level;
+        __entry->line = line;
+        __assign_str(file, file);
+        vsnprintf(__get_dynamic_array(msg), RP_LOG_TRACE_MSG_MAX, vaf->fmt, *vaf->va);
+    ),
+
+    TP_printk("%s <%s:%d> %s", __print_symbolic(__entry->level, { RP_LOG_INF, "INF" }, { RP_LOG_DBG, "DBG" }),
+              __get_str(file), __entry->line, __get_str(msg))
+);
+
+#endif //REDPILL_TRACE_RP_LOG_H
+
+//This must be outside of the include guard; the path is relative to this file as the Makefile adds it to includes
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace_rp_log
+#include <trace/define_trace.h>
@@ -2,40 +2,68 @@
 #include "../common.h"
 #include <linux/errno.h> //common exit codes
 //#include <linux/kallsyms.h> //kallsyms_lookup_name()
-#include "helper/symbol_helper.h" //kln_func
+#include "helper/symbol_helper.h" //kln_cached()
+#include "helper/memory_helper.h" //memcpy_to_ro_mem_batch()
 #include <linux/module.h> //symbol_get()/put
+#include <linux/stringify.h> //__stringify
+#include <linux/init.h> //__init, __initconst
 
 //This will eventually stop working (since Linux >=5.7.0 has the kallsyms_lookup_name() removed)
 //Workaround will be needed: https://github.com/xcellerator/linux_kernel_hacking/issues/3
 
 #define __VOID_RETURN__
+#define CP_JUMP_SIZE 5 //JMP rel32
+#define CP_JUMP_OPCODE 0xe9
+
+/**
+ * Defines _<name>() as a jump slot: a JMP rel32 in our .text which callers call directly
+ *
+ * Initially the slot jumps to <name>__unbound(), which looks the symbol up once & then calls it through a memoized
+ * pointer (a slot stays unbound e.g. when its symbol is missing during binding). bind_protected_calls() rewrites all
+ * slots at once to jump straight to the kernel functions; modules are always within rel32 range of the kernel text.
+ * Since the slot is called & jumps with direct instructions, there's no indirect call (=no retpoline).
+ * Slots are 8-byte aligned so that the whole JMP is within a single cache line.
+ */
+#define CP_JUMP_SLOT(org_function_name)                                   \
+  asm(".pushsection .text\n"                                              \
+      ".balign 8\n"                                                       \
+      ".globl _" #org_function_name "\n"                                  \
+      ".type _" #org_function_name ", @function\n"                        \
+      "_" #org_function_name ":\n"                                        \
+      ".byte " __stringify(CP_JUMP_OPCODE) "\n"                           \
+      ".long " #org_function_name "__unbound - . - 4\n"                   \
+      ".size _" #org_function_name ", " __stringify(CP_JUMP_SIZE) "\n"    \
+      ".popsection\n");
+
 //This macro should be used to export symbols which aren't normally EXPORT_SYMBOL/EXPORT_SYMBOL_GPL in the kernel but
 // they exist within the kernel (and not a loadable module!). Keep in mind that most of the time "static" cannot be
 // reexported using this trick.
-//All re-exported function will have _ prefix (e.g. foo() becomes _foo())
+//All re-exported function will have _ prefix (e.g. foo() becomes _foo()) and MUST be listed in cp_bindings[] as well.
 #define DEFINE_UNEXPORTED_SHIM(return_type, org_function_name, call_args, call_vars, fail_return) \
   extern asmlinkage return_type org_function_name(call_args);                                     \
   typedef typeof(org_function_name) *org_function_name##__ret;                                    \
-  static unsigned long org_function_name##__addr = 0;                                             \
-  return_type _##org_function_name(call_args)                                                     \
+  static unsigned long org_function_name##__addr = 0; /*memo, so kln_cached() is hit only once*/  \
+  static __used noinline return_type org_function_name##__unbound(call_args)                      \
   {                                                                                               \
-      if (unlikely(org_function_name##__addr == 0)) {                                             \
-          org_function_name##__addr = kln_func(#org_function_name);                               \
-          if (org_function_name##__addr == 0) {                                                   \
+      unsigned long addr = ACCESS_ONCE(org_function_name##__addr);                                \
+      if (unlikely(addr == 0)) {                                                                  \
+          addr = kln_cached(#org_function_name);                                                  \
+          if (unlikely(addr == 0)) {                                                              \
               pr_loc_bug("Failed to fetch %s() syscall address", #org_function_name);             \
               return fail_return;                                                                 \
           }                                                                                       \
-          pr_loc_dbg("Got addr %lx for %s", org_function_name##__addr, #org_function_name);       \
+          ACCESS_ONCE(org_function_name##__addr) = addr;                                          \
       }                                                                                           \
                                                                                                   \
-      return ((org_function_name##__ret)org_function_name##__addr)(call_vars);                    \
-  }
+      return ((org_function_name##__ret)addr)(call_vars);                                         \
+  }                                                                                               \
+  CP_JUMP_SLOT(org_function_name)
 
 //This macro should be used to export symbols which aren't normally EXPORT_SYMBOL/EXPORT_SYMBOL_GPL in the kernel but
 // they exist within the kernel and are defined as __init. These symbol can only be called when the system is still
 // booting (i.e. before init user-space binary was called). After that calling such functions is a lottery - the memory
-// of them is freed by free_initmem() [called in main.c:kernel_init()]. That's why we skip any caching kere as these are
-// called mostly as a one-off during boot process when this module was loaded as a I/O scheduler.
+// of them is freed by free_initmem() [called in main.c:kernel_init()]. That's why we refuse to call them after boot even
+// if their address is still in the cache.
 //All re-exported function will have _ prefix (e.g. foo() becomes _foo())
 #define DEFINE_UNEXPORTED_INIT_SHIM(return_type, org_function_name, call_args, call_vars, fail_return) \
   extern asmlinkage return_type org_function_name(call_args);                                          \
@@ -48,7 +76,7 @@
                      #org_function_name, system_state);                                                \
           return fail_return;                                                                          \
       }                                                                                                \
-      org_function_name##__addr = kln_func(#org_function_name);                                        \
+      org_function_name##__addr = kln_cached(#org_function_name);                                      \
       if (org_function_name##__addr == 0) {                                                            \
           pr_loc_bug("Failed to fetch %s() syscall address", #org_function_name);                      \
           return fail_return;                                                                          \
@@ -99,6 +127,10 @@ DEFINE_UNEXPORTED_SHIM(int, do_execve, CP_LIST(struct filename *filename,
         const char __user *const __user *__argv,
         const char __user *const __user *__envp), CP_LIST(filename, __argv, __envp), -EINTR);
 DEFINE_UNEXPORTED_SHIM(struct filename *, getname, CP_LIST(const char __user *name), CP_LIST(name), ERR_PTR(-EFAULT));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+DEFINE_UNEXPORTED_SHIM(struct filename *, getname_kernel, CP_LIST(const char *name), CP_LIST(name), ERR_PTR(-EFAULT));
+#endif
+DEFINE_UNEXPORTED_SHIM(void, putname, CP_LIST(struct filename *name), CP_LIST(name), __VOID_RETURN__);
 #endif
 
 DEFINE_UNEXPORTED_SHIM(int, scsi_scan_host_selected, CP_LIST(struct Scsi_Host *shost, unsigned int channel, unsigned int id, u64 lun, int rescan), CP_LIST(shost, channel, id, lun, rescan), -EIO);
@@ -111,3 +143,68 @@ DEFINE_UNEXPORTED_INIT_SHIM(int, elevator_setup, CP_LIST(char *str), CP_LIST(str
 
 DEFINE_DYNAMIC_SHIM(void, usb_register_notify, CP_LIST(struct notifier_block *nb), CP_LIST(nb), __VOID_RETURN__);
 DEFINE_DYNAMIC_SHIM(void, usb_unregister_notify, CP_LIST(struct notifier_block *nb), CP_LIST(nb), __VOID_RETURN__);
+
+struct cp_binding {
+    const char *name;
+    u8 *slot;
+};
+#define CP_BINDING(org_function_name) { .name = #org_function_name, .slot = (u8 *)_##org_function_name }
+
+//All DEFINE_UNEXPORTED_SHIM()s; init & dynamic ones cannot be bound upfront
+static const struct cp_binding cp_bindings[] __initconst = {
+    CP_BINDING(cmdline_proc_show),
+    CP_BINDING(flush_tlb_all),
+    CP_BINDING(do_execve),
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+#ifndef CONFIG_AUDITSYSCALL
+    CP_BINDING(final_putname),
+#else
+    CP_BINDING(putname),
+#endif
+#else
+    CP_BINDING(getname),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+    CP_BINDING(getname_kernel),
+#endif
+    CP_BINDING(putname),
+#endif
+    CP_BINDING(scsi_scan_host_selected),
+    CP_BINDING(ida_pre_get),
+    CP_BINDING(early_serial_setup),
+    CP_BINDING(serial8250_find_port),
+};
+
+int __init bind_protected_calls(void)
+{
+    u8 code[ARRAY_SIZE(cp_bindings)][CP_JUMP_SIZE];
+    struct ro_mem_write writes[ARRAY_SIZE(cp_bindings)];
+    unsigned int num = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(cp_bindings); i++) {
+        const struct cp_binding *binding = &cp_bindings[i];
+        unsigned long addr = kln_cached(binding->name);
+        if (unlikely(addr == 0)) { //not fatal unless someone calls it (& then the slot reports it)
+            pr_loc_dbg("Cannot bind %s() - symbol not found", binding->name);
+            continue;
+        }
+
+        long rel = (long)addr - (long)(binding->slot + CP_JUMP_SIZE);
+        if (unlikely(rel != (s32)rel)) {
+            pr_loc_wrn("Cannot bind %s()<%lx> - out of rel32 range (it will be called indirectly)",
+                       binding->name, addr);
+            continue;
+        }
+
+        code[num][0] = CP_JUMP_OPCODE;
+        *(s32 *)&code[num][1] = (s32)rel;
+        writes[num].dst = binding->slot;
+        writes[num].src = code[num];
+        writes[num].len = CP_JUMP_SIZE;
+        ++num;
+    }
+
+    memcpy_to_ro_mem_batch(writes, num);
+    pr_loc_dbg("Bound %u of %zu protected calls", num, ARRAY_SIZE(cp_bindings));
+
+    return 0;
+}
@@ -10,6 +10,16 @@
 #define is_system_booting() (system_state == SYSTEM_BOOTING)
 
 // ************************** Exports of normally protected functions ************************** //
+/**
+ * Resolves all protected calls at once & patches them into direct jumps (see CP_JUMP_SLOT() in call_protected.c)
+ *
+ * Protected calls work before (& without) it - they're just slower, as the symbol is looked up on every call. It must
+ * be called before anything else in the module can call them (i.e. right after the symbol cache is filled).
+ *
+ * @return 0 on success or -E on error
+ */
+int bind_protected_calls(void);
+
 
 //A usual macros to make defining them easier & consistent with .c implementation
 #define CP_LIST(...) __VA_ARGS__ //used to pass a list of arguments as a single argument
@@ -51,6 +61,12 @@ CP_DECLARE_SHIM(int, do_execve, CP_LIST(struct filename *filename,
         const char __user *const __user *__argv,
         const char __user *const __user *__envp));
 CP_DECLARE_SHIM(struct filename *, getname, CP_LIST(const char __user *name));
+//Only used when execve() is redirected to a different file - the original name is not passed to do_execve() then.
+// It was added in v3.16; see redirect_execve() for older kernels.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+CP_DECLARE_SHIM(struct filename *, getname_kernel, CP_LIST(const char *name));
+#endif
+CP_DECLARE_SHIM(void, putname, CP_LIST(struct filename *name));
 #endif
 
 //The following functions are used by vUART and uart_fixer
@@ -0,0 +1,76 @@
+#include "ata_helper.h"
+
+#define BYTE_LANES_MASK 0x00ff00ff00ff00ffULL
+#define WORD_LANES_MASK 0x0000ffff0000ffffULL
+#define MAX_WORDS_PER_FOLD 128 //every 16-bit lane gets at most 2*0xff per word, so it can take 128 words w/o overflow
+
+u8 ata_bytes_sum(const u8 *buff, unsigned int len)
+{
+    u64 sum = 0;
+
+    //Bytes are summed word-at-a-time: even & odd bytes of every 64-bit word are added into four 16-bit lanes, which
+    // are folded horizontally into two 32-bit lanes and then into the total
+    while (len >= sizeof(u64)) {
+        u64 lanes = 0;
+        for (unsigned int i = 0; i < MAX_WORDS_PER_FOLD && len >= sizeof(u64); i++) {
+            u64 word;
+            memcpy(&word, buff, sizeof(word)); //buffers start after ioctl header so they're never aligned
+            lanes += (word & BYTE_LANES_MASK) + ((word >> 8) & BYTE_LANES_MASK);
+            buff += sizeof(u64);
+            len -= sizeof(u64);
+        }
+        lanes = (lanes & WORD_LANES_MASK) + ((lanes >> 16) & WORD_LANES_MASK);
+        sum += (lanes & 0xffffffff) + (lanes >> 32);
+    }
+
+    while (len--)
+        sum += *buff++;
+
+    return (u8)sum;
+}
+
+void ata_calc_sector_checksum(u8 *buff)
+{
+    //The checksum byte is part of the sum, so that a sector with a non-zeroed checksum byte yields the same result as
+    // the historical byte-by-byte implementation
+    buff[(ATA_SECT_SIZE-1)] = (u8)(0 - (u8)(buff[(ATA_SECT_SIZE-1)] + ata_bytes_sum(buff, ATA_SECT_SIZE-1)));
+}
+
+void ata_patch_sector(u8 *buff, unsigned int offset, const u8 *data, unsigned int len)
+{
+    if (unlikely(offset + len > ATA_SECT_SIZE-1)) {
+        pr_loc_bug("Patch of %u bytes at %u overlaps the checksum byte", len, offset);
+        return;
+    }
+
+    u8 old_sum = ata_bytes_sum(buff + offset, len);
+    memcpy(buff + offset, data, len);
+    buff[(ATA_SECT_SIZE-1)] += (u8)(old_sum - ata_bytes_sum(buff + offset, len));
+}
+
+void ata_calc_integrity_word(u16 *word_buff)
+{
+    u8 *byte_buff = (u8 *)word_buff;
+
+    byte_buff[(ATA_SECT_SIZE-2)] = (u8)(0 - (u8)(byte_buff[(ATA_SECT_SIZE-2)] +
+                                                 ata_bytes_sum(byte_buff, ATA_SECT_SIZE-2)));
+    byte_buff[(ATA_SECT_SIZE-1)] = 0xa5;
+}
+
+void set_ata_string(u8 *dst, const char *src, u8 length)
+{
+    if (unlikely(length % 2 != 0)) {
+        pr_loc_bug("Length must be even but got %d", length);
+        --length;
+    }
+
+    memset(dst, 0x20, length); //fields in ATA/ATAPI are space-padded and not terminated by \0
+    for (u8 i = 0; i < length; i += 2)
+    {
+        if (src[i] == '\0')
+            break;
+
+        dst[i + 1] = src[i];
+        dst[i] = src[i + 1];
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef REDPILL_ATA_HELPER_H
+#define REDPILL_ATA_HELPER_H
+
+#include "../../compat/userspace_compat.h" //u8, u16; these helpers are also built for userspace
+
+/**
+ * Sums bytes of a buffer modulo 256 (which is what all ATA checksums are based on)
+ *
+ * It's done word-at-a-time so it's a couple of times faster than a naive loop for a full sector.
+ *
+ * @return sum of all bytes, truncated to 8 bits
+ */
+u8 ata_bytes_sum(const u8 *buff, unsigned int len);
+
+/**
+ * Calculates a standard per-sector ATA checksum
+ *
+ * ATA/ATAPI-6 standard contains the same checksum references in many places. It's always saved in the last byte of a
+ * sector (index 511). It is described e.g. in "Table 5: SMART Attribute Entry Format". It's defined as "Two's
+ * complement checksum of preceding 511B[ytes]". Wikipedia has a great article about that as well.
+ *
+ * @param buff A single-sector sized buffer to compute & save checksum to
+ */
+void ata_calc_sector_checksum(u8 *buff);
+
+/**
+ * Overwrites a part of a sector which already has a valid checksum & adjusts the checksum instead of recalculating it
+ *
+ * This is meant for pages generated once and then updated in a few places (e.g. counters in SMART values).
+ *
+ * @param buff A single-sector sized buffer with a valid checksum (see ata_calc_sector_checksum())
+ * @param offset Position in the sector to write to
+ * @param data Data to write
+ * @param len Length of data; offset+len cannot reach the checksum byte
+ */
+void ata_patch_sector(u8 *buff, unsigned int offset, const u8 *data, unsigned int len);
+
+/**
+ * Calculates a standard per-worded structure ATA checksum
+ *
+ * In principal it's almost the same thing as ata_calc_sector_checksum() but with some constant added to be 16 bits.
+ * See "8.16.64 Word 255: Integrity word". Checksum is always saved in word 255.
+ *
+ * @param word_buff A 255-word (each 16 bits) sized buffer to compute & save checksum to
+ */
+void ata_calc_integrity_word(u16 *word_buff);
+
+/**
+ * ATA/ATAPI uses "strings" which are LE arranged 8 bit characters into 16 bit words padded with spaces to full length
+ *
+ * Example of 10 character ATA field:
+ *  =normal=> "TEST12"
+ *  =ATA====> "ETTS21    "
+ *
+ * @param dst buffer to copy the string to
+ * @param src standard NULL-byte terminated text
+ * @param length ATA field length; must be even
+ */
+void set_ata_string(u8 *dst, const char *src, u8 length);
+
+#endif //REDPILL_ATA_HELPER_H
@@ -0,0 +1,131 @@
+/**
+ * Matching of many glob patterns in a single pass
+ *
+ * All patterns are compiled into one bit-parallel NFA (a "shift-and" automaton). Every pattern gets one bit for its
+ * start state and one bit per character it has to consume. Bit N being set after reading a character means that the
+ * pattern matched its first N characters so far. For every character read the whole state moves by one bit (masked by
+ * the bits of patterns' characters which accept it) and states followed by "*" simply stay active. That makes matching
+ * a handful of shifts & ANDs per character for up to 64 bits of patterns. If patterns don't fit in 64 bits more banks
+ * are used - they're independent automata, so the string is walked once per bank.
+ *
+ * See https://en.wikipedia.org/wiki/Bitap_algorithm for the general idea.
+ */
+#include "glob_helper.h"
+#include "../../common.h"
+#include <linux/err.h> //ERR_PTR()
+
+#define GLOB_BANK_BITS 64
+
+struct glob_bank {
+    u64 init; //start state of every pattern
+    u64 loop; //states which are followed by "*" (they stay active regardless of the character)
+    u64 final; //accepting state of every pattern
+    u64 chars[256]; //states which can be entered when a given character is read
+};
+
+struct glob_set {
+    enum rp_mem_owner owner;
+    unsigned int banks_num;
+    struct glob_bank banks[];
+};
+
+/**
+ * Counts characters a pattern has to consume (i.e. everything but "*")
+ */
+static unsigned int count_pattern_tokens(const char *pattern)
+{
+    unsigned int tokens = 0;
+    for (; *pattern; pattern++) {
+        if (*pattern != '*')
+            tokens++;
+    }
+
+    return tokens;
+}
+
+/**
+ * Adds a single pattern to the bank starting at a given bit
+ */
+static void compile_pattern(struct glob_bank *bank, const char *pattern, unsigned int base)
+{
+    u64 state = 1ULL << base;
+    bank->init |= state;
+
+    for (; *pattern; pattern++) {
+        if (*pattern == '*') {
+            bank->loop |= state;
+            continue;
+        }
+
+        state <<= 1;
+        if (*pattern == '?') {
+            for (int c = 1; c < 256; c++)
+                bank->chars[c] |= state;
+        } else {
+            bank->chars[(unsigned char)*pattern] |= state;
+        }
+    }
+
+    bank->final |= state;
+}
+
+struct glob_set *glob_set_compile(const char *const *patterns, unsigned int num, enum rp_mem_owner owner)
+{
+    unsigned int banks_num = 0, used = GLOB_BANK_BITS, i;
+    for (i = 0; i < num; i++) {
+        unsigned int bits = count_pattern_tokens(patterns[i]) + 1;
+        if (unlikely(bits > GLOB_MAX_PATTERN_TOKENS + 1)) {
+            pr_loc_err("Pattern \"%s\" is too long (max %d characters besides \"*\")", patterns[i],
+                       GLOB_MAX_PATTERN_TOKENS);
+            return ERR_PTR(-E2BIG);
+        }
+
+        if (used + bits > GLOB_BANK_BITS) {
+            banks_num++;
+            used = 0;
+        }
+        used += bits;
+    }
+
+    struct glob_set *set;
+    kzalloc_or_exit_ptr(set, sizeof(struct glob_set) + sizeof(struct glob_bank) * banks_num, owner);
+    set->owner = owner;
+    set->banks_num = banks_num;
+
+    struct glob_bank *bank = NULL;
+    used = GLOB_BANK_BITS;
+    for (i = 0; i < num; i++) {
+        unsigned int bits = count_pattern_tokens(patterns[i]) + 1;
+        if (used + bits > GLOB_BANK_BITS) {
+            bank = bank ? bank + 1 : set->banks;
+            used = 0;
+        }
+
+        compile_pattern(bank, patterns[i], used);
+        used += bits;
+    }
+
+    pr_loc_dbg("Compiled %u glob pattern(s) into %u bank(s)", num, banks_num);
+    return set;
+}
+
+bool glob_set_match(const struct glob_set *set, const char *str)
+{
+    for (unsigned int i = 0; i < set->banks_num; i++) {
+        const struct glob_bank *bank = &set->banks[i];
+        u64 state = bank->init;
+        for (const unsigned char *ptr = (const unsigned char *)str; *ptr && state; ptr++)
+            state = ((state << 1) & bank->chars[*ptr]) | (state & bank->loop);
+
+        if (state & bank->final)
+            return true;
+    }
+
+    return false;
+}
+
+void glob_set_free(struct glob_set *set)
+{
+    if (set)
+        rp_kfree(set, set->owner);
+}
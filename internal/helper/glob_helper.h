@@ -0,0 +1,41 @@
+#ifndef REDPILL_GLOB_HELPER_H
+#define REDPILL_GLOB_HELPER_H
+
+#include "../mem_accounting.h" //enum rp_mem_owner
+#include <linux/types.h> //bool
+
+/**
+ * A set of glob patterns compiled into a single automaton
+ *
+ * Supported wildcards are "*" (any string, including "/" and an empty one) and "?" (any single character). Everything
+ * else is matched literally, and every pattern must match the whole string (so a prefix rule is "/foo/*").
+ */
+struct glob_set;
+
+#define GLOB_MAX_PATTERN_TOKENS 63 //max number of non-"*" characters in a single pattern
+
+/**
+ * Compiles patterns into a set
+ *
+ * @param patterns Array of patterns; they're not referenced after this function returns
+ * @param num Number of patterns
+ * @param owner Subsystem the set's memory is accounted for
+ *
+ * @return set ptr on success or ERR_PTR(-E) on error
+ */
+struct glob_set *glob_set_compile(const char *const *patterns, unsigned int num, enum rp_mem_owner owner);
+
+/**
+ * Checks if any pattern from the set matches a given string
+ *
+ * This is a single pass over the string regardless of the number of patterns (as long as they fit in 64 bits of state;
+ * each pattern takes its number of non-"*" characters + 1).
+ */
+bool glob_set_match(const struct glob_set *set, const char *str);
+
+/**
+ * Frees set created with glob_set_compile(); NULL is a noop
+ */
+void glob_set_free(struct glob_set *set);
+
+#endif //REDPILL_GLOB_HELPER_H
@@ -1,5 +1,5 @@
 #include "math_helper.h"
-#include <linux/random.h> //prandom_u32()
+#include "../../compat/userspace_compat.h" //likely(), prandom_u32(); this helper is also built for userspace
 
 int prandom_int_range_stable(int *cur_val, int dev, int min, int max)
 {
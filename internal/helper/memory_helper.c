@@ -1,44 +1,129 @@
 /**
- * TODO: look into override_symbol to check if there's any docs
+ * Helpers for writing to write-protected kernel memory
+ *
+ * Changing page attributes (set_mem_addr_rw()/set_mem_addr_ro()) requires a global TLB flush each time, which means
+ * IPIs to all cores - twice for every write. For short writes (e.g. installing a trampoline or replacing a pointer)
+ * it's much cheaper to temporarily clear the CR0.WP bit on the local CPU with interrupts disabled: the page tables are
+ * never modified so nothing needs to be flushed and other CPUs aren't affected at all. Kernels v5.3+ pin CR0.WP so
+ * there we fall back to changing page attributes.
  */
 #include "memory_helper.h"
 #include "../../common.h"
 #include "../call_protected.h" //_flush_tlb_all()
+#include "../metrics.h" //RP_METRIC(), rp_metric_*()
+#include <linux/version.h> //KERNEL_VERSION()
+#include <linux/irqflags.h> //local_irq_save(), local_irq_restore()
+#include <linux/percpu.h> //DEFINE_PER_CPU, this_cpu_read(), this_cpu_write()
+#include <linux/string.h> //memcpy()
 #include <asm/cacheflush.h> //PAGE_ALIGN
 #include <asm/page_types.h> //PAGE_SIZE
 #include <asm/pgtable_types.h> //_PAGE_RW
+#include <asm/processor-flags.h> //X86_CR0_WP
+#include <asm/special_insns.h> //read_cr0(), write_cr0()
 
 #define PAGE_ALIGN_BOTTOM(addr) (PAGE_ALIGN(addr) - PAGE_SIZE) //aligns the memory address to bottom of the page boundary
 #define NUM_PAGES_BETWEEN(low, high) (((PAGE_ALIGN_BOTTOM(high) - PAGE_ALIGN_BOTTOM(low)) / PAGE_SIZE) + 1)
 
-void set_mem_addr_rw(const unsigned long vaddr, unsigned long len)
+#ifdef RO_MEM_WRITE_CR0_WP
+static RP_METRIC(ro_mem_irqoff_ns, RP_MG_LATENCY, RP_METRIC_HISTOGRAM); //CR0.WP cleared with IRQs disabled
+static RP_METRIC(ro_mem_irqoff_max_ns, RP_MG_LATENCY, RP_METRIC_GAUGE);
+static struct rp_metric *const ro_mem_metrics[] = { &ro_mem_irqoff_ns, &ro_mem_irqoff_max_ns };
+static DEFINE_PER_CPU(u64, ro_mem_write_start); //the section cannot nest nor migrate
+#endif
+
+/**
+ * Changes R/W attribute of all pages spanning a given memory region without flushing TLBs
+ *
+ * Theoretically this should use set_pte_atomic() but we're touching pages that will not be modified by anything else
+ */
+static void change_pages_rw(const unsigned long vaddr, unsigned long len, bool rw)
 {
     unsigned long addr = PAGE_ALIGN_BOTTOM(vaddr);
-    pr_loc_dbg("Disabling memory protection for page(s) at %p+%lu/%u (<<%p)", (void *) vaddr, len,
-               (unsigned int) NUM_PAGES_BETWEEN(vaddr, vaddr + len), (void *) addr);
+    pr_loc_dbg("%s memory protection for page(s) at %p+%lu/%u (<<%p)", rw ? "Disabling" : "Enabling", (void *) vaddr,
+               len, (unsigned int) NUM_PAGES_BETWEEN(vaddr, vaddr + len), (void *) addr);
 
-    //theoretically this should use set_pte_atomic() but we're touching pages that will not be modified by anything else
     unsigned int level;
-    for(; addr <= vaddr; addr += PAGE_SIZE) {
+    for(; addr <= vaddr + len - 1; addr += PAGE_SIZE) {
         pte_t *pte = lookup_address(addr, &level);
-        pte->pte |= _PAGE_RW;
+        if (rw)
+            pte->pte |= _PAGE_RW;
+        else
+            pte->pte &= ~_PAGE_RW;
     }
+}
 
+void set_mem_addr_rw(const unsigned long vaddr, unsigned long len)
+{
+    change_pages_rw(vaddr, len, true);
     _flush_tlb_all();
 }
 
 void set_mem_addr_ro(const unsigned long vaddr, unsigned long len)
 {
-    unsigned long addr = PAGE_ALIGN_BOTTOM(vaddr);
-    pr_loc_dbg("Enabling memory protection for page(s) at %p+%lu/%u (<<%p)", (void *) vaddr, len,
-               (unsigned int) NUM_PAGES_BETWEEN(vaddr, vaddr + len), (void *) addr);
+    change_pages_rw(vaddr, len, false);
+    _flush_tlb_all();
+}
 
-    //theoretically this should use set_pte_atomic() but we're touching pages that will not be modified by anything else
-    unsigned int level;
-    for(; addr <= vaddr; addr += PAGE_SIZE) {
-        pte_t *pte = lookup_address(addr, &level);
-        pte->pte &= ~_PAGE_RW;
-    }
+unsigned long __ro_mem_write_begin(const unsigned long vaddr, unsigned long len)
+{
+#ifdef RO_MEM_WRITE_CR0_WP
+    unsigned long flags;
+
+    local_irq_save(flags); //we cannot get migrated nor interrupted with WP disabled
+    this_cpu_write(ro_mem_write_start, rp_metric_clock());
+    write_cr0(read_cr0() & ~X86_CR0_WP);
+
+    return flags;
+#else
+    set_mem_addr_rw(vaddr, len);
+    return 0;
+#endif
+}
+
+void __ro_mem_write_end(const unsigned long vaddr, unsigned long len, unsigned long state)
+{
+#ifdef RO_MEM_WRITE_CR0_WP
+    write_cr0(read_cr0() | X86_CR0_WP);
+    rp_metric_time_end_max(&ro_mem_irqoff_ns, &ro_mem_irqoff_max_ns, this_cpu_read(ro_mem_write_start));
+    local_irq_restore(state);
+#else
+    set_mem_addr_ro(vaddr, len);
+#endif
+}
+
+void memcpy_to_ro_mem(void *dst, const void *src, size_t len)
+{
+    WITH_MEM_UNLOCKED(dst, len, memcpy(dst, src, len););
+}
+
+void memcpy_to_ro_mem_batch(const struct ro_mem_write *writes, unsigned int num)
+{
+    unsigned int i;
+#ifdef RO_MEM_WRITE_CR0_WP
+    unsigned long flags = __ro_mem_write_begin(0, 0); //CR0.WP doesn't care about the address
+    for (i = 0; i < num; i++)
+        memcpy(writes[i].dst, writes[i].src, writes[i].len);
+    __ro_mem_write_end(0, 0, flags);
+#else
+    //All pages are flipped first so that the whole batch costs two TLB flushes regardless of its size
+    for (i = 0; i < num; i++)
+        change_pages_rw((unsigned long)writes[i].dst, writes[i].len, true);
+    _flush_tlb_all();
 
+    for (i = 0; i < num; i++)
+        memcpy(writes[i].dst, writes[i].src, writes[i].len);
+
+    for (i = 0; i < num; i++)
+        change_pages_rw((unsigned long)writes[i].dst, writes[i].len, false);
     _flush_tlb_all();
-}
\ No newline at end of file
+#endif
+}
+
+int register_memory_helper_metrics(void)
+{
+#ifdef RO_MEM_WRITE_CR0_WP
+    rp_metrics_register(ro_mem_metrics, ARRAY_SIZE(ro_mem_metrics));
+#endif
+
+    return 0;
+}
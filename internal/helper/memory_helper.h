@@ -1,13 +1,62 @@
 #ifndef REDPILL_MEMORY_HELPER_H
 #define REDPILL_MEMORY_HELPER_H
 
-#define WITH_MEM_UNLOCKED(vaddr, size, code)           \
-    do {                                               \
-        set_mem_addr_rw((unsigned long)(vaddr), size); \
-        ({code});                                      \
-        set_mem_addr_ro((unsigned long)(vaddr), size); \
+#include <linux/types.h> //size_t
+#include <linux/version.h> //KERNEL_VERSION()
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,3,0)
+#define RO_MEM_WRITE_CR0_WP //CR0.WP is not pinned - writes don't touch page tables (see memory_helper.c)
+#endif
+
+/**
+ * Executes code with write-protection of a given memory region disabled
+ *
+ * On kernels <v5.3 the code is executed with interrupts disabled on the local CPU, so it must be short & cannot sleep.
+ * On v5.3+ pages are flipped to R/W instead, which flushes TLBs on all CPUs - then it cannot be used with interrupts
+ * disabled (see ro_mem_write_irqs_off_safe()). See memory_helper.c for details.
+ */
+#define WITH_MEM_UNLOCKED(vaddr, size, code)                                               \
+    do {                                                                                   \
+        unsigned long __mem_wp_state = __ro_mem_write_begin((unsigned long)(vaddr), size); \
+        ({code});                                                                          \
+        __ro_mem_write_end((unsigned long)(vaddr), size, __mem_wp_state);                  \
     } while(0)
 
+/**
+ * Copies data to a write-protected memory (e.g. kernel .text or .rodata)
+ *
+ * This should be used for all writes to protected memory as it picks the cheapest patching method available. It can
+ * be called while holding a spinlock, but with interrupts disabled only if ro_mem_write_irqs_off_safe() - on v5.3+ it
+ * flushes TLBs on all CPUs, which requires IPIs.
+ */
+void memcpy_to_ro_mem(void *dst, const void *src, size_t len);
+
+/**
+ * Whether memcpy_to_ro_mem() & friends can be used with interrupts disabled (i.e. they don't send IPIs)
+ */
+static inline bool ro_mem_write_irqs_off_safe(void)
+{
+#ifdef RO_MEM_WRITE_CR0_WP
+    return true;
+#else
+    return false;
+#endif
+}
+
+struct ro_mem_write {
+    void *dst;
+    const void *src;
+    size_t len;
+};
+
+/**
+ * Performs multiple memcpy_to_ro_mem() within a single unlocked section
+ *
+ * Use it when many unrelated places need to be patched at once (e.g. installing multiple trampolines) - protection is
+ * lifted (and TLBs flushed, if needed) only once for the whole batch.
+ */
+void memcpy_to_ro_mem_batch(const struct ro_mem_write *writes, unsigned int num);
+
 /**
  * Disables write-protection for the memory where symbol resides
  *
@@ -24,6 +73,9 @@
  * function is removed in newer kernels.
  * The easiest way is to just lookup the page table entry for a given address, modify the R/W attribute directly and
  * dump CPU caches. This will work as there's no middle-man to mess with our request.
+ *
+ * Warning: this flushes TLBs on ALL CPUs (=IPIs to every core). Unless you need the memory unlocked for a long time
+ * you should use memcpy_to_ro_mem() or WITH_MEM_UNLOCKED() instead.
  */
 void set_mem_addr_rw(const unsigned long vaddr, unsigned long len);
 
@@ -34,4 +86,17 @@ void set_mem_addr_rw(const unsigned long vaddr, unsigned long len);
  */
 void set_mem_addr_ro(const unsigned long vaddr, unsigned long len);
 
+/**
+ * Registers metrics of sections with write-protection disabled (in the "latency" group)
+ *
+ * Writes done before it aren't measured, so it should be called before anything patches the kernel.
+ *
+ * @return 0 on success or -E on error
+ */
+int register_memory_helper_metrics(void);
+
+/****************** Private helpers (should not be used directly by any code outside of this unit!) *******************/
+unsigned long __ro_mem_write_begin(const unsigned long vaddr, unsigned long len);
+void __ro_mem_write_end(const unsigned long vaddr, unsigned long len, unsigned long state);
+
 #endif //REDPILL_MEMORY_HELPER_H
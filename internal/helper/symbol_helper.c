@@ -1,96 +1,131 @@
 #include "symbol_helper.h" //kln_func
-#include <linux/module.h> //__symbol_get(), __symbol_put()
+#include <linux/module.h> //__symbol_get(), __symbol_put(), __module_address()
 #include <linux/kallsyms.h> //kallsyms_lookup_name
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_*
+#include <linux/jhash.h> //jhash()
+#include <linux/spinlock.h> //spin_lock_irqsave(), spin_unlock_irqrestore()
 #include "../../common.h" //pr_loc_*
 
 unsigned long (*kln_func)(const char* name) = NULL;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,7,0)
-int get_kln_p(void)
+int __init get_kln_p(void)
 {
     kln_func = kallsyms_lookup_name;
     return 0;
 }
 #else
+#include <linux/string.h> //strchr(), strncmp()
+#ifdef CONFIG_KPROBES
+#include <linux/kprobes.h> //register_kprobe(), unregister_kprobe()
+#endif
+
 /*
- * In kernel version 5.7, kallsyms_lookup_name() was unexported, so we can't use it anymore.
- * The alternative method below is slower (but not really noticably), and works by brute-forcing
- * possible addresses for the function name by starting at the kernel base address and using
- * sprint_symbol() (which is still exported) to check if the symbol name at each address
- * matches the one we want.
- * 
- * https://github.com/xcellerator/linux_kernel_hacking/blob/446789fd152d2663cd2c7d7f8a5aaae873a92a30/3_RootkitTechniques/3.3_set_root/ftrace_helper.h
+ * In kernel version 5.7, kallsyms_lookup_name() was unexported, so we can't use it anymore. Everything else can be
+ * found using kallsyms_lookup_name() itself, so we only need to find that one function once.
+ *
+ * When kprobes are available the kernel will happily resolve the address for us while registering a probe (which is
+ * removed right away). Syno kernels usually ship without kprobes, so there's also a fallback using sprint_symbol() (which is still
+ * exported). It returns "name+0xoffset/0xsize" for any address, which lets us hop from one symbol to the next instead of
+ * probing every possible address. Both sprint_symbol() and kallsyms_lookup_name() live in kernel/kallsyms.c, so we start
+ * from sprint_symbol() and walk in both directions - that takes a few dozen steps instead of a million.
+ *
+ * https://github.com/xcellerator/linux_kernel_hacking/issues/3
  */
-static unsigned long kaddr_lookup_name(const char *fname_raw)
-{
-    int i;
-    unsigned long kaddr;
-    char *fname_lookup, *fname;
+#define KADDR_WALK_MAX_STEPS 4096 //how many symbols to check in each direction around sprint_symbol()
+#define KADDR_SCAN_LEN 0x1000000 //how far from the kernel base to look if the walk around sprint_symbol() fails
 
-    fname_lookup = kzalloc(255, GFP_KERNEL);
-    if (!fname_lookup)
+#ifdef CONFIG_KPROBES
+static unsigned long __init kaddr_lookup_name_kprobe(const char *fname)
+{
+    struct kprobe kp = { .symbol_name = fname };
+    if (register_kprobe(&kp) != 0)
         return 0;
 
-    fname = kzalloc(strlen(fname_raw)+4, GFP_KERNEL);
-    if (!fname)
+    unsigned long kaddr = (unsigned long)kp.addr;
+    unregister_kprobe(&kp);
+
+    return kaddr;
+}
+#else
+#define kaddr_lookup_name_kprobe(dummy) (0)
+#endif
+
+/**
+ * Resolves symbol at a given address
+ *
+ * @param buf Buffer of at least KSYM_SYMBOL_LEN
+ * @return true if the symbol at kaddr is fname, false otherwise
+ */
+static bool __init kaddr_get_symbol(char *buf, unsigned long kaddr, const char *fname, size_t fname_len,
+                                    unsigned long *offset, unsigned long *size)
+{
+    sprint_symbol(buf, kaddr);
+    char *plus = strchr(buf, '+');
+    if (!plus || sscanf(plus, "+%lx/%lx", offset, size) != 2 || *size == 0) { //no symbol there
+        *offset = 0;
+        *size = 0;
+        return false;
+    }
+
+    return (plus - buf) == fname_len && strncmp(buf, fname, fname_len) == 0;
+}
+
+static unsigned long __init kaddr_lookup_name(const char *fname)
+{
+    unsigned long kaddr = kaddr_lookup_name_kprobe(fname);
+    if (kaddr) {
+        pr_loc_dbg("Found %s using kprobe", fname);
+        return kaddr;
+    }
+
+    char *buf = kmalloc(KSYM_SYMBOL_LEN, GFP_KERNEL);
+    if (!buf)
         return 0;
 
-    /*
-     * We have to add "+0x0" to the end of our function name
-     * because that's the format that sprint_symbol() returns
-     * to us. If we don't do this, then our search can stop
-     * prematurely and give us the wrong function address!
-     */
-    strcpy(fname, fname_raw);
-    strcat(fname, "+0x0");
-
-    /*
-     * Get the kernel base address:
-     * sprint_symbol() is less than 0x100000 from the start of the kernel, so
-     * we can just AND-out the last 3 bytes from it's address to the the base
-     * address.
-     * There might be a better symbol-name to use?
-     */
-    kaddr = (unsigned long) &sprint_symbol;
-    kaddr &= 0xffffffffff000000;
-
-    /*
-     * All the syscalls (and all interesting kernel functions I've seen so far)
-     * are within the first 0x100000 bytes of the base address. However, the kernel
-     * functions are all aligned so that the final nibble is 0x0, so we only
-     * have to check every 16th address.
-     */
-    for ( i = 0x0 ; i < 0x100000 ; i++ )
-    {
-        /*
-         * Lookup the name ascribed to the current kernel address
-         */
-        sprint_symbol(fname_lookup, kaddr);
-
-        /*
-         * Compare the looked-up name to the one we want
-         */
-        if ( strncmp(fname_lookup, fname, strlen(fname)) == 0 )
-        {
-            /*
-             * Clean up and return the found address
-             */
-            kfree(fname_lookup);
-            return kaddr;
-        }
-        /*
-         * Jump 16 addresses to next possible address
-         */
-        kaddr += 0x10;
+    size_t fname_len = strlen(fname);
+    unsigned long offset, size;
+    unsigned long start = (unsigned long)&sprint_symbol;
+    int i;
+
+    //Forward: the next symbol starts right after the end of the current one
+    kaddr = start;
+    for (i = 0; i < KADDR_WALK_MAX_STEPS; i++) {
+        if (kaddr_get_symbol(buf, kaddr, fname, fname_len, &offset, &size))
+            goto found;
+        if (!size)
+            break;
+        kaddr = kaddr - offset + size;
+    }
+
+    //Backward: the byte just before the current symbol belongs to the previous one
+    kaddr = start;
+    for (i = 0; i < KADDR_WALK_MAX_STEPS; i++) {
+        if (kaddr_get_symbol(buf, kaddr, fname, fname_len, &offset, &size))
+            goto found;
+        if (!size)
+            break;
+        kaddr = kaddr - offset - 1;
     }
-    /*
-     * We didn't find the name, so clean up and return 0
-     */
-    kfree(fname_lookup);
+
+    //Last resort: walk everything from the kernel base (functions are 16-byte aligned, gaps are skipped in such steps)
+    pr_loc_dbg("%s not found near sprint_symbol() - scanning the whole kernel text", fname);
+    unsigned long base = start & 0xffffffffff000000;
+    for (kaddr = base; kaddr < base + KADDR_SCAN_LEN; ) {
+        if (kaddr_get_symbol(buf, kaddr, fname, fname_len, &offset, &size))
+            goto found;
+        kaddr = size ? (kaddr - offset + size) : (kaddr + 0x10);
+    }
+
+    kfree(buf);
     return 0;
+
+    found:
+    kfree(buf);
+    return kaddr - offset;
 }
 
-int get_kln_p(void)
+int __init get_kln_p(void)
 {
     kln_func = (long unsigned int (*)(const char *))kaddr_lookup_name("kallsyms_lookup_name");
     if (kln_func == 0) {
@@ -108,5 +143,203 @@ bool kernel_has_symbol(const char *name) {
 
         return true;
     }
-    return kln_func(name) != 0;
+    return kln_cached(name) != 0;
+}
+
+/*
+ * SYMBOL CACHE
+ * The kallsyms_lookup_name() is a linear scan (with decompression of every name) over tens of thousands of symbols.
+ * Many parts of this module need the same addresses over and over so they're kept in a small hashtable. All symbols
+ * listed in cache_prefill_names[] are resolved in a single pass over kallsyms when the module loads; everything else is
+ * added when it's looked up for the first time.
+ * Only symbols from the core kernel are cached: modules can be unloaded and loaded again at a different address. Misses
+ * are not cached either as the symbol may appear later (e.g. when the module providing it is loaded).
+ */
+#define SYMBOL_CACHE_BITS 6
+
+struct symbol_cache_entry {
+    struct hlist_node node;
+    u32 hash;
+    unsigned long addr;
+    char name[];
+};
+
+static DEFINE_HASHTABLE(symbol_cache, SYMBOL_CACHE_BITS);
+static DEFINE_SPINLOCK(symbol_cache_lock);
+static unsigned int symbol_cache_pending __initdata = 0; //how many prefill entries are waiting for the address
+
+//Symbols which are commonly used by this module - this list is only an optimization and doesn't have to be complete
+static const char *const cache_prefill_names[] __initconst = {
+    "cmdline_proc_show", "flush_tlb_all", "do_execve", "getname", "getname_kernel", "putname", "final_putname",
+    "scsi_scan_host_selected", "ida_pre_get", "early_serial_setup", "serial8250_find_port", "elevator_setup",
+    "sys_call_table", "sys_close", "sys_open", "sys_read", "sys_write", "SyS_execve", "__x64_sys_execve",
+    "sd_fops", "uart_match_port", "apply_relocate_add", "driver_register", "syno_ahci_disk_led_enable",
+    "syno_ahci_disk_led_enable_by_port",
+};
+
+static inline u32 symbol_cache_hash(const char *name)
+{
+    return jhash(name, strlen(name), 0);
+}
+
+//This expects symbol_cache_lock to be held
+static struct symbol_cache_entry *symbol_cache_find(const char *name, u32 hash)
+{
+    struct symbol_cache_entry *entry;
+    hash_for_each_possible(symbol_cache, entry, node, hash) {
+        if (entry->hash == hash && strcmp(entry->name, name) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+static bool is_core_kernel_addr(unsigned long addr)
+{
+    preempt_disable();
+    bool is_module = !!__module_address(addr);
+    preempt_enable();
+
+    return !is_module;
+}
+
+static struct symbol_cache_entry *symbol_cache_new(const char *name, u32 hash, unsigned long addr, gfp_t gfp)
+{
+    struct symbol_cache_entry *entry = kmalloc(sizeof(struct symbol_cache_entry) + strsize(name), gfp);
+    if (unlikely(!entry))
+        return NULL;
+
+    rp_mem_alloced(RP_MEM_SYMBOLS, entry);
+    entry->hash = hash;
+    entry->addr = addr;
+    strcpy(entry->name, name);
+
+    return entry;
+}
+
+unsigned long kln_cached(const char *name)
+{
+    u32 hash = symbol_cache_hash(name);
+    struct symbol_cache_entry *entry;
+    unsigned long flags, addr = 0;
+
+    spin_lock_irqsave(&symbol_cache_lock, flags);
+    entry = symbol_cache_find(name, hash);
+    if (entry)
+        addr = entry->addr;
+    spin_unlock_irqrestore(&symbol_cache_lock, flags);
+
+    if (likely(addr))
+        return addr;
+
+    addr = kln_func(name);
+    if (!addr || !is_core_kernel_addr(addr))
+        return addr;
+
+    //This can be called from atomic context (e.g. memory_helper) so we cannot sleep; failing to cache isn't a problem
+    entry = symbol_cache_new(name, hash, addr, GFP_ATOMIC);
+    if (unlikely(!entry))
+        return addr;
+
+    spin_lock_irqsave(&symbol_cache_lock, flags);
+    if (symbol_cache_find(name, hash)) //somebody else was faster
+        rp_kfree(entry, RP_MEM_SYMBOLS);
+    else
+        hash_add(symbol_cache, &entry->node, hash);
+    spin_unlock_irqrestore(&symbol_cache_lock, flags);
+
+    return addr;
+}
+
+//Prefill entries are kept separately until the pass is finished as kallsyms_on_each_symbol() may sleep
+static __initdata DEFINE_HASHTABLE(symbol_cache_prefill, SYMBOL_CACHE_BITS);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+static int __init prefill_symbol_cb(void *data, const char *name, struct module *mod, unsigned long addr)
+#else
+static int __init prefill_symbol_cb(void *data, const char *name, unsigned long addr)
+#endif
+{
+    u32 hash = symbol_cache_hash(name);
+    struct symbol_cache_entry *entry;
+    hash_for_each_possible(symbol_cache_prefill, entry, node, hash) {
+        if (entry->hash != hash || strcmp(entry->name, name) != 0)
+            continue;
+
+        if (entry->addr || !is_core_kernel_addr(addr)) //the first match wins, just like in kallsyms_lookup_name()
+            return 0;
+
+        entry->addr = addr;
+        return --symbol_cache_pending == 0; //non-zero stops the iteration
+    }
+
+    return 0;
+}
+
+int __init init_symbol_cache(void)
+{
+    struct symbol_cache_entry *entry;
+    struct hlist_node *tmp;
+    unsigned int bkt;
+    unsigned long flags;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+    int (*each_symbol)(int (*fn)(void *, const char *, struct module *, unsigned long), void *data);
+#else
+    int (*each_symbol)(int (*fn)(void *, const char *, unsigned long), void *data);
+#endif
+    each_symbol = (void *)kln_func("kallsyms_on_each_symbol");
+    if (!each_symbol) {
+        pr_loc_dbg("kallsyms_on_each_symbol() not available - symbol cache will be filled lazily");
+        return 0;
+    }
+
+    symbol_cache_pending = 0;
+    for (int i = 0; i < ARRAY_SIZE(cache_prefill_names); i++) {
+        entry = symbol_cache_new(cache_prefill_names[i], symbol_cache_hash(cache_prefill_names[i]), 0, GFP_KERNEL);
+        if (unlikely(!entry))
+            goto error_out;
+        hash_add(symbol_cache_prefill, &entry->node, entry->hash);
+        symbol_cache_pending++;
+    }
+
+    each_symbol(prefill_symbol_cb, NULL);
+    pr_loc_dbg("Symbol cache prefilled (%u of %zu symbols not found)", symbol_cache_pending,
+               ARRAY_SIZE(cache_prefill_names));
+
+    //Symbols which weren't found (e.g. don't exist on this kernel version) cannot stay as they have no address
+    spin_lock_irqsave(&symbol_cache_lock, flags);
+    hash_for_each_safe(symbol_cache_prefill, bkt, tmp, entry, node) {
+        hash_del(&entry->node);
+        if (entry->addr && !symbol_cache_find(entry->name, entry->hash))
+            hash_add(symbol_cache, &entry->node, entry->hash);
+        else
+            rp_kfree(entry, RP_MEM_SYMBOLS);
+    }
+    spin_unlock_irqrestore(&symbol_cache_lock, flags);
+
+    return 0;
+
+    error_out:
+    pr_loc_crt("kernel memory alloc failure - tried to allocate symbol cache entry");
+    hash_for_each_safe(symbol_cache_prefill, bkt, tmp, entry, node) {
+        hash_del(&entry->node);
+        rp_kfree(entry, RP_MEM_SYMBOLS);
+    }
+    return -ENOMEM;
+}
+
+void free_symbol_cache(void)
+{
+    struct symbol_cache_entry *entry;
+    struct hlist_node *tmp;
+    unsigned int bkt;
+    unsigned long flags;
+
+    spin_lock_irqsave(&symbol_cache_lock, flags);
+    hash_for_each_safe(symbol_cache, bkt, tmp, entry, node) {
+        hash_del(&entry->node);
+        rp_kfree(entry, RP_MEM_SYMBOLS);
+    }
+    spin_unlock_irqrestore(&symbol_cache_lock, flags);
 }
\ No newline at end of file
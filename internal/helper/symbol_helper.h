@@ -10,6 +10,29 @@
 extern unsigned long (*kln_func)(const char*);
 int get_kln_p(void);
 
+/**
+ * Looks up address of a kernel symbol using a shared cache
+ *
+ * This should be used instead of calling kln_func() directly - see symbol_helper.c for details. It's safe to be called
+ * from atomic context.
+ *
+ * @param name name of the symbol
+ * @return address of the symbol or 0 if not found
+ */
+unsigned long kln_cached(const char *name);
+
+/**
+ * Resolves commonly used symbols into the cache in a single pass over kallsyms; this must be called after get_kln_p()
+ *
+ * @return 0 on success or -E on error
+ */
+int init_symbol_cache(void);
+
+/**
+ * Removes all entries from the symbol cache
+ */
+void free_symbol_cache(void);
+
 /**
  * Check if a given symbol exists
  *
@@ -1,118 +1,249 @@
+/**
+ * Allows other parts of the module to be notified when a given driver is registered (and optionally change the outcome)
+ *
+ * Watchers are kept in a hashtable keyed by the driver name. Any number of watchers can observe the same driver - they
+ * are called in the order of registration. The driver_register() replacement looks the name up under RCU only, so the
+ * majority of drivers (which nobody watches) pay a single hash lookup. When watchers are found they're pinned with a
+ * reference and called without any locks held, as callbacks are free to sleep, (un)watch drivers and register drivers.
+ *
+ * COMING & LIVE events require driver_register() to be hooked (through override_hook, so that others can hook it too) -
+ * this is done only while at least one watcher for them exists. The hook cannot be removed from within itself (which is
+ * where the last watcher is usually removed), so it's removed by a work shortly after the last such watcher is gone; a
+ * watcher added while that work is removing it starts receiving events when the work re-adds the hook.
+ * BOUND events come from standard bus notifiers (BUS_NOTIFY_BOUND_DRIVER) on buses listed in watched_buses[] and don't
+ * touch driver_register() at all. Notifiers are registered when the first BOUND watcher is added and stay registered
+ * until unregister_driver_bind_notifiers() (they cannot be removed from within their own callback, which is where
+ * watchers usually unwatch).
+ *
+ * One-shot "driver ready" requests (see on_driver_ready()) are just watchers with a different kind of callback. This
+ * way every subsystem waiting for a driver is fed by the same driver_register() interception & bus notifiers, instead
+ * of walking buses and keeping its own trampoline & watcher state.
+ */
 #include "intercept_driver_register.h"
 #include "../common.h"
-#include "override/override_symbol.h"
+#include "override/override_hook.h" //register_override_hook(), unregister_override_hook()
 #include <linux/platform_device.h> //platform_bus_type
-
-#define MAX_WATCHERS 5 //can be increased as-needed
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_*
+#include <linux/jhash.h> //jhash()
+#include <linux/kref.h> //struct kref, kref_*()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+#include <linux/rcupdate.h> //rcu_read_lock(), kfree_rcu()
+#include <linux/notifier.h> //struct notifier_block, NOTIFY_*
+#include <linux/bitops.h> //test_and_set_bit()
+#include <linux/workqueue.h> //DECLARE_WORK, schedule_work(), flush_work()
+#include "../compat/static_key_compat.h" //RP_DEFINE_STATIC_KEY_FALSE, rp_static_branch_*
+#include "metrics.h" //RP_METRIC(), rp_metric_*()
+#include "../debug/debug_driver_profile.h" //dprof_*(); noop unless built with DBG_DRIVER_PROFILE
+
+extern struct bus_type scsi_bus_type;
+
+#define WATCHERS_BITS 4 //hashtable buckets (as a power of 2); it can hold any number of watchers
 #define WATCH_FUNCTION "driver_register"
+#define READY_CLAIMED_BIT 0 //bit of ready_claimed; set by whoever gets to call or cancel a driver ready request first
 
 struct driver_watcher_instance {
-    watch_dr_callback *cb;
+    struct hlist_node node;
+    struct rcu_head rcu;
+    struct kref refs; //one is held by the table, others by calls in progress
+    bool removed; //set (under watchers_lock) when unwatched; pinned instances can still be seen by calls in progress
+    u32 hash;
+    watch_dr_callback *cb; //NULL for driver ready requests
+    driver_ready_callback *ready_cb; //only for driver ready requests (see on_driver_ready())
+    void *ready_data;
+    unsigned long ready_claimed; //READY_CLAIMED_BIT
     bool notify_coming:1;
     bool notify_live:1;
+    bool notify_bound:1;
     char name[];
 };
 
-static override_symbol_inst *ov_driver_register = NULL;
-static driver_watcher_instance *watchers[MAX_WATCHERS] = { NULL };
+static DEFINE_HASHTABLE(watchers, WATCHERS_BITS);
+static DEFINE_MUTEX(watchers_lock); //serializes changes to the table & the hook state
+static bool watching = false; //driver_register() hook is registered
+static bool watching_stopping = false; //stop_watching_work is removing the hook (without holding watchers_lock)
+static unsigned int override_watchers_num = 0; //watchers requiring driver_register() override (COMING and/or LIVE)
+static unsigned int bound_watchers_num = 0; //watchers of DWATCH_STATE_BOUND
+//Bus notifiers stay registered once added; with no BOUND watchers left every bind skips the lookup (it's just a NOP)
+static RP_DEFINE_STATIC_KEY_FALSE(bound_watchers_present);
+
+static RP_METRIC(dwatch_driver_registers, RP_MG_DRIVER_WATCH, RP_METRIC_COUNTER);
+static RP_METRIC(dwatch_driver_register_ns, RP_MG_DRIVER_WATCH, RP_METRIC_HISTOGRAM);
+static RP_METRIC(dwatch_binds, RP_MG_DRIVER_WATCH, RP_METRIC_COUNTER); //only while there are BOUND watchers
+static RP_METRIC(dwatch_watchers, RP_MG_DRIVER_WATCH, RP_METRIC_GAUGE);
+static struct rp_metric *const dwatch_metrics[] = { &dwatch_driver_registers, &dwatch_driver_register_ns,
+                                                    &dwatch_binds, &dwatch_watchers };
+
+static struct bus_type *const watched_buses[] = { &platform_bus_type, &scsi_bus_type };
+static struct notifier_block bus_nbs[ARRAY_SIZE(watched_buses)];
+static DEFINE_MUTEX(bus_nbs_lock); //never held together with bus notifiers' locks in the reverse order (see below)
+static bool bus_nbs_registered = false;
+
+//A watcher pinned for a single driver_register() call
+struct watcher_call {
+    driver_watcher_instance *watcher;
+    bool done; //watcher returned DWATCH_NOTIFY_DONE & should be removed after the call
+};
 
-/**
- * Finds a registered watcher based on the driver name
- *
- * @return pointer to the spot on the list containing driver_watcher_instance or NULL if not found
- */
-static driver_watcher_instance **match_watcher(const char *name)
+static inline u32 watcher_name_hash(const char *name)
 {
-    for (int i=0; i < MAX_WATCHERS; ++i) {
-        if (!watchers[i])
-            continue; //there could be "holes" due to unwatch calls
+    return jhash(name, strlen(name), 0);
+}
 
-        if(strcmp(name, watchers[i]->name) == 0)
-            return &watchers[i];
-    }
+static void release_watcher(struct kref *ref)
+{
+    driver_watcher_instance *watcher = container_of(ref, driver_watcher_instance, refs);
+    rp_mem_freeing(RP_MEM_DRIVER_WATCH, watcher);
+    kfree_rcu(watcher, rcu);
+}
 
-    return NULL;
+static inline void put_watcher(driver_watcher_instance *watcher)
+{
+    kref_put(&watcher->refs, release_watcher);
 }
 
 /**
- * Finds an empty spot in the watchers list
+ * Pins all watchers observing a given driver name
+ *
+ * @param name Driver name
+ * @param num Set to the number of watchers found
  *
- * @return pointer to the spot on the list which is empty or NULL if not found
+ * @return array of pinned watchers (to be freed with put_watchers()), NULL if there are none, or ERR_PTR(-E) on error
  */
-static driver_watcher_instance **watcher_list_spot(void)
+static struct watcher_call *get_watchers(const char *name, unsigned int *num)
 {
-    for (int i=0; i < MAX_WATCHERS; ++i) {
-        if (!watchers[i])
-            return &watchers[i];
+    u32 hash = watcher_name_hash(name);
+    driver_watcher_instance *watcher;
+    *num = 0;
+
+    //Fast path: nobody is watching this driver (which is true for almost every call)
+    bool found = false;
+    rcu_read_lock();
+    hash_for_each_possible_rcu(watchers, watcher, node, hash) {
+        if (watcher->hash == hash && strcmp(watcher->name, name) == 0) {
+            found = true;
+            break;
+        }
+    }
+    rcu_read_unlock();
+    if (likely(!found))
+        return NULL;
+
+    mutex_lock(&watchers_lock);
+    unsigned int count = 0;
+    hash_for_each_possible(watchers, watcher, node, hash) {
+        if (watcher->hash == hash && strcmp(watcher->name, name) == 0)
+            ++count;
     }
 
-    return NULL;
+    struct watcher_call *list = NULL;
+    if (count) {
+        list = kmalloc(sizeof(struct watcher_call) * count, GFP_KERNEL);
+        if (unlikely(!list)) {
+            mutex_unlock(&watchers_lock);
+            kalloc_error_ptr(list, sizeof(struct watcher_call) * count);
+        }
+
+        //hlist adds to the head - walk it backwards to call watchers in the order they were registered
+        unsigned int i = count;
+        hash_for_each_possible(watchers, watcher, node, hash) {
+            if (watcher->hash == hash && strcmp(watcher->name, name) == 0) {
+                kref_get(&watcher->refs);
+                --i;
+                list[i].watcher = watcher;
+                list[i].done = false;
+            }
+        }
+    }
+    mutex_unlock(&watchers_lock);
+
+    *num = count;
+    return list;
 }
 
-/**
- * Checks if there any watchers registered (to determine if it makes sense to still shim the driver_register())
- */
-static bool has_any_watchers(void)
+static void put_watchers(struct watcher_call *list, unsigned int num)
 {
-    for (int i=0; i < MAX_WATCHERS; ++i) {
-        if (watchers[i])
-            return true;
-    }
+    for (unsigned int i = 0; i < num; i++)
+        put_watcher(list[i].watcher);
 
-    return false;
+    kfree(list);
 }
 
 /**
  * Calls the original driver_register() with error handling
  *
+ * The hook stays in place even if a callback removed the last watcher in the meantime (see stop_watching()).
+ *
  * @return 0 on success, -E on error
  */
-static int call_original_driver_register(struct device_driver *drv)
+static int call_original_driver_register(struct override_hook_ctx *ctx)
 {
-    int driver_register_out, org_call_out;
-    org_call_out = call_overridden_symbol(driver_register_out, ov_driver_register, drv);
+    int out = override_hook_call_original(ctx);
+    return unlikely(out != 0) ? out : (int)ctx->ret;
+}
 
-    if (unlikely(org_call_out != 0)) {
-        pr_loc_err("Failed to call original %s (error=%d)", WATCH_FUNCTION, org_call_out);
-        return org_call_out;
+/**
+ * Calls a single watcher callback
+ *
+ * Driver ready requests are called only once (even if e.g. the driver binds to many devices) and then removed.
+ */
+static driver_watch_notify_result call_watcher(driver_watcher_instance *watcher, struct device_driver *drv,
+                                               driver_watch_notify_state event)
+{
+    dprof_time_begin(start);
+    driver_watch_notify_result out;
+    if (watcher->ready_cb) {
+        if (test_and_set_bit(READY_CLAIMED_BIT, &watcher->ready_claimed))
+            return DWATCH_NOTIFY_CONTINUE; //already called or cancelled (cancel_driver_ready() removes it)
+
+        watcher->ready_cb(drv, watcher->ready_data);
+        out = DWATCH_NOTIFY_DONE;
+    } else {
+        out = watcher->cb(drv, event);
     }
+    dprof_record(DPROF_EV_CALLBACK, drv->name, watcher->cb ? (void *)watcher->cb : (void *)watcher->ready_cb, event,
+                 start, out);
 
-    return driver_register_out;
+    return out;
 }
 
 /**
- * Replacement for driver_register(), executing registered hooks
+ * Executes registered hooks for driver_register()
+ *
+ * All watchers get DWATCH_STATE_COMING first. The first one returning DWATCH_NOTIFY_ABORT_* decides the outcome (the
+ * original isn't called & watchers after it are not asked). Then, if the driver loaded, they all get DWATCH_STATE_LIVE.
+ * Watchers returning DWATCH_NOTIFY_DONE are removed once the original driver_register() returns.
  */
-static int driver_register_shim(struct device_driver *drv)
+static int handle_driver_register(struct override_hook_ctx *ctx, struct device_driver *drv)
 {
-    driver_watcher_instance **watcher_lptr = match_watcher(drv->name);
-    int driver_load_result;
-    bool driver_register_fulfilled = false;
-
-    if (unlikely(!watcher_lptr)) {
-        pr_loc_dbg("%s() interception active - no handler observing \"%s\" found, calling original %s()",
-                   WATCH_FUNCTION, drv->name, WATCH_FUNCTION);
-        return call_original_driver_register(drv);
+    unsigned int num;
+    struct watcher_call *list = get_watchers(drv->name, &num);
+    if (likely(!list))
+        return call_original_driver_register(ctx);
+
+    if (unlikely(IS_ERR(list))) {
+        pr_loc_err("Failed to get watchers for \"%s\" - calling original %s()", drv->name, WATCH_FUNCTION);
+        return call_original_driver_register(ctx);
     }
 
-    pr_loc_dbg("%s() interception active - calling handler %pF<%p> for \"%s\"", WATCH_FUNCTION, (*watcher_lptr)->cb,
-               (*watcher_lptr)->cb, drv->name);
-
-    if ((*watcher_lptr)->notify_coming) {
-        pr_loc_dbg("Calling for DWATCH_STATE_COMING");
-        switch ((*watcher_lptr)->cb(drv, DWATCH_STATE_COMING)) {
-            //CONTINUE and DONE cannot use fall-through as we cannot unregister watcher before calling it (as if this is the
-            // last watcher the whole override will be stopped
+    int driver_load_result = 0;
+    bool driver_register_fulfilled = false;
+    for (unsigned int i = 0; i < num && !driver_register_fulfilled; i++) {
+        driver_watcher_instance *watcher = list[i].watcher;
+        if (!watcher->notify_coming || watcher->removed)
+            continue;
+
+        pr_loc_dbg("%s() interception active - calling handler %pF<%p> for \"%s\" (DWATCH_STATE_COMING)",
+                   WATCH_FUNCTION, watcher->cb, watcher->cb, drv->name);
+        switch (call_watcher(watcher, drv, DWATCH_STATE_COMING)) {
             case DWATCH_NOTIFY_CONTINUE:
-                pr_loc_dbg("Calling original %s() & leaving watcher active", WATCH_FUNCTION);
-                driver_load_result = call_original_driver_register(drv);
-                driver_register_fulfilled = true;
                 break;
             case DWATCH_NOTIFY_DONE:
-                pr_loc_dbg("Calling original %s() & removing watcher", WATCH_FUNCTION);
-                driver_load_result = call_original_driver_register(drv);
-                unwatch_driver_register(*watcher_lptr); //regardless of the call result we unregister
-                return driver_load_result; //we return here as the watcher doesn't want to be bothered anymore
+                //We cannot unregister the watcher before calling the original (if this is the last watcher the whole
+                // override would be stopped)
+                pr_loc_dbg("Watcher %pF<%p> will be removed after calling original %s()", watcher->cb, watcher->cb,
+                           WATCH_FUNCTION);
+                list[i].done = true;
+                break;
             case DWATCH_NOTIFY_ABORT_OK:
                 pr_loc_dbg("Faking OK return of %s() per callback request", WATCH_FUNCTION);
                 driver_load_result = 0;
@@ -125,135 +256,347 @@ static int driver_register_shim(struct device_driver *drv)
                 break;
             default: //This should never happen if the callback is correct
                 pr_loc_bug("%s callback %pF<%p> returned invalid status value during DWATCH_STATE_COMING",
-                           WATCH_FUNCTION, (*watcher_lptr)->cb, (*watcher_lptr)->cb);
+                           WATCH_FUNCTION, watcher->cb, watcher->cb);
         }
     }
 
     if (!driver_register_fulfilled)
-        driver_load_result = call_original_driver_register(drv);
+        driver_load_result = call_original_driver_register(ctx);
 
-    if (driver_load_result != 0) {
-        pr_loc_err("%s driver failed to load - not triggering STATE_LIVE callbacks", drv->name);
-        return driver_load_result;
-    }
+    for (unsigned int i = 0; i < num; i++) {
+        driver_watcher_instance *watcher = list[i].watcher;
+        if (watcher->removed) //a callback could've unwatched it in the meantime
+            continue;
 
-    if ((*watcher_lptr)->notify_live) {
-        pr_loc_dbg("Calling for DWATCH_STATE_LIVE");
-        if ((*watcher_lptr)->cb(drv, DWATCH_STATE_LIVE) == DWATCH_NOTIFY_DONE)
-            unwatch_driver_register(*watcher_lptr);
+        if (list[i].done) {
+            unwatch_driver_register(watcher);
+            continue;
+        }
+
+        if (driver_load_result != 0 || !watcher->notify_live)
+            continue;
+
+        pr_loc_dbg("%s() interception active - calling handler %pF<%p> for \"%s\" (DWATCH_STATE_LIVE)",
+                   WATCH_FUNCTION, watcher->cb, watcher->cb, drv->name);
+        if (call_watcher(watcher, drv, DWATCH_STATE_LIVE) == DWATCH_NOTIFY_DONE)
+            unwatch_driver_register(watcher);
     }
 
+    if (driver_load_result != 0)
+        pr_loc_err("%s driver failed to load - STATE_LIVE callbacks were not triggered", drv->name);
+
+    put_watchers(list, num);
     return driver_load_result;
 }
 
 /**
- * Enables override of driver_register() to watch for new drivers registration
+ * Hook of driver_register(); it calls the original on its own, so it always vetoes the call
+ */
+static bool driver_register_hook_pre(struct override_hook_ctx *ctx, void *data)
+{
+    struct device_driver *drv = (struct device_driver *)ctx->args[0];
+
+    dprof_time_begin(prof_start);
+    rp_metric_time_begin(metric_start);
+    int out = handle_driver_register(ctx, drv);
+    rp_metric_time_end(&dwatch_driver_register_ns, metric_start);
+    rp_metric_inc(&dwatch_driver_registers);
+    dprof_record(DPROF_EV_REGISTER, drv->name, NULL, 0, prof_start, out);
+
+    ctx->ret = (unsigned long)(long)out;
+    return true;
+}
+
+static struct override_hook_handler driver_register_hook = {
+    .pre = driver_register_hook_pre,
+    .priority = INT_MAX, //it vetoes the call - other pre handlers must go first
+};
+
+/**
+ * Hooks driver_register() to watch for new drivers registration; watchers_lock must be held
  *
  * @return 0 on success, or -E on error
  */
 static int start_watching(void)
 {
-    if (unlikely(ov_driver_register)) {
+    if (unlikely(watching)) {
         pr_loc_bug("Watching is already enabled!");
         return 0;
     }
 
+    if (watching_stopping)
+        return 0; //stop_watching_work_fn() will re-add it, as there's a watcher now
+
     pr_loc_dbg("Starting intercept of %s()", WATCH_FUNCTION);
-    ov_driver_register = override_symbol(WATCH_FUNCTION, driver_register_shim);
-    if (unlikely(IS_ERR(ov_driver_register))) {
-        pr_loc_err("Failed to intercept %s() - error=%ld", WATCH_FUNCTION, PTR_ERR(ov_driver_register));
-        ov_driver_register = NULL;
-        return -EINVAL;
+    int out = register_override_hook(WATCH_FUNCTION, &driver_register_hook);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to intercept %s() - error=%d", WATCH_FUNCTION, out);
+        return out;
     }
+    watching = true;
     pr_loc_dbg("%s() is now intercepted", WATCH_FUNCTION);
 
     return 0;
 }
 
 /**
- * Disables override of driver_register(), started by start_watching()
+ * Removes the driver_register() hook if there's still no watcher needing it
  *
- * @return 0 on success, or -E on error
+ * unregister_override_hook() waits for all calls of the hook to finish, so it cannot run in the hook itself (where the
+ * last watcher is usually removed) nor with watchers_lock held (the hook takes it).
  */
-static int stop_watching(void)
+static void stop_watching_work_fn(struct work_struct *work)
 {
-    if (unlikely(!ov_driver_register)) {
-        pr_loc_bug("Watching is NOT enabled");
-        return 0;
+    mutex_lock(&watchers_lock);
+    if (!watching || override_watchers_num > 0) {
+        mutex_unlock(&watchers_lock);
+        return;
     }
+    watching = false;
+    watching_stopping = true;
+    mutex_unlock(&watchers_lock);
 
     pr_loc_dbg("Stopping intercept of %s()", WATCH_FUNCTION);
-    int out = restore_symbol(ov_driver_register);
+    int out = unregister_override_hook(&driver_register_hook);
+
+    mutex_lock(&watchers_lock);
+    watching_stopping = false;
     if (unlikely(out != 0)) {
-        pr_loc_err("Failed to restore %s() - error=%ld", WATCH_FUNCTION, PTR_ERR(ov_driver_register));
-        return out;
+        pr_loc_err("Failed to restore %s() - error=%d", WATCH_FUNCTION, out);
+        watching = true; //the handler is still registered
+    } else {
+        pr_loc_dbg("Intercept of %s() stopped", WATCH_FUNCTION);
+        if (override_watchers_num > 0) //someone started watching while the hook was being removed
+            start_watching();
     }
-    pr_loc_dbg("Intercept of %s() stopped", WATCH_FUNCTION);
+    mutex_unlock(&watchers_lock);
+}
+static DECLARE_WORK(stop_watching_work, stop_watching_work_fn);
 
-    return 0;
+/**
+ * Schedules removal of the driver_register() hook started by start_watching(); watchers_lock must be held
+ */
+static void stop_watching(void)
+{
+    if (unlikely(!watching)) {
+        pr_loc_bug("Watching is NOT enabled");
+        return;
+    }
+
+    schedule_work(&stop_watching_work);
 }
 
-driver_watcher_instance *watch_driver_register(const char *name, watch_dr_callback *cb, int event_mask)
+/**
+ * Executes registered hooks for a driver being bound to a device
+ */
+static void handle_driver_bound(struct device_driver *drv)
 {
-    driver_watcher_instance **watcher_lptr = match_watcher(name);
-    if (unlikely(watcher_lptr)) {
-        pr_loc_err("Watcher for %s already exists (callback=%pF<%p>)", name, (*watcher_lptr)->cb, (*watcher_lptr)->cb);
-        return ERR_PTR(-EEXIST);
+    unsigned int num;
+    struct watcher_call *list = get_watchers(drv->name, &num);
+    if (likely(!list))
+        return;
+
+    if (unlikely(IS_ERR(list))) {
+        pr_loc_err("Failed to get watchers for \"%s\" - DWATCH_STATE_BOUND not delivered", drv->name);
+        return;
     }
 
-    watcher_lptr = watcher_list_spot();
-    if (unlikely(!watcher_lptr)) {
-        pr_loc_bug("There are no free spots for a new watcher");
-        return ERR_PTR(-ENOSPC);
+    for (unsigned int i = 0; i < num; i++) {
+        driver_watcher_instance *watcher = list[i].watcher;
+        if (!watcher->notify_bound || watcher->removed)
+            continue;
+
+        pr_loc_dbg("Driver \"%s\" bound - calling handler %pF<%p> (DWATCH_STATE_BOUND)", drv->name, watcher->cb,
+                   watcher->cb);
+        switch (call_watcher(watcher, drv, DWATCH_STATE_BOUND)) {
+            case DWATCH_NOTIFY_CONTINUE:
+                break;
+            case DWATCH_NOTIFY_DONE:
+                unwatch_driver_register(watcher);
+                break;
+            default: //the driver is already registered & bound - there's nothing to abort
+                pr_loc_bug("%s callback %pF<%p> returned invalid status value during DWATCH_STATE_BOUND",
+                           WATCH_FUNCTION, watcher->cb, watcher->cb);
+        }
     }
 
-    kmalloc_or_exit_ptr(*watcher_lptr, sizeof(driver_watcher_instance) + strsize(name));
-    strcpy((*watcher_lptr)->name, name);
-    (*watcher_lptr)->cb = cb;
-    (*watcher_lptr)->notify_coming = ((event_mask & DWATCH_STATE_COMING) == DWATCH_STATE_COMING);
-    (*watcher_lptr)->notify_live = ((event_mask & DWATCH_STATE_LIVE) == DWATCH_STATE_LIVE);
-    pr_loc_dbg("Registered %s() watcher for \"%s\" driver (coming=%d, live=%d)", WATCH_FUNCTION, name,
-               (*watcher_lptr)->notify_coming ? 1 : 0, (*watcher_lptr)->notify_live ? 1 : 0);
+    put_watchers(list, num);
+}
 
-    if (!ov_driver_register) {
-        pr_loc_dbg("Registered the first driver_register watcher - starting watching");
+static int driver_bound_notifier(struct notifier_block *nb, unsigned long action, void *data)
+{
+    struct device *dev = data;
+    if (!rp_static_branch_unlikely(&bound_watchers_present) || action != BUS_NOTIFY_BOUND_DRIVER ||
+        unlikely(!dev->driver))
+        return NOTIFY_DONE;
+
+    rp_metric_inc(&dwatch_binds);
+    dprof_time_begin(prof_start);
+    handle_driver_bound(dev->driver);
+    dprof_record(DPROF_EV_BOUND, dev->driver->name, NULL, 0, prof_start, 0);
+
+    return NOTIFY_OK;
+}
+
+/**
+ * Registers bus notifiers delivering DWATCH_STATE_BOUND events (if not registered yet)
+ *
+ * Bus notifiers are called under the bus' notifier rwsem, and (un)registering a notifier takes it for writing. This is
+ * why this must never be called with watchers_lock held (the notifier callback takes it) nor from a notifier callback.
+ *
+ * @return 0 on success, or -E on error
+ */
+static int register_bind_notifiers(void)
+{
+    int out = 0;
+    unsigned int i;
+
+    mutex_lock(&bus_nbs_lock);
+    if (bus_nbs_registered)
+        goto out_unlock;
+
+    for (i = 0; i < ARRAY_SIZE(watched_buses); i++) {
+        bus_nbs[i].notifier_call = driver_bound_notifier;
+        bus_nbs[i].priority = 0;
+        if ((out = bus_register_notifier(watched_buses[i], &bus_nbs[i])) != 0) {
+            pr_loc_err("Failed to register notifier for %s bus - error=%d", watched_buses[i]->name, out);
+            goto error_rollback;
+        }
+    }
+
+    bus_nbs_registered = true;
+    pr_loc_dbg("Registered driver bind notifiers on %zu buses", ARRAY_SIZE(watched_buses));
+    goto out_unlock;
+
+    error_rollback:
+    while (i-- > 0)
+        bus_unregister_notifier(watched_buses[i], &bus_nbs[i]);
+    out_unlock:
+    mutex_unlock(&bus_nbs_lock);
+    return out;
+}
+
+int unregister_driver_bind_notifiers(void)
+{
+    flush_work(&stop_watching_work); //removal of the driver_register() hook may still be pending
+
+    mutex_lock(&bus_nbs_lock);
+    if (bus_nbs_registered) {
+        for (unsigned int i = 0; i < ARRAY_SIZE(watched_buses); i++)
+            bus_unregister_notifier(watched_buses[i], &bus_nbs[i]);
+
+        bus_nbs_registered = false;
+        pr_loc_dbg("Unregistered driver bind notifiers");
+    }
+    mutex_unlock(&bus_nbs_lock);
+
+    return 0;
+}
+
+/**
+ * Creates & adds a watcher; either a regular one (cb) or a driver ready request (ready_cb)
+ *
+ * @return instance ptr on success, ERR_PTR(-E) on error
+ */
+static driver_watcher_instance *add_watcher(const char *name, watch_dr_callback *cb, driver_ready_callback *ready_cb,
+                                            void *ready_data, int event_mask)
+{
+    rp_metrics_register(dwatch_metrics, ARRAY_SIZE(dwatch_metrics));
+
+    driver_watcher_instance *watcher;
+    kmalloc_or_exit_ptr(watcher, sizeof(driver_watcher_instance) + strsize(name), RP_MEM_DRIVER_WATCH);
+    strcpy(watcher->name, name);
+    watcher->hash = watcher_name_hash(name);
+    watcher->cb = cb;
+    watcher->ready_cb = ready_cb;
+    watcher->ready_data = ready_data;
+    watcher->ready_claimed = 0;
+    watcher->removed = false;
+    kref_init(&watcher->refs);
+    watcher->notify_coming = ((event_mask & DWATCH_STATE_COMING) == DWATCH_STATE_COMING);
+    watcher->notify_live = ((event_mask & DWATCH_STATE_LIVE) == DWATCH_STATE_LIVE);
+    watcher->notify_bound = ((event_mask & DWATCH_STATE_BOUND) == DWATCH_STATE_BOUND);
+    bool needs_override = watcher->notify_coming || watcher->notify_live;
+
+    //This has to be done before we add the watcher & without holding watchers_lock (see register_bind_notifiers())
+    if (watcher->notify_bound) {
+        int out = register_bind_notifiers();
+        if (unlikely(out != 0)) {
+            rp_kfree(watcher, RP_MEM_DRIVER_WATCH);
+            return ERR_PTR(out);
+        }
+    }
+
+    mutex_lock(&watchers_lock);
+    driver_watcher_instance *existing;
+    hash_for_each_possible(watchers, existing, node, watcher->hash) {
+        if (unlikely(cb && existing->cb == cb && strcmp(existing->name, name) == 0)) {
+            mutex_unlock(&watchers_lock);
+            pr_loc_err("Watcher %pF<%p> for %s already exists", cb, cb, name);
+            rp_kfree(watcher, RP_MEM_DRIVER_WATCH);
+            return ERR_PTR(-EEXIST);
+        }
+    }
+
+    if (needs_override && !watching) {
+        pr_loc_dbg("Registering the first driver_register watcher - starting watching");
         int out = start_watching();
-        if (unlikely(out != 0))
+        if (unlikely(out != 0)) {
+            mutex_unlock(&watchers_lock);
+            rp_kfree(watcher, RP_MEM_DRIVER_WATCH);
             return ERR_PTR(out);
+        }
     }
 
-    return *watcher_lptr;
+    hash_add_rcu(watchers, &watcher->node, watcher->hash);
+    rp_metric_gauge_add(&dwatch_watchers, 1);
+    if (needs_override)
+        ++override_watchers_num;
+    if (watcher->notify_bound && bound_watchers_num++ == 0)
+        rp_static_branch_enable(&bound_watchers_present);
+    mutex_unlock(&watchers_lock);
+
+    pr_loc_dbg("Registered %s() %s for \"%s\" driver (coming=%d, live=%d, bound=%d)", WATCH_FUNCTION,
+               cb ? "watcher" : "ready request", name, watcher->notify_coming ? 1 : 0, watcher->notify_live ? 1 : 0,
+               watcher->notify_bound ? 1 : 0);
+
+    return watcher;
+}
+
+driver_watcher_instance *watch_driver_register(const char *name, watch_dr_callback *cb, int event_mask)
+{
+    return add_watcher(name, cb, NULL, NULL, event_mask);
 }
 
 int unwatch_driver_register(driver_watcher_instance *instance)
 {
-    driver_watcher_instance **matched_lptr = match_watcher(instance->name);
-    if (unlikely(!matched_lptr)) {
-        //This means it could be a double-unwatch situation and this will prevent a double-kfree (but the lack of crash
-        // is not guaranteed as match_watcher() already touched the memory)
-        pr_loc_bug("Watcher %p for %s couldn't be found in the watchers list", instance, instance->name);
+    int out = 0;
+
+    mutex_lock(&watchers_lock);
+    if (unlikely(instance->removed)) {
+        //This means it's a double-unwatch from a callback which didn't return DWATCH_NOTIFY_DONE; if the instance was
+        // already freed (not pinned by any call) there's no guarantee of not crashing as we touched the memory
+        mutex_unlock(&watchers_lock);
+        pr_loc_bug("Watcher %p for %s was already removed", instance, instance->name);
         return -ENOENT;
     }
 
-    if (unlikely(*matched_lptr != instance)) {
-        pr_loc_bug("Watcher %p for %s was found but the instance on the list %p (@%p) isn't the same (?!)", instance,
-                   instance->name, *matched_lptr, matched_lptr);
-        return -EINVAL;
-    }
+    hash_del_rcu(&instance->node);
+    instance->removed = true;
+    rp_metric_gauge_add(&dwatch_watchers, -1);
+    pr_loc_dbg("Removed %pF<%p> subscriber for \"%s\" driver", instance->cb, instance->cb, instance->name);
 
-    pr_loc_dbg("Removed %pF<%p> subscriber for \"%s\" driver", (*matched_lptr)->cb, (*matched_lptr)->cb,
-               (*matched_lptr)->name);
-    kfree(*matched_lptr);
-    *matched_lptr = NULL;
+    if (instance->notify_bound && --bound_watchers_num == 0)
+        rp_static_branch_disable(&bound_watchers_present);
 
-    if (!has_any_watchers()) {
+    if ((instance->notify_coming || instance->notify_live) && !--override_watchers_num) {
         pr_loc_dbg("Removed last %s() subscriber - unshimming %s()", WATCH_FUNCTION, WATCH_FUNCTION);
-        int out;
-        if ((out = stop_watching()) != 0)
-            return out;
+        stop_watching();
     }
+    mutex_unlock(&watchers_lock);
 
-    return 0;
+    put_watcher(instance); //drops the table reference
+    return out;
 }
 
 int is_driver_registered(const char *name, struct bus_type *bus)
@@ -266,4 +609,52 @@ int is_driver_registered(const char *name, struct bus_type *bus)
         return PTR_ERR(drv);
 
     return drv ? 1:0;
-}
\ No newline at end of file
+}
+
+driver_ready_request *on_driver_ready(const char *name, struct bus_type *bus, driver_watch_notify_state event,
+                                      driver_ready_callback *cb, void *data)
+{
+    if (unlikely(!cb || (event != DWATCH_STATE_COMING && event != DWATCH_STATE_LIVE && event != DWATCH_STATE_BOUND))) {
+        pr_loc_bug("Invalid driver ready request for \"%s\" (cb=%p event=%d)", name, cb, event);
+        return ERR_PTR(-EINVAL);
+    }
+
+    //The request is added BEFORE looking the driver up - this way the driver cannot register unnoticed in between
+    driver_ready_request *req = add_watcher(name, NULL, cb, data, event);
+    if (unlikely(IS_ERR(req)))
+        return req;
+    kref_get(&req->refs); //held by the caller until cancel_driver_ready()
+
+    struct device_driver *drv = driver_find(name, bus ? bus : &platform_bus_type);
+    if (unlikely(IS_ERR(drv))) {
+        pr_loc_err("Failed to check \"%s\" driver state - error=%ld", name, PTR_ERR(drv));
+        cancel_driver_ready(req);
+        return ERR_PTR(PTR_ERR(drv));
+    }
+
+    //If it's registered but the request was already claimed it means the callback is being called concurrently
+    if (!drv || test_and_set_bit(READY_CLAIMED_BIT, &req->ready_claimed))
+        return req;
+
+    unwatch_driver_register(req);
+    put_watcher(req);
+    pr_loc_dbg("Driver \"%s\" is already registered - calling %pF<%p> now", name, cb, cb);
+    cb(drv, data);
+
+    return NULL;
+}
+
+int cancel_driver_ready(driver_ready_request *req)
+{
+    if (unlikely(IS_ERR_OR_NULL(req) || !req->ready_cb)) {
+        pr_loc_bug("Attempted to cancel invalid driver ready request %p", req);
+        return -EINVAL;
+    }
+
+    int out = -EALREADY;
+    if (!test_and_set_bit(READY_CLAIMED_BIT, &req->ready_claimed))
+        out = unwatch_driver_register(req);
+
+    put_watcher(req); //the caller's reference
+    return out;
+}
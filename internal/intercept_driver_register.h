@@ -19,22 +19,32 @@ typedef enum {
 typedef enum {
     DWATCH_STATE_COMING = 0b100, //driver is loading, you can intercept the process using (DWATCH_NOTIFY_ABORT_*) and change data
     DWATCH_STATE_LIVE = 0b010, //driver just loaded
+    DWATCH_STATE_BOUND = 0b001, //driver was bound to a device (called for every device); doesn't override driver_register()
 } driver_watch_notify_state;
 
 typedef struct driver_watcher_instance driver_watcher_instance;
 typedef driver_watch_notify_result (watch_dr_callback)(struct device_driver *drv, driver_watch_notify_state event);
 
+//Driver ready requests are one-shot watchers; see on_driver_ready()
+typedef struct driver_watcher_instance driver_ready_request;
+typedef void (driver_ready_callback)(struct device_driver *drv, void *data);
+
 /**
  * Start watching for a driver registration
  *
  * Note: if the driver is already loaded this will do nothing, unless the driver is removed and re-registers. You should
  * probably call is_driver_registered() first.
+ * Any number of watchers (with different callbacks) can observe the same driver - see handle_driver_register() for how
+ * their results are combined. Callbacks are called without any locks held, so they can (un)watch drivers themselves.
+ * If you don't need to change the registration prefer DWATCH_STATE_BOUND alone: it doesn't require driver_register() to
+ * be overridden. Keep in mind it's only delivered for drivers on platform & SCSI buses, and only once the driver binds
+ * to a device.
  *
  * @param name Name of the driver you want to observe
  * @param cb Callback called on an event
  * @param event_mask ORed driver_watch_notify_state flags to when the callback is called
  *
- * @return 0 on success, -E on error
+ * @return instance ptr on success, ERR_PTR(-E) on error
  */
 driver_watcher_instance *watch_driver_register(const char *name, watch_dr_callback *cb, int event_mask);
 
@@ -56,4 +66,43 @@ int unwatch_driver_register(driver_watcher_instance *instance);
  */
 int is_driver_registered(const char *name, struct bus_type *bus);
 
+/**
+ * Calls a callback (once) when a given driver is ready, or right away if it's already registered
+ *
+ * This replaces the usual "check if the driver is there, if not watch for it, unwatch when it comes" dance: the check
+ * is done after the request is added, so the driver cannot slip in between. The callback is called only once, even if
+ * the driver binds to many devices, and it's called without any locks held.
+ *
+ * @param name Name of the driver to wait for
+ * @param bus Bus the driver lives on; NULL means platform bus (see is_driver_registered())
+ * @param event A single driver_watch_notify_state at which the driver is considered ready; note that the callback
+ *              cannot abort the registration
+ * @param cb Callback to call
+ * @param data Opaque pointer passed to the callback
+ *
+ * @return request handle (which must be released with cancel_driver_ready()) if the callback will be called later,
+ *         NULL if the driver was already registered & the callback was called, ERR_PTR(-E) on error
+ */
+driver_ready_request *on_driver_ready(const char *name, struct bus_type *bus, driver_watch_notify_state event,
+                                      driver_ready_callback *cb, void *data);
+
+/**
+ * Cancels a pending driver ready request & releases it
+ *
+ * It must be called exactly once for every handle returned by on_driver_ready(), even if the callback was called.
+ *
+ * @return 0 if the request was cancelled, -EALREADY if the callback was (or is being) called, -E on error
+ */
+int cancel_driver_ready(driver_ready_request *req);
+
+/**
+ * Removes bus notifiers used to deliver DWATCH_STATE_BOUND events & waits for the driver_register() hook to be removed
+ *
+ * They're registered automatically with the first such watcher but (as they cannot be removed from their own callback)
+ * they must be removed explicitly when the module unloads, after all watchers are gone.
+ *
+ * @return 0 on success, -E on error
+ */
+int unregister_driver_bind_notifiers(void);
+
 #endif //REDPILL_DRIVER_WATCHER_H
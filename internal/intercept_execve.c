@@ -1,9 +1,12 @@
 /*
  * Submodule used to hook the execve() syscall, used by the userland to execute binaries.
  *
- * This submodule can currently block calls to specific binaries and fake a successful return of the execution. In the
- * future, if needed, an option to fake certain response and/or execute a different binary instead can be easily added
- * here.
+ * This submodule can currently block calls to specific binaries and fake a successful return of the execution. Binaries
+ * can be specified by their exact path or by a glob pattern (see helper/glob_helper.h). All patterns are compiled into
+ * one automaton, so checking them is a single pass over the path regardless of their number.
+ * Exact paths can also be redirected to a different binary (e.g. a stub printing whatever the caller expects) - the
+ * caller gets a normal exec of the replacement with the original argv & envp. This is useful for tools which are
+ * retried over and over when they exit without the expected output.
  *
  * execve() is a rather special syscall. This submodule utilized override_symbool.c:override_syscall() to do the actual
  * ground work of replacing the call. However some syscalls (execve, fork, etc.) use ASM stubs with a non-GCC call
@@ -13,6 +16,16 @@
  * struct directly. This requires re-exported versions of these functions, so it may be marginally slower.
  * Because of that this trick is only utilized on Linux >v3.18 and older ones call the stub as normal.
  *
+ * BINFMT BACKEND
+ * When EXECVE_INTERCEPT_BINFMT is defined (see common.h) the syscall isn't touched at all. Instead a binary format
+ * handler is inserted in front of all others. The kernel asks it first for every exec: it checks the rules and, if the
+ * file isn't blocked, returns -ENOEXEC so that the kernel carries on with the real handlers. This avoids the extra
+ * getname() copy & calls through re-exported pointers on every exec. This backend is only available on x86_64.
+ * Blocked files are "loaded" as a built-in program consisting of a single exit_group(0) - the result for the caller is
+ * the same as with the syscall variant. We cannot simply do_exit() from the handler as the exec holds locks & memory
+ * which are only released when the handler returns. The only difference is that blocked binaries must exist, as the
+ * kernel opens the file before consulting handlers.
+ *
  * References:
  *  - https://github.com/torvalds/linux/commit/b645af2d5905c4e32399005b867987919cbfc3ae
  *  - https://my.oschina.net/macwe/blog/603583
@@ -24,45 +37,621 @@
 #include <linux/fs.h> //struct filename
 #include "override/override_syscall.h" //SYSCALL_SHIM_DEFINE3, override_symbol
 #include "call_protected.h" //do_execve(), getname(), putname()
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_*
+#include <linux/jhash.h> //jhash()
+#include <linux/list.h> //list_*
+#include <linux/rcupdate.h> //rcu_*, kfree_rcu(), synchronize_rcu()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+#include "helper/glob_helper.h" //glob_set_*
+#include "../compat/static_key_compat.h" //RP_DEFINE_STATIC_KEY_FALSE, rp_static_branch_*
+#include "metrics.h" //RP_METRIC(), rp_metric_*()
+#include <linux/binfmts.h> //insert_binfmt(), unregister_binfmt(), struct linux_binprm, setup_arg_pages()
+
+//exit_prog of the binfmt backend is x86_64 machine code
+#if defined(EXECVE_INTERCEPT_BINFMT) && !defined(CONFIG_X86_64)
+#warning "EXECVE_INTERCEPT_BINFMT is only supported on x86_64 - using the syscall backend"
+#undef EXECVE_INTERCEPT_BINFMT
+#endif
+
+#ifdef EXECVE_INTERCEPT_BINFMT
+#include <linux/mm.h> //vm_mmap(), get_user_pages(), set_page_dirty_lock(), put_page()
+#include <linux/mman.h> //PROT_*, MAP_*
+#include <linux/highmem.h> //kmap(), kunmap()
+#include <linux/ptrace.h> //current_pt_regs()
+#include <asm/processor.h> //start_thread(), STACK_TOP
+#endif
 
 #ifdef RPDBG_EXECVE
 #include "../debug/debug_execve.h"
 #endif
 
-#define MAX_INTERCEPTED_FILES 10
+#define EXECVE_RULES_BITS 5 //hashtable buckets (as a power of 2); it can hold any number of entries
 
-static char * intercepted_filenames[MAX_INTERCEPTED_FILES] = { NULL };
+/*
+ * Rules are read on every exec on any CPU, while they're modified very rarely. Because of that they're published using
+ * RCU: the exec path only takes rcu_read_lock() (which is free on non-preemptible kernels) & never waits for writers.
+ * Writers are serialized with execve_rules_lock and free old entries only after a grace period.
+ */
+static DEFINE_MUTEX(execve_rules_lock);
 
-int add_blocked_execve_filename(const char *filename)
+//Blocked filenames are kept with their length & hash so that the exec path only has to hash the filename once
+struct execve_rule {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    u32 hash;
+    size_t len;
+    const char *replacement; //NULL for blocked files, path to exec instead for redirected ones (stored after filename)
+    char filename[];
+};
+
+enum execve_action {
+    EXECVE_ALLOW,
+    EXECVE_BLOCK,
+    EXECVE_REDIRECT,
+};
+
+static DEFINE_HASHTABLE(execve_rules, EXECVE_RULES_BITS);
+static unsigned int execve_rules_num = 0;
+
+//Glob rules are kept as text (to recompile them when the list changes; writers only) & as a single compiled set used
+//for matching (published to readers)
+struct execve_glob {
+    struct list_head list;
+    char pattern[];
+};
+
+static LIST_HEAD(execve_globs);
+static unsigned int execve_globs_num = 0;
+static struct glob_set __rcu *execve_glob_set = NULL;
+
+//Enabled only while there's any rule, so that with no rules an exec doesn't even hash the filename (it's just a NOP)
+static RP_DEFINE_STATIC_KEY_FALSE(execve_rules_active);
+
+static RP_METRIC(execve_checked, RP_MG_EXECVE, RP_METRIC_COUNTER); //only execs checked while there are any rules
+static RP_METRIC(execve_blocked, RP_MG_EXECVE, RP_METRIC_COUNTER);
+static RP_METRIC(execve_redirected, RP_MG_EXECVE, RP_METRIC_COUNTER);
+static RP_METRIC(execve_rules, RP_MG_EXECVE, RP_METRIC_GAUGE);
+static struct rp_metric *const execve_metrics[] = { &execve_checked, &execve_blocked, &execve_redirected,
+                                                    &execve_rules };
+
+/**
+ * Flips execve_rules_active to reflect whether there are any rules
+ *
+ * The caller must hold execve_rules_lock. When the key is disabled execs which already passed it may still be looking
+ * at the rules - this is fine as they're freed after a grace period anyway.
+ */
+static void update_execve_rules_key(void)
 {
-    if (unlikely(strlen(filename) > PATH_MAX))
-        return -ENAMETOOLONG;
+    rp_metric_gauge_set(&execve_rules, execve_rules_num + execve_globs_num);
+    if (execve_rules_num || execve_globs_num)
+        rp_static_branch_enable(&execve_rules_active);
+    else
+        rp_static_branch_disable(&execve_rules_active);
+}
+
+static inline u32 execve_filename_hash(const char *filename, size_t len)
+{
+    return jhash(filename, len, 0);
+}
 
-    unsigned int idx = 0;
-    while (likely(intercepted_filenames[idx])) { //Find free spot
-        if (unlikely(strcmp(filename, intercepted_filenames[idx]) == 0)) { //Does it exist already?
-            pr_loc_bug("File %s was already added at %d", filename, idx);
-            return -EEXIST;
+/**
+ * Looks for an exact rule; the caller must hold rcu_read_lock() or execve_rules_lock
+ */
+static struct execve_rule *find_execve_rule(const char *filename, size_t len, u32 hash)
+{
+    struct execve_rule *rule;
+    hash_for_each_possible_rcu(execve_rules, rule, node, hash) {
+        if (rule->hash == hash && rule->len == len && memcmp(rule->filename, filename, len) == 0)
+            return rule;
+    }
+
+    return NULL;
+}
+
+/**
+ * Checks what should happen with an exec of a given file
+ *
+ * @param pathname Path as passed to execve()
+ * @param replacement Set to a copy of the replacement path when EXECVE_REDIRECT is returned; the caller must kfree() it
+ */
+static enum execve_action check_execve_rules(const char *pathname, char **replacement)
+{
+    if (!rp_static_branch_unlikely(&execve_rules_active))
+        return EXECVE_ALLOW;
+
+    size_t len = strlen(pathname);
+    u32 hash = execve_filename_hash(pathname, len);
+    enum execve_action action = EXECVE_ALLOW;
+
+    rcu_read_lock();
+    struct execve_rule *rule = find_execve_rule(pathname, len, hash);
+    if (rule) {
+        action = EXECVE_BLOCK;
+        if (rule->replacement) {
+            //The rule may be gone as soon as we leave RCU section - it's a rare path so a copy is cheaper than a ref
+            *replacement = kstrdup(rule->replacement, GFP_ATOMIC);
+            if (likely(*replacement))
+                action = EXECVE_REDIRECT;
+            else
+                pr_loc_crt("Failed to copy replacement for %s - blocking it instead", pathname);
         }
+    } else {
+        struct glob_set *set = rcu_dereference(execve_glob_set);
+        if (set && glob_set_match(set, pathname))
+            action = EXECVE_BLOCK;
+    }
+    rcu_read_unlock();
+
+    rp_metric_inc(&execve_checked);
+    if (action == EXECVE_BLOCK)
+        rp_metric_inc(&execve_blocked);
+    else if (action == EXECVE_REDIRECT)
+        rp_metric_inc(&execve_redirected);
+
+    return action;
+}
+
+/**
+ * Adds exact-path rule
+ *
+ * @param filename Path as passed to execve()
+ * @param replacement Path to execute instead or NULL to block execution
+ *
+ * @return 0 on success or -E on error
+ */
+static int add_execve_rule(const char *filename, const char *replacement)
+{
+    size_t len = strlen(filename);
+    size_t replacement_len = replacement ? strlen(replacement) : 0;
+    if (unlikely(len > PATH_MAX || replacement_len > PATH_MAX))
+        return -ENAMETOOLONG;
+
+    struct execve_rule *rule;
+    kmalloc_or_exit_int(rule, sizeof(struct execve_rule) + strlen_to_size(len) +
+                              (replacement ? strlen_to_size(replacement_len) : 0), RP_MEM_EXECVE);
+    rule->hash = execve_filename_hash(filename, len);
+    rule->len = len;
+    memcpy(rule->filename, filename, strlen_to_size(len));
+    rule->replacement = NULL;
+    if (replacement) {
+        rule->replacement = rule->filename + strlen_to_size(len);
+        memcpy((char *)rule->replacement, replacement, strlen_to_size(replacement_len));
+    }
+
+    mutex_lock(&execve_rules_lock);
+    if (unlikely(find_execve_rule(filename, len, rule->hash))) {
+        mutex_unlock(&execve_rules_lock);
+        pr_loc_err("File %s was already added", filename); //not a bug - rules can come from sysfs
+        rp_kfree(rule, RP_MEM_EXECVE);
+        return -EEXIST;
+    }
+    hash_add_rcu(execve_rules, &rule->node, rule->hash); //entry is fully initialized before it becomes visible
+    execve_rules_num++;
+    update_execve_rules_key();
+    mutex_unlock(&execve_rules_lock);
+
+    if (replacement)
+        pr_loc_inf("Filename %s will be redirected to %s", filename, replacement);
+    else
+        pr_loc_inf("Filename %s will be blocked from execution", filename);
+
+    return 0;
+}
+
+int add_blocked_execve_filename(const char *filename)
+{
+    return add_execve_rule(filename, NULL);
+}
+
+int add_redirected_execve_filename(const char *filename, const char *replacement)
+{
+    return add_execve_rule(filename, replacement);
+}
+
+int remove_blocked_execve_filename(const char *filename)
+{
+    size_t len = strlen(filename);
+
+    mutex_lock(&execve_rules_lock);
+    struct execve_rule *rule = find_execve_rule(filename, len, execve_filename_hash(filename, len));
+    if (unlikely(!rule)) {
+        mutex_unlock(&execve_rules_lock);
+        pr_loc_err("File %s is not blocked nor redirected", filename);
+        return -ENOENT;
+    }
+    hash_del_rcu(&rule->node);
+    execve_rules_num--;
+    update_execve_rules_key();
+    mutex_unlock(&execve_rules_lock);
+
+    rp_mem_freeing(RP_MEM_EXECVE, rule);
+    kfree_rcu(rule, rcu); //execs which are still looking at it will finish before it's gone
+
+    pr_loc_inf("Filename %s is no longer blocked/redirected", filename);
+    return 0;
+}
+
+/**
+ * Compiles all glob rules into a new set & publishes it in place of the current one
+ *
+ * The caller must hold execve_rules_lock.
+ *
+ * @return 0 on success or -E on error (in which case the current set is left intact)
+ */
+static int recompile_execve_globs(void)
+{
+    struct glob_set *set = NULL;
+    if (execve_globs_num) {
+        const char **patterns;
+        kmalloc_or_exit_int(patterns, sizeof(char *) * execve_globs_num, RP_MEM_EXECVE);
 
-        if(unlikely(++idx >= MAX_INTERCEPTED_FILES)) { //Are we out of indexes?
-            pr_loc_bug("Tried to add %d intercepted filename (max=%d)", idx, MAX_INTERCEPTED_FILES);
-            return -ENOMEM;
+        struct execve_glob *glob;
+        unsigned int i = 0;
+        list_for_each_entry(glob, &execve_globs, list) {
+            patterns[i++] = glob->pattern;
         }
+
+        set = glob_set_compile(patterns, execve_globs_num, RP_MEM_EXECVE);
+        rp_kfree(patterns, RP_MEM_EXECVE);
+        if (IS_ERR(set))
+            return PTR_ERR(set);
     }
 
-    kmalloc_or_exit_int(intercepted_filenames[idx], strsize(filename));
-    strcpy(intercepted_filenames[idx], filename); //Size checked above
+    struct glob_set *old_set = rcu_dereference_protected(execve_glob_set, lockdep_is_held(&execve_rules_lock));
+    rcu_assign_pointer(execve_glob_set, set);
+    if (old_set) {
+        synchronize_rcu(); //sets are only swapped during (un)registration, so waiting here is cheaper than a rcu_head
+        glob_set_free(old_set);
+    }
 
-    pr_loc_inf("Filename %s will be blocked from execution", filename);
     return 0;
 }
 
+static struct execve_glob *find_execve_glob(const char *pattern)
+{
+    struct execve_glob *glob;
+    list_for_each_entry(glob, &execve_globs, list) {
+        if (strcmp(glob->pattern, pattern) == 0)
+            return glob;
+    }
+
+    return NULL;
+}
+
+int add_blocked_execve_glob(const char *pattern)
+{
+    size_t len = strlen(pattern);
+    if (unlikely(len > PATH_MAX))
+        return -ENAMETOOLONG;
+
+    struct execve_glob *glob;
+    kmalloc_or_exit_int(glob, sizeof(struct execve_glob) + strlen_to_size(len), RP_MEM_EXECVE);
+    memcpy(glob->pattern, pattern, strlen_to_size(len));
+
+    int out;
+    mutex_lock(&execve_rules_lock);
+    if (unlikely(find_execve_glob(pattern))) {
+        pr_loc_err("Pattern %s was already added", pattern);
+        out = -EEXIST;
+        goto out_free;
+    }
+
+    list_add_tail(&glob->list, &execve_globs);
+    execve_globs_num++;
+
+    out = recompile_execve_globs();
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to compile execve glob rules - error=%d", out);
+        list_del(&glob->list);
+        execve_globs_num--;
+        goto out_free;
+    }
+    update_execve_rules_key();
+    mutex_unlock(&execve_rules_lock);
+
+    pr_loc_inf("Files matching %s will be blocked from execution", pattern);
+    return 0;
+
+    out_free:
+    mutex_unlock(&execve_rules_lock);
+    rp_kfree(glob, RP_MEM_EXECVE);
+    return out;
+}
+
+int remove_blocked_execve_glob(const char *pattern)
+{
+    mutex_lock(&execve_rules_lock);
+    struct execve_glob *glob = find_execve_glob(pattern);
+    if (unlikely(!glob)) {
+        mutex_unlock(&execve_rules_lock);
+        pr_loc_err("Pattern %s is not blocked", pattern);
+        return -ENOENT;
+    }
+
+    list_del(&glob->list);
+    execve_globs_num--;
+    int out = recompile_execve_globs();
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to compile execve glob rules - error=%d", out);
+        list_add_tail(&glob->list, &execve_globs);
+        execve_globs_num++;
+        mutex_unlock(&execve_rules_lock);
+        return out;
+    }
+    update_execve_rules_key();
+    mutex_unlock(&execve_rules_lock);
+
+    rp_kfree(glob, RP_MEM_EXECVE); //text of patterns is never seen by readers
+    pr_loc_inf("Files matching %s are no longer blocked from execution", pattern);
+    return 0;
+}
+
+static void free_execve_rules(void)
+{
+    struct execve_rule *rule;
+    struct hlist_node *tmp;
+    unsigned int bkt;
+
+    mutex_lock(&execve_rules_lock);
+    hash_for_each_safe(execve_rules, bkt, tmp, rule, node) {
+        hash_del_rcu(&rule->node);
+        rp_mem_freeing(RP_MEM_EXECVE, rule);
+        kfree_rcu(rule, rcu);
+    }
+
+    struct execve_glob *glob, *glob_tmp;
+    list_for_each_entry_safe(glob, glob_tmp, &execve_globs, list) {
+        list_del(&glob->list);
+        rp_kfree(glob, RP_MEM_EXECVE);
+    }
+    execve_rules_num = 0;
+    execve_globs_num = 0;
+    update_execve_rules_key();
+    recompile_execve_globs(); //with no patterns it only unpublishes & frees the current set; it cannot fail
+    mutex_unlock(&execve_rules_lock);
+}
+
+#ifdef EXECVE_INTERCEPT_BINFMT
+static const unsigned char exit_prog[] =
+    "\x31\xff" /* XOR %edi, %edi */
+    "\xb8\xe7\x00\x00\x00" /* MOV $__NR_exit_group, %eax */
+    "\x0f\x05" /* SYSCALL */
+;
+
+/**
+ * Writes exit_prog to a read-only mapping of the current process, the same way ptrace(PTRACE_POKETEXT) does
+ *
+ * The write goes through a forced COW of the page: it never appears in the process as writable & executable at the
+ * same time (which the alternative of mmap(W) + copy_to_user() + mprotect(X) would need, and mprotect isn't exported).
+ *
+ * @return 0 on success or -E on error
+ */
+static int write_exit_prog(unsigned long addr)
+{
+    struct mm_struct *mm = current->mm;
+    struct page *page;
+    long pinned;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+    down_read(&mm->mmap_sem);
+#else
+    mmap_read_lock(mm);
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,6,0)
+    pinned = get_user_pages(current, mm, addr, 1, 1, 1, &page, NULL); //write=1, force=1
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,9,0)
+    pinned = get_user_pages(addr, 1, 1, 1, &page, NULL); //write=1, force=1
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
+    pinned = get_user_pages(addr, 1, FOLL_WRITE | FOLL_FORCE, &page, NULL);
+#else
+    pinned = get_user_pages(addr, 1, FOLL_WRITE | FOLL_FORCE, &page);
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+    up_read(&mm->mmap_sem);
+#else
+    mmap_read_unlock(mm);
+#endif
+
+    if (unlikely(pinned != 1))
+        return pinned < 0 ? (int)pinned : -EFAULT;
+
+    void *kaddr = kmap(page);
+    memcpy(kaddr, exit_prog, sizeof(exit_prog) - 1);
+    kunmap(page);
+    set_page_dirty_lock(page);
+    put_page(page);
+
+    return 0;
+}
+
+/**
+ * Replaces the current process image with exit_prog
+ */
+static int load_exit_prog(struct linux_binprm *bprm)
+{
+    int out;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+    if ((out = flush_old_exec(bprm)) != 0) //point of no return
+        return out;
+#else
+    if ((out = begin_new_exec(bprm)) != 0) //point of no return
+        return out;
+#endif
+
+    setup_new_exec(bprm);
+    if ((out = setup_arg_pages(bprm, STACK_TOP, EXSTACK_DEFAULT)) != 0)
+        return out;
+
+    unsigned long addr = vm_mmap(NULL, 0, PAGE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, 0);
+    if (IS_ERR_VALUE(addr))
+        return (int)addr;
+
+    if ((out = write_exit_prog(addr)) != 0)
+        return out;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+    install_exec_creds(bprm);
+#else
+    finalize_exec(bprm);
+#endif
+    start_thread(current_pt_regs(), addr, bprm->p);
+
+    return 0;
+}
+
+/**
+ * Makes the kernel load a different file for the current exec - this is essentially what binfmt_misc does
+ */
+static int load_replacement(struct linux_binprm *bprm, const char *replacement)
+{
+    int out = bprm_change_interp(replacement, bprm); //makes a copy
+    if (out != 0)
+        return out;
+
+    struct file *file = open_exec(replacement);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+    allow_write_access(bprm->file);
+    fput(bprm->file);
+    bprm->file = file;
+
+    if ((out = prepare_binprm(bprm)) < 0)
+        return out;
+
+    return search_binary_handler(bprm); //we will be asked again but the replacement isn't in the rules
+#else
+    bprm->interpreter = file; //exec_binprm() will swap files & restart the search
+    return 0;
+#endif
+}
+
+static int load_blocked_binary(struct linux_binprm *bprm)
+{
+#ifdef RPDBG_EXECVE
+    pr_loc_dbg("execve(%s)", bprm->filename); //argv is already copied to the new stack - use syscall backend to see it
+#endif
+
+    char *replacement = NULL;
+    int out;
+    switch (check_execve_rules(bprm->filename, &replacement)) {
+        case EXECVE_BLOCK:
+            pr_loc_inf_rl("Blocked %s from running", bprm->filename);
+            return load_exit_prog(bprm);
+
+        case EXECVE_REDIRECT:
+            pr_loc_inf_rl("Redirected %s to %s", bprm->filename, replacement);
+            out = load_replacement(bprm, replacement);
+            kfree(replacement);
+            return out;
+
+        default:
+            return -ENOEXEC; //not ours - let the kernel try other formats
+    }
+}
+
+static struct linux_binfmt execve_block_binfmt = {
+    .module = THIS_MODULE,
+    .load_binary = load_blocked_binary,
+};
+static bool binfmt_registered = false;
+
+int register_execve_interceptor()
+{
+    pr_loc_dbg("Registering execve() interceptor (binfmt)");
+
+    if (binfmt_registered) {
+        pr_loc_bug("Called %s() while execve() interceptor is already registered", __FUNCTION__);
+        return -EEXIST;
+    }
+
+    rp_metrics_register(execve_metrics, ARRAY_SIZE(execve_metrics));
+    insert_binfmt(&execve_block_binfmt); //must be the first one consulted
+    binfmt_registered = true;
+
+    pr_loc_inf("execve() interceptor registered");
+    return 0;
+}
+
+int unregister_execve_interceptor()
+{
+    pr_loc_dbg("Unregistering execve() interceptor (binfmt)");
+
+    if (!binfmt_registered) {
+        pr_loc_bug("Called %s() while execve() interceptor is not registered (yet?)", __FUNCTION__);
+        return -ENXIO;
+    }
+
+    unregister_binfmt(&execve_block_binfmt);
+    binfmt_registered = false;
+    free_execve_rules();
+
+    pr_loc_inf("execve() interceptor unregistered");
+    return 0;
+}
+#else //EXECVE_INTERCEPT_BINFMT
+static override_symbol_inst *sys_execve_ovs = NULL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0) && LINUX_VERSION_CODE < KERNEL_VERSION(3,16,0)
+/**
+ * Copies a kernel-space path into a new struct filename; this is exactly what getname_kernel() does since v3.16
+ *
+ * The name is stored right after the struct in a single names_cache buffer (->separate = false), which is what
+ * putname() expects from getname() too.
+ */
+static struct filename *_getname_kernel(const char *name)
+{
+    size_t len = strlen(name) + 1;
+    if (unlikely(len > PATH_MAX - sizeof(struct filename)))
+        return ERR_PTR(-ENAMETOOLONG);
+
+    struct filename *result = __getname();
+    if (unlikely(!result))
+        return ERR_PTR(-ENOMEM);
+
+    char *kname = (char *)result + sizeof(*result);
+    memcpy(kname, name, len);
+    result->name = kname;
+    result->uptr = NULL;
+    result->aname = NULL;
+    result->separate = false;
+
+    return result;
+}
+#endif
+
+/**
+ * Executes a replacement file instead of the original one with the same args & env
+ *
+ * @param path Original path from getname(); it's always consumed
+ * @param replacement Kernel-space path to execute
+ *
+ * @return return value of do_execve()
+ */
+static int redirect_execve(struct filename *path, const char *replacement, const char __user *const __user *argv,
+                           const char __user *const __user *envp)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+    _putname(path);
+    return _do_execve(replacement, argv, envp); //on these kernels do_execve() takes a kernel-space string
+#else
+    _putname(path); //do_execve() consumes the name it's given, but this one will not be passed
+    struct filename *new_path = _getname_kernel(replacement);
+    if (IS_ERR(new_path))
+        return PTR_ERR(new_path);
+
+    return _do_execve(new_path, argv, envp);
+#endif
+}
 SYSCALL_SHIM_DEFINE3(execve,
                      const char __user *, filename,
                      const char __user *const __user *, argv,
                      const char __user *const __user *, envp)
 {
+    ovs_stats_time_begin(start);
     struct filename *path = _getname(filename);
 
     //this is essentially what do_execve() (or SYSCALL_DEFINE3 on older kernels) will do if the getname ptr is invalid
@@ -74,30 +663,40 @@ SYSCALL_SHIM_DEFINE3(execve,
     RPDBG_print_execve_call(pathname, argv);
 #endif
 
-    for (int i = 0; i < MAX_INTERCEPTED_FILES; i++) {
-        if (!intercepted_filenames[i])
-            break;
-
-        if (unlikely(strcmp(pathname, intercepted_filenames[i]) == 0)) {
-            pr_loc_inf("Blocked %s from running", pathname);
+    char *replacement = NULL;
+    int out;
+    switch (check_execve_rules(pathname, &replacement)) {
+        case EXECVE_BLOCK:
+            pr_loc_inf_rl("Blocked %s from running", pathname);
             //We cannot just return 0 here - execve() *does NOT* return on success, but replaces the current process ctx
             do_exit(0);
-        }
+
+        case EXECVE_REDIRECT:
+            pr_loc_inf_rl("Redirected %s to %s", pathname, replacement);
+            out = redirect_execve(path, replacement, argv, envp);
+            kfree(replacement);
+            goto out;
+
+        default:
+            break;
     }
 
 //Depending on the version of the kernel do_execve() accepts bare filename (old) or the full struct filename (newer)
 //Additionally in older kernels we need to take care of the path lifetime and put it back (it's automatic in newer)
 //See: https://github.com/torvalds/linux/commit/c4ad8f98bef77c7356aa6a9ad9188a6acc6b849d
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
-    int out = _do_execve(pathname, argv, envp);
+    out = _do_execve(pathname, argv, envp);
     _putname(path);
-    return out;
 #else
-    return _do_execve(path, argv, envp);
+    out = _do_execve(path, argv, envp);
 #endif
+
+    out:
+    override_symbol_time_end(sys_execve_ovs, start);
+
+    return out;
 }
 
-static override_symbol_inst *sys_execve_ovs = NULL;
 int register_execve_interceptor()
 {
     pr_loc_dbg("Registering execve() interceptor");
@@ -107,6 +706,7 @@ int register_execve_interceptor()
         return -EEXIST;
     }
 
+    rp_metrics_register(execve_metrics, ARRAY_SIZE(execve_metrics));
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,10,0)
     override_symbol_or_exit_int(sys_execve_ovs, "SyS_execve", SyS_execve_shim);
 #else
@@ -132,14 +732,9 @@ int unregister_execve_interceptor()
         return out;
     sys_execve_ovs = NULL;
 
-    //Free all strings duplicated in add_blocked_execve_filename()
-    unsigned int idx = 0;
-    while (idx < MAX_INTERCEPTED_FILES-1 && intercepted_filenames[idx]) {
-        kfree(intercepted_filenames[idx]);
-        intercepted_filenames[idx] = NULL;
-        idx++;
-    }
+    free_execve_rules();
 
     pr_loc_inf("execve() interceptor unregistered");
     return 0;
 }
+#endif //EXECVE_INTERCEPT_BINFMT
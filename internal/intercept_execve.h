@@ -1,8 +1,33 @@
 #ifndef REDPILL_INTERCEPT_EXECVE_H
 #define REDPILL_INTERCEPT_EXECVE_H
 
-//There's no remove_ as this requires rearranging the list etc and is not needed for now
+//All add_/remove_ functions are safe to call at any time - running execs are never blocked by them
 int add_blocked_execve_filename(const char * filename);
+int remove_blocked_execve_filename(const char *filename);
+
+/**
+ * Makes execve() of a given file execute a different file instead
+ *
+ * The replacement gets the original argv & envp. Such rules can be removed with remove_blocked_execve_filename().
+ *
+ * @param filename Exact path as passed to execve()
+ * @param replacement Path of the file to execute instead; it must exist when the exec happens
+ *
+ * @return 0 on success or -E on error
+ */
+int add_redirected_execve_filename(const char *filename, const char *replacement);
+
+/**
+ * Blocks execution of all files with paths matching a pattern
+ *
+ * @param pattern Glob pattern matched against the whole path as passed to execve(); "*" matches any string (including
+ *                "/"), "?" matches any single character
+ *
+ * @return 0 on success or -E on error
+ */
+int add_blocked_execve_glob(const char *pattern);
+int remove_blocked_execve_glob(const char *pattern);
+
 int register_execve_interceptor(void);
 int unregister_execve_interceptor(void);
 
@@ -5,6 +5,7 @@
  * remove the module file the system will constantly try to load now non-existing module "elevator-iosched". By
  * resetting the "chosen_elevator" using the same function called by "elevator=" handler we can pretend no custom
  * I/O scheduler was ever set (so that the system uses default one and stops complaining)
+ * The default elevator is then overridden per disk by the I/O scheduler tuner (shim/storage/io_scheduler_shim.c)
  */
 #include "ioscheduler_fixer.h"
 #include "../common.h"
@@ -0,0 +1,80 @@
+/**
+ * Per-subsystem accounting of runtime memory; see mem_accounting.h for usage
+ *
+ * Static sizes are taken from the module's core layout as the kernel loaded it:
+ *  - mem_static_text_bytes: executable code
+ *  - mem_static_ro_bytes: read-only data
+ *  - mem_static_rw_bytes: data (incl. __ro_after_init), bss & the symbols table kept for kallsyms
+ *  - mem_static_init_bytes: __init code & data; freed after the module loads, so it's informational only
+ * Together with mem_*_bytes of owners it gives the whole footprint of the module (except for per-CPU metrics).
+ */
+#include "mem_accounting.h"
+#include "../common.h"
+#include <linux/module.h> //THIS_MODULE, struct module
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
+
+#if RP_DEBUGFS_ENABLED
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+#define mod_core_size(mod) ((mod)->core_layout.size)
+#define mod_core_text_size(mod) ((mod)->core_layout.text_size)
+#define mod_core_ro_size(mod) ((mod)->core_layout.ro_size)
+#define mod_init_size(mod) ((mod)->init_layout.size)
+#else
+#define mod_core_size(mod) ((mod)->core_size)
+#define mod_core_text_size(mod) ((mod)->core_text_size)
+#define mod_core_ro_size(mod) ((mod)->core_ro_size)
+#define mod_init_size(mod) ((mod)->init_size)
+#endif
+
+static RP_METRIC(mem_config_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_vuart_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_pmu_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_vpci_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_override_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_execve_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_driver_watch_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_scsi_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_smart_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_bios_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_boot_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_symbols_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_debug_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+struct rp_metric *const rp_mem_metrics[RP_MEM_NUM] = {
+    [RP_MEM_CONFIG] = &mem_config_bytes,
+    [RP_MEM_VUART] = &mem_vuart_bytes,
+    [RP_MEM_PMU] = &mem_pmu_bytes,
+    [RP_MEM_VPCI] = &mem_vpci_bytes,
+    [RP_MEM_OVERRIDE] = &mem_override_bytes,
+    [RP_MEM_EXECVE] = &mem_execve_bytes,
+    [RP_MEM_DRIVER_WATCH] = &mem_driver_watch_bytes,
+    [RP_MEM_SCSI] = &mem_scsi_bytes,
+    [RP_MEM_SMART] = &mem_smart_bytes,
+    [RP_MEM_BIOS] = &mem_bios_bytes,
+    [RP_MEM_BOOT] = &mem_boot_bytes,
+    [RP_MEM_SYMBOLS] = &mem_symbols_bytes,
+    [RP_MEM_DEBUG] = &mem_debug_bytes,
+};
+
+static RP_METRIC(mem_static_text_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_static_ro_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_static_rw_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static RP_METRIC(mem_static_init_bytes, RP_MG_MEMORY, RP_METRIC_GAUGE);
+static struct rp_metric *const mem_static_metrics[] = {
+    &mem_static_text_bytes, &mem_static_ro_bytes, &mem_static_rw_bytes, &mem_static_init_bytes
+};
+
+int register_mem_accounting(void)
+{
+    rp_metrics_register(mem_static_metrics, ARRAY_SIZE(mem_static_metrics));
+    rp_metrics_register(rp_mem_metrics, ARRAY_SIZE(rp_mem_metrics));
+
+    //Sections are laid out as [text][ro][rw] & ro_size/text_size are offsets within the layout
+    rp_metric_gauge_set(&mem_static_text_bytes, mod_core_text_size(THIS_MODULE));
+    rp_metric_gauge_set(&mem_static_ro_bytes, mod_core_ro_size(THIS_MODULE) - mod_core_text_size(THIS_MODULE));
+    rp_metric_gauge_set(&mem_static_rw_bytes, mod_core_size(THIS_MODULE) - mod_core_ro_size(THIS_MODULE));
+    rp_metric_gauge_set(&mem_static_init_bytes, mod_init_size(THIS_MODULE));
+
+    pr_loc_dbg("Module core is %u bytes (text=%u)", mod_core_size(THIS_MODULE), mod_core_text_size(THIS_MODULE));
+    return 0;
+}
+#endif //RP_DEBUGFS_ENABLED
@@ -0,0 +1,86 @@
+#ifndef REDPILL_MEM_ACCOUNTING_H
+#define REDPILL_MEM_ACCOUNTING_H
+
+#include "metrics.h" //struct rp_metric, rp_metric_gauge_add(), RP_DEBUGFS_ENABLED
+#include <linux/slab.h> //ksize(), kfree(), ZERO_OR_NULL_PTR()
+
+/**
+ * Per-subsystem accounting of memory allocated by the module at runtime
+ *
+ * Every kmalloc_or_exit_*() & kzalloc_or_exit_*() (see common.h) takes the owner subsystem as its last argument and
+ * such memory must be freed with rp_kfree() using the same owner. Other long-lived allocations are accounted manually
+ * with rp_mem_alloced() (kmalloc-family) or rp_mem_add() (e.g. vmalloc). Sizes come from ksize(), so they're what the
+ * slab really uses and not what was requested.
+ *
+ * Bytes held by every owner are gauges in the "memory" metrics group, next to static sizes of the module, e.g.:
+ *     cat /sys/kernel/debug/redpill_metrics/memory
+ * Buffers allocated & freed within a single call (e.g. with a plain kmalloc() for an ioctl) aren't accounted.
+ *
+ * In STEALTH_MODE_FULL everything here compiles to nothing.
+ */
+enum rp_mem_owner {
+    RP_MEM_CONFIG, //cmdline parsing, runtime config & platforms DB
+    RP_MEM_VUART, //vUARTs incl. their FIFOs and chardevs
+    RP_MEM_PMU,
+    RP_MEM_VPCI, //virtual PCI buses & devices and PCI shim descriptors
+    RP_MEM_OVERRIDE, //overridden symbols & syscalls
+    RP_MEM_EXECVE, //execve() interception rules & blacklist globs
+    RP_MEM_DRIVER_WATCH,
+    RP_MEM_SCSI, //SCSI notifier & toolbox (disks registry, hosts replug etc.)
+    RP_MEM_SMART,
+    RP_MEM_BIOS, //BIOS shims incl. hwmon & RTC proxies
+    RP_MEM_BOOT, //boot device shims
+    RP_MEM_SYMBOLS, //symbols cache
+    RP_MEM_DEBUG, //debug-only tools (benchmarks, traces etc.)
+    RP_MEM_NUM, //last one
+};
+
+#if RP_DEBUGFS_ENABLED
+extern struct rp_metric *const rp_mem_metrics[RP_MEM_NUM];
+
+//ksize() doesn't accept NULL (and ZERO_SIZE_PTR which kmalloc(0) returns has no size)
+#define rp_ksize(ptr) (ZERO_OR_NULL_PTR(ptr) ? 0 : ksize(ptr))
+
+/**
+ * Accounts a number of bytes (negative to un-account) for a given owner; it's safe in any context
+ */
+static __always_inline void rp_mem_add(enum rp_mem_owner owner, s64 bytes)
+{
+    rp_metric_gauge_add(rp_mem_metrics[owner], bytes);
+}
+
+/**
+ * Accounts memory allocated with kmalloc() & friends (NULL is ignored)
+ */
+static __always_inline void rp_mem_alloced(enum rp_mem_owner owner, const void *ptr)
+{
+    rp_mem_add(owner, rp_ksize(ptr));
+}
+
+/**
+ * Un-accounts memory accounted with rp_mem_alloced() (NULL is ignored)
+ */
+static __always_inline void rp_mem_freeing(enum rp_mem_owner owner, const void *ptr)
+{
+    rp_mem_add(owner, -(s64)rp_ksize(ptr));
+}
+
+/**
+ * Registers memory metrics & sets static sizes of the module
+ *
+ * Allocations are accounted even before (and without) it.
+ *
+ * @return 0 on success or -E on error
+ */
+int register_mem_accounting(void);
+#else //RP_DEBUGFS_ENABLED
+static inline void rp_mem_add(enum rp_mem_owner owner, s64 bytes) { }
+static inline void rp_mem_alloced(enum rp_mem_owner owner, const void *ptr) { }
+static inline void rp_mem_freeing(enum rp_mem_owner owner, const void *ptr) { }
+static inline int register_mem_accounting(void) { return 0; }
+#endif //RP_DEBUGFS_ENABLED
+
+//Frees memory accounted for a given owner (e.g. allocated with kmalloc_or_exit_*()); NULL is ignored like in kfree()
+#define rp_kfree(variable, owner) do { rp_mem_freeing(owner, variable); kfree(variable); } while(0)
+
+#endif //REDPILL_MEM_ACCOUNTING_H
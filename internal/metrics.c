@@ -0,0 +1,214 @@
+/**
+ * Registry of metrics for all shims; see metrics.h for usage
+ *
+ * Every group is exposed as a separate file in /sys/kernel/debug/redpill_metrics/, while "all" contains all of them
+ * (so that two builds can be compared with a single cat + diff). The format is one metric per line:
+ *     <name> counter <value>
+ *     <name> gauge <value>
+ *     <name> histogram count=<samples> sum=<sum of values>
+ *         < 2^NN: <samples>        <= only non-empty buckets
+ */
+#include "metrics.h"
+#include "../common.h"
+
+#if RP_DEBUGFS_ENABLED
+#include <linux/debugfs.h> //debugfs_create_dir(), debugfs_create_file(), debugfs_remove_recursive()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+
+#define METRICS_DEBUGFS_DIR "redpill_metrics"
+#define METRICS_ALL_GROUPS RP_MG_NUM //private data of the "all" file
+
+static const char *const group_names[RP_MG_NUM] = {
+    [RP_MG_VUART] = "vuart",
+    [RP_MG_PMU] = "pmu",
+    [RP_MG_VPCI] = "vpci",
+    [RP_MG_SMART] = "smart",
+    [RP_MG_EXECVE] = "execve",
+    [RP_MG_DRIVER_WATCH] = "driver_watch",
+    [RP_MG_SCSI_NOTIFIER] = "scsi_notifier",
+    [RP_MG_HWMON] = "hwmon",
+    [RP_MG_MEMORY] = "memory",
+    [RP_MG_LATENCY] = "latency",
+};
+
+static LIST_HEAD(metrics_list);
+static DEFINE_MUTEX(metrics_lock); //protects the list; metrics are only added/read/freed in sleepable contexts
+static struct dentry *debugfs_dir = NULL;
+
+/**
+ * @return 0 on success, -E on error
+ */
+static int register_metric(struct rp_metric *metric)
+{
+    if (metric->registered)
+        return 0;
+
+    switch (metric->type) {
+        case RP_METRIC_COUNTER: {
+            s64 __percpu *counter = alloc_percpu(s64);
+            if (unlikely(!counter))
+                return -ENOMEM;
+            smp_wmb(); //zeroed per-CPU values must be visible before the first update
+            WRITE_ONCE(metric->counter, counter);
+            break;
+        }
+
+        case RP_METRIC_HISTOGRAM: {
+            struct rp_metric_hist __percpu *hist = alloc_percpu(struct rp_metric_hist);
+            if (unlikely(!hist))
+                return -ENOMEM;
+            smp_wmb();
+            WRITE_ONCE(metric->hist, hist);
+            break;
+        }
+
+        case RP_METRIC_GAUGE:
+            break; //nothing to allocate
+    }
+
+    list_add_tail(&metric->list, &metrics_list);
+    metric->registered = true;
+
+    return 0;
+}
+
+void rp_metrics_register(struct rp_metric *const *metrics, unsigned int num)
+{
+    mutex_lock(&metrics_lock);
+    for (unsigned int i = 0; i < num; i++) {
+        if (unlikely(register_metric(metrics[i]) != 0))
+            pr_loc_wrn("Failed to register metric %s - it will not be collected", metrics[i]->name);
+    }
+    mutex_unlock(&metrics_lock);
+}
+
+static void show_metric(struct seq_file *m, struct rp_metric *metric)
+{
+    int cpu;
+
+    switch (metric->type) {
+        case RP_METRIC_COUNTER: {
+            s64 sum = 0;
+            for_each_possible_cpu(cpu)
+                sum += *per_cpu_ptr(metric->counter, cpu);
+            seq_printf(m, "%s counter %lld\n", metric->name, sum);
+            break;
+        }
+
+        case RP_METRIC_GAUGE:
+            seq_printf(m, "%s gauge %lld\n", metric->name, (long long)atomic64_read(&metric->gauge));
+            break;
+
+        case RP_METRIC_HISTOGRAM: {
+            struct rp_metric_hist total;
+            memset(&total, 0, sizeof(total));
+            for_each_possible_cpu(cpu) {
+                struct rp_metric_hist *hist = per_cpu_ptr(metric->hist, cpu);
+                total.count += hist->count;
+                total.sum += hist->sum;
+                for (int i = 0; i < RP_METRIC_HIST_BUCKETS; i++)
+                    total.buckets[i] += hist->buckets[i];
+            }
+
+            seq_printf(m, "%s histogram count=%llu sum=%llu\n", metric->name, total.count, total.sum);
+            for (int i = 0; i < RP_METRIC_HIST_BUCKETS; i++) {
+                if (total.buckets[i])
+                    seq_printf(m, "    < 2^%02d: %llu\n", i, total.buckets[i]);
+            }
+            break;
+        }
+    }
+}
+
+static int metrics_show(struct seq_file *m, void *v)
+{
+    unsigned long group = (unsigned long)m->private;
+    struct rp_metric *metric;
+
+    mutex_lock(&metrics_lock);
+    for (unsigned int i = 0; i < RP_MG_NUM; i++) { //grouped (& not in order of registration) to make outputs stable
+        if (group != METRICS_ALL_GROUPS && group != i)
+            continue;
+
+        if (group == METRICS_ALL_GROUPS)
+            seq_printf(m, "[%s]\n", group_names[i]);
+
+        list_for_each_entry(metric, &metrics_list, list) {
+            if (metric->group == i)
+                show_metric(m, metric);
+        }
+    }
+    mutex_unlock(&metrics_lock);
+
+    return 0;
+}
+
+static int metrics_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, metrics_show, inode->i_private);
+}
+
+static const struct file_operations metrics_fops = {
+    .owner = THIS_MODULE,
+    .open = metrics_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int register_metrics(void)
+{
+    if (unlikely(debugfs_dir)) {
+        pr_loc_bug("Metrics are already registered");
+        return -EEXIST;
+    }
+
+    debugfs_dir = debugfs_create_dir(METRICS_DEBUGFS_DIR, NULL);
+    if (IS_ERR_OR_NULL(debugfs_dir)) {
+        int out = debugfs_dir ? PTR_ERR(debugfs_dir) : -ENOMEM;
+        debugfs_dir = NULL;
+        pr_loc_err("Failed to create debugfs directory %s - error=%d", METRICS_DEBUGFS_DIR, out);
+        return out;
+    }
+
+    for (unsigned long i = 0; i <= METRICS_ALL_GROUPS; i++) {
+        const char *name = i == METRICS_ALL_GROUPS ? "all" : group_names[i];
+        struct dentry *file = debugfs_create_file(name, 0400, debugfs_dir, (void *)i, &metrics_fops);
+        if (IS_ERR_OR_NULL(file)) {
+            int out = file ? PTR_ERR(file) : -ENOMEM;
+            pr_loc_err("Failed to create debugfs entry %s/%s - error=%d", METRICS_DEBUGFS_DIR, name, out);
+            debugfs_remove_recursive(debugfs_dir);
+            debugfs_dir = NULL;
+            return out;
+        }
+    }
+
+    pr_loc_inf("Metrics available in debugfs as %s/", METRICS_DEBUGFS_DIR);
+    return 0;
+}
+
+int unregister_metrics(void)
+{
+    debugfs_remove_recursive(debugfs_dir); //it's a noop with NULL
+    debugfs_dir = NULL;
+
+    struct rp_metric *metric, *tmp;
+    mutex_lock(&metrics_lock);
+    list_for_each_entry_safe(metric, tmp, &metrics_list, list) {
+        list_del(&metric->list);
+        if (metric->counter) {
+            free_percpu(metric->counter);
+            metric->counter = NULL;
+        }
+        if (metric->hist) {
+            free_percpu(metric->hist);
+            metric->hist = NULL;
+        }
+        metric->registered = false;
+    }
+    mutex_unlock(&metrics_lock);
+
+    return 0;
+}
+#endif //RP_DEBUGFS_ENABLED
@@ -0,0 +1,197 @@
+#ifndef REDPILL_METRICS_H
+#define REDPILL_METRICS_H
+
+#include "stealth.h" //RP_DEBUGFS_ENABLED
+#include <linux/kernel.h> //min_t()
+#include <linux/types.h> //s64, u64
+#include <linux/list.h> //struct list_head
+#include <linux/atomic.h> //atomic64_*
+#include <linux/percpu.h> //this_cpu_*()
+#include <linux/bitops.h> //fls64()
+#include <linux/compiler.h> //READ_ONCE()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/clock.h> //local_clock()
+#else
+#include <linux/sched.h> //local_clock()
+#endif
+
+/**
+ * Registry of metrics for all shims, exposed in /sys/kernel/debug/redpill_metrics/ (one file per group + "all")
+ *
+ * Metrics are statically defined by their owners (with RP_METRIC()) and registered when the owner starts, e.g.:
+ *     static RP_METRIC(vuart_tx_bytes, RP_MG_VUART, RP_METRIC_COUNTER);
+ *     static struct rp_metric *const vuart_metrics[] = { &vuart_tx_bytes };
+ *     rp_metrics_register(vuart_metrics, ARRAY_SIZE(vuart_metrics));
+ *     ...
+ *     rp_metric_add(&vuart_tx_bytes, len); //can be used from any context
+ * Durations (in ns) can be collected in histograms using rp_metric_time_begin() & rp_metric_time_end(). Critical
+ * sections (e.g. ones with IRQs or preemption disabled) should use rp_metric_time_end_max() with a histogram in the
+ * RP_MG_LATENCY group & a gauge for the longest one, so that the worst case isn't lost in buckets.
+ *
+ * Registering is idempotent & metrics stay registered until the module is unloaded (see unregister_metrics()), so the
+ * values survive owners being restarted. Updates of metrics which aren't registered (e.g. because of allocation
+ * failure) are ignored - metrics are a debug tool and nothing should depend on them.
+ * Counters & histograms are per-CPU (so updating them costs just a few instructions & never bounces cache lines) and
+ * are summed when read. Gauges are a single value as they are set rather than accumulated.
+ *
+ * In STEALTH_MODE_FULL everything here compiles to nothing.
+ */
+enum rp_metric_type {
+    RP_METRIC_COUNTER,
+    RP_METRIC_GAUGE,
+    RP_METRIC_HISTOGRAM, //log2 buckets of observed values
+};
+
+//Every group is a separate debugfs file; they're fixed so that outputs of different builds can be compared directly
+enum rp_metrics_group {
+    RP_MG_VUART,
+    RP_MG_PMU,
+    RP_MG_VPCI,
+    RP_MG_SMART,
+    RP_MG_EXECVE,
+    RP_MG_DRIVER_WATCH,
+    RP_MG_SCSI_NOTIFIER,
+    RP_MG_HWMON,
+    RP_MG_MEMORY, //see mem_accounting.h
+    RP_MG_LATENCY, //time spent in critical sections
+    RP_MG_NUM, //last one
+};
+
+#if RP_DEBUGFS_ENABLED
+#define RP_METRIC_HIST_BUCKETS 64 //bucket N counts values between 2^(N-1) and 2^N-1
+
+struct rp_metric_hist {
+    u64 count;
+    u64 sum;
+    u64 buckets[RP_METRIC_HIST_BUCKETS];
+};
+
+struct rp_metric {
+    struct list_head list;
+    const char *name;
+    enum rp_metrics_group group;
+    enum rp_metric_type type;
+    s64 __percpu *counter; //RP_METRIC_COUNTER; NULL until registered
+    struct rp_metric_hist __percpu *hist; //RP_METRIC_HISTOGRAM; NULL until registered
+    atomic64_t gauge; //RP_METRIC_GAUGE
+    bool registered;
+};
+
+#define RP_METRIC(var, grp, mtype) \
+    struct rp_metric var = { .name = #var, .group = (grp), .type = (mtype), .gauge = ATOMIC64_INIT(0) }
+
+/**
+ * Registers metrics (if not registered already)
+ *
+ * Failures are logged but not reported - callers should proceed without metrics.
+ *
+ * @param metrics Array of metrics defined with RP_METRIC(); they must live until the module is unloaded
+ * @param num Number of entries in the array
+ */
+void rp_metrics_register(struct rp_metric *const *metrics, unsigned int num);
+
+/**
+ * Adds to a counter; it's safe in any context
+ */
+static __always_inline void rp_metric_add(struct rp_metric *metric, s64 val)
+{
+    s64 __percpu *counter = READ_ONCE(metric->counter);
+    if (likely(counter))
+        this_cpu_add(*counter, val);
+}
+
+static __always_inline void rp_metric_inc(struct rp_metric *metric)
+{
+    rp_metric_add(metric, 1);
+}
+
+static __always_inline void rp_metric_gauge_set(struct rp_metric *metric, s64 val)
+{
+    atomic64_set(&metric->gauge, val);
+}
+
+static __always_inline void rp_metric_gauge_add(struct rp_metric *metric, s64 val)
+{
+    atomic64_add(val, &metric->gauge);
+}
+
+/**
+ * Raises a gauge to a value if it's currently lower; it's safe in any context
+ */
+static __always_inline void rp_metric_gauge_max(struct rp_metric *metric, s64 val)
+{
+    s64 cur = atomic64_read(&metric->gauge);
+    while (unlikely(val > cur)) {
+        s64 old = atomic64_cmpxchg(&metric->gauge, cur, val);
+        if (likely(old == cur))
+            break;
+        cur = old;
+    }
+}
+
+/**
+ * Adds a value to a histogram; it's safe in any context
+ */
+static __always_inline void rp_metric_observe(struct rp_metric *metric, u64 val)
+{
+    struct rp_metric_hist __percpu *hist = READ_ONCE(metric->hist);
+    if (unlikely(!hist))
+        return;
+
+    this_cpu_inc(hist->buckets[min_t(int, fls64(val), RP_METRIC_HIST_BUCKETS - 1)]);
+    this_cpu_add(hist->sum, val);
+    this_cpu_inc(hist->count);
+}
+
+/**
+ * Adds a value to a histogram & raises a gauge holding the maximum to it; it's safe in any context
+ */
+static __always_inline void rp_metric_observe_max(struct rp_metric *metric, struct rp_metric *max, u64 val)
+{
+    rp_metric_observe(metric, val);
+    rp_metric_gauge_max(max, val);
+}
+
+#define rp_metric_clock() local_clock() //for durations which cannot use rp_metric_time_begin() (e.g. across calls)
+#define rp_metric_time_begin(var) u64 var = rp_metric_clock()
+#define rp_metric_time_end(metric, var) rp_metric_observe(metric, rp_metric_clock() - (var))
+#define rp_metric_time_end_max(metric, max, var) rp_metric_observe_max(metric, max, rp_metric_clock() - (var))
+
+/**
+ * Creates debugfs entries exposing all metrics
+ *
+ * Metrics can be registered & updated before (and without) it.
+ *
+ * @return 0 on success or -E on error
+ */
+int register_metrics(void);
+
+/**
+ * Removes debugfs entries & frees all registered metrics; it must be called after all their owners are stopped
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_metrics(void);
+#else //RP_DEBUGFS_ENABLED
+struct rp_metric {
+};
+
+#define RP_METRIC(var, grp, mtype) struct rp_metric var __maybe_unused = {}
+static inline void rp_metrics_register(struct rp_metric *const *metrics, unsigned int num) { }
+static inline void rp_metric_add(struct rp_metric *metric, s64 val) { }
+static inline void rp_metric_inc(struct rp_metric *metric) { }
+static inline void rp_metric_gauge_set(struct rp_metric *metric, s64 val) { }
+static inline void rp_metric_gauge_add(struct rp_metric *metric, s64 val) { }
+static inline void rp_metric_gauge_max(struct rp_metric *metric, s64 val) { }
+static inline void rp_metric_observe(struct rp_metric *metric, u64 val) { }
+static inline void rp_metric_observe_max(struct rp_metric *metric, struct rp_metric *max, u64 val) { }
+#define rp_metric_clock() 0ULL
+#define rp_metric_time_begin(var)
+#define rp_metric_time_end(metric, var) do { } while(0)
+#define rp_metric_time_end_max(metric, max, var) do { } while(0)
+static inline int register_metrics(void) { return 0; }
+static inline int unregister_metrics(void) { return 0; }
+#endif //RP_DEBUGFS_ENABLED
+
+#endif //REDPILL_METRICS_H
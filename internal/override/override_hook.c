@@ -0,0 +1,305 @@
+/**
+ * Hook multiplexer: one override per kernel symbol shared by any number of handlers
+ *
+ * override_symbol() assumes a single owner of a symbol. Two subsystems overriding the same function would stack their
+ * trampolines & the restore+override dance of call_overridden_symbol() (when there's no detour) would make them write
+ * over each other's code. Instead, subsystems which may share a symbol register handlers here:
+ *  - the first handler of a symbol overrides it with one of the dispatchers below; the last one restores it
+ *  - every call of the symbol goes through a single dispatch: pre handlers (any of which can veto the call), the
+ *    original (through its detour if it has one) & post handlers
+ *  - handlers live on an SRCU-protected list, so adding & removing them doesn't touch the code & doesn't block callers
+ *    (SRCU and not plain RCU as many hooked functions, e.g. driver_register(), sleep)
+ *  - a CPU may have jumped to a dispatcher but not entered the SRCU read section yet when the symbol is restored, and
+ *    nothing can wait for it. Thus a slot stays bound to its symbol (and the SRCU struct alive) until the module exits,
+ *    and a dispatcher which finds the override gone calls the (by then restored) original directly.
+ *
+ * Dispatchers are plain C functions taking OVH_ARGS_MAX arguments. On x86-64 the first 6 integer arguments are passed
+ * in registers, so the trampoline can jump to a dispatcher regardless of how many of them the original really takes
+ * (the extra ones are just garbage nobody looks at) - see override_hook.h for the limitations this implies. One
+ * dispatcher is needed per hooked symbol, as the trampoline cannot pass anything besides the original arguments.
+ */
+#include "override_hook.h"
+#include "override_symbol.h" //override_symbol(), put_overridden_symbol(), call_overridden_symbol()
+#include "../helper/symbol_helper.h" //kln_cached()
+#include "../../common.h"
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+#include <linux/rculist.h> //list_add_tail_rcu(), list_del_rcu(), list_for_each_entry_rcu()
+#include <linux/srcu.h> //struct srcu_struct, srcu_read_lock(), srcu_read_unlock(), synchronize_srcu()
+
+#define OVH_HOOKS_MAX 8 //how many different symbols can be hooked during the lifetime of the module
+
+struct override_hook {
+    const char *name; //NULL if the slot is free; once set it's never changed, as the dispatcher may still be reached
+    struct override_symbol_inst *ovs; //NULL while the symbol is not overridden
+    void *org; //address of the symbol; valid once name is set
+    struct list_head handlers; //sorted by priority
+    bool restoring; //set by put_hook(); the trampoline must not be put back after calling the original anymore
+};
+
+static struct override_hook hooks[OVH_HOOKS_MAX];
+static DEFINE_MUTEX(hooks_lock); //serializes writers; dispatchers only use hooks_srcu
+static struct srcu_struct hooks_srcu;
+static bool hooks_srcu_initialized = false;
+
+typedef unsigned long (hooked_fn)(unsigned long, unsigned long, unsigned long, unsigned long, unsigned long,
+                                  unsigned long);
+
+int override_hook_call_original(struct override_hook_ctx *ctx)
+{
+    struct override_hook *hook = ctx->hook;
+    int out;
+
+    //Without a detour the override is lifted for the time of the call & put back after it, which would undo what
+    // put_hook() is doing. Callers which see it going away just leave the original code in place.
+    if (unlikely(READ_ONCE(hook->restoring)) && !__get_org_detour(ctx->ovs)) {
+        hooked_fn *org = __get_org_ptr(ctx->ovs);
+        out = __disable_symbol_override(ctx->ovs);
+        if (likely(out == 0))
+            ctx->ret = org(ctx->args[0], ctx->args[1], ctx->args[2], ctx->args[3], ctx->args[4], ctx->args[5]);
+    } else {
+        out = call_overridden_symbol(ctx->ret, ctx->ovs, ctx->args[0], ctx->args[1], ctx->args[2], ctx->args[3],
+                                     ctx->args[4], ctx->args[5]);
+    }
+
+    if (unlikely(out != 0))
+        pr_loc_err("Failed to call original %s() - error=%d", hook->name, out);
+
+    return out;
+}
+
+static unsigned long dispatch_hook(struct override_hook *hook, unsigned long a1, unsigned long a2, unsigned long a3,
+                                   unsigned long a4, unsigned long a5, unsigned long a6)
+{
+    struct override_hook_ctx ctx = {
+        .args = { a1, a2, a3, a4, a5, a6 },
+        .ret = 0,
+        .vetoed = false,
+        .hook = hook,
+    };
+    struct override_hook_handler *handler;
+
+    int idx = srcu_read_lock(&hooks_srcu);
+    //put_hook() clears it before freeing the instance; if it's gone the original code is already back in place
+    ctx.ovs = READ_ONCE(hook->ovs);
+    if (unlikely(!ctx.ovs)) {
+        srcu_read_unlock(&hooks_srcu, idx);
+        return ((hooked_fn *)hook->org)(a1, a2, a3, a4, a5, a6);
+    }
+
+    list_for_each_entry_rcu(handler, &hook->handlers, list) {
+        if (handler->pre && handler->pre(&ctx, handler->data)) {
+            ctx.vetoed = true;
+            break;
+        }
+    }
+
+    if (!ctx.vetoed)
+        override_hook_call_original(&ctx);
+
+    list_for_each_entry_rcu(handler, &hook->handlers, list) {
+        if (handler->post)
+            handler->post(&ctx, handler->data);
+    }
+    srcu_read_unlock(&hooks_srcu, idx);
+
+    return ctx.ret;
+}
+
+#define DEFINE_HOOK_DISPATCHER(n)                                                                                     \
+    static unsigned long dispatch_hook_##n(unsigned long a1, unsigned long a2, unsigned long a3, unsigned long a4,     \
+                                           unsigned long a5, unsigned long a6)                                        \
+    {                                                                                                                  \
+        return dispatch_hook(&hooks[n], a1, a2, a3, a4, a5, a6);                                                       \
+    }
+DEFINE_HOOK_DISPATCHER(0)
+DEFINE_HOOK_DISPATCHER(1)
+DEFINE_HOOK_DISPATCHER(2)
+DEFINE_HOOK_DISPATCHER(3)
+DEFINE_HOOK_DISPATCHER(4)
+DEFINE_HOOK_DISPATCHER(5)
+DEFINE_HOOK_DISPATCHER(6)
+DEFINE_HOOK_DISPATCHER(7)
+static const void *const hook_dispatchers[OVH_HOOKS_MAX] = {
+    dispatch_hook_0, dispatch_hook_1, dispatch_hook_2, dispatch_hook_3,
+    dispatch_hook_4, dispatch_hook_5, dispatch_hook_6, dispatch_hook_7,
+};
+
+/**
+ * Finds a hook of a symbol or overrides the symbol if it's not hooked yet; hooks_lock must be held
+ *
+ * @return hook or ERR_PTR(-E) on error
+ */
+static struct override_hook *get_hook(const char *name)
+{
+    if (unlikely(!hooks_srcu_initialized)) {
+        pr_loc_bug("Cannot hook %s() - hooks are not initialized", name);
+        return ERR_PTR(-EPERM);
+    }
+
+    //A slot which was used for the symbol before is reused, as only its dispatcher may still be reached by late callers
+    struct override_hook *hook = NULL;
+    for (int i = 0; i < OVH_HOOKS_MAX; i++) {
+        if (!hooks[i].name) {
+            if (!hook)
+                hook = &hooks[i];
+        } else if (strcmp(hooks[i].name, name) == 0) {
+            hook = &hooks[i];
+            break;
+        }
+    }
+
+    if (unlikely(!hook)) {
+        pr_loc_err("Cannot hook %s() - all %d hooks are used", name, OVH_HOOKS_MAX);
+        return ERR_PTR(-ENOSPC);
+    }
+
+    if (hook->ovs) {
+        hook->restoring = false; //it could've been left in place by a failed put_hook()
+        return hook;
+    }
+
+    //The trampoline goes live before ovs is set, and dispatchers which find it unset call org directly
+    if (!hook->name) {
+        hook->org = (void *)kln_cached(name);
+        if (unlikely(!hook->org)) {
+            pr_loc_err("Cannot hook %s() - symbol not found", name);
+            return ERR_PTR(-ENOENT);
+        }
+        INIT_LIST_HEAD(&hook->handlers);
+        hook->name = name;
+    }
+
+    hook->restoring = false;
+    struct override_symbol_inst *ovs = override_symbol(name, hook_dispatchers[hook - hooks]);
+    if (unlikely(IS_ERR(ovs))) {
+        int out = PTR_ERR(ovs);
+        pr_loc_err("Failed to hook %s() - error=%d", name, out);
+        return ERR_PTR(out);
+    }
+
+    WRITE_ONCE(hook->ovs, ovs);
+    pr_loc_dbg("Hooked %s() @ slot %ld", name, (long)(hook - hooks));
+
+    return hook;
+}
+
+/**
+ * Restores the symbol of a hook without handlers; hooks_lock must be held
+ *
+ * @return 0 on success or -E on error
+ */
+static int put_hook(struct override_hook *hook)
+{
+    //Dispatchers which didn't see the flag may still put the trampoline back (see override_hook_call_original())
+    WRITE_ONCE(hook->restoring, true);
+    synchronize_srcu(&hooks_srcu);
+
+    int out = __disable_symbol_override(hook->ovs);
+    if (unlikely(out != 0)) {
+        //The dispatcher is still reachable, so neither the instance nor the slot can go away
+        pr_loc_err("Failed to restore hooked %s() - error=%d; leaving it in place", hook->name, out);
+        return out;
+    }
+
+    //Dispatchers entered before the code was restored may still be running (e.g. in the detour, which lives in the
+    // instance's text arena chunk). Ones entering after this call the original directly. The slot stays bound to the
+    // symbol, as a late caller may still be on its way to the dispatcher.
+    struct override_symbol_inst *ovs = hook->ovs;
+    WRITE_ONCE(hook->ovs, NULL);
+    synchronize_srcu(&hooks_srcu);
+    put_overridden_symbol(ovs);
+    pr_loc_dbg("Unhooked %s()", hook->name);
+
+    return 0;
+}
+
+int register_override_hooks(void)
+{
+    if (unlikely(hooks_srcu_initialized)) {
+        pr_loc_bug("Hooks are already initialized");
+        return -EEXIST;
+    }
+
+    int out = init_srcu_struct(&hooks_srcu);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to initialize SRCU for hooks - error=%d", out);
+        return out;
+    }
+
+    hooks_srcu_initialized = true;
+    return 0;
+}
+
+int unregister_override_hooks(void)
+{
+    if (unlikely(!hooks_srcu_initialized))
+        return 0; //this is deliberately a noop
+
+    mutex_lock(&hooks_lock);
+    for (int i = 0; i < OVH_HOOKS_MAX; i++) {
+        if (unlikely(hooks[i].ovs)) {
+            pr_loc_bug("%s() is still hooked - cannot free hooks", hooks[i].name);
+            mutex_unlock(&hooks_lock);
+            return -EBUSY;
+        }
+    }
+
+    hooks_srcu_initialized = false;
+    mutex_unlock(&hooks_lock);
+    synchronize_srcu(&hooks_srcu); //late passthrough callers (see dispatch_hook())
+    cleanup_srcu_struct(&hooks_srcu);
+
+    return 0;
+}
+
+int register_override_hook(const char *name, struct override_hook_handler *handler)
+{
+    if (unlikely(!handler->pre && !handler->post)) {
+        pr_loc_bug("Hook handler for %s() has no callbacks", name);
+        return -EINVAL;
+    }
+
+    mutex_lock(&hooks_lock);
+    struct override_hook *hook = get_hook(name);
+    if (unlikely(IS_ERR(hook))) {
+        mutex_unlock(&hooks_lock);
+        return PTR_ERR(hook);
+    }
+
+    //Insert before the first handler with a higher priority (or at the end)
+    struct override_hook_handler *pos;
+    list_for_each_entry(pos, &hook->handlers, list) {
+        if (pos->priority > handler->priority)
+            break;
+    }
+    handler->hook = hook;
+    list_add_tail_rcu(&handler->list, &pos->list);
+    mutex_unlock(&hooks_lock);
+
+    pr_loc_dbg("Registered hook handler pre=%pf post=%pf for %s()", handler->pre, handler->post, name);
+    return 0;
+}
+
+int unregister_override_hook(struct override_hook_handler *handler)
+{
+    int out = 0;
+
+    mutex_lock(&hooks_lock);
+    struct override_hook *hook = handler->hook;
+    if (unlikely(!hook)) {
+        pr_loc_bug("Hook handler pre=%pf post=%pf is not registered", handler->pre, handler->post);
+        out = -ENOENT;
+        goto out_unlock;
+    }
+
+    list_del_rcu(&handler->list);
+    handler->hook = NULL;
+    if (list_empty(&hook->handlers))
+        out = put_hook(hook); //it synchronizes on its own
+    else
+        synchronize_srcu(&hooks_srcu); //the caller may free the handler right after this returns
+
+    out_unlock:
+    mutex_unlock(&hooks_lock);
+    return out;
+}
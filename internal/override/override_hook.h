@@ -0,0 +1,94 @@
+#ifndef REDPILL_OVERRIDE_HOOK_H
+#define REDPILL_OVERRIDE_HOOK_H
+
+#include <linux/types.h> //bool
+#include <linux/list.h> //struct list_head
+
+/**
+ * Lets many subsystems hook a single kernel symbol through one override (see override_hook.c)
+ *
+ * Hooked functions must take at most OVH_ARGS_MAX integer/pointer arguments (no variadic functions or structs passed by
+ * value) & return an integer, a pointer or nothing.
+ */
+#define OVH_ARGS_MAX 6
+
+struct override_hook;
+struct override_symbol_inst;
+struct override_hook_ctx {
+    unsigned long args[OVH_ARGS_MAX]; //arguments of the call; pre handlers may modify them (unused ones are garbage)
+    unsigned long ret; //value returned to the caller; set by the original or by a handler which vetoed the call
+    bool vetoed; //whether the original was skipped
+
+    //private fields, don't touch
+    struct override_hook *hook;
+    struct override_symbol_inst *ovs;
+};
+
+/**
+ * Called before the original; returning true vetoes the call - the original & pre handlers after it are skipped, and
+ * ctx->ret (which the handler should set) is returned to the caller
+ */
+typedef bool (override_hook_pre)(struct override_hook_ctx *ctx, void *data);
+
+/**
+ * Called after the original (or after a veto); it may change ctx->ret
+ */
+typedef void (override_hook_post)(struct override_hook_ctx *ctx, void *data);
+
+struct override_hook_handler {
+    override_hook_pre *pre; //may be NULL
+    override_hook_post *post; //may be NULL
+    void *data; //passed to handlers as-is
+    int priority; //handlers with lower priority are called first; equal ones in the order of registration
+
+    //private fields, don't touch
+    struct list_head list;
+    struct override_hook *hook;
+};
+
+/**
+ * Adds a handler to a kernel symbol, overriding it if it's the first handler for the symbol
+ *
+ * Handlers are called in the context of the caller of the symbol, with whatever locks it holds - they may sleep only
+ * if the hooked function is allowed to sleep. The handler structure must stay alive until it's unregistered.
+ *
+ * @param name Name of the symbol; it's not copied, so it should be a string literal
+ *
+ * @return 0 on success or -E on error
+ */
+int register_override_hook(const char *name, struct override_hook_handler *handler);
+
+/**
+ * Removes a handler registered with register_override_hook(); the symbol is restored when it was the last one
+ *
+ * It waits for calls which could've seen the handler to finish, so it cannot be called from a handler.
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_override_hook(struct override_hook_handler *handler);
+
+/**
+ * Calls the original from a pre handler which needs to act on its result (e.g. to notify someone only on success)
+ *
+ * The value returned by the original is stored in ctx->ret. The handler should veto the call afterwards, as otherwise
+ * the original would be called again (pre handlers after it are skipped then - give it a high priority).
+ *
+ * @return 0 if the original was called, -E if it wasn't
+ */
+int override_hook_call_original(struct override_hook_ctx *ctx);
+
+/**
+ * Initializes the state shared by all hooks; it must be called before anything registers a hook handler
+ *
+ * @return 0 on success or -E on error
+ */
+int register_override_hooks(void);
+
+/**
+ * Frees the state initialized by register_override_hooks(); it must be called after all hook handlers are removed
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_override_hooks(void);
+
+#endif //REDPILL_OVERRIDE_HOOK_H
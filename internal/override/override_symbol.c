@@ -62,13 +62,11 @@
  * 10. [R] Lock memory page(s) with trampoline
  * 11. [R] Enable CR0
  *
- * The call_overridden_symbol() obviously has to disable CR0 and unlock memory but it LEAVES the memory unlocked for any
- * subsequent calls. While it's less safe (as something can accidentally override it will not be reported) it shortens
- * the call path for 2nd and beyond calls to the original:
- * 1. Check if memory needs to be unlocked
- * 2. [O] Copy original preamble over trampoline
- * 3. Call original
- * 4. [R] Copy original trampoline over original preamble
+ * The call_overridden_symbol() doesn't touch page tables at all - every copy is done with CR0.WP cleared on the local
+ * CPU only (see memory_helper.c), which shortens the call path to:
+ * 1. [O] Copy original preamble over trampoline
+ * 2. Call original
+ * 3. [R] Copy original trampoline over original preamble
  *
  * Using call_overridden_symbol() thus has huge advantages over override+restore if you plan to call the original
  * function more than once. If you want to call it only once the call_overridden_symbol() is an equivalent of restore+
@@ -79,6 +77,38 @@
  * implementation. The kernel uses breakpoints for more safety and to detect possible interactions between different
  * subsystems utilizing breakpoints. This isn't our concern here.
  *
+ * DETOURS
+ * The restore+override dance described above is still used as a fallback, but whenever possible a detour is prepared
+ * instead when the symbol is overridden. We do NOT try to solve all problems listed above - instead we only relocate
+ * prologues we fully understand & refuse everything else:
+ *  - the preamble is decoded instruction by instruction (rounded up to a full instruction) using a tiny decoder which
+ *    only knows instructions commonly found in prologues (push/pop, mov, lea, ALU ops, NOPs incl. the ones left by
+ *    ftrace, CALL rel32 to __fentry__ etc)
+ *  - anything IP-relative is rejected, besides CALL rel32 which is re-encoded for the new location
+ *  - any jump or RET within the preamble means the function is too short to be safely relocated
+ *  - relocated preamble is followed by a JMP *0(%rip) back to the rest of the original (it doesn't clobber any regs)
+ * Detours live in the text arena (see text_arena.c) inside of the module's .text so that they're executable and within
+ * +-2GB of the kernel text (needed for relocating CALL rel32); detours of a batch are written all at once. With a
+ * detour the call_overridden_symbol() is just an indirect call and the trampoline stays installed the whole time - no
+ * memory unlocking, no TLB flushes, and no window where other CPUs can observe a half-restored function. The only case
+ * not covered is the backwards jump into the preamble described above; prologue instructions practically never are
+ * jump targets so we accept that.
+ *
+ * PATCHING LIVE CODE
+ * The trampoline is written over code which other CPUs may be executing at the very same moment. A plain memcpy() can
+ * let them fetch a half-written (=torn) instruction. Instead the code is replaced the same way the kernel's
+ * text_poke_bp() does it (which isn't exported):
+ *  1. write int3 over the first byte & sync all cores (any CPU reaching the code now traps)
+ *  2. write all bytes but the first one & sync
+ *  3. write the first byte & sync
+ * CPUs which hit the int3 in the meantime are redirected by a die notifier to the replacement function - this is valid
+ * both when installing & removing the override, as at that moment the override is active either way. The state of
+ * every override is switched atomically (OFF/ON/PATCHING) so there's no per-symbol lock and interrupts aren't
+ * disabled. Syncing requires IPIs so it cannot be done with interrupts disabled - in such case (or before the handler
+ * is registered) the code falls back to a plain copy.
+ * This doesn't protect CPUs which were interrupted/preempted in the middle of the original prologue - the trampoline
+ * spans multiple instructions so there's no way to fix that without stopping the machine.
+ *
  * References:
  *  - https://www.cs.uaf.edu/2016/fall/cs301/lecture/09_28_machinecode.html
  *  - http://www.watson.org/%7Erobert/2007woot/2007usenixwoot-exploitingconcurrency.pdf
@@ -89,9 +119,31 @@
 
 #include "override_symbol.h"
 #include "../../common.h"
-#include "../helper/memory_helper.h" //set_mem_addr_ro(), set_mem_addr_rw()
-#include "../helper/symbol_helper.h" //kln_func
+#include "../helper/memory_helper.h" //memcpy_to_ro_mem(), memcpy_to_ro_mem_batch(), ro_mem_write_irqs_off_safe()
+#include "../helper/symbol_helper.h" //kln_cached()
+#include "text_arena.h" //text_arena_alloc(), text_arena_free()
+#include "../../debug/debug_ovs_stats.h" //ovs_stats_*(); noop unless DBG_OVS_STATS
+#include "../metrics.h" //RP_METRIC(), rp_metric_*()
 #include <linux/string.h> //memcpy()
+#include <linux/atomic.h> //atomic_cmpxchg(), atomic_set(), atomic_read()
+#include <linux/kdebug.h> //register_die_notifier(), DIE_INT3, struct die_args
+#include <linux/smp.h> //on_each_cpu()
+#include <linux/spinlock.h> //spin_lock(), spin_unlock()
+#include <linux/version.h> //KERNEL_VERSION()
+#include <linux/rcupdate.h> //synchronize_sched(), synchronize_rcu()
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+#include <asm/sync_core.h> //sync_core()
+#else
+#include <asm/processor.h> //sync_core()
+#endif
+
+//Since RCU flavors were consolidated in v4.20 synchronize_rcu() waits for preempt-disabled regions too (and
+// synchronize_sched() is gone soon after)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+#define ovs_synchronize_sched() synchronize_rcu()
+#else
+#define ovs_synchronize_sched() synchronize_sched()
+#endif
 
 #define JUMP_ADDR_POS 2 //JUMP starts at [2] in the jump template below
 #define OVERRIDE_JUMP_SIZE 1 + 1 + 8 + 1 + 1 //MOVQ + %rax + $vaddr + JMP + *%rax
@@ -100,50 +152,227 @@ static const unsigned char jump_tpl[OVERRIDE_JUMP_SIZE] =
     "\xff\xe0" /* JMP *%rax */
 ;
 
-#define WITH_OVS_LOCK(__sym, code)                                                               \
-    do {                                                                                         \
-        pr_loc_dbg("Obtaining lock for <%pF/%p>", (__sym)->org_sym_ptr, (__sym)->org_sym_ptr);   \
-        spin_lock_irqsave(&(__sym)->lock, (__sym)->lock_irq);                                    \
-        ({code});                                                                                \
-        spin_unlock_irqrestore(&(__sym)->lock, (__sym)->lock_irq);                               \
-        pr_loc_dbg("Released lock for <%p>", (__sym)->org_sym_ptr);                              \
-    } while(0)
+#define OVS_DETOUR_JMP_SIZE (6 + 8) //JMP *0(%rip) + 64-bit vaddr
+#define OVS_DETOUR_MAX_LEN 64 //relocated prologue (max OVERRIDE_JUMP_SIZE+14) + absolute JMP back
+#define OVS_DETOUR_MAX_PROLOGUE (OVS_DETOUR_MAX_LEN - OVS_DETOUR_JMP_SIZE)
+static const unsigned char detour_jmp_tpl[OVS_DETOUR_JMP_SIZE] =
+    "\xff\x25\x00\x00\x00\x00" /* JMP *0(%rip) */
+    "\x00\x00\x00\x00\x00\x00\x00\x00" /* 64-bit-vaddr */
+;
+
+#define OVS_STATE_OFF 0
+#define OVS_STATE_ON 1
+#define OVS_STATE_PATCHING 2 //one of the CPUs is currently writing the code
+#define INT3_INSN 0xCC
+
+struct ovs_poke {
+    void *addr;
+    const void *code; //OVERRIDE_JUMP_SIZE of new code
+    const void *bp_target; //where CPUs hitting int3 @ addr should go
+};
+
+static DEFINE_SPINLOCK(ovs_poke_lock); //only one (batch of) poke(s) can be in progress
+static const struct ovs_poke *ovs_bp_pokes = NULL; //pokes in progress; read by the int3 handler
+static unsigned int ovs_bp_pokes_num = 0;
+static bool ovs_bp_handler_registered = false;
+
+static RP_METRIC(ovs_poke_lock_ns, RP_MG_LATENCY, RP_METRIC_HISTOGRAM); //preemption is disabled & IPIs are waited for
+static RP_METRIC(ovs_poke_lock_max_ns, RP_MG_LATENCY, RP_METRIC_GAUGE);
+static struct rp_metric *const ovs_metrics[] = { &ovs_poke_lock_ns, &ovs_poke_lock_max_ns };
 
 struct override_symbol_inst {
     void *org_sym_ptr;
     const void *new_sym_ptr;
     char org_sym_code[OVERRIDE_JUMP_SIZE];
     char trampoline[OVERRIDE_JUMP_SIZE];
-    spinlock_t lock;
-    unsigned long lock_irq;
-    bool installed:1; //whether the symbol is currently overrode (=has trampoline installed)
+    void *detour; //executable copy of the original prologue + jump to the rest of the original; NULL if n/a
+    u8 detour_len; //bytes reserved for the detour in the text arena
+    struct ovs_stats *stats; //invocation stats; always NULL unless DBG_OVS_STATS
+    atomic_t state; //OVS_STATE_*; ON means the trampoline is installed
     bool has_trampoline:1; //does this structure contain a valid trampoline code already?
-    bool mem_protected:1; //is the trampoline installation site memory-protected?
     char name[];
 };
 
 /**
- * Wrapper for set_mem_addr_rw() which works with symbols
+ * Determines length of ModR/M byte along with SIB & displacement (if any) which follow it
+ *
+ * @return length or 0 if the operand is IP-relative
+ */
+static int get_modrm_len(const u8 *modrm)
+{
+    u8 mod = *modrm >> 6;
+    u8 rm = *modrm & 0x07;
+    int len = 1;
+
+    if (mod == 3) //register operand
+        return len;
+
+    if (rm == 4) { //SIB follows
+        len++;
+        if (mod == 0 && (modrm[1] & 0x07) == 5) //no base, disp32
+            return len + 4;
+    } else if (mod == 0 && rm == 5) { //RIP-relative
+        return 0;
+    }
+
+    if (mod == 1)
+        return len + 1;
+    if (mod == 2)
+        return len + 4;
+
+    return len;
+}
+
+/**
+ * Determines length of a single x86-64 instruction commonly found in function prologues
+ *
+ * This is NOT a general x86 decoder: it only knows instructions which can be executed from a different location without
+ * any changes, and CALL rel32 (which must be relocated by the caller).
+ *
+ * @param is_call_rel32 Set to true if the instruction is a CALL rel32
+ * @return length of the instruction or 0 if it's unknown or not safe to relocate
  */
-static void __always_inline set_symbol_rw(struct override_symbol_inst *sym)
+static int get_prologue_insn_len(const u8 *code, bool *is_call_rel32)
 {
-    set_mem_addr_rw((unsigned long)sym->org_sym_ptr, OVERRIDE_JUMP_SIZE);
-    sym->mem_protected = false;
+    const u8 *ptr = code;
+    bool opsize = false;
+    bool rex_w = false;
+    int imm_len;
+
+    *is_call_rel32 = false;
+    if (*ptr == 0x66) { //operand size override
+        opsize = true;
+        ptr++;
+    }
+    if ((*ptr & 0xF0) == 0x40) { //REX
+        rex_w = !!(*ptr & 0x08);
+        ptr++;
+    }
+
+    u8 opcode = *ptr++;
+    if ((opcode >= 0x50 && opcode <= 0x5F) || opcode == 0x90) //PUSH/POP reg, NOP
+        return ptr - code;
+
+    if (opcode >= 0xB8 && opcode <= 0xBF) //MOV imm, reg
+        return (ptr - code) + (rex_w ? 8 : (opsize ? 2 : 4));
+
+    if (opcode == 0xE8) { //CALL rel32 (e.g. ftrace's __fentry__), only without prefixes
+        if (ptr - code != 1)
+            return 0;
+
+        *is_call_rel32 = true;
+        return 1 + 4;
+    }
+
+    switch (opcode) {
+        case 0x01: case 0x03: case 0x09: case 0x0B: case 0x21: case 0x23: case 0x29: case 0x2B: //ADD/OR/AND/SUB
+        case 0x31: case 0x33: case 0x39: case 0x3B: case 0x85: //XOR/CMP/TEST
+        case 0x89: case 0x8B: case 0x8D: //MOV/LEA
+            imm_len = 0;
+            break;
+        case 0x83: //ALU imm8
+            imm_len = 1;
+            break;
+        case 0x81: case 0xC7: //ALU imm32, MOV imm32
+            imm_len = opsize ? 2 : 4;
+            break;
+        case 0x0F:
+            if (*ptr++ != 0x1F) //only NOPL
+                return 0;
+            imm_len = 0;
+            break;
+        default:
+            return 0;
+    }
+
+    int modrm_len = get_modrm_len(ptr);
+    if (!modrm_len)
+        return 0;
+
+    return (ptr - code) + modrm_len + imm_len;
 }
 
 /**
- * Wrapper for set_mem_addr_ro() which works with symbols
+ * Generates an executable copy of the original prologue so that the original can be called while the trampoline is
+ * installed
+ *
+ * The space in the text arena is reserved right away but the code is only generated into the buffer - the caller has
+ * to write it (so that detours of many symbols can be written at once).
+ * When this fails it's not an error - the symbol will simply use the restore+override path when calling the original.
+ *
+ * @param code Buffer of OVS_DETOUR_MAX_LEN for the generated code
+ * @param write Where to write the code (sym->detour) & its length
+ *
+ * @return 0 on success or -E on error
  */
-static void __always_inline set_symbol_ro(struct override_symbol_inst *sym)
+static int prepare_detour(struct override_symbol_inst *sym, u8 *code, struct ro_mem_write *write)
 {
-    set_mem_addr_ro((unsigned long)sym->org_sym_ptr, OVERRIDE_JUMP_SIZE);
-    sym->mem_protected = true;
+    u8 *org = sym->org_sym_ptr;
+    int pos = 0;
+    bool is_call_rel32;
+
+    //Lengths are needed upfront as CALLs are relocated relative to the final location of the detour
+    while (pos < OVERRIDE_JUMP_SIZE) {
+        int len = get_prologue_insn_len(org + pos, &is_call_rel32);
+        if (!len || pos + len > OVS_DETOUR_MAX_PROLOGUE) {
+            pr_loc_dbg("Cannot relocate %s() prologue (unknown insn %*ph @ +%d)", sym->name, 4, org + pos, pos);
+            return -ENOEXEC;
+        }
+        pos += len;
+    }
+
+    int detour_len = pos + OVS_DETOUR_JMP_SIZE;
+    u8 *detour = text_arena_alloc(detour_len);
+    if (!detour) {
+        pr_loc_wrn("No more space for detours - %s() will use slow path for calling original", sym->name);
+        return -ENOSPC;
+    }
+
+    pos = 0;
+    while (pos < OVERRIDE_JUMP_SIZE) {
+        int len = get_prologue_insn_len(org + pos, &is_call_rel32);
+        memcpy(code + pos, org + pos, len);
+        if (is_call_rel32) {
+            long target = (long)(org + pos + len) + *(s32 *)(org + pos + 1);
+            long rel = target - (long)(detour + pos + len);
+            if (rel != (s32)rel) {
+                pr_loc_dbg("Cannot relocate %s() prologue (CALL @ +%d out of range)", sym->name, pos);
+                text_arena_free(detour, detour_len);
+                return -ENOEXEC;
+            }
+            *(s32 *)(code + pos + 1) = (s32)rel;
+        }
+
+        pos += len;
+    }
+
+    memcpy(code + pos, detour_jmp_tpl, OVS_DETOUR_JMP_SIZE);
+    *(unsigned long *)(code + pos + 6) = (unsigned long)(org + pos);
+
+    sym->detour = detour;
+    sym->detour_len = detour_len;
+    write->dst = detour;
+    write->src = code;
+    write->len = detour_len;
+    pr_loc_dbg("Prepared detour for %s() with %d bytes of prologue <%p>", sym->name, pos, detour);
+
+    return 0;
 }
 
 void put_overridden_symbol(struct override_symbol_inst *sym)
 {
     pr_loc_dbg("Freeing OVS for %s", sym->name);
-    kfree(sym);
+    if (sym->detour) {
+        //CPUs which entered the detour before the override was lifted may still be running the relocated prologue, and
+        // the freed chunk can be reused by the next override right away. Like the patching itself (see "PATCHING LIVE
+        // CODE" at the top of this file) this doesn't cover tasks preempted in the middle of it.
+        might_sleep();
+        ovs_synchronize_sched();
+        text_arena_free(sym->detour, sym->detour_len);
+    }
+
+    ovs_stats_destroy(sym->stats);
+    rp_kfree(sym, RP_MEM_OVERRIDE);
 }
 
 /**
@@ -154,22 +383,32 @@ void put_overridden_symbol(struct override_symbol_inst *sym)
 static struct override_symbol_inst* get_ov_symbol_instance(const char *symbol_name, const void *new_sym_ptr)
 {
     struct override_symbol_inst *sym;
-    kmalloc_or_exit_ptr(sym, sizeof(struct override_symbol_inst) + strsize(symbol_name));
+    kmalloc_or_exit_ptr(sym, sizeof(struct override_symbol_inst) + strsize(symbol_name), RP_MEM_OVERRIDE);
 
     sym->new_sym_ptr = new_sym_ptr;
-    spin_lock_init(&sym->lock);
-    sym->installed = false;
+    sym->detour = NULL;
+    sym->detour_len = 0;
+    sym->stats = NULL;
+    atomic_set(&sym->state, OVS_STATE_OFF);
     sym->has_trampoline = false;
-    sym->mem_protected = true;
     strcpy(sym->name, symbol_name);
-    sym->org_sym_ptr = (void *)kln_func(sym->name);
+    sym->org_sym_ptr = (void *)kln_cached(sym->name);
     if (unlikely(sym->org_sym_ptr == 0)) { //header file: "Lookup the address for a symbol. Returns 0 if not found."
         pr_loc_err("Failed to locate vaddr for %s()", sym->name);
         put_overridden_symbol(sym);
-        return ERR_PTR(-EFAULT);
+        return ERR_PTR(-ENOENT);
     }
     pr_loc_dbg("Saved %s() ptr <%p>", sym->name, sym->org_sym_ptr);
 
+    //Stacking trampolines doesn't work (calling the original would restore the other one's code) - see override_hook.c
+    if (unlikely(memcmp(sym->org_sym_ptr, jump_tpl, JUMP_ADDR_POS) == 0 &&
+                 memcmp((u8 *)sym->org_sym_ptr + JUMP_ADDR_POS + 8, jump_tpl + JUMP_ADDR_POS + 8, 2) == 0)) {
+        pr_loc_err("%s() is already overridden - use override_hook to share it", sym->name);
+        put_overridden_symbol(sym);
+        return ERR_PTR(-EBUSY);
+    }
+    sym->stats = ovs_stats_create(sym->name, new_sym_ptr);
+
     return sym;
 }
 
@@ -182,7 +421,7 @@ static inline void prepare_trampoline(struct override_symbol_inst *sym)
 
     //First generate jump/trampoline to new_sym_ptr
     memcpy(sym->trampoline, jump_tpl, OVERRIDE_JUMP_SIZE); //copy "empty" trampoline
-    *(long *)&sym->trampoline[JUMP_ADDR_POS] = (long)sym->new_sym_ptr; //paste new addr into trampoline
+    *(long *)&sym->trampoline[JUMP_ADDR_POS] = (long)ovs_stats_target(sym->stats, sym->new_sym_ptr); //paste new addr
     pr_loc_dbg("Generated trampoline to %pF<%p> for %s<%p>: ", sym->new_sym_ptr, sym->new_sym_ptr, sym->name,
                sym->org_sym_ptr);
 
@@ -190,8 +429,159 @@ static inline void prepare_trampoline(struct override_symbol_inst *sym)
     sym->has_trampoline = true;
 }
 
+static inline void set_poke(struct ovs_poke *poke, struct override_symbol_inst *sym, bool enable)
+{
+    poke->addr = sym->org_sym_ptr;
+    poke->code = enable ? sym->trampoline : sym->org_sym_code;
+    poke->bp_target = *(void **)&sym->trampoline[JUMP_ADDR_POS];
+}
+
+static void ovs_sync_core(void *info)
+{
+    sync_core();
+}
+
+static int ovs_int3_notify(struct notifier_block *self, unsigned long val, void *data)
+{
+    struct die_args *args = data;
+    if (val != DIE_INT3 || !args->regs || user_mode(args->regs))
+        return NOTIFY_DONE;
+
+    unsigned int num = ovs_bp_pokes_num;
+    smp_rmb(); //pairs with smp_wmb() in poke_code(): pokes are published before their number
+    const struct ovs_poke *pokes = ovs_bp_pokes;
+    unsigned long addr = args->regs->ip - 1; //int3 is a trap: IP points after the instruction
+    for (unsigned int i = 0; i < num; i++) {
+        if ((unsigned long)pokes[i].addr == addr) {
+            args->regs->ip = (unsigned long)pokes[i].bp_target;
+            return NOTIFY_STOP;
+        }
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block ovs_int3_nb = {
+    .notifier_call = ovs_int3_notify,
+    .priority = INT_MAX,
+};
+
+/**
+ * Writes new code for multiple pokes (see "PATCHING LIVE CODE" at the top of this file)
+ *
+ * @param writes Scratch space for num elements
+ *
+ * @return 0 on success, -EBUSY if the code cannot be written in the current context
+ */
+static int poke_code(const struct ovs_poke *pokes, struct ro_mem_write *writes, unsigned int num)
+{
+    static const unsigned char int3 = INT3_INSN;
+    unsigned int i;
+
+    //The handler flag must be checked under the lock - see unregister_override_symbol_poke_handler()
+    bool use_bp = !irqs_disabled();
+    if (likely(use_bp)) {
+        spin_lock(&ovs_poke_lock);
+        if (unlikely(!ovs_bp_handler_registered)) {
+            spin_unlock(&ovs_poke_lock);
+            use_bp = false;
+        }
+    }
+
+    if (unlikely(!use_bp)) {
+        //On v5.3+ even the plain copy flushes TLBs on all CPUs, which would deadlock with interrupts disabled
+        if (unlikely(irqs_disabled() && !ro_mem_write_irqs_off_safe())) {
+            pr_loc_wrn("Cannot patch code with interrupts disabled on this kernel");
+            return -EBUSY;
+        }
+
+        pr_loc_dbg("Cannot use int3 patching - falling back to a plain copy");
+        for (i = 0; i < num; i++) {
+            writes[i].dst = pokes[i].addr;
+            writes[i].src = pokes[i].code;
+            writes[i].len = OVERRIDE_JUMP_SIZE;
+        }
+        memcpy_to_ro_mem_batch(writes, num);
+        return 0;
+    }
+
+    rp_metric_time_begin(lock_start); //the lock is held from here
+    ovs_bp_pokes = pokes;
+    smp_wmb();
+    ovs_bp_pokes_num = num;
+    smp_wmb();
+
+    for (i = 0; i < num; i++) {
+        writes[i].dst = pokes[i].addr;
+        writes[i].src = &int3;
+        writes[i].len = 1;
+    }
+    memcpy_to_ro_mem_batch(writes, num);
+    on_each_cpu(ovs_sync_core, NULL, 1);
+
+    for (i = 0; i < num; i++) {
+        writes[i].dst = (u8 *)pokes[i].addr + 1;
+        writes[i].src = (const u8 *)pokes[i].code + 1;
+        writes[i].len = OVERRIDE_JUMP_SIZE - 1;
+    }
+    memcpy_to_ro_mem_batch(writes, num);
+    on_each_cpu(ovs_sync_core, NULL, 1);
+
+    for (i = 0; i < num; i++) {
+        writes[i].dst = pokes[i].addr;
+        writes[i].src = pokes[i].code;
+        writes[i].len = 1;
+    }
+    memcpy_to_ro_mem_batch(writes, num);
+    on_each_cpu(ovs_sync_core, NULL, 1); //after this no CPU can be in the int3 handler for these pokes
+
+    ovs_bp_pokes_num = 0;
+    smp_wmb();
+    ovs_bp_pokes = NULL;
+    rp_metric_time_end_max(&ovs_poke_lock_ns, &ovs_poke_lock_max_ns, lock_start);
+    spin_unlock(&ovs_poke_lock);
+
+    return 0;
+}
+
+/**
+ * Switches the override on or off
+ *
+ * @return 0 on success, -E on error
+ */
+static int set_symbol_override(struct override_symbol_inst *sym, bool enable)
+{
+    int from = enable ? OVS_STATE_OFF : OVS_STATE_ON;
+    int to = enable ? OVS_STATE_ON : OVS_STATE_OFF;
+    int state;
+
+    while ((state = atomic_cmpxchg(&sym->state, from, OVS_STATE_PATCHING)) != from) {
+        if (state == to) //already done
+            return 0;
+
+        //Another CPU is writing the code; if we cannot take IPIs it may be waiting for us forever
+        if (irqs_disabled()) {
+            pr_loc_wrn("Cannot %s override of %s() now - it's being modified", enable ? "enable" : "disable", sym->name);
+            return -EBUSY;
+        }
+        cpu_relax();
+    }
+
+    if (enable && !sym->has_trampoline)
+        prepare_trampoline(sym);
+
+    struct ovs_poke poke;
+    struct ro_mem_write write;
+    set_poke(&poke, sym, enable);
+    pr_loc_dbg("Writing %s code to <%p>", enable ? "trampoline" : "original", sym->org_sym_ptr);
+    int out = poke_code(&poke, &write, 1);
+    atomic_set(&sym->state, out == 0 ? to : from);
+
+    return out;
+}
+
 /**
- * Enables (previously disabled) symbol override, disabling memory barriers if needed & leaving them disabled upon exit
+ * Enables (previously disabled) symbol override
  *
  * Warning: this function is exported only to make universal call original macros working. You should NOT use it outside
  * of this submodule
@@ -200,30 +590,11 @@ static inline void prepare_trampoline(struct override_symbol_inst *sym)
  */
 int __enable_symbol_override(struct override_symbol_inst *sym)
 {
-    if (sym->mem_protected)
-        set_symbol_rw(sym);
-
-    WITH_OVS_LOCK(sym,
-         if (likely(!sym->installed)) {
-            if (!sym->has_trampoline)
-                prepare_trampoline(sym);
-
-            //after we got the lock need to re-check the memory protection - this shouldn't be changed within spinlock
-            //since it generates a warning... but sometimes we have no choice
-            if (sym->mem_protected)
-                set_symbol_rw(sym);
-
-            pr_loc_dbg("Writing trampoline code to <%p>", sym->org_sym_ptr);
-            memcpy(sym->org_sym_ptr, sym->trampoline, OVERRIDE_JUMP_SIZE);
-            sym->installed = true;
-        }
-    );
-
-    return 0;
+    return set_symbol_override(sym, true);
 }
 
 /**
- * Disables (previously enables) symbol override, disabling memory barriers if needed & leaving them disabled upon exit
+ * Disables (previously enables) symbol override
  *
  * Warning: this function is exported only to make universal call original macros working. You should NOT use it outside
  * of this submodule
@@ -232,23 +603,7 @@ int __enable_symbol_override(struct override_symbol_inst *sym)
  */
 int __disable_symbol_override(struct override_symbol_inst *sym)
 {
-    if (sym->mem_protected)
-        set_symbol_rw(sym);
-
-    WITH_OVS_LOCK(sym,
-        if (likely(sym->installed)) {
-            //after we got the lock need to re-check the memory protection - this shouldn't be changed within spinlock
-            //since it generates a warning... but sometimes we have no choice
-            if (sym->mem_protected)
-                set_symbol_rw(sym);
-
-            pr_loc_dbg("Writing original code to <%p>", sym->org_sym_ptr);
-            memcpy(sym->org_sym_ptr, sym->org_sym_code, OVERRIDE_JUMP_SIZE);
-            sym->installed = false;
-        }
-    );
-
-    return 0;
+    return set_symbol_override(sym, false);
 }
 
 struct override_symbol_inst* __must_check override_symbol(const char *name, const void *new_sym_ptr)
@@ -260,11 +615,15 @@ struct override_symbol_inst* __must_check override_symbol(const char *name, cons
     if (unlikely(IS_ERR(sym)))
         return sym;
 
+    //it must be done before the prologue is replaced; failure isn't fatal
+    u8 detour_code[OVS_DETOUR_MAX_LEN];
+    struct ro_mem_write detour_write;
+    if (prepare_detour(sym, detour_code, &detour_write) == 0)
+        memcpy_to_ro_mem(detour_write.dst, detour_write.src, detour_write.len);
+
     if ((out = __enable_symbol_override(sym)) != 0)
         goto error_out;
 
-    set_symbol_ro(sym); //by design standard override leaves the memory protected
-
     pr_loc_dbg("Successfully overrode %s() with trampoline to %pF<%p>", sym->name, sym->new_sym_ptr, sym->new_sym_ptr);
     return sym;
 
@@ -273,6 +632,74 @@ struct override_symbol_inst* __must_check override_symbol(const char *name, cons
     return ERR_PTR(out);
 }
 
+int __must_check override_symbols_batch(const struct override_symbol_req *reqs, unsigned int num)
+{
+    pr_loc_dbg("Overriding %u symbols in a batch", num);
+
+    int out;
+    unsigned int i;
+    unsigned int detours_num = 0;
+    struct ro_mem_write *writes;
+    struct ovs_poke *pokes;
+    u8 *detours_code;
+    kmalloc_or_exit_int(writes, sizeof(struct ro_mem_write) * num, RP_MEM_OVERRIDE);
+    pokes = kmalloc(sizeof(struct ovs_poke) * num, GFP_KERNEL);
+    rp_mem_alloced(RP_MEM_OVERRIDE, pokes);
+    detours_code = kmalloc(OVS_DETOUR_MAX_LEN * num, GFP_KERNEL);
+    rp_mem_alloced(RP_MEM_OVERRIDE, detours_code);
+    if (unlikely(!pokes || !detours_code)) {
+        rp_kfree(pokes, RP_MEM_OVERRIDE);
+        rp_kfree(detours_code, RP_MEM_OVERRIDE);
+        rp_kfree(writes, RP_MEM_OVERRIDE);
+        kalloc_error_int(pokes, (sizeof(struct ovs_poke) + OVS_DETOUR_MAX_LEN) * num);
+    }
+
+    for (i = 0; i < num; i++)
+        *reqs[i].ovs = NULL;
+
+    //Everything which may fail is done before any code is touched so that a failure doesn't leave a partial batch
+    for (i = 0; i < num; i++) {
+        struct override_symbol_inst *sym = get_ov_symbol_instance(reqs[i].name, reqs[i].new_sym_ptr);
+        if (unlikely(IS_ERR(sym))) {
+            out = PTR_ERR(sym);
+            goto error_out;
+        }
+        *reqs[i].ovs = sym;
+
+        if (prepare_detour(sym, detours_code + (i * OVS_DETOUR_MAX_LEN), &writes[detours_num]) == 0)
+            ++detours_num; //see override_symbol()
+        prepare_trampoline(sym);
+        set_poke(&pokes[i], sym, true);
+    }
+
+    //All detours live in the same arena page - they're written in one go before any of them can be reached
+    memcpy_to_ro_mem_batch(writes, detours_num);
+
+    //Instances aren't visible to anyone yet so nobody else can change their state
+    if (unlikely((out = poke_code(pokes, writes, num)) != 0))
+        goto error_out;
+    for (i = 0; i < num; i++)
+        atomic_set(&(*reqs[i].ovs)->state, OVS_STATE_ON);
+
+    rp_kfree(detours_code, RP_MEM_OVERRIDE);
+    rp_kfree(pokes, RP_MEM_OVERRIDE);
+    rp_kfree(writes, RP_MEM_OVERRIDE);
+    pr_loc_dbg("Successfully overrode %u symbols in a batch", num);
+    return 0;
+
+    error_out:
+    for (i = 0; i < num; i++) {
+        if (*reqs[i].ovs) {
+            put_overridden_symbol(*reqs[i].ovs);
+            *reqs[i].ovs = NULL;
+        }
+    }
+    rp_kfree(detours_code, RP_MEM_OVERRIDE);
+    rp_kfree(pokes, RP_MEM_OVERRIDE);
+    rp_kfree(writes, RP_MEM_OVERRIDE);
+    return out;
+}
+
 int restore_symbol(struct override_symbol_inst *sym)
 {
     pr_loc_dbg("Restoring %s<%p> to original code", sym->name, sym->org_sym_ptr);
@@ -281,8 +708,6 @@ int restore_symbol(struct override_symbol_inst *sym)
     if ((out = __disable_symbol_override(sym)) != 0)
         goto out_free;
 
-    set_symbol_ro(sym); //by design restore leaves the memory protected
-
     pr_loc_dbg("Successfully restored original code of %s", sym->name);
 
     out_free:
@@ -298,10 +723,68 @@ __always_inline void * __get_org_ptr(struct override_symbol_inst *sym)
     return sym->org_sym_ptr;
 }
 
+/**
+ * Returns pointer to the detour calling the original or NULL if the symbol doesn't have one
+ */
+__always_inline void * __get_org_detour(struct override_symbol_inst *sym)
+{
+    return sym->detour;
+}
+
+/**
+ * Returns invocation stats of the symbol (see debug/debug_ovs_stats.c) or NULL if they're not available
+ */
+struct ovs_stats *__get_ovs_stats(struct override_symbol_inst *sym)
+{
+    return likely(sym) ? sym->stats : NULL;
+}
+
 /**
  * Checks if override is enabled. This is a function made to avoid exposing internals of the struct to header.
  */
 __always_inline bool symbol_is_overridden(struct override_symbol_inst *sym)
 {
-    return likely(sym) && sym->installed;
+    return likely(sym) && atomic_read(&sym->state) == OVS_STATE_ON;
+}
+
+__always_inline bool symbol_has_detour(struct override_symbol_inst *sym)
+{
+    return likely(sym) && sym->detour;
+}
+
+int register_override_symbol_poke_handler(void)
+{
+    if (unlikely(ovs_bp_handler_registered)) {
+        pr_loc_bug("int3 handler is already registered");
+        return -EEXIST;
+    }
+
+    rp_metrics_register(ovs_metrics, ARRAY_SIZE(ovs_metrics));
+
+    int out = register_die_notifier(&ovs_int3_nb);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to register int3 handler - error=%d", out);
+        return out;
+    }
+
+    ovs_bp_handler_registered = true;
+    pr_loc_dbg("Registered int3 handler for live code patching");
+    return 0;
+}
+
+int unregister_override_symbol_poke_handler(void)
+{
+    if (unlikely(!ovs_bp_handler_registered))
+        return 0; //this is deliberately a noop
+
+    //Pokes check the flag under the lock, so after this no breakpoint can be published anymore
+    spin_lock(&ovs_poke_lock);
+    ovs_bp_handler_registered = false;
+    spin_unlock(&ovs_poke_lock);
+
+    int out = unregister_die_notifier(&ovs_int3_nb);
+    if (unlikely(out != 0))
+        pr_loc_err("Failed to unregister int3 handler - error=%d", out);
+
+    return out;
 }
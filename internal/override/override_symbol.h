@@ -3,6 +3,7 @@
 
 #include <linux/types.h>
 #include <linux/err.h> //PTR_ERR, IS_ERR
+#include "../../debug/debug_ovs_stats.h" //ovs_stats_time_begin(), ovs_stats_time_end()
 
 typedef struct override_symbol_inst override_symbol_inst;
 
@@ -10,23 +11,31 @@ typedef struct override_symbol_inst override_symbol_inst;
 /**
  * Calls the original symbol, returning nothing, that was previously overridden
  *
+ * When the symbol has a detour (see override_symbol.c) this is a plain call. Otherwise the override is temporarily
+ * removed for the time of the call.
+ *
  * @param sym pointer to a override_symbol_inst
  * @param ... any arguments to the original function
  *
  * @return 0 if the execution succeeded, -E if it didn't
  */
 #define call_overridden_symbol_void(sym, ...) ({              \
-    int __ret;                                                \
+    int __ret = 0;                                            \
     bool __was_installed = symbol_is_overridden(sym);         \
     _Pragma("GCC diagnostic push")                            \
     _Pragma("GCC diagnostic ignored \"-Wstrict-prototypes\"") \
+    void (*__detour)() = __get_org_detour(sym);               \
     void (*__ptr)() = __get_org_ptr(sym);                     \
     _Pragma("GCC diagnostic pop")                             \
-    __ret = __disable_symbol_override(sym);                   \
-    if (likely(__ret == 0)) {                                 \
-        __ptr(__VA_ARGS__);                                   \
-        if (likely(__was_installed)) {                        \
-        __ret = __enable_symbol_override(sym);                \
+    if (likely(__detour && __was_installed)) {                \
+        __detour(__VA_ARGS__);                                \
+    } else {                                                  \
+        __ret = __disable_symbol_override(sym);               \
+        if (likely(__ret == 0)) {                             \
+            __ptr(__VA_ARGS__);                               \
+            if (likely(__was_installed)) {                    \
+                __ret = __enable_symbol_override(sym);        \
+            }                                                 \
         }                                                     \
     }                                                         \
     __ret;                                                    \
@@ -35,6 +44,8 @@ typedef struct override_symbol_inst override_symbol_inst;
 /**
  * Calls the original symbol, returning a value, that was previously overridden
  *
+ * See call_overridden_symbol_void() for details
+ *
  * @param out_var name of the variable where original function return value should be placed
  * @param sym pointer to a override_symbol_inst
  * @param ... any arguments to the original function
@@ -42,22 +53,40 @@ typedef struct override_symbol_inst override_symbol_inst;
  * @return 0 if the execution succeeded, -E if it didn't
  */
 #define call_overridden_symbol(out_var, sym, ...) ({          \
-    int __ret;                                                \
+    int __ret = 0;                                            \
     bool __was_installed = symbol_is_overridden(sym);         \
     _Pragma("GCC diagnostic push")                            \
     _Pragma("GCC diagnostic ignored \"-Wstrict-prototypes\"") \
+    typeof (out_var) (*__detour)() = __get_org_detour(sym);   \
     typeof (out_var) (*__ptr)() = __get_org_ptr(sym);         \
     _Pragma("GCC diagnostic pop")                             \
-    __ret = __disable_symbol_override(sym);                   \
-    if (likely(__ret == 0)) {                                 \
-        out_var = __ptr(__VA_ARGS__);                         \
-        if (likely(__was_installed)) {                        \
-            __ret = __enable_symbol_override(sym);            \
+    if (likely(__detour && __was_installed)) {                \
+        out_var = __detour(__VA_ARGS__);                      \
+    } else {                                                  \
+        __ret = __disable_symbol_override(sym);               \
+        if (likely(__ret == 0)) {                             \
+            out_var = __ptr(__VA_ARGS__);                     \
+            if (likely(__was_installed)) {                    \
+                __ret = __enable_symbol_override(sym);        \
+            }                                                 \
         }                                                     \
     }                                                         \
     __ret;                                                    \
 });
 
+/**
+ * Records latency of an override replacement function (noop unless DBG_OVS_STATS; see debug/debug_ovs_stats.h)
+ *
+ * @example
+ *     static int foo_shim(void) {
+ *         ovs_stats_time_begin(start);
+ *         ...
+ *         override_symbol_time_end(foo_ovs, start);
+ *         return 0;
+ *     }
+ */
+#define override_symbol_time_end(sym, start_var) ovs_stats_time_end(__get_ovs_stats(sym), start_var)
+
 /**
  * override_symbol() with automatic error handling. See the original function for details.
  *
@@ -78,7 +107,8 @@ typedef struct override_symbol_inst override_symbol_inst;
  * @param name Name of the kernel symbol (function) to override
  * @param new_sym_ptr An address/pointer to a new function
  *
- * @return Instance of override_symbol_inst struct pointer on success, ERR_PTR(-E) on error
+ * @return Instance of override_symbol_inst struct pointer on success, ERR_PTR(-ENOENT) if the symbol doesn't exist,
+ *         ERR_PTR(-E) on other errors
  *
  * @example
  *     struct override_symbol_inst *ovi;
@@ -96,10 +126,31 @@ typedef struct override_symbol_inst override_symbol_inst;
  */
 struct override_symbol_inst* __must_check override_symbol(const char *name, const void *new_sym_ptr);
 
+struct override_symbol_req {
+    const char *name; //name of the kernel symbol (function) to override
+    const void *new_sym_ptr; //an address/pointer to a new function
+    struct override_symbol_inst **ovs; //where to store the instance (set to NULL on failure)
+};
+
+/**
+ * Overrides multiple kernel symbols at once
+ *
+ * This is an equivalent of calling override_symbol() for every request, but all symbols are resolved & all trampolines
+ * are prepared first, and then installed within a single unlocked section. The batch is atomic from the caller's
+ * perspective: if any of the symbols cannot be overridden none of them is. Every instance should be restored with
+ * restore_symbol() separately.
+ *
+ * @param reqs Array of requests
+ * @param num Number of elements in reqs
+ *
+ * @return 0 on success or -E on error
+ */
+int __must_check override_symbols_batch(const struct override_symbol_req *reqs, unsigned int num);
+
 /**
  * Restores symbol overridden by override_symbol()
  *
- * For details see override_symbol() docblock
+ * For details see override_symbol() docblock. It may sleep (see put_overridden_symbol()).
  *
  * @return 0 on success, -E on error
  */
@@ -115,19 +166,47 @@ int restore_symbol(struct override_symbol_inst *sym);
  * restore_symbol() to actually restore the original code. This function simply "forgets" about the override and frees
  * memory (as if external module has been unloaded we are NOT allowed to touch that memory anymore as it may be freed).
  * It is explicitly NOT necessary to call this function after restore_symbol() as it does so internally.
+ * When the symbol has a detour it waits for CPUs which may still be executing it, so it must be called from a context
+ * which can sleep.
  */
 void put_overridden_symbol(struct override_symbol_inst *sym);
 
+/**
+ * Registers int3 handler used to safely patch live code (see "PATCHING LIVE CODE" in override_symbol.c)
+ *
+ * Overrides work without it, but then the code is patched with a plain copy which other CPUs may observe half-written.
+ *
+ * @return 0 on success, -E on error
+ */
+int register_override_symbol_poke_handler(void);
+
+/**
+ * Unregisters handler registered with register_override_symbol_poke_handler()
+ *
+ * @return 0 on success, -E on error
+ */
+int unregister_override_symbol_poke_handler(void);
+
 /**
  * Check if the given symbol override is currently active
  */
 bool symbol_is_overridden(struct override_symbol_inst *sym);
 
+/**
+ * Check if the original of the given symbol can be called without lifting the override (i.e. it has a detour)
+ *
+ * Without a detour call_overridden_symbol() restores the original code for the time of the call, so calls made on
+ * other CPUs at the same moment bypass the override.
+ */
+bool symbol_has_detour(struct override_symbol_inst *sym);
+
 
 /****************** Private helpers (should not be used directly by any code outside of this unit!) *******************/
 #include <linux/types.h>
 int __enable_symbol_override(override_symbol_inst *sym);
 int __disable_symbol_override(override_symbol_inst *sym);
 void * __get_org_ptr(struct override_symbol_inst *sym);
+void * __get_org_detour(struct override_symbol_inst *sym);
+struct ovs_stats *__get_ovs_stats(struct override_symbol_inst *sym);
 
 #endif //REDPILLLKM_OVERRIDE_KFUNC_H
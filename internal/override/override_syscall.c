@@ -1,9 +1,14 @@
 #include "override_syscall.h"
 #include "../../common.h"
-#include "../helper/memory_helper.h" //set_mem_addr_ro(), set_mem_addr_rw()
+#include "../helper/memory_helper.h" //WITH_MEM_UNLOCKED
 #include <asm/asm-offsets.h> //__NR_syscall_max & NR_syscalls
 #include <asm/unistd.h> //syscalls numbers (e.g. __NR_read)
-#include "../helper/symbol_helper.h" //kln_func
+#include "../helper/symbol_helper.h" //kln_cached()
+#include <linux/list.h> //list_*
+#include <linux/module.h> //THIS_MODULE, MODULE_STATE_LIVE
+#include "../../debug/debug_ovs_stats.h" //ovs_stats_*(); noop unless DBG_OVS_STATS
+
+#define SYS_CALL_TABLE_SCAN_MAX (32 * 1024 * 1024) //how far to scan when kernel image boundaries are unknown
 
 static unsigned long *syscall_table_ptr = NULL;
 static void print_syscall_table(unsigned int from, unsigned to)
@@ -24,9 +29,9 @@ static void print_syscall_table(unsigned int from, unsigned to)
     }
 }
 
-static int find_sys_call_table(void)
+static int __init find_sys_call_table(void)
 {
-    syscall_table_ptr = (unsigned long *)kln_func("sys_call_table");
+    syscall_table_ptr = (unsigned long *)kln_cached("sys_call_table");
     if (syscall_table_ptr != 0) {
         pr_loc_dbg("Found sys_call_table @ <%p> using kallsyms", syscall_table_ptr);
         return 0;
@@ -44,10 +49,10 @@ static int find_sys_call_table(void)
      a place of sys_call_table by verifying other 2-3 places to make sure other syscalls are where they should be
      The huge downside of this method is it is slow as potentially the amount of memory to search may be large.
     */
-    unsigned long sys_close_ptr = kln_func("sys_close");
-    unsigned long sys_open_ptr = kln_func("sys_open");
-    unsigned long sys_read_ptr = kln_func("sys_read");
-    unsigned long sys_write_ptr = kln_func("sys_write");
+    unsigned long sys_close_ptr = kln_cached("sys_close");
+    unsigned long sys_open_ptr = kln_cached("sys_open");
+    unsigned long sys_read_ptr = kln_cached("sys_read");
+    unsigned long sys_write_ptr = kln_cached("sys_write");
     if (sys_close_ptr == 0 || sys_open_ptr == 0 || sys_read_ptr == 0 || sys_write_ptr == 0) {
         pr_loc_bug(
                 "One or more syscall handler addresses cannot be located: "
@@ -67,22 +72,32 @@ static int find_sys_call_table(void)
       ffffffff860c7ba0 T __x64_sys_write
       ffffffff86e013a0 R sys_call_table    <= it's way below any of the syscalls but not too far (~13,892,336 bytes)
     */
-    unsigned long i = sys_close_ptr;
-    if (sys_open_ptr < i) i = sys_open_ptr;
-    if (sys_read_ptr < i) i = sys_read_ptr;
-    if (sys_write_ptr < i) i = sys_write_ptr;
+    unsigned long start = sys_close_ptr;
+    if (sys_open_ptr < start) start = sys_open_ptr;
+    if (sys_read_ptr < start) start = sys_read_ptr;
+    if (sys_write_ptr < start) start = sys_write_ptr;
+
+    //The table is const so it must be in .rodata - if we know where it is we don't need to go through the whole text
+    unsigned long rodata_start = kln_cached("__start_rodata");
+    unsigned long end = kln_cached("__end_rodata");
+    if (rodata_start > start)
+        start = rodata_start;
+    if (!end || end <= start)
+        end = kln_cached("_end"); //end of the kernel image - everything above may not be mapped
+    if (!end || end <= start)
+        end = start + SYS_CALL_TABLE_SCAN_MAX;
+    start = ALIGN(start, sizeof(unsigned long));
 
     //If everything goes well it should take ~1-2ms tops (which is slow in the kernel sense but it's not bad)
-    pr_loc_dbg("Scanning memory for sys_call_table starting at %p", (void *)i);
-    for (; i < ULONG_MAX; i += sizeof(void *)) {
-        syscall_table_ptr = (unsigned long *)i;
-
-        if (unlikely(
-                syscall_table_ptr[__NR_close] == sys_close_ptr &&
-                syscall_table_ptr[__NR_open] == sys_open_ptr &&
-                syscall_table_ptr[__NR_read] == sys_read_ptr &&
-                syscall_table_ptr[__NR_write] == sys_write_ptr
-        )) {
+    pr_loc_dbg("Scanning memory for sys_call_table in %p-%p", (void *)start, (void *)end);
+    const unsigned long *word = (const unsigned long *)start;
+    const unsigned long *last = (const unsigned long *)(end - sizeof(unsigned long) * NR_syscalls);
+    for (; word <= last; word++) {
+        if (likely(word[__NR_close] != sys_close_ptr)) //cheap check first, verify only candidates
+            continue;
+
+        if (word[__NR_open] == sys_open_ptr && word[__NR_read] == sys_read_ptr && word[__NR_write] == sys_write_ptr) {
+            syscall_table_ptr = (unsigned long *)word;
             pr_loc_dbg("Found sys_call_table @ %p", (void *)syscall_table_ptr);
             return 0;
         }
@@ -93,17 +108,57 @@ static int find_sys_call_table(void)
     return -EFAULT;
 }
 
-static unsigned long *overridden_syscall[NR_syscalls] = { NULL }; //@todo this should be alloced dynamically
+/**
+ * Returns cached result of find_sys_call_table() - the search is done only once, even if it fails
+ *
+ * The search itself lives in init sections (all syscall overrides are currently registered while the module loads)
+ * so it cannot be done once the module is live (hence __ref).
+ */
+static int __ref get_sys_call_table(void)
+{
+    static int search_result = 1; //>0 = not searched yet
+
+    if (likely(search_result <= 0))
+        return search_result;
+
+    if (unlikely(THIS_MODULE->state == MODULE_STATE_LIVE)) {
+        pr_loc_bug("sys_call_table was never searched during init - it cannot be searched after init");
+        search_result = -EFAULT;
+        return search_result;
+    }
+
+    search_result = find_sys_call_table();
+    return search_result;
+}
+
+//Usually only one or two syscalls are overridden so a simple list is much cheaper than a table of NR_syscalls entries
+struct overridden_syscall {
+    struct list_head list;
+    unsigned int num;
+    unsigned long *org_ptr; //original-original entry (never an override)
+    struct ovs_stats *stats; //invocation stats; always NULL unless DBG_OVS_STATS
+};
+static LIST_HEAD(overridden_syscalls);
+
+static struct overridden_syscall *get_overridden_syscall(unsigned int syscall_num)
+{
+    struct overridden_syscall *entry;
+    list_for_each_entry(entry, &overridden_syscalls, list) {
+        if (entry->num == syscall_num)
+            return entry;
+    }
+
+    return NULL;
+}
+
 int override_syscall(unsigned int syscall_num, const void *new_sysc_ptr, void * *org_sysc_ptr)
 {
     pr_loc_dbg("Overriding syscall #%d with %pf()<%p>", syscall_num, new_sysc_ptr, new_sysc_ptr);
 
     int out = 0;
-    if (unlikely(!syscall_table_ptr)) {
-        out = find_sys_call_table();
-        if (unlikely(out != 0))
-            return out;
-    }
+    out = get_sys_call_table();
+    if (unlikely(out != 0))
+        return out;
 
     if (unlikely(syscall_num > __NR_syscall_max)) {
         pr_loc_bug("Invalid syscall number: %d > %d", syscall_num, __NR_syscall_max);
@@ -112,22 +167,29 @@ int override_syscall(unsigned int syscall_num, const void *new_sysc_ptr, void *
 
     print_syscall_table(syscall_num-5, syscall_num+5);
 
-    if (unlikely(overridden_syscall[syscall_num])) {
+    struct overridden_syscall *entry = get_overridden_syscall(syscall_num);
+    if (unlikely(entry)) {
         pr_loc_bug("Syscall %d is already overridden - will be replaced (bug?)", syscall_num);
+        ovs_stats_destroy(entry->stats);
     } else {
-        //Only save original-original entry (not the override one)
-        overridden_syscall[syscall_num] = (unsigned long *)syscall_table_ptr[syscall_num];
+        kmalloc_or_exit_int(entry, sizeof(struct overridden_syscall), RP_MEM_OVERRIDE);
+        entry->num = syscall_num;
+        entry->org_ptr = (unsigned long *)syscall_table_ptr[syscall_num]; //Only save original-original entry
+        list_add(&entry->list, &overridden_syscalls);
     }
 
     if (org_sysc_ptr != 0)
-        *org_sysc_ptr = overridden_syscall[syscall_num];
+        *org_sysc_ptr = entry->org_ptr;
+
+    char stats_name[16];
+    snprintf(stats_name, sizeof(stats_name), "syscall#%u", syscall_num);
+    entry->stats = ovs_stats_create(stats_name, new_sysc_ptr);
 
-    set_mem_addr_rw((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
     pr_loc_dbg("syscall #%d originally %ps<%p> will now be %ps<%p> @ %d", syscall_num,
-               (void *) overridden_syscall[syscall_num], (void *) overridden_syscall[syscall_num], new_sysc_ptr,
-               new_sysc_ptr, smp_processor_id());
-    syscall_table_ptr[syscall_num] = (unsigned long) new_sysc_ptr;
-    set_mem_addr_ro((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
+               (void *) entry->org_ptr, (void *) entry->org_ptr, new_sysc_ptr, new_sysc_ptr, smp_processor_id());
+    WITH_MEM_UNLOCKED(&syscall_table_ptr[syscall_num], sizeof(unsigned long),
+        syscall_table_ptr[syscall_num] = (unsigned long) ovs_stats_target(entry->stats, new_sysc_ptr);
+    );
 
     print_syscall_table(syscall_num-5, syscall_num+5);
 
@@ -148,19 +210,24 @@ int restore_syscall(unsigned int syscall_num)
         return -EINVAL;
     }
 
-    if (unlikely(overridden_syscall[syscall_num] == 0)) {
+    struct overridden_syscall *entry = get_overridden_syscall(syscall_num);
+    if (unlikely(!entry)) {
         pr_loc_bug("Syscall #%d cannot be restored - it was never overridden", syscall_num);
         return -EINVAL;
     }
 
     print_syscall_table(syscall_num-5, syscall_num+5);
 
-    set_mem_addr_rw((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
     pr_loc_dbg("Restoring syscall #%d from %ps<%p> to original %ps<%p>", syscall_num,
                (void *) syscall_table_ptr[syscall_num], (void *) syscall_table_ptr[syscall_num],
-               (void *) overridden_syscall[syscall_num], (void *) overridden_syscall[syscall_num]);
-    syscall_table_ptr[syscall_num] = (unsigned long)overridden_syscall[syscall_num];
-    set_mem_addr_rw((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
+               (void *) entry->org_ptr, (void *) entry->org_ptr);
+    WITH_MEM_UNLOCKED(&syscall_table_ptr[syscall_num], sizeof(unsigned long),
+        syscall_table_ptr[syscall_num] = (unsigned long)entry->org_ptr;
+    );
+
+    list_del(&entry->list);
+    ovs_stats_destroy(entry->stats);
+    rp_kfree(entry, RP_MEM_OVERRIDE);
 
     print_syscall_table(syscall_num-5, syscall_num+5);
 
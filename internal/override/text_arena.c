@@ -0,0 +1,64 @@
+/**
+ * A single page of executable memory for stubs generated at runtime (e.g. detours of overridden symbols)
+ *
+ * Stubs have to be executable & within +-2GB of the kernel text (so that CALL rel32 can be relocated into them), which
+ * rules out vmalloc()-like memory (module_alloc() isn't exported). Instead the arena is reserved in the module's own
+ * .text, which the kernel maps RO+X when loading the module, and it's never remapped:
+ *  - it's one page-aligned page, so all stubs combined share one TLB entry & a batch of writes to them costs a single
+ *    protection transition (see memcpy_to_ro_mem_batch())
+ *  - stubs are packed contiguously in TEXT_ARENA_CHUNK units instead of fixed-size slots, so the hot ones share cache
+ *    lines instead of being spread all over kernel text pages
+ *  - nothing is allocated per stub; a bitmap of chunks is the only bookkeeping
+ * The arena starts filled with int3, so a jump into a never-written stub traps instead of running garbage.
+ */
+#include "text_arena.h"
+#include "../../common.h"
+#include <linux/bitmap.h> //DECLARE_BITMAP, bitmap_find_next_zero_area(), bitmap_set(), bitmap_clear()
+#include <linux/spinlock.h> //DEFINE_SPINLOCK, spin_lock_irqsave(), spin_unlock_irqrestore()
+#include <linux/stringify.h> //__stringify
+
+#define TEXT_ARENA_SIZE 4096 //one page on x86
+#define TEXT_ARENA_CHUNKS (TEXT_ARENA_SIZE / TEXT_ARENA_CHUNK)
+
+asm(".pushsection .text\n"
+    ".balign " __stringify(TEXT_ARENA_SIZE) "\n"
+    "rp_text_arena:\n"
+    ".fill " __stringify(TEXT_ARENA_SIZE) ",1,0xcc\n"
+    ".popsection\n");
+extern unsigned char rp_text_arena[];
+
+static DECLARE_BITMAP(text_arena_used, TEXT_ARENA_CHUNKS);
+static DEFINE_SPINLOCK(text_arena_lock);
+
+void *text_arena_alloc(size_t len)
+{
+    unsigned int chunks = DIV_ROUND_UP(len, TEXT_ARENA_CHUNK);
+    unsigned long flags;
+
+    spin_lock_irqsave(&text_arena_lock, flags);
+    unsigned long start = bitmap_find_next_zero_area(text_arena_used, TEXT_ARENA_CHUNKS, 0, chunks, 0);
+    if (unlikely(start >= TEXT_ARENA_CHUNKS)) {
+        spin_unlock_irqrestore(&text_arena_lock, flags);
+        pr_loc_wrn("Text arena is full - cannot reserve %zu bytes", len);
+        return NULL;
+    }
+    bitmap_set(text_arena_used, start, chunks);
+    spin_unlock_irqrestore(&text_arena_lock, flags);
+
+    return rp_text_arena + (start * TEXT_ARENA_CHUNK);
+}
+
+void text_arena_free(void *ptr, size_t len)
+{
+    unsigned long start = ((unsigned char *)ptr - rp_text_arena) / TEXT_ARENA_CHUNK;
+    unsigned long flags;
+
+    if (unlikely((unsigned char *)ptr < rp_text_arena || start >= TEXT_ARENA_CHUNKS)) {
+        pr_loc_bug("%p is not within the text arena", ptr);
+        return;
+    }
+
+    spin_lock_irqsave(&text_arena_lock, flags);
+    bitmap_clear(text_arena_used, start, DIV_ROUND_UP(len, TEXT_ARENA_CHUNK));
+    spin_unlock_irqrestore(&text_arena_lock, flags);
+}
@@ -0,0 +1,25 @@
+#ifndef REDPILL_TEXT_ARENA_H
+#define REDPILL_TEXT_ARENA_H
+
+#include <linux/types.h> //size_t
+
+#define TEXT_ARENA_CHUNK 16 //allocation granularity; every stub starts at a 16-byte boundary
+
+/**
+ * Reserves executable memory for a stub (e.g. a relocated prologue) in the module-owned arena (see text_arena.c)
+ *
+ * The memory is read-only - it must be written with memcpy_to_ro_mem() or memcpy_to_ro_mem_batch(). It's guaranteed
+ * to be in the range of rel32 from the kernel text. It's safe to call in any context.
+ *
+ * @return pointer to the stub or NULL if the arena is full
+ */
+void *text_arena_alloc(size_t len);
+
+/**
+ * Returns memory reserved with text_arena_alloc(); the length must be the same as when it was reserved
+ *
+ * The caller must make sure nothing can execute the stub anymore.
+ */
+void text_arena_free(void *ptr, size_t len);
+
+#endif //REDPILL_TEXT_ARENA_H
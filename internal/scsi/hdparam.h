@@ -59,6 +59,25 @@
 #define WIN_FT_SMART_AUTOSAVE 0xd2 //this is not a typo (AUTOSAVE and AUTO_OFFLINE are spelled differently in ATA spec)
 #define WIN_FT_SMART_AUTO_OFFLINE 0xdb
 
+/************************************ Params related to SG_IO with ATA PASS-THROUGH ************************************/
+//See "12.2.2 ATA PASS-THROUGH (16) command" & "12.2.3 ATA PASS-THROUGH (12) command" in T10/SAT-2 spec. Offsets of
+// ATA registers differ between CDB types, the flags byte is the same.
+#define SAT_ATA_16_OPCODE 0x85
+#define SAT_ATA_16_LEN 16
+#define SAT_ATA_12_OPCODE 0xa1
+#define SAT_ATA_12_LEN 12
+#define SAT_CDB_FLAGS 2 //byte containing CK_COND, T_DIR, BYTE_BLOCK & T_LENGTH
+#define SAT_CDB_CK_COND 0x20 //caller requested ATA registers to be returned in sense data
+
+//Descriptor-format sense data with ATA Status Return descriptor (see "12.2.2.6 ATA Status Return sense data descriptor")
+#define SAT_SENSE_LEN 22 //8 bytes of sense header + 14 bytes of the descriptor
+#define SAT_SENSE_DESC_ATA_RET 0x09
+#define SAT_SENSE_ASCQ_ATA_PT_INFO 0x1d //ASC=0x00 ASCQ=0x1d: "ATA pass through information available"
+
+//Values set in sg_io_hdr by the SCSI layer; newer kernels dropped some of these constants so they're defined here
+#define SG_MASKED_STATUS_CHECK_CONDITION 0x01
+#define SG_DRIVER_SENSE 0x08
+
 /*************************************** Params related to ATA IDENTIFY command ***************************************/
 //Word numbers for the ATA IDENTIFY command response fields & bits in them (described in "struct hd_driveid")
 #define ATA_ID_COMMAND_SET_1_SMART 0x01 //first bit of command set #1 contains SMART supported flag
@@ -33,9 +33,9 @@
  * to trigger notifications for all-all SCSI devices (which include hosts, buses, etc). If needed a new set of functions
  * subscribe_.../ubsubscribe_... can easily be added which don't filter by type.
  *
- * TODO
- * This notifier does not support notifying about disconnection of the device. It should as we need to know if device
- * disappeared (e.g. while processing shimming of boot devices).
+ * REMOVAL
+ * Removal of disks is delivered as SCSI_EVT_DEV_REMOVED, based on the SCSI bus notifications (BUS_NOTIFY_DEL_DEVICE).
+ * That event cannot be vetoed.
  *
  * ADDITIONAL TOOLS
  * It is highly recommended to use scsi_toolbox when subscribing to notifications from the SCSI subsystem.
@@ -46,15 +46,68 @@
 #include "scsi_notifier.h"
 #include "../../common.h"
 #include "../notifier_base.h" //notifier_*()
-#include "scsi_notifier_list.h"
 #include "scsi_toolbox.h"
 #include "../intercept_driver_register.h" //watching for sd driver loading
+#include "../metrics.h" //RP_METRIC(), rp_metric_*()
+#include "../../debug/debug_scsi_bench.h" //sbench_*(); noop unless built with DBG_SCSI_BENCH
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+#include <linux/rculist.h> //list_add_rcu(), list_del_rcu(), list_for_each_entry_rcu()
+#include <linux/srcu.h> //struct srcu_struct, srcu_read_lock(), synchronize_srcu()
 #include <scsi/scsi_device.h> //to_scsi_device()
 
 #define NOTIFIER_NAME "SCSI device"
 
+/**************************************************** Subscribers *****************************************************/
+//Sorted by priority (highest first). Readers use SRCU (callbacks can sleep, e.g. while reading capacity) so that async
+// probes of many disks don't serialize on a lock like they would with a blocking notifier chain.
+static LIST_HEAD(subscribers);
+static DEFINE_MUTEX(subscribers_lock);
+static struct srcu_struct subscribers_srcu; //initialized dynamically as 3.10 has no DEFINE_STATIC_SRCU
+static bool subscribers_srcu_ready = false;
+
+static RP_METRIC(scsi_evt_probing, RP_MG_SCSI_NOTIFIER, RP_METRIC_COUNTER);
+static RP_METRIC(scsi_evt_probed_ok, RP_MG_SCSI_NOTIFIER, RP_METRIC_COUNTER);
+static RP_METRIC(scsi_evt_probed_err, RP_MG_SCSI_NOTIFIER, RP_METRIC_COUNTER);
+static RP_METRIC(scsi_evt_removed, RP_MG_SCSI_NOTIFIER, RP_METRIC_COUNTER);
+static RP_METRIC(scsi_sd_probe_ns, RP_MG_SCSI_NOTIFIER, RP_METRIC_HISTOGRAM); //original sd_probe() only
+static RP_METRIC(scsi_probe_shim_ns, RP_MG_SCSI_NOTIFIER, RP_METRIC_HISTOGRAM); //sd_probe() with all subscribers
+static struct rp_metric *const scsi_evt_metrics[] = {
+    [SCSI_EVT_DEV_PROBING] = &scsi_evt_probing,
+    [SCSI_EVT_DEV_PROBED_OK] = &scsi_evt_probed_ok,
+    [SCSI_EVT_DEV_PROBED_ERR] = &scsi_evt_probed_err,
+    [SCSI_EVT_DEV_REMOVED] = &scsi_evt_removed,
+};
+static struct rp_metric *const scsi_other_metrics[] = { &scsi_sd_probe_ns, &scsi_probe_shim_ns };
+
+/**
+ * Calls all subscribers interested in a given event & device
+ *
+ * @return NOTIFY_* of the last subscriber called, NOTIFY_DONE if none was called
+ */
+static int notify_subscribers(scsi_event evt, struct scsi_device *sdp)
+{
+    struct scsi_disk_subscriber *sub;
+    int ret = NOTIFY_DONE;
+
+    rp_metric_inc(scsi_evt_metrics[evt]);
+    int idx = srcu_read_lock(&subscribers_srcu);
+    list_for_each_entry_rcu(sub, &subscribers, list) {
+        if (!(sub->event_mask & SCSI_EVT_MASK(evt)) || (sub->filter && !sub->filter(&sdp->sdev_gendev)))
+            continue;
+
+        sbench_time_begin(sub_start);
+        ret = sub->nb.notifier_call(&sub->nb, evt, sdp);
+        sbench_record_sub(sub->nb.notifier_call, evt, sub_start);
+        if (ret & NOTIFY_STOP_MASK)
+            break;
+    }
+    srcu_read_unlock(&subscribers_srcu, idx);
+
+    return ret;
+}
+
 /*********************************** Interacting with an active/loaded SCSI driver ************************************/
-static driver_watcher_instance *driver_watcher = NULL;
+static driver_ready_request *driver_ready_req = NULL; //set when waiting for the sd driver to load
 static int (*org_sd_probe) (struct device *dev) = NULL; //set during register
 
 /**
@@ -74,22 +127,28 @@ static int sd_probe_shim(struct device *dev)
         return org_sd_probe(dev);
     }
 
+    rp_metric_time_begin(shim_start);
+    scsi_disk_registry_add(sdp); //it's on the bus regardless of the probe result
+
     pr_loc_dbg("Triggering SCSI_EVT_DEV_PROBING notifications");
-    int out = notifier_to_errno(blocking_notifier_call_chain(&rp_scsi_notify_list, SCSI_EVT_DEV_PROBING, sdp));
+    int out = notify_subscribers(SCSI_EVT_DEV_PROBING, sdp);
     if (unlikely(out == NOTIFY_STOP)) {
         pr_loc_dbg("After SCSI_EVT_DEV_PROBING a callee stopped chain with non-error condition. Faking probe-ok.");
         return 0;
     } else if (unlikely(out == NOTIFY_BAD)) {
-        pr_loc_dbg("After SCSI_EVT_DEV_PROBING a callee stopped chain with non-error condition. Faking probe-ok.");
+        pr_loc_dbg("After SCSI_EVT_DEV_PROBING a callee stopped chain with error condition. Failing probe.");
         return -EIO; //some generic error
     }
 
     pr_loc_dbg("Calling original sd_probe()");
+    rp_metric_time_begin(metric_start);
     out = org_sd_probe(dev);
+    rp_metric_time_end(&scsi_sd_probe_ns, metric_start);
     scsi_event evt = (out == 0) ? SCSI_EVT_DEV_PROBED_OK : SCSI_EVT_DEV_PROBED_ERR;
 
     pr_loc_dbg("Triggering SCSI_EVT_DEV_PROBED notifications - sd_probe() exit=%d", out);
-    blocking_notifier_call_chain(&rp_scsi_notify_list, evt, sdp);
+    notify_subscribers(evt, sdp);
+    rp_metric_time_end(&scsi_probe_shim_ns, shim_start);
 
     return out;
 }
@@ -127,33 +186,97 @@ static inline void uninstall_sd_probe_shim(struct device_driver *drv)
 }
 
 /**
- * Watches for the sd driver to load in order to shim it. The driver registration is modified before the driver loads.
+ * Called when the sd driver loads in order to shim it. The driver registration is modified before the driver loads.
  */
-static driver_watch_notify_result sd_load_watcher(struct device_driver *drv, driver_watch_notify_state event)
+static void sd_ready(struct device_driver *drv, void *data)
 {
-    if (unlikely(event != DWATCH_STATE_COMING))
-        return DWATCH_NOTIFY_CONTINUE;
-
     pr_loc_dbg("%s driver loaded - triggering sd_probe shim installation", SCSI_DRV_NAME);
     install_sd_probe_shim(drv);
-
-    driver_watcher = NULL; //returning DWATCH_NOTIFY_DONE causes automatic unwatching
-    return DWATCH_NOTIFY_DONE;
 }
 
 /******************************************** Public API of the notifier **********************************************/
 extern struct bus_type scsi_bus_type;
 
-int subscribe_scsi_disk_events(struct notifier_block *nb)
+/**
+ * Watches for SCSI devices going away to invalidate what scsi_toolbox cached about them & notify subscribers
+ */
+static int scsi_bus_notify(struct notifier_block *self, unsigned long action, void *data)
 {
-    notifier_sub(nb);
-    return blocking_notifier_chain_register(&rp_scsi_notify_list, nb);
+    struct device *dev = data;
+    if (action != BUS_NOTIFY_DEL_DEVICE || !is_scsi_leaf(dev))
+        return NOTIFY_DONE;
+
+    struct scsi_device *sdp = to_scsi_device(dev);
+    scsi_disk_registry_remove(sdp);
+    scsi_forget_cached_info(sdp);
+
+    if (is_scsi_disk(sdp)) {
+        pr_loc_dbg("Triggering SCSI_EVT_DEV_REMOVED notifications");
+        notify_subscribers(SCSI_EVT_DEV_REMOVED, sdp);
+    }
+
+    return NOTIFY_OK;
 }
 
-int unsubscribe_scsi_disk_events(struct notifier_block *nb)
+static struct notifier_block scsi_bus_nb = {
+    .notifier_call = scsi_bus_notify,
+};
+
+int subscribe_scsi_disk_events(struct scsi_disk_subscriber *sub)
 {
-    notifier_unsub(nb);
-    return blocking_notifier_chain_unregister(&rp_scsi_notify_list, nb);
+    if (unlikely(!subscribers_srcu_ready)) {
+        pr_loc_bug("%s notifier must be registered before subscribing", NOTIFIER_NAME);
+        return -ENODEV;
+    }
+
+    notifier_sub(&sub->nb);
+
+    mutex_lock(&subscribers_lock);
+    struct scsi_disk_subscriber *cur;
+    struct list_head *pos = &subscribers; //the end of the list unless a subscriber with lower priority exists
+    list_for_each_entry(cur, &subscribers, list) {
+        if (cur == sub) {
+            mutex_unlock(&subscribers_lock);
+            pr_loc_bug("%pF is already subscribed", sub->nb.notifier_call);
+            return -EEXIST;
+        }
+
+        if (pos == &subscribers && sub->nb.priority > cur->nb.priority)
+            pos = &cur->list;
+    }
+    list_add_tail_rcu(&sub->list, pos); //adding before pos
+    mutex_unlock(&subscribers_lock);
+
+    return 0;
+}
+
+int unsubscribe_scsi_disk_events(struct scsi_disk_subscriber *sub)
+{
+    notifier_unsub(&sub->nb);
+
+    mutex_lock(&subscribers_lock);
+    struct scsi_disk_subscriber *cur;
+    bool found = false;
+    list_for_each_entry(cur, &subscribers, list) {
+        if (cur == sub) {
+            found = true;
+            break;
+        }
+    }
+
+    if (unlikely(!found)) {
+        mutex_unlock(&subscribers_lock);
+        return -ENOENT;
+    }
+
+    list_del_rcu(&sub->list);
+    mutex_unlock(&subscribers_lock);
+
+    //The subscriber is usually static data of some shim - it cannot go away until no probe is calling it
+    if (likely(subscribers_srcu_ready))
+        synchronize_srcu(&subscribers_srcu);
+
+    return 0;
 }
 
 // We need an additional flag as depending on which method of sd_probe override (watcher vs. existing driver find &
@@ -168,29 +291,55 @@ int register_scsi_notifier(void)
         return -EEXIST;
     }
 
-    struct device_driver *drv = find_scsi_driver();
+    rp_metrics_register(scsi_evt_metrics, ARRAY_SIZE(scsi_evt_metrics));
+    rp_metrics_register(scsi_other_metrics, ARRAY_SIZE(scsi_other_metrics));
+
+    int out = init_srcu_struct(&subscribers_srcu);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to initialize SRCU for %s notifier - error=%d", NOTIFIER_NAME, out);
+        return out;
+    }
+    subscribers_srcu_ready = true;
+
+    out = bus_register_notifier(&scsi_bus_type, &scsi_bus_nb);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to register SCSI bus notifier - error=%d", out);
+        goto error_srcu;
+    }
+
+    //After the bus notifier (to not miss removals) but before sd_probe() shim (to not miss additions)
+    out = scsi_disk_registry_start();
+    if (unlikely(out != 0))
+        goto error_bus_nb;
 
-    if(unlikely(drv < 0)) { //some error occurred while looking for the driver
-        return PTR_ERR(drv); //find_scsi_driver() should already log what went wrong
-    } else if(drv) { //the driver is already loaded - driver watcher cannot help us
+    //If the driver is already loaded the shim is installed right away, otherwise it will be when the driver loads
+    driver_ready_req = on_scsi_driver_ready(DWATCH_STATE_COMING, sd_ready, NULL);
+    if (unlikely(IS_ERR(driver_ready_req))) {
+        pr_loc_err("Failed to wait for driver %s", SCSI_DRV_NAME);
+        out = PTR_ERR(driver_ready_req);
+        driver_ready_req = NULL;
+        goto error_bus_nb;
+    } else if (!driver_ready_req) {
         pr_loc_wrn(
                 "The %s driver was already loaded when %s notifier registered - some devices may already be registered",
                 SCSI_DRV_NAME, NOTIFIER_NAME);
-        install_sd_probe_shim(drv);
-    } else { //driver not yet loaded - driver watcher will trigger sd_probe_shim installation when driver loads
+    } else {
         pr_loc_dbg("The %s driver is not ready to dispatch %s notifier events - awaiting driver", SCSI_DRV_NAME,
                    NOTIFIER_NAME);
-        driver_watcher = watch_scsi_driver_register(sd_load_watcher, DWATCH_STATE_COMING);
-        if (unlikely(IS_ERR(driver_watcher))) {
-            pr_loc_err("Failed to register driver watcher for driver %s", SCSI_DRV_NAME);
-            return PTR_ERR(driver_watcher);
-        }
     }
 
     notifier_registered = true;
 
     notifier_reg_ok();
     return 0;
+
+    error_bus_nb:
+    scsi_disk_registry_stop(); //noop if not started
+    bus_unregister_notifier(&scsi_bus_type, &scsi_bus_nb);
+    error_srcu:
+    subscribers_srcu_ready = false;
+    cleanup_srcu_struct(&subscribers_srcu);
+    return out;
 }
 
 int unregister_scsi_notifier(void)
@@ -205,13 +354,15 @@ int unregister_scsi_notifier(void)
     bool is_error = false;
     int out = -EINVAL;
 
-    //Check if we're watching sd driver (i.e. SCSI notifier was registered and is now being unregistered before the
-    // driver had a chance to load)
-    if (unlikely(driver_watcher)) {
-        pr_loc_dbg("%s notifier is still observing %s driver - stopping observer", NOTIFIER_NAME, SCSI_DRV_NAME);
-        out = unwatch_driver_register(driver_watcher);
-        if (unlikely(out != 0)) {
-            pr_loc_err("Failed to unregister driver watcher - error=%d", out);
+    //Release the sd driver ready request; if it wasn't called yet SCSI notifier is being unregistered before the
+    // driver had a chance to load
+    if (driver_ready_req) {
+        out = cancel_driver_ready(driver_ready_req);
+        driver_ready_req = NULL;
+        if (out == 0) {
+            pr_loc_dbg("%s notifier was still awaiting %s driver - stopped waiting", NOTIFIER_NAME, SCSI_DRV_NAME);
+        } else if (unlikely(out != -EALREADY)) {
+            pr_loc_err("Failed to cancel waiting for %s driver - error=%d", SCSI_DRV_NAME, out);
             is_error = true;
         }
     }
@@ -229,6 +380,16 @@ int unregister_scsi_notifier(void)
         }
     }
 
+    bus_unregister_notifier(&scsi_bus_type, &scsi_bus_nb);
+    scsi_disk_registry_stop();
+    scsi_free_cached_info();
+
+    if (unlikely(!list_empty(&subscribers)))
+        pr_loc_wrn("%s notifier is being unregistered with subscribers still present", NOTIFIER_NAME);
+    synchronize_srcu(&subscribers_srcu); //sd_probe_shim() is gone but some probe may still be inside
+    subscribers_srcu_ready = false;
+    cleanup_srcu_struct(&subscribers_srcu);
+
     notifier_registered = false;
     if (unlikely(is_error)) {
         return out;
@@ -2,15 +2,40 @@
 #define REDPILL_SCSI_NOTIFIER_H
 
 #include <linux/notifier.h> //All other parts including scsi_notifier.h cannot really not use linux/notifier.h
+#include <linux/list.h> //struct list_head
+
+struct device;
 
 typedef enum {
     SCSI_EVT_DEV_PROBING, //device is being probed; it can be modified or outright ignored
     SCSI_EVT_DEV_PROBED_OK, //device is probed and ready
     SCSI_EVT_DEV_PROBED_ERR, //device was probed but it failed
+    SCSI_EVT_DEV_REMOVED, //device is being removed from the system (incl. scsi_force_replug()); return value is ignored
 } scsi_event;
 
+#define SCSI_EVT_MASK(evt) (1U << (evt))
+#define SCSI_EVT_MASK_PROBED (SCSI_EVT_MASK(SCSI_EVT_DEV_PROBED_OK) | SCSI_EVT_MASK(SCSI_EVT_DEV_PROBED_ERR))
+#define SCSI_EVT_MASK_ALL \
+    (SCSI_EVT_MASK(SCSI_EVT_DEV_PROBING) | SCSI_EVT_MASK_PROBED | SCSI_EVT_MASK(SCSI_EVT_DEV_REMOVED))
+
 /**
- * Callback signature: void (*f)(struct notifier_block *self, unsigned long state, void *data), where:
+ * Subscription to SCSI disk events
+ *
+ * The .nb works exactly like with notifier chains: .notifier_call is called with the event & struct scsi_device, and
+ * subscribers with higher .priority are called first. However, the callback is called only for events selected in the
+ * .event_mask (SCSI_EVT_MASK() of scsi_event values) and devices accepted by the optional .filter (e.g. is_sata_disk()),
+ * so that subscribers don't have to be called just to ignore the event.
+ * The .list is used internally and shouldn't be touched.
+ */
+struct scsi_disk_subscriber {
+    struct notifier_block nb;
+    unsigned int event_mask;
+    bool (*filter)(struct device *dev);
+    struct list_head list;
+};
+
+/**
+ * Callback signature: int (*f)(struct notifier_block *self, unsigned long state, void *data), where:
  *      unsigned long state => scsi_event event
  *      void *data => struct scsi_device *sdp
  *
@@ -18,10 +43,13 @@ typedef enum {
  * add another set of methods (subscribe scsi_device_events() and such, do NOT extend the scope of these methods as
  * other parts of the code rely on pre-filtered events as in most cases listening for ALL devices is a lot of noise).
  *
- * @return
+ * Callbacks are called under SRCU (i.e. they can sleep and probes of different devices don't block each other) and
+ * they MUST NOT (un)subscribe from within the callback.
+ *
+ * @return 0 on success or -E on error
  */
-int subscribe_scsi_disk_events(struct notifier_block *nb);
-int unsubscribe_scsi_disk_events(struct notifier_block *nb);
+int subscribe_scsi_disk_events(struct scsi_disk_subscriber *sub);
+int unsubscribe_scsi_disk_events(struct scsi_disk_subscriber *sub);
 
 int register_scsi_notifier(void);
 int unregister_scsi_notifier(void);
@@ -5,11 +5,20 @@
 #include <linux/dma-direction.h> //DMA_FROM_DEVICE
 #include <linux/unaligned/be_byteshift.h> //get_unaligned_be32()
 #include <linux/delay.h> //msleep
+#include <linux/async.h> //async_schedule_domain(), async_synchronize_full_domain()
+#include <linux/list.h> //list_*
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_*
+#include <linux/jhash.h> //jhash()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+#include <linux/rcupdate.h> //rcu_read_lock(), rcu_dereference()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
 #include <scsi/scsi.h> //cmd consts (e.g. SERVICE_ACTION_IN), SCAN_WILD_CARD, and TYPE_DISK
 #include <scsi/scsi_eh.h> //struct scsi_sense_hdr, scsi_sense_valid()
 #include <scsi/scsi_host.h> //struct Scsi_Host, SYNO_PORT_TYPE_SATA
 #include <scsi/scsi_transport.h> //struct scsi_transport_template
 #include <scsi/scsi_device.h> //struct scsi_device, scsi_execute_req(), scsi_is_sdev_device()
+#include <linux/blkdev.h> //struct request_queue
+#include <linux/kobject.h> //get_ktype(), struct kobj_type
 
 extern struct bus_type scsi_bus_type; //SCSI bus type for driver scanning
 
@@ -61,7 +70,7 @@ long long opportunistic_read_capacity(struct scsi_device *sdp)
     bool use_cap16 = true;
 
     unsigned char *buffer = NULL;
-    kmalloc_or_exit_int(buffer, SCSI_BUF_SIZE);
+    kmalloc_or_exit_int(buffer, SCSI_BUF_SIZE, RP_MEM_SCSI);
 
     int out;
     int sense_valid = 0;
@@ -94,7 +103,7 @@ long long opportunistic_read_capacity(struct scsi_device *sdp)
             //Drive deliberately rejected the request and indicated that this situtation will not change
             if (sshdr.sense_key == ILLEGAL_REQUEST && (sshdr.asc == 0x20 || sshdr.asc == 0x24) && sshdr.ascq == 0x00) {
                 pr_loc_err("Drive refused to provide capacity");
-                kfree(buffer);
+                rp_kfree(buffer, RP_MEM_SCSI);
                 return -EINVAL;
             }
 
@@ -110,7 +119,7 @@ long long opportunistic_read_capacity(struct scsi_device *sdp)
     if (out != 0) {
         pr_loc_err("Failed to pre-read capacity of the drive after %d attempts due to SCSI errors",
                    (SCSI_CAP_MAX_RETRIES - read_retry));
-        kfree(buffer);
+        rp_kfree(buffer, RP_MEM_SCSI);
         return -EIO;
     }
 
@@ -120,10 +129,229 @@ long long opportunistic_read_capacity(struct scsi_device *sdp)
     //Good up to 8192000000 pebibytes - good luck overflowing that :D
     long long size_mb = ((lba+1) * sector_size) / 1024 / 1024; //sectors * sector size = size in bytes
 
-    kfree(buffer);
+    rp_kfree(buffer, RP_MEM_SCSI);
     return size_mb;
 }
 
+/************************************************* Device info cache *************************************************/
+#define SCSI_INFO_CACHE_BITS 5
+#define SCSI_IDENTITY_LEN 96
+
+struct scsi_info_entry {
+    struct hlist_node node;
+    u32 hash;
+    unsigned int replug_gen; //device is being removed by a replug (see begin_replug()) & will come back; 0 if not
+    struct scsi_cached_info info;
+    char identity[SCSI_IDENTITY_LEN];
+};
+
+static DEFINE_HASHTABLE(scsi_info_cache, SCSI_INFO_CACHE_BITS);
+static unsigned int scsi_replug_gen = 0; //last generation given to a replug
+static DEFINE_MUTEX(scsi_info_cache_lock); //protects everything above
+
+/**
+ * Copies unit serial number from VPD page 0x80 cached by the SCSI layer (no commands are issued)
+ *
+ * @return true if the serial was copied, false if it's not available
+ */
+static bool get_cached_vpd_serial(struct scsi_device *sdp, char *buf, size_t size)
+{
+    bool found = false;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+    rcu_read_lock();
+    struct scsi_vpd *vpd = rcu_dereference(sdp->vpd_pg80);
+    const unsigned char *page = vpd ? vpd->data : NULL;
+    int page_len = vpd ? vpd->len : 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+    rcu_read_lock();
+    const unsigned char *page = rcu_dereference(sdp->vpd_pg80);
+    int page_len = sdp->vpd_pg80_len;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+    if (page && page_len > 4) {
+        size_t len = min_t(size_t, min_t(size_t, page[3], page_len - 4), size - 1);
+        memcpy(buf, &page[4], len);
+        buf[len] = '\0';
+        found = strim(buf)[0] != '\0';
+    }
+    rcu_read_unlock();
+#endif
+
+    return found;
+}
+
+/**
+ * @param serial Buffer of SCSI_SERIAL_MAX_LEN for the serial number (empty if not available) or NULL
+ */
+static void get_scsi_identity(struct scsi_device *sdp, char *identity, char *serial)
+{
+    char serial_buf[SCSI_SERIAL_MAX_LEN];
+    if (!serial)
+        serial = serial_buf;
+
+    if (get_cached_vpd_serial(sdp, serial, SCSI_SERIAL_MAX_LEN)) {
+        char *trimmed = strim(serial);
+        memmove(serial, trimmed, strlen(trimmed) + 1);
+        snprintf(identity, SCSI_IDENTITY_LEN, "sn:%.8s:%.16s:%s", sdp->vendor, sdp->model, serial);
+    } else {
+        serial[0] = '\0';
+        snprintf(identity, SCSI_IDENTITY_LEN, "addr:%.8s:%.16s:%u:%u:%u:%llu", sdp->vendor, sdp->model,
+                 sdp->host->host_no, sdp->channel, sdp->id, (unsigned long long)sdp->lun);
+    }
+}
+
+/**
+ * Finds cache entry; scsi_info_cache_lock must be held
+ */
+static struct scsi_info_entry *find_scsi_info(const char *identity, u32 hash)
+{
+    struct scsi_info_entry *entry;
+    hash_for_each_possible(scsi_info_cache, entry, node, hash) {
+        if (entry->hash == hash && strcmp(entry->identity, identity) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+int scsi_get_cached_info(struct scsi_device *sdp, struct scsi_cached_info *info)
+{
+    char identity[SCSI_IDENTITY_LEN];
+    char serial[SCSI_SERIAL_MAX_LEN];
+    get_scsi_identity(sdp, identity, serial);
+    u32 hash = jhash(identity, strlen(identity), 0);
+
+    mutex_lock(&scsi_info_cache_lock);
+    struct scsi_info_entry *entry = find_scsi_info(identity, hash);
+    if (entry) {
+        entry->replug_gen = 0; //it's back
+        *info = entry->info;
+        mutex_unlock(&scsi_info_cache_lock);
+        pr_loc_dbg("Using cached info of %s: %lld MiB", identity, info->capacity_mib);
+        return 0;
+    }
+    mutex_unlock(&scsi_info_cache_lock);
+
+    //The lock isn't held here as reads can take seconds; two concurrent reads of the same device are harmless
+    long long capacity_mib = opportunistic_read_capacity(sdp);
+    if (capacity_mib < 0)
+        return (int)capacity_mib;
+
+    info->capacity_mib = capacity_mib;
+    strlcpy(info->vendor, sdp->vendor ? sdp->vendor : "", sizeof(info->vendor));
+    strlcpy(info->model, sdp->model ? sdp->model : "", sizeof(info->model));
+    strlcpy(info->serial, serial, sizeof(info->serial));
+
+    entry = kmalloc(sizeof(struct scsi_info_entry), GFP_KERNEL);
+    if (unlikely(!entry)) {
+        pr_loc_wrn("Failed to cache info of %s", identity);
+        return 0;
+    }
+    rp_mem_alloced(RP_MEM_SCSI, entry);
+
+    entry->hash = hash;
+    entry->replug_gen = 0;
+    entry->info = *info;
+    strcpy(entry->identity, identity);
+
+    mutex_lock(&scsi_info_cache_lock);
+    if (likely(!find_scsi_info(identity, hash))) {
+        hash_add(scsi_info_cache, &entry->node, hash);
+        entry = NULL;
+    }
+    mutex_unlock(&scsi_info_cache_lock);
+    rp_kfree(entry, RP_MEM_SCSI); //somebody else added it in the meantime (or NULL)
+
+    return 0;
+}
+
+long long scsi_cached_read_capacity(struct scsi_device *sdp)
+{
+    struct scsi_cached_info info;
+    int out = scsi_get_cached_info(sdp, &info);
+
+    return out == 0 ? info.capacity_mib : out;
+}
+
+/**
+ * Starts a new replug; devices marked with its generation keep their cache entries when they're removed
+ *
+ * @return generation of the replug (never 0)
+ */
+static unsigned int begin_replug(void)
+{
+    mutex_lock(&scsi_info_cache_lock);
+    if (unlikely(++scsi_replug_gen == 0))
+        ++scsi_replug_gen;
+    unsigned int gen = scsi_replug_gen;
+    mutex_unlock(&scsi_info_cache_lock);
+
+    return gen;
+}
+
+/**
+ * Marks device as being replugged, so that its cache entry survives the removal
+ */
+static void mark_replugging(struct scsi_device *sdp, unsigned int gen)
+{
+    char identity[SCSI_IDENTITY_LEN];
+    get_scsi_identity(sdp, identity, NULL);
+    u32 hash = jhash(identity, strlen(identity), 0);
+
+    mutex_lock(&scsi_info_cache_lock);
+    struct scsi_info_entry *entry = find_scsi_info(identity, hash);
+    if (entry)
+        entry->replug_gen = gen;
+    mutex_unlock(&scsi_info_cache_lock);
+}
+
+/**
+ * Ends a replug, regardless of its result: devices which didn't come back are treated as normal ones again
+ */
+static void end_replug(unsigned int gen)
+{
+    struct scsi_info_entry *entry;
+    unsigned int bkt;
+
+    mutex_lock(&scsi_info_cache_lock);
+    hash_for_each(scsi_info_cache, bkt, entry, node) {
+        if (entry->replug_gen == gen)
+            entry->replug_gen = 0;
+    }
+    mutex_unlock(&scsi_info_cache_lock);
+}
+
+void scsi_forget_cached_info(struct scsi_device *sdp)
+{
+    char identity[SCSI_IDENTITY_LEN];
+    get_scsi_identity(sdp, identity, NULL);
+    u32 hash = jhash(identity, strlen(identity), 0);
+
+    mutex_lock(&scsi_info_cache_lock);
+    struct scsi_info_entry *entry = find_scsi_info(identity, hash);
+    if (entry && !entry->replug_gen) {
+        hash_del(&entry->node);
+        rp_kfree(entry, RP_MEM_SCSI);
+        pr_loc_dbg("Removed cached info of %s", identity);
+    }
+    mutex_unlock(&scsi_info_cache_lock);
+}
+
+void scsi_free_cached_info(void)
+{
+    struct scsi_info_entry *entry;
+    struct hlist_node *tmp;
+    unsigned int bkt;
+
+    mutex_lock(&scsi_info_cache_lock);
+    hash_for_each_safe(scsi_info_cache, bkt, tmp, entry, node) {
+        hash_del(&entry->node);
+        rp_kfree(entry, RP_MEM_SCSI);
+    }
+    mutex_unlock(&scsi_info_cache_lock);
+}
+/*********************************************************************************************************************/
+
 bool is_scsi_disk(struct scsi_device *sdp)
 {
     return (likely(sdp) && (sdp)->type == TYPE_DISK);
@@ -146,17 +374,96 @@ bool is_sata_disk(struct device *dev)
     return true;
 }
 
-int scsi_force_replug(scsi_device *sdp)
+#define VIRTIO_HOST_ID "Virtio SCSI HBA"
+#define PVSCSI_HOST_ID "VMware PVSCSI"
+#define STORVSC_HOST_ID "storvsc_host"
+static const struct {
+    const char *vendor; //prefix of the 8-char vendor field
+    const char *model; //prefix of the 16-char model field; NULL matches any model
+} virtual_disk_ids[] = {
+    { "VMware", NULL },
+    { "QEMU", NULL },
+    { "VBOX", NULL },
+    { "XENSRC", NULL },
+    { "Msft", "Virtual Disk" },
+    { "ATA", "VBOX HARDDISK" },
+    { "ATA", "QEMU HARDDISK" },
+    { "ATA", "VMware Virtual" },
+};
+
+bool is_virtual_scsi_disk(struct scsi_device *sdp)
 {
-    if (unlikely(!is_scsi_leaf(&sdp->sdev_gendev))) {
-        pr_loc_bug("%s expected SCSI leaf - got something else", __FUNCTION__);
-        return -EINVAL;
+    const char *host_name = sdp->host->hostt->name;
+    if (likely(host_name) && (strcmp(host_name, VIRTIO_HOST_ID) == 0 ||
+                              strncmp(host_name, PVSCSI_HOST_ID, sizeof(PVSCSI_HOST_ID) - 1) == 0 ||
+                              strncmp(host_name, STORVSC_HOST_ID, sizeof(STORVSC_HOST_ID) - 1) == 0))
+        return true;
+
+    //vendor & model point to the INQUIRY data and aren't nullbyte-terminated
+    if (unlikely(!sdp->vendor || !sdp->model))
+        return false;
+
+    for (int i = 0; i < ARRAY_SIZE(virtual_disk_ids); i++) {
+        if (strncmp(sdp->vendor, virtual_disk_ids[i].vendor, strlen(virtual_disk_ids[i].vendor)) != 0)
+            continue;
+
+        if (!virtual_disk_ids[i].model ||
+            strncmp(sdp->model, virtual_disk_ids[i].model, strlen(virtual_disk_ids[i].model)) == 0)
+            return true;
     }
 
-    struct Scsi_Host *host = sdp->host;
-    pr_loc_dbg("Removing device from host%d", host->host_no);
-    scsi_remove_device(sdp); //this will do locking for remove
+    return false;
+}
+
+/**
+ * Finds sysfs attribute of a request queue by name
+ */
+static struct attribute *find_queue_attr(struct kobj_type *ktype, const char *name)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+    if (unlikely(!ktype->default_attrs))
+        return NULL;
+
+    for (struct attribute **attr = ktype->default_attrs; *attr; attr++) {
+        if (strcmp((*attr)->name, name) == 0)
+            return *attr;
+    }
+#else
+    for (const struct attribute_group **grp = ktype->default_groups; grp && *grp; grp++) {
+        for (struct attribute **attr = (*grp)->attrs; attr && *attr; attr++) {
+            if (strcmp((*attr)->name, name) == 0)
+                return *attr;
+        }
+    }
+#endif
+
+    return NULL;
+}
+
+int scsi_set_queue_attr(struct scsi_device *sdp, const char *attr, const char *value)
+{
+    struct request_queue *q = sdp->request_queue;
+    if (unlikely(!q))
+        return -ENODEV;
 
+    //e.g. changing an elevator before the queue is in sysfs would create its "iosched" directory in sysfs root
+    if (unlikely(!q->kobj.state_in_sysfs))
+        return -EAGAIN;
+
+    struct kobj_type *ktype = get_ktype(&q->kobj);
+    struct attribute *queue_attr = find_queue_attr(ktype, attr);
+    if (unlikely(!queue_attr || !ktype->sysfs_ops || !ktype->sysfs_ops->store))
+        return -ENOENT;
+
+    ssize_t out = ktype->sysfs_ops->store(&q->kobj, queue_attr, value, strlen(value));
+    return out < 0 ? (int)out : 0;
+}
+
+/**
+ * Rescans all channels/targets/LUNs of a host, which will probe any devices which aren't there yet
+ */
+static int rescan_scsi_host(struct Scsi_Host *host)
+{
     //See drivers/scsi/scsi_sysfs.c:scsi_scan() for details
     if (unlikely(host->transportt->user_scan)) {
         pr_loc_dbg("Triggering template-based rescan of host%d", host->host_no);
@@ -169,6 +476,110 @@ int scsi_force_replug(scsi_device *sdp)
     }
 }
 
+/**
+ * "Unplugs" SCSI leaf device
+ */
+static int remove_scsi_leaf(struct scsi_device *sdp, unsigned int replug_gen)
+{
+    if (unlikely(!is_scsi_leaf(&sdp->sdev_gendev))) {
+        pr_loc_bug("%s expected SCSI leaf - got something else", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    pr_loc_dbg("Removing device from host%d", sdp->host->host_no);
+    mark_replugging(sdp, replug_gen); //it's the same device so whatever we know about it will still be valid
+    scsi_remove_device(sdp); //this will do locking for remove
+
+    return 0;
+}
+
+int scsi_force_replug(scsi_device *sdp)
+{
+    struct Scsi_Host *host = sdp->host;
+    unsigned int gen = begin_replug();
+    int out = remove_scsi_leaf(sdp, gen);
+    if (likely(out == 0))
+        out = rescan_scsi_host(host);
+
+    end_replug(gen);
+    return out;
+}
+
+struct replug_host {
+    struct list_head list;
+    struct Scsi_Host *host; //referenced with scsi_host_get()
+    int result;
+};
+
+static ASYNC_DOMAIN_EXCLUSIVE(replug_domain);
+
+int scsi_replug_batch_add(struct scsi_replug_batch *batch, struct scsi_device *sdp)
+{
+    struct Scsi_Host *host = sdp->host;
+    struct replug_host *entry;
+    bool host_known = false;
+    list_for_each_entry(entry, &batch->hosts, list) {
+        if (entry->host == host) {
+            host_known = true;
+            break;
+        }
+    }
+
+    if (!host_known) {
+        kmalloc_or_exit_int(entry, sizeof(struct replug_host), RP_MEM_SCSI);
+        if (unlikely(!scsi_host_get(host))) {
+            pr_loc_err("Failed to get host%d - it's going away?", host->host_no);
+            rp_kfree(entry, RP_MEM_SCSI);
+            return -ENODEV;
+        }
+
+        entry->host = host;
+        entry->result = 0;
+        list_add_tail(&entry->list, &batch->hosts);
+    }
+
+    if (!batch->gen)
+        batch->gen = begin_replug();
+
+    return remove_scsi_leaf(sdp, batch->gen);
+}
+
+static void rescan_scsi_host_async(void *data, async_cookie_t cookie)
+{
+    struct replug_host *entry = data;
+    entry->result = rescan_scsi_host(entry->host);
+}
+
+int scsi_replug_batch_run(struct scsi_replug_batch *batch)
+{
+    struct replug_host *entry, *tmp;
+    list_for_each_entry(entry, &batch->hosts, list) {
+        pr_loc_dbg("Scheduling rescan of host%d", entry->host->host_no);
+        async_schedule_domain(rescan_scsi_host_async, entry, &replug_domain);
+    }
+    async_synchronize_full_domain(&replug_domain);
+
+    int out = 0;
+    list_for_each_entry_safe(entry, tmp, &batch->hosts, list) {
+        if (unlikely(entry->result != 0)) {
+            pr_loc_err("Failed to rescan host%d - error=%d", entry->host->host_no, entry->result);
+            if (out == 0)
+                out = entry->result;
+        }
+
+        list_del(&entry->list);
+        scsi_host_put(entry->host);
+        rp_kfree(entry, RP_MEM_SCSI);
+    }
+
+    if (batch->gen) {
+        end_replug(batch->gen);
+        batch->gen = 0;
+    }
+
+    return out;
+}
+
 //We assume that if the sd was loaded once it will never unload (as on most kernels it's built in).
 //If this assumption changes the cache can simply be removed
 bool sd_driver_loaded = false;
@@ -235,6 +646,160 @@ static int inline for_each_scsi_x(on_scsi_device_cb *cb, int (*filter)(struct de
     return unlikely(code == -ENXIO) ? -EIO : code;
 }
 
+/************************************************** Disks registry ***************************************************/
+struct registered_disk {
+    struct list_head list;
+    struct scsi_device *sdp; //not referenced; it's removed from here on BUS_NOTIFY_DEL_DEVICE, before it's released
+};
+
+static LIST_HEAD(disk_registry);
+static DEFINE_MUTEX(disk_registry_lock);
+static bool disk_registry_running = false;
+static unsigned int disk_registry_num = 0;
+
+/**
+ * Adds a disk to the registry; disk_registry_lock must be held
+ */
+static void disk_registry_add_locked(struct scsi_device *sdp)
+{
+    struct registered_disk *entry;
+    list_for_each_entry(entry, &disk_registry, list) {
+        if (entry->sdp == sdp)
+            return; //re-probe of a disk which is already known
+    }
+
+    entry = kmalloc(sizeof(struct registered_disk), GFP_KERNEL);
+    if (unlikely(!entry)) {
+        //The registry cannot be trusted anymore - fallback to bus walking
+        pr_loc_err("Failed to add SCSI disk to the registry - falling back to SCSI bus scans");
+        disk_registry_running = false;
+        return;
+    }
+    rp_mem_alloced(RP_MEM_SCSI, entry);
+
+    entry->sdp = sdp;
+    list_add_tail(&entry->list, &disk_registry);
+    disk_registry_num++;
+}
+
+static void disk_registry_free_locked(void)
+{
+    struct registered_disk *entry, *tmp;
+    list_for_each_entry_safe(entry, tmp, &disk_registry, list) {
+        list_del(&entry->list);
+        rp_kfree(entry, RP_MEM_SCSI);
+    }
+    disk_registry_num = 0;
+}
+
+static int disk_registry_seed(struct device *dev, void *data)
+{
+    if (is_scsi_leaf(dev) && is_scsi_disk(to_scsi_device(dev)))
+        disk_registry_add_locked(to_scsi_device(dev));
+
+    return 0;
+}
+
+int scsi_disk_registry_start(void)
+{
+    mutex_lock(&disk_registry_lock);
+    if (unlikely(disk_registry_running)) {
+        mutex_unlock(&disk_registry_lock);
+        pr_loc_bug("SCSI disks registry is already running");
+        return -EEXIST;
+    }
+
+    disk_registry_running = true;
+    bus_for_each_dev(&scsi_bus_type, NULL, NULL, disk_registry_seed); //an empty bus if sd is not loaded yet
+    mutex_unlock(&disk_registry_lock);
+
+    pr_loc_dbg("SCSI disks registry started with %u disks", disk_registry_num);
+    return 0;
+}
+
+void scsi_disk_registry_add(struct scsi_device *sdp)
+{
+    mutex_lock(&disk_registry_lock);
+    if (likely(disk_registry_running))
+        disk_registry_add_locked(sdp);
+    mutex_unlock(&disk_registry_lock);
+}
+
+void scsi_disk_registry_remove(struct scsi_device *sdp)
+{
+    struct registered_disk *entry;
+
+    mutex_lock(&disk_registry_lock);
+    list_for_each_entry(entry, &disk_registry, list) {
+        if (entry->sdp == sdp) {
+            list_del(&entry->list);
+            rp_kfree(entry, RP_MEM_SCSI);
+            disk_registry_num--;
+            break;
+        }
+    }
+    mutex_unlock(&disk_registry_lock);
+}
+
+void scsi_disk_registry_stop(void)
+{
+    mutex_lock(&disk_registry_lock);
+    disk_registry_running = false;
+    disk_registry_free_locked();
+    mutex_unlock(&disk_registry_lock);
+}
+
+/**
+ * Takes a snapshot of all registered disks, with every disk referenced using scsi_device_get()
+ *
+ * The snapshot is needed as callbacks can remove devices (which modifies the registry).
+ *
+ * @param disks_out Array of disks which should be released with put_registered_disks()
+ * @return number of disks in the array, -ENODEV if the registry is not running, or other -E on error
+ */
+static int get_registered_disks(struct scsi_device ***disks_out)
+{
+    mutex_lock(&disk_registry_lock);
+    if (!disk_registry_running) {
+        mutex_unlock(&disk_registry_lock);
+        return -ENODEV;
+    }
+
+    struct scsi_device **disks = NULL;
+    if (disk_registry_num > 0) {
+        disks = kmalloc_array(disk_registry_num, sizeof(struct scsi_device *), GFP_KERNEL);
+        if (unlikely(!disks)) {
+            mutex_unlock(&disk_registry_lock);
+            kalloc_error_int(disks, disk_registry_num * sizeof(struct scsi_device *));
+        }
+    }
+
+    int num = 0;
+    struct registered_disk *entry;
+    list_for_each_entry(entry, &disk_registry, list) {
+        if (scsi_device_get(entry->sdp) != 0) {
+            pr_loc_dbg("SCSI disk vendor=\"%s\" model=\"%s\" is going away - skipping", entry->sdp->vendor,
+                       entry->sdp->model);
+            continue;
+        }
+
+        disks[num++] = entry->sdp;
+    }
+    mutex_unlock(&disk_registry_lock);
+
+    *disks_out = disks;
+    return num;
+}
+
+static void put_registered_disks(struct scsi_device **disks, int num)
+{
+    for (int i = 0; i < num; i++)
+        scsi_device_put(disks[i]);
+
+    kfree(disks);
+}
+/*********************************************************************************************************************/
+
 int for_each_scsi_leaf(on_scsi_device_cb *cb)
 {
     return for_each_scsi_x(cb, for_each_scsi_leaf_filter);
@@ -242,5 +807,129 @@ int for_each_scsi_leaf(on_scsi_device_cb *cb)
 
 int for_each_scsi_disk(on_scsi_device_cb *cb)
 {
-    return for_each_scsi_x(cb, for_each_scsi_disk_filter);
+    struct scsi_device **disks;
+    int num = get_registered_disks(&disks);
+    if (num == -ENODEV) //registry is not running
+        return for_each_scsi_x(cb, for_each_scsi_disk_filter);
+    else if (unlikely(num < 0))
+        return num;
+
+    if (!is_scsi_driver_loaded()) {
+        put_registered_disks(disks, num);
+        return -ENXIO;
+    }
+
+    int out = 0;
+    for (int i = 0; i < num && out == 0; i++)
+        out = cb(disks[i]);
+
+    put_registered_disks(disks, num);
+    return unlikely(out == -ENXIO) ? -EIO : out;
+}
+
+static ASYNC_DOMAIN_EXCLUSIVE(capacity_read_domain); //so that we wait only for our own reads
+
+struct capacity_read_req {
+    struct list_head list;
+    struct scsi_device *sdp;
+    long long capacity_mib;
+};
+
+struct capacity_read_batch {
+    struct list_head reqs;
+    bool (*filter)(struct device *dev);
+};
+
+static void capacity_read_async(void *data, async_cookie_t cookie)
+{
+    struct capacity_read_req *req = data;
+    req->capacity_mib = scsi_cached_read_capacity(req->sdp);
+}
+
+/**
+ * Schedules capacity read for an already referenced disk
+ */
+static int queue_referenced_capacity_read(struct capacity_read_batch *batch, struct scsi_device *sdp)
+{
+    struct capacity_read_req *req = kmalloc(sizeof(struct capacity_read_req), GFP_KERNEL);
+    if (unlikely(!req)) {
+        scsi_device_put(sdp);
+        kalloc_error_int(req, sizeof(struct capacity_read_req));
+    }
+
+    req->sdp = sdp;
+    list_add_tail(&req->list, &batch->reqs);
+    async_schedule_domain(capacity_read_async, req, &capacity_read_domain);
+
+    return 0;
+}
+
+/**
+ * Schedules capacity read for every SCSI disk matching the batch filter
+ */
+static int queue_capacity_read(struct device *dev, void *data)
+{
+    struct capacity_read_batch *batch = data;
+    if (!is_scsi_leaf(dev) || !is_scsi_disk(to_scsi_device(dev)) || (batch->filter && !batch->filter(dev)))
+        return 0;
+
+    struct scsi_device *sdp = to_scsi_device(dev);
+    if (scsi_device_get(sdp) != 0) {
+        pr_loc_dbg("SCSI disk vendor=\"%s\" model=\"%s\" is going away - skipping", sdp->vendor, sdp->model);
+        return 0;
+    }
+
+    return queue_referenced_capacity_read(batch, sdp);
+}
+
+/**
+ * Schedules capacity read for every registered disk matching the batch filter
+ *
+ * @return 0 on success, -ENODEV if the registry is not running, or other -E on error
+ */
+static int queue_registered_capacity_reads(struct capacity_read_batch *batch)
+{
+    struct scsi_device **disks;
+    int num = get_registered_disks(&disks);
+    if (num < 0)
+        return num;
+
+    int out = 0;
+    for (int i = 0; i < num; i++) {
+        if (out != 0 || (batch->filter && !batch->filter(&disks[i]->sdev_gendev))) {
+            scsi_device_put(disks[i]);
+            continue;
+        }
+
+        out = queue_referenced_capacity_read(batch, disks[i]); //the reference is passed to the request
+    }
+
+    kfree(disks);
+    return out;
+}
+
+int for_each_scsi_disk_capacity(bool (*filter)(struct device *dev), on_scsi_device_capacity_cb *cb)
+{
+    if (!is_scsi_driver_loaded())
+        return -ENXIO;
+
+    struct capacity_read_batch batch = { .filter = filter };
+    INIT_LIST_HEAD(&batch.reqs);
+
+    int out = queue_registered_capacity_reads(&batch);
+    if (out == -ENODEV) //registry is not running
+        out = bus_for_each_dev(&scsi_bus_type, NULL, &batch, queue_capacity_read);
+    async_synchronize_full_domain(&capacity_read_domain); //even on error - queued requests are still running
+
+    struct capacity_read_req *req, *tmp;
+    list_for_each_entry_safe(req, tmp, &batch.reqs, list) {
+        if (out == 0)
+            out = cb(req->sdp, req->capacity_mib);
+
+        list_del(&req->list);
+        scsi_device_put(req->sdp);
+        kfree(req);
+    }
+
+    return unlikely(out == -ENXIO) ? -EIO : out;
 }
\ No newline at end of file
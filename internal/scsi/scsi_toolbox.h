@@ -2,15 +2,20 @@
 #define REDPILL_SCSI_TOOLBOX_H
 
 #include <linux/types.h> //bool
+#include <linux/list.h> //struct list_head
 
 typedef struct device device;
 typedef struct scsi_device scsi_device;
 typedef int (on_scsi_device_cb)(struct scsi_device *sdp);
+typedef int (on_scsi_device_capacity_cb)(struct scsi_device *sdp, long long capacity_mib);
 
 #define SCSI_DRV_NAME "sd" //useful for triggering watchers
 //To use this one import intercept_driver_register.h header (it's not imported here to avoid pollution)
 #define watch_scsi_driver_register(callback, event_mask) \
     watch_driver_register(SCSI_DRV_NAME, (callback), (event_mask))
+//Same as above; scsi_bus_type must be declared by the user (it's not exported in any header)
+#define on_scsi_driver_ready(event, callback, data) \
+    on_driver_ready(SCSI_DRV_NAME, &scsi_bus_type, (event), (callback), (data))
 
 #define IS_SCSI_DRIVER_ERROR(state) (unlikely((state) < 0))
 typedef enum {
@@ -42,6 +47,50 @@ typedef enum {
  */
 long long opportunistic_read_capacity(struct scsi_device *sdp);
 
+#define SCSI_SERIAL_MAX_LEN 40
+
+/**
+ * Information about a SCSI device which is cached per device identity (see scsi_get_cached_info())
+ */
+struct scsi_cached_info {
+    long long capacity_mib;
+    char vendor[9]; //as reported by INQUIRY when the device was seen for the first time (shims may change sdp->vendor)
+    char model[17];
+    char serial[SCSI_SERIAL_MAX_LEN]; //unit serial number (VPD page 0x80) or empty if the kernel didn't have it
+};
+
+/**
+ * Gets information about a device: capacity is read with opportunistic_read_capacity(), the rest comes from the SCSI
+ * layer; the result is cached per device identity
+ *
+ * The identity is the vendor + model + unit serial number (VPD page 0x80, if the kernel already cached it) or the
+ * vendor + model + the H:C:T:L address otherwise. Thanks to that re-probes of the same disk (e.g. after
+ * scsi_force_replug()) as well as repeated scans don't issue any commands to the device. Entries are removed with
+ * scsi_forget_cached_info() when the device goes away. Only successful reads are cached.
+ *
+ * @return 0 on success, or -E on error
+ */
+int scsi_get_cached_info(struct scsi_device *sdp, struct scsi_cached_info *info);
+
+/**
+ * Same as scsi_get_cached_info() but only returns the capacity
+ *
+ * @return capacity in full mebibytes, or -E on error
+ */
+long long scsi_cached_read_capacity(struct scsi_device *sdp);
+
+/**
+ * Removes cached information about a device which is being removed
+ *
+ * Removals caused by scsi_force_replug() are ignored as the same device will come back right away.
+ */
+void scsi_forget_cached_info(struct scsi_device *sdp);
+
+/**
+ * Removes all cached information (see scsi_cached_read_capacity())
+ */
+void scsi_free_cached_info(void);
+
 /**
  * Checks if a SCSI device is a SCSI-complain disk (e.g. SATA, SAS, iSCSI etc)
  *
@@ -56,6 +105,28 @@ bool is_scsi_disk(struct scsi_device *sdp);
  */
 bool is_sata_disk(struct device *dev);
 
+/**
+ * Checks if a SCSI disk is backed by a hypervisor (e.g. VirtIO, VMware, Hyper-V, VirtualBox, QEMU emulated disks)
+ *
+ * The detection is based on the HBA driver name and the vendor/model strings reported by the device.
+ */
+bool is_virtual_scsi_disk(struct scsi_device *sdp);
+
+/**
+ * Sets a request queue attribute of a SCSI device, exactly like writing to /sys/block/sdX/queue/<attr> does
+ *
+ * The attribute is written using the queue's own sysfs handlers so that all side effects (e.g. changing the elevator
+ * or recalculating congestion thresholds after changing nr_requests) are applied as usual. The queue must already be
+ * registered in sysfs (i.e. the disk must be fully probed). This function may sleep.
+ *
+ * @param attr name of the attribute (e.g. "scheduler", "nr_requests", "read_ahead_kb")
+ * @param value value to set, as would be written to the sysfs file
+ *
+ * @return 0 on success, -ENOENT if the attribute doesn't exist, -EAGAIN if the queue is not registered yet, -E on
+ *         other errors
+ */
+int scsi_set_queue_attr(struct scsi_device *sdp, const char *attr, const char *value);
+
 /**
  * Triggers a re-probe of SCSI leaf device by forcefully "unplugging" and "replugging" the device
  *
@@ -66,6 +137,38 @@ bool is_sata_disk(struct device *dev);
  */
 int scsi_force_replug(scsi_device *sdp);
 
+/**
+ * Batch of devices to be replugged at once (see scsi_replug_batch_add())
+ */
+struct scsi_replug_batch {
+    struct list_head hosts;
+    unsigned int gen; //marks cached info of devices replugged by this batch (0 if none yet)
+};
+
+static inline void scsi_replug_batch_init(struct scsi_replug_batch *batch)
+{
+    INIT_LIST_HEAD(&batch->hosts);
+    batch->gen = 0;
+}
+
+/**
+ * Same as scsi_force_replug() but the device is only "unplugged" now; the "replug" happens in scsi_replug_batch_run()
+ *
+ * Every replug rescans the whole host and waits for the probe to finish. With many disks doing that one by one takes
+ * N probe times. The batch removes all devices first and then rescans every affected host just once, with all hosts
+ * being rescanned in parallel.
+ *
+ * @return 0 on success, -E on error
+ */
+int scsi_replug_batch_add(struct scsi_replug_batch *batch, struct scsi_device *sdp);
+
+/**
+ * Rescans all hosts of devices added to the batch & waits for them; the batch is empty (but reusable) afterwards
+ *
+ * @return 0 on success, -E on error (of the first host which failed; all hosts are rescanned regardless)
+ */
+int scsi_replug_batch_run(struct scsi_replug_batch *batch);
+
 /**
  * Locates & returns SCSI driver structure if loaded
  *
@@ -83,6 +186,20 @@ struct device_driver *find_scsi_driver(void);
  */
 int is_scsi_driver_loaded(void);
 
+/**
+ * Starts maintaining a registry of SCSI disks so that for_each_scsi_disk*() don't need to walk the whole SCSI bus
+ *
+ * Disks already present are added right away; new ones must be reported with scsi_disk_registry_add() and removed
+ * ones with scsi_disk_registry_remove(). This is normally done by the SCSI notifier (which sees every sd_probe() and
+ * a bus removal notification), so users of scsi_toolbox should not call these functions.
+ *
+ * @return 0 on success, -E on error
+ */
+int scsi_disk_registry_start(void);
+void scsi_disk_registry_add(struct scsi_device *sdp);
+void scsi_disk_registry_remove(struct scsi_device *sdp);
+void scsi_disk_registry_stop(void);
+
 /**
  * Traverses list of all SCSI devices and calls the callback with every leaf/terminal device found
  *
@@ -93,8 +210,29 @@ int for_each_scsi_leaf(on_scsi_device_cb *cb);
 /**
  * Traverses list of all SCSI devices and calls the callback with every SCSCI-complaint disk found
  *
+ * When the registry is running (see scsi_disk_registry_start()) only known disks are visited, without locking the
+ * bus. Disks are held with scsi_device_get() while the callback runs so it can safely e.g. scsi_force_replug() them.
+ *
  * @return 0 on success, -E on failure. -ENXIO is reserved to always mean that the driver is not loaded
  */
 int for_each_scsi_disk(on_scsi_device_cb *cb);
 
+/**
+ * Reads capacity of all SCSI disks in parallel and then calls the callback with every disk & its capacity
+ *
+ * Capacity reads (see opportunistic_read_capacity()) are the slowest part of checking existing disks, especially with
+ * spinning disks which need to spin up. Here they're all issued at once (using async_schedule()), so this takes about
+ * as long as the slowest disk rather than the sum of all of them. Callbacks are called sequentially, from the caller's
+ * context, only after all reads finished. Disks are held with scsi_device_get() during the whole time so the callback
+ * can safely e.g. scsi_force_replug() them.
+ *
+ * @param filter Optional (can be NULL) filter to select disks which are worth reading (e.g. is_sata_disk())
+ * @param cb Callback called with every disk & its capacity in full mebibytes (or -E if it couldn't be read); like with
+ *           for_each_scsi_disk() returning anything but 0 stops further calls
+ *
+ * @return 0 on success, -E on failure, or the non-zero value returned by the callback. -ENXIO is reserved to always
+ *         mean that the driver is not loaded
+ */
+int for_each_scsi_disk_capacity(bool (*filter)(struct device *dev), on_scsi_device_capacity_cb *cb);
+
 #endif //REDPILL_SCSI_TOOLBOX_H
@@ -16,6 +16,15 @@
 #define STEALTH_MODE STEALTH_MODE_BASIC
 #endif
 
+//debugfs is visible to anybody who cares to look, so all diagnostic entries (metrics, vUART capture, boot device timing
+// and DBG_* make option tools) exist only below this level - the same as logs
+#define RP_DEBUGFS_ENABLED (STEALTH_MODE < STEALTH_MODE_FULL)
+
+#if !RP_DEBUGFS_ENABLED && (defined(RPDBG_EXECVE) || defined(RPDBG_OVS_STATS) || defined(RPDBG_DRIVER_PROFILE) || \
+                            defined(RPDBG_PMU_TRACE))
+#error "DBG_* tools exposed in debugfs cannot be used with STEALTH_MODE_FULL"
+#endif
+
 //Some compile-time stealthiness
 #if STEALTH_MODE > STEALTH_MODE_OFF //STEALTH_MODE_BASIC or above
 #define VIRTUAL_UART_THREAD_FMT "irq/%d-serial" //pattern format for vUART kernel thread which spoofs IRQ one
@@ -20,9 +20,10 @@
  * This change has been made in commit "Rewrite cmdline sanitize to replace cmdline_proc_show".
  *
  * FILTRATION
- * The second part of the code deals with the actual filtration. List of blacklisted entries is passed during
- * registration (to allow flexibility). Usually it will be gathered form pre-generated config. Then a filtrated copy of
- * cmdline is created once (as this is a quite expensive string-ridden operation).
+ * The second part of the code deals with the actual filtration. Blacklisted options are marked in the cmdline options
+ * table (config/cmdline_delegate.c) and the decision for every token is made during the same pass which extracts the
+ * config. That pass records positions of the tokens left visible, which are then written directly from the cached
+ * cmdline on every read (so neither a second parse nor a filtrated copy of cmdline is needed).
  * The only sort-of way to find the original implementation is to access the kmesg buffer where the original cmdline is
  * baked into early on boot. Technically we can replace that too but this will get veeery messy and I doubt anyone will
  * try dig through kmesg messages with a regex for cmdline (especially that with a small dmesg buffer it will roll over)
@@ -30,91 +31,33 @@
 
 #include "sanitize_cmdline.h"
 #include "../../common.h"
-#include "../../config/cmdline_delegate.h" //get_kernel_cmdline() & CMDLINE_MAX
+#include "../../config/cmdline_delegate.h" //get_visible_cmdline_spans()
 #include "../override/override_symbol.h" //override_symbol() & restore_symbol()
-#include <linux/seq_file.h> //seq_file, seq_printf()
-
-/**
- * Pre-generated filtered cmdline (by default it's an empty string in case it's somehow printed before filtration)
- * See filtrate_cmdline() for details
- */
-static char *filtrated_cmdline = NULL;
-
-/**
- * Check if a given cmdline token is on the blacklist
- */
-static bool
-is_token_blacklisted(const char *param_pointer, cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS]) {
-    for (int i = 0; i < MAX_BLACKLISTED_CMDLINE_TOKENS; i++) {
-        if (!cmdline_blacklist[i])
-            return false;
-
-        if (strncmp(param_pointer, (char *)cmdline_blacklist[i], strlen((char *)cmdline_blacklist[i])) == 0)
-            return true;
-    }
-
-    return false;
-}
-
-/**
- * Filters-out all blacklisted entries from the cmdline string (fetched from /proc/cmdline)
- */
-static int filtrate_cmdline(cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS])
-{
-    char *raw_cmdline;
-    kmalloc_or_exit_int(raw_cmdline, strlen_to_size(CMDLINE_MAX));
-
-    long cmdline_len = get_kernel_cmdline(raw_cmdline, CMDLINE_MAX);
-    if(unlikely(cmdline_len < 0)) { //if <0 it's an error code
-        pr_loc_dbg("get_kernel_cmdline failed with %ld", cmdline_len);
-        kfree(raw_cmdline);
-        return (int) cmdline_len;
-    }
-
-    filtrated_cmdline = kmalloc(strlen_to_size(cmdline_len), GFP_KERNEL);
-    if (unlikely(!filtrated_cmdline)) {
-        kfree(raw_cmdline);
-        kalloc_error_int(filtrated_cmdline, strlen_to_size(cmdline_len));
-    }
-
-    char *single_param_chunk; //Pointer to the beginning of the cmdline token
-    char *filtrated_ptr = &filtrated_cmdline[0]; //Pointer to the current position in filtered
-
-    size_t curr_param_len;
-    while ((single_param_chunk = strsep(&raw_cmdline, CMDLINE_SEP)) != NULL) {
-        if (single_param_chunk[0] == '\0') //Skip empty
-            continue;
-
-        if (is_token_blacklisted(single_param_chunk, cmdline_blacklist)) {
-            pr_loc_dbg("Cmdline param \"%s\" blacklisted - skipping", single_param_chunk);
-            continue;
-        }
-
-        curr_param_len = strlen(single_param_chunk);
-        memcpy(filtrated_ptr, single_param_chunk, curr_param_len);
-        filtrated_ptr += curr_param_len;
-        *(filtrated_ptr++) = ' ';
-    }
-
-    *(filtrated_ptr-1) = '\0'; //Terminate whole param string (removing the trailing space)
-    kfree(raw_cmdline);
-
-    pr_loc_dbg("Sanitized cmdline to: %s", filtrated_cmdline);
-
-    return 0;
-}
+#include <linux/seq_file.h> //seq_file, seq_write(), seq_putc()
 
 /**
  * Handles fs/proc/ semantics for reading. See include/linux/fs.h:file_operations.read for details.
+ *
+ * Visible tokens are written straight from the cmdline cache, so there's no filtered copy to build or keep.
  */
 static int cmdline_proc_show_filtered(struct seq_file *m, void *v)
 {
-    seq_printf(m, "%s\n", filtrated_cmdline);
+    const char *cmdline;
+    const struct cmdline_span *spans;
+    unsigned int spans_num = get_visible_cmdline_spans(&cmdline, &spans);
+
+    for (unsigned int i = 0; i < spans_num; i++) {
+        if (i > 0)
+            seq_putc(m, ' ');
+        seq_write(m, cmdline + spans[i].offset, spans[i].len);
+    }
+    seq_putc(m, '\n');
+
     return 0;
 }
 
 static override_symbol_inst *ov_cmdline_proc_show = NULL;
-int register_stealth_sanitize_cmdline(cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS])
+int register_stealth_sanitize_cmdline(void)
 {
     if (unlikely(ov_cmdline_proc_show)) {
         pr_loc_bug("Attempted to %s while already registered", __FUNCTION__);
@@ -122,10 +65,13 @@ int register_stealth_sanitize_cmdline(cmdline_token *cmdline_blacklist[MAX_BLACK
     }
 
     int out;
-    //This has to be done once (we're assuming cmdline doesn't change without reboot). In case this submodule is
-    // re-registered the filtrated_cmdline is left as-is and reused
-    if (!filtrated_cmdline && (out = filtrate_cmdline(cmdline_blacklist)) != 0)
-        return out;
+    //Tokens to show are determined once when the cmdline is parsed (we're assuming cmdline doesn't change w/o reboot)
+    const char *cmdline;
+    const struct cmdline_span *spans;
+    if (unlikely(get_visible_cmdline_spans(&cmdline, &spans) == 0 && cmdline[0] == '\0')) {
+        pr_loc_bug("Attempted to %s before cmdline was processed", __FUNCTION__);
+        return -EINVAL;
+    }
 
     ov_cmdline_proc_show = override_symbol("cmdline_proc_show", cmdline_proc_show_filtered);
     if (unlikely(IS_ERR(ov_cmdline_proc_show))) {
@@ -148,10 +94,7 @@ int unregister_stealth_sanitize_cmdline(void)
     }
 
     int out = restore_symbol(ov_cmdline_proc_show);
-    //We deliberately fall through here without checking as we have to free stuff at this point no matter what
-
-    kfree(filtrated_cmdline);
-    filtrated_cmdline = NULL;
+    ov_cmdline_proc_show = NULL;
 
     if (likely(out == 0))
         pr_loc_inf("Original /proc/cmdline restored");
@@ -1,17 +1,16 @@
 #ifndef REDPILL_SANITIZE_CMDLINE_H
 #define REDPILL_SANITIZE_CMDLINE_H
 
-#include "../../config/cmdline_delegate.h" //MAX_BLACKLISTED_CMDLINE_TOKENS
-
 /**
  * Register submodule sanitizing /proc/cmdline
  *
- * After registration /proc/cmdline will be non-destructively cleared from entries listed in cmdline_blacklist param.
+ * After registration /proc/cmdline will be non-destructively cleared from entries blacklisted in the cmdline options
+ * table (see config/cmdline_delegate.c). The cmdline must be already processed by extract_config_from_cmdline().
  * It can be reversed using unregister_stealth_sanitize_cmdline()
  *
  * @return 0 on success, -E on error
  */
-int register_stealth_sanitize_cmdline(cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS]);
+int register_stealth_sanitize_cmdline(void);
 
 /**
  * Reverses what register_stealth_sanitize_cmdline() did
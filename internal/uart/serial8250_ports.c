@@ -0,0 +1,140 @@
+/**
+ * Registry of 8250 driver ports shared by everything which needs to touch them directly (UART swapper & vUART)
+ *
+ * The 8250 serial driver is very secretive of its ports and doesn't allow anyone to access them. This is for a good
+ * reason - it's very easy to cause a deadlock, KP, or a runaway CPU-hogging process. However, we must access them as
+ * we're intentionally messing up with the structures of them (as SOMEONE had a BRILLIANT idea to break them by swapping
+ * iobases and IRQs defined since the 1970s), and the vUART needs them to deliver its virtual interrupts.
+ *
+ * Discovering ports requires a temporary override of uart_match_port() (see recover_serial8250_ports()), so it's done
+ * exactly once per boot and every consumer uses pointers from here.
+ */
+#include "serial8250_ports.h"
+#include "../../common.h"
+#include "../call_protected.h" //serial8250_find_port()
+#include "../override/override_symbol.h" //overriding uart_match_port()
+#include "../metrics.h" //RP_METRIC(), rp_metric_*()
+#include "../../config/uart_defs.h" //struct uart_port, UART_NR
+#include <linux/serial_8250.h> //struct uart_8250_port
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+
+static struct uart_8250_port *serial8250_ports[UART_NR] = { NULL }; //recovered ptrs to serial8250_ports structure
+static bool serial8250_ports_recovered = false;
+static DEFINE_MUTEX(serial8250_ports_lock); //serializes the recovery; ptrs never change after it
+static override_symbol_inst *ov_uart_match_port = NULL;
+static RP_METRIC(serial8250_recover_ns, RP_MG_LATENCY, RP_METRIC_HISTOGRAM); //uart_match_port() is replaced
+static RP_METRIC(serial8250_recover_max_ns, RP_MG_LATENCY, RP_METRIC_GAUGE);
+static struct rp_metric *const recover_metrics[] = { &serial8250_recover_ns, &serial8250_recover_max_ns };
+
+/**
+ * Fake uart_match_port() which always returns "no match" but collects all passing ports to serial8250_ports
+ *
+ * See recover_serial8250_ports() for usage. This is a very specific thing and shouldn't be used standalone.
+ *
+ * @return 0
+ */
+static int uart_match_port_collector(struct uart_port *port1, struct uart_port *port2)
+{
+    //our fake trigger calls with one port being NULL, that's how we can easily detect which one is the one provided by
+    //the driver ;]
+    struct uart_port *port = port1 ? port1:port2;
+    pr_loc_dbg("Found ptr to line=%d iobase=0x%03lx irq=%d", port->line, port->iobase, port->irq);
+
+    if (likely(port->line < UART_NR))
+        serial8250_ports[port->line] = container_of(port, struct uart_8250_port, port);
+
+    return 0;
+}
+
+/**
+ * Enables collecting of 8250 serial port structures
+ *
+ * @return 0 on success, -E on failure
+ */
+static int __must_check enable_collector_matcher(void)
+{
+    if (unlikely(ov_uart_match_port))
+        return 0; //it's not a problem is we already enabled it
+
+    ov_uart_match_port = override_symbol("uart_match_port", uart_match_port_collector);
+    if (unlikely(IS_ERR(ov_uart_match_port))) {
+        int out = PTR_ERR(ov_uart_match_port);
+        ov_uart_match_port = NULL;
+        return out;
+    }
+
+    return 0;
+}
+
+/**
+ * Disabled collecting of 8250 serial port structures (reverses enable_collector_matcher())
+ *
+ * @return 0 on success or noop, -E on failure
+ */
+static int disable_collector_matcher(void)
+{
+    if (unlikely(!ov_uart_match_port))
+        return 0; //it's not a problem is we already disabled it
+
+    int out = restore_symbol(ov_uart_match_port);
+    ov_uart_match_port = NULL;
+
+    if (unlikely(out != 0))
+        pr_loc_err("Failed to disable collector matcher, error=%d", out);
+
+    return out;
+}
+
+/**
+ * Fish-out 8250 serial driver ports from its internal structures
+ *
+ * Ports will be populated in a serial8250_ports. The caller must hold serial8250_ports_lock.
+ *
+ * @return 0 on success, -E on failure
+ */
+static int recover_serial8250_ports(void)
+{
+    int out = 0;
+
+    //We cannot acquire any locks as we don't have ports information. The most we can do is to keep the window when
+    // uart_match_port() is replaced as short as possible. Neither console writes nor IRQ handlers look up ports (only
+    // port registration & console setup do), so there's no need to stop the console or pause any COM IRQs here.
+    //Preemption cannot be disabled for the window: overriding/restoring a symbol allocates & waits for other CPUs.
+    // Concurrent recoveries are excluded by serial8250_ports_lock.
+    rp_metric_time_begin(recover_start);
+
+    if (unlikely((out = enable_collector_matcher()) != 0)) { //Install a fake matching function
+        pr_loc_err("Failed to enable collector!");
+        goto out;
+    }
+
+    _serial8250_find_port(NULL); //Force the driver to iterate over all its ports... using our fake matching function
+
+    if (unlikely((out = disable_collector_matcher()) != 0)) //Restore normal matcher
+        pr_loc_err("Failed to enable collector!");
+
+    out:
+    rp_metric_time_end_max(&serial8250_recover_ns, &serial8250_recover_max_ns, recover_start);
+
+    return out;
+}
+
+struct uart_8250_port *get_serial8250_port(unsigned int line)
+{
+    if (unlikely(line >= UART_NR)) {
+        pr_loc_bug("Requested UART line %u but kernel supports up to %u", line, UART_NR);
+        return ERR_PTR(-EINVAL);
+    }
+
+    mutex_lock(&serial8250_ports_lock);
+    if (unlikely(!serial8250_ports_recovered)) {
+        rp_metrics_register(recover_metrics, ARRAY_SIZE(recover_metrics)); //it may sleep - not in the section
+        //A failed recovery (e.g. override failure) will be retried on the next call, but a successful one is final
+        // even if some ports weren't found - the 8250 driver never adds them later
+        if (recover_serial8250_ports() == 0)
+            serial8250_ports_recovered = true;
+    }
+    mutex_unlock(&serial8250_ports_lock);
+
+    return (likely(serial8250_ports[line])) ? serial8250_ports[line] : ERR_PTR(-ENODEV);
+}
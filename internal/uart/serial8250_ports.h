@@ -0,0 +1,23 @@
+#ifndef REDPILL_SERIAL8250_PORTS_H
+#define REDPILL_SERIAL8250_PORTS_H
+
+#include <linux/compiler.h> //__must_check
+
+struct uart_8250_port;
+
+/**
+ * Gets an internal 8250 driver port structure for the line/ttyS specified
+ *
+ * Things to know:
+ *  - line = ttyS#, so line=0 = ttyS0 (this is universal across Linux UART subsystem)
+ *  - this function returns things as-is in the 8250 driver, so if ports are already reversed you will get them reversed
+ *  - ports are discovered only once (on the first call after the 8250 driver is ready) and only ptrs are stored. The
+ *    8250 driver builds its internal array (to which elements we get ptrs) only once during boot, so these stay valid
+ *    when ports are swapped, reconfigured or (re)registered with serial8250_register_8250_port().
+ *  - it must be called from a context which can sleep
+ *
+ * @return ptr to a port OR error ptr with -E
+ */
+struct uart_8250_port *__must_check get_serial8250_port(unsigned int line);
+
+#endif //REDPILL_SERIAL8250_PORTS_H
@@ -80,159 +80,25 @@
  */
 
 #include "../../common.h"
-#include "../call_protected.h" //early_serial_setup()
-#include "../override/override_symbol.h" //overriding uart_match_port()
+#include "serial8250_ports.h" //get_serial8250_port()
 #include "../../config/uart_defs.h" //struct uart_port, COM ports definition, UART_NR
 #include <linux/serial_8250.h> //struct uart_8250_port
 #include <linux/console.h> //console_lock(), console_unlock()
 #include <linux/hardirq.h> //synchronize_irq()
 #include <linux/list.h> //LIST_POISON1, LIST_POISON2
 #include <linux/timer.h> //timer_pending()
-#include <linux/interrupt.h> //disable_irq()/enable_irq()
+#include <linux/interrupt.h> //synchronize_irq()
 #include <linux/irq.h> // irq_common_data
 #include <linux/irqdesc.h> //irq_has_action
-
-#define pause_irq_save(irq) ({bool __state = irq_has_action(irq); if (__state) { disable_irq(irq); } __state; })
-#define resume_irq_saved(irq, saved) if (saved) { enable_irq(irq); }
-
-/*********************************************** Extracting 8250 ports ************************************************/
-static struct uart_8250_port *serial8250_ports[UART_NR] = { NULL }; //recovered ptrs to serial8250_ports structure
-static override_symbol_inst *ov_uart_match_port = NULL;
-
-/**
- * Fake uart_match_port() which always returns "no match" but collects all passing ports to serial8250_ports
- *
- * See recover_serial8250_ports() for usage. This is a very specific thing and shouldn't be used standalone.
- *
- * @return 0
- */
-static int uart_match_port_collector(struct uart_port *port1, struct uart_port *port2)
-{
-    //our fake trigger calls with one port being NULL, that's how we can easily detect which one is the one provided by
-    //the driver ;]
-    struct uart_port *port = port1 ? port1:port2;
-    pr_loc_dbg("Found ptr to line=%d iobase=0x%03lx irq=%d", port->line, port->iobase, port->irq);
-
-    serial8250_ports[port->line] = container_of(port, struct uart_8250_port, port);
-
-    return 0;
-}
-
-/**
- * Enables collecting of 8250 serial port structures
- *
- * Warning: before you do that you MUST disable IRQs or you're risking a serious crash or a silent corruption of the
- * kernel!
- *
- * @return 0 on success, -E on failure
- */
-static int __must_check enable_collector_matcher(void)
-{
-    if (unlikely(ov_uart_match_port))
-        return 0; //it's not a problem is we already enabled it as it's enabled all the time
-
-    ov_uart_match_port = override_symbol("uart_match_port", uart_match_port_collector);
-    if (unlikely(IS_ERR(ov_uart_match_port))) {
-        int out = PTR_ERR(ov_uart_match_port);
-        ov_uart_match_port = NULL;
-        return out;
-    }
-
-    return 0;
-}
-
-/**
- * Disabled collecting of 8250 serial port structures (reverses enable_collector_matcher())
- *
- * @return 0 on success or noop, -E on failure
- */
-static int disable_collector_matcher(void)
-{
-    if (unlikely(!ov_uart_match_port))
-        return 0; //it's not a problem is we already disabled it
-
-    int out = restore_symbol(ov_uart_match_port);
-    ov_uart_match_port = NULL;
-
-    if (unlikely(out != 0))
-        pr_loc_err("Failed to disable collector matcher, error=%d", out);
-
-    return out;
-}
-
-/**
- * Fish-out 8250 serial driver ports from its internal structures
- *
- * The 8250 serial driver is very secretive of its ports and doesn't allow anyone to access them. This is for a good
- * reason - it's very easy to cause a deadlock, KP, or a runaway CPU-hogging process. However, we must access them as
- * we're intentionally messing up with the structures of them (as SOMEONE had a BRILLIANT idea to break them by swapping
- * iobases and IRQs defined since the 1970s).
- *
- * Ports will be populated in a serial8250_ports.
- */
-static int recover_serial8250_ports(void)
-{
-    int out = 0;
-    //Stops and buffers printks while pulling console semaphore down (in case console is active on any of the ports)
-    console_lock();
-    preempt_disable();
-
-    //We cannot acquire any locks as we don't have ports information. The most we can do is ensure nothing tirggers
-    // while we collect them. It's imperfect as some ports are timer based etc. However, the chance is abysmal that
-    // with preempt disabled and IRQs disabled something magically triggers ports lookup (which is rare by itself).
-    //While there may be more than 4 ports their IRQs aren't well defined by the platform nor kernel.
-    //Some of these may be shared but we don't make assumptions here (as it will be a noop if we call it twice)
-    bool com1_irq_state = pause_irq_save(STD_COM1_IRQ);
-    bool com2_irq_state = pause_irq_save(STD_COM2_IRQ);
-    bool com3_irq_state = pause_irq_save(STD_COM3_IRQ);
-    bool com4_irq_state = pause_irq_save(STD_COM4_IRQ);
-
-    if (unlikely((out = enable_collector_matcher()) != 0)) { //Install a fake matching function
-        pr_loc_err("Failed to enable collector!");
-        goto out;
-    }
-
-    _serial8250_find_port(NULL); //Force the driver to iterate over all its ports... using our fake matching function
-
-    if (unlikely((out = disable_collector_matcher()) != 0)) //Restore normal matcher
-        pr_loc_err("Failed to enable collector!");
-
-    //Other processes will use spinlocks with IRQ-save as we now know the ports
-    out:
-    resume_irq_saved(STD_COM1_IRQ, com1_irq_state);
-    resume_irq_saved(STD_COM2_IRQ, com2_irq_state);
-    resume_irq_saved(STD_COM3_IRQ, com3_irq_state);
-    resume_irq_saved(STD_COM4_IRQ, com4_irq_state);
-    preempt_enable();
-    console_unlock();
-
-    return out;
-}
-
-/**
- * Gets an internal 8250 driver port structure for the line/ttyS specified
- *
- * Things to know:
- *  - line = ttyS#, so line=0 = ttyS0 (this is universal across Linux UART subsystem)
- *  - this function returns things as-is in the 8250 driver, so if ports are already reversed you will get them reversed
- *  - this function only runs scanning once but only ptrs are stored, so if you flip ports the re-scan is not needed as
- *    8250 builds its internal array (to which elements we get ptrs) only once during boot
- *
- * @return ptr to a port OR error ptr with -E
- */
-static __must_check struct uart_8250_port *get_8250_port(unsigned int line)
-{
-    if (unlikely(line >= UART_NR)) {
-        pr_loc_bug("Requested UART line %u but kernel supports up to %u", line, UART_NR);
-        return ERR_PTR(-EINVAL);
-    }
-
-    if (!serial8250_ports[0]) //Port not recovered or port 0 doesn't exist (HIGHLY unlikely)
-        recover_serial8250_ports(); //there's no point in checking the return code here - it will fail below
-
-    return (likely(serial8250_ports[line])) ? serial8250_ports[line] : ERR_PTR(-ENODEV);
-}
-
+#include <linux/serial_reg.h> //UART_IER
+#include <linux/lockdep.h> //SINGLE_DEPTH_NESTING
+#include <linux/tty.h> //tty_port_tty_get(), tty_kref_put()
+
+//Since v4.2 8250 ports have up->ops->setup_irq()/release_irq() which (un)link the port from its IRQ chain without
+// touching the chip. Older kernels only do that as a part of full ops->startup()/shutdown().
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+#define UART_HAS_IRQ_RELINK
+#endif
 
 /****************************************** Shutting down & restarting ports ******************************************/
 #define is_irq_port(uart_port_ptr) ((uart_port_ptr)->irq != 0)
@@ -385,26 +251,153 @@ static inline void restart_port(struct uart_8250_port *up)
 }
 
 
+#ifdef UART_HAS_IRQ_RELINK
+/**
+ * Detaches an active port from its IRQ (or stops its poll timer) without shutting down the chip
+ *
+ * Unlike try_shutdown_port() this doesn't reset the UART - its FIFOs, line settings & modem lines are preserved and
+ * the chip keeps receiving (up to its FIFO size) while detached. You should NOT call this function with a lock active!
+ *
+ * @return 0 if the operation resulted in noop, 1 if the port was detached
+ */
+static inline int try_detach_port_irq(struct uart_8250_port *up)
+{
+    struct uart_port *port = &up->port;
+    if (!is_port_active(up)) {
+        pr_loc_dbg("Port iobase=0x%03lx ttyS%d not active - not detaching", port->iobase, port->line);
+        return 0;
+    }
+
+    up->ops->release_irq(up); //may free the IRQ (if we were the last port on the chain) and thus sleep
+    if (is_irq_port(port))
+        synchronize_irq(port->irq);
+
+    pr_loc_dbg("Port iobase=0x%03lx ttyS%d detached from IRQ=%d", port->iobase, port->line, port->irq);
+    return 1;
+}
+
+/**
+ * Re-attaches port detached by try_detach_port_irq() to its (current) IRQ or poll timer
+ *
+ * @return 0 on success, -E on error
+ */
+static inline int reattach_port_irq(struct uart_8250_port *up)
+{
+    struct uart_port *port = &up->port;
+    int out = up->ops->setup_irq(up); //may request the IRQ (if we're the first port on the chain) and thus sleep
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to attach port iobase=0x%03lx ttyS%d to IRQ=%d - error=%d", port->iobase, port->line,
+                   port->irq, out);
+        return out;
+    }
+
+    //ISA IRQs are edge-triggered - if the chip raised one while detached it will never be raised again until serviced
+    port->handle_irq(port);
+    pr_loc_dbg("Port iobase=0x%03lx ttyS%d attached to IRQ=%d", port->iobase, port->line, port->irq);
+
+    return 0;
+}
+
+/**
+ * Reprograms the whole line state (LCR, divisor latch, FCR, MCR & IER) of a port onto the chip it's currently mapped to
+ *
+ * When ports are remapped (see swap_uart_lanes()) each port inherits a chip which was programmed with settings of the
+ * other port. The 8250 ->set_termios() writes all of these registers from the port's cached state, so it's called
+ * with the termios currently set on the port's tty. If there's no tty (which shouldn't happen for an active port) only
+ * the cached IER is written, as e.g. start_tx() only touches the register when the cached value differs.
+ *
+ * You should NOT call this function with a port lock held (->set_termios() takes it).
+ */
+static void reprogram_port_line(struct uart_8250_port *up)
+{
+    struct uart_port *port = &up->port;
+    struct tty_struct *tty = tty_port_tty_get(&port->state->port);
+    if (unlikely(!tty)) {
+        pr_loc_wrn("Port iobase=0x%03lx ttyS%d has no tty - only IER will be restored", port->iobase, port->line);
+        unsigned long flags;
+        spin_lock_irqsave(&port->lock, flags);
+        serial_port_out(port, UART_IER, up->ier);
+        spin_unlock_irqrestore(&port->lock, flags);
+        return;
+    }
+
+    struct ktermios termios;
+    down_read(&tty->termios_rwsem);
+    termios = tty->termios;
+    up_read(&tty->termios_rwsem);
+
+    port->ops->set_termios(port, &termios, NULL);
+    tty_kref_put(tty);
+    pr_loc_dbg("Port iobase=0x%03lx ttyS%d line settings reprogrammed", port->iobase, port->line);
+}
+#endif //UART_HAS_IRQ_RELINK
+
+
 /*************************************************** Swapping logic ***************************************************/
 /**
  * Swaps two UART data lines with proper locking
  *
- * This function assumes ports are already stopped.
+ * This function assumes ports are already stopped or detached from their IRQs. When both ports keep their chips
+ * running (remap) each chip is still programmed with the line settings of the other port, so the full line state of
+ * each port is written to its new chip before the console is released.
+ *
+ * It holds the console only for the swap itself (which is just a few fields + reprogramming), so no messages are
+ * dropped or sent with the wrong line settings.
  */
-static inline void swap_uart_lanes(struct uart_8250_port *a, struct uart_8250_port *b)
+static inline void swap_uart_lanes(struct uart_8250_port *a, struct uart_8250_port *b, bool remap)
 {
-    unsigned long flags_a, flags_b;
-    spin_lock_irqsave(&a->port.lock, flags_a);
-    spin_lock_irqsave(&b->port.lock, flags_b);
+    unsigned long flags;
+    console_lock(); //we don't want a message to be half-written to one port and half to another
+    spin_lock_irqsave(&a->port.lock, flags);
+    spin_lock_nested(&b->port.lock, SINGLE_DEPTH_NESTING);
 
     swap(a->port.iobase, b->port.iobase);
     swap(a->port.irq, b->port.irq);
     swap(a->port.uartclk, b->port.uartclk); //Just to be complete we should move flags & clock
     swap(a->port.flags, b->port.flags);     // (they're probably the same anyway)
-    swap(a->timer, b->timer); //if one port was timer based and another wasn't this ensures they aren't broken
+    if (!remap)
+        swap(a->timer, b->timer); //if one port was timer based and another wasn't this ensures they aren't broken
+
+    spin_unlock(&b->port.lock);
+    spin_unlock_irqrestore(&a->port.lock, flags);
+
+#ifdef UART_HAS_IRQ_RELINK
+    if (remap) {
+        reprogram_port_line(a);
+        reprogram_port_line(b);
+    }
+#endif
+    console_unlock();
+}
+
+/**
+ * Swaps ports by shutting them down & restarting them
+ *
+ * This is the slow path resetting both chips, used when ports cannot be remapped (see uart_swap_hw_output()).
+ */
+static void swap_uart_restart(struct uart_8250_port *a, struct uart_8250_port *b)
+{
+    //This is an edge case when swapping two ports where one is active and another one is not. Since the active status
+    // is a property of the software (i.e. port opened/used by something) and shutting down/starting alters the state
+    // of the hardware we may have a problem with restarting the previously inactive port. If WE did shut it down there
+    // is no issue as we know the hardware is initialized. But if it wasn't and we try to just start it up without
+    // reinit we can either crash the driver or leave the port in inactive state.
+    pr_loc_dbg("Disabling ports");
+    int a_was_running = try_shutdown_port(a);
+    int b_was_running = try_shutdown_port(b);
+    if (unlikely(a_was_running != b_was_running))
+        pr_loc_wrn("Swapping hw data paths of ttyS%d (was %sactive) and ttyS%d (was %sactive). We will attempt to "
+                   "reactivate inactive one but this may fail.", a->port.line, a_was_running ? "" : "in",
+                   b->port.line, b_was_running ? "" : "in");
 
-    spin_unlock_irqrestore(&a->port.lock, flags_b); //flags_a were a property of B
-    spin_unlock_irqrestore(&b->port.lock, flags_a);
+    swap_uart_lanes(a, b, false);
+    //This code IS CORRECT - make sure to read comment next to a_was_running/b_was_running vars initialization
+    //We swapped the data paths but we need to restore the state as the userland expects it.
+    pr_loc_dbg("Restarting ports");
+    if (a_was_running)
+        restart_port(a);
+    if (b_was_running)
+        restart_port(b);
 }
 
 int uart_swap_hw_output(unsigned int from, unsigned int to)
@@ -414,57 +407,61 @@ int uart_swap_hw_output(unsigned int from, unsigned int to)
 
     pr_loc_dbg("Swapping ttyS%d<=>ttyS%d started", from, to);
 
-    struct uart_8250_port *port_a = get_8250_port(from);
-    struct uart_8250_port *port_b = get_8250_port(to);
+    struct uart_8250_port *port_a = get_serial8250_port(from);
+    struct uart_8250_port *port_b = get_serial8250_port(to);
 
-    if (unlikely(!port_a)) {
+    if (unlikely(IS_ERR(port_a))) {
         pr_loc_err("Failed to locate ttyS%d port", from);
         return PTR_ERR(port_a);
     }
-    if (unlikely(!port_b)) {
+    if (unlikely(IS_ERR(port_b))) {
         pr_loc_err("Failed to locate ttyS%d port", to);
         return PTR_ERR(port_b);
     }
 
-
-    pr_loc_dbg("Disabling preempt & locking console");
     pr_loc_inf("======= OUTPUT ON THIS PORT WILL STOP AND CONTINUE ON ANOTHER ONE (swapping ttyS%d & ttyS%d) =======",
                from, to); //That will be the last message user sees before swap on the "old" port
 
-    pr_loc_dbg("### LAST MESSAGE BEFORE SWAP ON \"OLD\" PORT ttyS%d<=>ttyS%d", from, to);
-    preempt_disable(); //we cannot be rescheduled here due to timing constraint and possibly IRQ interactions
-    console_lock(); //We don't want stray messages landing somewhere randomly when we swap, + the ports will be down
-    //this will be the first message after port unlocks after swapping
-    pr_loc_dbg("### FIRST MESSAGE AFTER SWAP ON \"NEW\" PORT ttyS%d<=>ttyS%d", from, to);
-
-    //This is an edge case when swapping two ports where one is active and another one is not. Since the active status
-    // is a property of the software (i.e. port opened/used by something) and shutting down/starting alters the state
-    // of the hardware we may have a problem with restarting the previously inactive port. If WE did shut it down there
-    // is no issue as we know the hardware is initialized. But if it wasn't and we try to just start it up without
-    // reinit we can either crash the driver or leave the port in inactive state.
-    pr_loc_dbg("Disabling ports");
-    int port_a_was_running = try_shutdown_port(port_a);
-    int port_b_was_running = try_shutdown_port(port_b);
-    if (unlikely(port_a_was_running != port_b_was_running))
-        pr_loc_wrn("Swapping hw data paths of ttyS%d (was %sactive) and ttyS%d (was %sactive). We will attempt to "
-                   "reactivate inactive one but this may fail.", port_a->port.line, port_a_was_running ? "" : "in",
-                   port_b->port.line, port_b_was_running ? "" : "in");
+    int out = 0;
+    bool a_active = is_port_active(port_a);
+    bool b_active = is_port_active(port_b);
+    if (!a_active && !b_active) {
+        pr_loc_dbg("Both ports inactive - swapping in place");
+        swap_uart_lanes(port_a, port_b, false);
+        goto out_swapped;
+    }
 
-    swap_uart_lanes(port_a, port_b);
-    //This code IS CORRECT - make sure to read comment next to port_a_was_running/port_b_was_running vars initialization
-    //We swapped the data paths but we need to restore the state as the userland expects it.
-    pr_loc_dbg("Restarting ports");
-    if (port_a_was_running)
-        restart_port(port_a);
-    if (port_b_was_running)
-        restart_port(port_b);
+#ifdef UART_HAS_IRQ_RELINK
+    //When both ports are running both chips are initialized, so they can just be remapped: each port is detached from
+    // its IRQ, its lane is swapped under the port lock & it's attached to the new IRQ. Chips are never reset and the
+    // console keeps printing to the old port until the very moment of the swap.
+    if (a_active && b_active) {
+        pr_loc_dbg("Both ports active - remapping");
+        try_detach_port_irq(port_a);
+        try_detach_port_irq(port_b);
+        pr_loc_dbg("### LAST MESSAGE BEFORE SWAP ON \"OLD\" PORT ttyS%d<=>ttyS%d", from, to);
+        swap_uart_lanes(port_a, port_b, true);
+        pr_loc_dbg("### FIRST MESSAGE AFTER SWAP ON \"NEW\" PORT ttyS%d<=>ttyS%d", from, to);
+
+        int out_a = reattach_port_irq(port_a);
+        int out_b = reattach_port_irq(port_b);
+        out = out_a ? out_a : out_b;
+        goto out_swapped;
+    }
+#endif
 
-    console_unlock();
-    preempt_enable();
+    //Only one port is running (so the other chip may have never been initialized) or the kernel cannot relink IRQs
+    swap_uart_restart(port_a, port_b);
 
+    out_swapped:
     pr_loc_inf("======= OUTPUT ON THIS PORT CONTINUES FROM A DIFFERENT ONE (swapped ttyS%d & ttyS%d) =======", from,
                to);
 
+    if (unlikely(out != 0)) {
+        pr_loc_err("Swapping ttyS%d<=>ttyS%d finished but ports may not be receiving - error=%d", from, to, out);
+        return out;
+    }
+
     pr_loc_dbg("Swapping ttyS%d (curr_iob=0x%03lx) <=> ttyS%d (curr_iob=0x%03lx) finished successfully", from,
                port_a->port.iobase, to, port_b->port.iobase);
 
@@ -8,7 +8,8 @@
  * real chip. Moreover, the code isn't hacking around any private parts of the kernel but rather fully emulates
  * registries and their behaviors according to the chip's data sheet.
  * The emulation layer supports standard 8250-compliant feature (in essence UART) set with addition of two 16 bytes
- * TX/RX FIFOs with configurable threshold as well as timer or virtual IRQ model. The code should be pretty
+ * TX/RX FIFOs with configurable threshold, RX trigger levels with character time-out, as well as timer or virtual IRQ
+ * model. The code should be pretty
  * straight-forward to read but it contains MANY quirks. All of them however are heavily documented throughout the file.
  *
  * DEALING WITH OPEN PORTS
@@ -27,8 +28,10 @@
  * -----------
  *  - For obvious reasons (as we are not working with a real hw) the DMA portion of the chip is not emulated
  *  - On most system the maximum number of UARTs emulated is 4 (driver's limitation, see CONFIG_SERIAL_8250_NR_UARTS)
- *  - FIFOs, true to the original 16550A, are limited to 16 bytes each. In theory, if needed, they can be enlarge up to
- *    even 256 bytes each with chip model change (as 8250 driver actually tests how big a FIFO is on setup)
+ *  - FIFOs, true to the original 16550A, are limited to 16 bytes each. A TI 16C750 model can be selected per line (see
+ *    vuart_set_chip_model()) which offers 64 bytes FIFOs. The 8250 driver detects it on setup by probing FCR/IIR bit 5
+ *    with and without DLAB, so the emulation replicates exactly that behavior. Models with even deeper FIFOs (e.g.
+ *    16C950) are not offered as the driver requires EFR & indexed registers emulation to detect them.
  *  - FIFO mode is always enabled. There are some not-fully-accurate pieces which don't handle non-FIFO operation. There
  *    is (at least to our knowledge) no reason to use it adn kernel always asks for FIFO to save CPU anyway.
  *
@@ -46,7 +49,13 @@
  *    pretty catastrophic as you will be flooded with messages about IIR being read as long as the port stays open in 
  *    the userland. This consciously does not use kernel's dynamic debug facilities are some (e.g. 918+) kernels are
  *    compiled without it.
- *  - To change name of the vIRQ thread define VUART_THREAD_FMT which gets a real port IRQ # and ttyS# as its params.
+ *  - All lines share a single vIRQ dispatcher thread (see vuart_virtual_irq.c). To change its name define
+ *    VUART_THREAD_FMT which gets a real port IRQ # and ttyS# of the first line with vIRQ enabled as its params.
+ *  - Bulk transfers take a fast path: IIR is only recomputed when a register access can actually change the interrupts
+ *    state (e.g. LSR polls and bytes pushed into a non-empty TX FIFO don't). See handle_transmit_char().
+ *  - RX and TX sides of the chip have separate locks, while the registers lock is only taken shortly to compose IIR
+ *    (see serial8250_16550A_vdev). This way data injected by vuart_inject_rx() doesn't contend with the driver pushing
+ *    data to TX. LSR & IIR reads (polled constantly by the driver) don't take any lock.
  *  - UART_BUG_SWAPPED (defined in uart_defs.h) is used to detect swapped ports and make sure numbers used here are real
  *    ttyS* values and not swapped bs (as 8250 matches ports by iobase and not line#)
  *
@@ -69,10 +78,22 @@
 #include "../../config/uart_defs.h" //COM defs & struct uart_port
 #include "../../internal/intercept_driver_register.h" //is_driver_registered, watch_driver_register, unwatch_driver_register
 #include "vuart_virtual_irq.h" //vIRQ handling & shimming; CHECKS VUART_USE_TIMER_FALLBACK
+#include "vuart_chardev.h" //vuart_chardev_add(), vuart_chardev_remove(); CHECKS VUART_CHARDEV
 #include <linux/serial_8250.h> //serial8250_unregister_port, uart_8250_port
+#include "serial8250_ports.h" //get_serial8250_port()
 #include <linux/serial_reg.h> //UART_* consts
-#include <linux/spinlock.h> //locking devices (vdev->lock)
+#include <linux/spinlock.h> //locking devices (vdev->lock, vdev->rx_lock, vdev->tx_lock)
+#include <linux/bitops.h> //set_bit(), clear_bit() for vdev->lsr_oe
+#include <linux/atomic.h> //xchg(), atomic_inc(), atomic_dec_and_test()
+#include <linux/compiler.h> //READ_ONCE(), WRITE_ONCE()
 #include <linux/kfifo.h> //kfifo_*
+#include "../../compat/kfifo_compat.h" //kfifo_put_val()
+#include "../../compat/static_key_compat.h" //RP_DEFINE_STATIC_KEY_FALSE, rp_static_branch_*
+#include "../metrics.h" //RP_METRIC(), rp_metric_*()
+#include "vuart_capture.h" //vuart_capture*()
+#include <linux/scatterlist.h> //kfifo_dma_out_prepare() for zero-copy TX
+#include <linux/rculist.h> //list_*_rcu for TX subscribers
+#include <linux/mutex.h> //tx_subs_mutex
 
 /************************************************* Static definitions *************************************************/
 /*
@@ -82,6 +103,9 @@
 #define UART_IIR_FIFOEN 0xc0
 #define UART_IIR_FIFEN_B6 0x40
 #define UART_IIR_FIFEN_B7 0x80
+#ifndef UART_IIR_64BYTE_FIFO
+#define UART_IIR_64BYTE_FIFO 0x20 //16750: 64 bytes FIFO enabled (not defined in older kernels)
+#endif
 #define UART_DRIVER_NAME "serial8250" //see drivers/tty/serial/8250/8250_core.c in "serial8250_isa_driver"
 
 /**
@@ -113,23 +137,53 @@ static struct serial8250_16550A_vdev ttySs[] = {
     [3]	= { .line = 3, .iobase = STD_COM4_IOBASE, .irq = STD_COM4_IRQ, .baud = STD_COMX_BAUD }, //COM4 aka ttyS3
 };
 
-//Internal type for callbacks; see vuart_set_tx_callback() for details
-struct flush_callback {
-    vuart_callback_t *fn;
-    void *buffer;
+//Internal type for TX subscribers; see vuart_add_tx_subscriber() & vuart_add_tx_zc_subscriber() for details
+struct vuart_tx_subscriber {
+    struct list_head list; //entry in tx_line_subscribers.list
+    int line;
+    vuart_callback_t *fn; //either this or zc_fn is set
+    vuart_zc_callback_t *zc_fn;
+    void *buffer; //only used with fn
+    bool owns_buffer; //buffer was allocated by vUART (and will be freed with the subscriber)
     int threshold;
 };
-//Storage for all TX callbacks, see vuart_set_tx_callback()
-static struct flush_callback *flush_cbs[SERIAL8250_LAST_ISA_LINE] = { NULL };
+
+//All subscribers of a single line
+struct tx_line_subscribers {
+    struct list_head list; //RCU-protected list of struct vuart_tx_subscriber (writers hold tx_subs_mutex)
+    struct vuart_tx_subscriber *primary; //one managed by vuart_set_tx_callback() & vuart_set_tx_zc_callback()
+    int threshold; //lowest threshold of all subscribers; read under vdev TX lock
+};
+
+//Storage for all TX subscribers, see vuart_add_tx_subscriber()
+#define TX_LINE_SUBSCRIBERS_INIT(idx) \
+    [idx] = { .list = LIST_HEAD_INIT(tx_subs[idx].list), .primary = NULL, .threshold = VUART_THRESHOLD_MAX }
+static struct tx_line_subscribers tx_subs[ARRAY_SIZE(ttySs)] = {
+    TX_LINE_SUBSCRIBERS_INIT(0),
+    TX_LINE_SUBSCRIBERS_INIT(1),
+    TX_LINE_SUBSCRIBERS_INIT(2),
+    TX_LINE_SUBSCRIBERS_INIT(3),
+};
+static DEFINE_MUTEX(tx_subs_mutex);
+static unsigned int tx_subs_num = 0; //on all lines; protected by tx_subs_mutex
+//Enabled while there's any TX subscriber; without them the per-char threshold check in TX path is just a NOP
+static RP_DEFINE_STATIC_KEY_FALSE(tx_subs_present);
+
+//All lines are counted together
+static RP_METRIC(vuart_tx_bytes, RP_MG_VUART, RP_METRIC_COUNTER);
+static RP_METRIC(vuart_tx_flushes, RP_MG_VUART, RP_METRIC_COUNTER);
+static RP_METRIC(vuart_tx_overflows, RP_MG_VUART, RP_METRIC_COUNTER);
+static RP_METRIC(vuart_rx_injected_bytes, RP_MG_VUART, RP_METRIC_COUNTER);
+static RP_METRIC(vuart_rx_overflows, RP_MG_VUART, RP_METRIC_COUNTER);
+static struct rp_metric *const vuart_metrics[] = {
+    &vuart_tx_bytes, &vuart_tx_flushes, &vuart_tx_overflows, &vuart_rx_injected_bytes, &vuart_rx_overflows
+};
 static volatile bool kernel_driver_ready = false; //Whether the 8250 UART driver is ready
 
 /**************************************** Internal helper function-like macros ****************************************/
 //Get vDEV from line/ttyS number (created for consistency)
 #define get_line_vdev(line) (&ttySs[(line)])
 
-//8250 driver doesn't give access to the real uart_port upon adding but does it on first read/write
-#define capture_uart_port(vdev, port) if (unlikely(!(vdev)->up)) (vdev)->up = port;
-
 //Some functions should warn use out of courtesy that we're running in a stupid environment
 #if defined(UART_BUG_SWAPPED) && defined(DBG_DISABLE_UART_SWAP_FIX)
 #define warn_bug_swapped(line) \
@@ -144,15 +198,100 @@ static volatile bool kernel_driver_ready = false; //Whether the 8250 UART driver
 
 #define for_each_vdev() for (int line=0; line < ARRAY_SIZE(ttySs); ++line)
 
-//Before v3.13 the kfifo_put() accepted a pointer, since then it accepts a value
-//ffs... https://github.com/torvalds/linux/commit/498d319bb512992ef0784c278fa03679f2f5649d
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
-#define kfifo_put_val(fifo, val) kfifo_put(fifo, &val)
-#else
-#define kfifo_put_val(fifo, val) kfifo_put(fifo, val)
-#endif
+//RX FIFO trigger levels selected by FCR bits 6-7; 2nd row is used by 16750 in 64 bytes mode (see TL16C750 Table 3)
+static const u8 rx_trigger_levels[2][4] = {
+    { 1, 4, 8, 14 },
+    { 1, 16, 32, 56 },
+};
+#define rx_trigger_level(vdev) \
+    rx_trigger_levels[vuart_fifo_len(vdev) == VUART_FIFO_LEN_16750][((vdev)->fcr & UART_FCR_TRIGGER_MASK) >> 6]
 
 /****************************************** Internal chip emulation functions ******************************************/
+/**
+ * Restarts the character time-out measurement - it should be called whenever a character enters or leaves RX FIFO
+ *
+ * This function doesn't touch IIR (the timer, if needed, will be armed by update_interrupts_state()). It assumes you
+ * have vdev RX lock.
+ */
+static inline void reset_rx_timeout(struct serial8250_16550A_vdev *vdev)
+{
+    vdev->rx_timed_out = false;
+    vdev->rx_last_activity = ktime_get();
+
+    //We cannot wait for the callback as we hold the RX lock it needs. If it's already running on another CPU it will
+    // see rx_last_activity moved once it gets the lock & re-arm itself for the rest of the period instead
+    if (hrtimer_try_to_cancel(&vdev->rx_timer) < 0)
+        uart_prdbg("RX time-out callback running on ttyS%d - it will re-arm itself", vdev->line);
+}
+
+/**
+ * Moves data waiting in the staging ring into RX FIFO (as much as it can currently accept)
+ *
+ * This is what makes vuart_inject_rx() streaming: the staging ring is drained at the same pace the driver picks up
+ * characters from the FIFO. Waiters in vuart_inject_rx_wait() are notified when space becomes available.
+ *
+ * This function does NOT recalculate IIRs (see update_rx_interrupt()) and assumes you have vdev RX lock.
+ */
+static void refill_rx_fifo(struct serial8250_16550A_vdev *vdev)
+{
+    char transfer_buf[VUART_FIFO_LEN_MAX];
+
+    //In TEST/LOOP mode RX is connected to TX internally and nothing from the outside can arrive
+    if (kfifo_is_empty(vdev->rx_staging) || unlikely(vdev->mcr & UART_MCR_LOOP))
+        return;
+
+    int space = vuart_fifo_len(vdev) - kfifo_len(vdev->rx_fifo);
+    if (space <= 0)
+        return;
+
+    unsigned int moved = kfifo_out(vdev->rx_staging, transfer_buf, space);
+    kfifo_in(vdev->rx_fifo, transfer_buf, moved);
+    vdev->rx_lsr |= UART_LSR_DR;
+    reset_rx_timeout(vdev);
+    uart_prdbg("Moved %u bytes from RX staging into RX FIFO on ttyS%d", moved, vdev->line);
+
+    if (waitqueue_active(&vdev->rx_space_wq))
+        wake_up_interruptible(&vdev->rx_space_wq);
+}
+
+/**
+ * Determines which (if any) RX interrupt should be signalled
+ *
+ * In FIFO mode the chip raises RDI only when the FIFO reaches the trigger level set in FCR. If there's less data than
+ * that it waits for the FIFO to be idle for the time-out period and then raises the character time-out interrupt (which
+ * for the driver is just a different flavor of RDI). This is what allows the driver to read data in batches.
+ *
+ * @return UART_IIR_RDI, UART_IIR_RX_TIMEOUT, or 0 if no interrupt is due (yet)
+ */
+static u8 get_rx_interrupt(struct serial8250_16550A_vdev *vdev)
+{
+    if (!(vdev->rx_lsr & UART_LSR_DR))
+        return 0;
+
+    if (!(vdev->fcr & UART_FCR_ENABLE_FIFO) || unlikely(vdev->mcr & UART_MCR_LOOP) ||
+        kfifo_len(vdev->rx_fifo) >= rx_trigger_level(vdev))
+        return UART_IIR_RDI;
+
+    if (vdev->rx_timed_out)
+        return UART_IIR_RX_TIMEOUT;
+
+    if (!hrtimer_active(&vdev->rx_timer))
+        hrtimer_start(&vdev->rx_timer, ns_to_ktime((u64)vdev->rx_timeout_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+
+    return 0;
+}
+
+/**
+ * Publishes the RX interrupt state (see get_rx_interrupt()) for the IIR composition
+ *
+ * The RX state is only consistent under the RX lock, while IIR is composed under the registers lock. This function
+ * should be called (under the RX lock) after every RX-side change, and followed by update_interrupts_state().
+ */
+static inline void update_rx_interrupt(struct serial8250_16550A_vdev *vdev)
+{
+    WRITE_ONCE(vdev->rx_int, get_rx_interrupt(vdev));
+}
+
 /**
  * Updates state of the IIR register
  *
@@ -169,25 +308,29 @@ static volatile bool kernel_driver_ready = false; //Whether the 8250 UART driver
  * all changes).
  *
  * Regardless of whether vIRQ is enabled or not this register MUST be updated.
+ *
+ * This function assumes you have vdev (registers) lock. The RX & TX sides are only sampled here: each of them publishes
+ * its state before taking the lock in order to call this function, so the last call always sees the latest state.
  */
 static void update_interrupts_state(struct serial8250_16550A_vdev *vdev)
 {
     uart_prdbg("Recomputing IIR state");
     //Order of these if/elseifs is CRUCIAL - interrupts have priorities and they're masked
     u8 new_iir_int_state = 0;
+    u8 rx_int_state;
+    u8 lsr = vuart_lsr(vdev);
     if ((vdev->ier & UART_IER_RLSI) &&
-        unlikely((vdev->lsr & UART_LSR_OE) || (vdev->lsr & UART_LSR_PE) || (vdev->lsr & UART_LSR_FE) ||
-                (vdev->lsr & UART_LSR_BI))) {
+        unlikely((lsr & UART_LSR_OE) || (lsr & UART_LSR_PE) || (lsr & UART_LSR_FE) || (lsr & UART_LSR_BI))) {
         //Kernel enabled OE/PE/FE/BI interrupts and there's one of them
         uart_prdbg("IIR: setting RLS (errors) interrupt");
         new_iir_int_state |= UART_IIR_RLSI;
-    } else if ((vdev->ier & UART_IER_RDI) && (vdev->lsr & UART_LSR_DR)) {
-        //We don't distinguish between FIFO and non-FIFO mode and just set interrupt if there's some data to be read
-        //We also don't support the receiver time-out (kernel should pick up the data in time as it's a virtual port)
-        uart_prdbg("IIR: setting RD (data-ready) interrupt");
-        new_iir_int_state |= UART_IIR_RDI;
-    } else if ((vdev->ier & UART_IER_THRI) && ((vdev->lsr & UART_LSR_TEMT) || kfifo_is_empty(vdev->tx_fifo))) {
-        //When THR is empty or FIFO is empty (for us it's the same thing) kernel wants to know about that
+    } else if ((vdev->ier & UART_IER_RDI) && (rx_int_state = READ_ONCE(vdev->rx_int)) != 0) {
+        //Data reached the trigger level or was sitting in the FIFO for long enough (see get_rx_interrupt())
+        uart_prdbg("IIR: setting %s interrupt", (rx_int_state == UART_IIR_RDI) ? "RD (data-ready)" : "CT (timeout)");
+        new_iir_int_state |= rx_int_state;
+    } else if ((vdev->ier & UART_IER_THRI) && (lsr & UART_LSR_TEMT)) {
+        //When THR is empty or FIFO is empty (for us it's the same thing, TX side keeps TEMT in sync) kernel wants to
+        // know about that
         uart_prdbg("IIR: setting THR (transmitter empty) interrupt");
         new_iir_int_state |= UART_IIR_THRI;
     }
@@ -201,9 +344,16 @@ static void update_interrupts_state(struct serial8250_16550A_vdev *vdev)
     }
 
     //IIR (despite its name) also contains FIFO status along interrupts
-    vdev->iir = new_iir_int_state;
-    if (likely(vdev->fcr & UART_FCR_ENABLE_FIFO))
-        vdev->iir |= UART_IIR_FIFOEN;
+    if (likely(vdev->fcr & UART_FCR_ENABLE_FIFO)) {
+        new_iir_int_state |= UART_IIR_FIFOEN;
+
+        //This is how 8250 driver distinguishes 16750 from 16550A during autoconfig (the bit is never set on 16550A)
+        if (vdev->fcr & UART_FCR7_64BYTE)
+            new_iir_int_state |= UART_IIR_64BYTE_FIFO;
+    }
+    if (vuart_capture_on() && new_iir_int_state != vdev->iir)
+        __vuart_capture(vdev->line, VUART_CAP_IIR, vdev->iir, new_iir_int_state);
+    WRITE_ONCE(vdev->iir, new_iir_int_state); //it's read without a lock so it must never be seen half-way done
 
     dump_iir(vdev);
     uart_prdbg("Finished IIR state");
@@ -216,13 +366,15 @@ static void update_interrupts_state(struct serial8250_16550A_vdev *vdev)
 static void reset_device(struct serial8250_16550A_vdev *vdev)
 {
     uart_prdbg("Resetting virtual chip @ ttyS%d", vdev->line);
-    lock_vuart_oppr(vdev);
+    lock_vuart_all_oppr(vdev);
 
     //Upon reset both FIFOs must be erased
     if (vdev->tx_fifo)
         kfifo_reset(vdev->tx_fifo);
     if (vdev->rx_fifo)
         kfifo_reset(vdev->rx_fifo);
+    if (vdev->rx_staging)
+        kfifo_reset(vdev->rx_staging);
 
     //Registries for when DLAB=0
     vdev->rhr = 0x00; //no data in receiving channel
@@ -232,7 +384,10 @@ static void reset_device(struct serial8250_16550A_vdev *vdev)
     vdev->fcr = 0x00; //FIFO disabled (which invalidates other FIFO properties in FCR), DMA disabled
     vdev->lcr = 0x00; //non-DLAB mode, errors cleared, 1 STOP bit, 5 bit words (not that it matters for virtual port)
     vdev->mcr = UART_MCR_OUT2; //autoflow disabled, loop mode disabled, OUT2 enabled as global interrupt
-    vdev->lsr = UART_LSR_TEMT | UART_LSR_THRE; //transmitter empty & idle, all errors cleared, break not requested
+    vdev->rx_lsr = 0x00; //no data, all errors cleared, break not requested
+    vdev->tx_lsr = UART_LSR_TEMT | UART_LSR_THRE; //transmitter empty & idle
+    vdev->lsr_oe = 0; //no overruns
+    vdev->rx_int = 0; //no data => no RX interrupt
     vdev->msr = 0x00; //all flow control flags not triggered
     vdev->scr = 0x00; //empty scratchpad
 
@@ -240,10 +395,45 @@ static void reset_device(struct serial8250_16550A_vdev *vdev)
     vdev->dll = 0x00; //undefined divisor LSB latch
     vdev->dlm = 0x00; //undefined divisor MSB latch
 
-    unlock_vuart_oppr(vdev);
+    unlock_vuart_all_oppr(vdev);
     uart_prdbg("Virtual chip @ ttyS%d reset done", vdev->line);
 }
 
+/**
+ * Called when the RX FIFO was idle for the time-out period (see get_rx_interrupt()); runs in hardirq context
+ *
+ * The FIFO could've been touched while we were waiting for the RX lock (reset_rx_timeout() cannot cancel a running
+ * callback), so the idle period is verified against rx_last_activity before the time-out is signalled.
+ */
+static enum hrtimer_restart rx_timeout_expired(struct hrtimer *timer)
+{
+    struct serial8250_16550A_vdev *vdev = container_of(timer, struct serial8250_16550A_vdev, rx_timer);
+
+    lock_vuart_rx(vdev);
+    ktime_t deadline = ktime_add_us(vdev->rx_last_activity, vdev->rx_timeout_us);
+    if (unlikely(ktime_us_delta(deadline, ktime_get()) > 0)) {
+        hrtimer_set_expires(timer, deadline);
+        unlock_vuart_rx(vdev);
+        return HRTIMER_RESTART;
+    }
+
+    bool has_data = likely(vdev->rx_lsr & UART_LSR_DR);
+    if (has_data) {
+        uart_prdbg("RX time-out on ttyS%d with %d bytes in FIFO", vdev->line, kfifo_len(vdev->rx_fifo));
+        vdev->rx_timed_out = true;
+        update_rx_interrupt(vdev);
+    }
+    unlock_vuart_rx(vdev);
+
+    if (has_data) {
+        lock_vuart(vdev);
+        update_interrupts_state(vdev);
+        unlock_vuart(vdev);
+    }
+
+    return HRTIMER_NORESTART;
+}
+
 /**
  * Allocate/create FIFOs on the device if they don't exist (and if they do you shouldn't call this function)
  *
@@ -261,18 +451,28 @@ static int alloc_fifos(struct serial8250_16550A_vdev *vdev)
         return -EINVAL;
     }
 
-    kzalloc_or_exit_int(vdev->rx_fifo, sizeof(struct kfifo));
-    kzalloc_or_exit_int(vdev->tx_fifo, sizeof(struct kfifo));
+    kzalloc_or_exit_int(vdev->rx_fifo, sizeof(struct kfifo), RP_MEM_VUART);
+    kzalloc_or_exit_int(vdev->tx_fifo, sizeof(struct kfifo), RP_MEM_VUART);
+    kzalloc_or_exit_int(vdev->rx_staging, sizeof(struct kfifo), RP_MEM_VUART);
 
-    if (unlikely(kfifo_alloc(vdev->rx_fifo, VUART_FIFO_LEN, GFP_KERNEL) != 0)) {
+    //FIFOs are always allocated for the deepest model as 16750 can switch between 16 and 64 bytes mode at any time
+    if (unlikely(kfifo_alloc(vdev->rx_fifo, VUART_FIFO_LEN_MAX, GFP_KERNEL) != 0)) {
         pr_loc_crt("kfifo_alloc for RX FIFO elements @ %d failed", vdev->line);
         return -EFAULT;
     }
+    rp_mem_alloced(RP_MEM_VUART, vdev->rx_fifo->kfifo.data);
 
-    if (unlikely(kfifo_alloc(vdev->tx_fifo, VUART_FIFO_LEN, GFP_KERNEL) != 0)) {
+    if (unlikely(kfifo_alloc(vdev->tx_fifo, VUART_FIFO_LEN_MAX, GFP_KERNEL) != 0)) {
         pr_loc_crt("kfifo_alloc for TX FIFO elements @ %d failed", vdev->line);
         return -EFAULT;
     }
+    rp_mem_alloced(RP_MEM_VUART, vdev->tx_fifo->kfifo.data);
+
+    if (unlikely(kfifo_alloc(vdev->rx_staging, VUART_RX_STAGING_LEN, GFP_KERNEL) != 0)) {
+        pr_loc_crt("kfifo_alloc for RX staging elements @ %d failed", vdev->line);
+        return -EFAULT;
+    }
+    rp_mem_alloced(RP_MEM_VUART, vdev->rx_staging->kfifo.data);
 
     return 0;
 }
@@ -283,44 +483,93 @@ static int alloc_fifos(struct serial8250_16550A_vdev *vdev)
 static int free_fifos(struct serial8250_16550A_vdev *vdev)
 {
     //This should be called when the vIRQ thread is killed so nothing call the IRQ handler without FIFOs
-    if (unlikely(!vdev->rx_fifo || !vdev->tx_fifo)) { //this shouldn't happen on initialized port
+    if (unlikely(!vdev->rx_fifo || !vdev->tx_fifo || !vdev->rx_staging)) { //this shouldn't happen on initialized port
         pr_loc_bug("RX and/or TX FIFO @ %d are not alloc'd (nothing to free)", vdev->line);
         return -EINVAL;
     }
 
+    rp_mem_freeing(RP_MEM_VUART, vdev->rx_fifo->kfifo.data); //kfifo_free() clears the pointer
+    rp_mem_freeing(RP_MEM_VUART, vdev->tx_fifo->kfifo.data);
+    rp_mem_freeing(RP_MEM_VUART, vdev->rx_staging->kfifo.data);
     kfifo_free(vdev->rx_fifo);
     kfifo_free(vdev->tx_fifo);
+    kfifo_free(vdev->rx_staging);
+    rp_kfree(vdev->rx_fifo, RP_MEM_VUART);
+    rp_kfree(vdev->tx_fifo, RP_MEM_VUART);
+    rp_kfree(vdev->rx_staging, RP_MEM_VUART);
+    vdev->rx_fifo = NULL;
+    vdev->tx_fifo = NULL;
+    vdev->rx_staging = NULL;
 
     return 0;
 }
 
 /**
- * Deposits the TX queue contents into callbacks set using vuart_set_tx_callback() and clears the FIFO itself
- * If no callbacks were defined it will simply clear.
+ * Deposits the TX queue contents into all subscribers (see vuart_add_tx_subscriber()) and clears the FIFO itself
+ * If no subscribers were added it will simply clear.
  *
- * This function does NOT recalculate IIRs (see update_interrupts_state()) and assumes you have vdev lock.
+ * The FIFO is drained once and the same data is delivered to every subscriber: zero-copy ones get views directly into
+ * the FIFO, while regular ones get a copy in their own buffers. When there's exactly one zero-copy subscriber it can
+ * decide to leave some bytes in the FIFO (see vuart_zc_callback_t). With more subscribers everything is always
+ * consumed, as otherwise others would get the same bytes twice.
+ *
+ * This function does NOT recalculate IIRs (see update_interrupts_state()) and assumes you have vdev TX lock.
  */
 static void flush_tx_fifo(struct serial8250_16550A_vdev *vdev, vuart_flush_reason reason)
 {
     uart_prdbg("Flushing TX FIFO now! reason=%d", reason);
+    rp_metric_inc(&vuart_tx_flushes);
+    vuart_capture(vdev->line, VUART_CAP_FLUSH, reason, min_t(unsigned int, kfifo_len(vdev->tx_fifo), U8_MAX));
+
+    //kfifo gives us its internal storage as (at most two) scatterlist entries - nothing is copied here
+    struct scatterlist sgl[VUART_TX_MAX_SEGMENTS];
+    struct vuart_tx_segment segs[VUART_TX_MAX_SEGMENTS];
+    unsigned int len = kfifo_len(vdev->tx_fifo);
+
+    sg_init_table(sgl, VUART_TX_MAX_SEGMENTS);
+    unsigned int nsegs = kfifo_dma_out_prepare(vdev->tx_fifo, sgl, VUART_TX_MAX_SEGMENTS, len);
+    for (unsigned int i = 0; i < nsegs; ++i) {
+        segs[i].data = sg_virt(&sgl[i]);
+        segs[i].len = sgl[i].length;
+    }
 
-    if (likely(flush_cbs[vdev->line])) {
-        unsigned int flushed_bytes = 0;
-        flushed_bytes = kfifo_out(vdev->tx_fifo, flush_cbs[vdev->line]->buffer, VUART_FIFO_LEN);
-        flush_cbs[vdev->line]->fn(vdev->line, flush_cbs[vdev->line]->buffer, flushed_bytes, reason);
-    } else {
-        uart_prdbg("No callback for TX FIFO @ %d - discarding", vdev->line);
+    struct vuart_tx_subscriber *sub;
+    unsigned int nsubs = 0;
+    unsigned int consumed = len;
+    rcu_read_lock();
+    list_for_each_entry_rcu(sub, &tx_subs[vdev->line].list, list) {
+        ++nsubs;
+        if (sub->zc_fn) {
+            consumed = min(sub->zc_fn(vdev->line, segs, nsegs, len, reason), len);
+            continue;
+        }
+
+        unsigned int copied = 0;
+        for (unsigned int i = 0; i < nsegs; ++i) {
+            memcpy((char *)sub->buffer + copied, segs[i].data, segs[i].len);
+            copied += segs[i].len;
+        }
+        sub->fn(vdev->line, sub->buffer, len, reason);
+    }
+    rcu_read_unlock();
+
+    if (unlikely(nsubs == 0)) {
+        uart_prdbg("No subscribers for TX FIFO @ %d - discarding", vdev->line);
         kfifo_reset(vdev->tx_fifo);
+    } else {
+        kfifo_dma_out_finish(vdev->tx_fifo, (nsubs == 1) ? consumed : len);
     }
 
-    vdev->lsr |= UART_LSR_TEMT | UART_LSR_THRE; //nothing should be in the buffer
+    //nothing should be in the buffer... unless zero-copy consumer decided to leave something there
+    if (likely(kfifo_is_empty(vdev->tx_fifo)))
+        vdev->tx_lsr |= UART_LSR_TEMT | UART_LSR_THRE;
 }
 
 /**
  * Pulls a character/byte from RX FIFO and places it into RHR for the driver to read it
  *  - It updates all registers according to the specs
- *  - It assumes you have vdev lock
- *  - It does NOT recalculate IIRs (see update_interrupts_state())
+ *  - It assumes you have vdev RX lock
+ *  - It does NOT recalculate IIRs (see update_rx_interrupt())
  *  - It will produce an error if you try to do the transfer while FIFO is empty but it will not crash. You should check
  *    UART_LSR_DR before calling this function.
  *
@@ -331,15 +580,16 @@ static unsigned char transfer_char_fifo_rhr(struct serial8250_16550A_vdev *vdev)
     //Before this function is called UART_LSR_DR should be verified - it wasn't or it was wrong if this exploded
     if(unlikely(kfifo_get(vdev->rx_fifo, &vdev->rhr) == 0))
         pr_loc_bug("Attempted to %s with empty FIFO - that shouldn't happen if the DR flag was checked", __FUNCTION__);
+    reset_rx_timeout(vdev); //reading a character restarts the time-out (Ti doc section 3.6.2)
 
     if (kfifo_is_empty(vdev->rx_fifo))
-        vdev->lsr &= ~UART_LSR_DR;
+        vdev->rx_lsr &= ~UART_LSR_DR;
 
     //See descriptions of these fields in Table 3-12 from TI doc - these flags are cleared on character read
-    vdev->lsr &= ~UART_LSR_BI;
-    vdev->lsr &= ~UART_LSR_FE;
-    vdev->lsr &= ~UART_LSR_PE;
-    vdev->lsr &= ~UART_LSR_OE; //by definition, we cannot have overrun if a character was just read
+    vdev->rx_lsr &= ~UART_LSR_BI;
+    vdev->rx_lsr &= ~UART_LSR_FE;
+    vdev->rx_lsr &= ~UART_LSR_PE;
+    clear_bit(VUART_LSR_OE_RX, &vdev->lsr_oe); //by definition, we cannot have overrun if a character was just read
 
     return vdev->rhr;
 }
@@ -347,7 +597,7 @@ static unsigned char transfer_char_fifo_rhr(struct serial8250_16550A_vdev *vdev)
 /**
  * An alternative to transfer_char_fifo_rhr() when FIFOs aren't used for transfers (e.g. in MSR TEST/LOOP mode)
  *
- * This function does NOT recalculate IIRs (see update_interrupts_state()) and assumes you have vdev lock.
+ * This function does NOT recalculate IIRs (see update_rx_interrupt()) and assumes you have vdev RX lock.
  */
 static void handle_receive_char(struct serial8250_16550A_vdev *vdev, unsigned char value)
 {
@@ -356,68 +606,164 @@ static void handle_receive_char(struct serial8250_16550A_vdev *vdev, unsigned ch
     vdev->rhr = value; //RHR is always populated with the value no matter the FIFO or non-FIFO mode
 
     //Put value in FIFO, it will indicate with return of 0 if it was full before attempted put (overrun/overflow)
-    if (kfifo_put_val(vdev->rx_fifo, value) == 0) {
-        vdev->lsr |= UART_LSR_OE; //set overrun flag as FIFO detected that
+    //The kfifo is always allocated for VUART_FIFO_LEN_MAX so the current chip FIFO depth has to be checked manually
+    if (kfifo_len(vdev->rx_fifo) >= vuart_fifo_len(vdev) || kfifo_put_val(vdev->rx_fifo, value) == 0) {
+        set_bit(VUART_LSR_OE_RX, &vdev->lsr_oe); //set overrun flag as FIFO detected that
+        rp_metric_inc(&vuart_rx_overflows);
 
         //During TEST/LOOP mode many overflows are caused on purpose - we don't want to hear about them really
         if (unlikely(!(vdev->mcr & UART_MCR_LOOP)))
-            pr_loc_wrn("RX FIFO overflow detected @ ttyS%d", vdev->line);
+            pr_loc_wrn_rl("RX FIFO overflow detected @ ttyS%d", vdev->line);
     } else {
-        vdev->lsr &= ~UART_LSR_OE; //no overrun condition - clear OE flag just in case
+        clear_bit(VUART_LSR_OE_RX, &vdev->lsr_oe); //no overrun condition - clear OE flag just in case
     }
 
-    vdev->lsr |= UART_LSR_DR; //receiver has something for the kernel to pickup
+    vdev->rx_lsr |= UART_LSR_DR; //receiver has something for the kernel to pickup
+    reset_rx_timeout(vdev);
 }
 
 /**
  * Called when kernel sent something to the device and it has to be put into TX FIFO & THR
  *
- * This function does NOT recalculate IIRs (see update_interrupts_state()) and assumes you have vdev lock.
+ * This function does NOT recalculate IIRs (see update_interrupts_state()) and assumes you have vdev TX lock.
  *
  * CAUTION: order of these "ifs" for flushes here is crucial: we make a guarantee to the reason parameter that if both
- *  VUART_FLUSH_THRESHOLD and VUART_FLUSH_FULL are true (i.e. callback was set with threshold == VUART_FIFO_LEN) we
+ *  VUART_FLUSH_THRESHOLD and VUART_FLUSH_FULL are true (i.e. callback was set with threshold == FIFO length) we
  *  will prioritize threshold trigger (as a user-specified event takes precedence over internal event of FIFO full)
  * If the threshold specified by the callback setter was met flush the FIFO
+ *
+ * @return true if the interrupt state may have changed (and IIR needs to be recomputed), false otherwise. This is the
+ *         fast path for bulk transfers: while the driver keeps pushing bytes into a non-empty FIFO nothing changes from
+ *         the interrupts perspective. IIR only needs to be recomputed when the burst starts (THRE interrupt goes away),
+ *         when the FIFO is flushed (THRE interrupt may be due again) or when an overrun happens.
  */
-static void handle_transmit_char(struct serial8250_16550A_vdev *vdev, unsigned char value)
+static bool handle_transmit_char(struct serial8250_16550A_vdev *vdev, unsigned char value)
 {
+    bool int_state_changed = false;
+
     //@todo this only handle non-FIFO properly: doesn't detect OE, and doesn't reset THRE
     vdev->thr = value; //THR is always populated with the value no matter the FIFO or non-FIFO mode
-    vdev->lsr &= ~UART_LSR_THRE;
+    vdev->tx_lsr &= ~UART_LSR_THRE;
 
     int fifo_len = kfifo_len(vdev->tx_fifo);
+    int fifo_cap = vuart_fifo_len(vdev);
     uart_prdbg("%s got new char ascii=%c hex=%02x on ttyS%d (FIFO#=%d)", __FUNCTION__, value, value, vdev->line,
                fifo_len);
 
-    //FIFO is full - try to flush it; if we got here it means the threshold is for sure >VUART_FIFO_LEN as this is
+    //FIFO is full - try to flush it; if we got here it means the threshold is for sure >fifo_cap as this is
     // checked after we put data into the FIFO (to make sure we trigger THRESHOLD event and not FULL)
     //The reason why we check this at the beginning of new char and not after adding to FIFO is that if the transmitting
-    // party sends exactly VUART_FIFO_LEN bytes and then ends the transmission we don't want to flush with FULL but with
+    // party sends exactly fifo_cap bytes and then ends the transmission we don't want to flush with FULL but with
     // IDLE to give a better sense of what's going on to the caller. FULL implies "we got too much data, there may be
     // more coming" while IDLE implies that the unit of transmission ended.
-    if (unlikely(fifo_len == VUART_FIFO_LEN))
+    if (unlikely(fifo_len >= fifo_cap)) {
         flush_tx_fifo(vdev, VUART_FLUSH_FULL);
+        fifo_len = kfifo_len(vdev->tx_fifo);
+        int_state_changed = true;
+    }
+
+    if (fifo_len == 0) //first byte of a burst
+        int_state_changed = true;
 
     //Put value in FIFO, it will indicate with return of 0 if it was full before attempted put (overrun/overflow)
-    //This, if we are correct, cannot happen if the flush_tx_fifo() is functioning correctly as we try to flush above
-    int fifo_add = kfifo_put_val(vdev->tx_fifo, value);
+    //This, if we are correct, can only happen if a zero-copy callback didn't consume anything from a full FIFO
+    int fifo_add = (likely(fifo_len < fifo_cap)) ? kfifo_put_val(vdev->tx_fifo, value) : 0;
     fifo_len += fifo_add; //we can call kfifo_ API for this but why if we have both pieces of info anyway? ;)
     if (unlikely(fifo_add == 0)) {
-        vdev->lsr |= UART_LSR_OE; //set overrun flag as FIFO detected that
-        pr_loc_wrn("TX FIFO overflow detected");
+        set_bit(VUART_LSR_OE_TX, &vdev->lsr_oe); //set overrun flag as FIFO detected that
+        rp_metric_inc(&vuart_tx_overflows);
+        pr_loc_wrn_rl("TX FIFO overflow detected");
+        int_state_changed = true;
     } else {
-        vdev->lsr &= ~UART_LSR_OE; //no overrun condition - clear OE flag just in case
+        clear_bit(VUART_LSR_OE_TX, &vdev->lsr_oe); //no overrun condition - clear OE flag just in case
+        rp_metric_inc(&vuart_tx_bytes);
     }
 
-    vdev->lsr &= ~UART_LSR_TEMT; //transmitter buffers are no longer empty
+    vdev->tx_lsr &= ~UART_LSR_TEMT; //transmitter buffers are no longer empty
 
     //@todo THRE should be reset immediately in non-FIFO mode (i.e. at the same time as TEMT)
     //This is to prevent kernel from freaking out about "blackhole" UART (see https://unix.stackexchange.com/a/387650)
-    if (fifo_len >= VUART_FIFO_LEN / 2)
-        vdev->lsr &= ~UART_LSR_THRE;
+    if (fifo_len >= fifo_cap / 2)
+        vdev->tx_lsr &= ~UART_LSR_THRE;
 
-    if (likely(flush_cbs[vdev->line]) && fifo_len >= flush_cbs[vdev->line]->threshold)
+    if (rp_static_branch_unlikely(&tx_subs_present) && fifo_len >= tx_subs[vdev->line].threshold) {
         flush_tx_fifo(vdev, VUART_FLUSH_THRESHOLD);
+        int_state_changed = true;
+    }
+
+    return int_state_changed;
+}
+
+/**
+ * Reads RHR (or DLL when DLAB is set) which is the only register read with side effects on the RX side
+ *
+ * It only needs the RX lock (so TX traffic & the registers lock aren't touched unless the interrupts state changed)
+ */
+static unsigned int read_rhr(struct serial8250_16550A_vdev *vdev)
+{
+    unsigned int out;
+    bool int_state_changed = false;
+
+    lock_vuart_rx(vdev);
+    //if DLAB is enabled DLL registry is desired; otherwise we should send THR
+    //See Table 2 in the chip manual. DLAB controls access to address 000, 001, and 101. When DLAB=1 these
+    //addrs respond with DLL, DLM, and PSD respectively, when DLAB=0 they respond with RHR/THR, IER/DLM, and LSR
+    if (vdev->lcr & UART_LCR_DLAB) {
+        out = vdev->dll;
+        reg_read("DLL");
+    } else if (vdev->rx_lsr & UART_LSR_BI) { //chip wants a break?
+        out = 0;
+        vdev->rx_lsr &= ~UART_LSR_BI; //clear the break for the next cycle; see BI in Table 3-12 from TI doc
+        int_state_changed = true;
+        uart_prdbg("LSR indicated break request, cleared");
+        dump_lsr(vdev);
+    }  else if(vdev->rx_lsr & UART_LSR_DR) { //Did we receive anything?
+        out = transfer_char_fifo_rhr(vdev);
+        refill_rx_fifo(vdev); //a slot just freed up in the FIFO
+        int_state_changed = true;
+        dump_lsr(vdev);
+        uart_prdbg("Providing RHR registry (val=%x DLAB=0 LSR_DR=1)", out);
+    } else {
+        out = 0;
+        //Such read isn't invalid. However, it is done e.g. in the init sequence as a workaround for some
+        // physical chips bugs in the past or to clear the RHR before other operations (even if LSR DR=0)
+        uart_prdbg("Nothing in RHR (DLAB=0; LSR_DR=0) - noop");
+        dump_lsr(vdev);
+    }
+
+    if (int_state_changed)
+        update_rx_interrupt(vdev);
+    unlock_vuart_rx(vdev);
+
+    if (int_state_changed) {
+        lock_vuart(vdev);
+        update_interrupts_state(vdev);
+        unlock_vuart(vdev);
+    }
+
+    return out;
+}
+
+/**
+ * Reads LSR which is composed from RX & TX halves without any lock (see vuart_lsr())
+ *
+ * The driver polls LSR constantly (e.g. for every character written), so it shouldn't contend with any of the sides.
+ */
+static unsigned int read_lsr(struct serial8250_16550A_vdev *vdev)
+{
+    //See "OE" Table 3-12 or Table 3-6 - it needs to be cleared on LSR read
+    bool had_oe = xchg(&vdev->lsr_oe, 0) != 0;
+    unsigned int out = READ_ONCE(vdev->rx_lsr) | READ_ONCE(vdev->tx_lsr) | (had_oe ? UART_LSR_OE : 0);
+    reg_read("LSR");
+    uart_prdbg("LSR[0x%02x] (OE %s)", out, had_oe ? "cleared" : "not set");
+
+    if (had_oe) { //clearing OE may drop the RLS interrupt
+        lock_vuart(vdev);
+        update_interrupts_state(vdev);
+        unlock_vuart(vdev);
+    }
+
+    return out;
 }
 
 /**
@@ -429,39 +775,28 @@ static void handle_transmit_char(struct serial8250_16550A_vdev *vdev, unsigned c
  * @param offset This is really the register value. It's named "offset" in accordance with Linux nomenclature which
  *               makes sense for physical chips (as this is a memory offset from chip's memory base)
  */
-static unsigned int serial_remote_read(struct uart_port *port, int offset)
+static unsigned int __serial_remote_read(struct uart_port *port, int offset)
 {
     uart_prdbg("Serial READ for line=%d/%d", port->line, ttySs[port->line].line);
 
     struct serial8250_16550A_vdev *vdev = get_line_vdev(port->line);
-    lock_vuart(vdev);
-    capture_uart_port(vdev, port);
     unsigned int out;
-	switch (offset) {
+
+    //Hot registers have their own (lighter) locking
+    switch (offset) {
         case UART_RX:
-            //if DLAB is enabled DLL registry is desired; otherwise we should send THR
-            //See Table 2 in the chip manual. DLAB controls access to address 000, 001, and 101. When DLAB=1 these
-            //addrs respond with DLL, DLM, and PSD respectively, when DLAB=0 they respond with RHR/THR, IER/DLM, and LSR
-            if (vdev->lcr & UART_LCR_DLAB) {
-                out = vdev->dll;
-                reg_read("DLL");
-            } else if (vdev->lsr & UART_LSR_BI) { //chip wants a break?
-                out = 0;
-                vdev->lsr &= ~UART_LSR_BI; //clear the break for the next cycle; see BI in Table 3-12 from TI doc
-                uart_prdbg("LSR indicated break request, cleared");
-                dump_lsr(vdev);
-            }  else if(vdev->lsr & UART_LSR_DR) { //Did we receive anything?
-                out = transfer_char_fifo_rhr(vdev);
-                dump_lsr(vdev);
-                uart_prdbg("Providing RHR registry (val=%x DLAB=0 LSR_DR=1)", out);
-            } else {
-                out = 0;
-                //Such read isn't invalid. However, it is done e.g. in the init sequence as a workaround for some
-                // physical chips bugs in the past or to clear the RHR before other operations (even if LSR DR=0)
-                uart_prdbg("Nothing in RHR (DLAB=0; LSR_DR=0) - noop");
-                dump_lsr(vdev);
-            }
-            break;
+            return read_rhr(vdev);
+        case UART_IIR:
+            out = READ_ONCE(vdev->iir); //it's published as a whole by update_interrupts_state()
+            reg_read_dump(vdev, iir, "IIR/ISR");
+            return out;
+        case UART_LSR:
+            return read_lsr(vdev);
+    }
+
+    //Reading other registers has no side effects - no need to recompute IIR for them
+    lock_vuart(vdev);
+	switch (offset) {
         case UART_IER:
             if (vdev->lcr & UART_LCR_DLAB) {
                 out = vdev->dlm;
@@ -471,10 +806,7 @@ static unsigned int serial_remote_read(struct uart_port *port, int offset)
                 reg_read_dump(vdev, ier, "IER");
             }
             break;
-        case UART_IIR:
-            out = vdev->iir;
-            reg_read_dump(vdev, iir, "IIR/ISR");
-            break;
+        //case UART_IIR handled above
 	    //case UART_FCR not present - write only register
         case UART_LCR:
             out = vdev->lcr;
@@ -484,11 +816,7 @@ static unsigned int serial_remote_read(struct uart_port *port, int offset)
             out = vdev->mcr;
             reg_read_dump(vdev, mcr, "MCR");
             break;
-        case UART_LSR:
-            out = vdev->lsr;
-            reg_read_dump(vdev, lsr, "LSR");
-            vdev->lsr &= ~UART_LSR_OE; //See "OE" Table 3-12 or Table 3-6 - it needs to be cleared on LSR read
-            break;
+        //case UART_LSR handled above
         case UART_MSR:
             out = vdev->msr;
             reg_read_dump(vdev, msr, "MSR");
@@ -512,13 +840,62 @@ static unsigned int serial_remote_read(struct uart_port *port, int offset)
             out = 0;
             break;
 	}
+    unlock_vuart(vdev);
+
+    return out;
+}
 
-	update_interrupts_state(vdev);
-	unlock_vuart(vdev);
+//This is what's really passed to the 8250 driver; reads have many exits so they're captured here
+static unsigned int serial_remote_read(struct uart_port *port, int offset)
+{
+    unsigned int out = __serial_remote_read(port, offset);
+    vuart_capture(port->line, VUART_CAP_REG_READ, offset, out);
 
     return out;
 }
 
+/**
+ * Writes THR (or DLL when DLAB is set) which is the hot path of all transmissions
+ *
+ * It only needs the TX lock (or the RX one in TEST/LOOP mode), so the driver writing doesn't contend with data being
+ * received. The registers lock is taken only if the interrupts state may have changed (see handle_transmit_char()).
+ */
+static void write_thr(struct serial8250_16550A_vdev *vdev, unsigned char value)
+{
+    bool int_state_changed = true;
+
+    lock_vuart_tx(vdev);
+    //See "case UART_RX" for explanation
+    if (vdev->lcr & UART_LCR_DLAB) { //DLAB overrides everything
+        lock_vuart_rx(vdev); //registers are modified under all locks (see serial8250_16550A_vdev)
+        lock_vuart(vdev);
+        vdev->dll = value;
+        unlock_vuart(vdev);
+        unlock_vuart_rx(vdev);
+        reg_write("DLL");
+        int_state_changed = false;
+    } else if (vdev->mcr & UART_MCR_LOOP) { //are we in the reflection/loop mode? (=> fake TX->RX connection)
+        uart_prdbg("Loopback enabled, writing %x meant for THR to RHR directly", value);
+        lock_vuart_rx(vdev);
+        handle_receive_char(vdev, value); //loopback emulates receiving char on RX
+        update_rx_interrupt(vdev);
+        unlock_vuart_rx(vdev);
+        dump_mcr(vdev);
+        dump_lsr(vdev);
+    } else { //just pickup the data from kernel
+        int_state_changed = handle_transmit_char(vdev, value);
+        reg_write("THR");
+        dump_lsr(vdev);
+    }
+    unlock_vuart_tx(vdev);
+
+    if (int_state_changed) {
+        lock_vuart(vdev);
+        update_interrupts_state(vdev);
+        unlock_vuart(vdev);
+    }
+}
+
 /**
  * The main WRITE routing passed to the 8250 driver. It should be as fast as possible and MUST be multithread-safe
  *
@@ -533,30 +910,24 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
     //uart_prdbg("Serial WRITE for line=%d/%d", port->line, ttySs[port->line].line);
 
     struct serial8250_16550A_vdev *vdev = get_line_vdev(port->line);
-    lock_vuart(vdev);
-    capture_uart_port(vdev, port);
+    vuart_capture(port->line, VUART_CAP_REG_WRITE, offset, value);
+    if (likely(offset == UART_TX)) {
+        write_thr(vdev, (unsigned char)value);
+        return;
+    }
+
+    //Other registers are written rarely (compared to THR) but they affect both sides of the chip (e.g. FCR flushes
+    // both FIFOs and changes their depth) - they're always modified with all locks held
+    lock_vuart_all(vdev);
+    bool int_state_changed = true; //most writes modify something which can influence interrupts
 
     switch (offset) {
-        case UART_TX:
-            //See "case UART_RX" for explanation
-            if (vdev->lcr & UART_LCR_DLAB) { //DLAB overrides everything
-                vdev->dll = value;
-                reg_write("DLL");
-            } else if (vdev->mcr & UART_MCR_LOOP) { //are we in the reflection/loop mode? (=> fake TX->RX connection)
-                uart_prdbg("Loopback enabled, writing %x meant for THR to RHR directly", value);
-                handle_receive_char(vdev, (unsigned char)value); //loopback emulates receiving char on RX
-                dump_mcr(vdev);
-                dump_lsr(vdev);
-            } else { //just pickup the data from kernel
-                handle_transmit_char(vdev, (unsigned char)value);
-                reg_write("THR");
-                dump_lsr(vdev);
-            }
-            break;
+        //case UART_TX handled above
         case UART_IER:
             if (vdev->lcr & UART_LCR_DLAB) {
                 vdev->dlm = value;
                 reg_write("DLM");
+                int_state_changed = false;
                 break;
             }
 
@@ -580,34 +951,55 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
             if (!(vdev->fcr & UART_FCR_ENABLE_FIFO) && !(value & UART_FCR_ENABLE_FIFO))
                 value &= UART_FCR_ENABLE_FIFO;
 
+            //64 bytes mode bit: 16550A doesn't have it at all, 16750 only latches it when DLAB is set (see p.21 of
+            // TI TL16C750 datasheet) - this is exactly what 8250 autoconfig_16550a() probes for
+            if (vdev->model != VUART_CHIP_16750) {
+                value &= ~UART_FCR7_64BYTE;
+            } else if (!(vdev->lcr & UART_LCR_DLAB)) {
+                value = (value & ~UART_FCR7_64BYTE) | (vdev->fcr & UART_FCR7_64BYTE);
+            } else if ((value ^ vdev->fcr) & UART_FCR7_64BYTE) {
+                //Changing FIFO depth with data inside would leave more bytes than the new depth allows
+                value |= UART_FCR_CLEAR_XMIT | UART_FCR_CLEAR_RCVR;
+                uart_prdbg("FIFO depth changed to %d bytes", (value & UART_FCR7_64BYTE) ? VUART_FIFO_LEN_16750 :
+                                                                                          VUART_FIFO_LEN);
+            }
+
             vdev->fcr = value;
             reg_write_dump(vdev, fcr, "FCR");
 
             //If the new FCR value called for flush of TX and/or RX do that right away
             if (vdev->fcr & UART_FCR_CLEAR_XMIT) {
                 kfifo_reset(vdev->tx_fifo);
-                vdev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+                vdev->tx_lsr |= UART_LSR_TEMT | UART_LSR_THRE;
                 uart_prdbg("TX FIFO flushed on FCR request");
                 dump_lsr(vdev);
             }
 
             if (vdev->fcr & UART_FCR_CLEAR_RCVR) {
                 kfifo_reset(vdev->rx_fifo);
-                vdev->lsr &= ~UART_LSR_DR;
+                reset_rx_timeout(vdev);
+                vdev->rx_lsr &= ~UART_LSR_DR;
                 uart_prdbg("RX FIFO flushed on FCR request");
                 dump_lsr(vdev);
             }
+            update_rx_interrupt(vdev); //FIFO mode & trigger level may have changed
             break;
         case UART_LCR:
             vdev->lcr = value;
             reg_write_dump(vdev, lcr, "LCR");
+            int_state_changed = false; //we don't emulate framing so it affects nothing but DLAB
             break;
         case UART_MCR:
             vdev->mcr = value;
             reg_write_dump(vdev, mcr, "MCR");
+            refill_rx_fifo(vdev); //if the LOOP mode just ended data from staging can arrive again
+            update_rx_interrupt(vdev); //LOOP mode changes how RX interrupts are triggered
             break;
         case UART_LSR:
-            vdev->lsr = value;
+            vdev->rx_lsr = value & VUART_LSR_RX_BITS;
+            vdev->tx_lsr = value & VUART_LSR_TX_BITS;
+            xchg(&vdev->lsr_oe, (value & UART_LSR_OE) ? BIT(VUART_LSR_OE_RX) : 0);
+            update_rx_interrupt(vdev);
             pr_loc_bug("Bogus LSR write attempt on ttyS%d - why?", vdev->line);
             dump_lsr(vdev);
             break;
@@ -619,19 +1011,21 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
         case UART_SCR:
             vdev->scr = value;
             reg_write("SCR");
+            int_state_changed = false;
             break;
         default:
             pr_loc_bug("Unknown registry %x write attempt on ttyS%d with %x", offset, vdev->line, value);
             break;
 	}
 
-    update_interrupts_state(vdev);
-    unlock_vuart(vdev);
+    if (int_state_changed)
+        update_interrupts_state(vdev);
+    unlock_vuart_all(vdev);
 }
 
 
 /************************************************** vUART Glue Layer **************************************************/
-static driver_watcher_instance *driver_watcher = NULL;
+static driver_ready_request *driver_ready_req = NULL; //set when waiting for the 8250 driver to load
 static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev);
 static int restore_serial8250_isa_port(struct serial8250_16550A_vdev *vdev);
 
@@ -652,10 +1046,22 @@ static int initialize_ttyS(struct serial8250_16550A_vdev *vdev)
     if ((out = alloc_fifos(vdev) != 0))
         return out;
 
-    kmalloc_or_exit_int(vdev->lock, sizeof(spinlock_t));
+    kmalloc_or_exit_int(vdev->lock, sizeof(spinlock_t), RP_MEM_VUART);
     spin_lock_init(vdev->lock);
+    kmalloc_or_exit_int(vdev->rx_lock, sizeof(spinlock_t), RP_MEM_VUART);
+    spin_lock_init(vdev->rx_lock);
+    kmalloc_or_exit_int(vdev->tx_lock, sizeof(spinlock_t), RP_MEM_VUART);
+    spin_lock_init(vdev->tx_lock);
 
-    //virq_* stuff is allocated/freed by enable_/disable_interrupts()
+    init_waitqueue_head(&vdev->rx_space_wq);
+    hrtimer_init(&vdev->rx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    vdev->rx_timer.function = rx_timeout_expired;
+    vdev->rx_timed_out = false;
+    vdev->rx_last_activity = ktime_set(0, 0);
+    if (!vdev->rx_timeout_us)
+        vdev->rx_timeout_us = VUART_RX_TIMEOUT_US;
+
+    //virq_* stuff is managed by enable_/disable_interrupts()
 
     vdev->initialized = true;
     pr_loc_dbg("Initialized ttyS%d vUART", vdev->line);
@@ -676,24 +1082,34 @@ static int deinitialize_ttyS(struct serial8250_16550A_vdev *vdev)
         return -ENODEV;
     }
 
+    //Injectors check the flag under the RX lock, so after this nobody touches the staging ring or re-arms the timer
+    lock_vuart_rx(vdev);
+    vdev->initialized = false;
+    unlock_vuart_rx(vdev);
+
+    //Nobody should be waiting, but if they are they will get -ENXIO. They evaluate their wait condition (which reads
+    // rx_staging) & may call vuart_inject_rx() until they leave, so FIFOs and locks can only go away after that.
+    smp_mb(); //pairs with vuart_inject_rx_wait(): either we see it counted or it sees the device gone
+    wake_up_interruptible_all(&vdev->rx_space_wq);
+    wait_event(vdev->rx_space_wq, atomic_read(&vdev->rx_waiters) == 0);
+
+    hrtimer_cancel(&vdev->rx_timer); //it must be stopped before FIFOs and lock are gone
     if ((out = free_fifos(vdev) != 0))
         return out;
 
-    kfree(vdev->lock);
-    vdev->initialized = false;
+    rp_kfree(vdev->lock, RP_MEM_VUART);
+    rp_kfree(vdev->rx_lock, RP_MEM_VUART);
+    rp_kfree(vdev->tx_lock, RP_MEM_VUART);
     pr_loc_dbg("Deinitialized ttyS%d vUART", vdev->line);
 
     return 0;
 }
 
 /**
- * Watches for the serial8250 driver to load in order to register ports which were added before the driver loaded
+ * Called once the serial8250 driver is ready in order to register ports which were added before the driver loaded
  */
-static driver_watch_notify_result serial8250_ready_watcher(struct device_driver *drv, driver_watch_notify_state event)
+static void serial8250_ready(struct device_driver *drv, void *data)
 {
-    if (unlikely(event != DWATCH_STATE_LIVE))
-        return DWATCH_NOTIFY_CONTINUE;
-
     pr_loc_dbg("%s driver loaded - adding queued ports", UART_DRIVER_NAME);
     kernel_driver_ready = true;
 
@@ -712,80 +1128,101 @@ static driver_watch_notify_result serial8250_ready_watcher(struct device_driver
     }
 
     pr_loc_dbg("Finished processing enqueued ports");
-    return DWATCH_NOTIFY_DONE;
 }
 
 /**
- * Checks the current serial8250 status
+ * Attempt to wait for the serial8250 driver readiness (if needed)
  *
- * @return 0 if not loaded, 1 if loaded, -E on error
- */
-static int probe_driver(void)
-{
-    if (kernel_driver_ready)
-        return 1; //we've already checked the state and confirmed as ready before
-
-    int driver_ready_tristate = is_driver_registered(UART_DRIVER_NAME, NULL);
-    if (driver_ready_tristate < 0) {
-        pr_loc_err("Failed to check %s driver state - error=%d", UART_DRIVER_NAME, driver_ready_tristate);
-        return -EIO;
-    }
-
-    if (driver_ready_tristate == 1)
-        kernel_driver_ready = true;
-
-    return driver_ready_tristate;
-}
-
-/**
- * Attempt to watch for the serial8250 driver readiness (if needed)
+ * Keep in mind that when the driver turns out to be already loaded serial8250_ready() is called before this function
+ * returns, so all queued ports (including the one being added) are already registered.
  *
- * @return 0 if driver is not loaded and a watcher has been set up,
- *         1 if driver is already loaded (and nothing needs to be done),
+ * @return 0 if driver is not loaded and ports will be registered when it loads,
+ *         1 if driver is already loaded,
  *         -E on error
  */
 static int try_wait_for_serial8250_driver(void)
 {
-    int driver_ready_tristate = probe_driver();
-    if (driver_ready_tristate != 0)
-        return driver_ready_tristate; //if the driver is ready (=1) or an error occurred (-E) we don't do anything here
+    if (kernel_driver_ready)
+        return 1; //we've already checked the state and confirmed as ready before
 
-    pr_loc_inf("%s driver is not ready - the port addition will be delayed until the driver loads", UART_DRIVER_NAME);
-    driver_watcher = watch_driver_register(UART_DRIVER_NAME, serial8250_ready_watcher, DWATCH_STATE_LIVE);
+    if (driver_ready_req)
+        return 0; //already waiting
 
-    if (IS_ERR(driver_watcher)) {
-        pr_loc_err("Failed to register driver watcher - no ports can be registered till the driver loads");
-        return PTR_ERR(driver_watcher);
+    //serial8250 always binds to its own ISA platform device right after registering (that's where its probe adds ports
+    // too), so we don't need to override driver_register() to know when it's ready
+    driver_ready_request *req = on_driver_ready(UART_DRIVER_NAME, NULL, DWATCH_STATE_BOUND, serial8250_ready, NULL);
+    if (!req)
+        return 1;
+
+    if (IS_ERR(req)) {
+        pr_loc_err("Failed to wait for %s driver - no ports can be registered till the driver loads (error=%ld)",
+                   UART_DRIVER_NAME, PTR_ERR(req));
+        return PTR_ERR(req);
     }
 
+    pr_loc_inf("%s driver is not ready - the port addition will be delayed until the driver loads", UART_DRIVER_NAME);
+    driver_ready_req = req;
     return 0;
 }
 
 /**
- * Disable the driver watcher if it was set up
+ * Release the driver ready request if it was set up & isn't needed anymore
  *
  * @return 0 on success, -E on error
  */
 static int try_leave_serial8250_driver(void)
 {
-    if (!driver_watcher) //we're only concerned about watching the driver
+    if (!driver_ready_req)
         return 0;
 
-    for_each_vdev() {
-        if (ttySs[line].initialized && !ttySs[line].registered) {
-            pr_loc_dbg("Cannot leave %s driver yet - port %d is still awaiting registration", UART_DRIVER_NAME, line);
-            return 0;
+    if (!kernel_driver_ready) {
+        for_each_vdev() {
+            if (ttySs[line].initialized && !ttySs[line].registered) {
+                pr_loc_dbg("Cannot leave %s driver yet - port %d is still awaiting registration", UART_DRIVER_NAME,
+                           line);
+                return 0;
+            }
         }
     }
 
-    int out = unwatch_driver_register(driver_watcher);
-    driver_watcher = NULL;
+    int out = cancel_driver_ready(driver_ready_req);
+    driver_ready_req = NULL;
+    if (out == -EALREADY) //the driver loaded while we were waiting
+        return 0;
+
     if (out != 0)
-        pr_loc_err("Failed to unwatch driver (error=%d)", out);
+        pr_loc_err("Failed to cancel waiting for %s driver (error=%d)", UART_DRIVER_NAME, out);
 
     return out;
 }
 
+/**
+ * Binds the real 8250 driver port structure to the vdev the driver will call us with for a given line
+ *
+ * The driver doesn't give access to the real uart_port upon adding (it copies the one we pass) and the line it picks
+ * may differ from the one requested (see comment for ttySs), so the port is taken from the shared registry by the line
+ * the driver used. It's only needed to deliver virtual interrupts.
+ */
+static void bind_serial8250_port(int line)
+{
+    if (unlikely(line < 0 || line >= ARRAY_SIZE(ttySs))) {
+        pr_loc_bug("8250 driver registered vUART port as ttyS%d which is not a vUART line", line);
+        return;
+    }
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    struct uart_8250_port *up = get_serial8250_port(line);
+    if (unlikely(IS_ERR(up))) {
+        pr_loc_err("Failed to locate 8250 port for ttyS%d - virtual interrupts will not be delivered (error=%ld)", line,
+                   PTR_ERR(up));
+        return;
+    }
+
+    lock_vuart_oppr(vdev);
+    vdev->up = &up->port;
+    unlock_vuart_oppr(vdev);
+}
+
 /**
  * Asks the Linux 8250 driver to UPDATE properties of a given serial device which matches line & iobase
  *
@@ -815,9 +1252,12 @@ static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
         return driver_ready_tristate;
     }
 
+    if (unlikely(vdev->registered))
+        return 0; //the driver just turned out to be ready and serial8250_ready() registered all queued ports
+
 
     struct uart_8250_port *up;
-    kzalloc_or_exit_int(up, sizeof(struct uart_8250_port));
+    kzalloc_or_exit_int(up, sizeof(struct uart_8250_port), RP_MEM_VUART);
     struct uart_port *port = &up->port;
 
     port->line = vdev->line;
@@ -836,7 +1276,7 @@ static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
     port->regshift = 0;
     port->serial_in = serial_remote_read;
     port->serial_out = serial_remote_write;
-    port->type = PORT_16550A;
+    port->type = (vdev->model == VUART_CHIP_16750) ? PORT_16750 : PORT_16550A; //autoconfig will re-detect it anyway
     up->cur_iotype = 0xFF;
 
     //DO NOT EVEN THINK about assigning "port" top vdev->port!!! serial8250_register_8250_port() uses our passed port to
@@ -850,11 +1290,12 @@ static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
         goto out_free;
     }
     pr_loc_dbg("ttyS%d registered with driver (line=%d)", vdev->line, out);
+    bind_serial8250_port(out);
     out = 0; //serial8250_register_8250_port return serial port line # or -E code
     vdev->registered = true;
 
     out_free:
-    kfree(up);
+    rp_kfree(up, RP_MEM_VUART);
     return out;
 }
 
@@ -878,7 +1319,7 @@ static int restore_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
     }
 
     struct uart_8250_port *up;
-    kzalloc_or_exit_int(up, sizeof(struct uart_8250_port));
+    kzalloc_or_exit_int(up, sizeof(struct uart_8250_port), RP_MEM_VUART);
     struct uart_port *port = &up->port;
 
     port->line = vdev->line;
@@ -904,59 +1345,238 @@ static int restore_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
     out = try_leave_serial8250_driver();
 
     out_free:
-    kfree(up);
+    rp_kfree(up, RP_MEM_VUART);
     return out;
 }
 
-int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int threshold)
+/**
+ * Recomputes the lowest threshold of all subscribers of a given line; you must hold tx_subs_mutex
+ */
+static void update_tx_threshold(struct serial8250_16550A_vdev *vdev)
+{
+    struct vuart_tx_subscriber *sub;
+    int threshold = VUART_THRESHOLD_MAX;
+
+    list_for_each_entry(sub, &tx_subs[vdev->line].list, list) {
+        if (sub->threshold < threshold)
+            threshold = sub->threshold;
+    }
+
+    lock_vuart_tx_oppr(vdev);
+    tx_subs[vdev->line].threshold = threshold;
+    unlock_vuart_tx_oppr(vdev);
+}
+
+/**
+ * Creates & adds a new subscriber for a given line; see vuart_add_tx_subscriber()
+ */
+static vuart_tx_subscriber *add_tx_subscriber(int line, vuart_callback_t *cb, vuart_zc_callback_t *zc_cb, char *buffer,
+                                              int threshold)
+{
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    struct vuart_tx_subscriber *sub;
+
+    if (unlikely(!cb && !zc_cb)) {
+        pr_loc_bug("Invalid TX subscriber for ttyS%d - callback missing", line);
+        return ERR_PTR(-EINVAL);
+    }
+
+    kmalloc_or_exit_ptr(sub, sizeof(struct vuart_tx_subscriber), RP_MEM_VUART);
+    sub->line = vdev->line; //this looks to make no sense BUT it does when serials are swapped
+    sub->fn = cb;
+    sub->zc_fn = zc_cb;
+    sub->buffer = buffer;
+    sub->owns_buffer = false;
+    sub->threshold = threshold;
+
+    if (cb && !buffer) { //consumer wants us to manage the buffer
+        sub->buffer = kmalloc(VUART_FIFO_LEN_MAX, GFP_KERNEL);
+        if (unlikely(!sub->buffer)) {
+            rp_kfree(sub, RP_MEM_VUART);
+            kalloc_error_ptr(sub->buffer, VUART_FIFO_LEN_MAX);
+        }
+        rp_mem_alloced(RP_MEM_VUART, sub->buffer);
+        sub->owns_buffer = true;
+    }
+
+    //This can technically be called during serial port operation - RCU makes sure flush_tx_fifo() sees either the old
+    // or the new list
+    mutex_lock(&tx_subs_mutex);
+    list_add_tail_rcu(&sub->list, &tx_subs[sub->line].list);
+    update_tx_threshold(vdev);
+    if (tx_subs_num++ == 0)
+        rp_static_branch_enable(&tx_subs_present); //may sleep - it cannot be done under the vdev lock
+    mutex_unlock(&tx_subs_mutex);
+
+    pr_loc_dbg("Added %sTX subscriber %p for ttyS%d (line=%d)", zc_cb ? "zero-copy " : "", sub, line, vdev->line);
+    return sub;
+}
+
+/**
+ * Removes subscriber from its line and frees it; you must hold tx_subs_mutex
+ */
+static void remove_tx_subscriber(struct vuart_tx_subscriber *sub)
+{
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(sub->line);
+
+    list_del_rcu(&sub->list);
+    if (tx_subs[sub->line].primary == sub)
+        tx_subs[sub->line].primary = NULL;
+    update_tx_threshold(vdev);
+    if (--tx_subs_num == 0)
+        rp_static_branch_disable(&tx_subs_present);
+
+    synchronize_rcu(); //flush_tx_fifo() may be still delivering data to it
+    if (sub->owns_buffer)
+        rp_kfree(sub->buffer, RP_MEM_VUART);
+    rp_kfree(sub, RP_MEM_VUART);
+}
+
+vuart_tx_subscriber *vuart_add_tx_subscriber(int line, vuart_callback_t *cb, char *buffer, int threshold)
+{
+    validate_isa_line_ptr(line);
+    return add_tx_subscriber(line, cb, NULL, buffer, threshold);
+}
+
+vuart_tx_subscriber *vuart_add_tx_zc_subscriber(int line, vuart_zc_callback_t *cb, int threshold)
+{
+    validate_isa_line_ptr(line);
+    return add_tx_subscriber(line, NULL, cb, NULL, threshold);
+}
+
+int vuart_remove_tx_subscriber(vuart_tx_subscriber *sub)
+{
+    if (unlikely(IS_ERR_OR_NULL(sub))) {
+        pr_loc_bug("Attempted to remove invalid TX subscriber %p", sub);
+        return -EINVAL;
+    }
+
+    pr_loc_dbg("Removing TX subscriber %p for ttyS%d", sub, sub->line);
+    mutex_lock(&tx_subs_mutex);
+    remove_tx_subscriber(sub);
+    mutex_unlock(&tx_subs_mutex);
+
+    return 0;
+}
+
+/**
+ * Removes all subscribers (including the primary one) from a given line
+ */
+static void remove_all_tx_subscribers(struct serial8250_16550A_vdev *vdev)
+{
+    struct vuart_tx_subscriber *sub, *tmp;
+
+    mutex_lock(&tx_subs_mutex);
+    list_for_each_entry_safe(sub, tmp, &tx_subs[vdev->line].list, list) {
+        remove_tx_subscriber(sub);
+    }
+    mutex_unlock(&tx_subs_mutex);
+}
+
+/**
+ * Sets either a regular or zero-copy primary TX callback; see vuart_set_tx_callback() and vuart_set_tx_zc_callback()
+ *
+ * The primary callback is just a subscriber which is managed by the vUART on behalf of the caller (so that simple
+ * consumers don't need to keep a handle).
+ */
+static int set_tx_callback(int line, vuart_callback_t *cb, vuart_zc_callback_t *zc_cb, char *buffer, int threshold)
 {
     validate_isa_line(line);
 
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
-    if (!cb) {
+    line = vdev->line; //this looks to make no sense BUT it does when serials are swapped
+    struct vuart_tx_subscriber *old = tx_subs[line].primary;
+    struct vuart_tx_subscriber *new = NULL;
+
+    if (cb || zc_cb) {
+        pr_loc_dbg("Setting TX callback for for ttyS%d (line=%d)", line, vdev->line);
+        new = add_tx_subscriber(line, cb, zc_cb, buffer, threshold);
+        if (IS_ERR(new))
+            return PTR_ERR(new);
+    } else {
         pr_loc_dbg("Removing TX callback for ttyS%d (line=%d)", line, vdev->line);
-        if (unlikely(!flush_cbs[line])) {
+        if (unlikely(!old)) {
             pr_loc_dbg("Nothing to do - no TX callback set");
             return 0;
         }
+    }
 
-        //We don't really need to lock for that
-        kfree(flush_cbs[line]);
-        flush_cbs[line] = NULL;
+    mutex_lock(&tx_subs_mutex);
+    tx_subs[line].primary = new;
+    if (old)
+        remove_tx_subscriber(old);
+    mutex_unlock(&tx_subs_mutex);
 
-        pr_loc_dbg("Removed TX callback for ttyS%d (line=%d)", line, vdev->line);
-        return 0;
+    return 0;
+}
+
+int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int threshold)
+{
+    return set_tx_callback(line, cb, NULL, buffer, threshold);
+}
+
+int vuart_set_tx_zc_callback(int line, vuart_zc_callback_t *cb, int threshold)
+{
+    return set_tx_callback(line, NULL, cb, NULL, threshold);
+}
+
+int vuart_set_chip_model(int line, vuart_chip_model model)
+{
+    validate_isa_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    if (unlikely(vdev->initialized)) {
+        pr_loc_bug("Cannot change chip model of ttyS%d - it is already added as vUART", line);
+        return -EBUSY;
     }
 
-    pr_loc_dbg("Setting TX callback for for ttyS%d (line=%d)", line, vdev->line);
-    line = vdev->line; //this looks to make no sense BUT it does when serials are swapped
-    if (likely(!flush_cbs[line])) { //if there was already a cb there we don't need to reserve memory
-        kmalloc_or_exit_int(flush_cbs[line], sizeof(struct flush_callback));
+    if (unlikely(model != VUART_CHIP_16550A && model != VUART_CHIP_16750)) {
+        pr_loc_bug("Unknown vUART chip model %d", model);
+        return -EINVAL;
     }
 
-    //This can technically be called during serial port operation so we need to get a lock before we change these or
-    // we risk sending a buffer to a wrong function. That lock may not exist when device is not added yet.
-    lock_vuart_oppr(vdev);
-    flush_cbs[line]->fn = cb;
-    flush_cbs[line]->buffer = buffer;
-    flush_cbs[line]->threshold = threshold;
-    unlock_vuart_oppr(vdev);
+    vdev->model = model;
+    pr_loc_dbg("ttyS%d vUART chip model set to %s", line, (model == VUART_CHIP_16750) ? "16750" : "16550A");
+
+    return 0;
+}
 
-    pr_loc_dbg("Added TX callback for ttyS%d (line=%d)", line, vdev->line);
+int vuart_set_rx_timeout(int line, unsigned int timeout_us)
+{
+    validate_isa_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    if (!timeout_us)
+        timeout_us = VUART_RX_TIMEOUT_US;
+
+    //New value will be used next time the timer is armed
+    lock_vuart_rx_oppr(vdev);
+    vdev->rx_timeout_us = timeout_us;
+    unlock_vuart_rx_oppr(vdev);
 
+    pr_loc_dbg("ttyS%d vUART RX time-out set to %uus", line, timeout_us);
     return 0;
 }
 
+int vuart_set_virq_sched(int policy, int priority, int cpu)
+{
+    int out = vuart_virq_set_sched(policy, priority, cpu);
+    if (unlikely(out == -EOPNOTSUPP))
+        pr_loc_wrn("vIRQ is disabled in this build - there's no dispatcher to set scheduling for");
+
+    return out;
+}
+
 int vuart_inject_rx(int line, const char *buffer, int length)
 {
     validate_isa_line(line);
-    
-    if (unlikely(length > VUART_FIFO_LEN)) {
-        pr_loc_bug("Attempted to inject buffer of %d bytes - it's larger than FIFO size (%d bytes)", length, VUART_FIFO_LEN);
-        return -E2BIG;
-    }
-    
+
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    if (unlikely(length < 0)) {
+        pr_loc_bug("Attempted to inject buffer of invalid length %d", length);
+        return -EINVAL;
+    }
+
     if (unlikely(!vdev->initialized)) {
         pr_loc_bug("Cannot inject data into non-initialized or non-registered device");
         return -ENXIO;
@@ -967,21 +1587,84 @@ int vuart_inject_rx(int line, const char *buffer, int length)
         return 0;
     }
 
-    //No space to put data - not an error per-sen as this can be re-run again
-    if ((vdev->lsr & UART_LSR_DR) && unlikely(kfifo_is_full(vdev->rx_fifo) || unlikely(vdev->mcr & UART_MCR_LOOP)))
-        return 0;
-    
-    
-    int put_bytes = kfifo_in(vdev->rx_fifo, buffer, VUART_FIFO_LEN);
-    if (likely(put_bytes > 0))
-        vdev->lsr |= UART_LSR_DR;
+    //Only the RX side is touched here so the driver can keep transmitting in the meantime
+    lock_vuart_rx(vdev);
+    if (unlikely(!vdev->initialized)) { //deinitialize_ttyS() raced with us
+        unlock_vuart_rx(vdev);
+        return -ENXIO;
+    }
 
-    uart_prdbg("Injected %d bytes into ttyS%d RX", put_bytes, line);
+    //If the staging ring is full we will accept 0 bytes - not an error per-se as this can be re-run again
+    int put_bytes = kfifo_in(vdev->rx_staging, buffer, length);
+    rp_metric_add(&vuart_rx_injected_bytes, put_bytes);
+    refill_rx_fifo(vdev);
+    update_rx_interrupt(vdev);
+    unlock_vuart_rx(vdev);
+
+    uart_prdbg("Injected %d/%d bytes into ttyS%d RX", put_bytes, length, line);
+    lock_vuart(vdev);
     update_interrupts_state(vdev);
+    unlock_vuart(vdev);
 
     return put_bytes;
 }
 
+/**
+ * Does the actual work of vuart_inject_rx_wait(); the caller must be counted in rx_waiters
+ */
+static int inject_rx_wait(struct serial8250_16550A_vdev *vdev, int line, const char *buffer, int length,
+                          long timeout)
+{
+    int done = 0;
+    int out;
+    long wait_out;
+
+    while (done < length) {
+        if ((out = vuart_inject_rx(line, buffer + done, length - done)) < 0)
+            return done ? done : out;
+
+        done += out;
+        if (done == length)
+            break;
+
+        //vuart_inject_rx() returns 0 for unregistered devices - there's nobody who will drain the staging ring
+        if (unlikely(!vdev->registered))
+            break;
+
+        wait_out = wait_event_interruptible_timeout(vdev->rx_space_wq,
+                                                    !vdev->initialized || !kfifo_is_full(vdev->rx_staging), timeout);
+        if (unlikely(wait_out < 0))
+            return done ? done : (int)wait_out; //-ERESTARTSYS
+
+        if (unlikely(!vdev->initialized))
+            return done ? done : -ENXIO;
+
+        if (unlikely(wait_out == 0))
+            return done ? done : -ETIMEDOUT;
+
+        if (timeout != MAX_SCHEDULE_TIMEOUT)
+            timeout = wait_out; //remaining time
+    }
+
+    return done;
+}
+
+int vuart_inject_rx_wait(int line, const char *buffer, int length, long timeout)
+{
+    validate_isa_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    might_sleep();
+
+    atomic_inc(&vdev->rx_waiters);
+    smp_mb(); //pairs with deinitialize_ttyS(): either it sees us counted or we see the device gone
+    int out = inject_rx_wait(vdev, line, buffer, length, timeout);
+    if (atomic_dec_and_test(&vdev->rx_waiters) && unlikely(!vdev->initialized))
+        wake_up_all(&vdev->rx_space_wq); //deinitialize_ttyS() waits for the last one to leave
+
+    return out;
+}
+
 int vuart_add_device(int line)
 {
     pr_loc_dbg("Adding vUART ttyS%d", line);
@@ -991,6 +1674,7 @@ int vuart_add_device(int line)
 
     int out;
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    rp_metrics_register(vuart_metrics, ARRAY_SIZE(vuart_metrics));
 
     if ((out = initialize_ttyS(vdev)) != 0)
         return out;
@@ -1001,9 +1685,15 @@ int vuart_add_device(int line)
     if ((out = vuart_enable_interrupts(vdev)) != 0)
         goto error_restore;
 
+    if ((out = vuart_chardev_add(line)) != 0)
+        goto error_disable;
+
     pr_loc_inf("Added vUART at ttyS%d", line);
     return 0;
 
+    error_disable:
+    vuart_disable_interrupts(vdev);
+
     error_restore:
     restore_serial8250_isa_port(vdev);
 
@@ -1022,10 +1712,12 @@ int vuart_remove_device(int line)
 
     int out;
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
-    if ((out = vuart_disable_interrupts(vdev)) != 0 || (out = deinitialize_ttyS(vdev)) != 0 ||
-        (out = restore_serial8250_isa_port(vdev)) != 0 || (out = vuart_set_tx_callback(line, NULL, NULL, 0)) != 0)
+    if ((out = vuart_chardev_remove(line)) != 0 || (out = vuart_disable_interrupts(vdev)) != 0 ||
+        (out = deinitialize_ttyS(vdev)) != 0 || (out = restore_serial8250_isa_port(vdev)) != 0)
         return out;
 
+    remove_all_tx_subscribers(vdev);
+
     pr_loc_inf("Removed vUART & restored original UART at ttyS%d", line);
 
     return 0;
@@ -9,6 +9,16 @@
  */
 #define VUART_FIFO_LEN 16
 
+/**
+ * Length of the RX/TX FIFO in bytes when the chip is in 64-byte mode (only available with VUART_CHIP_16750)
+ */
+#define VUART_FIFO_LEN_16750 64
+
+/**
+ * Maximum FIFO length across all chip models; buffers passed to the vUART should always be able to accommodate it
+ */
+#define VUART_FIFO_LEN_MAX VUART_FIFO_LEN_16750
+
 /**
  * Defines maximum threshold possible; in practice this means you will never get any THRESHOLD events but only ID:E and
  * FULL ones.
@@ -34,6 +44,21 @@ typedef enum {
     VUART_FLUSH_FULL,
 } vuart_flush_reason ;
 
+/**
+ * Chip models which can be emulated
+ *
+ * All models are register-compatible. The only difference visible to the 8250 driver is the FIFO depth, which it
+ * discovers during port autoconfiguration. Deeper FIFOs mean the driver pushes more bytes per THRE interrupt, so bursts
+ * are delivered using far fewer vIRQs and callbacks.
+ */
+typedef enum {
+    //True National Semiconductors 16550A with 16 bytes FIFOs (default)
+    VUART_CHIP_16550A = 0,
+
+    //TI 16C750 with 64 bytes FIFOs; the driver switches them on via FCR bit 5 (which is only writable with DLAB=1)
+    VUART_CHIP_16750,
+} vuart_chip_model;
+
 /**
  * Represents a callback signature
  *
@@ -44,6 +69,36 @@ typedef enum {
  */
 typedef void (vuart_callback_t)(int line, const char *buffer, unsigned int len, vuart_flush_reason reason);
 
+/**
+ * A direct (read-only) view of a contiguous part of the TX FIFO; see vuart_zc_callback_t
+ */
+struct vuart_tx_segment {
+    const char *data;
+    unsigned int len;
+};
+
+//The FIFO is a ring so its content can wrap around - this gives at most two segments
+#define VUART_TX_MAX_SEGMENTS 2
+
+/**
+ * Represents a zero-copy callback signature
+ *
+ * Instead of getting a copy of data in a buffer the callback gets views directly into the TX FIFO. Data are valid ONLY
+ * during the call (i.e. you must not save the pointers). Your callback should tell how many bytes it consumed (from
+ * the beginning of the first segment). Bytes which weren't consumed will stay in the FIFO and will be offered again
+ * with the next flush (however, if the FIFO is full they will be lost as a transmitter overrun).
+ *
+ * @param line UART# where the data arrived; you can ignore it if you registered only one UART
+ * @param segs Array of nsegs segments; reading them in order gives data in order they were sent
+ * @param nsegs Number of segments (1 to VUART_TX_MAX_SEGMENTS)
+ * @param len Total number of bytes in all segments
+ * @param reason Denotes why the vUART decided to flush the buffer to the callback
+ *
+ * @return number of bytes consumed (up to len)
+ */
+typedef unsigned int (vuart_zc_callback_t)(int line, const struct vuart_tx_segment *segs, unsigned int nsegs,
+                                           unsigned int len, vuart_flush_reason reason);
+
 /**
  * Adds a virtual UART device
  *
@@ -58,6 +113,67 @@ typedef void (vuart_callback_t)(int line, const char *buffer, unsigned int len,
  */
 int vuart_add_device(int line);
 
+/**
+ * Selects the chip model emulated on a given line
+ *
+ * The model is exposed to the 8250 driver when the port is registered, so it must be selected BEFORE calling
+ * vuart_add_device() (all lines default to VUART_CHIP_16550A). The selection is kept after the device is removed.
+ *
+ * @param line UART number, see vuart_add_device()
+ * @param model See vuart_chip_model
+ *
+ * @return 0 on success or -E on error (e.g. -EBUSY when the device has already been added)
+ */
+int vuart_set_chip_model(int line, vuart_chip_model model);
+
+/**
+ * Default receiver time-out (i.e. RX interrupts coalescing window) in microseconds
+ *
+ * A real chip signals time-out after 4 characters time (~350us @ 115200 baud) without RX FIFO activity.
+ */
+#ifndef VUART_RX_TIMEOUT_US
+#define VUART_RX_TIMEOUT_US 350
+#endif
+
+/**
+ * Sets the receiver time-out (coalescing window) for a given line
+ *
+ * The emulated chip honors the RX trigger level set by the driver (FCR bits 6-7) and raises data-ready interrupt only
+ * when the RX FIFO holds at least that many bytes. Data below the trigger level is delivered after the FIFO stays
+ * untouched for the time-out period (character time-out interrupt). Setting a longer window lets the driver drain more
+ * data per interrupt at the expense of latency for short transmissions.
+ *
+ * @param line UART number, see vuart_add_device()
+ * @param timeout_us Time-out in microseconds; 0 restores VUART_RX_TIMEOUT_US
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_set_rx_timeout(int line, unsigned int timeout_us);
+
+//Special values of CPU for vuart_set_virq_sched()
+#define VUART_VIRQ_CPU_ANY (-1) //the dispatcher can run on any CPU (default)
+#define VUART_VIRQ_CPU_FOLLOW (-2) //the dispatcher follows CPUs raising interrupts (i.e. where the 8250 writers run)
+
+/**
+ * Sets scheduling policy, priority, and CPU affinity of the vIRQ dispatcher (shared by all lines)
+ *
+ * By default the dispatcher is a regular SCHED_NORMAL thread allowed to run anywhere. Under heavy load (e.g. RAID
+ * rebuilds) it may not get the CPU for a long time, which delays all vUART traffic and makes consumers (e.g. the PMU
+ * shim) see artificial gaps in transmissions. The settings can be changed at any time: if the dispatcher isn't running
+ * they will be used when it's started.
+ *
+ * With VUART_VIRQ_CPU_FOLLOW the dispatcher is moved to the package (i.e. cores sharing cache) of the CPU which keeps
+ * raising interrupts, so that registers & FIFOs stay hot in cache. It doesn't move on every wakeup to not ping-pong
+ * between CPUs when interrupts are raised from different places.
+ *
+ * @param policy SCHED_NORMAL, SCHED_FIFO, or SCHED_RR
+ * @param priority Real-time priority (1-99) for SCHED_FIFO & SCHED_RR, nice value (-20 to 19) for SCHED_NORMAL
+ * @param cpu CPU number, VUART_VIRQ_CPU_ANY, or VUART_VIRQ_CPU_FOLLOW
+ *
+ * @return 0 on success or -E on error (-EOPNOTSUPP when vIRQ is disabled with VUART_USE_TIMER_FALLBACK)
+ */
+int vuart_set_virq_sched(int policy, int priority, int cpu);
+
 /**
  * Removes a virtual UART device
  *
@@ -73,6 +189,16 @@ int vuart_add_device(int line);
  */
 int vuart_remove_device(int line);
 
+/**
+ * Size of the per-line RX staging ring in bytes (rounded up to a power of 2)
+ *
+ * Data injected with vuart_inject_rx() lands here first and is fed into the emulated RX FIFO as the driver drains it.
+ * Think of it as bytes which are "on the wire" and didn't reach the chip yet.
+ */
+#ifndef VUART_RX_STAGING_LEN
+#define VUART_RX_STAGING_LEN 4096
+#endif
+
 /**
  * Injects data into RX stream of the port
  *
@@ -82,15 +208,36 @@ int vuart_remove_device(int line);
  * the port. So while TX implies "transmission" from the perspective of the chip and the app opening the port it's an
  * RX side. This naming is consistent with what the whole 8250 subsystem uses.
  *
+ * This function never blocks and is safe to call from atomic context. Data of any length can be passed - it is queued
+ * in the staging ring (see VUART_RX_STAGING_LEN) and delivered as the driver reads the port. If the ring doesn't have
+ * enough space only part of the buffer will be accepted; use vuart_inject_rx_wait() if you want to sleep instead.
+ *
  * @param line UART number to replace, e.g. 0 for ttyS0. On systems with inverted UARTs you should use the real one, so
  *             even if ttyS0 points to 2nd physical port this method will ALWAYS use the one corresponding to ttyS*
  * @param buffer Pointer to a buffer where we will read from. There's no assumption as to what the buffer contains.
- * @param length Length to read from the buffer up to VUART_FIFO_LEN
+ * @param length Length to read from the buffer
  *
- * @return 0 on success or -E on error
+ * @return number of bytes accepted (which may be less than length or even 0) or -E on error
  */
 int vuart_inject_rx(int line, const char *buffer, int length);
 
+/**
+ * Injects data into RX stream of the port waiting for space in the staging ring if needed
+ *
+ * This is a blocking variant of vuart_inject_rx(). It sleeps (interruptibly) each time the staging ring is full and is
+ * woken up as the driver drains the port. It CANNOT be called from atomic context. You MUST NOT remove the device while
+ * some thread is waiting here.
+ *
+ * @param line UART number, see vuart_inject_rx()
+ * @param buffer See vuart_inject_rx()
+ * @param length See vuart_inject_rx()
+ * @param timeout Maximum time to wait in jiffies (for all data to be accepted) or MAX_SCHEDULE_TIMEOUT
+ *
+ * @return number of bytes accepted (equal to length unless waiting timed out or was interrupted) or -E on error (when
+ *         no data was accepted)
+ */
+int vuart_inject_rx_wait(int line, const char *buffer, int length, long timeout);
+
 /**
  * Set a function which will be called upon data transmission by the port opener
  *
@@ -103,8 +250,10 @@ int vuart_inject_rx(int line, const char *buffer, int length);
  *         pr_loc_inf("TX @ ttyS%d: |%.*s|", line, len, buffer);
  *     }
  *     //....
- *     char buf[VUART_FIFO_LEN]; //Your buffer should be able to accommodate at least VUART_FIFO_LEN
+ *     char buf[VUART_FIFO_LEN_MAX]; //Your buffer should be able to accommodate at least VUART_FIFO_LEN_MAX
  *     vuart_set_tx_callback(TRY_PORT, dummy_tx_callback, buf, VUART_FIFO_LEN);
+ *     //...or let the vUART manage the buffer for you
+ *     vuart_set_tx_callback(TRY_PORT, dummy_tx_callback, NULL, VUART_FIFO_LEN);
  *
  * WARNING:
  * You callback should be multithreading-aware. It may be called from different contexts. You shouldn't do a lot of work
@@ -115,7 +264,9 @@ int vuart_inject_rx(int line, const char *buffer, int length);
  *             even if ttyS0 points to 2nd physical port this method will ALWAYS use the one corresponding to ttyS*
  * @param cb Function to be called; call it with a NULL ptr to remove callback, see docblock for vuart_callback_t
  * @param buffer A pointer to a buffer where data will be placed. The buffer should be able to accommodate
- *               VUART_FIFO_LEN number of bytes. The buffer you pass will be the same one as passed back during a call
+ *               VUART_FIFO_LEN_MAX number of bytes. The buffer you pass will be the same one as passed back during a call.
+ *               If you pass NULL the vUART will allocate (and later free) a buffer for you; it's only valid during the
+ *               callback.
  * @param threshold a *HINT* how many bytes at minimum should be deposited in the FIFO before callback is called. Keep
  *                  in mind that this is just a hint and you callback may be called sooner (e.g. when a client program
  *                  wrote only a single byte using e.g. echo -n X > /dev/ttyS0).
@@ -123,4 +274,63 @@ int vuart_inject_rx(int line, const char *buffer, int length);
  */
 int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int threshold);
 
+/**
+ * Set a function which will be called upon data transmission by the port opener, without copying the data
+ *
+ * This is a zero-copy alternative to vuart_set_tx_callback() - see vuart_zc_callback_t for details. There can be only
+ * one callback per line: setting a zero-copy callback replaces a regular one and vice-versa.
+ *
+ * @param line UART number, see vuart_set_tx_callback()
+ * @param cb Function to be called; call it with a NULL ptr to remove callback
+ * @param threshold See vuart_set_tx_callback()
+ * @return 0 on success or -E on error
+ */
+int vuart_set_tx_zc_callback(int line, vuart_zc_callback_t *cb, int threshold);
+
+/**
+ * Represents a single TX data subscriber; see vuart_add_tx_subscriber()
+ */
+typedef struct vuart_tx_subscriber vuart_tx_subscriber;
+
+/**
+ * Adds a new TX data subscriber to a given line
+ *
+ * Unlike vuart_set_tx_callback() (which sets "the" callback for a line) any number of subscribers can be added to the
+ * same line. The TX FIFO is drained once and the same data is delivered to all of them. Every subscriber can specify
+ * its own threshold, however since the FIFO is shared it will be flushed as soon as the lowest threshold is met (which
+ * is consistent with the threshold being only a hint).
+ * The callback set with vuart_set_tx_callback()/vuart_set_tx_zc_callback() is simply one of subscribers.
+ *
+ * WARNING: all subscribers are removed when the device is removed (see vuart_remove_device()) - you must not use the
+ * handle afterwards.
+ *
+ * @param line UART number, see vuart_set_tx_callback()
+ * @param cb Function to be called; see vuart_callback_t
+ * @param buffer See vuart_set_tx_callback(); every subscriber must have its own buffer (or pass NULL to get one)
+ * @param threshold See vuart_set_tx_callback()
+ *
+ * @return subscriber handle (to be passed to vuart_remove_tx_subscriber()) or ERR_PTR(-E) on error
+ */
+vuart_tx_subscriber *vuart_add_tx_subscriber(int line, vuart_callback_t *cb, char *buffer, int threshold);
+
+/**
+ * Adds a new zero-copy TX data subscriber to a given line
+ *
+ * See vuart_add_tx_subscriber() & vuart_zc_callback_t. Keep in mind that the number of bytes consumed is only respected
+ * when this is the only subscriber of a given line.
+ *
+ * @return subscriber handle (to be passed to vuart_remove_tx_subscriber()) or ERR_PTR(-E) on error
+ */
+vuart_tx_subscriber *vuart_add_tx_zc_subscriber(int line, vuart_zc_callback_t *cb, int threshold);
+
+/**
+ * Removes a subscriber previously added with vuart_add_tx_subscriber() or vuart_add_tx_zc_subscriber()
+ *
+ * After this function returns the callback is guaranteed to not be running nor to be called anymore. This function may
+ * sleep.
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_remove_tx_subscriber(vuart_tx_subscriber *sub);
+
 #endif //REDPILL_VIRTUAL_UART_H
@@ -0,0 +1,303 @@
+/**
+ * Per-line binary capture of vUART activity, for profiling register round-trips on production boxes
+ *
+ * VUART_DEBUG_LOG shows the same information but it needs a rebuild, floods printk & changes the timing completely.
+ * This is compiled in all the time and costs nothing until it's started at runtime for a given line:
+ *     echo 1 > /sys/kernel/debug/redpill_vuart_capture/ttyS1   <= starts (and resets) the capture
+ *     echo 0 > /sys/kernel/debug/redpill_vuart_capture/ttyS1   <= stops it (the buffer is kept for reading)
+ *     cat /sys/kernel/debug/redpill_vuart_capture/ttyS1 > trace.bin
+ * Registers reads & writes, IIR transitions, TX flushes and vIRQ raises & dispatches are recorded with get_cycles()
+ * timestamps into a ring of VUART_CAPTURE_RECORDS (the oldest records are overwritten).
+ *
+ * Recording is lockless (capture points run under various vUART locks or none at all): a record is reserved with a
+ * single atomic increment and its seq is set to VUART_CAPTURE_SEQ_BUSY first & written last, so that dumping a running
+ * capture can skip records which are being overwritten. Rings are RCU-protected only so that they can be freed on
+ * unload.
+ *
+ * Dump format (native/little endian): struct vuart_cap_header followed by records (struct vuart_cap_rec) from the
+ * oldest to the newest.
+ */
+#include "vuart_capture.h"
+#include "../../common.h"
+
+#if RP_DEBUGFS_ENABLED
+#include "../../config/uart_defs.h" //UART_NR, STD_COMX_DEV_NAME
+#include <linux/atomic.h> //atomic_t, atomic_inc_return()
+#include <linux/rcupdate.h> //rcu_read_lock(), rcu_dereference(), synchronize_rcu()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+#include <linux/vmalloc.h> //vmalloc(), vfree()
+#include <linux/debugfs.h> //debugfs_create_dir(), debugfs_create_file(), debugfs_remove_recursive()
+#include <linux/timex.h> //get_cycles()
+#include <asm/tsc.h> //tsc_khz
+
+#ifndef VUART_CAPTURE_RECORDS
+#define VUART_CAPTURE_RECORDS 4096 //per line; must be a power of 2
+#endif
+
+#define VUART_CAPTURE_SEQ_BUSY (~0U) //seq of a slot being written (or never written); no reader ever expects it
+#define VUART_CAPTURE_DEBUGFS_DIR "redpill_vuart_capture"
+#define VUART_CAPTURE_MAGIC 0x43565052 //"RPVC"
+#define VUART_CAPTURE_VERSION 1
+
+struct vuart_cap_header {
+    u32 magic;
+    u8 version;
+    u8 line;
+    u16 rec_size; //sizeof(struct vuart_cap_rec)
+    u32 cycles_khz; //to convert timestamps to time
+    u32 num; //records following the header
+    u32 total; //records captured (the ones not dumped were overwritten or were being written)
+};
+
+struct vuart_capture_ring {
+    bool active; //records are only added when it's set
+    atomic_t next; //seq of the next record
+    struct vuart_cap_rec recs[VUART_CAPTURE_RECORDS];
+};
+
+RP_DEFINE_STATIC_KEY_FALSE(vuart_capture_active);
+static struct vuart_capture_ring __rcu *rings[UART_NR] = { NULL }; //allocated on the first start & kept until unload
+static unsigned int rings_active = 0; //protected by capture_mutex
+static DEFINE_MUTEX(capture_mutex); //serializes starting & stopping captures
+static struct dentry *debugfs_dir = NULL;
+
+void __vuart_capture(int line, vuart_cap_type type, u8 reg, u8 value)
+{
+    if (unlikely(line < 0 || line >= UART_NR))
+        return;
+
+    rcu_read_lock();
+    struct vuart_capture_ring *ring = rcu_dereference(rings[line]);
+    if (likely(ring) && ACCESS_ONCE(ring->active)) {
+        u32 seq = (u32)atomic_inc_return(&ring->next) - 1;
+        struct vuart_cap_rec *rec = &ring->recs[seq & (VUART_CAPTURE_RECORDS - 1)];
+
+        ACCESS_ONCE(rec->seq) = VUART_CAPTURE_SEQ_BUSY; //the old seq of the slot must not be valid while it's written
+        smp_wmb();
+        rec->cycles = get_cycles();
+        rec->type = type;
+        rec->reg = reg;
+        rec->value = value;
+        rec->cpu = (u8)raw_smp_processor_id();
+        smp_wmb();
+        ACCESS_ONCE(rec->seq) = seq;
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * Starts (or restarts from scratch) capture of a line
+ *
+ * @return 0 on success or -E on error
+ */
+static int start_capture(int line)
+{
+    int out = 0;
+
+    mutex_lock(&capture_mutex);
+    struct vuart_capture_ring *ring = rcu_dereference_protected(rings[line], lockdep_is_held(&capture_mutex));
+    if (ring && ring->active)
+        goto out_unlock;
+
+    bool new_ring = !ring;
+    if (new_ring) {
+        if (unlikely(!(ring = vmalloc(sizeof(*ring))))) {
+            pr_loc_crt("Failed to allocate vUART capture buffer for ttyS%d", line);
+            out = -ENOMEM;
+            goto out_unlock;
+        }
+        rp_mem_add(RP_MEM_VUART, sizeof(*ring));
+        ring->active = false;
+    }
+
+    //Nobody writes to an existing ring - it was stopped and a grace period has passed since (see stop_capture())
+    memset(ring->recs, 0xff, sizeof(ring->recs)); //VUART_CAPTURE_SEQ_BUSY everywhere - nothing is valid yet
+    atomic_set(&ring->next, 0);
+    if (new_ring)
+        rcu_assign_pointer(rings[line], ring);
+
+    smp_wmb(); //the reset must be visible before any capture point sees the ring as active
+    ACCESS_ONCE(ring->active) = true;
+    if (rings_active++ == 0)
+        rp_static_branch_enable(&vuart_capture_active);
+    pr_loc_inf("Started vUART capture of ttyS%d (%d records)", line, VUART_CAPTURE_RECORDS);
+
+    out_unlock:
+    mutex_unlock(&capture_mutex);
+    return out;
+}
+
+static void stop_capture(int line)
+{
+    mutex_lock(&capture_mutex);
+    struct vuart_capture_ring *ring = rcu_dereference_protected(rings[line], lockdep_is_held(&capture_mutex));
+    if (!ring || !ring->active) {
+        mutex_unlock(&capture_mutex);
+        return;
+    }
+
+    ACCESS_ONCE(ring->active) = false;
+    if (--rings_active == 0)
+        rp_static_branch_disable(&vuart_capture_active);
+    synchronize_rcu(); //capture points which saw it active may still be writing
+    mutex_unlock(&capture_mutex);
+
+    pr_loc_inf("Stopped vUART capture of ttyS%d after %u records", line, (u32)atomic_read(&ring->next));
+}
+
+/**
+ * Copies records of a ring in order, skipping ones which are being written
+ *
+ * @return number of records copied
+ */
+static u32 snapshot_ring(const struct vuart_capture_ring *ring, struct vuart_cap_rec *dst, u32 *total)
+{
+    u32 next = (u32)atomic_read(&ring->next);
+    u32 first = next > VUART_CAPTURE_RECORDS ? next - VUART_CAPTURE_RECORDS : 0;
+    u32 num = 0;
+
+    *total = next;
+    for (u32 seq = first; seq != next; ++seq) {
+        const struct vuart_cap_rec *rec = &ring->recs[seq & (VUART_CAPTURE_RECORDS - 1)];
+        if (unlikely(seq == VUART_CAPTURE_SEQ_BUSY) || ACCESS_ONCE(rec->seq) != seq) //the former is lost after a wrap
+            continue;
+
+        smp_rmb();
+        dst[num] = *rec;
+        smp_rmb();
+        if (ACCESS_ONCE(rec->seq) == seq && dst[num].seq == seq)
+            ++num;
+    }
+
+    return num;
+}
+
+struct capture_dump {
+    size_t len;
+    char data[];
+};
+
+/**
+ * Dumps are taken when the file is opened, so that they're consistent across multiple read() calls
+ */
+static int capture_open(struct inode *inode, struct file *file)
+{
+    int line = (int)(long)inode->i_private;
+    struct capture_dump *dump = vmalloc(sizeof(*dump) + sizeof(struct vuart_cap_header) +
+                                        sizeof(struct vuart_cap_rec) * VUART_CAPTURE_RECORDS);
+    if (unlikely(!dump))
+        return -ENOMEM;
+
+    struct vuart_cap_header *hdr = (struct vuart_cap_header *)dump->data;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = VUART_CAPTURE_MAGIC;
+    hdr->version = VUART_CAPTURE_VERSION;
+    hdr->line = line;
+    hdr->rec_size = sizeof(struct vuart_cap_rec);
+    hdr->cycles_khz = tsc_khz;
+
+    rcu_read_lock();
+    struct vuart_capture_ring *ring = rcu_dereference(rings[line]);
+    if (ring)
+        hdr->num = snapshot_ring(ring, (struct vuart_cap_rec *)(hdr + 1), &hdr->total);
+    rcu_read_unlock();
+
+    dump->len = sizeof(*hdr) + sizeof(struct vuart_cap_rec) * hdr->num;
+    file->private_data = dump;
+
+    return 0;
+}
+
+static ssize_t capture_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct capture_dump *dump = file->private_data;
+    return simple_read_from_buffer(buf, count, ppos, dump->data, dump->len);
+}
+
+static ssize_t capture_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    int line = (int)(long)file_inode(file)->i_private;
+    unsigned int enable;
+    int out = kstrtouint_from_user(buf, count, 10, &enable);
+    if (out != 0)
+        return out;
+
+    if (enable)
+        out = start_capture(line);
+    else
+        stop_capture(line);
+
+    return out != 0 ? out : count;
+}
+
+static int capture_release(struct inode *inode, struct file *file)
+{
+    vfree(file->private_data);
+    return 0;
+}
+
+static const struct file_operations capture_fops = {
+    .owner = THIS_MODULE,
+    .open = capture_open,
+    .read = capture_read,
+    .write = capture_write,
+    .llseek = default_llseek,
+    .release = capture_release,
+};
+
+int register_vuart_capture(void)
+{
+    char name[16];
+
+    if (unlikely(debugfs_dir)) {
+        pr_loc_bug("vUART capture is already registered");
+        return -EEXIST;
+    }
+
+    BUILD_BUG_ON_NOT_POWER_OF_2(VUART_CAPTURE_RECORDS);
+    debugfs_dir = debugfs_create_dir(VUART_CAPTURE_DEBUGFS_DIR, NULL);
+    if (IS_ERR_OR_NULL(debugfs_dir)) {
+        int out = debugfs_dir ? PTR_ERR(debugfs_dir) : -ENOMEM;
+        debugfs_dir = NULL;
+        pr_loc_err("Failed to create debugfs directory %s - error=%d", VUART_CAPTURE_DEBUGFS_DIR, out);
+        return out;
+    }
+
+    for (long line = 0; line < UART_NR; ++line) {
+        snprintf(name, sizeof(name), STD_COMX_DEV_NAME "%ld", line);
+        struct dentry *file = debugfs_create_file(name, 0600, debugfs_dir, (void *)line, &capture_fops);
+        if (IS_ERR_OR_NULL(file)) {
+            int out = file ? PTR_ERR(file) : -ENOMEM;
+            pr_loc_err("Failed to create debugfs entry %s/%s - error=%d", VUART_CAPTURE_DEBUGFS_DIR, name, out);
+            debugfs_remove_recursive(debugfs_dir);
+            debugfs_dir = NULL;
+            return out;
+        }
+    }
+
+    pr_loc_dbg("vUART capture available in debugfs as %s/", VUART_CAPTURE_DEBUGFS_DIR);
+    return 0;
+}
+
+int unregister_vuart_capture(void)
+{
+    debugfs_remove_recursive(debugfs_dir); //it's a noop with NULL
+    debugfs_dir = NULL;
+
+    for (int line = 0; line < UART_NR; ++line) {
+        stop_capture(line);
+
+        mutex_lock(&capture_mutex);
+        struct vuart_capture_ring *ring = rcu_dereference_protected(rings[line], lockdep_is_held(&capture_mutex));
+        RCU_INIT_POINTER(rings[line], NULL);
+        mutex_unlock(&capture_mutex);
+
+        if (ring) { //stop_capture() waited for writers; readers (debugfs) are gone
+            vfree(ring);
+            rp_mem_add(RP_MEM_VUART, -(s64)sizeof(*ring));
+        }
+    }
+
+    return 0;
+}
+#endif //RP_DEBUGFS_ENABLED
@@ -0,0 +1,65 @@
+#ifndef REDPILL_VUART_CAPTURE_H
+#define REDPILL_VUART_CAPTURE_H
+
+#include "../stealth.h" //RP_DEBUGFS_ENABLED
+#include <linux/types.h> //u8, u32, u64
+
+/**
+ * Binary capture of what the 8250 driver does to a vUART line (see vuart_capture.c)
+ *
+ * Every capture point costs a single NOP unless the capture is running on at least one line.
+ */
+typedef enum {
+    VUART_CAP_REG_READ = 1, //reg=register offset, value=value read
+    VUART_CAP_REG_WRITE = 2, //reg=register offset, value=value written
+    VUART_CAP_IIR = 3, //reg=previous IIR, value=new IIR
+    VUART_CAP_FLUSH = 4, //reg=vuart_flush_reason, value=number of bytes in TX FIFO
+    VUART_CAP_VIRQ_RAISE = 5, //value=1 if the vIRQ dispatcher had to be woken up, 0 if it was already pending/polling
+    VUART_CAP_VIRQ_DISPATCH = 6, //value=IIR passed to the serial8250 interrupt handler
+} vuart_cap_type;
+
+struct vuart_cap_rec {
+    u64 cycles; //get_cycles() when the event happened
+    u32 seq; //number of the record since the capture started
+    u8 type; //vuart_cap_type
+    u8 reg;
+    u8 value;
+    u8 cpu;
+};
+
+#if RP_DEBUGFS_ENABLED
+#include "../../compat/static_key_compat.h" //RP_DECLARE_STATIC_KEY_FALSE, rp_static_branch_unlikely()
+
+RP_DECLARE_STATIC_KEY_FALSE(vuart_capture_active); //whether any line is being captured
+
+#define vuart_capture_on() rp_static_branch_unlikely(&vuart_capture_active)
+
+/**
+ * Records an event on a line (if it's being captured); it's safe to call in any context
+ */
+void __vuart_capture(int line, vuart_cap_type type, u8 reg, u8 value);
+
+#define vuart_capture(line, type, reg, value) \
+    do { if (vuart_capture_on()) __vuart_capture(line, type, reg, value); } while(0)
+
+/**
+ * Creates debugfs entries controlling & exposing captures of all lines
+ *
+ * @return 0 on success or -E on error
+ */
+int register_vuart_capture(void);
+
+/**
+ * Stops all captures, frees their buffers & removes debugfs entries; it must be called after all vUARTs are removed
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_vuart_capture(void);
+#else //RP_DEBUGFS_ENABLED
+#define vuart_capture_on() false
+#define vuart_capture(line, type, reg, value) do { } while(0)
+static inline int register_vuart_capture(void) { return 0; }
+static inline int unregister_vuart_capture(void) { return 0; }
+#endif //RP_DEBUGFS_ENABLED
+
+#endif //REDPILL_VUART_CAPTURE_H
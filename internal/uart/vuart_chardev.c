@@ -0,0 +1,366 @@
+/**
+ * Exposes vUART lines to userspace via mmap()-able rings
+ *
+ * See vuart_chardev.h for the layout of the mapping and the protocol. This file is only compiled-in when VUART_CHARDEV
+ * is defined (see common.h).
+ *
+ * INTERNALS
+ * Each line has a single vmalloc_user() area: [control page][TX ring][RX ring]. The TX side is fed by a zero-copy TX
+ * subscriber registered with the vUART, so data flows FIFO => TX ring without any intermediate buffer. The RX side is
+ * drained by a work item (kicked by userspace via ioctl) which injects data using the non-blocking vuart_inject_rx().
+ * If the vUART staging ring is full the work simply reschedules itself.
+ * Indexes written by userspace are never trusted - they're only used after being clamped to the ring size, so a
+ * misbehaving process can only corrupt its own data stream.
+ *
+ * The area must outlive the line as long as someone has the device opened or mapped - this is tracked via a kref.
+ */
+#include "../../common.h" //can set VUART_CHARDEV
+#include "vuart_chardev.h" //must be included after common.h
+#ifdef VUART_CHARDEV
+#include "virtual_uart.h"
+#include "../../config/uart_defs.h" //UART_NR
+#include <linux/miscdevice.h> //misc_register()
+#include <linux/fs.h> //file_operations
+#include <linux/mm.h> //vm_area_struct
+#include <linux/vmalloc.h> //vmalloc_user(), remap_vmalloc_range()
+#include <linux/poll.h> //poll_wait()
+#include <linux/wait.h> //wait_queue_head_t
+#include <linux/workqueue.h> //delayed_work
+#include <linux/kref.h> //kref
+#include <linux/mutex.h> //chardevs_mutex
+
+#define CTRL_PAGE_LEN PAGE_SIZE
+#define AREA_LEN (CTRL_PAGE_LEN + (VUART_CHARDEV_RING_LEN * 2))
+#define RX_RETRY_DELAY 1 //jiffies
+#define ring_mask(idx) ((idx) & (VUART_CHARDEV_RING_LEN - 1))
+
+struct vuart_chardev {
+    int line;
+    char name[16];
+    struct miscdevice misc;
+    struct kref refs;
+    bool removed;
+    atomic_t opened; //only a single opener is allowed as rings are SPSC
+
+    void *area;
+    struct vuart_chardev_ctrl *ctrl;
+    char *tx_ring;
+    char *rx_ring;
+
+    vuart_tx_subscriber *tx_sub;
+    wait_queue_head_t wq;
+    struct delayed_work rx_work;
+};
+
+static struct vuart_chardev *chardevs[UART_NR] = { NULL };
+static DEFINE_MUTEX(chardevs_mutex);
+
+static void free_chardev(struct kref *kref)
+{
+    struct vuart_chardev *cdev = container_of(kref, struct vuart_chardev, refs);
+
+    pr_loc_dbg("Freeing vUART chardev for ttyS%d", cdev->line);
+    cancel_delayed_work_sync(&cdev->rx_work); //userspace could've kicked it after the line was removed
+    vfree(cdev->area);
+    rp_mem_add(RP_MEM_VUART, -AREA_LEN);
+    rp_kfree(cdev, RP_MEM_VUART);
+}
+
+#define get_chardev(cdev) kref_get(&(cdev)->refs)
+#define put_chardev(cdev) kref_put(&(cdev)->refs, free_chardev)
+
+/**
+ * Copies data from the TX FIFO directly into the TX ring; called by the vUART with the port lock held
+ */
+static unsigned int chardev_tx_callback(int line, const struct vuart_tx_segment *segs, unsigned int nsegs,
+                                        unsigned int len, vuart_flush_reason reason)
+{
+    struct vuart_chardev *cdev = chardevs[line];
+    if (unlikely(!cdev))
+        return len; //device is being created or removed - nobody is listening anyway
+
+    struct vuart_chardev_ctrl *ctrl = cdev->ctrl;
+    u32 head = ctrl->tx_head;
+    u32 used = head - ACCESS_ONCE(ctrl->tx_tail);
+    if (unlikely(used > VUART_CHARDEV_RING_LEN))
+        used = VUART_CHARDEV_RING_LEN; //userspace wrote garbage - treat ring as full
+
+    unsigned int space = VUART_CHARDEV_RING_LEN - used;
+    unsigned int copied = 0;
+    smp_mb(); //read tail before overwriting space it just released
+
+    for (int i = 0; i < nsegs && copied < space; i++) {
+        unsigned int seg_len = min(segs[i].len, space - copied);
+        unsigned int pos = ring_mask(head + copied);
+        unsigned int first = min(seg_len, (unsigned int)VUART_CHARDEV_RING_LEN - pos);
+
+        memcpy(cdev->tx_ring + pos, segs[i].data, first);
+        memcpy(cdev->tx_ring, segs[i].data + first, seg_len - first);
+        copied += seg_len;
+    }
+
+    if (unlikely(copied < len)) {
+        ctrl->tx_dropped += len - copied;
+        pr_loc_wrn_rl("vUART chardev TX ring for ttyS%d is full - dropped %u bytes", line, len - copied);
+    }
+
+    smp_wmb(); //data must be visible before the new head
+    ACCESS_ONCE(ctrl->tx_head) = head + copied;
+    wake_up_interruptible(&cdev->wq);
+
+    return len; //we never keep data in the FIFO - the wire doesn't wait either
+}
+
+/**
+ * Moves data from the RX ring into the vUART
+ */
+static void chardev_rx_work(struct work_struct *work)
+{
+    struct vuart_chardev *cdev = container_of(to_delayed_work(work), struct vuart_chardev, rx_work);
+    struct vuart_chardev_ctrl *ctrl = cdev->ctrl;
+    u32 tail = ctrl->rx_tail;
+    u32 avail = ACCESS_ONCE(ctrl->rx_head) - tail;
+    int out;
+
+    if (unlikely(avail > VUART_CHARDEV_RING_LEN)) {
+        pr_loc_wrn("Invalid RX head in vUART chardev ttyS%d - discarding RX ring", cdev->line);
+        ACCESS_ONCE(ctrl->rx_tail) = ACCESS_ONCE(ctrl->rx_head);
+        goto out_wake;
+    }
+    smp_rmb(); //read head before data
+
+    while (avail) {
+        unsigned int pos = ring_mask(tail);
+        unsigned int chunk = min(avail, (u32)VUART_CHARDEV_RING_LEN - pos);
+
+        out = vuart_inject_rx(cdev->line, cdev->rx_ring + pos, chunk);
+        if (unlikely(out < 0)) {
+            pr_loc_err("Failed to inject RX data from chardev into ttyS%d - error=%d", cdev->line, out);
+            break;
+        }
+
+        tail += out;
+        avail -= out;
+        if (out < chunk) { //vUART is full - try again later
+            schedule_delayed_work(&cdev->rx_work, RX_RETRY_DELAY);
+            break;
+        }
+    }
+
+    smp_mb(); //finish reading data before releasing space
+    ACCESS_ONCE(ctrl->rx_tail) = tail;
+
+    out_wake:
+    wake_up_interruptible(&cdev->wq);
+}
+
+static int chardev_open(struct inode *inode, struct file *file)
+{
+    struct vuart_chardev *cdev = NULL;
+    int minor = iminor(inode);
+
+    mutex_lock(&chardevs_mutex);
+    for (int i = 0; i < UART_NR; i++) {
+        if (chardevs[i] && chardevs[i]->misc.minor == minor) {
+            cdev = chardevs[i];
+            get_chardev(cdev);
+            break;
+        }
+    }
+    mutex_unlock(&chardevs_mutex);
+
+    if (unlikely(!cdev))
+        return -ENODEV;
+
+    if (atomic_cmpxchg(&cdev->opened, 0, 1) != 0) {
+        put_chardev(cdev);
+        return -EBUSY;
+    }
+
+    file->private_data = cdev;
+    return nonseekable_open(inode, file);
+}
+
+static int chardev_release(struct inode *inode, struct file *file)
+{
+    struct vuart_chardev *cdev = file->private_data;
+
+    atomic_set(&cdev->opened, 0);
+    put_chardev(cdev);
+
+    return 0;
+}
+
+static void chardev_vma_open(struct vm_area_struct *vma)
+{
+    get_chardev((struct vuart_chardev *)vma->vm_private_data);
+}
+
+static void chardev_vma_close(struct vm_area_struct *vma)
+{
+    put_chardev((struct vuart_chardev *)vma->vm_private_data);
+}
+
+static const struct vm_operations_struct chardev_vm_ops = {
+    .open = chardev_vma_open,
+    .close = chardev_vma_close,
+};
+
+static int chardev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct vuart_chardev *cdev = file->private_data;
+    int out;
+
+    if (vma->vm_pgoff != 0 || (vma->vm_end - vma->vm_start) > AREA_LEN)
+        return -EINVAL;
+
+    if ((out = remap_vmalloc_range(vma, cdev->area, 0)) != 0)
+        return out;
+
+    vma->vm_private_data = cdev;
+    vma->vm_ops = &chardev_vm_ops;
+    chardev_vma_open(vma);
+
+    return 0;
+}
+
+static unsigned int chardev_poll(struct file *file, poll_table *wait)
+{
+    struct vuart_chardev *cdev = file->private_data;
+    struct vuart_chardev_ctrl *ctrl = cdev->ctrl;
+    unsigned int mask = 0;
+
+    poll_wait(file, &cdev->wq, wait);
+
+    if (unlikely(cdev->removed))
+        return POLLHUP | POLLERR;
+
+    if (ACCESS_ONCE(ctrl->tx_head) != ACCESS_ONCE(ctrl->tx_tail))
+        mask |= POLLIN | POLLRDNORM;
+
+    if ((u32)(ACCESS_ONCE(ctrl->rx_head) - ACCESS_ONCE(ctrl->rx_tail)) < VUART_CHARDEV_RING_LEN)
+        mask |= POLLOUT | POLLWRNORM;
+
+    return mask;
+}
+
+static long chardev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct vuart_chardev *cdev = file->private_data;
+
+    if (cmd != VUART_CHARDEV_IOC_RX_KICK)
+        return -ENOTTY;
+
+    if (unlikely(cdev->removed))
+        return -ENODEV;
+
+    schedule_delayed_work(&cdev->rx_work, 0);
+    return 0;
+}
+
+static const struct file_operations chardev_fops = {
+    .owner = THIS_MODULE,
+    .open = chardev_open,
+    .release = chardev_release,
+    .mmap = chardev_mmap,
+    .poll = chardev_poll,
+    .unlocked_ioctl = chardev_ioctl,
+    .compat_ioctl = chardev_ioctl,
+    .llseek = no_llseek,
+};
+
+int vuart_chardev_add(int line)
+{
+    int out;
+    struct vuart_chardev *cdev;
+
+    if (unlikely(line < 0 || line >= UART_NR))
+        return -EINVAL;
+
+    if (unlikely(chardevs[line])) {
+        pr_loc_bug("vUART chardev for ttyS%d already exists", line);
+        return -EEXIST;
+    }
+
+    pr_loc_dbg("Creating vUART chardev for ttyS%d", line);
+    kzalloc_or_exit_int(cdev, sizeof(struct vuart_chardev), RP_MEM_VUART);
+    kref_init(&cdev->refs);
+    cdev->line = line;
+    init_waitqueue_head(&cdev->wq);
+    INIT_DELAYED_WORK(&cdev->rx_work, chardev_rx_work);
+
+    cdev->area = vmalloc_user(AREA_LEN); //zeroed
+    if (unlikely(!cdev->area)) {
+        rp_kfree(cdev, RP_MEM_VUART);
+        kalloc_error_int(cdev->area, AREA_LEN);
+    }
+    rp_mem_add(RP_MEM_VUART, AREA_LEN); //vmalloc() has no ksize() but it's page-aligned anyway
+    cdev->ctrl = cdev->area;
+    cdev->tx_ring = (char *)cdev->area + CTRL_PAGE_LEN;
+    cdev->rx_ring = cdev->tx_ring + VUART_CHARDEV_RING_LEN;
+    cdev->ctrl->tx_size = cdev->ctrl->rx_size = VUART_CHARDEV_RING_LEN;
+    cdev->ctrl->tx_offset = CTRL_PAGE_LEN;
+    cdev->ctrl->rx_offset = CTRL_PAGE_LEN + VUART_CHARDEV_RING_LEN;
+
+    snprintf(cdev->name, sizeof(cdev->name), VUART_CHARDEV_NAME_FMT, line);
+    cdev->misc.minor = MISC_DYNAMIC_MINOR;
+    cdev->misc.name = cdev->name;
+    cdev->misc.fops = &chardev_fops;
+
+    mutex_lock(&chardevs_mutex);
+    chardevs[line] = cdev;
+    mutex_unlock(&chardevs_mutex);
+
+    cdev->tx_sub = vuart_add_tx_zc_subscriber(line, chardev_tx_callback, VUART_FIFO_LEN_MAX);
+    if (IS_ERR(cdev->tx_sub)) {
+        out = PTR_ERR(cdev->tx_sub);
+        pr_loc_err("Failed to subscribe to ttyS%d TX - error=%d", line, out);
+        goto error_unpublish;
+    }
+
+    if ((out = misc_register(&cdev->misc)) != 0) {
+        pr_loc_err("Failed to register misc device %s - error=%d", cdev->name, out);
+        goto error_unsubscribe;
+    }
+
+    pr_loc_inf("Created vUART chardev /dev/%s", cdev->name);
+    return 0;
+
+    error_unsubscribe:
+    vuart_remove_tx_subscriber(cdev->tx_sub);
+
+    error_unpublish:
+    mutex_lock(&chardevs_mutex);
+    chardevs[line] = NULL;
+    mutex_unlock(&chardevs_mutex);
+    put_chardev(cdev);
+
+    return out;
+}
+
+int vuart_chardev_remove(int line)
+{
+    if (unlikely(line < 0 || line >= UART_NR))
+        return -EINVAL;
+
+    struct vuart_chardev *cdev = chardevs[line];
+    if (!cdev)
+        return 0; //nothing to do
+
+    pr_loc_dbg("Removing vUART chardev /dev/%s", cdev->name);
+    misc_deregister(&cdev->misc);
+
+    cdev->removed = true;
+    vuart_remove_tx_subscriber(cdev->tx_sub); //after this returns the TX callback isn't running
+    cancel_delayed_work_sync(&cdev->rx_work);
+    wake_up_interruptible(&cdev->wq);
+
+    mutex_lock(&chardevs_mutex);
+    chardevs[line] = NULL;
+    mutex_unlock(&chardevs_mutex);
+    put_chardev(cdev); //if userspace still holds it (open or mmap) it will be freed when it lets go
+
+    pr_loc_inf("Removed vUART chardev for ttyS%d", line);
+    return 0;
+}
+#endif //VUART_CHARDEV
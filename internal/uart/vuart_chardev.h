@@ -0,0 +1,62 @@
+#ifndef REDPILL_VUART_CHARDEV_H
+#define REDPILL_VUART_CHARDEV_H
+
+#include <linux/types.h> //__u32
+#include <linux/ioctl.h> //_IO
+
+/**
+ * Userspace bridge for vUARTs (enabled with VUART_CHARDEV in common.h)
+ *
+ * Every vUART line gets a misc device /dev/vuart_ttySN which can be mmap()ed. The mapping consists of one control page
+ * (struct vuart_chardev_ctrl) followed by two single-producer-single-consumer rings:
+ *  - TX ring: data sent by the port opener (i.e. what would be visible on the wire); kernel produces, userspace consumes
+ *  - RX ring: data to be received by the port opener; userspace produces, kernel consumes
+ *
+ * All indexes are free-running u32 counters - to get the position in the ring use (idx & (size-1)). Every side only
+ * writes its own index. After producing into the RX ring userspace should call ioctl(VUART_CHARDEV_IOC_RX_KICK). The
+ * poll() reports POLLIN when TX ring has data and POLLOUT when RX ring has space.
+ *
+ * If the TX ring is full data are dropped (a real UART doesn't wait for the other side either) and tx_dropped is
+ * incremented.
+ */
+
+#ifndef VUART_CHARDEV_RING_LEN
+#define VUART_CHARDEV_RING_LEN 16384 //must be a power of 2 and a multiple of PAGE_SIZE
+#endif
+
+#define VUART_CHARDEV_NAME_FMT "vuart_ttyS%d"
+#define VUART_CHARDEV_IOC_MAGIC 'v'
+#define VUART_CHARDEV_IOC_RX_KICK _IO(VUART_CHARDEV_IOC_MAGIC, 1)
+
+struct vuart_chardev_ctrl {
+    __u32 tx_head; //written by kernel
+    __u32 tx_tail; //written by userspace
+    __u32 rx_head; //written by userspace
+    __u32 rx_tail; //written by kernel
+    __u32 tx_size; //size of TX ring (read-only)
+    __u32 rx_size; //size of RX ring (read-only)
+    __u32 tx_offset; //offset of TX ring from the start of mapping (read-only)
+    __u32 rx_offset; //offset of RX ring from the start of mapping (read-only)
+    __u32 tx_dropped; //number of TX bytes lost due to full ring (written by kernel)
+};
+
+#ifdef VUART_CHARDEV
+/**
+ * Creates misc device for a given vUART line; vUART must be already added
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_chardev_add(int line);
+
+/**
+ * Removes misc device for a given vUART line (if it exists)
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_chardev_remove(int line);
+#else //VUART_CHARDEV
+#define vuart_chardev_add(dummy) (0)
+#define vuart_chardev_remove(dummy) (0)
+#endif //VUART_CHARDEV
+
+#endif //REDPILL_VUART_CHARDEV_H
@@ -1,32 +1,72 @@
 #ifndef REDPILL_VUART_INTERNAL_H
 #define REDPILL_VUART_INTERNAL_H
 
+#include "virtual_uart.h" //vuart_chip_model, VUART_FIFO_LEN*
 #include <linux/spinlock.h>
-#ifndef VUART_USE_TIMER_FALLBACK
-#include <linux/wait.h>
-#endif
+#include <linux/compiler.h> //READ_ONCE()
+#include <linux/serial_reg.h> //UART_LSR_*
+#include <linux/hrtimer.h> //rx_timer
+#include <linux/wait.h> //rx_space_wq
+#include <linux/atomic.h> //rx_waiters
 
 
-//Lock/unlock vdev for registries operations
+//Lock/unlock vdev for registries operations; see serial8250_16550A_vdev for what each lock protects
 #define lock_vuart(vdev) spin_lock_irqsave((vdev)->lock, (vdev)->lock_flags);
 #define unlock_vuart(vdev) spin_unlock_irqrestore((vdev)->lock, (vdev)->lock_flags);
+#define lock_vuart_rx(vdev) spin_lock_irqsave((vdev)->rx_lock, (vdev)->rx_lock_flags);
+#define unlock_vuart_rx(vdev) spin_unlock_irqrestore((vdev)->rx_lock, (vdev)->rx_lock_flags);
+#define lock_vuart_tx(vdev) spin_lock_irqsave((vdev)->tx_lock, (vdev)->tx_lock_flags);
+#define unlock_vuart_tx(vdev) spin_unlock_irqrestore((vdev)->tx_lock, (vdev)->tx_lock_flags);
+
+//Locks MUST be taken in the TX => RX => registers order; this takes all of them (e.g. for registers writes)
+#define lock_vuart_all(vdev) lock_vuart_tx(vdev); lock_vuart_rx(vdev); lock_vuart(vdev);
+#define unlock_vuart_all(vdev) unlock_vuart(vdev); unlock_vuart_rx(vdev); unlock_vuart_tx(vdev);
 
 //In some circumstances operations may be performed on the chip before or after the chip is initialized. If it is
 // initialized we need a lock first; otherwise we do not. This is a shortcut for this opportunistic/conditional locking.
 #define lock_vuart_oppr(vdev) if ((vdev)->initialized) { lock_vuart(vdev); }
 #define unlock_vuart_oppr(vdev) if ((vdev)->initialized) { unlock_vuart(vdev); }
+#define lock_vuart_rx_oppr(vdev) if ((vdev)->initialized) { lock_vuart_rx(vdev); }
+#define unlock_vuart_rx_oppr(vdev) if ((vdev)->initialized) { unlock_vuart_rx(vdev); }
+#define lock_vuart_tx_oppr(vdev) if ((vdev)->initialized) { lock_vuart_tx(vdev); }
+#define unlock_vuart_tx_oppr(vdev) if ((vdev)->initialized) { unlock_vuart_tx(vdev); }
+#define lock_vuart_all_oppr(vdev) if ((vdev)->initialized) { lock_vuart_all(vdev); }
+#define unlock_vuart_all_oppr(vdev) if ((vdev)->initialized) { unlock_vuart_all(vdev); }
+
+//LSR bits owned by each side of the chip; OE can be caused by both so it's kept separately (see lsr_oe)
+#define VUART_LSR_RX_BITS (UART_LSR_DR | UART_LSR_PE | UART_LSR_FE | UART_LSR_BI)
+#define VUART_LSR_TX_BITS (UART_LSR_THRE | UART_LSR_TEMT)
+#define VUART_LSR_OE_RX 0 //bit # in lsr_oe
+#define VUART_LSR_OE_TX 1 //bit # in lsr_oe
 
-#define validate_isa_line(line) \
-    if (unlikely((line) > SERIAL8250_LAST_ISA_LINE)) { \
+//LSR as seen by the driver; it's composed from both halves so it can be read without any lock
+#define vuart_lsr(vdev) \
+    (READ_ONCE((vdev)->rx_lsr) | READ_ONCE((vdev)->tx_lsr) | (READ_ONCE((vdev)->lsr_oe) ? UART_LSR_OE : 0))
+
+//Current depth of FIFOs; 16750 only offers 64 bytes when the driver enabled it (FCR bit 5)
+#define vuart_fifo_len(vdev) \
+    (((vdev)->model == VUART_CHIP_16750 && ((vdev)->fcr & UART_FCR7_64BYTE)) ? VUART_FIFO_LEN_16750 : VUART_FIFO_LEN)
+
+#define __validate_isa_line(line, err) \
+    if (unlikely((line) < 0 || (line) > SERIAL8250_LAST_ISA_LINE)) { \
         pr_loc_bug("%s failed - requested line %d but kernel supports only %d", __FUNCTION__, line, \
                    SERIAL8250_LAST_ISA_LINE); \
-        return -EINVAL; \
+        return err; \
     }
+#define validate_isa_line(line) __validate_isa_line(line, -EINVAL)
+#define validate_isa_line_ptr(line) __validate_isa_line(line, ERR_PTR(-EINVAL))
 
 /**
  * An emulated 16550A chips internal state
  *
  * See http://caro.su/msx/ocm_de1/16550.pdf for details; registers are on page 9 (Table 2)
+ *
+ * Locking is split so that RX & TX traffic don't serialize on each other (e.g. vuart_inject_rx() vs. driver writes):
+ *  - rx_lock protects RX FIFO & staging, RHR, rx_lsr, rx_int, and the character time-out state
+ *  - tx_lock protects TX FIFO, THR, and tx_lsr
+ *  - lock protects IIR (i.e. its composition in update_interrupts_state()) and the vIRQ state
+ * All other registers are written with all three locks held, so holding any of them is enough to read one. IIR is
+ * published as a whole so it can be read without a lock, same as LSR (see vuart_lsr()).
  */
 struct serial8250_16550A_vdev {
     //Port properties
@@ -34,39 +74,55 @@ struct serial8250_16550A_vdev {
     u16			iobase;
     u8			irq;
     unsigned int         baud;
+    vuart_chip_model model; //see vuart_set_chip_model()
 
-    //The 8250 driver port structure - it will be populated as soon as 8250 gives us the real pointer
+    //The 8250 driver port structure - it will be populated from the ports registry once the port is registered
     struct uart_port *up;
 
-    //Chip emulated FIFOs
+    //Chip emulated FIFOs (always allocated for VUART_FIFO_LEN_MAX; the usable length is given by vuart_fifo_len())
     struct kfifo *tx_fifo; //character to be sent (aka what we've got from the OS)
     struct kfifo *rx_fifo; //characters received (aka what we want the OS to get from us)
+    struct kfifo *rx_staging; //characters injected which didn't fit in rx_fifo yet (see vuart_inject_rx())
+    wait_queue_head_t rx_space_wq; //woken up when rx_staging is drained into rx_fifo
+    atomic_t rx_waiters; //callers of vuart_inject_rx_wait(); deinitialize_ttyS() waits for them before freeing FIFOs
 
-    //Chip registries (they're considered volatile but there's a spinlock protecting them)
+    //Chip registries (they're considered volatile but there are spinlocks protecting them)
     u8 rhr; //Receiver Holding Register (characters received)
     u8 thr; //Transmitter Holding Register (characters REQUESTED to be sent, TSR will contain these to be TRANSMITTED)
     u8 ier; //Interrupt Enable Register
     u8 iir; //Interrupt ID Register (same as ISR/Interrupt Status Register)
-    u8 fcr; //FIFO Control Register (not really used but holds values written to it)
+    u8 fcr; //FIFO Control Register (mostly holds values written to it; on 16750 it also selects the FIFO depth)
     u8 lcr; //Line Control Register (not really used but holds values written to it)
     u8 mcr; //Modem Control Register (used to control autoflow)
-    u8 lsr; //Line Status Register
+    u8 rx_lsr; //Line Status Register bits of the receiver (VUART_LSR_RX_BITS)
+    u8 tx_lsr; //Line Status Register bits of the transmitter (VUART_LSR_TX_BITS)
+    unsigned long lsr_oe; //overrun flags (VUART_LSR_OE_*); modified atomically as both sides & LSR reads change them
     u8 msr; //Modem Status Register
     u8 scr; //SCratch pad Register (in the original docs refered to as SPR, but linux uses SCR name)
     u8 dll; //Divisor Lat Least significant byte (not really used but holds values written to it)
     u8 dlm; //Divisor Lat Most significant byte (not really used but holds values written to it; also called DLH)
     u8 psd; //Prescaler Division (not really used but holds values written to it)
 
+    //Receiver time-out (aka CTI) emulation; see update_rx_interrupt()
+    struct hrtimer rx_timer; //fires when data sits in RX FIFO below the trigger level for rx_timeout_us
+    unsigned int rx_timeout_us; //coalescing window; see vuart_set_rx_timeout()
+    bool rx_timed_out:1; //whether the timer fired since the last character was received or read
+    ktime_t rx_last_activity; //when a character last entered or left RX FIFO; see rx_timeout_expired()
+    u8 rx_int; //RX interrupt due (if any) as last computed by update_rx_interrupt()
+
     //Some operations (e.g. FIFO access) must be locked
     bool initialized:1;
     bool registered:1; //whether the vdev is actually registered with 8250 subsystem
     spinlock_t *lock;
     unsigned long lock_flags;
+    spinlock_t *rx_lock;
+    unsigned long rx_lock_flags;
+    spinlock_t *tx_lock;
+    unsigned long tx_lock_flags;
 
 #ifndef VUART_USE_TIMER_FALLBACK
-    //We emulate (i.e. self-trigger) interrupts on threads
-    struct task_struct *virq_thread; //where fake interrupt code is executed
-    wait_queue_head_t *virq_queue; //wait queue used to put thread to sleep
+    //We emulate (i.e. self-trigger) interrupts on a shared dispatcher thread (see vuart_virtual_irq.c)
+    bool virq_active:1; //whether the line is serviced by the vIRQ dispatcher
 #endif
 };
 
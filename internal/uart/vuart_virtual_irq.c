@@ -3,17 +3,153 @@
 #include "vuart_virtual_irq.h"
 #include "vuart_internal.h"
 #include "../../common.h"
+#include "../../config/uart_defs.h" //UART_NR
 #include "../../debug/debug_vuart.h"
+#include "vuart_capture.h" //vuart_capture()
 #include <linux/serial_reg.h> //UART_* consts
 #include <linux/kthread.h> //running vIRQ thread
 #include <linux/wait.h> //wait queue handling (init_waitqueue_head etc.)
+#include <linux/mutex.h> //virq_mutex, virq_dispatch_mutex
+#include <linux/bitops.h> //test_and_clear_bit, for_each_set_bit
 #include <linux/serial_8250.h> //serial8250_handle_irq
+#include <linux/sched.h> //sched_setscheduler_nocheck(), set_user_nice(), set_cpus_allowed_ptr()
+#include <linux/sched/rt.h> //MAX_RT_PRIO
+#include <linux/cpumask.h> //cpumask_of(), cpu_possible_mask
+#include <linux/topology.h> //topology_core_cpumask()
 
 //Default name of the thread for vIRQ
 #ifndef VUART_THREAD_FMT
 #define VUART_THREAD_FMT "vuart/%d-ttyS%d"
 #endif
 
+//Max number of dispatch rounds executed in polling mode before the dispatcher yields the CPU; see virq_thread()
+#ifndef VUART_VIRQ_POLL_BUDGET
+#define VUART_VIRQ_POLL_BUDGET 64
+#endif
+
+//Number of consecutive wakeups raised from outside of the dispatcher CPUs before it moves; see follow_raising_cpu()
+#ifndef VUART_VIRQ_FOLLOW_WAKEUPS
+#define VUART_VIRQ_FOLLOW_WAKEUPS 8
+#endif
+
+/**
+ * All vIRQs are dispatched from a single thread
+ *
+ * Lines with pending interrupts are marked in virq_pending bitmap (by vdev->line) and the thread services all of them
+ * in one go. This way a burst hitting multiple lines at once is handled in a single scheduling slot, and we don't keep a
+ * sleeping thread for every virtual port.
+ */
+static struct task_struct *virq_thread_task = NULL; //dispatcher thread; started with first line & stopped with last
+static DECLARE_WAIT_QUEUE_HEAD(virq_queue); //wait queue used to put the dispatcher to sleep
+static DECLARE_BITMAP(virq_pending, UART_NR); //lines which requested the interrupt handler to be called
+static struct serial8250_16550A_vdev *virq_vdevs[UART_NR] = { NULL }; //lines serviced by the dispatcher
+static unsigned int virq_lines_active = 0; //number of non-NULL entries in virq_vdevs
+static DEFINE_MUTEX(virq_mutex); //protects starting/stopping of the dispatcher & virq_vdevs modifications
+static DEFINE_MUTEX(virq_dispatch_mutex); //held while an interrupt handler for any of the lines is executing
+static bool virq_polling = false; //dispatcher is awake & polling; new interrupts don't need to wake it up
+static int virq_sched_policy = SCHED_NORMAL; //see vuart_virq_set_sched(); modified under virq_mutex
+static int virq_sched_priority = 0; //RT priority or nice value, depending on virq_sched_policy
+static int virq_sched_cpu = VUART_VIRQ_CPU_ANY; //CPU# or VUART_VIRQ_CPU_*
+static int virq_raised_cpu = -1; //CPU which raised the last interrupt; only tracked with VUART_VIRQ_CPU_FOLLOW
+#ifdef RPDBG_VUART_BENCH
+static struct vuart_virq_stats virq_stats = { 0 }; //only modified by the dispatcher thread
+#define virq_stat_add(field, val) virq_stats.field += (val)
+
+void vuart_virq_get_stats(struct vuart_virq_stats *stats)
+{
+    stats->wakeups = ACCESS_ONCE(virq_stats.wakeups);
+    stats->dispatches = ACCESS_ONCE(virq_stats.dispatches);
+}
+#else
+#define virq_stat_add(field, val) //noop
+#endif
+
+void vuart_virq_schedule(struct serial8250_16550A_vdev *vdev)
+{
+    //This is called from update_interrupts_state() with the vdev lock held - it MUST NOT sleep
+    if (unlikely(ACCESS_ONCE(virq_sched_cpu) == VUART_VIRQ_CPU_FOLLOW))
+        ACCESS_ONCE(virq_raised_cpu) = smp_processor_id(); //we're under a spinlock so it cannot change
+
+    //When the dispatcher is polling it will pick up the bit without being woken up (that's the whole point of polling)
+    if (!test_and_set_bit(vdev->line, virq_pending) && !ACCESS_ONCE(virq_polling)) {
+        wake_up_interruptible(&virq_queue);
+        vuart_capture(vdev->line, VUART_CAP_VIRQ_RAISE, 0, 1);
+    } else {
+        vuart_capture(vdev->line, VUART_CAP_VIRQ_RAISE, 0, 0);
+    }
+}
+
+/**
+ * Executes interrupt handlers for all lines marked as pending (a single dispatch round)
+ *
+ * @return number of lines serviced
+ */
+static unsigned int dispatch_pending_lines(void)
+{
+    struct serial8250_16550A_vdev *vdev;
+    unsigned int serviced = 0;
+
+    mutex_lock(&virq_dispatch_mutex);
+    for (int line = 0; line < UART_NR; ++line) {
+        if (!test_and_clear_bit(line, virq_pending))
+            continue;
+
+        vdev = virq_vdevs[line];
+        if (unlikely(!vdev)) //vIRQ was disabled for the line after the interrupt was scheduled
+            continue;
+
+        if (unlikely(!vdev->up)) {
+            pr_loc_bug("Cannot call serial8250 interrupt handler for ttyS%d - port not bound (yet?)", line);
+            continue;
+        }
+
+        uart_prdbg("Calling serial8250 interrupt handler for ttyS%d", line);
+        vuart_capture(line, VUART_CAP_VIRQ_DISPATCH, 0, vdev->iir);
+        serial8250_handle_irq(vdev->up, vdev->iir);
+        ++serviced;
+    }
+    mutex_unlock(&virq_dispatch_mutex);
+    virq_stat_add(dispatches, serviced);
+
+    return serviced;
+}
+
+/**
+ * Moves the dispatcher (i.e. the current thread) closer to the CPU raising interrupts; see VUART_VIRQ_CPU_FOLLOW
+ *
+ * The dispatcher is allowed to run on the whole package of the raising CPU, so it shares cache with the writer without
+ * competing with it for the very same CPU. It only moves after VUART_VIRQ_FOLLOW_WAKEUPS consecutive wakeups from
+ * outside of its current CPUs.
+ *
+ * @param misses consecutive wakeups raised outside of the dispatcher CPUs so far
+ */
+static void follow_raising_cpu(unsigned int *misses)
+{
+    int cpu = ACCESS_ONCE(virq_raised_cpu);
+    if (cpu < 0 || cpumask_test_cpu(cpu, tsk_cpus_allowed(current))) {
+        *misses = 0;
+        return;
+    }
+
+    if (++*misses < VUART_VIRQ_FOLLOW_WAKEUPS)
+        return;
+
+    //vuart_virq_set_sched() may be changing the affinity right now (and stop_virq_thread() waits for us with the mutex
+    // held) - we will try again with the next wakeup
+    if (!mutex_trylock(&virq_mutex))
+        return;
+
+    *misses = 0;
+    if (likely(virq_sched_cpu == VUART_VIRQ_CPU_FOLLOW)) {
+        int out = set_cpus_allowed_ptr(current, topology_core_cpumask(cpu));
+        if (unlikely(out != 0))
+            pr_loc_wrn("Failed to move vIRQ dispatcher closer to CPU%d (error=%d)", cpu, out);
+        else
+            uart_prdbg("vIRQ dispatcher moved to the package of CPU%d", cpu);
+    }
+    mutex_unlock(&virq_mutex);
+}
+
 /**
  * Function running on a separate kernel thread responsible for simulating the IRQ call (normally done via hardware
  * interrupt triggering CPU to invoke Linux IRQ subsystem)
@@ -21,21 +157,29 @@
  * There's no sane way to trigger IRQs in the low range used by 8250 UARTs. A pure asm call of "int $4" will result in a
  * crash (yes, we did try first ;)). So instead of hacking around the kernel we simply used the 8250 public interface to
  * trigger interrupt routines and implemented a small IRQ handling subsystem on our own.
- * @param data
- * @return
+ *
+ * Calling the 8250 handler always results in registers being read, which in turn recalculates IIR and re-marks the line
+ * as pending if there's still something to do. This mimics a level-triggered interrupt line.
+ *
+ * The dispatcher works in a hybrid mode (similar to NAPI in network drivers): when sleeping it's woken up by the first
+ * interrupt (sparse traffic = vIRQ), then it switches to polling and keeps servicing lines without any wakeups for as
+ * long as there's something pending (sustained burst = polling). Every VUART_VIRQ_POLL_BUDGET rounds it yields the
+ * CPU so that a never-ending stream doesn't starve others. As soon as a round finds nothing to do it goes back to
+ * interrupt mode and sleeps.
  */
 static int virq_thread(void *data)
 {
     allow_signal(SIGKILL);
 
     int out = 0;
-    struct serial8250_16550A_vdev *vdev = data;
+    unsigned int rounds;
+    unsigned int follow_misses = 0;
 
-    uart_prdbg("%s started for ttyS%d pid=%d", __FUNCTION__, vdev->line, current->pid);
+    uart_prdbg("%s started pid=%d", __FUNCTION__, current->pid);
     while(likely(!kthread_should_stop())) {
-        wait_event_interruptible(*vdev->virq_queue, !(vdev->iir & UART_IIR_NO_INT) || unlikely(kthread_should_stop()));
+        wait_event_interruptible(virq_queue, !bitmap_empty(virq_pending, UART_NR) || unlikely(kthread_should_stop()));
         if (unlikely(signal_pending(current))) {
-            uart_prdbg("%s started for ttyS%d pid=%d received signal", __FUNCTION__, vdev->line, current->pid);
+            uart_prdbg("%s pid=%d received signal", __FUNCTION__, current->pid);
             out = -EPIPE;
             break;
         }
@@ -43,85 +187,156 @@ static int virq_thread(void *data)
         if (unlikely(kthread_should_stop()))
             break;
 
-        if (unlikely(!vdev->up)) {
-            pr_loc_bug("Cannot call serial8250 interrupt handler - port not captured (yet?)");
-            continue;
-        }
+        virq_stat_add(wakeups, 1);
+        if (unlikely(ACCESS_ONCE(virq_sched_cpu) == VUART_VIRQ_CPU_FOLLOW))
+            follow_raising_cpu(&follow_misses);
 
-        uart_prdbg("Calling serial8250 interrupt handler");
-        serial8250_handle_irq(vdev->up, vdev->iir);
+        ACCESS_ONCE(virq_polling) = true;
+        rounds = 0;
+        do {
+            dispatch_pending_lines();
+
+            if (++rounds >= VUART_VIRQ_POLL_BUDGET) {
+                uart_prdbg("vIRQ poll budget exhausted - yielding");
+                rounds = 0;
+                cond_resched();
+            }
+        } while (!bitmap_empty(virq_pending, UART_NR) && likely(!kthread_should_stop()));
+
+        //Back to interrupt mode; anything marked after this point will wake us up, while anything marked between the
+        // last round and here will be seen by wait_event_interruptible() condition check
+        ACCESS_ONCE(virq_polling) = false;
+        smp_mb();
     }
-    uart_prdbg("%s stopped for ttyS%d pid=%d exit=%d", __FUNCTION__, vdev->line, current->pid, out);
+    uart_prdbg("%s stopped pid=%d exit=%d", __FUNCTION__, current->pid, out);
 
-    //that can lead to a small memory leak for virq_queue if thread is killed outisde disable_interrupts() but this
+    //If the thread was killed outside of vuart_disable_interrupts() all lines are left without interrupts. This
     // shouldn't normally happen unless something goes horribly wrong
-    vdev->virq_thread = NULL;
+    virq_thread_task = NULL;
 
     return out;
 }
 
-int vuart_enable_interrupts(struct serial8250_16550A_vdev *vdev)
+/**
+ * Applies scheduling settings (see vuart_virq_set_sched()) to the dispatcher thread; you must hold virq_mutex
+ *
+ * @return 0 on success, -E on error
+ */
+static int apply_virq_sched(struct task_struct *task)
 {
     int out;
-    pr_loc_dbg("Enabling vIRQ for ttyS%d", vdev->line);
-    lock_vuart(vdev);
+    struct sched_param param = { .sched_priority = (virq_sched_policy == SCHED_NORMAL) ? 0 : virq_sched_priority };
 
-    if (unlikely(!vdev->initialized)) {
-        pr_loc_bug("ttyS%d is not initialized as vUART", vdev->line);
-        out = -ENODEV;
-        goto error_unlock_free;
+    if ((out = sched_setscheduler_nocheck(task, virq_sched_policy, &param)) != 0) {
+        pr_loc_err("Failed to set vIRQ dispatcher scheduling policy=%d prio=%d (error=%d)", virq_sched_policy,
+                   virq_sched_priority, out);
+        return out;
     }
 
-    if (unlikely(vuart_virq_active(vdev))) {
-        pr_loc_bug("Interrupts are already enabled & scheduled for ttyS%d", vdev->line);
-        out = -EBUSY;
-        goto error_unlock_free;
-    }
+    if (virq_sched_policy == SCHED_NORMAL)
+        set_user_nice(task, virq_sched_priority);
 
-    if (!(vdev->virq_queue = kmalloc(sizeof(wait_queue_head_t), GFP_KERNEL)) ||
-        !(vdev->virq_thread = kmalloc(sizeof(struct task_struct), GFP_KERNEL))) {
-        out = -ENOMEM;
-        pr_loc_crt("kernel memory alloc failure - tried to reserve memory for vIRQ structures");
-        goto error_unlock_free;
+    //With VUART_VIRQ_CPU_FOLLOW the dispatcher starts anywhere & narrows it down on its own (see follow_raising_cpu())
+    if ((out = set_cpus_allowed_ptr(task, (virq_sched_cpu >= 0) ? cpumask_of(virq_sched_cpu) : cpu_possible_mask))) {
+        pr_loc_err("Failed to set vIRQ dispatcher CPU affinity cpu=%d (error=%d)", virq_sched_cpu, out);
+        return out;
     }
 
-    init_waitqueue_head(vdev->virq_queue);
-    unlock_vuart(vdev); //we can safely unlock after reserving memory but before starting thread (so we're not atomic)
+    return 0;
+}
+
+/**
+ * Starts the dispatcher thread if it's not running yet; you must hold virq_mutex
+ */
+static int start_virq_thread(struct serial8250_16550A_vdev *vdev)
+{
+    if (virq_thread_task)
+        return 0;
+
+    bitmap_zero(virq_pending, UART_NR);
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-extra-args"
-    //VUART_THREAD_FMT can resolve to anonymized version without line or even IRQ#
-    vdev->virq_thread = kthread_run(virq_thread, vdev, VUART_THREAD_FMT, vdev->irq, vdev->line);
+    //VUART_THREAD_FMT can resolve to anonymized version without line or even IRQ#; the thread is named after the first
+    // line which enabled vIRQ
+    struct task_struct *task = kthread_create(virq_thread, NULL, VUART_THREAD_FMT, vdev->irq, vdev->line);
 #pragma GCC diagnostic pop
-    if (IS_ERR(vdev->virq_thread)) {
-        out = PTR_ERR(vdev->virq_thread);
+    if (IS_ERR(task)) {
         pr_loc_bug("Failed to start vIRQ thread");
-        goto error_free;
+        return PTR_ERR(task);
     }
-    pr_loc_dbg("vIRQ fully enabled for for ttyS%d", vdev->line);
 
+    //Scheduling is set before the thread gets to run; failing to do so isn't fatal as the dispatcher still works
+    if (apply_virq_sched(task) != 0)
+        pr_loc_wrn("vIRQ dispatcher will run with default scheduling");
+    wake_up_process(task);
+
+    virq_thread_task = task;
     return 0;
+}
 
-error_unlock_free:
-    unlock_vuart(vdev);
+/**
+ * Stops the dispatcher thread if it's running; you must hold virq_mutex
+ */
+static int stop_virq_thread(void)
+{
+    if (!virq_thread_task)
+        return 0;
 
-error_free:
-    if (vdev->virq_queue) {
-        kfree(vdev->virq_queue);
-        vdev->virq_queue = NULL;
+    int out = kthread_stop(virq_thread_task);
+    if (out < 0) {
+        pr_loc_bug("Failed to stop vIRQ thread");
+        return out;
     }
-    if (vdev->virq_thread) {
-        kfree(vdev->virq_thread);
-        vdev->virq_thread = NULL;
+
+    virq_thread_task = NULL;
+    return 0;
+}
+
+int vuart_enable_interrupts(struct serial8250_16550A_vdev *vdev)
+{
+    int out;
+    pr_loc_dbg("Enabling vIRQ for ttyS%d", vdev->line);
+    mutex_lock(&virq_mutex);
+
+    if (unlikely(!vdev->initialized)) {
+        pr_loc_bug("ttyS%d is not initialized as vUART", vdev->line);
+        out = -ENODEV;
+        goto out_unlock;
     }
+
+    if (unlikely(vuart_virq_active(vdev))) {
+        pr_loc_bug("Interrupts are already enabled & scheduled for ttyS%d", vdev->line);
+        out = -EBUSY;
+        goto out_unlock;
+    }
+
+    if ((out = start_virq_thread(vdev)) != 0)
+        goto out_unlock;
+
+    virq_vdevs[vdev->line] = vdev;
+    ++virq_lines_active;
+
+    lock_vuart(vdev);
+    vdev->virq_active = true;
+    unlock_vuart(vdev);
+
+    //If something was already pending before vIRQ got enabled we need to let the driver know
+    if (!(vdev->iir & UART_IIR_NO_INT))
+        vuart_virq_schedule(vdev);
+
+    pr_loc_dbg("vIRQ fully enabled for for ttyS%d (lines serviced: %u)", vdev->line, virq_lines_active);
+
+    out_unlock:
+    mutex_unlock(&virq_mutex);
     return out;
 }
 
 int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev)
 {
-    int out;
+    int out = 0;
     pr_loc_dbg("Disabling vIRQ for ttyS%d", vdev->line);
-    lock_vuart(vdev);
+    mutex_lock(&virq_mutex);
 
     if (unlikely(!vdev->initialized)) {
         pr_loc_bug("ttyS%d is not initialized as vUART", vdev->line);
@@ -135,19 +350,54 @@ int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev)
         goto out_unlock;
     }
 
-    out = kthread_stop(vdev->virq_thread);
-    if (out < 0) {
-        pr_loc_bug("Failed to stop vIRQ thread");
-        goto out_unlock;
-    }
+    lock_vuart(vdev);
+    vdev->virq_active = false;
+    unlock_vuart(vdev);
 
-    kfree(vdev->virq_thread);
-    vdev->virq_thread = NULL;
-    pr_loc_dbg("vIRQ disabled for ttyS%d", vdev->line);
+    //Make sure the dispatcher isn't running the handler for this line while we take it away
+    mutex_lock(&virq_dispatch_mutex);
+    virq_vdevs[vdev->line] = NULL;
+    clear_bit(vdev->line, virq_pending);
+    mutex_unlock(&virq_dispatch_mutex);
+
+    if (--virq_lines_active == 0)
+        out = stop_virq_thread();
+
+    pr_loc_dbg("vIRQ disabled for ttyS%d (lines serviced: %u)", vdev->line, virq_lines_active);
 
     out_unlock:
-    unlock_vuart(vdev);
+    mutex_unlock(&virq_mutex);
+    return out;
+}
 
-    return 0;
+int vuart_virq_set_sched(int policy, int priority, int cpu)
+{
+    if (unlikely(policy != SCHED_NORMAL && policy != SCHED_FIFO && policy != SCHED_RR)) {
+        pr_loc_err("Invalid vIRQ dispatcher scheduling policy %d", policy);
+        return -EINVAL;
+    }
+
+    if (policy == SCHED_NORMAL ? (priority < -20 || priority > 19) : (priority < 1 || priority > MAX_RT_PRIO - 1)) {
+        pr_loc_err("Invalid vIRQ dispatcher priority %d for policy %d", priority, policy);
+        return -EINVAL;
+    }
+
+    if (unlikely(cpu < VUART_VIRQ_CPU_FOLLOW || (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_possible(cpu))))) {
+        pr_loc_err("Invalid vIRQ dispatcher CPU %d", cpu);
+        return -EINVAL;
+    }
+
+    int out = 0;
+    mutex_lock(&virq_mutex);
+    virq_sched_policy = policy;
+    virq_sched_priority = priority;
+    ACCESS_ONCE(virq_raised_cpu) = -1;
+    ACCESS_ONCE(virq_sched_cpu) = cpu;
+    if (virq_thread_task)
+        out = apply_virq_sched(virq_thread_task);
+    mutex_unlock(&virq_mutex);
+
+    pr_loc_dbg("vIRQ dispatcher scheduling set to policy=%d prio=%d cpu=%d", policy, priority, cpu);
+    return out;
 }
-#endif
\ No newline at end of file
+#endif
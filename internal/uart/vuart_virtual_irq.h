@@ -1,20 +1,49 @@
 #ifndef REDPILL_VUART_VIRTUAL_IRQ_H
 #define REDPILL_VUART_VIRTUAL_IRQ_H
 
+/**
+ * Counters of the vIRQ dispatcher activity; only gathered in benchmark builds (see debug/debug_vuart_bench.c)
+ */
+struct vuart_virq_stats {
+    unsigned long wakeups; //how many times the dispatcher was woken up from sleep
+    unsigned long dispatches; //how many times the serial8250 interrupt handler was called
+};
+
 #ifdef VUART_USE_TIMER_FALLBACK
 #define vuart_virq_supported() 0
 #define vuart_virq_wake_up(dummy) //noop
 #define vuart_enable_interrupts(dummy) (0)
 #define vuart_disable_interrupts(dummy) (0)
+#define vuart_virq_set_sched(policy, priority, cpu) (-EOPNOTSUPP)
+#define vuart_virq_get_stats(stats) memset((stats), 0, sizeof(struct vuart_virq_stats))
 
 #else //VUART_USE_TIMER_FALLBACK
 #include "vuart_internal.h"
 
 #define vuart_virq_supported() 1
-#define vuart_virq_active(vdev) (!!(vdev)->virq_thread)
-#define vuart_virq_wake_up(vdev) if (vuart_virq_active(vdev)) { wake_up_interruptible(vdev->virq_queue); }
+#define vuart_virq_active(vdev) ((vdev)->virq_active)
+#define vuart_virq_wake_up(vdev) if (vuart_virq_active(vdev)) { vuart_virq_schedule(vdev); }
+
+/**
+ * Marks line as having a pending interrupt & wakes up the shared vIRQ dispatcher; safe to call in atomic context
+ */
+void vuart_virq_schedule(struct serial8250_16550A_vdev *vdev);
 int vuart_enable_interrupts(struct serial8250_16550A_vdev *vdev);
 int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev);
+
+/**
+ * Sets scheduling of the vIRQ dispatcher; see vuart_set_virq_sched() for details
+ */
+int vuart_virq_set_sched(int policy, int priority, int cpu);
+
+#ifdef RPDBG_VUART_BENCH
+/**
+ * Gets a snapshot of the dispatcher counters
+ */
+void vuart_virq_get_stats(struct vuart_virq_stats *stats);
+#else
+#define vuart_virq_get_stats(stats) memset((stats), 0, sizeof(struct vuart_virq_stats))
+#endif
 #endif //VUART_USE_TIMER_FALLBACK
 
 #endif //REDPILL_VUART_VIRTUAL_IRQ_H
\ No newline at end of file
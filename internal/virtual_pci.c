@@ -18,8 +18,13 @@
  *  - you should (but you don't HAVE to) set "master bus" (.command |= PCI_COMMAND_MASTER) for every function 0 device
  *    instance
  *  - every device MUST have a valid VID/DEV. None of the fields can be 0x0000 or 0xFFFF (they have special meanings)
- *  - this module does NOT have any support for capabilities (CAPs) as they're variable length and we don't want to
- *    force every device struct to take 256K of memory (todo if needed?)
+ *  - capabilities (CAPs) of common types (PM, MSI, MSI-X, PCIe) can be requested with struct pci_dev_caps. They're
+ *    precomputed into the shadow config space when the device is added so reads are still a single copy. PCIe
+ *    devices get the 4KB extended config space (with no extended capabilities).
+ *  - every device gets its own shadow copy of the config space initialized from the descriptor (which is never modified
+ *    and thus can be shared). Writes to RW bits (e.g. command, cache line size, IRQ line, BARs) land in the shadow;
+ *    read-only bits are ignored. BARs are sized from natural alignment of the address set in the descriptor (e.g.
+ *    0xfe000000 will report 32MB when probed with all-ones) while BARs set to PCI_DSC_NULL_BAR are unimplemented.
  *  - there are three types of headers: PCI device, PCI-PCI bridge, PCI-CardBus bridge. Only the first one was tested.
  *    The second one allows for more levels of the tree and should work if configured properly (see struct
  *    pci_pci_bridge_descriptor) but it wasn't needed yet. The third one is practically a bitrot now.
@@ -146,6 +151,11 @@
  *   obj->integer.value = 1;
  *   return obj;
  *
+ * HOT-ADD & REMOVAL
+ * -----------------
+ * Only a new bus is scanned as a whole. Devices added later to an existing bus (or removed from it) are handled one
+ * slot at a time (see scan_vdev() & vpci_remove_device()), so that devices which are already there are never touched.
+ *
  * x86 BUS SCANNING BUG (>=v4.1)
  * -----------------------------
  * Since v4.1 adding a new bus under a different domain will cause devices on the bus to not be fully populated. See the
@@ -170,12 +180,13 @@
  */
 #include "virtual_pci.h"
 #include "../common.h"
-#include "../config/vpci_types.h" //MAX_VPCI_BUSES
+#include "metrics.h" //RP_METRIC(), rp_metric_*()
 #include <linux/pci.h>
 #include <linux/pci_regs.h> //PCI device header constants
 #include <linux/pci_ids.h> //Constants for vendors, classes, and other
-#include <linux/list.h> //list_for_each
+#include <linux/list.h> //list_for_each, list_add_tail
 #include <linux/device.h> //device_del
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
 
 #define PCIBUS_VIRTUAL_DOMAIN 0x0001 //normal PC buses are (always?) on domain 0, this is just a next one
 #define PCI_DEVICE_NOT_FOUND_VID_DID 0xFFFFFFFF //A special case to detect non-existing devices (per PCI spec)
@@ -235,22 +246,64 @@ const struct pci_dev_descriptor pci_dev_conf_default_normal_dev = {
     .max_lat = PCI_DSC_INF_LATENCY,
 };
 
+#define PCI_BUS_NO_MAX 256
+#define PCI_DEVFN_MAX 256
+#define VPCI_CFG_HEADER_LEN 64 //size of the descriptors (both normal device and PCI-PCI bridge)
+#define VPCI_CFG_SPACE_LEN 256 //conventional PCI config space size
+#define VPCI_CFG_EXT_SPACE_LEN 4096 //PCIe extended config space size
+#define VPCI_CAPS_START VPCI_CFG_HEADER_LEN //capabilities are placed right after the header
+
+//Lengths of capabilities as laid out in the config space
+#define VPCI_CAP_PM_LEN 8
+#define VPCI_CAP_MSI_LEN 16 //64-bit address without per-vector masking (0x0e rounded to a dword)
+#define VPCI_CAP_MSIX_LEN 12
+#define VPCI_CAP_EXP_LEN 0x3c //v2 capability with all registers
+
+//Writable bits of standard registers; everything not listed here is read-only
+#define VPCI_COMMAND_WMASK (PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_PARITY | \
+                            PCI_COMMAND_SERR | PCI_COMMAND_INTX_DISABLE)
+#define VPCI_STATUS_W1CMASK (PCI_STATUS_PARITY | PCI_STATUS_SIG_TARGET_ABORT | PCI_STATUS_REC_TARGET_ABORT | \
+                             PCI_STATUS_REC_MASTER_ABORT | PCI_STATUS_SIG_SYSTEM_ERROR | PCI_STATUS_DETECTED_PARITY)
+
 struct virtual_device {
+    struct list_head list; //entry in vdevices
     unsigned char *bus_no; //same as bus->number, used when bus is not initialized yet (e.g. during scanning)
     unsigned char dev_no;
     unsigned char fn_no;
     struct pci_bus* bus;
     void *descriptor;
+    unsigned int cfg_len; //VPCI_CFG_SPACE_LEN or VPCI_CFG_EXT_SPACE_LEN for PCIe devices
+    u8 *cfg; //shadow config space, initialized from the descriptor & caps; all reads & writes use it
+    u8 wmask[VPCI_CFG_SPACE_LEN]; //bits which can be changed by writes (extended config space is read-only)
+    u8 w1cmask[VPCI_CFG_SPACE_LEN]; //bits which are cleared by writing 1 (e.g. error bits in status)
+    bool scan_pending:1; //added to an existing bus within a batch; it will be scanned by vpci_commit()
+};
+
+struct virtual_bus {
+    struct list_head list; //entry in vbuses
+    unsigned char bus_no; //known before the bus is scanned for the first time
+    struct pci_bus *bus; //NULL until the initial scan finishes
+    bool scan_pending:1; //devices were added to an existing bus within a batch (see vpci_begin())
+    struct virtual_device *devfn_map[PCI_DEVFN_MAX]; //devices on this bus indexed by devfn
 };
-static unsigned int free_bus_idx = 0; //Used to find next free bus and for indexing other arrays
-static struct pci_bus *buses[MAX_VPCI_BUSES] = { NULL }; //All virtual buses
 
-static unsigned int free_dev_idx = 0; //Used to find next free bus and for indexing other arrays
-static struct virtual_device *devices[MAX_VPCI_DEVS] = { NULL }; //All virtual devices
+/*
+ * Buses and devices are allocated on demand so only what's used by the platform takes memory. Config space reads must
+ * be fast (the kernel does thousands of them while enumerating buses, most of them for empty slots) so B/D/F lookups
+ * are direct-indexed: bus# => struct virtual_bus (allocated with the first device on that bus) => devfn => device.
+ * The vBUS is registered before its initial scan as pci_read_cfg() is called before pci_scan_bus() returns.
+ */
+static LIST_HEAD(vbuses); //All virtual buses
+static LIST_HEAD(vdevices); //All virtual devices
+static struct virtual_bus *vbus_by_no[PCI_BUS_NO_MAX] = { NULL };
+static bool batch_open = false; //between vpci_begin() and vpci_commit() no scanning is done
 
-//Macros to easily iterate over lists above
-#define for_each_bus_idx() for (int i = 0, last_bus_idx = free_bus_idx-1; i <= last_bus_idx; i++)
-#define for_each_dev_idx() for (int i = 0, last_dev_idx = free_dev_idx-1; i <= last_dev_idx; i++)
+static inline struct virtual_device *get_vdev_by_bdf(unsigned char bus_no, unsigned int devfn)
+{
+    struct virtual_bus *vbus = vbus_by_no[bus_no];
+
+    return likely(vbus) ? vbus->devfn_map[devfn & (PCI_DEVFN_MAX-1)] : NULL;
+}
 
 /**
  * Prints pci_dev_descriptor or pci_pci_bridge_descriptor
@@ -284,55 +337,73 @@ void print_pci_descriptor(void *test_dev)
  * @param val Pointer to save read bytes
  * @return PCIBIOS_*
  */
+static RP_METRIC(vpci_cfg_reads, RP_MG_VPCI, RP_METRIC_COUNTER);
+static RP_METRIC(vpci_cfg_reads_empty, RP_MG_VPCI, RP_METRIC_COUNTER); //of slots without a device
+static RP_METRIC(vpci_cfg_writes, RP_MG_VPCI, RP_METRIC_COUNTER);
+static RP_METRIC(vpci_devices, RP_MG_VPCI, RP_METRIC_GAUGE);
+static struct rp_metric *const vpci_metrics[] = {
+    &vpci_cfg_reads, &vpci_cfg_reads_empty, &vpci_cfg_writes, &vpci_devices
+};
+
 static int pci_read_cfg(struct pci_bus *bus, unsigned int devfn, int where, int size, u32 *val)
 {
+    rp_metric_inc(&vpci_cfg_reads);
+
     //devfn is a combination of device number on bus and function number (Bus/Device/Function addressing)
     //Each device which exists MUST implement function 0. So every 8th value of devfn we have a new device.
-    unsigned char vdev_no = PCI_SLOT(devfn);
-    unsigned char vdev_fn = PCI_FUNC(devfn);
-
-    void *pci_descriptor = NULL;
-
-    //Very noisy!
-    //pr_loc_dbg("Read SYN wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8,
-    //           bus->number, vdev_no, vdev_fn);
-    for_each_dev_idx() {
-        //Very noisy!
-        //pr_loc_dbg("Checking vDEV @ bus=%02x dev=%02x fn=%02x", *devices[i]->bus_no, devices[i]->dev_no,
-        //           devices[i]->fn_no);
-
-        //We cannot use devices[i]->bus->number during scan as the bus may just being created and no ->bus is available
-        if(*devices[i]->bus_no == bus->number && devices[i]->dev_no == vdev_no && devices[i]->fn_no == vdev_fn) {
-            //Very noisy!
-            //pr_loc_dbg("Found matching vDEV @ bus=%02x dev=%02x fn=%02x => vidx=%d mf=%d", bus->number, vdev_no,
-            //           vdev_fn, i,
-            //           IS_PCI_HEADER_MULTI(((struct pci_dev_descriptor *) devices[i]->descriptor)->header_type) ? 1:0);
-            pci_descriptor = devices[i]->descriptor;
-            break;
-        }
-    };
+    //We cannot use device->bus->number during scan as the bus may just being created and no ->bus is available
+    struct virtual_device *device = get_vdev_by_bdf(bus->number, devfn);
 
-    if (!pci_descriptor) { //This is not a hack - this is per PCI spec to return special "not found pid/vid"
+    //Most reads during enumeration are VID probes of empty slots - this is the fast path for them
+    if (!device) { //This is not a hack - this is per PCI spec to return special "not found pid/vid"
+        rp_metric_inc(&vpci_cfg_reads_empty);
         if (where == PCI_VENDOR_ID || where == PCI_DEVICE_ID)
             *val = PCI_DEVICE_NOT_FOUND_VID_DID;
 
         //Very noisy!
-        //pr_loc_dbg("Read NAK wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8, bus->number,
-        //           vdev_no, vdev_fn);
+        //pr_loc_dbg("Read NAK wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8,
+        //           bus->number, PCI_SLOT(devfn), PCI_FUNC(devfn));
         return PCIBIOS_DEVICE_NOT_FOUND;
     }
 
+    if (unlikely(where < 0 || where + size > device->cfg_len))
+        return PCIBIOS_BAD_REGISTER_NUMBER;
+
     //Very noisy!
-    //pr_loc_dbg("Read ACK wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8, bus->number,
-    //           vdev_no, vdev_fn);
-    memcpy(val, (u8 *)pci_descriptor + where, size);
+    //pr_loc_dbg("Read ACK wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8,
+    //           bus->number, device->dev_no, device->fn_no);
+    memcpy(val, device->cfg + where, size);
 
     return PCIBIOS_SUCCESSFUL;
 }
 
+/**
+ * Writes to the shadow config space of a device honoring write masks (RO bits are silently ignored as on real hw)
+ *
+ * @param bus The bus (may be under first scan so only its number may be present in virtual_device)
+ * @param devfn Device AND its function; it's a 0-256 number allowing for 32 devices with 8 functions each
+ * @param where Offset in the device structure to write
+ * @param size How many BYTES (not bits) to write
+ * @param val Value to write
+ * @return PCIBIOS_*
+ */
 static int pci_write_cfg(struct pci_bus *bus, unsigned int devfn, int where, int size, u32 val)
 {
-    return PCIBIOS_SET_FAILED;
+    rp_metric_inc(&vpci_cfg_writes);
+    struct virtual_device *device = get_vdev_by_bdf(bus->number, devfn);
+    if (!device)
+        return PCIBIOS_DEVICE_NOT_FOUND;
+
+    if (unlikely(where < 0 || where + size > device->cfg_len))
+        return PCIBIOS_BAD_REGISTER_NUMBER;
+
+    for (int i = where; i < where + size && i < VPCI_CFG_SPACE_LEN; i++, val >>= 8) {
+        u8 byte = val & 0xFF;
+        device->cfg[i] = (device->cfg[i] & ~device->wmask[i]) | (byte & device->wmask[i]);
+        device->cfg[i] &= ~(byte & device->w1cmask[i]);
+    }
+
+    return PCIBIOS_SUCCESSFUL;
 }
 
 //Definition of callbacks the PCI subsystem uses to query the root bus
@@ -354,15 +425,185 @@ static struct pci_sysdata x86_sysdata = {
     .iommu = NULL
 };
 
+static inline void set_cfg_bytes(u8 *space, int where, int size, u32 val)
+{
+    for (int i = where; i < where + size; i++, val >>= 8)
+        space[i] = val & 0xFF;
+}
+
+/**
+ * Determines which bits of a BAR are writable (i.e. what it reports when all-ones is written to it)
+ *
+ * Descriptors don't carry sizes of BARs so the size is derived from the natural alignment of the address (which per
+ * spec is always aligned to the size), e.g. BAR of 0xfe000000 is considered 32MB.
+ */
+static u32 get_bar_wmask(u32 bar)
+{
+    u32 addr_mask = (bar & PCI_BASE_ADDRESS_SPACE_IO) ? PCI_BASE_ADDRESS_IO_MASK : PCI_BASE_ADDRESS_MEM_MASK;
+    u32 addr = bar & addr_mask;
+
+    if (addr == 0) //Unimplemented BAR - hardwired to 0 per spec
+        return 0;
+
+    return addr_mask & ~((addr & -addr) - 1);
+}
+
+/**
+ * Links a new capability into the chain
+ *
+ * @param next_ptr Offset of the "next" pointer of the previous capability (or PCI_CAPABILITY_LIST); updated
+ * @param pos Offset where the capability will be placed; updated to point to the next free space
+ * @return offset of the capability
+ */
+static inline int append_cap(struct virtual_device *device, int *next_ptr, int *pos, u8 cap_id, int len)
+{
+    int cap = *pos;
+
+    device->cfg[*next_ptr] = cap;
+    device->cfg[cap + PCI_CAP_LIST_ID] = cap_id;
+    device->cfg[cap + PCI_CAP_LIST_NEXT] = PCI_DSC_NULL_CAP;
+    *next_ptr = cap + PCI_CAP_LIST_NEXT;
+    *pos += ALIGN(len, 4);
+
+    return cap;
+}
+
+static void build_cap_pcie(struct virtual_device *device, int cap, const struct pci_dev_caps *caps)
+{
+    set_cfg_bytes(device->cfg, cap + PCI_EXP_FLAGS, 2, 2 | ((caps->pcie_type << 4) & PCI_EXP_FLAGS_TYPE)); //v2
+    //DEVCAP stays 0: 128B max payload, no extended tags, no FLR
+    set_cfg_bytes(device->wmask, cap + PCI_EXP_DEVCTL, 2, 0x7FFF);
+    set_cfg_bytes(device->w1cmask, cap + PCI_EXP_DEVSTA, 2,
+                  PCI_EXP_DEVSTA_CED | PCI_EXP_DEVSTA_NFED | PCI_EXP_DEVSTA_FED | PCI_EXP_DEVSTA_URD);
+
+    if (!caps->pcie_link_width) //e.g. root complex integrated endpoints have no link
+        return;
+
+    //No ASPM support is advertised so that the ASPM code leaves the link alone
+    u32 link = (caps->pcie_link_speed & PCI_EXP_LNKCAP_SLS) | ((caps->pcie_link_width << 4) & PCI_EXP_LNKCAP_MLW);
+    set_cfg_bytes(device->cfg, cap + PCI_EXP_LNKCAP, 4, link);
+    set_cfg_bytes(device->wmask, cap + PCI_EXP_LNKCTL, 2,
+                  PCI_EXP_LNKCTL_ASPMC | PCI_EXP_LNKCTL_RCB | PCI_EXP_LNKCTL_CCC | PCI_EXP_LNKCTL_ES);
+    set_cfg_bytes(device->cfg, cap + PCI_EXP_LNKSTA, 2, link & (PCI_EXP_LNKSTA_CLS | PCI_EXP_LNKSTA_NLW));
+    set_cfg_bytes(device->cfg, cap + PCI_EXP_LNKCAP2, 4, ((1 << caps->pcie_link_speed) - 1) << 1); //speeds vector
+    set_cfg_bytes(device->cfg, cap + PCI_EXP_LNKCTL2, 2, caps->pcie_link_speed);
+    set_cfg_bytes(device->wmask, cap + PCI_EXP_LNKCTL2, 2, 0x000F); //target link speed
+
+    if (caps->pcie_type == PCI_EXP_TYPE_ROOT_PORT)
+        set_cfg_bytes(device->wmask, cap + PCI_EXP_RTCTL, 2, 0x001F);
+}
+
+/**
+ * Precomputes capabilities chain into the shadow config space
+ */
+static void build_caps(struct virtual_device *device, const struct pci_dev_caps *caps)
+{
+    int next_ptr = PCI_CAPABILITY_LIST;
+    int pos = VPCI_CAPS_START;
+    int cap;
+
+    device->cfg[PCI_CAPABILITY_LIST] = PCI_DSC_NULL_CAP; //only caps defined here are supported
+    if (!caps || !(caps->pm || caps->msi || caps->msix || caps->pcie))
+        return;
+
+    if (caps->pm) {
+        cap = append_cap(device, &next_ptr, &pos, PCI_CAP_ID_PM, VPCI_CAP_PM_LEN);
+        set_cfg_bytes(device->cfg, cap + PCI_PM_PMC, 2, 0x0003); //v1.2, no PME, only D0 & D3hot
+        set_cfg_bytes(device->cfg, cap + PCI_PM_CTRL, 2, PCI_PM_CTRL_NO_SOFT_RESET);
+        set_cfg_bytes(device->wmask, cap + PCI_PM_CTRL, 2, PCI_PM_CTRL_STATE_MASK);
+    }
+
+    if (caps->msi) {
+        cap = append_cap(device, &next_ptr, &pos, PCI_CAP_ID_MSI, VPCI_CAP_MSI_LEN);
+        set_cfg_bytes(device->cfg, cap + PCI_MSI_FLAGS, 2, PCI_MSI_FLAGS_64BIT); //single vector
+        set_cfg_bytes(device->wmask, cap + PCI_MSI_FLAGS, 2, PCI_MSI_FLAGS_ENABLE | PCI_MSI_FLAGS_QSIZE);
+        set_cfg_bytes(device->wmask, cap + PCI_MSI_ADDRESS_LO, 4, 0xFFFFFFFC);
+        set_cfg_bytes(device->wmask, cap + PCI_MSI_ADDRESS_HI, 4, 0xFFFFFFFF);
+        set_cfg_bytes(device->wmask, cap + PCI_MSI_DATA_64, 2, 0xFFFF);
+    }
+
+    if (caps->msix) {
+        cap = append_cap(device, &next_ptr, &pos, PCI_CAP_ID_MSIX, VPCI_CAP_MSIX_LEN);
+        set_cfg_bytes(device->cfg, cap + PCI_MSIX_FLAGS, 2, (caps->msix_table_size - 1) & PCI_MSIX_FLAGS_QSIZE);
+        set_cfg_bytes(device->wmask, cap + PCI_MSIX_FLAGS, 2, PCI_MSIX_FLAGS_MASKALL | PCI_MSIX_FLAGS_ENABLE);
+        set_cfg_bytes(device->cfg, cap + PCI_MSIX_TABLE, 4,
+                      (caps->msix_table_offset & ~PCI_MSIX_TABLE_BIR) | (caps->msix_bir & PCI_MSIX_TABLE_BIR));
+        set_cfg_bytes(device->cfg, cap + PCI_MSIX_PBA, 4,
+                      (caps->msix_pba_offset & ~PCI_MSIX_TABLE_BIR) | (caps->msix_bir & PCI_MSIX_TABLE_BIR));
+    }
+
+    if (caps->pcie) {
+        cap = append_cap(device, &next_ptr, &pos, PCI_CAP_ID_EXP, VPCI_CAP_EXP_LEN);
+        build_cap_pcie(device, cap, caps);
+    }
+
+    device->cfg[PCI_STATUS] |= PCI_STATUS_CAP_LIST; //it's in the lower byte
+}
+
+/**
+ * Populates shadow config space of a device along with its write masks
+ *
+ * @return 0 on success or -E on error
+ */
+static int init_cfg_shadow(struct virtual_device *device, const struct pci_dev_caps *caps)
+{
+    device->cfg_len = (caps && caps->pcie) ? VPCI_CFG_EXT_SPACE_LEN : VPCI_CFG_SPACE_LEN;
+    kzalloc_or_exit_int(device->cfg, device->cfg_len, RP_MEM_VPCI);
+    memcpy(device->cfg, device->descriptor, VPCI_CFG_HEADER_LEN);
+    memset(device->wmask, 0, VPCI_CFG_SPACE_LEN);
+    memset(device->w1cmask, 0, VPCI_CFG_SPACE_LEN);
+
+    set_cfg_bytes(device->wmask, PCI_COMMAND, 2, VPCI_COMMAND_WMASK);
+    set_cfg_bytes(device->w1cmask, PCI_STATUS, 2, VPCI_STATUS_W1CMASK);
+    set_cfg_bytes(device->wmask, PCI_CACHE_LINE_SIZE, 1, 0xFF);
+    set_cfg_bytes(device->wmask, PCI_LATENCY_TIMER, 1, 0xFF);
+    set_cfg_bytes(device->wmask, PCI_INTERRUPT_LINE, 1, 0xFF);
+
+    bool is_bridge = (device->cfg[PCI_HEADER_TYPE] & 0x7F) == PCI_HEADER_TYPE_BRIDGE;
+    int bar_num = is_bridge ? 2 : 6;
+    for (int i = 0; i < bar_num; i++) {
+        int where = PCI_BASE_ADDRESS_0 + i * 4;
+        u32 bar;
+        memcpy(&bar, device->cfg + where, sizeof(bar));
+
+        u32 bar_wmask = get_bar_wmask(bar);
+        set_cfg_bytes(device->wmask, where, 4, bar_wmask);
+
+        //Upper half of a 64-bit BAR is a plain address register
+        if (bar_wmask && !(bar & PCI_BASE_ADDRESS_SPACE_IO) &&
+            (bar & PCI_BASE_ADDRESS_MEM_TYPE_MASK) == PCI_BASE_ADDRESS_MEM_TYPE_64 && i + 1 < bar_num) {
+            set_cfg_bytes(device->wmask, where + 4, 4, 0xFFFFFFFF);
+            i++;
+        }
+    }
+
+    if (is_bridge) {
+        set_cfg_bytes(device->wmask, PCI_PRIMARY_BUS, 4, 0xFFFFFFFF); //pri, sec & subordinate bus + sec latency
+        set_cfg_bytes(device->wmask, PCI_IO_BASE, 2, 0xF0F0);
+        set_cfg_bytes(device->w1cmask, PCI_SEC_STATUS, 2, VPCI_STATUS_W1CMASK);
+        set_cfg_bytes(device->wmask, PCI_MEMORY_BASE, 4, 0xFFF0FFF0);
+        set_cfg_bytes(device->wmask, PCI_PREF_MEMORY_BASE, 4, 0xFFF0FFF0);
+        set_cfg_bytes(device->wmask, PCI_PREF_BASE_UPPER32, 4, 0xFFFFFFFF);
+        set_cfg_bytes(device->wmask, PCI_PREF_LIMIT_UPPER32, 4, 0xFFFFFFFF);
+        set_cfg_bytes(device->wmask, PCI_IO_BASE_UPPER16, 4, 0xFFFFFFFF);
+        set_cfg_bytes(device->wmask, PCI_BRIDGE_CONTROL, 2, 0xFFFF);
+    }
+
+    build_caps(device, caps);
+
+    return 0;
+}
+
+static inline void free_vdev(struct virtual_device *device)
+{
+    rp_kfree(device->cfg, RP_MEM_VPCI);
+    rp_kfree(device, RP_MEM_VPCI);
+}
+
 //_NO  => number according to the PCI spec
-//_IDX => index in arrays (internal to this emulation layer only)
 #define BUS_NO_VALID(x) ((x) >= 0 && (x) <= 0xFF) //Check if a given bus# is valid according to the PCI spec
-#define DEV_NO_VALID(x) ((x) >= 0 && (x) <= 32) //Check if a given dev# is valid according to the PCI spec
+#define DEV_NO_VALID(x) ((x) >= 0 && (x) <= 31) //Check if a given dev# is valid according to the PCI spec
 #define FN_NO_VALID(x) ((x) >= 0 && (x) <= 7) //Check if a given function# is valid according to the PCI spec
-#define VBUS_IDX_VALID(x) ((x) >= 0 && (x) < MAX_VPCI_BUSES-1) //Check if virtual bus INDEX is valid for this emulator
-#define VBUS_IDX_USED(x) ((x) >= 0 && (x) < free_bus_idx) //Check if a given bus index is used now in the emulator
-#define VDEV_IDX_VALID(x) ((x) >= 0 && (x) < MAX_VPCI_DEVS-1) //Check if virtual device INDEX is valid for this emulator
-#define VDEV_IDX_USED(x) ((x) >= 0 && (x) < free_dev_idx) //Check if a given bus index is used now in the emulator
 
 static inline int validate_bdf(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no)
 {
@@ -381,120 +622,329 @@ static inline int validate_bdf(unsigned char bus_no, unsigned char dev_no, unsig
         return -EINVAL;
     }
 
-    //if the free device index is not valid it means we're out of free IDs for devices
-    if (unlikely(!VDEV_IDX_VALID(free_dev_idx))) {
-        pr_loc_bug("No more device indexes are available (max devs: %d)", MAX_VPCI_DEVS);
-        return -ENOMEM;
+    //If the device has the same B/D/F address it is a duplicate
+    if (unlikely(get_vdev_by_bdf(bus_no, PCI_DEVFN(dev_no, fn_no)))) {
+        pr_loc_err("Device bus=%02x dev=%02x fn=%02x already exists", bus_no, dev_no, fn_no);
+        return -EEXIST;
     }
 
-    //If the device has the same B/D/F address it is a duplicate
-    for_each_dev_idx() {
-        if (
-                likely(*devices[i]->bus_no == bus_no) &&
-                unlikely(devices[i]->dev_no == dev_no && devices[i]->fn_no == fn_no)
-                ) {
-            pr_loc_err("Device bus=%02x dev=%02x fn=%02x already exists in vidx=%d", bus_no, dev_no, fn_no, i);
-            return -EEXIST;
-        }
-    };
+    return 0;
+}
+
+/**
+ * Creates a PCI bus for a vBUS which wasn't scanned yet & switches all its devices to the real bus
+ *
+ * @return 0 on success or -E on error
+ */
+static int scan_new_vbus(struct virtual_bus *vbus)
+{
+    //Since we don't have a bus so we need to add the device with a mock dev_no and trigger scanning (which actually
+    // creates the bus). While it sounds counter-intuitive it is how the PCI subsystem works.
+    struct pci_bus *bus = pci_scan_bus(vbus->bus_no, &pci_shim_ops, &x86_sysdata);
+    if (!bus) {
+        pr_loc_err("pci_scan_bus failed - cannot add new bus=%02x", vbus->bus_no);
+        return -EIO;
+    }
+
+    vbus->bus = bus;
+    for (int devfn = 0; devfn < PCI_DEVFN_MAX; devfn++) {
+        if (!vbus->devfn_map[devfn])
+            continue;
+
+        //Replace temp bus number pointer with the actual bus struct pointer
+        vbus->devfn_map[devfn]->bus_no = &bus->number;
+        vbus->devfn_map[devfn]->bus = bus;
+    }
+
+    /*
+     * There was a commit in v4.1 which made "subtle" change aimed to "cleanup control flow" by moving
+     * pci_bus_add_devices(bus) from drivers/pci/probe.c:pci_scan_bus() to a higher order
+     * arch/x86/pci/common.c:pcibios_scan_root().
+     * However this means that adding a bus with a domain different than 0 as used on x86 with BIOS/ACPI causes some
+     * resources to not be created (e.g. /sys/bus/pci/devices/..../config) which in turn breaks a ton of tools (lspci
+     * included). This is because pci_bus_add_devices() calls pci_create_sysfs_dev_files().
+     * It's important to mention that this is broken only for new buses - pci_rescan_bus() calls pci_bus_add_devices().
+     *
+     * Don't even fucking ask how long we looked for that...
+     *
+     * See https://github.com/torvalds/linux/commit/8e795840e4d89df3d594e736989212ee8a4a1fca#
+     */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+    pr_loc_dbg("Linux >=v4.1 quirk: calling pci_bus_add_devices(bus) manually");
+    pci_bus_add_devices(bus);
+#endif
+
+    pr_loc_inf("Added new bus=%02x", vbus->bus_no);
+    return 0;
+}
+
+//pci_*_rescan_remove() were added in v3.14; before that the PCI core didn't serialize hotplug at all
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+#define vpci_lock_rescan_remove() pci_lock_rescan_remove()
+#define vpci_unlock_rescan_remove() pci_unlock_rescan_remove()
+#else
+#define vpci_lock_rescan_remove() do { } while(0)
+#define vpci_unlock_rescan_remove() do { } while(0)
+#endif
+
+/**
+ * Makes the kernel discover a device added to an already scanned vBUS (without rescanning the whole bus)
+ *
+ * Only the device's slot is probed: for fn=0 the whole slot (so that functions added before fn=0 show up too), for
+ * other functions just the function itself, unless fn=0 isn't known to the kernel yet (as functions cannot exist
+ * without it they will be discovered along with fn=0). Devices already on the bus are not probed again.
+ * You must call add_scanned_vdevs() afterwards & hold vpci_lock_rescan_remove().
+ *
+ * @return 0 on success (incl. deferring to fn=0), -E on error
+ */
+static int scan_vdev(struct pci_bus *bus, struct virtual_device *device)
+{
+    if (device->fn_no == 0)
+        return pci_scan_slot(bus, PCI_DEVFN(device->dev_no, 0)) > 0 ? 0 : -EIO;
+
+    struct pci_dev *fn0 = pci_get_slot(bus, PCI_DEVFN(device->dev_no, 0));
+    if (!fn0) {
+        pr_loc_dbg("Device @ bus=%02x dev=%02x fn=%02x will be discovered along with its fn=00", bus->number,
+                   device->dev_no, device->fn_no);
+        return 0;
+    }
+    pci_dev_put(fn0);
+
+    return pci_scan_single_device(bus, PCI_DEVFN(device->dev_no, device->fn_no)) ? 0 : -EIO;
+}
+
+/**
+ * Finishes what scan_vdev() started: assigns resources & registers newly discovered devices with the driver core
+ *
+ * Both only affect devices which don't have resources & aren't added yet, so devices already on the bus stay intact.
+ */
+static inline void add_scanned_vdevs(struct pci_bus *bus)
+{
+    pci_assign_unassigned_bus_resources(bus);
+    pci_bus_add_devices(bus);
+}
+
+/**
+ * Reverses adding of a vBUS which was never successfully scanned (along with all devices on it)
+ */
+static void destroy_unscanned_vbus(struct virtual_bus *vbus)
+{
+    vbus_by_no[vbus->bus_no] = NULL;
+    for (int devfn = 0; devfn < PCI_DEVFN_MAX; devfn++) {
+        if (!vbus->devfn_map[devfn])
+            continue;
+
+        list_del(&vbus->devfn_map[devfn]->list);
+        free_vdev(vbus->devfn_map[devfn]);
+        rp_metric_gauge_add(&vpci_devices, -1);
+    }
+
+    list_del(&vbus->list);
+    rp_kfree(vbus, RP_MEM_VPCI);
+}
+
+int vpci_begin(void)
+{
+    if (unlikely(batch_open)) {
+        pr_loc_bug("%s called while another batch is open", __FUNCTION__);
+        return -EBUSY;
+    }
+
+    pr_loc_dbg("Opening vPCI batch");
+    batch_open = true;
 
     return 0;
 }
 
-static inline struct pci_bus *get_vbus_by_number(unsigned char bus_no)
+/**
+ * Discovers devices added within a batch to an already scanned vBUS
+ *
+ * Devices which failed to be discovered are discarded, others are kept.
+ *
+ * @return 0 on success or -E on error (first error encountered)
+ */
+static int commit_existing_vbus(struct virtual_bus *vbus)
 {
-    for_each_bus_idx() { //Determine whether we need to rescan existing bus after adding a device OR scan a new root bus
-        if (buses[i]->number == bus_no) {
-            pr_loc_dbg("Found existing bus_no=%d @ bidx=%d", bus_no, i);
-            return buses[i];
-            break;
+    int out = 0;
+    int error;
+
+    vpci_lock_rescan_remove();
+    //Ascending devfn order guarantees that fn=0 of a slot is scanned (with all the functions) before others
+    for (int devfn = 0; devfn < PCI_DEVFN_MAX; devfn++) {
+        struct virtual_device *device = vbus->devfn_map[devfn];
+        if (!device || !device->scan_pending)
+            continue;
+
+        device->scan_pending = false;
+        if (likely((error = scan_vdev(vbus->bus, device)) == 0))
+            continue;
+
+        pr_loc_err("Failed to scan device @ bus=%02x dev=%02x fn=%02x - discarding it", vbus->bus_no, device->dev_no,
+                   device->fn_no);
+        vbus->devfn_map[devfn] = NULL;
+        list_del(&device->list);
+        free_vdev(device);
+        rp_metric_gauge_add(&vpci_devices, -1);
+        if (out == 0)
+            out = error;
+    }
+    add_scanned_vdevs(vbus->bus);
+    vpci_unlock_rescan_remove();
+    vbus->scan_pending = false;
+
+    return out;
+}
+
+int vpci_commit(void)
+{
+    if (unlikely(!batch_open)) {
+        pr_loc_bug("%s called without vpci_begin()", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    pr_loc_dbg("Committing vPCI batch");
+    batch_open = false;
+
+    int out = 0;
+    int error;
+    struct virtual_bus *vbus, *vbus_n;
+    list_for_each_entry_safe(vbus, vbus_n, &vbuses, list) {
+        if (vbus->bus) {
+            if (vbus->scan_pending && (error = commit_existing_vbus(vbus)) != 0 && out == 0)
+                out = error;
+
+            continue;
         }
-    };
 
-    return NULL;
+        //Failure of one bus shouldn't prevent others from being added; the first error will be returned
+        if ((error = scan_new_vbus(vbus)) != 0) {
+            destroy_unscanned_vbus(vbus);
+            if (out == 0)
+                out = error;
+        }
+    }
+
+    return out;
+}
+
+void vpci_abort(void)
+{
+    if (unlikely(!batch_open)) {
+        pr_loc_bug("%s called without vpci_begin()", __FUNCTION__);
+        return;
+    }
+
+    pr_loc_dbg("Aborting vPCI batch");
+    batch_open = false;
+
+    struct virtual_bus *vbus, *vbus_n;
+    list_for_each_entry_safe(vbus, vbus_n, &vbuses, list) {
+        if (!vbus->bus) { //created within the batch - everything on it is new
+            destroy_unscanned_vbus(vbus);
+            continue;
+        }
+
+        if (!vbus->scan_pending)
+            continue;
+
+        for (int devfn = 0; devfn < PCI_DEVFN_MAX; devfn++) {
+            struct virtual_device *device = vbus->devfn_map[devfn];
+            if (!device || !device->scan_pending)
+                continue;
+
+            vbus->devfn_map[devfn] = NULL;
+            list_del(&device->list);
+            free_vdev(device);
+            rp_metric_gauge_add(&vpci_devices, -1);
+        }
+        vbus->scan_pending = false;
+    }
 }
 
 const __must_check struct virtual_device *
-vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, void *descriptor)
+vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, void *descriptor,
+                const struct pci_dev_caps *caps)
 {
     pr_loc_dbg("Attempting to add vPCI device [printed below] @ bus=%02x dev=%02x fn=%02x", bus_no, dev_no, fn_no);
     print_pci_descriptor(descriptor);
+    rp_metrics_register(vpci_metrics, ARRAY_SIZE(vpci_metrics)); //cfg accesses can only come for buses we create
 
     int error = validate_bdf(bus_no, dev_no, fn_no);
     if (error != 0)
         return ERR_PTR(error);
 
-    struct pci_bus *bus = get_vbus_by_number(bus_no);
-
     //At this point we know the device can be added either to a new or existing bus so we have to populate their struct
     struct virtual_device *device;
-    kmalloc_or_exit_ptr(device, sizeof(struct virtual_device));
+    kmalloc_or_exit_ptr(device, sizeof(struct virtual_device), RP_MEM_VPCI);
 
     device->dev_no = dev_no;
     device->fn_no = fn_no;
     device->descriptor = descriptor;
+    device->scan_pending = false;
+    if ((error = init_cfg_shadow(device, caps)) != 0) {
+        rp_kfree(device, RP_MEM_VPCI);
+        return ERR_PTR(error);
+    }
 
-    if (bus) { //We have an existing bus to use
-        device->bus_no = &bus->number;
-        devices[free_dev_idx++] = device;
-
-        //We cannot use "pci_scan_single_device" here in case there are mf devices
-        pci_rescan_bus(bus); //this cannot fail - it simply return max device num
+    struct virtual_bus *vbus = vbus_by_no[bus_no];
+    if (!vbus) { //No existing bus - we need a new one (it will be scanned when the device is ready)
+        vbus = kzalloc(sizeof(struct virtual_bus), GFP_KERNEL);
+        if (unlikely(!vbus)) {
+            free_vdev(device);
+            kalloc_error_ptr(vbus, sizeof(struct virtual_bus));
+        }
+        rp_mem_alloced(RP_MEM_VPCI, vbus);
 
-        pr_loc_err("Added device with existing bus @ bus=%02x dev=%02x fn=%02x", *device->bus_no, device->dev_no,
-                   device->fn_no);
-        return device;
+        vbus->bus_no = bus_no; //It will be valid for the time of initial scan
+        list_add_tail(&vbus->list, &vbuses);
+        vbus_by_no[bus_no] = vbus; //The vBUS must be visible for the scan so that reads can find devices
     }
 
-    //No existing bus - check if we can add a new one
-    //if the free bus index is not valid it means we're out of free IDs for buses
-    if (unlikely(!VBUS_IDX_VALID(free_bus_idx))) {
-        pr_loc_bug("No more bus indexes are available (max buses: %d)", MAX_VPCI_BUSES);
-        return ERR_PTR(-ENOMEM);
+    device->bus = vbus->bus;
+    device->bus_no = vbus->bus ? &vbus->bus->number : &vbus->bus_no;
+    vbus->devfn_map[PCI_DEVFN(dev_no, fn_no)] = device;
+    list_add_tail(&device->list, &vdevices);
+    rp_metric_gauge_add(&vpci_devices, 1);
+
+    if (batch_open) {
+        device->scan_pending = !!vbus->bus; //devices on new buses are discovered by the initial scan
+        vbus->scan_pending |= device->scan_pending;
+        pr_loc_dbg("Queued device @ bus=%02x dev=%02x fn=%02x until vpci_commit()", bus_no, dev_no, fn_no);
+        return device;
     }
 
-    //Since we don't have a bus so we need to add the device with a mock dev_no and trigger scanning (which actually
-    // creates the bus). While it sounds counter-intuitive it is how the PCI subsystem works.
-    unsigned char tmp_bus_no = bus_no; //It will be valid for the time of initial scan
-    device->bus_no = &tmp_bus_no;
-    devices[free_dev_idx++] = device;
+    if (vbus->bus) { //We have an existing bus to use
+        vpci_lock_rescan_remove();
+        error = scan_vdev(vbus->bus, device);
+        if (likely(error == 0))
+            add_scanned_vdevs(vbus->bus);
+        vpci_unlock_rescan_remove();
+
+        if (unlikely(error != 0)) {
+            pr_loc_err("Failed to scan device @ bus=%02x dev=%02x fn=%02x", bus_no, dev_no, fn_no);
+            vbus->devfn_map[PCI_DEVFN(dev_no, fn_no)] = NULL;
+            list_del(&device->list);
+            free_vdev(device);
+            rp_metric_gauge_add(&vpci_devices, -1);
+            return ERR_PTR(error);
+        }
 
-    bus = pci_scan_bus(*device->bus_no, &pci_shim_ops, &x86_sysdata);
-    if (!bus) {
-        pr_loc_err("pci_scan_bus failed - cannot add new bus");
-        devices[free_dev_idx--] = NULL; //Reverse adding & ensure idx is still free
-        kfree(device); //Free memory for the device itself
-        return ERR_PTR(-EIO);
+        pr_loc_inf("Added device with existing bus @ bus=%02x dev=%02x fn=%02x", bus_no, dev_no, fn_no);
+        return device;
     }
 
-    device->bus_no = &bus->number; //Replace temp bus number pointer with the actual bus struct pointer
-    device->bus = bus;
-    buses[free_bus_idx++] = bus;
-
-    /*
-     * There was a commit in v4.1 which made "subtle" change aimed to "cleanup control flow" by moving
-     * pci_bus_add_devices(bus) from drivers/pci/probe.c:pci_scan_bus() to a higher order
-     * arch/x86/pci/common.c:pcibios_scan_root().
-     * However this means that adding a bus with a domain different than 0 as used on x86 with BIOS/ACPI causes some
-     * resources to not be created (e.g. /sys/bus/pci/devices/..../config) which in turn breaks a ton of tools (lspci
-     * included). This is because pci_bus_add_devices() calls pci_create_sysfs_dev_files().
-     * It's important to mention that this is broken only for new buses - pci_rescan_bus() calls pci_bus_add_devices().
-     *
-     * Don't even fucking ask how long we looked for that...
-     *
-     * See https://github.com/torvalds/linux/commit/8e795840e4d89df3d594e736989212ee8a4a1fca#
-     */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
-    pr_loc_dbg("Linux >=v4.1 quirk: calling pci_bus_add_devices(bus) manually");
-    pci_bus_add_devices(bus);
-#endif
+    if ((error = scan_new_vbus(vbus)) != 0) {
+        destroy_unscanned_vbus(vbus); //The device was the only one there
+        return ERR_PTR(error);
+    }
 
-    pr_loc_inf("Added device with new bus @ bus=%02x dev=%02x fn=%02x", *device->bus_no, device->dev_no, device->fn_no);
+    pr_loc_inf("Added device with new bus @ bus=%02x dev=%02x fn=%02x", bus_no, dev_no, fn_no);
     return device;
 }
 
 const struct virtual_device *
-vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, struct pci_dev_descriptor *descriptor)
+vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, struct pci_dev_descriptor *descriptor,
+                       const struct pci_dev_caps *caps)
 {
     if (unlikely(IS_PCI_HEADER_MULTI(descriptor->header_type))) {
         pr_loc_bug("Attempted to use %s() to add multifunction device."
@@ -502,20 +952,21 @@ vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, struct pci_de
         return ERR_PTR(-EINVAL);
     }
 
-    return vpci_add_device(bus_no, dev_no, 0x00, descriptor);
+    return vpci_add_device(bus_no, dev_no, 0x00, descriptor, caps);
 }
 
 const struct virtual_device *
 vpci_add_multifunction_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_dev_descriptor *descriptor)
+                              struct pci_dev_descriptor *descriptor, const struct pci_dev_caps *caps)
 {
     descriptor->header_type = PCI_HEADER_TO_MULTI(descriptor->header_type);
 
-    return vpci_add_device(bus_no, dev_no, fn_no, descriptor);
+    return vpci_add_device(bus_no, dev_no, fn_no, descriptor, caps);
 }
 
 const struct virtual_device *
-vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pci_bridge_descriptor *descriptor)
+vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pci_bridge_descriptor *descriptor,
+                       const struct pci_dev_caps *caps)
 {
     if (unlikely(IS_PCI_HEADER_MULTI(descriptor->header_type))) {
         pr_loc_bug("Attempted to use %s() to add multifunction device."
@@ -523,16 +974,47 @@ vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pc
         return ERR_PTR(-EINVAL);
     }
 
-    return vpci_add_device(bus_no, dev_no, 0x00, descriptor);
+    return vpci_add_device(bus_no, dev_no, 0x00, descriptor, caps);
 }
 
 const struct virtual_device *
 vpci_add_multifunction_bridge(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_pci_bridge_descriptor *descriptor)
+                              struct pci_pci_bridge_descriptor *descriptor, const struct pci_dev_caps *caps)
 {
     descriptor->header_type = PCI_HEADER_TO_MULTI(descriptor->header_type);
 
-    return vpci_add_device(bus_no, dev_no, fn_no, descriptor);
+    return vpci_add_device(bus_no, dev_no, fn_no, descriptor, caps);
+}
+
+int vpci_remove_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no)
+{
+    unsigned int devfn = PCI_DEVFN(dev_no, fn_no);
+    struct virtual_device *device = get_vdev_by_bdf(bus_no, devfn);
+    if (unlikely(!device)) {
+        pr_loc_err("Cannot remove device bus=%02x dev=%02x fn=%02x - it doesn't exist", bus_no, dev_no, fn_no);
+        return -ENOENT;
+    }
+
+    //The device may not be known to the kernel if the bus wasn't scanned yet or it's waiting for its fn=0
+    struct virtual_bus *vbus = vbus_by_no[bus_no];
+    if (vbus->bus) {
+        vpci_lock_rescan_remove();
+        struct pci_dev *pci_dev = pci_get_slot(vbus->bus, devfn);
+        if (pci_dev) {
+            pr_loc_dbg("Detaching vDEV dev=%02x fn=%02x from bus=%02x", dev_no, fn_no, bus_no);
+            pci_stop_and_remove_bus_device(pci_dev);
+            pci_dev_put(pci_dev);
+        }
+        vpci_unlock_rescan_remove();
+    }
+
+    vbus->devfn_map[devfn] = NULL;
+    list_del(&device->list);
+    free_vdev(device);
+    rp_metric_gauge_add(&vpci_devices, -1);
+    pr_loc_inf("Removed device @ bus=%02x dev=%02x fn=%02x", bus_no, dev_no, fn_no);
+
+    return 0;
 }
 
 int vpci_remove_all_devices_and_buses(void)
@@ -542,32 +1024,41 @@ int vpci_remove_all_devices_and_buses(void)
     //However, this is still leaving dangling things in /sys/devices which cannot be removed (kernel bug?)
 
     struct pci_dev *pci_dev, *pci_dev_n;
-    for_each_bus_idx() {
-        list_for_each_entry_safe(pci_dev, pci_dev_n, &buses[i]->devices, bus_list) {
+    struct virtual_bus *vbus, *vbus_n;
+    list_for_each_entry(vbus, &vbuses, list) {
+        if (!vbus->bus) //never scanned (e.g. batch was not committed)
+            continue;
+
+        list_for_each_entry_safe(pci_dev, pci_dev_n, &vbus->bus->devices, bus_list) {
             pr_loc_dbg("Detaching vDEV dev=%02x fn=%02x from bus=%02x [add=%d]", PCI_SLOT(pci_dev->devfn),
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(5,0,0)
-                       PCI_FUNC(pci_dev->devfn), buses[i]->number, pci_dev->is_added);
+                       PCI_FUNC(pci_dev->devfn), vbus->bus_no, pci_dev->is_added);
 #else
-                       PCI_FUNC(pci_dev->devfn), buses[i]->number, 0);  // Not found a replacement for pci_dev->is_added
+                       PCI_FUNC(pci_dev->devfn), vbus->bus_no, 0);  // Not found a replacement for pci_dev->is_added
 #endif
             pci_stop_and_remove_bus_device(pci_dev);
         }
     }
 
-    for_each_dev_idx() {
-        pr_loc_dbg("Removing PCI vDEV @ didx %d", i);
-        kfree(devices[i]);
-        devices[i] = NULL;
+    struct virtual_device *device, *device_n;
+    list_for_each_entry_safe(device, device_n, &vdevices, list) {
+        pr_loc_dbg("Removing PCI vDEV @ bus=%02x dev=%02x fn=%02x", *device->bus_no, device->dev_no, device->fn_no);
+        list_del(&device->list);
+        free_vdev(device);
+        rp_metric_gauge_add(&vpci_devices, -1);
     };
-    free_dev_idx = 0;
 
-    for_each_bus_idx() {
-        pr_loc_dbg("Removing child PCI vBUS @ bidx %d", i);
-        pci_rescan_bus(buses[i]);
-        pci_remove_bus(buses[i]);
-        buses[i] = NULL;
+    list_for_each_entry_safe(vbus, vbus_n, &vbuses, list) {
+        pr_loc_dbg("Removing child PCI vBUS @ bus=%02x", vbus->bus_no);
+        if (vbus->bus) {
+            pci_rescan_bus(vbus->bus);
+            pci_remove_bus(vbus->bus);
+        }
+        vbus_by_no[vbus->bus_no] = NULL;
+        list_del(&vbus->list);
+        rp_kfree(vbus, RP_MEM_VPCI);
     }
-    free_bus_idx = 0;
+    batch_open = false;
 
     pr_loc_inf("All vPCI devices and buses removed");
 
@@ -128,16 +128,54 @@ struct pci_pci_bridge_descriptor {
     u16 bridge_ctrl;
 } __packed;
 
-//This is currently not implemented
-struct pci_dev_capability {
-    u8 cap_id; //see PCI_CAP_ID_*, set to 0x00 to denote null-capability
-    u8 cap_next; //offset where next capability exists, set to 0x00 to denote null-capability
-    u8 cap_data[];
-} __packed;
+//Optional capabilities of a device (pass NULL to vpci_add_*() for none). They're precomputed into the config space
+// when the device is added. Capabilities set in the descriptor's cap_ptr are ignored.
+struct pci_dev_caps {
+    bool pm:1; //Power Management (D0 & D3hot, no PME)
+    bool msi:1; //MSI with 64-bit address & a single vector
+    bool msix:1; //MSI-X; it makes sense only if the BAR pointed by msix_bir is implemented
+    bool pcie:1; //PCI Express capability; also enables 4KB extended config space
+    u8 pcie_type; //PCI_EXP_TYPE_*
+    u8 pcie_link_speed; //PCI_EXP_LNKCAP_SLS_* (e.g. 2 for 5GT/s); ignored when pcie_link_width is 0
+    u8 pcie_link_width; //number of lanes; 0 for devices without a link (e.g. PCI_EXP_TYPE_RC_END)
+    u16 msix_table_size; //number of MSI-X vectors
+    u8 msix_bir; //BAR number where MSI-X table & PBA are
+    u32 msix_table_offset; //offset of MSI-X table within the BAR (8-byte aligned)
+    u32 msix_pba_offset; //offset of MSI-X PBA within the BAR (8-byte aligned)
+};
+
+/**
+ * Starts a batch of vpci_add_*() calls
+ *
+ * Normally every added device causes a scan of a new bus or a scan of its slot on an existing one. Within a batch
+ * devices are only registered; new buses are scanned and new slots of existing ones probed once by vpci_commit().
+ * Returned virtual_device pointers are valid immediately but devices will not be visible to the kernel until commit.
+ *
+ * @return 0 on success or -E on error
+ */
+int vpci_begin(void);
+
+/**
+ * Scans all new buses and discovers devices added to existing ones since vpci_begin()
+ *
+ * Failure to scan one bus doesn't stop others from being scanned. Devices on the failed bus are discarded.
+ *
+ * @return 0 on success or -E on error (first error encountered)
+ */
+int vpci_commit(void);
+
+/**
+ * Discards all devices added since vpci_begin() (along with buses created for them) without scanning anything
+ *
+ * Devices which were already visible to the kernel before the batch are not touched. Pointers returned within the batch
+ * are invalid after this call.
+ */
+void vpci_abort(void);
 
 /**
  * Adds a single new device (along with the bus if needed)
  *
+ * When the bus already exists only the new device is probed - other devices on the bus are not touched.
  * If you don't want to create the descriptor from scratch you can use "const struct pci_dev_conf_default_normal_dev"
  * while setting some missing params (see .c file header for details).
  * Note: you CAN reuse the same descriptor under multiple BDFs (bus_no/dev_no/fn_no)
@@ -145,44 +183,55 @@ struct pci_dev_capability {
  * @param bus_no (0x00 - 0xFF)
  * @param dev_no (0x00 - 0x20)
  * @param descriptor Pointer to pci_dev_descriptor or pci_pci_bridge_descriptor
+ * @param caps Capabilities of the device or NULL if none
  * @return virtual_device ptr or error pointer (ERR_PTR(-E))
  */
 const struct virtual_device *
-vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, struct pci_dev_descriptor *descriptor);
+vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, struct pci_dev_descriptor *descriptor,
+                       const struct pci_dev_caps *caps);
 
 /**
  * See vpci_add_single_device() for details
  */
 const struct virtual_device *
-vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pci_bridge_descriptor *descriptor);
+vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pci_bridge_descriptor *descriptor,
+                       const struct pci_dev_caps *caps);
 
 
 /*
  * Adds a new multifunction device (along with the bus if needed)
  *
  * Warning about multifunctional devices
- *  - this function has a slight limitation due to how Linux scans devices. You HAVE TO add fn_no=0 entry as the LAST
- *    one when calling it multiple times. Kernel scans devices only once for changes and if it finds fn=0 and it's the
- *    only one (i.e. you added fn=0 first) adding more functions will not populate them (as kernel will never re-scan
- *    the device).
- *  - As per PCI spec Linux doesn't allow devices to have fn>0 if they don't have corresponding fn=0 entry
+ *  - As per PCI spec Linux doesn't allow devices to have fn>0 if they don't have corresponding fn=0 entry. Functions
+ *    can be added in any order, but the ones added before fn=0 will become visible to the kernel along with fn=0.
  *
  * @param bus_no (0x00 - 0xFF)
  * @param dev_no (0x00 - 0x20)
  * @param fn_no (0x00 - 0x07)
  * @param descriptor Pointer to pci_dev_descriptor or pci_pci_bridge_descriptor
+ * @param caps Capabilities of the device or NULL if none
  * @return virtual_device ptr or error pointer (ERR_PTR(-E))
  */
 const struct virtual_device *
 vpci_add_multifunction_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_dev_descriptor *descriptor);
+                              struct pci_dev_descriptor *descriptor, const struct pci_dev_caps *caps);
 
 /**
  * See vpci_add_multifunction_device() for details
  */
 const struct virtual_device *
 vpci_add_multifunction_bridge(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_pci_bridge_descriptor *descriptor);
+                              struct pci_pci_bridge_descriptor *descriptor, const struct pci_dev_caps *caps);
+
+/**
+ * Removes a single device (function) without touching other devices on the bus
+ *
+ * The bus stays even if it's empty afterwards (it can get new devices later). Keep in mind that removing fn=0 of a
+ * multifunction device while other functions are present leaves them orphaned (as per PCI spec).
+ *
+ * @return 0 on success or -E on error
+ */
+int vpci_remove_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no);
 
 /**
  * Removes all previously added devices and buses
@@ -1,6 +1,7 @@
 #include "internal/stealth.h"
 #include "redpill_main.h"
 #include "config/runtime_config.h"
+#include "config/platform_types.h" //hw_cfg()
 #include "common.h" //commonly used headers in this module
 #include "internal/intercept_execve.h" //Handling of execve() replacement
 #include "internal/scsi/scsi_notifier.h" //the missing pub/sub handler for SCSI driver
@@ -13,9 +14,47 @@
 #include "shim/pci_shim.h" //Handles PCI devices emulation
 #include "shim/storage/smart_shim.h" //Handles emulation of SMART data for devices without it
 #include "shim/storage/sata_port_shim.h" //Handles VirtIO & SAS storage devices/disks peculiarities
+#include "shim/storage/io_scheduler_shim.h" //Tunes elevator & queue of every disk depending on its type
 #include "shim/uart_fixer.h" //Various fixes for UART weirdness
 #include "shim/pmu_shim.h" //Emulates the platform management unit
-#include "internal/helper/symbol_helper.h" //kln_func
+#include "internal/uart/virtual_uart.h" //vuart_set_virq_sched()
+#include "internal/helper/symbol_helper.h" //get_kln_p(), init_symbol_cache(), free_symbol_cache()
+#include "internal/call_protected.h" //bind_protected_calls()
+#include "internal/override/override_symbol.h" //register_override_symbol_poke_handler()
+#include "internal/override/override_hook.h" //register_override_hooks(), unregister_override_hooks()
+#include "internal/intercept_driver_register.h" //unregister_driver_bind_notifiers()
+#include "internal/metrics.h" //register_metrics(), unregister_metrics()
+#include "internal/mem_accounting.h" //register_mem_accounting()
+#include "internal/uart/vuart_capture.h" //register_vuart_capture(), unregister_vuart_capture()
+#include "config/config_sysfs.h" //register_config_sysfs(), unregister_config_sysfs()
+#include <linux/async.h> //async_schedule_domain(), async_synchronize_full_domain()
+#include <linux/atomic.h> //atomic_t, atomic_inc_return()
+#include <linux/ktime.h> //ktime_get(), ktime_us_delta()
+#include <linux/sched.h> //SCHED_NORMAL
+#ifdef RPDBG_OVS_STATS
+#include "debug/debug_ovs_stats.h" //override stats in debugfs; see Makefile DBG_OVS_STATS
+#endif
+#ifdef RPDBG_EXECVE
+#include "debug/debug_execve.h" //execve() trace in debugfs; see Makefile DBG_EXECVE
+#endif
+#ifdef RPDBG_DRIVER_PROFILE
+#include "debug/debug_driver_profile.h" //driver registration timeline in debugfs; see Makefile DBG_DRIVER_PROFILE
+#endif
+#ifdef RPDBG_PMU_TRACE
+#include "debug/debug_pmu_trace.h" //PMU traffic record/replay in debugfs; see Makefile DBG_PMU_TRACE
+#endif
+#ifdef RPDBG_VUART_BENCH
+#include "debug/debug_vuart_bench.h" //vUART benchmark; see Makefile DBG_VUART_BENCH
+#endif
+#ifdef RPDBG_VUART_NET
+#include "debug/debug_vuart_net.h" //vUART UDP sink; see Makefile DBG_VUART_NET
+#endif
+#ifdef RPDBG_SHIM_BENCH
+#include "debug/debug_shim_bench.h" //emulated subsystems benchmark; see Makefile DBG_SHIM_BENCH
+#endif
+#ifdef RPDBG_SCSI_BENCH
+#include "debug/debug_scsi_bench.h" //SCSI hotplug storm benchmark; see Makefile DBG_SCSI_BENCH
+#endif
 
 //Handle versioning stuff
 #ifndef RP_VERSION_POSTFIX
@@ -39,39 +78,227 @@ void noinline __noreturn rp_crash(void) {
     panic("Fatal exception");
 }
 
+/************************************************* Load-time profile *************************************************/
+#define INIT_PROFILE_MAX_STEPS 40
+#define INIT_PROFILE_NAME_LEN 40
+
+struct init_profile_entry {
+    char name[INIT_PROFILE_NAME_LEN];
+    s64 took_us;
+    int out;
+};
+
+//Deliberately not __initdata: in full stealth there are no logs, but it can still be read from a dump; __used keeps the
+// otherwise never read array (and stores to it) in such builds
+static struct init_profile_entry rp_init_profile[INIT_PROFILE_MAX_STEPS] __used;
+static atomic_t rp_init_profile_num = ATOMIC_INIT(0); //steps of parallel_init_chains are recorded concurrently
+
+static void __init record_init_step(const char *name, const void *fn, ktime_t start, int out)
+{
+    s64 took_us = ktime_us_delta(ktime_get(), start);
+    int idx = atomic_inc_return(&rp_init_profile_num) - 1;
+    if (unlikely(idx >= INIT_PROFILE_MAX_STEPS))
+        return; //the overflow is reported when printing
+
+    struct init_profile_entry *entry = &rp_init_profile[idx];
+    if (name)
+        strlcpy(entry->name, name, sizeof(entry->name));
+    else
+        snprintf(entry->name, sizeof(entry->name), "%ps", fn);
+    entry->took_us = took_us;
+    entry->out = out;
+}
+
+/**
+ * Calls an initializer & records how long it took in rp_init_profile
+ *
+ * @return value returned by the initializer
+ */
+#define profile_step(fn, ...) ({                 \
+    ktime_t __start = ktime_get();               \
+    int __out = fn(__VA_ARGS__);                 \
+    record_init_step(#fn, NULL, __start, __out); \
+    __out;                                       \
+})
+
+/**
+ * Prints the timing table in dev & test targets (which have logs, even if they're limited)
+ */
+static void __init print_init_profile(ktime_t load_start)
+{
+#if STEALTH_MODE < STEALTH_MODE_FULL
+    int num = atomic_read(&rp_init_profile_num);
+    _pr_loc_inf("Load-time profile (steps=%d, total=%lld us):", num, ktime_us_delta(ktime_get(), load_start));
+    for (int i = 0; i < min(num, INIT_PROFILE_MAX_STEPS); i++)
+        _pr_loc_inf("  %-*s %10lld us ret=%d", INIT_PROFILE_NAME_LEN, rp_init_profile[i].name,
+                    rp_init_profile[i].took_us, rp_init_profile[i].out);
+
+    if (unlikely(num > INIT_PROFILE_MAX_STEPS))
+        _pr_loc_inf("  (%d steps not recorded)", num - INIT_PROFILE_MAX_STEPS);
+#endif
+}
+/*********************************************************************************************************************/
+
+#define INIT_CHAIN_MAX_STEPS 2
+
+/**
+ * Chain of initializers which have to run in order; different chains don't depend on each other
+ */
+struct init_chain {
+    int (*steps[INIT_CHAIN_MAX_STEPS])(void); //NULL-terminated if shorter
+    bool (*is_needed)(const struct hw_config *hw); //optional; when it returns false the chain is skipped entirely
+    int out; //result of the chain; set when it finishes
+};
+
+static int __init init_pci_shim(void) { return register_pci_shim(current_config.hw_config); }
+static int __init init_pmu_shim(void) { return register_pmu_shim(current_config.hw_config); }
+
+/**
+ * Applies vIRQ dispatcher scheduling from the config; it's not fatal if it fails as vUARTs work without it
+ */
+static int __init init_vuart_irq_sched(void)
+{
+    const struct vuart_irq_sched *sched = &current_config.vuart_irq;
+    if (sched->policy == SCHED_NORMAL && sched->priority == 0 && sched->cpu == VUART_VIRQ_CPU_ANY)
+        return 0; //defaults of the dispatcher
+
+    if (vuart_set_virq_sched(sched->policy, sched->priority, sched->cpu) != 0)
+        pr_loc_wrn("Failed to apply %s - vIRQ dispatcher will use default scheduling", CMDLINE_CT_VUART_IRQ);
+
+    return 0;
+}
+
+//All of these only need the core (config, execve interceptor, SCSI notifier, driver watchers) registered beforehand
+static struct init_chain parallel_init_chains[] __initdata = {
+    { .steps = { register_disable_executables_shim, register_fw_update_shim } }, //both add execve rules
+#ifndef DBG_DISABLE_UNLOADABLE
+    { .steps = { init_pci_shim }, .is_needed = pci_shim_is_needed }, //it's a core hw but it's not checked early
+#endif
+    { .steps = { register_disk_smart_shim } }, //provide fake SMART to userspace
+    { .steps = { register_io_scheduler_shim } }, //per-disk elevator & queue tuning; needs SCSI notifier
+    { .steps = { init_pmu_shim }, .is_needed = pmu_shim_is_needed }, //used as early as mfgBIOS loads (=late)
+};
+static ASYNC_DOMAIN_EXCLUSIVE(init_domain);
+
+static void __init run_init_chain(void *data, async_cookie_t cookie)
+{
+    struct init_chain *chain = data;
+
+    chain->out = 0;
+    for (int i = 0; i < INIT_CHAIN_MAX_STEPS && chain->steps[i]; i++) {
+        ktime_t start = ktime_get();
+        chain->out = chain->steps[i]();
+        record_init_step(NULL, chain->steps[i], start, chain->out);
+        if (chain->out != 0) {
+            pr_loc_err("Initializer %pF failed with code=%d", chain->steps[i], chain->out);
+            return;
+        }
+    }
+}
+
+/**
+ * Runs all parallel_init_chains at once and waits for all of them to finish
+ *
+ * Many of these wait for drivers or rescan buses, so the time taken is close to the slowest chain instead of the sum.
+ * All chains are always finished (even if some of them failed) so that nothing runs in the background on error.
+ *
+ * @return 0 on success, -E of the first failed chain on error
+ */
+static int __init run_parallel_init_chains(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(parallel_init_chains); i++) {
+        struct init_chain *chain = &parallel_init_chains[i];
+        if (chain->is_needed && !chain->is_needed(current_config.hw_config)) {
+            pr_loc_dbg("Skipping %pF - not needed for %s", chain->steps[0],
+                       hw_cfg(current_config.hw_config, name));
+            chain->out = 0;
+            continue;
+        }
+
+        async_schedule_domain(run_init_chain, chain, &init_domain);
+    }
+
+    async_synchronize_full_domain(&init_domain);
+
+    for (int i = 0; i < ARRAY_SIZE(parallel_init_chains); i++) {
+        if (parallel_init_chains[i].out != 0)
+            return parallel_init_chains[i].out;
+    }
+
+    return 0;
+}
+
 static int __init init_(void)
 {
     int out = 0;
+    ktime_t load_start = ktime_get();
 
     pr_loc_dbg("================================================================================================");
     pr_loc_inf("RedPill %s loading...", RP_VERSION_STR);
 
     if (
-         get_kln_p() < 0 //Find pointer of kallsyms_lookup_name function, This MUST be the first entry
-         || (out = extract_config_from_cmdline(&current_config)) != 0 //This MUST be the second entry
-         || (out = populate_runtime_config(&current_config)) != 0 //This MUST be third
-         || (out = register_uart_fixer(current_config.hw_config)) != 0 //Fix consoles ASAP
-         || (out = register_scsi_notifier()) != 0 //Load SCSI notifier so that boot shim (& others) can use it
-         || (out = register_sata_port_shim()) //This should be bfr boot shim as it can fix some things need by boot
-         || (out = register_boot_shim(&current_config.boot_media)) //Make sure we're quick with this one
-         || (out = register_execve_interceptor()) != 0 //Register this reasonably high as other modules can use it blindly
-         || (out = register_bios_shim(current_config.hw_config)) != 0
-         || (out = register_disable_executables_shim()) != 0
-         || (out = register_fw_update_shim()) != 0
-#ifndef DBG_DISABLE_UNLOADABLE
-         || (out = register_pci_shim(current_config.hw_config)) != 0 //it's a core hw but it's not checked early
+         profile_step(get_kln_p) < 0 //Find pointer of kallsyms_lookup_name function, This MUST be the first entry
+         || (out = profile_step(init_symbol_cache)) != 0 //Resolve common symbols at once; right after get_kln_p
+         || (out = profile_step(register_memory_helper_metrics)) != 0 //Before anything writes to kernel .text
+         || (out = profile_step(bind_protected_calls)) != 0 //Uses the symbol cache; before anything calls them
+         || (out = profile_step(register_override_symbol_poke_handler)) != 0 //Must be before anything overrides symbols
+         || (out = profile_step(register_override_hooks)) != 0 //Must be before anything hooks symbols
+         || (out = profile_step(register_metrics)) != 0 //Shims can collect metrics without it, but let's expose all
+         || (out = profile_step(register_mem_accounting)) != 0 //Allocations are accounted before it too
+         || (out = profile_step(register_vuart_capture)) != 0 //Before any vUART so that all lines can be captured
+#ifdef RPDBG_OVS_STATS
+         || (out = profile_step(register_ovs_stats)) != 0 //Stats are collected even without it, but let's fail early
+#endif
+#ifdef RPDBG_EXECVE
+         || (out = profile_step(register_execve_trace)) != 0 //Must be before execve interceptor to not miss early calls
+#endif
+#ifdef RPDBG_DRIVER_PROFILE
+         || (out = profile_step(register_driver_profile)) != 0 //Before anything watching drivers; timeline "zero"
+#endif
+#ifdef RPDBG_PMU_TRACE
+         || (out = profile_step(register_pmu_trace)) != 0 //Before PMU shim to capture its very first packets
 #endif
-         || (out = register_disk_smart_shim()) != 0 //provide fake SMART to userspace
-         || (out = register_pmu_shim(current_config.hw_config)) != 0 //this is used as early as mfgBIOS loads (=late)
-         || (out = initialize_stealth(&current_config)) != 0 //Should be after any shims to let shims have real stuff
-         || (out = reset_elevator()) != 0 //Cosmetic, can be the last one
+         || (out = profile_step(extract_config_from_cmdline, &current_config)) != 0 //This MUST be the second entry
+         || (out = profile_step(populate_runtime_config, &current_config)) != 0 //This MUST be third
+         || (out = profile_step(register_uart_fixer, current_config.hw_config)) != 0 //Fix consoles ASAP
+         || (out = profile_step(register_scsi_notifier)) != 0 //Load SCSI notifier so that boot shim (& others) can use
+         || (out = profile_step(register_sata_port_shim)) //This should be bfr boot shim as it can fix things for boot
+         || (out = profile_step(register_boot_shim, &current_config.boot_media)) //Make sure we're quick with this one
+         || (out = profile_step(register_execve_interceptor)) != 0 //Reasonably high as other modules can use it blindly
+         || (out = profile_step(register_bios_shim, current_config.hw_config)) != 0
+         || (out = profile_step(init_vuart_irq_sched)) != 0 //before any vUART is added (i.e. PMU shim)
+         || (out = profile_step(run_parallel_init_chains)) != 0 //independent shims; see parallel_init_chains
+#ifdef RPDBG_VUART_BENCH
+         || (out = profile_step(register_vuart_bench)) != 0 //runs in the background
+#endif
+#ifdef RPDBG_VUART_NET
+         || (out = profile_step(register_vuart_net, &current_config)) != 0 //after shims which may own vUARTs
+#endif
+#ifdef RPDBG_SHIM_BENCH
+         || (out = profile_step(register_shim_bench)) != 0 //runs in the background, after shims it measures
+#endif
+#ifdef RPDBG_SCSI_BENCH
+         || (out = profile_step(register_scsi_bench)) != 0 //runs in the background, after all SCSI subscribers
+#endif
+         || (out = profile_step(register_config_sysfs)) != 0 //After all shims it can reconfigure
+         || (out = profile_step(initialize_stealth, &current_config)) != 0 //After all shims to let them have real stuff
+         || (out = profile_step(reset_elevator)) != 0 //Cosmetic, can be the last one
        )
         goto error_out;
 
+    print_init_profile(load_start);
     pr_loc_inf("RedPill %s loaded successfully (stealth=%d)", RP_VERSION_STR, STEALTH_MODE);
     return 0;
 
     error_out:
+        print_init_profile(load_start); //especially useful to see which step failed
+        unregister_driver_bind_notifiers(); //notifiers cannot outlive the module either
+        unregister_override_hooks(); //after the notifiers, which may be the last ones hooking driver_register()
+        unregister_override_symbol_poke_handler(); //the handler cannot outlive the module
+        unregister_metrics(); //debugfs entries cannot outlive the module
+        unregister_vuart_capture(); //neither can these
+        unregister_config_sysfs(); //neither can sysfs ones
+        free_symbol_cache();
         pr_loc_crt("RedPill %s cannot be loaded, initializer error=%d", RP_VERSION_STR, out);
 #ifdef KP_ON_LOAD_ERROR
         rp_crash();
@@ -82,16 +309,50 @@ static int __init init_(void)
 module_init(init_);
 
 #if STEALTH_MODE < STEALTH_MODE_FULL //module cannot be unloaded in full-stealth anyway
+//Shims skipped by their is_needed predicate during init must not be unregistered either
+static int __exit cleanup_pci_shim(void)
+{
+    return pci_shim_is_needed(current_config.hw_config) ? unregister_pci_shim() : 0;
+}
+
+static int __exit cleanup_pmu_shim(void)
+{
+    return pmu_shim_is_needed(current_config.hw_config) ? unregister_pmu_shim() : 0;
+}
+
+//SMART emulation can be disabled at runtime (see config/config_sysfs.c)
+static int __exit cleanup_disk_smart_shim(void)
+{
+    return is_disk_smart_shim_registered() ? unregister_disk_smart_shim() : 0;
+}
+
 static void __exit cleanup_(void)
 {
     pr_loc_inf("RedPill %s unloading...", RP_VERSION_STR);
 
     int (*cleanup_handlers[])(void ) = {
+        unregister_config_sysfs, //must be before shims it reconfigures
         uninitialize_stealth,
-        unregister_pmu_shim,
-        unregister_disk_smart_shim,
+#ifdef RPDBG_VUART_BENCH
+        unregister_vuart_bench,
+#endif
+#ifdef RPDBG_VUART_NET
+        unregister_vuart_net, //must be before shims which may own vUARTs it listens to
+#endif
+#ifdef RPDBG_SHIM_BENCH
+        unregister_shim_bench, //must be before shims it measures
+#endif
+#ifdef RPDBG_SCSI_BENCH
+        unregister_scsi_bench, //must be before SCSI subscribers it measures
+#endif
+        cleanup_pmu_shim,
+#ifdef RPDBG_PMU_TRACE
+        unregister_pmu_trace, //must be after PMU shim it captures
+#endif
+        unregister_io_scheduler_shim,
+        cleanup_disk_smart_shim,
 #ifndef DBG_DISABLE_UNLOADABLE
-        unregister_pci_shim,
+        cleanup_pci_shim,
 #endif
         unregister_fw_update_shim,
         unregister_disable_executables_shim,
@@ -100,18 +361,42 @@ static void __exit cleanup_(void)
         unregister_boot_shim,
         unregister_sata_port_shim,
         unregister_scsi_notifier,
-        unregister_uart_fixer
+        unregister_uart_fixer,
+#ifdef RPDBG_EXECVE
+        unregister_execve_trace,
+#endif
+#ifdef RPDBG_OVS_STATS
+        unregister_ovs_stats,
+#endif
+        unregister_driver_bind_notifiers, //must be after everything which could watch drivers
+        unregister_vuart_capture, //must be after all vUARTs are removed
+        unregister_metrics, //must be after everything which could collect metrics
+#ifdef RPDBG_DRIVER_PROFILE
+        unregister_driver_profile,
+#endif
+        unregister_override_hooks, //must be after all hook handlers are removed
+        unregister_override_symbol_poke_handler, //must be after all overrides are removed
     };
 
     int out;
+    s64 took_us[ARRAY_SIZE(cleanup_handlers)];
+    ktime_t unload_start = ktime_get();
     for (int i = 0; i < ARRAY_SIZE(cleanup_handlers); i++) {
         pr_loc_dbg("Calling cleanup handler %pF<%p>", cleanup_handlers[i], cleanup_handlers[i]);
+        ktime_t start = ktime_get();
         out = cleanup_handlers[i]();
+        took_us[i] = ktime_us_delta(ktime_get(), start);
         if (out != 0)
             pr_loc_wrn("Cleanup handler %pF failed with code=%d", cleanup_handlers[i], out);
     }
 
+    _pr_loc_inf("Unload-time profile (handlers=%zu, total=%lld us):", ARRAY_SIZE(cleanup_handlers),
+                ktime_us_delta(ktime_get(), unload_start));
+    for (int i = 0; i < ARRAY_SIZE(cleanup_handlers); i++)
+        _pr_loc_inf("  %-*ps %10lld us", INIT_PROFILE_NAME_LEN, cleanup_handlers[i], took_us[i]);
+
     free_runtime_config(&current_config); //A special snowflake ;)
+    free_symbol_cache();
 
     pr_loc_inf("RedPill %s is dead", RP_VERSION_STR);
     pr_loc_dbg("================================================================================================");
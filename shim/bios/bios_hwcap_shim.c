@@ -1,18 +1,32 @@
 /**
  * Overrides GetHwCapability to provide additional capabilities for older platforms (e.g. 3615xs)
+ *
+ * DSM daemons query capabilities constantly and answers never change for a given mfgBIOS, so every answer is resolved
+ * only on the first call for a given capability and served from hwcap_answers[] afterwards. This matters mostly for
+ * proxied capabilities, as calling the original GetHwCapability means unpatching & repatching it.
  */
 #include "bios_hwcap_shim.h"
 #include "../../common.h"
 #include "../shim_base.h"
 #include "../../internal/override/override_symbol.h" //overriding GetHWCapability
-#include "../../config/platform_types.h" //hw_config, platform_has_hwmon_*
+#include "../../config/platform_types.h" //hw_config, hw_cfg(), platform_has_hwmon_*
 #include <linux/synobios.h> //CAPABILITY_*, CAPABILITY
+#include <linux/compiler.h> //READ_ONCE(), WRITE_ONCE()
 
 #define SHIM_NAME "mfgBIOS HW Capability"
+#define HWCAP_CACHED_IDS 64 //all known CAPABILITY_* are way below that; others are resolved on every call
 
 static const struct hw_config *hw_config = NULL;
 static override_symbol_inst *GetHwCapability_ovs = NULL;
 
+//Resolved answers indexed by CAPABILITY.id; an entry is written once when ready is false, and never changes after
+struct hwcap_answer {
+    bool ready;
+    int support;
+    int fout;
+};
+static struct hwcap_answer hwcap_answers[HWCAP_CACHED_IDS];
+
 static void dbg_compare_cap_value(SYNO_HW_CAPABILITY id, int computed_support)
 {
 #ifdef DBG_HWCAP
@@ -26,27 +40,32 @@ static void dbg_compare_cap_value(SYNO_HW_CAPABILITY id, int computed_support)
 #endif
 }
 
-static int GetHwCapability_shim(CAPABILITY *cap)
+/**
+ * Computes (or gets from the original GetHwCapability) an answer for a capability
+ *
+ * @param cacheable Set to true if the answer can be reused for all subsequent calls with the same cap->id
+ *
+ * @return value to be returned by GetHwCapability
+ */
+static int resolve_hw_capability(CAPABILITY *cap, bool *cacheable)
 {
-    if (unlikely(!cap)) {
-        pr_loc_err("Got NULL-ptr to %s", __FUNCTION__);
-        return -EINVAL;
-    }
-
     switch (cap->id) {
         case CAPABILITY_THERMAL:
             cap->support = platform_has_hwmon_thermal(hw_config) ? 1 : 0;
             dbg_compare_cap_value(cap->id, cap->support);
+            *cacheable = true;
             return 0;
 
         case CAPABILITY_CPU_TEMP:
-            cap->support = hw_config->has_cpu_temp;
+            cap->support = hw_cfg(hw_config, has_cpu_temp);
             dbg_compare_cap_value(cap->id, cap->support);
+            *cacheable = true;
             return 0;
 
         case CAPABILITY_FAN_RPM_RPT:
             cap->support = platform_has_hwmon_fan_rpm(hw_config) ? 1 : 0;
             dbg_compare_cap_value(cap->id, cap->support);
+            *cacheable = true;
             return 0;
 
         case CAPABILITY_DISK_LED_CTRL:
@@ -65,6 +84,7 @@ static int GetHwCapability_shim(CAPABILITY *cap)
             pr_loc_dbg("proxying GetHwCapability(id=%d)->support => real=%d [org_fout=%d, ovs_fout=%d]", cap->id,
                        cap->support, org_fout, ovs_fout);
 
+            *cacheable = (ovs_fout == 0); //if we failed to call the original we don't really know the answer
             return org_fout;
         }
 
@@ -74,6 +94,33 @@ static int GetHwCapability_shim(CAPABILITY *cap)
     }
 }
 
+static int GetHwCapability_shim(CAPABILITY *cap)
+{
+    if (unlikely(!cap)) {
+        pr_loc_err("Got NULL-ptr to %s", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    struct hwcap_answer *answer = ((unsigned int)cap->id < HWCAP_CACHED_IDS) ? &hwcap_answers[cap->id] : NULL;
+    if (likely(answer && READ_ONCE(answer->ready))) {
+        smp_rmb(); //pairs with smp_wmb() below
+        cap->support = answer->support;
+        return answer->fout;
+    }
+
+    //Multiple threads may resolve the same capability at once - this is harmless, as they will get the same answer
+    bool cacheable = false;
+    int out = resolve_hw_capability(cap, &cacheable);
+    if (cacheable && answer) {
+        answer->support = cap->support;
+        answer->fout = out;
+        smp_wmb(); //answer must be complete before it's marked as ready
+        WRITE_ONCE(answer->ready, true);
+    }
+
+    return out;
+}
+
 int register_bios_hwcap_shim(const struct hw_config *hw)
 {
     shim_reg_in();
@@ -82,6 +129,7 @@ int register_bios_hwcap_shim(const struct hw_config *hw)
         shim_reg_already();
 
     hw_config = hw;
+    memset(hwcap_answers, 0, sizeof(hwcap_answers)); //mfgBIOS may have been reloaded since the last time
     override_symbol_or_exit_int(GetHwCapability_ovs, "GetHwCapability", GetHwCapability_shim);
 
     shim_reg_ok();
@@ -2,6 +2,9 @@
  * Responds to all HWMON ("hardware monitor") calls coming to the mfgBIOS
  *
  * This submodule emulates both legitimate HWMON calls as well as "legacy" hardware monitoring calls get_fan_status()
+ * Readings are generated in the background and mfgBIOS calls only copy the latest snapshot (see hwmon_snapshot).
+ * On bare metal real sensors can be used instead of fake ones (see hwmon_proxy.c and CMDLINE_CT_HWMON_PT). Sensors
+ * which are missing or failed to read are still faked.
  */
 #include "bios_hwmon_shim.h"
 #include "../shim_base.h" //shim_reg_in(), shim_reg_ok(), shim_reset_in(), shim_reset_ok()
@@ -10,6 +13,12 @@
 #include "../../internal/helper/math_helper.h" //prandom_int_range_stable
 #include "mfgbios_types.h" //HWMON_*
 #include "../../config/platform_types.h" //HWMON_*_ID
+#include "../../config/runtime_config.h" //current_config.hwmon_pt_interval
+#include "hwmon_proxy.h" //hwmon_proxy_*(), struct hwmon_proxy_readings
+#include "../../internal/metrics.h" //RP_METRIC(), rp_metric_*()
+#include <linux/seqlock.h> //DEFINE_SEQLOCK, read_seq*(), write_seq*()
+#include <linux/workqueue.h> //DECLARE_DELAYED_WORK, schedule_delayed_work(), cancel_delayed_work_sync()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
 
 #define SHIM_NAME "mfgBIOS HW Monitor"
 #ifdef DBG_HWMON
@@ -112,7 +121,14 @@ static const __used char *hwmon_current_id_map[] = {
 };
 
 /************************************************ Various small tools *************************************************/
+#ifdef RP_PLATFORM
+//The platform is known at compile time so sensor loops are unrolled over constants (see hw_cfg())
+static const struct hw_config_hwmon *const hwmon_cfg = &rp_fixed_platform.hwmon;
+#define set_hwmon_cfg(ptr) do { } while(0)
+#else
 static const struct hw_config_hwmon *hwmon_cfg = NULL;
+#define set_hwmon_cfg(ptr) hwmon_cfg = (ptr)
+#endif
 #define guard_hwmon_cfg() \
     if (unlikely(!hwmon_cfg)) { \
         pr_loc_bug("Called %s without hwmon_cfg context being populated", __FUNCTION__); \
@@ -125,53 +141,89 @@ static const struct hw_config_hwmon *hwmon_cfg = NULL;
         return -EFAULT;                                       \
     }
 
-/******************************************* mfgBIOS LKM replacement functions ****************************************/
+/*********************************************** Sensor readings snapshot *********************************************/
+//mfgBIOS (i.e. scemd) polls sensors multiple times a second. Instead of generating & formatting readings on every call
+// they're generated by the background refresher (hwmon_refresh_work) every hwmon_refresh_interval and published as a
+// complete, ready-to-copy snapshot. The seqlock makes sure readers never see a half-updated one without ever blocking
+// the refresher. Thanks to that mfgBIOS calls never wait for slow (e.g. I2C/SMBus) real sensors.
+#define HWMON_REFRESH_INTERVAL (2 * HZ) //for fake sensors; real ones use CMDLINE_CT_HWMON_PT
+
+struct hwmon_snapshot {
+    int cpu_num;
+    int cpu_temp[MAX_CPU];
+    SYNO_HWMON_SENSOR_TYPE thermal;
+    SYNO_HWMON_SENSOR_TYPE voltage;
+    SYNO_HWMON_SENSOR_TYPE fan_rpm;
+};
+
+static struct hwmon_snapshot hwmon_snapshot; //published snapshot; read via read_hwmon_snapshot()
+static struct hwmon_snapshot hwmon_snapshot_next; //snapshot being built; only touched by the refresher
+static DEFINE_SEQLOCK(hwmon_snapshot_lock);
+
+//Previous raw readings used to generate the next ones (see prandom_int_range_stable())
+static int cur_cpu_temp = 0;
+static int hwmon_thermals[HWMON_SYS_THERMAL_ZONE_IDS];
+static int hwmon_voltages[HWMON_SYS_VOLTAGE_SENSOR_IDS];
+static int hwmon_fans_rpm[HWMON_SYS_FAN_RPM_IDS];
+
+static bool hwmon_passthrough = false; //whether real sensors are used (see hwmon_proxy.c); only set by the refresher
+static bool hwmon_discover_pending = false; //real sensors should be discovered by the refresher on its next run
+static unsigned long hwmon_refresh_interval = HWMON_REFRESH_INTERVAL;
+static struct hwmon_proxy_readings real_readings; //only touched by the refresher
+
 /**
- * Provides fan status
- * 
- * Currently the fan is always assumed to be running
+ * Picks a real sensor reading (if available) or generates a fake one
+ *
+ * @param real Real readings of a given kind (indexed like the platform sensors list, see struct hwmon_proxy_readings)
+ * @param real_num Number of elements in the real readings
+ * @param idx Index of the sensor on the platform sensors list
+ * @param last Previous value (it will be updated)
+ * @param dev,min,max Parameters for the fake reading (see prandom_int_range_stable())
  */
-static int bios_get_fan_state(int no, enum MfgCompatFanStatus *status)
+static int get_sensor_value(const int *real, int real_num, int idx, int *last, int dev, int min, int max)
 {
-    hwmon_pr_loc_dbg("mfgBIOS: GET_FAN_STATE(%d) => MFGC_FAN_RUNNING", no);
-    *status = MFGC_FAN_RUNNING;
-    return 0;
+    if (hwmon_passthrough && idx < real_num && real[idx] != HWMON_PROXY_NO_READING)
+        *last = real[idx];
+    else
+        *last = prandom_int_range_stable(last, dev, min, max);
+
+    return *last;
 }
 
-static int cur_cpu_temp = 0;
 /**
- * Returns CPU temperature across all cores
+ * Copies a part of the published snapshot
  *
- * Currently it always returns a fake value. However, it should only do so if running under hypervisor. In bare-metal
- * scenario we can simply proxy to syno_cpu_temperature() [or not override that part at all].
+ * @param dst Destination buffer
+ * @param src Pointer to a member of hwmon_snapshot
+ * @param len Size of the member
  */
-static int bios_get_cpu_temp(SYNOCPUTEMP *temp)
-{
-    int fake_temp = prandom_int_range_stable(&cur_cpu_temp, TEMP_DEV, FAKE_CPU_TEMP_MIN, FAKE_CPU_TEMP_MAX);
-    temp->cpu_num = MAX_CPU;
-    for(int i=0; i < MAX_CPU; ++i)
-        temp->cpu_temp[i] = fake_temp;
+static RP_METRIC(hwmon_reads, RP_MG_HWMON, RP_METRIC_COUNTER);
+static RP_METRIC(hwmon_refreshes, RP_MG_HWMON, RP_METRIC_COUNTER);
+static RP_METRIC(hwmon_refresh_errors, RP_MG_HWMON, RP_METRIC_COUNTER);
+static RP_METRIC(hwmon_refresh_ns, RP_MG_HWMON, RP_METRIC_HISTOGRAM);
+static struct rp_metric *const hwmon_metrics[] = {
+    &hwmon_reads, &hwmon_refreshes, &hwmon_refresh_errors, &hwmon_refresh_ns
+};
 
-    hwmon_pr_loc_dbg("mfgBIOS: GET_CPU_TEMP(surf=%d, cpuNum=%d) => %d°C", temp->blSurface, temp->cpu_num, fake_temp);
+static void read_hwmon_snapshot(void *dst, const void *src, size_t len)
+{
+    rp_metric_inc(&hwmon_reads);
 
-    return 0;
+    unsigned int seq;
+    do {
+        seq = read_seqbegin(&hwmon_snapshot_lock);
+        memcpy(dst, src, len);
+    } while (read_seqretry(&hwmon_snapshot_lock, seq));
 }
 
-static int *hwmon_thermals = NULL;
 /**
- * Returns various HWMON temperatures
+ * Generates temperatures for all thermal zones present on the platform
  *
- * @param reading Pointer to save results
  * @return 0 on success, -E on error
  */
-static int bios_hwmon_get_thermal(SYNO_HWMON_SENSOR_TYPE *reading)
+static int build_hwmon_thermal(SYNO_HWMON_SENSOR_TYPE *reading)
 {
-    guard_hwmon_cfg();
-    if (unlikely(!hwmon_thermals))
-        kzalloc_or_exit_int(hwmon_thermals, sizeof(int) * HWMON_SYS_THERMAL_ZONE_IDS);
-
     guarded_strscpy(reading->type_name, HWMON_SYS_THERMAL_NAME, sizeof(reading->type_name));
-    hwmon_pr_loc_dbg("mfgBIOS: => %s(type=%s)", __FUNCTION__, reading->type_name);
 
     reading->sensor_num = 0;
     for (int i = 0; i < HWMON_SYS_THERMAL_ZONE_IDS; i++) {
@@ -180,33 +232,23 @@ static int bios_hwmon_get_thermal(SYNO_HWMON_SENSOR_TYPE *reading)
 
         guarded_strscpy(reading->sensor[i].sensor_name, hwmon_sys_thermal_zone_id_map[hwmon_cfg->sys_thermal[i]],
                         sizeof(reading->sensor[i].sensor_name)); //Save the name of the sensor
-        hwmon_thermals[i] = prandom_int_range_stable(&hwmon_thermals[i], TEMP_DEV, FAKE_SURFACE_TEMP_MIN,
-                                                     FAKE_SURFACE_TEMP_MAX);
+        get_sensor_value(real_readings.thermal, real_readings.thermal_num, i, &hwmon_thermals[i], TEMP_DEV,
+                         FAKE_SURFACE_TEMP_MIN, FAKE_SURFACE_TEMP_MAX);
         snprintf(reading->sensor[i].value, sizeof(reading->sensor[i].value), "%d", hwmon_thermals[i]);
         ++reading->sensor_num;
-
-        hwmon_pr_loc_dbg("mfgBIOS: <= %s() %s->%d °C", __FUNCTION__,
-                         hwmon_sys_thermal_zone_id_map[hwmon_cfg->sys_thermal[i]], hwmon_thermals[i]);
     }
 
     return 0;
 }
 
-static int *hwmon_voltages = NULL;
 /**
- * Returns various HWMON voltages
+ * Generates voltages for all voltage sensors present on the platform
  *
- * @param reading Pointer to save results
  * @return 0 on success, -E on error
  */
-static int bios_hwmon_get_voltages(SYNO_HWMON_SENSOR_TYPE *reading)
+static int build_hwmon_voltages(SYNO_HWMON_SENSOR_TYPE *reading)
 {
-    guard_hwmon_cfg();
-    if (unlikely(!hwmon_voltages))
-        kzalloc_or_exit_int(hwmon_voltages, sizeof(int) * HWMON_SYS_VOLTAGE_SENSOR_IDS);
-
     guarded_strscpy(reading->type_name, HWMON_SYS_VOLTAGE_NAME, sizeof(reading->type_name));
-    hwmon_pr_loc_dbg("mfgBIOS: => %s(type=%s)", __FUNCTION__, reading->type_name);
 
     reading->sensor_num = 0;
     for (int i = 0; i < HWMON_SYS_VOLTAGE_SENSOR_IDS; i++) {
@@ -215,34 +257,23 @@ static int bios_hwmon_get_voltages(SYNO_HWMON_SENSOR_TYPE *reading)
 
         guarded_strscpy(reading->sensor[i].sensor_name, hwmon_sys_vsens_id_map[hwmon_cfg->sys_voltage[i]],
                         sizeof(reading->sensor[i].sensor_name)); //Save the name of the sensor
-        hwmon_voltages[i] = prandom_int_range_stable(&hwmon_voltages[i], VOLT_DEV,
-                                                     fake_volt_min(hwmon_cfg->sys_voltage[i]),
-                                                     fake_volt_max(hwmon_cfg->sys_voltage[i]));
+        get_sensor_value(real_readings.voltage, real_readings.voltage_num, i, &hwmon_voltages[i], VOLT_DEV,
+                         fake_volt_min(hwmon_cfg->sys_voltage[i]), fake_volt_max(hwmon_cfg->sys_voltage[i]));
         snprintf(reading->sensor[i].value, sizeof(reading->sensor[i].value), "%d", hwmon_voltages[i]);
         ++reading->sensor_num;
-
-        hwmon_pr_loc_dbg("mfgBIOS: <= %s() %s->%d mV", __FUNCTION__, hwmon_sys_vsens_id_map[hwmon_cfg->sys_voltage[i]],
-                         hwmon_voltages[i]);
     }
 
     return 0;
 }
 
-static int *hwmon_fans_rpm = NULL;
 /**
- * Returns HWMON fan speeds
+ * Generates speeds for all fans present on the platform
  *
- * @param reading Pointer to save results
  * @return 0 on success, -E on error
  */
-static int bios_hwmon_get_fans_rpm(SYNO_HWMON_SENSOR_TYPE *reading)
+static int build_hwmon_fans_rpm(SYNO_HWMON_SENSOR_TYPE *reading)
 {
-    guard_hwmon_cfg();
-    if (unlikely(!hwmon_fans_rpm))
-        kzalloc_or_exit_int(hwmon_fans_rpm, sizeof(int) * HWMON_SYS_FAN_RPM_IDS);
-
     guarded_strscpy(reading->type_name, HWMON_SYS_FAN_RPM_NAME, sizeof(reading->type_name));
-    hwmon_pr_loc_dbg("mfgBIOS: => %s(type=%s)", __FUNCTION__, reading->type_name);
 
     reading->sensor_num = 0;
     for (int i = 0; i < HWMON_SYS_FAN_RPM_IDS; i++) {
@@ -252,14 +283,215 @@ static int bios_hwmon_get_fans_rpm(SYNO_HWMON_SENSOR_TYPE *reading)
         guarded_strscpy(reading->sensor[i].sensor_name,
                         hwmon_sys_fan_id_map[hwmon_cfg->sys_fan_speed_rpm[i]],
                         sizeof(reading->sensor[i].sensor_name));
-        hwmon_fans_rpm[i] = prandom_int_range_stable(&hwmon_fans_rpm[i], FAN_SPEED_DEV, FAKE_RPM_MIN, FAKE_RPM_MAX);
+        get_sensor_value(real_readings.fan_rpm, real_readings.fan_rpm_num, i, &hwmon_fans_rpm[i], FAN_SPEED_DEV,
+                         FAKE_RPM_MIN, FAKE_RPM_MAX);
         snprintf(reading->sensor[i].value, sizeof(reading->sensor[i].value), "%d", hwmon_fans_rpm[i]);
         ++reading->sensor_num;
+    }
+
+    return 0;
+}
+
+/**
+ * Builds a complete snapshot of all sensors & publishes it
+ *
+ * @return 0 on success, -E on error (the previous snapshot stays published)
+ */
+static int refresh_hwmon_snapshot(void)
+{
+    struct hwmon_snapshot *next = &hwmon_snapshot_next;
+    int out;
+
+    memset(next, 0, sizeof(*next));
+    if (hwmon_passthrough && hwmon_proxy_read(&real_readings) != 0)
+        memset(&real_readings, 0, sizeof(real_readings)); //everything will be faked this time
+
+    if (real_readings.cpu_num > 0) { //real_readings are zeroed when not in passthrough mode
+        next->cpu_num = real_readings.cpu_num;
+        for (int i = 0; i < real_readings.cpu_num; i++)
+            next->cpu_temp[i] = get_sensor_value(real_readings.cpu_temp, real_readings.cpu_num, i, &cur_cpu_temp,
+                                                 TEMP_DEV, FAKE_CPU_TEMP_MIN, FAKE_CPU_TEMP_MAX);
+    } else {
+        next->cpu_num = MAX_CPU;
+        cur_cpu_temp = prandom_int_range_stable(&cur_cpu_temp, TEMP_DEV, FAKE_CPU_TEMP_MIN, FAKE_CPU_TEMP_MAX);
+        for (int i = 0; i < MAX_CPU; i++)
+            next->cpu_temp[i] = cur_cpu_temp;
+    }
+
+    if ((out = build_hwmon_thermal(&next->thermal)) != 0 || (out = build_hwmon_voltages(&next->voltage)) != 0 ||
+        (out = build_hwmon_fans_rpm(&next->fan_rpm)) != 0)
+        return out;
+
+    write_seqlock(&hwmon_snapshot_lock);
+    memcpy(&hwmon_snapshot, next, sizeof(hwmon_snapshot));
+    write_sequnlock(&hwmon_snapshot_lock);
+
+    return 0;
+}
+
+static void hwmon_refresh_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(hwmon_refresh_work, hwmon_refresh_work_fn);
+static bool hwmon_refresher_running = false;
+static DEFINE_MUTEX(hwmon_refresher_lock); //mfgBIOS (re)shimming can race with set_bios_hwmon_pt_interval()
+
+/**
+ * Switches to real sensors if requested (see start_hwmon_refresher())
+ *
+ * It's done here and not when mfgBIOS is shimmed as looking for sensors probes many sysfs files, which can take long.
+ */
+static void discover_real_sensors(void)
+{
+    hwmon_discover_pending = false;
+
+    int out = hwmon_proxy_discover(hwmon_cfg);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to discover real sensors - error=%d; sensors will be faked", out);
+        return;
+    }
+
+    hwmon_passthrough = true;
+    hwmon_refresh_interval = current_config.hwmon_pt_interval * HZ;
+}
+
+static void hwmon_refresh_work_fn(struct work_struct *work)
+{
+    if (unlikely(hwmon_discover_pending))
+        discover_real_sensors();
+
+    rp_metric_time_begin(start);
+    int out = refresh_hwmon_snapshot();
+    rp_metric_time_end(&hwmon_refresh_ns, start);
+    rp_metric_inc(&hwmon_refreshes);
+    if (unlikely(out != 0)) {
+        rp_metric_inc(&hwmon_refresh_errors);
+        pr_loc_err("Failed to refresh HWMON readings - error=%d", out);
+    }
+
+    schedule_delayed_work(&hwmon_refresh_work, hwmon_refresh_interval);
+}
+
+/**
+ * Publishes the first snapshot & starts the background refresher (noop if already running)
+ *
+ * The first snapshot is always a fake one, as it must be ready before any mfgBIOS call comes and this is called from
+ * the mfgBIOS module notifier (and under hwmon_refresher_lock). When real sensors were requested they're discovered &
+ * read by the refresher, which runs immediately in such case.
+ *
+ * @return 0 on success, -E on error
+ */
+static int start_hwmon_refresher(void)
+{
+    if (hwmon_refresher_running)
+        return 0;
 
-        hwmon_pr_loc_dbg("mfgBIOS: <= %s() %s->%d RPM", __FUNCTION__,
-                         hwmon_sys_fan_id_map[hwmon_cfg->sys_fan_speed_rpm[i]], hwmon_fans_rpm[i]);
+    int out = refresh_hwmon_snapshot(); //hwmon_passthrough is always false here so no sysfs is touched
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to generate HWMON readings - error=%d", out);
+        return out;
     }
 
+    hwmon_discover_pending = current_config.hwmon_pt_interval > 0;
+    schedule_delayed_work(&hwmon_refresh_work, hwmon_discover_pending ? 0 : hwmon_refresh_interval);
+    hwmon_refresher_running = true;
+
+    return 0;
+}
+
+static void stop_hwmon_refresher(void)
+{
+    if (!hwmon_refresher_running)
+        return;
+
+    cancel_delayed_work_sync(&hwmon_refresh_work);
+    hwmon_refresher_running = false;
+    hwmon_discover_pending = false;
+    hwmon_passthrough = false;
+    hwmon_refresh_interval = HWMON_REFRESH_INTERVAL;
+    memset(&real_readings, 0, sizeof(real_readings));
+    hwmon_proxy_free();
+}
+
+/******************************************* mfgBIOS LKM replacement functions ****************************************/
+/**
+ * Provides fan status
+ * 
+ * Currently the fan is always assumed to be running
+ */
+static int bios_get_fan_state(int no, enum MfgCompatFanStatus *status)
+{
+    hwmon_pr_loc_dbg("mfgBIOS: GET_FAN_STATE(%d) => MFGC_FAN_RUNNING", no);
+    *status = MFGC_FAN_RUNNING;
+    return 0;
+}
+
+/**
+ * Returns CPU temperature across all cores
+ *
+ * Under a hypervisor it returns a fake value for all cores. In passthrough mode (bare-metal) it returns per-core
+ * readings from coretemp.
+ */
+static int bios_get_cpu_temp(SYNOCPUTEMP *temp)
+{
+    int cpu_num;
+    int cpu_temp[MAX_CPU];
+    unsigned int seq;
+    do {
+        seq = read_seqbegin(&hwmon_snapshot_lock);
+        cpu_num = hwmon_snapshot.cpu_num;
+        memcpy(cpu_temp, hwmon_snapshot.cpu_temp, sizeof(cpu_temp));
+    } while (read_seqretry(&hwmon_snapshot_lock, seq));
+
+    temp->cpu_num = cpu_num;
+    for(int i=0; i < cpu_num; ++i)
+        temp->cpu_temp[i] = cpu_temp[i];
+
+    hwmon_pr_loc_dbg("mfgBIOS: GET_CPU_TEMP(surf=%d, cpuNum=%d) => %d°C", temp->blSurface, temp->cpu_num, cpu_temp[0]);
+
+    return 0;
+}
+
+/**
+ * Returns various HWMON temperatures
+ *
+ * @param reading Pointer to save results
+ * @return 0 on success, -E on error
+ */
+static int bios_hwmon_get_thermal(SYNO_HWMON_SENSOR_TYPE *reading)
+{
+    guard_hwmon_cfg();
+    read_hwmon_snapshot(reading, &hwmon_snapshot.thermal, sizeof(*reading));
+    hwmon_pr_loc_dbg("mfgBIOS: <= %s(type=%s) with %d sensors", __FUNCTION__, reading->type_name, reading->sensor_num);
+
+    return 0;
+}
+
+/**
+ * Returns various HWMON voltages
+ *
+ * @param reading Pointer to save results
+ * @return 0 on success, -E on error
+ */
+static int bios_hwmon_get_voltages(SYNO_HWMON_SENSOR_TYPE *reading)
+{
+    guard_hwmon_cfg();
+    read_hwmon_snapshot(reading, &hwmon_snapshot.voltage, sizeof(*reading));
+    hwmon_pr_loc_dbg("mfgBIOS: <= %s(type=%s) with %d sensors", __FUNCTION__, reading->type_name, reading->sensor_num);
+
+    return 0;
+}
+
+/**
+ * Returns HWMON fan speeds
+ *
+ * @param reading Pointer to save results
+ * @return 0 on success, -E on error
+ */
+static int bios_hwmon_get_fans_rpm(SYNO_HWMON_SENSOR_TYPE *reading)
+{
+    guard_hwmon_cfg();
+    read_hwmon_snapshot(reading, &hwmon_snapshot.fan_rpm, sizeof(*reading));
+    hwmon_pr_loc_dbg("mfgBIOS: <= %s(type=%s) with %d sensors", __FUNCTION__, reading->type_name, reading->sensor_num);
+
     return 0;
 }
 
@@ -335,11 +567,18 @@ static int bios_hwmon_get_current(struct hw_config_hwmon *hwc, SYNO_HWMON_SENSOR
 int shim_bios_module_hwmon_entries(const struct hw_config *hw)
 {
     shim_reg_in();
-    hwmon_cfg = &hw->hwmon;
+    set_hwmon_cfg(&hw->hwmon); //hw_cfg() can't yield an address; it's a noop in single-platform builds anyway
+    rp_metrics_register(hwmon_metrics, ARRAY_SIZE(hwmon_metrics));
+
+    mutex_lock(&hwmon_refresher_lock);
+    int out = start_hwmon_refresher();
+    mutex_unlock(&hwmon_refresher_lock);
+    if (unlikely(out != 0))
+        return out;
 
     _shim_bios_module_entry(VTK_GET_FAN_STATE, bios_get_fan_state);
 
-    if (hw->has_cpu_temp)
+    if (hw_cfg(hw, has_cpu_temp))
         _shim_bios_module_entry(VTK_GET_CPU_TEMP, bios_get_cpu_temp);
 
     if (platform_has_hwmon_thermal(hw))
@@ -368,12 +607,35 @@ int reset_bios_module_hwmon_shim(void)
 {
     shim_reset_in();
 
-    hwmon_cfg = NULL;
+    mutex_lock(&hwmon_refresher_lock);
+    stop_hwmon_refresher();
+    mutex_unlock(&hwmon_refresher_lock);
+    set_hwmon_cfg(NULL);
     cur_cpu_temp = 0;
-    try_kfree(hwmon_thermals);
-    try_kfree(hwmon_voltages);
-    try_kfree(hwmon_fans_rpm);
+    memset(hwmon_thermals, 0, sizeof(hwmon_thermals));
+    memset(hwmon_voltages, 0, sizeof(hwmon_voltages));
+    memset(hwmon_fans_rpm, 0, sizeof(hwmon_fans_rpm));
 
     shim_reset_ok();
     return 0;
-}
\ No newline at end of file
+}
+
+int set_bios_hwmon_pt_interval(unsigned int interval_sec)
+{
+    int out = 0;
+
+    mutex_lock(&hwmon_refresher_lock);
+    current_config.hwmon_pt_interval = interval_sec;
+    if (hwmon_refresher_running) { //otherwise it will be picked up when mfgBIOS is shimmed
+        stop_hwmon_refresher();
+        out = start_hwmon_refresher();
+        if (unlikely(out != 0))
+            pr_loc_err("Failed to restart HWMON refresher - error=%d; last readings will be returned", out);
+    }
+    mutex_unlock(&hwmon_refresher_lock);
+
+    if (out == 0)
+        pr_loc_inf("HWMON switching to %s sensors (interval=%us)", interval_sec ? "real" : "fake", interval_sec);
+
+    return out;
+}
@@ -9,4 +9,16 @@ struct hw_config;
 int shim_bios_module_hwmon_entries(const struct hw_config *hw);
 int reset_bios_module_hwmon_shim(void);
 
+/**
+ * Switches between real & fake sensors at runtime (see CMDLINE_CT_HWMON_PT)
+ *
+ * The new mode is saved in current_config and, if the shim is active, the refresher is restarted with it right away.
+ * It may sleep for a long time (as discovery of real sensors does).
+ *
+ * @param interval_sec Refresh interval of real sensors or 0 to fake them
+ *
+ * @return 0 on success, -E on error
+ */
+int set_bios_hwmon_pt_interval(unsigned int interval_sec);
+
 #endif //REDPILL_BIOS_HWMON_SHIM_H
@@ -1,22 +1,20 @@
 /**
  * Overrides HWMONGetPSUStatusByI2C to provide fake psu status for SA6400, RS4021xsp and FS2500
  * to find the required symbol you can consult the mfgbios output while booting the dev LKM
+ *
+ * Every mfgBIOS contains only some of these functions (the platform-specific ones are mutually exclusive), so the
+ * missing ones are skipped and only the ones found are overridden (in a single batch).
  */
 #include "bios_psu_status_shim.h"
 #include "../../common.h"
 #include "../shim_base.h"
 #include "../../internal/override/override_symbol.h" //overriding HWMONGetPSUStatusByI2C
+#include "../../internal/helper/symbol_helper.h" //kernel_has_symbol()
 #include "../../config/platform_types.h" //hw_config, platform_has_hwmon_*
 #include <linux/synobios.h> //CAPABILITY_*, CAPABILITY
 
 #define SHIM_NAME "mfgBIOS HWMONGetPSUStatusByI2C"
 
-static const struct hw_config *hw_config = NULL;
-static override_symbol_inst *HWMONGetPSUStatusByI2C_ovs = NULL;
-static override_symbol_inst *RS4021xspI2CGetPowerInfo_ovs = NULL;
-static override_symbol_inst *FS2500I2CGetPowerInfo_ovs = NULL;
-static override_symbol_inst *SA3600I2CGetPowerInfo_ovs = NULL;
-
 static int HWMONGetPSUStatusByI2C_shim(void)
 {
     return 1;
@@ -37,25 +35,81 @@ static int SA3600I2CGetPowerInfo_shim(void)
     return 1;
 }
 
+struct psu_status_override {
+    const char *name;
+    const void *shim;
+    override_symbol_inst *ovs; //NULL if not overridden (e.g. the mfgBIOS doesn't have it)
+};
+
+static const struct hw_config *hw_config = NULL;
+static bool psu_status_registered = false;
+static struct psu_status_override psu_status_overrides[] = {
+    { "HWMONGetPSUStatusByI2C", HWMONGetPSUStatusByI2C_shim, NULL },
+    { "RS4021xspI2CGetPowerInfo", RS4021xspI2CGetPowerInfo_shim, NULL },
+    { "FS2500I2CGetPowerInfo", FS2500I2CGetPowerInfo_shim, NULL },
+    { "SA3600I2CGetPowerInfo", SA3600I2CGetPowerInfo_shim, NULL },
+};
+
+/**
+ * Restores all overridden PSU functions
+ *
+ * @return 0 on success or -E on error (of the last failed restore; it continues with others)
+ */
+static int restore_psu_status_overrides(void)
+{
+    int out = 0;
+    for (unsigned int i = 0; i < ARRAY_SIZE(psu_status_overrides); i++) {
+        struct psu_status_override *ov = &psu_status_overrides[i];
+        if (!ov->ovs)
+            continue;
+
+        int restore_out = restore_symbol(ov->ovs);
+        ov->ovs = NULL; //the instance is freed even if restoring failed
+        if (unlikely(restore_out != 0)) {
+            pr_loc_err("Failed to restore %s - error=%d", ov->name, restore_out);
+            out = restore_out;
+        }
+    }
+
+    return out;
+}
+
 int register_bios_psu_status_shim(const struct hw_config *hw)
 {
     shim_reg_in();
 
-    if (unlikely(HWMONGetPSUStatusByI2C_ovs))
-        shim_reg_already();
-    if (unlikely(RS4021xspI2CGetPowerInfo_ovs))
-        shim_reg_already();
-    if (unlikely(FS2500I2CGetPowerInfo_ovs))
-        shim_reg_already();
-    if (unlikely(SA3600I2CGetPowerInfo_ovs))
+    if (unlikely(psu_status_registered))
         shim_reg_already();
 
-    hw_config = hw;
-    override_symbol_or_exit_int(HWMONGetPSUStatusByI2C_ovs, "HWMONGetPSUStatusByI2C", HWMONGetPSUStatusByI2C_shim);
-    override_symbol_or_exit_int(RS4021xspI2CGetPowerInfo_ovs, "RS4021xspI2CGetPowerInfo_ovs", RS4021xspI2CGetPowerInfo_shim);
-    override_symbol_or_exit_int(FS2500I2CGetPowerInfo_ovs, "FS2500I2CGetPowerInfo_ovs", FS2500I2CGetPowerInfo_shim);    
-    override_symbol_or_exit_int(SA3600I2CGetPowerInfo_ovs, "SA3600I2CGetPowerInfo_ovs", SA3600I2CGetPowerInfo_shim);    
+    //Only the functions this mfgBIOS has are requested; all of them are then patched at once
+    struct override_symbol_req reqs[ARRAY_SIZE(psu_status_overrides)];
+    unsigned int num = 0;
+    for (unsigned int i = 0; i < ARRAY_SIZE(psu_status_overrides); i++) {
+        struct psu_status_override *ov = &psu_status_overrides[i];
+        if (!kernel_has_symbol(ov->name)) {
+            pr_loc_dbg("%s not found - skipping", ov->name);
+            continue;
+        }
+
+        reqs[num].name = ov->name;
+        reqs[num].new_sym_ptr = ov->shim;
+        reqs[num].ovs = &ov->ovs;
+        ++num;
+    }
+
+    if (likely(num > 0)) {
+        int out = override_symbols_batch(reqs, num);
+        if (unlikely(out != 0)) {
+            pr_loc_err("Failed to override PSU status functions - error=%d", out);
+            return out;
+        }
+    }
+
+    if (unlikely(num == 0))
+        pr_loc_wrn("None of the PSU status functions were found in the mfgBIOS - PSU status will not be faked");
 
+    hw_config = hw;
+    psu_status_registered = true;
     shim_reg_ok();
     return 0;
 }
@@ -64,49 +118,15 @@ int unregister_bios_psu_status_shim(void)
 {
     shim_ureg_in();
 
-    if (unlikely(!HWMONGetPSUStatusByI2C_ovs))
-        return 0; //this is deliberately a noop
-    if (unlikely(!RS4021xspI2CGetPowerInfo_ovs))
-        return 0; //this is deliberately a noop
-    if (unlikely(!FS2500I2CGetPowerInfo_ovs))
+    if (unlikely(!psu_status_registered))
         return 0; //this is deliberately a noop
-    if (unlikely(!SA3600I2CGetPowerInfo_ovs))
-        return 0; //this is deliberately a noop
-
-    int out = restore_symbol(HWMONGetPSUStatusByI2C_ovs);
-    if (unlikely(out != 0)) {
-        pr_loc_err("Failed to restore HWMONGetPSUStatusByI2C - error=%d", out);
-        return out;
-    }
-    HWMONGetPSUStatusByI2C_ovs = NULL;
 
-    int outrs4021xsp = restore_symbol(RS4021xspI2CGetPowerInfo_ovs);
-    if (unlikely(outrs4021xsp != 0)) {
-        pr_loc_err("Failed to restore RS4021xspI2CGetPowerInfo - error=%d", out);
+    int out = restore_psu_status_overrides();
+    hw_config = NULL;
+    psu_status_registered = false;
+    if (unlikely(out != 0))
         return out;
-    }
-    HWMONGetPSUStatusByI2C_ovs = NULL;
-    RS4021xspI2CGetPowerInfo_ovs = NULL;
 
-    int outfs2500 = restore_symbol(FS2500I2CGetPowerInfo_ovs);
-    if (unlikely(outfs2500 != 0)) {
-        pr_loc_err("Failed to restore FS2500I2CGetPowerInfo - error=%d", out);
-        return out;
-    }
-    HWMONGetPSUStatusByI2C_ovs = NULL;
-    RS4021xspI2CGetPowerInfo_ovs = NULL;
-    FS2500I2CGetPowerInfo_ovs = NULL;
-
-    int outsa3600 = restore_symbol(SA3600I2CGetPowerInfo_ovs);
-    if (unlikely(outsa3600 != 0)) {
-        pr_loc_err("Failed to restore SA3600I2CGetPowerInfo - error=%d", out);
-        return out;
-    }
-    HWMONGetPSUStatusByI2C_ovs = NULL;
-    RS4021xspI2CGetPowerInfo_ovs = NULL;
-    FS2500I2CGetPowerInfo_ovs = NULL;
-    SA3600I2CGetPowerInfo_ovs = NULL;
-    
     shim_ureg_ok();
     return 0;
 }
@@ -114,18 +134,15 @@ int unregister_bios_psu_status_shim(void)
 int reset_bios_psu_status_shim(void)
 {
     shim_reset_in();
-    put_overridden_symbol(HWMONGetPSUStatusByI2C_ovs);
-    HWMONGetPSUStatusByI2C_ovs = NULL;
-
-    put_overridden_symbol(RS4021xspI2CGetPowerInfo_ovs);
-    RS4021xspI2CGetPowerInfo_ovs = NULL;
-
-    put_overridden_symbol(FS2500I2CGetPowerInfo_ovs);
-    FS2500I2CGetPowerInfo_ovs = NULL;
+    for (unsigned int i = 0; i < ARRAY_SIZE(psu_status_overrides); i++) {
+        if (psu_status_overrides[i].ovs) {
+            put_overridden_symbol(psu_status_overrides[i].ovs);
+            psu_status_overrides[i].ovs = NULL;
+        }
+    }
+    hw_config = NULL;
+    psu_status_registered = false;
 
-    put_overridden_symbol(SA3600I2CGetPowerInfo_ovs);
-    SA3600I2CGetPowerInfo_ovs = NULL;
-    
     shim_reset_ok();
     return 0;
 }
@@ -1,10 +1,13 @@
 #include "bios_shims_collection.h"
-#include "../../config/platform_types.h"
+#include "../../config/platform_types.h" //hw_cfg()
 #include "rtc_proxy.h"
 #include "bios_hwmon_shim.h"
 #include "../../common.h"
 #include "../../internal/helper/symbol_helper.h" //kernel_has_symbol()
 #include "../../internal/override/override_symbol.h" //shimming leds stuff
+#include "../../config/runtime_config.h" //current_config.dbg_vtable
+#include <linux/bitmap.h> //DECLARE_BITMAP, bitmap_*(), for_each_set_bit(), test_and_set_bit()
+#include <linux/workqueue.h> //DECLARE_DELAYED_WORK, schedule_delayed_work(), cancel_delayed_work_sync()
 
 
 #define DECLARE_NULL_ZERO_INT(for_what)                         \
@@ -12,11 +15,28 @@
         pr_loc_dbg("mfgBIOS: nullify zero-int for " #for_what); \
         return 0;                                               \
     }
-#define SHIM_TO_NULL_ZERO_INT(for_what) _shim_bios_module_entry(for_what, bios_##for_what##_null_zero_int);
+
+/**
+ * A single static shim of the mfgBIOS vtable
+ *
+ * All of them are listed in bios_vtable_shims[] and applied in that order. The condition is evaluated only when the
+ * vtable is shimmed for the first time; later passes only re-apply entries which were applied then.
+ */
+struct bios_vtable_shim {
+    unsigned int idx; //VTK_* index
+    const void *new_sym_ptr;
+    bool (*applies)(const struct hw_config *hw); //NULL if the shim applies to all platforms
+};
+
+#define BIOS_SHIM(vtk, sym, cond) { .idx = (vtk), .new_sym_ptr = (sym), .applies = (cond) }
+#define BIOS_SHIM_NULL_ZERO_INT(vtk) BIOS_SHIM(vtk, bios_##vtk##_null_zero_int, NULL)
 
 /********************************************* mfgBIOS LKM static shims ***********************************************/
 static unsigned long org_shimmed_entries[VTK_SIZE] = { '\0' }; //original entries which were shimmed by custom entries
 static unsigned long cust_shimmed_entries[VTK_SIZE] = { '\0' }; //custom entries which were set as shims
+static DECLARE_BITMAP(shimmed_entries, VTK_SIZE); //indexes of cust_shimmed_entries which are set
+static u16 shimmed_idxs[VTK_SIZE]; //same as shimmed_entries but packed, so that re-applying doesn't scan the bitmap
+static unsigned int shimmed_idxs_num = 0;
 
 static int bios_get_power_status(POWER_INFO *power)
 {
@@ -60,6 +80,36 @@ DECLARE_NULL_ZERO_INT(VTK_SET_HDD_ACT_LED);
 DECLARE_NULL_ZERO_INT(VTK_GET_MICROP_ID);
 DECLARE_NULL_ZERO_INT(VTK_SET_MICROP_ID);
 
+static bool platform_needs_rtc_proxy(const struct hw_config *hw)
+{
+    return hw_cfg(hw, emulate_rtc);
+}
+
+static const struct bios_vtable_shim bios_vtable_shims[] = {
+    BIOS_SHIM_NULL_ZERO_INT(VTK_SET_FAN_STATE),
+    BIOS_SHIM_NULL_ZERO_INT(VTK_SET_DISK_LED),
+    BIOS_SHIM_NULL_ZERO_INT(VTK_SET_PWR_LED),
+    // BIOS_SHIM_NULL_ZERO_INT(VTK_SET_GPIO_PIN),
+    BIOS_SHIM(VTK_GET_GPIO_PIN, shim_get_gpio_pin_usable, NULL),
+    BIOS_SHIM(VTK_SET_GPIO_PIN, shim_set_gpio_pin_usable, NULL),
+    BIOS_SHIM_NULL_ZERO_INT(VTK_SET_GPIO_PIN_BLINK),
+    BIOS_SHIM_NULL_ZERO_INT(VTK_SET_ALR_LED),
+    BIOS_SHIM(VTK_GET_BUZ_CLR, bios_get_buz_clr, NULL),
+    BIOS_SHIM_NULL_ZERO_INT(VTK_SET_BUZ_CLR),
+    BIOS_SHIM(VTK_GET_PWR_STATUS, bios_get_power_status, NULL),
+    BIOS_SHIM_NULL_ZERO_INT(VTK_SET_CPU_FAN_STATUS),
+    BIOS_SHIM_NULL_ZERO_INT(VTK_SET_PHY_LED),
+    BIOS_SHIM_NULL_ZERO_INT(VTK_SET_HDD_ACT_LED),
+    BIOS_SHIM_NULL_ZERO_INT(VTK_GET_MICROP_ID),
+    BIOS_SHIM_NULL_ZERO_INT(VTK_SET_MICROP_ID),
+    BIOS_SHIM(VTK_RTC_GET_TIME, rtc_proxy_get_time, platform_needs_rtc_proxy),
+    BIOS_SHIM(VTK_RTC_SET_TIME, rtc_proxy_set_time, platform_needs_rtc_proxy),
+    BIOS_SHIM(VTK_RTC_INT_APWR, rtc_proxy_init_auto_power_on, platform_needs_rtc_proxy),
+    BIOS_SHIM(VTK_RTC_GET_APWR, rtc_proxy_get_auto_power_on, platform_needs_rtc_proxy),
+    BIOS_SHIM(VTK_RTC_SET_APWR, rtc_proxy_set_auto_power_on, platform_needs_rtc_proxy),
+    BIOS_SHIM(VTK_RTC_UINT_APWR, rtc_proxy_uinit_auto_power_on, platform_needs_rtc_proxy),
+};
+
 /********************************************** mfgBIOS shimming routines *********************************************/
 static unsigned long *vtable_start = NULL; //set when shim_bios_module is called()
 void _shim_bios_module_entry(const unsigned int idx, const void *new_sym_ptr)
@@ -88,13 +138,56 @@ void _shim_bios_module_entry(const unsigned int idx, const void *new_sym_ptr)
     org_shimmed_entries[idx] = vtable_start[idx];
     cust_shimmed_entries[idx] = (unsigned long)new_sym_ptr;
     vtable_start[idx] = cust_shimmed_entries[idx];
+    if (!test_and_set_bit(idx, shimmed_entries))
+        shimmed_idxs[shimmed_idxs_num++] = idx;
+}
+
+/**
+ * Applies all static shims which apply to the platform
+ */
+static void apply_bios_vtable_shims(const struct hw_config *hw)
+{
+    for (unsigned int i = 0; i < ARRAY_SIZE(bios_vtable_shims); i++) {
+        const struct bios_vtable_shim *shim = &bios_vtable_shims[i];
+        if (!shim->applies || shim->applies(hw))
+            _shim_bios_module_entry(shim->idx, shim->new_sym_ptr);
+    }
+}
+
+/**
+ * Re-applies shims which were overwritten (by mfgBIOS) since they were set
+ *
+ * This runs on every module notification while mfgBIOS loads, so it only goes over entries which were shimmed.
+ *
+ * @return number of entries re-applied
+ */
+static unsigned int reapply_overwritten_entries(void)
+{
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < shimmed_idxs_num; i++) {
+        unsigned int idx = shimmed_idxs[i];
+        unsigned long cur = vtable_start[idx];
+        if (likely(cur == cust_shimmed_entries[idx]))
+            continue;
+
+        org_shimmed_entries[idx] = cur;
+        vtable_start[idx] = cust_shimmed_entries[idx];
+        ++count;
+    }
+
+    return count;
 }
 
 /**
  * Prints a table of memory between vtable_start and vtable_end, trying to resolve symbols as it goes
+ *
+ * This is a lot of output so it's only printed when requested (see CMDLINE_CT_DBG_VTABLE)
  */
 static void print_debug_symbols(const unsigned long *vtable_end)
 {
+    if (likely(!current_config.dbg_vtable))
+        return;
+
     if (unlikely(!vtable_start)) {
         pr_loc_dbg("Cannot print - no vtable address");
         return;
@@ -120,7 +213,8 @@ static void print_debug_symbols(const unsigned long *vtable_end)
 /**
  * Applies shims to the vtable used by the bios
  *
- * These calls may execute multiple times as the mfgBIOS is loading.
+ * These calls may execute multiple times as the mfgBIOS is loading. Only the first one does the full shimming; the
+ * subsequent ones just check which entries mfgBIOS overwrote in the meantime and re-apply them.
  *
  * @return true when shimming succeeded, false otherwise
  */
@@ -131,38 +225,26 @@ bool shim_bios_module(const struct hw_config *hw, struct module *mod, unsigned l
         return false;
     }
 
+    if (likely(vtable_start == vt_start && shimmed_idxs_num > 0)) {
+        unsigned int reapplied = reapply_overwritten_entries();
+        if (reapplied > 0) {
+            pr_loc_dbg("mfgBIOS overwrote %u shimmed vtable entries - re-applied", reapplied);
+            print_debug_symbols(vt_end);
+        }
+
+        return true;
+    }
+
     vtable_start = vt_start;
 
     print_debug_symbols(vt_end);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_FAN_STATE);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_DISK_LED);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_PWR_LED);
-    // SHIM_TO_NULL_ZERO_INT(VTK_SET_GPIO_PIN);
-    _shim_bios_module_entry(VTK_GET_GPIO_PIN, shim_get_gpio_pin_usable);
-    _shim_bios_module_entry(VTK_SET_GPIO_PIN, shim_set_gpio_pin_usable);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_GPIO_PIN_BLINK);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_ALR_LED);
-    _shim_bios_module_entry(VTK_GET_BUZ_CLR, bios_get_buz_clr);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_BUZ_CLR);
-    _shim_bios_module_entry(VTK_GET_PWR_STATUS, bios_get_power_status);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_CPU_FAN_STATUS);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_PHY_LED);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_HDD_ACT_LED);
-    SHIM_TO_NULL_ZERO_INT(VTK_GET_MICROP_ID);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_MICROP_ID);
-
-    if (hw->emulate_rtc) {
+    if (platform_needs_rtc_proxy(hw)) {
         pr_loc_dbg("Platform requires RTC proxy - enabling");
-        register_rtc_proxy_shim();
-        _shim_bios_module_entry(VTK_RTC_GET_TIME, rtc_proxy_get_time);
-        _shim_bios_module_entry(VTK_RTC_SET_TIME, rtc_proxy_set_time);
-        _shim_bios_module_entry(VTK_RTC_INT_APWR, rtc_proxy_init_auto_power_on);
-        _shim_bios_module_entry(VTK_RTC_GET_APWR, rtc_proxy_get_auto_power_on);
-        _shim_bios_module_entry(VTK_RTC_SET_APWR, rtc_proxy_set_auto_power_on);
-        _shim_bios_module_entry(VTK_RTC_UINT_APWR, rtc_proxy_uinit_auto_power_on);
+        register_rtc_proxy_shim(); //before its vtable entries are applied
     } else {
-        pr_loc_dbg("Native RTC supported - not enabling proxy (emulate_rtc=%d)", hw->emulate_rtc ? 1:0);
+        pr_loc_dbg("Native RTC supported - not enabling proxy (emulate_rtc=0)");
     }
+    apply_bios_vtable_shims(hw);
 
     shim_bios_module_hwmon_entries(hw); //Shim all hardware environment stuff (temps, fans, etc.)
 
@@ -173,12 +255,10 @@ bool shim_bios_module(const struct hw_config *hw, struct module *mod, unsigned l
 
 bool unshim_bios_module(unsigned long *vt_start, unsigned long *vt_end)
 {
-    for (int i = 0; i < VTK_SIZE; i++) {
-        //make sure to check the cust_ one as org_ may contain NULL ptrs and we should restore them as NULL if they were
-        // so originally
-        if (!cust_shimmed_entries[i])
-            continue;
-
+    //make sure to check the shimmed ones and not org_ as it may contain NULL ptrs and we should restore them as NULL if
+    // they were so originally
+    for (unsigned int n = 0; n < shimmed_idxs_num; n++) {
+        unsigned int i = shimmed_idxs[n];
         pr_loc_dbg("Restoring vtable [%d] from %ps<%p> to %ps<%p>", i, (void *) vt_start[i],
                    (void *) vt_start[i], (void *) org_shimmed_entries[i], (void *) org_shimmed_entries[i]);
         vtable_start[i] = org_shimmed_entries[i];
@@ -193,6 +273,8 @@ void reset_bios_shims(void)
 {
     memset(org_shimmed_entries, 0, sizeof(org_shimmed_entries));
     memset(cust_shimmed_entries, 0, sizeof(cust_shimmed_entries));
+    bitmap_zero(shimmed_entries, VTK_SIZE);
+    shimmed_idxs_num = 0;
     unregister_rtc_proxy_shim();
     reset_bios_module_hwmon_shim();
 }
@@ -208,22 +290,65 @@ static override_symbol_inst *ov_funcSYNOSATADiskLedCtrl = NULL;
 static override_symbol_inst *ov_syno_ahci_disk_led_enable = NULL;
 static override_symbol_inst *ov_syno_ahci_disk_led_enable_by_port = NULL;
 
+/*
+ * LED shims are called from the disk I/O path (libata-scsi calls them on every command activity), so they only record
+ * the requested state in per-port bitmaps. The state is then processed by a delayed work at most once per
+ * DISK_LED_FLUSH_INTERVAL_MS, with only the last state of every port which changed in the meantime. The I/O path never
+ * prints, locks or touches any hardware.
+ * Host-based and port-based calls share the same index space, as syno AHCI uses one host per port.
+ */
+#define DISK_LED_MAX_PORTS 64
+#define DISK_LED_FLUSH_INTERVAL_MS 1000
+static DECLARE_BITMAP(disk_led_on, DISK_LED_MAX_PORTS); //last requested state per port
+static DECLARE_BITMAP(disk_led_dirty, DISK_LED_MAX_PORTS); //ports with state not yet flushed
+
+static void flush_disk_leds_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(flush_disk_leds_work, flush_disk_leds_work_fn);
+
+static void flush_disk_leds_work_fn(struct work_struct *work)
+{
+    unsigned int port;
+    for_each_set_bit(port, disk_led_dirty, DISK_LED_MAX_PORTS) {
+        clear_bit(port, disk_led_dirty); //must be cleared before reading state so that a concurrent change re-queues
+        pr_loc_dbg("Disk LED of port=%u set to %s", port, test_bit(port, disk_led_on) ? "on" : "off");
+    }
+}
+
+/**
+ * Records LED state for a port and schedules the flush (if not already scheduled)
+ *
+ * This is safe to call from any context (incl. IRQ) as it only uses atomic bitops and schedule_delayed_work()
+ */
+static inline void queue_disk_led_state(unsigned int port, bool on)
+{
+    if (unlikely(port >= DISK_LED_MAX_PORTS))
+        return;
+
+    if (on)
+        set_bit(port, disk_led_on);
+    else
+        clear_bit(port, disk_led_on);
+
+    set_bit(port, disk_led_dirty);
+    schedule_delayed_work(&flush_disk_leds_work, msecs_to_jiffies(DISK_LED_FLUSH_INTERVAL_MS)); //noop if pending
+}
+
 static int funcSYNOSATADiskLedCtrl_shim(int host_num, SYNO_DISK_LED led)
 {
-    pr_loc_dbg("Received %s with host=%d led=%d", __FUNCTION__, host_num, led);
+    queue_disk_led_state(host_num, led != DISK_LED_OFF);
     //exit code is not used anywhere in the public code, so this value is an educated guess based on libata-scsi.c
     return 0;
 }
 
 int syno_ahci_disk_led_enable_shim(const unsigned short host_num, const int value)
 {
-    pr_loc_dbg("Received %s with host=%d val=%d", __FUNCTION__, host_num, value);
+    queue_disk_led_state(host_num, value != 0);
     return 0;
 }
 
 int syno_ahci_disk_led_enable_by_port_shim(const unsigned short port, const int value)
 {
-    pr_loc_dbg("Received %s with port=%d val=%d", __FUNCTION__, port, value);
+    queue_disk_led_state(port, value != 0);
     return 0;
 }
 
@@ -231,41 +356,34 @@ int shim_disk_leds_ctrl(const struct hw_config *hw)
 {
     //we're checking this here to remove knowledge of "struct hw_config" from bios_shim letting others know it's NOT
     //the place to do BIOS shimming decisions
-    if (!hw->fix_disk_led_ctrl)
+    if (!hw_cfg(hw, fix_disk_led_ctrl))
         return 0;
 
     pr_loc_dbg("Shimming disk led control API");
 
-    int out;
+    //All of the ones present are patched at once
+    struct override_symbol_req reqs[3];
+    unsigned int num = 0;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,0,0)
     //funcSYNOSATADiskLedCtrl exists on (almost?) all platforms, but it's null on some... go figure ;)
-    if (funcSYNOSATADiskLedCtrl) {
-        ov_funcSYNOSATADiskLedCtrl = override_symbol("funcSYNOSATADiskLedCtrl", funcSYNOSATADiskLedCtrl_shim);
-        if (unlikely(IS_ERR(ov_funcSYNOSATADiskLedCtrl))) {
-            out = PTR_ERR(ov_funcSYNOSATADiskLedCtrl);
-            ov_funcSYNOSATADiskLedCtrl = NULL;
-            pr_loc_err("Failed to shim funcSYNOSATADiskLedCtrl, error=%d", out);
-            return out;
-        }
-    }
+    if (funcSYNOSATADiskLedCtrl)
+        reqs[num++] = (struct override_symbol_req){ "funcSYNOSATADiskLedCtrl", funcSYNOSATADiskLedCtrl_shim,
+                                                    &ov_funcSYNOSATADiskLedCtrl };
 #endif
 
-    if (kernel_has_symbol("syno_ahci_disk_led_enable")) {
-        ov_syno_ahci_disk_led_enable = override_symbol("syno_ahci_disk_led_enable", syno_ahci_disk_led_enable_shim);
-        if (unlikely(IS_ERR(ov_syno_ahci_disk_led_enable))) {
-            out = PTR_ERR(ov_syno_ahci_disk_led_enable);
-            ov_syno_ahci_disk_led_enable = NULL;
-            pr_loc_err("Failed to shim syno_ahci_disk_led_enable, error=%d", out);
-            return out;
-        }
-    }
+    if (kernel_has_symbol("syno_ahci_disk_led_enable"))
+        reqs[num++] = (struct override_symbol_req){ "syno_ahci_disk_led_enable", syno_ahci_disk_led_enable_shim,
+                                                    &ov_syno_ahci_disk_led_enable };
 
-    if (kernel_has_symbol("syno_ahci_disk_led_enable_by_port")) {
-        ov_syno_ahci_disk_led_enable_by_port = override_symbol("syno_ahci_disk_led_enable_by_port", syno_ahci_disk_led_enable_by_port_shim);
-        if (unlikely(IS_ERR(ov_syno_ahci_disk_led_enable_by_port))) {
-            out = PTR_ERR(ov_syno_ahci_disk_led_enable_by_port);
-            ov_syno_ahci_disk_led_enable_by_port = NULL;
-            pr_loc_err("Failed to shim syno_ahci_disk_led_enable_by_port, error=%d", out);
+    if (kernel_has_symbol("syno_ahci_disk_led_enable_by_port"))
+        reqs[num++] = (struct override_symbol_req){ "syno_ahci_disk_led_enable_by_port",
+                                                    syno_ahci_disk_led_enable_by_port_shim,
+                                                    &ov_syno_ahci_disk_led_enable_by_port };
+
+    if (num > 0) {
+        int out = override_symbols_batch(reqs, num);
+        if (unlikely(out != 0)) {
+            pr_loc_err("Failed to shim disk led control API, error=%d", out);
             return out;
         }
     }
@@ -310,6 +428,11 @@ int unshim_disk_leds_ctrl(void)
         }
     }
 
+    //Shims are not reachable anymore so nothing can re-queue the work
+    cancel_delayed_work_sync(&flush_disk_leds_work);
+    bitmap_zero(disk_led_dirty, DISK_LED_MAX_PORTS);
+    bitmap_zero(disk_led_on, DISK_LED_MAX_PORTS);
+
     out = failed ? -EINVAL : 0;
     pr_loc_dbg("Finished %s (exit=%d)", __FUNCTION__, out);
 
@@ -0,0 +1,373 @@
+/*
+ * Proxy between real kernel sensors and mfgBIOS HWMON calls
+ *
+ * On bare metal there's no reason to fake sensor readings - the kernel already knows them. The problem is that there's
+ * no in-kernel API to read hwmon sensors: drivers (coretemp, nct6775, it87...) expose them only via sysfs attributes.
+ * Thus this module simply reads these attributes, the same way userspace tools (e.g. lm-sensors) do. Paths are located
+ * once (hwmon_proxy_discover()) as looking for them requires probing many files.
+ *
+ * Every real sensor is bound to a sensor of the platform (see struct hw_config_hwmon) and not just taken in the order
+ * in which it was found - otherwise e.g. a 3.3V reading could easily land on the V12 sensor:
+ *  - CPU cores: "coretemp" hwmon device [temp2_input, temp3_input, ...; temp1_input is a package sensor]
+ *  - thermal zones: any other hwmon device [tempN_input] or a thermal zone [/sys/class/thermal/thermal_zoneN/temp]
+ *    whose label [tempN_label] or type [thermal_zoneN/type] matches the platform sensor (see thermal_labels)
+ *  - voltages: any other hwmon device [inN_input] with a label [inN_label] matching the platform sensor (see
+ *    voltage_labels)
+ *  - fans: any other hwmon device [fanN_input]; both mfgBIOS and hwmon drivers number fans from 1
+ * Platform sensors which couldn't be bound to anything stay faked.
+ *
+ * Older kernels register hwmon attributes on the parent device and not the hwmon class device, so both are checked.
+ */
+#include "hwmon_proxy.h"
+#include "../../common.h"
+#include "mfgbios_types.h" //HWMON_SYS_*_NAME
+#include <linux/fs.h> //filp_open(), filp_close(), vfs_read(), kernel_read()
+#include <linux/uaccess.h> //get_fs(), set_fs()
+#include <linux/string.h> //strcasecmp()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
+
+#define HWMON_PROXY_MAX_DEVS 16 //max hwmonN & thermal_zoneN checked
+#define HWMON_PROXY_MAX_INPUTS 16 //max attributes of a single kind (e.g. fanN_input) checked per hwmon device
+#define HWMON_PROXY_PATH_LEN 64 //"/sys/class/hwmon/hwmonXX/device/tempXX_input" is the longest one
+#define HWMON_PROXY_LABEL_LEN 32
+#define HWMON_CORETEMP_NAME "coretemp"
+
+/**
+ * Labels under which real sensors are exposed for a given platform sensor; they're compared case-insensitively
+ *
+ * Besides mfgBIOS names these are the most common labels used by Super I/O chips and thermal zones. Anything not
+ * listed here is not bound to a platform sensor, as guessing would be worse than a fake reading.
+ */
+struct hwmon_proxy_label {
+    int id; //HWMON_SYS_*_ID of the platform sensor
+    const char *label;
+};
+
+static const struct hwmon_proxy_label thermal_labels[] = {
+    { HWMON_SYS_TZONE_REMOTE1_ID,  HWMON_SYS_TZONE_REMOTE1_NAME },
+    { HWMON_SYS_TZONE_REMOTE2_ID,  HWMON_SYS_TZONE_REMOTE2_NAME },
+    { HWMON_SYS_TZONE_LOCAL_ID,    HWMON_SYS_TZONE_LOCAL_NAME },
+    { HWMON_SYS_TZONE_SYSTEM_ID,   HWMON_SYS_TZONE_SYSTEM_NAME },
+    { HWMON_SYS_TZONE_SYSTEM_ID,   "SYSTIN" }, //nct6775 & friends
+    { HWMON_SYS_TZONE_SYSTEM_ID,   "acpitz" }, //ACPI thermal zone type
+    { HWMON_SYS_TZONE_ADT1_LOC_ID, HWMON_SYS_TZONE_ADT1_LOC_NAME },
+    { HWMON_SYS_TZONE_ADT2_LOC_ID, HWMON_SYS_TZONE_ADT2_LOC_NAME },
+};
+
+static const struct hwmon_proxy_label voltage_labels[] = {
+    { HWMON_SYS_VSENS_VCC_ID,      HWMON_SYS_VSENS_VCC_NAME },
+    { HWMON_SYS_VSENS_VPP_ID,      HWMON_SYS_VSENS_VPP_NAME },
+    { HWMON_SYS_VSENS_V33_ID,      HWMON_SYS_VSENS_V33_NAME },
+    { HWMON_SYS_VSENS_V33_ID,      "+3.3V" },
+    { HWMON_SYS_VSENS_V33_ID,      "3.3V" },
+    { HWMON_SYS_VSENS_V33_ID,      "3VCC" },
+    { HWMON_SYS_VSENS_V5_ID,       HWMON_SYS_VSENS_V5_NAME },
+    { HWMON_SYS_VSENS_V5_ID,       "+5V" },
+    { HWMON_SYS_VSENS_V5_ID,       "5V" },
+    { HWMON_SYS_VSENS_V5_ID,       "5VCC" },
+    { HWMON_SYS_VSENS_V12_ID,      HWMON_SYS_VSENS_V12_NAME },
+    { HWMON_SYS_VSENS_V12_ID,      "+12V" },
+    { HWMON_SYS_VSENS_V12_ID,      "12V" },
+    { HWMON_SYS_VSENS_ADT1_V33_ID, HWMON_SYS_VSENS_ADT1_V33_NAME },
+    { HWMON_SYS_VSENS_ADT2_V33_ID, HWMON_SYS_VSENS_ADT2_V33_NAME },
+};
+
+/**
+ * A single platform sensor & the real sensor bound to it (empty path if none)
+ */
+struct hwmon_proxy_slot {
+    int id; //HWMON_SYS_*_ID; for CPUs it's just the core number
+    char path[HWMON_PROXY_PATH_LEN];
+};
+
+struct hwmon_proxy_paths {
+    int cpu_num;
+    struct hwmon_proxy_slot cpu_temp[MAX_CPU];
+    int thermal_num;
+    struct hwmon_proxy_slot thermal[HWMON_SYS_THERMAL_ZONE_IDS];
+    int voltage_num;
+    struct hwmon_proxy_slot voltage[HWMON_SYS_VOLTAGE_SENSOR_IDS];
+    int fan_rpm_num;
+    struct hwmon_proxy_slot fan_rpm[HWMON_SYS_FAN_RPM_IDS];
+};
+static struct hwmon_proxy_paths *paths = NULL;
+
+/**
+ * Reads the beginning of a sysfs attribute
+ *
+ * @return number of bytes read (the buffer is always nul-terminated), or -E on error
+ */
+static ssize_t read_sysfs_attr(const char *path, char *buf, size_t size)
+{
+    struct file *file = filp_open(path, O_RDONLY, 0);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    loff_t pos = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+    ssize_t len = kernel_read(file, buf, size - 1, &pos);
+#else
+    mm_segment_t old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    ssize_t len = vfs_read(file, (char __user *)buf, size - 1, &pos);
+    set_fs(old_fs);
+#endif
+    filp_close(file, NULL);
+
+    buf[len > 0 ? len : 0] = '\0';
+    return len;
+}
+
+/**
+ * @return 0 on success, -E on error
+ */
+static int read_sysfs_long(const char *path, long *val)
+{
+    char buf[24];
+    ssize_t len = read_sysfs_attr(path, buf, sizeof(buf));
+    if (len <= 0)
+        return len < 0 ? (int)len : -ENODATA;
+
+    return kstrtol(strim(buf), 10, val);
+}
+
+/**
+ * Locates an attribute of hwmon device either on the class device or its parent
+ *
+ * @param path Buffer of HWMON_PROXY_PATH_LEN where the path will be saved
+ *
+ * @return true if found, false if not
+ */
+static bool find_hwmon_attr(char *path, int hwmon_id, const char *attr)
+{
+    char buf[24];
+
+    snprintf(path, HWMON_PROXY_PATH_LEN, "/sys/class/hwmon/hwmon%d/%s", hwmon_id, attr);
+    if (read_sysfs_attr(path, buf, sizeof(buf)) > 0)
+        return true;
+
+    snprintf(path, HWMON_PROXY_PATH_LEN, "/sys/class/hwmon/hwmon%d/device/%s", hwmon_id, attr);
+    return read_sysfs_attr(path, buf, sizeof(buf)) > 0;
+}
+
+/**
+ * Adds all attributes named <prefix><N>_input found in a hwmon device, until the list is full (used for CPU cores)
+ */
+static void find_hwmon_inputs(int hwmon_id, const char *prefix, int first, struct hwmon_proxy_slot *slots, int *num,
+                              int max)
+{
+    char attr[16];
+    for (int i = first; i < first + HWMON_PROXY_MAX_INPUTS && *num < max; i++) {
+        snprintf(attr, sizeof(attr), "%s%d_input", prefix, i);
+        if (!find_hwmon_attr(slots[*num].path, hwmon_id, attr))
+            continue;
+
+        pr_loc_dbg("Found sensor %s", slots[*num].path);
+        slots[*num].id = *num;
+        ++*num;
+    }
+}
+
+/**
+ * Finds a free platform sensor slot for a real sensor with a given label
+ *
+ * @return slot index or -ENOENT if the label is unknown or all matching slots are already bound
+ */
+static int find_labeled_slot(const char *label, const struct hwmon_proxy_label *labels, size_t labels_num,
+                             struct hwmon_proxy_slot *slots, int num)
+{
+    for (size_t i = 0; i < labels_num; i++) {
+        if (strcasecmp(labels[i].label, label) != 0)
+            continue;
+
+        for (int slot = 0; slot < num; slot++) {
+            if (slots[slot].id == labels[i].id && slots[slot].path[0] == '\0')
+                return slot;
+        }
+    }
+
+    return -ENOENT;
+}
+
+/**
+ * Binds all attributes named <prefix><N>_input of a hwmon device, which have a known <prefix><N>_label, to slots
+ */
+static void bind_labeled_hwmon_inputs(int hwmon_id, const char *prefix, int first,
+                                      const struct hwmon_proxy_label *labels, size_t labels_num,
+                                      struct hwmon_proxy_slot *slots, int num)
+{
+    char attr[16];
+    char path[HWMON_PROXY_PATH_LEN];
+    char label[HWMON_PROXY_LABEL_LEN];
+
+    for (int i = first; i < first + HWMON_PROXY_MAX_INPUTS; i++) {
+        snprintf(attr, sizeof(attr), "%s%d_label", prefix, i);
+        if (!find_hwmon_attr(path, hwmon_id, attr) || read_sysfs_attr(path, label, sizeof(label)) <= 0)
+            continue;
+
+        int slot = find_labeled_slot(strim(label), labels, labels_num, slots, num);
+        if (slot < 0)
+            continue;
+
+        snprintf(attr, sizeof(attr), "%s%d_input", prefix, i);
+        if (!find_hwmon_attr(slots[slot].path, hwmon_id, attr)) {
+            slots[slot].path[0] = '\0';
+            continue;
+        }
+
+        pr_loc_dbg("Bound sensor %s (\"%s\") to slot #%d", slots[slot].path, strim(label), slot);
+    }
+}
+
+/**
+ * Binds fanN_input attributes of a hwmon device to free FANn slots
+ */
+static void bind_hwmon_fans(int hwmon_id, struct hwmon_proxy_slot *slots, int num)
+{
+    char attr[16];
+
+    for (int slot = 0; slot < num; slot++) {
+        if (slots[slot].path[0] != '\0')
+            continue;
+
+        //HWMON_SYS_FANn_ID == n
+        snprintf(attr, sizeof(attr), "fan%d_input", slots[slot].id);
+        if (!find_hwmon_attr(slots[slot].path, hwmon_id, attr)) {
+            slots[slot].path[0] = '\0';
+            continue;
+        }
+
+        pr_loc_dbg("Bound sensor %s to slot #%d", slots[slot].path, slot);
+    }
+}
+
+/**
+ * Binds thermal zones with a known type to free slots
+ */
+static void bind_thermal_zones(struct hwmon_proxy_slot *slots, int num)
+{
+    char path[HWMON_PROXY_PATH_LEN];
+    char type[HWMON_PROXY_LABEL_LEN];
+    long val;
+
+    for (int i = 0; i < HWMON_PROXY_MAX_DEVS; i++) {
+        snprintf(path, sizeof(path), "/sys/class/thermal/thermal_zone%d/type", i);
+        if (read_sysfs_attr(path, type, sizeof(type)) <= 0)
+            continue;
+
+        int slot = find_labeled_slot(strim(type), thermal_labels, ARRAY_SIZE(thermal_labels), slots, num);
+        if (slot < 0)
+            continue;
+
+        snprintf(path, sizeof(path), "/sys/class/thermal/thermal_zone%d/temp", i);
+        if (read_sysfs_long(path, &val) != 0)
+            continue;
+
+        strscpy(slots[slot].path, path, sizeof(slots[slot].path));
+        pr_loc_dbg("Bound sensor %s (\"%s\") to slot #%d", path, type, slot);
+    }
+}
+
+/**
+ * Copies IDs of platform sensors into slots
+ *
+ * @return number of slots
+ */
+#define init_platform_slots(slots, ids, null_id) ({ \
+        int __num = 0; \
+        while (__num < (int)ARRAY_SIZE(ids) && (ids)[__num] != (null_id)) { \
+            (slots)[__num].id = (ids)[__num]; \
+            ++__num; \
+        } \
+        __num; \
+    })
+
+static int count_bound_slots(const struct hwmon_proxy_slot *slots, int num)
+{
+    int bound = 0;
+    for (int i = 0; i < num; i++)
+        bound += slots[i].path[0] != '\0';
+
+    return bound;
+}
+
+int hwmon_proxy_discover(const struct hw_config_hwmon *hwmon)
+{
+    char name[HWMON_PROXY_PATH_LEN];
+    char path[HWMON_PROXY_PATH_LEN];
+
+    hwmon_proxy_free();
+    kzalloc_or_exit_int(paths, sizeof(struct hwmon_proxy_paths), RP_MEM_BIOS);
+
+    paths->thermal_num = init_platform_slots(paths->thermal, hwmon->sys_thermal, HWMON_SYS_TZONE_NULL_ID);
+    paths->voltage_num = init_platform_slots(paths->voltage, hwmon->sys_voltage, HWMON_SYS_VSENS_NULL_ID);
+    paths->fan_rpm_num = init_platform_slots(paths->fan_rpm, hwmon->sys_fan_speed_rpm, HWMON_SYS_FAN_NULL_ID);
+
+    for (int i = 0; i < HWMON_PROXY_MAX_DEVS; i++) {
+        //hwmon IDs are not reused after a driver is unloaded, so there can be gaps
+        if (!find_hwmon_attr(path, i, "name") || read_sysfs_attr(path, name, sizeof(name)) <= 0)
+            continue;
+
+        strim(name);
+        pr_loc_dbg("Found hwmon%d (%s)", i, name);
+        if (strcmp(name, HWMON_CORETEMP_NAME) == 0) {
+            find_hwmon_inputs(i, "temp", 2, paths->cpu_temp, &paths->cpu_num, MAX_CPU);
+            if (paths->cpu_num == 0) //no per-core sensors - just use the package one
+                find_hwmon_inputs(i, "temp", 1, paths->cpu_temp, &paths->cpu_num, 1);
+        } else {
+            bind_labeled_hwmon_inputs(i, "temp", 1, thermal_labels, ARRAY_SIZE(thermal_labels), paths->thermal,
+                                      paths->thermal_num);
+            bind_labeled_hwmon_inputs(i, "in", 0, voltage_labels, ARRAY_SIZE(voltage_labels), paths->voltage,
+                                      paths->voltage_num);
+            bind_hwmon_fans(i, paths->fan_rpm, paths->fan_rpm_num);
+        }
+    }
+
+    bind_thermal_zones(paths->thermal, paths->thermal_num);
+
+    pr_loc_inf("Found real sensors: %d CPU temp, %d/%d thermal zones, %d/%d voltages, %d/%d fans", paths->cpu_num,
+               count_bound_slots(paths->thermal, paths->thermal_num), paths->thermal_num,
+               count_bound_slots(paths->voltage, paths->voltage_num), paths->voltage_num,
+               count_bound_slots(paths->fan_rpm, paths->fan_rpm_num), paths->fan_rpm_num);
+
+    return 0;
+}
+
+/**
+ * Reads a list of sensors (unbound ones are reported as HWMON_PROXY_NO_READING)
+ *
+ * @param divisor Value to divide raw readings by (e.g. temperatures are in m°C)
+ */
+static void read_sensors(const struct hwmon_proxy_slot *slots, int num, int *values, int divisor)
+{
+    long val;
+    for (int i = 0; i < num; i++) {
+        values[i] = (slots[i].path[0] != '\0' && read_sysfs_long(slots[i].path, &val) == 0) ? (int)(val / divisor)
+                                                                                            : HWMON_PROXY_NO_READING;
+    }
+}
+
+int hwmon_proxy_read(struct hwmon_proxy_readings *readings)
+{
+    if (unlikely(!paths)) {
+        pr_loc_bug("Called %s without sensors discovered first", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    readings->cpu_num = paths->cpu_num;
+    read_sensors(paths->cpu_temp, paths->cpu_num, readings->cpu_temp, 1000);
+    readings->thermal_num = paths->thermal_num;
+    read_sensors(paths->thermal, paths->thermal_num, readings->thermal, 1000);
+    readings->voltage_num = paths->voltage_num;
+    read_sensors(paths->voltage, paths->voltage_num, readings->voltage, 1);
+    readings->fan_rpm_num = paths->fan_rpm_num;
+    read_sensors(paths->fan_rpm, paths->fan_rpm_num, readings->fan_rpm, 1);
+
+    return 0;
+}
+
+void hwmon_proxy_free(void)
+{
+    rp_kfree(paths, RP_MEM_BIOS);
+    paths = NULL;
+}
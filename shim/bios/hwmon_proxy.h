@@ -0,0 +1,51 @@
+#ifndef REDPILL_HWMON_PROXY_H
+#define REDPILL_HWMON_PROXY_H
+
+#include <linux/synobios.h> //MAX_CPU
+#include "../../config/platform_types.h" //HWMON_SYS_*_IDS
+
+#define HWMON_PROXY_NO_READING INT_MIN //sensor exists but it couldn't be read this time
+
+/**
+ * Readings of real sensors
+ *
+ * CPU temperatures are in order of cores. Other arrays are indexed the same way as their lists in struct
+ * hw_config_hwmon; platform sensors without a real counterpart are HWMON_PROXY_NO_READING.
+ */
+struct hwmon_proxy_readings {
+    int cpu_num;
+    int cpu_temp[MAX_CPU]; //°C
+    int thermal_num;
+    int thermal[HWMON_SYS_THERMAL_ZONE_IDS]; //°C
+    int voltage_num;
+    int voltage[HWMON_SYS_VOLTAGE_SENSOR_IDS]; //mV
+    int fan_rpm_num;
+    int fan_rpm[HWMON_SYS_FAN_RPM_IDS]; //RPM
+};
+
+/**
+ * Finds real sensors exposed by the kernel (coretemp, ACPI thermal zones, and any other hwmon fans/voltages/temps) and
+ * binds them to sensors of the platform
+ *
+ * @param hwmon Sensors of the platform; it's only used during the call
+ *
+ * This function (as well as hwmon_proxy_read()) may sleep for a long time (e.g. on I2C/SMBus sensors). It should never
+ * be called from mfgBIOS calls directly.
+ *
+ * @return 0 on success, -E on error
+ */
+int hwmon_proxy_discover(const struct hw_config_hwmon *hwmon);
+
+/**
+ * Reads all sensors found by hwmon_proxy_discover()
+ *
+ * @return 0 on success, -E on error
+ */
+int hwmon_proxy_read(struct hwmon_proxy_readings *readings);
+
+/**
+ * Forgets sensors found by hwmon_proxy_discover()
+ */
+void hwmon_proxy_free(void);
+
+#endif //REDPILL_HWMON_PROXY_H
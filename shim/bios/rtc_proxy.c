@@ -13,6 +13,12 @@
  * As some of the functions are rarely used (and often even completely broken on many systems), like RTC wakeup they're
  * not really implemented but instead mocked to look "just good enough".
  *
+ * CMOS port I/O is slow, serialized by the rtc_lock and (on VMs) causes an exit to the hypervisor for every register
+ * read. Since DSM polls the clock quite often the RTC is only read once and then the time is computed from the value
+ * read plus the monotonic time which elapsed since. The cache is refreshed from the chip every RTC_CACHE_RESYNC_SEC
+ * (to catch up with e.g. hwclock writes or drift) and whenever a day boundary is crossed (as the day of week register
+ * format is left to the chip). Writes via rtc_proxy_set_time() update the cache directly.
+ *
  * References:
  *  - https://www.kernel.org/doc/html/latest/admin-guide/rtc.html
  *  - https://embedded.fm/blog/2018/6/5/an-introduction-to-bcd
@@ -22,8 +28,28 @@
 #include "../shim_base.h" //shim_*()
 #include <linux/mc146818rtc.h>
 #include <linux/bcd.h>
+#include <linux/ktime.h> //ktime_get(), ktime_sub()
+#include <linux/time.h> //mktime*(), time*_to_tm()
+#include <linux/spinlock.h>
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
 
 #define SHIM_NAME "RTC proxy"
+#define RTC_CACHE_RESYNC_SEC (10 * 60) //how often the cached time is re-read from the chip
+#define SEC_PER_DAY 86400
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+typedef time64_t rtc_secs_t;
+#define rtc_mktime mktime64
+#else
+typedef unsigned long rtc_secs_t;
+#define rtc_mktime mktime
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+#define rtc_secs_to_tm(secs, tm) time64_to_tm((secs), 0, (tm))
+#else
+#define rtc_secs_to_tm(secs, tm) time_to_tm((secs), 0, (tm))
+#endif
 
 //Confused? See https://slate.com/technology/2016/02/the-math-behind-leap-years.html
 #define year_is_leap(year) !((year)%((year)%25?4:16))
@@ -34,6 +60,15 @@ static const unsigned char months_to_days[] = {31, 28, 31, 30, 31, 30, 31, 31, 3
 
 static struct MfgCompatAutoPwrOn *auto_power_on_mock = NULL;
 
+//Last time read from (or written to) the chip; see file header
+static struct {
+    bool valid;
+    rtc_secs_t base_secs; //seconds since epoch (UTC) as read from the RTC
+    ktime_t base_ktime; //monotonic time when base_secs was read
+    unsigned char wkday; //day of week as reported by the chip (format is chip-specific)
+} rtc_cache = { .valid = false };
+static DEFINE_SPINLOCK(rtc_cache_lock);
+
 inline static void debug_print_mfg_time(struct MfgCompatTime *mfgTime)
 {
     pr_loc_dbg("MfgCompatTime raw data: sec=%u min=%u hr=%u wkd=%u day=%u mth=%u yr=%u", mfgTime->second,
@@ -119,15 +154,65 @@ static void write_rtc_num(unsigned char yy, unsigned char mm, unsigned char dd,
     spin_unlock_irqrestore(&rtc_lock, flags);
 }
 
-int rtc_proxy_get_time(struct MfgCompatTime *mfgTime)
+/**
+ * Stores time in the cache (see file header) if it looks like something which can be sanely interpolated
+ *
+ * Must be called with rtc_cache_lock held.
+ */
+static void update_rtc_cache(const struct MfgCompatTime *mfgTime)
 {
-    if (mfgTime == NULL) {
-        pr_loc_wrn("Got an invalid call to %s", __FUNCTION__);
-        return -EPERM;
+    if (unlikely(mfgTime->second > 59 || mfgTime->minute > 59 || mfgTime->hours > 23 || mfgTime->day == 0 ||
+                 mfgTime->day > 31 || mfgTime->month > 11)) {
+        pr_loc_wrn("RTC time looks invalid - it will not be cached");
+        rtc_cache.valid = false;
+        return;
     }
 
-    debug_print_mfg_time(mfgTime);
+    rtc_cache.base_secs = rtc_mktime(mfg_year_to_full(mfgTime->year), mfg_month_to_normal(mfgTime->month),
+                                     mfgTime->day, mfgTime->hours, mfgTime->minute, mfgTime->second);
+    rtc_cache.base_ktime = ktime_get();
+    rtc_cache.wkday = mfgTime->wkday;
+    rtc_cache.valid = true;
+}
+
+/**
+ * Computes current time from the cache without touching the chip
+ *
+ * Must be called with rtc_cache_lock held.
+ *
+ * @return true if mfgTime was filled, false if the RTC needs to be read
+ */
+static bool get_cached_rtc_time(struct MfgCompatTime *mfgTime)
+{
+    if (!rtc_cache.valid)
+        return false;
+
+    s64 elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), rtc_cache.base_ktime));
+    if (unlikely(elapsed_ns < 0) || elapsed_ns >= (s64)RTC_CACHE_RESYNC_SEC * NSEC_PER_SEC)
+        return false;
+
+    rtc_secs_t now_secs = rtc_cache.base_secs + div_u64(elapsed_ns, NSEC_PER_SEC);
+    if (now_secs / SEC_PER_DAY != rtc_cache.base_secs / SEC_PER_DAY) //day of week must come from the chip
+        return false;
+
+    struct tm now_tm;
+    rtc_secs_to_tm(now_secs, &now_tm);
+    mfgTime->year = now_tm.tm_year; //both tm & mfgTime use years since 1900...
+    mfgTime->month = now_tm.tm_mon; //...and 0-based months
+    mfgTime->day = now_tm.tm_mday;
+    mfgTime->wkday = rtc_cache.wkday;
+    mfgTime->hours = now_tm.tm_hour;
+    mfgTime->minute = now_tm.tm_min;
+    mfgTime->second = now_tm.tm_sec;
+
+    return true;
+}
 
+/**
+ * Reads the time from the chip itself
+ */
+static void read_rtc_time(struct MfgCompatTime *mfgTime)
+{
     unsigned char rtc_year; //mfgTime uses offset from 1900 while RTC uses 2-digit format (see below)
     unsigned char rtc_month; //mfgTime uses 0-11 while RTC uses 1-12
     read_rtc_num(&rtc_year, &rtc_month, &mfgTime->day, &mfgTime->wkday, &mfgTime->hours, &mfgTime->minute,
@@ -144,6 +229,29 @@ int rtc_proxy_get_time(struct MfgCompatTime *mfgTime)
 
     pr_loc_inf("Time got from RTC is %4d-%02d-%02d %2d:%02d:%02d (UTC)", mfg_year_to_full(mfgTime->year),
                mfg_month_to_normal(mfgTime->month), mfgTime->day, mfgTime->hours, mfgTime->minute, mfgTime->second);
+}
+
+int rtc_proxy_get_time(struct MfgCompatTime *mfgTime)
+{
+    if (mfgTime == NULL) {
+        pr_loc_wrn("Got an invalid call to %s", __FUNCTION__);
+        return -EPERM;
+    }
+
+    debug_print_mfg_time(mfgTime);
+
+    unsigned long flags;
+    spin_lock_irqsave(&rtc_cache_lock, flags);
+    if (likely(get_cached_rtc_time(mfgTime))) {
+        pr_loc_dbg("Time got from RTC cache is %4d-%02d-%02d %2d:%02d:%02d (UTC)", mfg_year_to_full(mfgTime->year),
+                   mfg_month_to_normal(mfgTime->month), mfgTime->day, mfgTime->hours, mfgTime->minute,
+                   mfgTime->second);
+    } else {
+        read_rtc_time(mfgTime);
+        update_rtc_cache(mfgTime);
+    }
+    spin_unlock_irqrestore(&rtc_cache_lock, flags);
+
     debug_print_mfg_time(mfgTime);
 
     return 0;
@@ -191,7 +299,11 @@ int rtc_proxy_set_time(struct MfgCompatTime *mfgTime)
     
     unsigned char rtc_month = mfg_month_to_normal(mfgTime->month); //mfgTime uses 0-11 while RTC uses 1-12
     
+    unsigned long flags;
+    spin_lock_irqsave(&rtc_cache_lock, flags);
     write_rtc_num(rtc_year, rtc_month, mfgTime->day, mfgTime->wkday, mfgTime->hours, mfgTime->minute, mfgTime->second);
+    update_rtc_cache(mfgTime); //what we just wrote is the current time - no need to read it back
+    spin_unlock_irqrestore(&rtc_cache_lock, flags);
 
     pr_loc_inf("RTC time set to %4d-%02d-%02d %2d:%02d:%02d (UTC)", mfg_year_to_full(mfgTime->year),
                mfg_month_to_normal(mfgTime->month), mfgTime->day, mfgTime->hours, mfgTime->minute, mfgTime->second);
@@ -249,8 +361,14 @@ int unregister_rtc_proxy_shim(void)
         return 0;
     }
 
-    kfree(auto_power_on_mock);
+    rp_kfree(auto_power_on_mock, RP_MEM_BIOS);
     auto_power_on_mock = NULL;
+
+    unsigned long flags;
+    spin_lock_irqsave(&rtc_cache_lock, flags);
+    rtc_cache.valid = false; //the RTC may be changed by someone else while we're not registered
+    spin_unlock_irqrestore(&rtc_cache_lock, flags);
+
     shim_ureg_ok();
     return 0;
 }
@@ -264,7 +382,7 @@ int register_rtc_proxy_shim(void)
         unregister_rtc_proxy_shim();
     }
 
-    kzalloc_or_exit_int(auto_power_on_mock, sizeof(struct MfgCompatAutoPwrOn));
+    kzalloc_or_exit_int(auto_power_on_mock, sizeof(struct MfgCompatAutoPwrOn), RP_MEM_BIOS);
     shim_reg_ok();
     return 0;
 }
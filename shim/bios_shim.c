@@ -264,10 +264,10 @@ int unregister_bios_shim(void)
     int out;
 
     shim_ureg_in();
-    if (likely(bios_shimmed)) {
-        if (!unshim_bios_module(vtable_start, vtable_end))
-            return -EINVAL;
-    }
+    //This cannot depend on bios_shimmed: an *early* shimmed mfgBIOS already has vtable entries replaced & the hwmon
+    // refresher and RTC proxy running. When nothing was shimmed (or mfgBIOS went away) it is a noop restore + cleanup.
+    if (!unshim_bios_module(vtable_start, vtable_end))
+        return -EINVAL;
 
     out = unregister_bios_module_notifier();
     if (unlikely(out != 0))
@@ -29,7 +29,7 @@
 
 #define DMI_MAX_LEN 512
 #define FW_BOARD_NAME "\x53\x79\x6e\x6f\x64\x65\x6e"    //Synoden
-#define FW_UPDATE_PATH "./H2OFFT-Lx64"
+#define FW_UPDATE_GLOB "*/H2OFFT-Lx64" //any directory, incl. relative "./"
 
 static char dmi_product_name_backup[DMI_MAX_LEN] = { '\0' };
 static void patch_dmi(void)
@@ -70,7 +70,7 @@ int register_fw_update_shim(void)
 {
     shim_reg_in();
 
-    int out = add_blocked_execve_filename(FW_UPDATE_PATH);
+    int out = add_blocked_execve_glob(FW_UPDATE_GLOB);
     if (out != 0)
         return out;
 
@@ -1,9 +1,18 @@
 #include "boot_shim_base.h"
 #include "../../common.h"
 #include "../../config/runtime_config.h" //struct boot_media
-#include "../../internal/scsi/scsi_toolbox.h" //is_sata_disk(), opportunistic_read_capacity()
+#include "../../internal/scsi/scsi_toolbox.h" //is_sata_disk(), scsi_get_cached_info()
 #include <scsi/scsi_device.h> //struct scsi_device
 #include <linux/usb.h> //struct usb_device
+#include <linux/atomic.h> //cmpxchg64()
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/clock.h> //local_clock()
+#else
+#include <linux/sched.h> //local_clock()
+#endif
 
 //Definition of known VID/PIDs for USB-based shims
 #define SBOOT_RET_VID 0xf400 //Retail boot drive VID
@@ -11,11 +20,111 @@
 #define SBOOT_MFG_VID 0xf401 //Force-reinstall boot drive VID
 #define SBOOT_MFG_PID 0xf401 //Force-reinstall boot drive PID
 
+#define BOOT_DEV_TIMING_DEBUGFS_NAME "redpill_boot_dev_timing"
+
 void *mapped_shim_data = NULL;
 
+/*********************************************** Detection telemetry *************************************************/
+static u64 milestones_ns[BOOT_DEV_MS_NUM] = { 0 }; //local_clock() of the first occurrence; 0 = not reached yet
+static const char *const milestone_names[BOOT_DEV_MS_NUM] = {
+    [BOOT_DEV_MS_MODULE_LOAD] = "module_load",
+    [BOOT_DEV_MS_DRIVER_READY] = "driver_ready",
+    [BOOT_DEV_MS_DEVICE_PROBE] = "device_probe",
+    [BOOT_DEV_MS_SHIM_APPLIED] = "shim_applied",
+};
+static struct dentry *timing_debugfs_file = NULL;
+
+/**
+ * Returns time of a milestone in us since BOOT_DEV_MS_MODULE_LOAD or -1 if not reached (yet)
+ */
+static long long milestone_us(enum boot_dev_milestone milestone)
+{
+    u64 at_ns = READ_ONCE(milestones_ns[milestone]);
+    u64 load_ns = READ_ONCE(milestones_ns[BOOT_DEV_MS_MODULE_LOAD]);
+    if (!at_ns || !load_ns)
+        return -1;
+
+    return at_ns > load_ns ? (at_ns - load_ns) / NSEC_PER_USEC : 0;
+}
+
+void boot_dev_timing_mark(enum boot_dev_milestone milestone)
+{
+    if (READ_ONCE(milestones_ns[milestone]))
+        return; //the cheapest path, as it's called for every event
+
+    u64 now_ns = local_clock() ? : 1; //0 means "not reached"
+    if (cmpxchg64(&milestones_ns[milestone], 0, now_ns) != 0)
+        return;
+
+    if (milestone != BOOT_DEV_MS_SHIM_APPLIED)
+        return;
+
+    pr_loc_inf("Boot device shimmed in %lld us since module load (driver_ready=%lld device_probe=%lld; -1 = n/a)",
+               milestone_us(BOOT_DEV_MS_SHIM_APPLIED), milestone_us(BOOT_DEV_MS_DRIVER_READY),
+               milestone_us(BOOT_DEV_MS_DEVICE_PROBE));
+}
+
+static int boot_dev_timing_show(struct seq_file *m, void *v)
+{
+    seq_printf(m, "# boot device detection milestones (times in us since module load; -1 = not reached)\n");
+    for (int i = 0; i < BOOT_DEV_MS_NUM; i++)
+        seq_printf(m, "%-12s %lld\n", milestone_names[i], milestone_us(i));
+
+    return 0;
+}
+
+static int boot_dev_timing_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, boot_dev_timing_show, NULL);
+}
+
+static const struct file_operations boot_dev_timing_fops = {
+    .owner = THIS_MODULE,
+    .open = boot_dev_timing_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int boot_dev_timing_start(void)
+{
+    for (int i = 0; i < BOOT_DEV_MS_NUM; i++)
+        WRITE_ONCE(milestones_ns[i], 0);
+    boot_dev_timing_mark(BOOT_DEV_MS_MODULE_LOAD);
+
+#if RP_DEBUGFS_ENABLED
+    if (unlikely(timing_debugfs_file)) {
+        pr_loc_bug("Boot device timing is already started");
+        return -EEXIST;
+    }
+
+    timing_debugfs_file = debugfs_create_file(BOOT_DEV_TIMING_DEBUGFS_NAME, 0400, NULL, NULL, &boot_dev_timing_fops);
+    if (IS_ERR_OR_NULL(timing_debugfs_file)) {
+        //it's just a telemetry - the summary line will still be logged
+        pr_loc_wrn("Failed to create debugfs entry %s - error=%ld", BOOT_DEV_TIMING_DEBUGFS_NAME,
+                   timing_debugfs_file ? PTR_ERR(timing_debugfs_file) : -ENOMEM);
+        timing_debugfs_file = NULL;
+    }
+#endif
+
+    return 0;
+}
+
+void boot_dev_timing_stop(void)
+{
+    if (!timing_debugfs_file)
+        return;
+
+    debugfs_remove(timing_debugfs_file);
+    timing_debugfs_file = NULL;
+}
+/*********************************************************************************************************************/
+
 void set_shimmed_boot_dev(void *private_data)
 {
     mapped_shim_data = private_data;
+    if (private_data)
+        boot_dev_timing_mark(BOOT_DEV_MS_SHIM_APPLIED);
 }
 
 void *get_shimmed_boot_dev(void)
@@ -30,10 +139,25 @@ bool scsi_is_boot_dev_target(const struct boot_media *boot_dev_config, struct sc
         return false;
     }
 
+    struct scsi_cached_info info;
+    int out = scsi_get_cached_info(sdp, &info);
+    if (out == 0)
+        pr_loc_dbg("Checking %s %s (serial \"%s\") as boot device candidate", info.vendor, info.model, info.serial);
+
+    return scsi_is_boot_dev_target_of_capacity(boot_dev_config, sdp, out == 0 ? info.capacity_mib : out);
+}
+
+bool scsi_is_boot_dev_target_of_capacity(const struct boot_media *boot_dev_config, struct scsi_device *sdp,
+                                         long long capacity_mib)
+{
+    if (!is_sata_disk(&sdp->sdev_gendev)) {
+        pr_loc_dbg("%s: it's not a SATA disk, ignoring", __FUNCTION__);
+        return false;
+    }
+
     pr_loc_dbg("Checking if SATA disk is a shim target - id=%u channel=%u vendor=\"%s\" model=\"%s\"", sdp->id,
                sdp->channel, sdp->vendor, sdp->model);
 
-    long long capacity_mib = opportunistic_read_capacity(sdp);
     if (unlikely(capacity_mib < 0)) {
         pr_loc_dbg("Failed to estimate drive capacity (error=%lld) - it WILL NOT be shimmed", capacity_mib);
         return false;
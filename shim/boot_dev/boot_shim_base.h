@@ -7,6 +7,41 @@ struct boot_media;
 struct usb_device;
 struct scsi_device;
 
+/**
+ * Milestones of boot device detection, recorded to measure how long it takes to get the boot device (see
+ * boot_dev_timing_mark())
+ */
+enum boot_dev_milestone {
+    BOOT_DEV_MS_MODULE_LOAD, //boot shim registration (it's one of the first things done when the module loads)
+    BOOT_DEV_MS_DRIVER_READY, //driver the boot device is connected through is ready (e.g. usbcore loaded)
+    BOOT_DEV_MS_DEVICE_PROBE, //the first possible boot device started probing
+    BOOT_DEV_MS_SHIM_APPLIED, //boot device was shimmed (recorded automatically by set_shimmed_boot_dev())
+    BOOT_DEV_MS_NUM
+};
+
+/**
+ * Starts boot device detection telemetry & records BOOT_DEV_MS_MODULE_LOAD
+ *
+ * Unless in full stealth mode the timings are also exposed in debugfs. When the boot device is shimmed a summary of
+ * all timings is logged.
+ *
+ * @return 0 on success, -E on error
+ */
+int boot_dev_timing_start(void);
+
+/**
+ * Records a milestone of boot device detection
+ *
+ * Only the first occurrence of every milestone is recorded, so it is cheap & safe to call it every time the event
+ * happens. It can be called from any context.
+ */
+void boot_dev_timing_mark(enum boot_dev_milestone milestone);
+
+/**
+ * Removes debugfs entry created by boot_dev_timing_start() (timings recorded so far are kept)
+ */
+void boot_dev_timing_stop(void);
+
 /**
  * Modify given USB device instance to conform to syno kernel boot device specification
  *
@@ -54,4 +89,12 @@ void *get_shimmed_boot_dev(void);
  */
 bool scsi_is_boot_dev_target(const struct boot_media *boot_dev_config, struct scsi_device *sdp);
 
+/**
+ * Same as scsi_is_boot_dev_target() but with capacity already known (e.g. from for_each_scsi_disk_capacity())
+ *
+ * @param capacity_mib Capacity in full mebibytes or -E if it couldn't be read
+ */
+bool scsi_is_boot_dev_target_of_capacity(const struct boot_media *boot_dev_config, struct scsi_device *sdp,
+                                         long long capacity_mib);
+
 #endif //REDPILL_BOOT_SHIM_BASE_H
@@ -19,6 +19,13 @@
  * In a birds-eye view the descriptors are modified just before the sd_probe() is called and removed when ida_pre_get()
  * is called by the sd_probe(). The ida_pre_get() is nearly guaranteed [even if the sd.c code changes] to be called
  * very early in the process as the ID allocation needs to be done for anything else to use structures created within.
+ * The camouflage is scoped to the probing device only: its Scsi_Host gets a private copy of the host template with the
+ * USB port type (so other hosts using the same driver don't see any change), and the ida_pre_get() trap only reacts
+ * to calls made by the task probing the camouflaged device. Everybody else passes through to the original. Thanks to
+ * that neither preemption nor interrupts need to be disabled during the probe.
+ * Passing through must not lift the override (which would race with other CPUs), so the trap is only set up when the
+ * ida_pre_get() prologue can be relocated into a detour. It's removed as soon as the boot device finished probing, as
+ * no other device can be camouflaged after that.
  *
  *
  * HERE BE DRAGONS
@@ -36,10 +43,13 @@
 #include "boot_shim_base.h" //set_shimmed_boot_dev(), get_shimmed_boot_dev(), scsi_is_shim_target(), usb_shim_as_boot_dev()
 #include "../shim_base.h" //shim_*
 #include "../../common.h"
-#include "../../internal/scsi/scsi_toolbox.h" //scsi_force_replug()
+#include "../../internal/scsi/scsi_toolbox.h" //scsi_force_replug(), for_each_scsi_disk_capacity(), is_sata_disk()
 #include "../../internal/scsi/scsi_notifier.h" //waiting for the drive to appear
-#include "../../internal/call_protected.h" //ida_pre_get()
 #include "../../internal/override/override_symbol.h" //overriding ida_pre_get()
+#include "../../internal/metrics.h" //RP_METRIC(), rp_metric_*()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+#include <linux/sched.h> //current
+#include <linux/string.h> //kmemdup()
 #include <scsi/scsi_device.h> //struct scsi_device
 #include <scsi/scsi_host.h> //struct Scsi_Host, SYNO_PORT_TYPE_*
 #include <linux/usb.h> //struct usb_device
@@ -49,10 +59,16 @@
 
 static const struct boot_media *boot_dev_config = NULL; //passed to scsi_is_shim_target() & usb_shim_as_boot_dev()
 static struct scsi_device *camouflaged_sdp = NULL; //set when ANY device is under camouflage
+static struct task_struct *camouflage_owner = NULL; //task probing camouflaged_sdp; the only one the trap reacts to
 static struct usb_device *fake_usbd = NULL; //ptr to our fake usb device scaffolding
-static int org_port_type = 0; //original port type of the device which registered
+static struct scsi_host_template *fake_hostt = NULL; //copy of camouflaged host template with USB port type
+static struct scsi_host_template *org_hostt = NULL; //original template of the camouflaged host
 static override_symbol_inst *ida_pre_get_ovs = NULL; //trap override
-static unsigned long irq_flags = 0; //saved flags when IRQs are disabled (to prevent rescheduling)
+static DEFINE_MUTEX(camouflage_lock); //serializes camouflage_device() & uncamouflage_device()
+static u64 camouflage_start = 0; //rp_metric_clock() when the trap was armed; protected by camouflage_lock
+static RP_METRIC(boot_camouflage_ns, RP_MG_LATENCY, RP_METRIC_HISTOGRAM); //the whole probe runs with a fake USB view
+static RP_METRIC(boot_camouflage_max_ns, RP_MG_LATENCY, RP_METRIC_GAUGE);
+static struct rp_metric *const camouflage_metrics[] = { &boot_camouflage_ns, &boot_camouflage_max_ns };
 
 //They call each other, see their own docblocks
 static int camouflage_device(struct scsi_device *sdp);
@@ -64,22 +80,22 @@ struct ida;
  */
 static int ida_pre_get_trap(struct ida *ida, gfp_t gfp_mask)
 {
-    //This can happen if the kernel decides to reschedule and/or some device appears JUST between setting up the trap
-    // and disabling of rescheduling. We cannot reverse the order as setting up the trap requires flushing CPU caches
-    // which isn't really feasible in non-preempt & IRQ-disabled state... a catch-22
-    //It is also possible that it happens during uncamouflage_device - this is why we force-restore here and just call
-    // it.
-    if (unlikely(!camouflaged_sdp)) {
-        pr_loc_bug("Hit ida_pr_get() trap without sdp saved - removing trap and calling original");
-        restore_symbol(ida_pre_get_ovs);
-        return _ida_pre_get(ida, gfp_mask);
+    int out;
+    override_symbol_inst *ovs = READ_ONCE(ida_pre_get_ovs); //it's cleared when the trap is removed
+
+    //The trap stays installed until the boot device is probed, so most of the calls are unrelated to camouflage
+    // (other drivers, as well as other devices being probed at the same time on other CPUs)
+    if (likely(READ_ONCE(camouflage_owner) != current)) {
+        int ovs_out = call_overridden_symbol(out, ovs, ida, gfp_mask);
+        return unlikely(ovs_out != 0) ? ovs_out : out;
     }
 
     pr_loc_dbg("Hit ida_pre_get() trap! Removing camouflage...");
     uncamouflage_device(camouflaged_sdp);
 
     pr_loc_dbg("Calling original ida_pre_get()");
-    return _ida_pre_get(ida, gfp_mask);
+    int ovs_out = call_overridden_symbol(out, ovs, ida, gfp_mask);
+    return unlikely(ovs_out != 0) ? ovs_out : out;
 }
 
 /**
@@ -93,9 +109,9 @@ static bool is_camouflaged(struct scsi_device *sdp)
 /**
  * Alters a SATA device to look like a USB boot disk
  *
- * Order of operations in camouflage/uncamouflage is VERY particular. We make sure we CANNOT fail (at least not without
- * a KP resulting from pagefault) once we disable preemption & irqs AND that no changes before preemption is disabled
- * are overriding anything external (as we can be rescheduled and we cannot leave stuff half-replaced)
+ * Order of operations in camouflage/uncamouflage is VERY particular. Everything which can fail is done before anything
+ * external is changed, so that we never leave stuff half-replaced. Then the fake USB device is put in place before the
+ * host starts using the USB-typed template, so that anybody who sees the USB port type also sees the fake device.
  *
  * @param sdp A valid SATA disk (it's assumed it passed through scsi_is_boot_dev_target() already) to disguise as USB
  *
@@ -103,13 +119,17 @@ static bool is_camouflaged(struct scsi_device *sdp)
  */
 static int camouflage_device(struct scsi_device *sdp)
 {
+    int out = 0;
+    mutex_lock(&camouflage_lock);
+
     //This is very serious - it means something went TERRIBLY wrong. The camouflage should last only through the
     // duration of probing. If we got here again before camouflaging it means there's a device floating around which
     // is a SATA device but with broken USB descriptors. This should never ever happen as it may lead to data loss and
     // crashes at best.
     if (unlikely(camouflaged_sdp)) {
         pr_loc_crt("Attempting to camouflage when another device is undergoing camouflage");
-        return -EEXIST;
+        out = -EEXIST;
+        goto out_unlock;
     }
 
     //Here's the kicker: most of the subsystems save a pointer to some driver-related data into sdp->host->hostdata.
@@ -122,46 +142,60 @@ static int camouflage_device(struct scsi_device *sdp)
     // the safeguards here the chance is minimal.
     if (unlikely(host_to_us(sdp->host)->pusb_dev)) {
         pr_loc_crt("Cannot camouflage - space on pointer not empty");
-        return -EINVAL;
+        out = -EINVAL;
+        goto out_unlock;
     }
 
+    //This also guarantees fake_usbd & fake_hostt are never reused - they're freed when the shim is unregistered, as
+    // another CPU may still have a pointer to them for a short while after uncamouflage_device()
     if (unlikely(get_shimmed_boot_dev())) {
         pr_loc_wrn("Refusing to camouflage. Boot device was already shimmed but a new matching device appeared again - "
                    "this may produce unpredictable outcomes! Ignoring - check your hardware");
-        return -EEXIST;
+        out = -EEXIST;
+        goto out_unlock;
     }
 
     pr_loc_dbg("Camouflaging SATA disk vendor=\"%s\" model=\"%s\" to look like a USB boot device", sdp->vendor,
                sdp->model);
 
     pr_loc_dbg("Generating fake USB descriptor");
-    kzalloc_or_exit_int(fake_usbd, sizeof(struct usb_device));
+    fake_usbd = kzalloc(sizeof(struct usb_device), GFP_KERNEL);
+    if (unlikely(!fake_usbd)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate %zu bytes for fake_usbd", sizeof(*fake_usbd));
+        out = -ENOMEM;
+        goto out_unlock;
+    }
+    rp_mem_alloced(RP_MEM_BOOT, fake_usbd);
     usb_shim_as_boot_dev(boot_dev_config, fake_usbd);
 
-    pr_loc_dbg("Setting-up ida_pre_get() trap");
-    ida_pre_get_ovs = override_symbol("ida_pre_get", ida_pre_get_trap);
-    if (unlikely(IS_ERR(ida_pre_get_ovs))) {
-        pr_loc_err("Failed to override ida_pre_get - error=%ld", PTR_ERR(ida_pre_get_ovs));
-        ida_pre_get_ovs = NULL;
-        kfree(fake_usbd);
-        return PTR_ERR(ida_pre_get_ovs);
+    pr_loc_dbg("Generating USB-typed copy of \"%s\" host template", sdp->host->hostt->name);
+    fake_hostt = kmemdup(sdp->host->hostt, sizeof(struct scsi_host_template), GFP_KERNEL);
+    if (unlikely(!fake_hostt)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate %zu bytes for fake_hostt", sizeof(*fake_hostt));
+        rp_kfree(fake_usbd, RP_MEM_BOOT);
+        fake_usbd = NULL;
+        out = -ENOMEM;
+        goto out_unlock;
     }
-
-    pr_loc_dbg("Disabling rescheduling");
-    preempt_disable();
-    local_irq_save(irq_flags);
-
-    pr_loc_dbg("Changing port type %d => %d", sdp->host->hostt->syno_port_type, SYNO_PORT_TYPE_USB);
-    org_port_type = sdp->host->hostt->syno_port_type;
-    sdp->host->hostt->syno_port_type = SYNO_PORT_TYPE_USB;
+    rp_mem_alloced(RP_MEM_BOOT, fake_hostt);
+    fake_hostt->syno_port_type = SYNO_PORT_TYPE_USB;
 
     pr_loc_dbg("Faking ptr to usb_device at %p", &host_to_us(sdp->host)->pusb_dev);
     host_to_us(sdp->host)->pusb_dev = fake_usbd;
+    smp_wmb(); //see function docblock
+
+    pr_loc_dbg("Changing port type %d => %d", sdp->host->hostt->syno_port_type, SYNO_PORT_TYPE_USB);
+    org_hostt = sdp->host->hostt;
+    sdp->host->hostt = fake_hostt;
 
     camouflaged_sdp = sdp;
+    WRITE_ONCE(camouflage_owner, current); //the trap is armed from now on
     set_shimmed_boot_dev(sdp);
+    camouflage_start = rp_metric_clock();
 
-    return 0;
+    out_unlock:
+    mutex_unlock(&camouflage_lock);
+    return out;
 }
 
 /**
@@ -174,36 +208,56 @@ static int camouflage_device(struct scsi_device *sdp)
 static int uncamouflage_device(struct scsi_device *sdp)
 {
     int out = 0;
+    mutex_lock(&camouflage_lock);
     pr_loc_dbg("Uncamouflaging SATA disk vendor=\"%s\" model=\"%s\"", sdp->vendor, sdp->model);
 
-    if (unlikely(host_to_us(sdp->host)->pusb_dev != fake_usbd)) {
-                pr_loc_bug("Fake USB device in the scsi_device is not the same as our fake one - something changed it");
-        return -EINVAL;
+    if (unlikely(camouflaged_sdp != sdp)) {
+        pr_loc_bug("Attempted to uncamouflage device which is not camouflaged");
+        out = -EINVAL;
+        goto out_unlock;
+    }
+
+    //The probe is over from the trap's point of view even if the device cannot be restored below
+    WRITE_ONCE(camouflage_owner, NULL); //disarms the trap
+
+    if (unlikely(host_to_us(sdp->host)->pusb_dev != fake_usbd || sdp->host->hostt != fake_hostt)) {
+        pr_loc_bug("Fake USB device or host template in the scsi_device is not ours - something changed it");
+        out = -EINVAL;
+        goto out_unlock;
     }
 
     camouflaged_sdp = NULL;
+    rp_metric_observe_max(&boot_camouflage_ns, &boot_camouflage_max_ns, rp_metric_clock() - camouflage_start);
+
+    pr_loc_dbg("Restoring port type %d => %d", sdp->host->hostt->syno_port_type, org_hostt->syno_port_type);
+    sdp->host->hostt = org_hostt;
+    org_hostt = NULL;
+    smp_wmb(); //reverse order of camouflage_device()
 
     pr_loc_dbg("Removing fake usb_device ptr at %p", &host_to_us(sdp->host)->pusb_dev);
     host_to_us(sdp->host)->pusb_dev = NULL;
 
-    pr_loc_dbg("Restoring port type %d => %d", sdp->host->hostt->syno_port_type, org_port_type);
-    sdp->host->hostt->syno_port_type = org_port_type;
-    org_port_type = 0;
-
-    pr_loc_dbg("Re-enabling scheduling");
-    local_irq_restore(irq_flags);
-    preempt_enable();
+    out_unlock:
+    mutex_unlock(&camouflage_lock);
+    return out;
+}
 
-    if (likely(ida_pre_get_ovs)) { //scheduling race condition may have removed that already in ida_pre_get_trap()
+/**
+ * Removes the ida_pre_get() trap (if it's still installed)
+ *
+ * @return 0 on success or noop, -E on error
+ */
+static int remove_ida_pre_get_trap(void)
+{
+    int out = 0;
+    mutex_lock(&camouflage_lock);
+    if (ida_pre_get_ovs) {
         pr_loc_dbg("Removing ida_pre_get() trap");
         if ((out = restore_symbol(ida_pre_get_ovs)) != 0)
-        pr_loc_err ("Failed to restore original ida_pre_get() - error=%d", out);
-        ida_pre_get_ovs = NULL;
+            pr_loc_err("Failed to restore original ida_pre_get() - error=%d", out);
+        WRITE_ONCE(ida_pre_get_ovs, NULL);
     }
-
-    pr_loc_dbg("Cleaning fake USB descriptor");
-    kfree(fake_usbd);
-    fake_usbd = NULL;
+    mutex_unlock(&camouflage_lock);
 
     return out;
 }
@@ -220,9 +274,9 @@ static int uncamouflage_device(struct scsi_device *sdp)
  * @return 0 means "continue calling me" while any other value means "I found what I was looking for, stop calling me".
  *         This convention is based on how bus_for_each_dev() works
  */
-static int on_existing_scsi_disk_device(struct scsi_device *sdp)
+static int on_existing_scsi_disk_device(struct scsi_device *sdp, long long capacity_mib)
 {
-    if (!scsi_is_boot_dev_target(boot_dev_config, sdp))
+    if (!scsi_is_boot_dev_target_of_capacity(boot_dev_config, sdp, capacity_mib))
         return 0;
 
     pr_loc_dbg("Found a shimmable SCSI device - reconnecting to trigger shimming");
@@ -240,24 +294,36 @@ static int scsi_disk_probe_handler(struct notifier_block *self, unsigned long st
 
     switch (state) {
         case SCSI_EVT_DEV_PROBING:
-            if (unlikely(camouflaged_sdp)) {
-                pr_loc_bug("Got device probe when other one is camouflaged - surprise reschedule happened?");
-                uncamouflage_device(camouflaged_sdp);
+            boot_dev_timing_mark(BOOT_DEV_MS_DRIVER_READY); //the first disk probed means the driver is ready
+
+            //Probes of other devices can legitimately run in parallel; the camouflage is scoped to its own device
+            if (unlikely(READ_ONCE(camouflaged_sdp))) {
+                pr_loc_dbg("Got device probe when other one is camouflaged - leaving it as-is");
                 return NOTIFY_OK;
             }
 
-            if (scsi_is_boot_dev_target(boot_dev_config, data))
+            if (scsi_is_boot_dev_target(boot_dev_config, data)) {
+                boot_dev_timing_mark(BOOT_DEV_MS_DEVICE_PROBE);
                 camouflage_device(sdp);
+            }
 
             return NOTIFY_OK;
 
         case SCSI_EVT_DEV_PROBED_OK:
         case SCSI_EVT_DEV_PROBED_ERR:
-            if (is_camouflaged(sdp)) { //camouflage is expected to be removed by the ida_pre_get() trap
-                pr_loc_bug("Probing finished but device is still camouflages - something went terribly wrong");
+            //Camouflage is expected to be removed by the ida_pre_get() trap, unless sd_probe() failed before it
+            if (is_camouflaged(sdp)) {
+                if (state == SCSI_EVT_DEV_PROBED_OK)
+                    pr_loc_bug("Probing finished but device is still camouflaged - something went terribly wrong");
+                else
+                    pr_loc_wrn("Probing failed before the ida_pre_get() trap was hit - removing camouflage");
                 uncamouflage_device(sdp);
             }
 
+            //No other device will be camouflaged after the boot one (see camouflage_device())
+            if (get_shimmed_boot_dev() == sdp)
+                remove_ida_pre_get_trap();
+
             return NOTIFY_OK;
 
         default:
@@ -267,14 +333,19 @@ static int scsi_disk_probe_handler(struct notifier_block *self, unsigned long st
 
 }
 
-static struct notifier_block scsi_disk_nb = {
-    .notifier_call = scsi_disk_probe_handler,
-    .priority = INT_MIN, //we want to be FIRST so that we other things can get the correct drive type
+//No filter here: camouflaged device doesn't look like a SATA disk anymore when SCSI_EVT_DEV_PROBED_* arrives
+static struct scsi_disk_subscriber scsi_disk_sub = {
+    .nb = {
+        .notifier_call = scsi_disk_probe_handler,
+        .priority = INT_MIN, //we want to be FIRST so that we other things can get the correct drive type
+    },
+    .event_mask = SCSI_EVT_MASK(SCSI_EVT_DEV_PROBING) | SCSI_EVT_MASK_PROBED,
 };
 
 int register_fake_sata_boot_shim(const struct boot_media *config)
 {
     shim_reg_in();
+    rp_metrics_register(camouflage_metrics, ARRAY_SIZE(camouflage_metrics));
 
 #ifdef NATIVE_SATA_DOM_SUPPORTED
     pr_loc_wrn("This platform supports native SATA DoM - usage of %s is highly discouraged", SHIM_NAME);
@@ -285,33 +356,68 @@ int register_fake_sata_boot_shim(const struct boot_media *config)
     int out;
     boot_dev_config = config;
 
+    //The trap cannot be set up when the device is being probed, as it would race with other CPUs calling ida_pre_get()
+    pr_loc_dbg("Setting-up ida_pre_get() trap");
+    ida_pre_get_ovs = override_symbol("ida_pre_get", ida_pre_get_trap);
+    if (unlikely(IS_ERR(ida_pre_get_ovs))) {
+        out = PTR_ERR(ida_pre_get_ovs);
+        pr_loc_err("Failed to override ida_pre_get - error=%d", out);
+        ida_pre_get_ovs = NULL;
+        boot_dev_config = NULL;
+        return out;
+    }
+
+    if (unlikely(!symbol_has_detour(ida_pre_get_ovs))) {
+        pr_loc_err("Cannot relocate ida_pre_get() prologue - the trap would race with other CPUs calling it");
+        out = -ENOEXEC;
+        goto error_restore;
+    }
+
     pr_loc_dbg("Registering for new devices notifications");
-    out = subscribe_scsi_disk_events(&scsi_disk_nb);
+    out = subscribe_scsi_disk_events(&scsi_disk_sub);
     if (unlikely(out != 0)) {
         pr_loc_err("Failed to register for SCSI disks notifications - error=%d", out);
-        boot_dev_config = NULL;
-        return out;
+        goto error_restore;
     }
 
     pr_loc_dbg("Iterating over existing devices");
-    out = for_each_scsi_disk(on_existing_scsi_disk_device);
-    if (unlikely(out != 0 && out != -ENXIO)) {
+    out = for_each_scsi_disk_capacity(is_sata_disk, on_existing_scsi_disk_device); //capacities are read in parallel
+    if (unlikely(out < 0 && out != -ENXIO)) { //1 means a shimmable device was found
         pr_loc_err("Failed to enumerate current SCSI disks - error=%d", out);
-        boot_dev_config = NULL;
-        return out;
+        unsubscribe_scsi_disk_events(&scsi_disk_sub);
+        goto error_restore;
     }
 
+    if (out != -ENXIO)
+        boot_dev_timing_mark(BOOT_DEV_MS_DRIVER_READY);
+
     shim_reg_ok();
     return 0;
+
+    error_restore:
+    remove_ida_pre_get_trap();
+    boot_dev_config = NULL;
+    return out;
 }
 
 int unregister_fake_sata_boot_shim(void)
 {
     shim_ureg_in();
 
-    unsubscribe_scsi_disk_events(&scsi_disk_nb);
+    unsubscribe_scsi_disk_events(&scsi_disk_sub);
+    if (unlikely(camouflaged_sdp)) {
+        pr_loc_bug("Unregistering while a device is still camouflaged - removing camouflage");
+        uncamouflage_device(camouflaged_sdp);
+    }
+
+    int out = remove_ida_pre_get_trap(); //it's normally gone already after the boot device was probed
+
+    rp_kfree(fake_usbd, RP_MEM_BOOT);
+    fake_usbd = NULL;
+    rp_kfree(fake_hostt, RP_MEM_BOOT);
+    fake_hostt = NULL;
     boot_dev_config = NULL;
 
     shim_ureg_ok();
-    return 0; //noop
+    return out;
 }
\ No newline at end of file
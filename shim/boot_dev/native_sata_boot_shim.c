@@ -95,10 +95,10 @@
 #include "../../config/runtime_config.h" //consts, NATIVE_SATA_DOM_SUPPORTED
 
 #ifdef NATIVE_SATA_DOM_SUPPORTED
-#include "boot_shim_base.h" //set_shimmed_boot_dev(), get_shimmed_boot_dev(), scsi_is_boot_dev_target()
+#include "boot_shim_base.h" //set_shimmed_boot_dev(), scsi_is_boot_dev_target(), boot_dev_timing_mark()
 #include "../shim_base.h" //shim_reg_*(), scsi_ureg_*()
 #include "../../internal/call_protected.h" //scsi_scan_host_selected()
-#include "../../internal/scsi/scsi_toolbox.h" //scsi_force_replug(), for_each_scsi_disk()
+#include "../../internal/scsi/scsi_toolbox.h" //scsi_force_replug(), for_each_scsi_disk_capacity(), is_sata_disk()
 #include "../../internal/scsi/scsi_notifier.h" //watching for new devices to shim them as they appear
 #include <scsi/scsi_device.h> //struct scsi_device
 
@@ -108,9 +108,13 @@ static const struct boot_media *boot_dev_config = NULL; //passed to scsi_is_shim
 
 //Structure for watching for new devices (via SCSI notifier / scsi_notifier.c event system)
 static int on_new_scsi_disk(struct notifier_block *self, unsigned long state, void *data);
-static struct notifier_block scsi_disk_nb = {
-    .notifier_call = on_new_scsi_disk,
-    .priority = INT_MAX //We want to be LAST, after all other possible fixes has been already applied
+static struct scsi_disk_subscriber scsi_disk_sub = {
+    .nb = {
+        .notifier_call = on_new_scsi_disk,
+        .priority = INT_MAX //We want to be LAST, after all other possible fixes has been already applied
+    },
+    .event_mask = SCSI_EVT_MASK(SCSI_EVT_DEV_PROBING),
+    .filter = is_sata_disk,
 };
 
 /********************************************* Actual shimming routines ***********************************************/
@@ -149,11 +153,14 @@ static __used int on_new_scsi_disk(struct notifier_block *self, unsigned long st
         return NOTIFY_DONE;
 
     struct scsi_device *sdp = data;
+    boot_dev_timing_mark(BOOT_DEV_MS_DRIVER_READY); //the first disk probed means the driver is ready
 
     pr_loc_dbg("Found new SCSI disk vendor=\"%s\" model=\"%s\": checking boot shim viability", sdp->vendor, sdp->model);
     if (!scsi_is_boot_dev_target(boot_dev_config, sdp))
         return NOTIFY_OK;
 
+    boot_dev_timing_mark(BOOT_DEV_MS_DEVICE_PROBE);
+
     int err = shim_device(data);
     if (unlikely(err != 0)) {
         //If we let the device register it may be misinterpreted as a normal disk and possibly formatted
@@ -175,12 +182,12 @@ static __used int on_new_scsi_disk(struct notifier_block *self, unsigned long st
  * @return 0 means "continue calling me" while any other value means "I found what I was looking for, stop calling me".
  *         This convention is based on how bus_for_each_dev() works
  */
-static int on_existing_scsi_disk(struct scsi_device *sdp)
+static int on_existing_scsi_disk(struct scsi_device *sdp, long long capacity_mib)
 {
     pr_loc_dbg("Found existing SCSI disk vendor=\"%s\" model=\"%s\": checking boot shim viability", sdp->vendor,
                sdp->model);
 
-    if (!scsi_is_boot_dev_target(boot_dev_config, sdp))
+    if (!scsi_is_boot_dev_target_of_capacity(boot_dev_config, sdp, capacity_mib))
         return 0;
 
     //So, now we know it's a shimmable target but we cannot just call shim_device() as this will change vendor+model on
@@ -224,26 +231,29 @@ int register_native_sata_boot_shim(const struct boot_media *config)
      * regardless of the driver state, but if the driver is already loaded we also need to take care of existing devs.
      * Additionally, subscribing for notifications will, in the future, give us info if a device went away.
      */
-    out = subscribe_scsi_disk_events(&scsi_disk_nb);
+    out = subscribe_scsi_disk_events(&scsi_disk_sub);
     if (unlikely(out != 0)) {
         pr_loc_err("Failed to register for SCSI disks notifications - error=%d", out);
         goto fail;
     }
 
-    //This will already check if driver is loaded and only iterate if it is
-    out = for_each_scsi_disk(on_existing_scsi_disk);
+    //This will already check if driver is loaded and only iterate if it is; capacities of all SATA disks are read at once
+    out = for_each_scsi_disk_capacity(is_sata_disk, on_existing_scsi_disk);
     //0 means "call me again" or "success", 1 means "found what I wanted, stop iterating", -ENXIO is "driver not ready"
     if (unlikely(out < 0 && out != -ENXIO)) {
         pr_loc_dbg("SCSI driver is already loaded but iteration over existing devices failed - error=%d", out);
         goto fail_unwatch;
     }
 
+    if (out != -ENXIO)
+        boot_dev_timing_mark(BOOT_DEV_MS_DRIVER_READY);
+
     shim_registered = true;
     shim_reg_ok();
     return 0;
 
     fail_unwatch:
-    unsubscribe_scsi_disk_events(&scsi_disk_nb); //we keep the original code, so this function return code is ignored
+    unsubscribe_scsi_disk_events(&scsi_disk_sub); //we keep the original code, so this function return code is ignored
     fail:
     boot_dev_config = NULL;
     return out;
@@ -258,7 +268,7 @@ int unregister_native_sata_boot_shim(void)
         return -ENOENT;
     }
 
-    int out = unsubscribe_scsi_disk_events(&scsi_disk_nb);
+    int out = unsubscribe_scsi_disk_events(&scsi_disk_sub);
     if (out != 0)
         pr_loc_err("Failed to unsubscribe from SCSI events");
 
@@ -9,9 +9,13 @@
  *
  * HOW THIS SHIM MATCHES DEVICE TO SHIM?
  * The decision is made based on "struct boot_media" (derived from boot config) passed to the register method:
+ *  - devices without a mass storage interface (e.g. hubs, HIDs) are never considered
  *  - if vid/pid combo is set (i.e. not VID_PID_EMPTY) it must match the newly detected device
  *  - if vid/pid is not set (i.e. VID_PID_EMPTY) the first device is used (NOT recommended unless you don't use USB)
  *  - if a second device matching any of the criteria above appears a warning is emitted and device is ignored
+ * Once the boot device is claimed the device notifier is unregistered, so that later USB hotplug events don't have to
+ * go through this shim at all. A consequence of that is the boot device cannot be hot-replugged (which is not a
+ * supported scenario anyway, as the kernel needs to find the boot device during boot).
  *
  * HOW IT WORKS?
  * In order to dynamically change VID & PID of a USB device we need to modify device descriptor just after the device is
@@ -38,7 +42,7 @@
  *  - https://lwn.net/Articles/160501/
  */
 #include "usb_boot_shim.h"
-#include "boot_shim_base.h" //set_shimmed_boot_dev(), get_shimmed_boot_dev(), usb_shim_as_boot_dev()
+#include "boot_shim_base.h" //set_shimmed_boot_dev(), usb_shim_as_boot_dev(), boot_dev_timing_mark()
 #include "../shim_base.h" //shim_*
 #include "../../common.h"
 #include "../../config/runtime_config.h" //struct boot_device & consts
@@ -47,6 +51,7 @@
 #include <linux/notifier.h>
 #include <linux/usb.h>
 #include <linux/module.h> //struct module
+#include <linux/workqueue.h> //DECLARE_WORK(), schedule_work(), cancel_work_sync()
 
 #define SHIM_NAME "USB boot device"
 
@@ -54,6 +59,41 @@ static bool module_notify_registered = false;
 static bool device_notify_registered = false;
 static const struct boot_media *boot_media = NULL; //passed to usb_shim_as_boot_dev()
 
+static int unregister_device_notifier(void);
+static void unregister_device_notifier_work_fn(struct work_struct *work)
+{
+    if (device_notify_registered)
+        unregister_device_notifier();
+}
+//Notifier cannot be unregistered from its own callback, as the chain is locked while the callback is running
+static DECLARE_WORK(unregister_device_notifier_work, unregister_device_notifier_work_fn);
+
+/**
+ * Checks if any interface of any configuration of the device is a mass storage one
+ *
+ * At the time of USB_DEVICE_ADD all descriptors are already read by the usbcore, so this doesn't do any I/O.
+ */
+static bool has_mass_storage_interface(struct usb_device *device)
+{
+    if (device->descriptor.bDeviceClass == USB_CLASS_MASS_STORAGE)
+        return true;
+
+    if (device->descriptor.bDeviceClass == USB_CLASS_HUB || !device->config)
+        return false;
+
+    for (int cfg_i = 0; cfg_i < device->descriptor.bNumConfigurations; cfg_i++) {
+        struct usb_host_config *cfg = &device->config[cfg_i];
+        for (int intf_i = 0; intf_i < cfg->desc.bNumInterfaces && intf_i < USB_MAXINTERFACES; intf_i++) {
+            struct usb_interface_cache *intfc = cfg->intf_cache[intf_i];
+            if (likely(intfc) && intfc->num_altsetting > 0 &&
+                intfc->altsetting[0].desc.bInterfaceClass == USB_CLASS_MASS_STORAGE)
+                return true;
+        }
+    }
+
+    return false;
+}
+
 /**
  * Responds to USB devices being added/removed
  */
@@ -63,16 +103,22 @@ static int device_notifier_handler(struct notifier_block *b, unsigned long event
     struct usb_device *prev_device = get_shimmed_boot_dev();
 
     if (event == USB_DEVICE_ADD) {
-        //TODO: Can we even check if it matched mass storage here... (bInterfaceClass == USB_CLASS_MASS_STORAGE)
+        //This is called for every USB device, so the cheapest checks go first & descriptor fields are read only once
+        if (!has_mass_storage_interface(device))
+            return NOTIFY_DONE;
+
+        boot_dev_timing_mark(BOOT_DEV_MS_DEVICE_PROBE);
+
+        u16 vid = le16_to_cpu(device->descriptor.idVendor);
+        u16 pid = le16_to_cpu(device->descriptor.idProduct);
         if (boot_media->vid == VID_PID_EMPTY || boot_media->pid == VID_PID_EMPTY) {
             pr_loc_wrn("Your boot device VID and/or PID is not set - "
-                       "using device found <vid=%04x, pid=%04x> (prev_shimmed=%d)",
-                       device->descriptor.idVendor, device->descriptor.idProduct, prev_device ? 1:0);
-        } else if (device->descriptor.idVendor != boot_media->vid || device->descriptor.idProduct != boot_media->pid) {
-            pr_loc_dbg("Found new device <vid=%04x, pid=%04x> - "
-                       "didn't match expected <vid=%04x, pid=%04x> (prev_shimmed=%d)",
-                       device->descriptor.idVendor, device->descriptor.idProduct, boot_media->vid, boot_media->pid,
+                       "using mass storage device found <vid=%04x, pid=%04x> (prev_shimmed=%d)", vid, pid,
                        prev_device ? 1:0);
+        } else if (vid != boot_media->vid || pid != boot_media->pid) {
+            pr_loc_dbg("Found new mass storage device <vid=%04x, pid=%04x> - "
+                       "didn't match expected <vid=%04x, pid=%04x> (prev_shimmed=%d)", vid, pid, boot_media->vid,
+                       boot_media->pid, prev_device ? 1:0);
 
             return NOTIFY_OK;
         }
@@ -87,8 +133,11 @@ static int device_notifier_handler(struct notifier_block *b, unsigned long event
         usb_shim_as_boot_dev(boot_media, device);
         set_shimmed_boot_dev(device);
 
-        pr_loc_inf("Device <vid=%04x, pid=%04x> shimmed to <vid=%04x, pid=%04x>", boot_media->vid, boot_media->pid,
-                   device->descriptor.idVendor, device->descriptor.idProduct);
+        pr_loc_inf("Device <vid=%04x, pid=%04x> shimmed to <vid=%04x, pid=%04x>", vid, pid,
+                   le16_to_cpu(device->descriptor.idVendor), le16_to_cpu(device->descriptor.idProduct));
+
+        pr_loc_dbg("Boot device claimed - USB device notifier is not needed anymore");
+        schedule_work(&unregister_device_notifier_work);
 
         return NOTIFY_OK;
     }
@@ -124,6 +173,7 @@ static void register_device_notifier(void)
     _usb_register_notify(&device_notifier_block); //has no return value
 
     device_notify_registered = true;
+    boot_dev_timing_mark(BOOT_DEV_MS_DRIVER_READY);
     pr_loc_dbg("Registered USB device notifier");
 }
 
@@ -153,6 +203,7 @@ static int ubscore_notifier_handler(struct notifier_block * self, unsigned long
 
     if (state == MODULE_STATE_GOING) {
         //TODO: call unregister with some force flag?
+        cancel_work_sync(&unregister_device_notifier_work);
         device_notify_registered = false;
         reset_shimmed_boot_dev();
         pr_loc_wrn("usbcore module unloaded - this should not happen normally");
@@ -258,10 +309,12 @@ int unregister_usb_boot_shim(void)
     }
 
     int out = 0;
-    if (
-            (out = unregister_usbcore_notifier()) != 0
-         || (out = unregister_device_notifier()) != 0
-    )
+    if ((out = unregister_usbcore_notifier()) != 0)
+        return out;
+
+    //Device notifier is normally unregistered already after the boot device was claimed
+    cancel_work_sync(&unregister_device_notifier_work);
+    if (device_notify_registered && (out = unregister_device_notifier()) != 0)
         return out;
 
     boot_media = NULL;
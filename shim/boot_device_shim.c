@@ -39,6 +39,7 @@
 #include "boot_dev/usb_boot_shim.h"
 #include "boot_dev/fake_sata_boot_shim.h"
 #include "boot_dev/native_sata_boot_shim.h"
+#include "boot_dev/boot_shim_base.h" //boot_dev_timing_start(), boot_dev_timing_stop()
 
 #define BOOT_MEDIA_SHIM_NULL (-1)
 
@@ -52,7 +53,10 @@ int register_boot_shim(const struct boot_media *boot_dev_config)
         return -EEXIST;
     }
 
-    int out;
+    int out = boot_dev_timing_start();
+    if (unlikely(out != 0))
+        return out;
+
     switch (boot_dev_config->type) {
         case BOOT_MEDIA_USB:
             out = register_usb_boot_shim(boot_dev_config);
@@ -65,11 +69,13 @@ int register_boot_shim(const struct boot_media *boot_dev_config)
             break;
         default:
             pr_loc_bug("Failed to %s - unknown type=%d", __FUNCTION__, boot_dev_config->type);
-            return -EINVAL;
+            out = -EINVAL;
     }
 
-    if (out != 0)
+    if (out != 0) {
+        boot_dev_timing_stop();
         return out; //individual shims should print what went wrong
+    }
 
     registered_type = boot_dev_config->type;
 
@@ -104,6 +110,7 @@ int unregister_boot_shim(void)
         return out; //individual shims should print what went wrong
 
     registered_type = BOOT_MEDIA_SHIM_NULL;
+    boot_dev_timing_stop();
 
     shim_ureg_ok();
     return 0;
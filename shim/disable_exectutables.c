@@ -7,7 +7,7 @@
 
 #define PSTORE_PATH "/usr/syno/bin/syno_pstore_collect"
 #define BOOTLOADER_UPDATE1_PATH "uboot_do_upd.sh"
-#define BOOTLOADER_UPDATE2_PATH "./uboot_do_upd.sh"
+#define BOOTLOADER_UPDATE2_GLOB "*/uboot_do_upd.sh" //any directory, incl. relative "./"
 #define SAS_FW_UPDATE_PATH "/tmpData/upd@te/sas_fw_upgrade_tool"
 #define OOB_FW_UPDATE_PATH "/usr/syno/sbin/syno_oob_fw_upgrade"
 
@@ -18,7 +18,7 @@ int register_disable_executables_shim(void)
     int out;
     if (
             (out = add_blocked_execve_filename(BOOTLOADER_UPDATE1_PATH)) != 0
-         || (out = add_blocked_execve_filename(BOOTLOADER_UPDATE2_PATH)) != 0
+         || (out = add_blocked_execve_glob(BOOTLOADER_UPDATE2_GLOB)) != 0
          || (out = add_blocked_execve_filename(PSTORE_PATH)) != 0
          || (out = add_blocked_execve_filename(SAS_FW_UPDATE_PATH)) != 0
          || (out = add_blocked_execve_filename(OOB_FW_UPDATE_PATH)) != 0
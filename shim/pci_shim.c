@@ -3,23 +3,41 @@
 #include "pci_shim.h"
 #include "shim_base.h"
 #include "../common.h"
-#include "../config/vpci_types.h" //MAX_VPCI_DEVS, pci_shim_device_type
-#include "../config/platform_types.h" //hw_config
+#include "../config/vpci_types.h" //vpci_device_stub, pci_shim_device_type
+#include "../config/platform_types.h" //hw_config, hw_cfg()
 #include "../internal/virtual_pci.h"
 #include <linux/pci_ids.h>
+#include <linux/pci_regs.h> //PCI_EXP_TYPE_*
 
-unsigned int free_dev_idx = 0;
-static void *devices[MAX_VPCI_DEVS] = { NULL };
+//Capabilities of stubs; they don't have to be exact with the real hardware but they should be sane for the kernel
+static const struct pci_dev_caps caps_pcie_ep_gen1 = {
+    .pm = true, .msi = true, .pcie = true, .pcie_type = PCI_EXP_TYPE_ENDPOINT, .pcie_link_speed = 1,
+    .pcie_link_width = 1,
+};
+static const struct pci_dev_caps caps_pcie_ep_gen2 = {
+    .pm = true, .msi = true, .pcie = true, .pcie_type = PCI_EXP_TYPE_ENDPOINT, .pcie_link_speed = 2,
+    .pcie_link_width = 1,
+};
+static const struct pci_dev_caps caps_pcie_root_port = {
+    .pm = true, .msi = true, .pcie = true, .pcie_type = PCI_EXP_TYPE_ROOT_PORT, .pcie_link_speed = 2,
+    .pcie_link_width = 1,
+};
+static const struct pci_dev_caps caps_pm_msi = { .pm = true, .msi = true };
+static const struct pci_dev_caps caps_pm = { .pm = true };
+
+static unsigned int free_dev_idx = 0;
+static unsigned int max_devs = 0;
+static void **devices = NULL; //sized to the number of stubs of the platform
 
 static struct pci_dev_descriptor *allocate_vpci_dev_dsc(void) {
-    if (free_dev_idx >= MAX_VPCI_DEVS) {
-        /*index has to be at max MAX_VPCI_DEVS-1*/
-        pr_loc_bug("No more device indexes are available (max devs: %d)", MAX_VPCI_DEVS);
+    if (free_dev_idx >= max_devs) {
+        /*index has to be at max max_devs-1*/
+        pr_loc_bug("No more device indexes are available (max devs: %u)", max_devs);
         return ERR_PTR(-ENOMEM);
     }
 
     struct pci_dev_descriptor *dev_dsc;
-    kmalloc_or_exit_ptr(dev_dsc, sizeof(struct pci_dev_descriptor));
+    kmalloc_or_exit_ptr(dev_dsc, sizeof(struct pci_dev_descriptor), RP_MEM_VPCI);
     memcpy(dev_dsc, &pci_dev_conf_default_normal_dev, sizeof(struct pci_dev_descriptor));
     devices[free_dev_idx++] = dev_dsc;
 
@@ -30,19 +48,19 @@ static struct pci_dev_descriptor *allocate_vpci_dev_dsc(void) {
     if (IS_ERR(dev_dsc)) return PTR_ERR(dev_dsc);
     
 static int
-add_vdev(struct pci_dev_descriptor *dev_dsc, unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                    bool is_mf)
+add_vdev(struct pci_dev_descriptor *dev_dsc, const struct pci_dev_caps *caps, unsigned char bus_no,
+         unsigned char dev_no, unsigned char fn_no, bool is_mf)
 {
     const struct virtual_device *vpci_vdev;
 
     if (is_mf) {
-        vpci_vdev = vpci_add_multifunction_device(bus_no, dev_no, fn_no, dev_dsc);
+        vpci_vdev = vpci_add_multifunction_device(bus_no, dev_no, fn_no, dev_dsc, caps);
     } else if(unlikely(fn_no != 0x00)) {
         //Making such config will either cause the device to not show up at all or only fn_no=0 one will show u
         pr_loc_bug("%s called with non-MF device but non-zero fn_no", __FUNCTION__);
         return -EINVAL;
     } else {
-        vpci_vdev = vpci_add_single_device(bus_no, dev_no, dev_dsc);
+        vpci_vdev = vpci_add_single_device(bus_no, dev_no, dev_dsc, caps);
     }
 
     return IS_ERR(vpci_vdev) ? PTR_ERR(vpci_vdev) : 0;
@@ -67,7 +85,7 @@ vdev_add_generic_marvell_ahci(u16 dev, unsigned char bus_no, unsigned char dev_n
     dev_dsc->class = U24_CLASS_TO_U8_CLASS(PCI_CLASS_STORAGE_SATA_AHCI);
     dev_dsc->subclass = U24_CLASS_TO_U8_SUBCLASS(PCI_CLASS_STORAGE_SATA_AHCI);
     dev_dsc->prog_if = U24_CLASS_TO_U8_PROGIF(PCI_CLASS_STORAGE_SATA_AHCI);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
+    return add_vdev(dev_dsc, &caps_pcie_ep_gen2, bus_no, dev_no, fn_no, is_mf);
 }
 
 static int vdev_add_MARVELL_88SE9235(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
@@ -88,7 +106,7 @@ static int vdev_add_INTEL_I211(unsigned char bus_no, unsigned char dev_no, unsig
     dev_dsc->rev_id = 0x03; //Not confirmed
     dev_dsc->class = U16_CLASS_TO_U8_CLASS(PCI_CLASS_NETWORK_ETHERNET);
     dev_dsc->subclass = U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_NETWORK_ETHERNET);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
+    return add_vdev(dev_dsc, &caps_pcie_ep_gen1, bus_no, dev_no, fn_no, is_mf);
 }
 
 static int vdev_add_INTEL_X552(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
@@ -99,7 +117,7 @@ static int vdev_add_INTEL_X552(unsigned char bus_no, unsigned char dev_no, unsig
     dev_dsc->rev_id = 0x03; //Not confirmed
     dev_dsc->class = U16_CLASS_TO_U8_CLASS(PCI_CLASS_NETWORK_ETHERNET);
     dev_dsc->subclass = U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_NETWORK_ETHERNET);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
+    return add_vdev(dev_dsc, &caps_pcie_ep_gen1, bus_no, dev_no, fn_no, is_mf);
 }
 
 
@@ -111,7 +129,7 @@ static int vdev_add_INTEL_CPU_AHCI_CTRL(unsigned char bus_no, unsigned char dev_
     dev_dsc->class = U24_CLASS_TO_U8_CLASS(PCI_CLASS_STORAGE_SATA_AHCI);
     dev_dsc->subclass = U24_CLASS_TO_U8_SUBCLASS(PCI_CLASS_STORAGE_SATA_AHCI);
     dev_dsc->prog_if = U24_CLASS_TO_U8_PROGIF(PCI_CLASS_STORAGE_SATA_AHCI);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
+    return add_vdev(dev_dsc, &caps_pm_msi, bus_no, dev_no, fn_no, is_mf);
 }
 
 //This technically should be a bridge but we don't have the info to recreate full tree
@@ -122,7 +140,7 @@ vdev_add_generic_intel_pcie(u16 dev, unsigned char bus_no, unsigned char dev_no,
     dev_dsc->dev = dev;
     dev_dsc->class = U16_CLASS_TO_U8_CLASS(PCI_CLASS_BRIDGE_PCI);
     dev_dsc->subclass = U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_BRIDGE_PCI);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
+    return add_vdev(dev_dsc, &caps_pcie_root_port, bus_no, dev_no, fn_no, is_mf);
 }
 
 static int vdev_add_INTEL_CPU_PCIE_PA(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
@@ -143,7 +161,7 @@ static int vdev_add_INTEL_CPU_USB_XHCI(unsigned char bus_no, unsigned char dev_n
     dev_dsc->class = U24_CLASS_TO_U8_CLASS(PCI_CLASS_SERIAL_USB_XHCI);
     dev_dsc->subclass = U24_CLASS_TO_U8_SUBCLASS(PCI_CLASS_SERIAL_USB_XHCI);
     dev_dsc->prog_if = U24_CLASS_TO_U8_PROGIF(PCI_CLASS_SERIAL_USB_XHCI);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
+    return add_vdev(dev_dsc, &caps_pm_msi, bus_no, dev_no, fn_no, is_mf);
 }
 
 static inline int
@@ -154,7 +172,7 @@ vdev_add_generic_intel_io(u16 dev, unsigned char bus_no, unsigned char dev_no, u
     dev_dsc->dev = dev;
     dev_dsc->class = U16_CLASS_TO_U8_CLASS(PCI_CLASS_SP_OTHER);
     dev_dsc->subclass = U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_SP_OTHER);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
+    return add_vdev(dev_dsc, &caps_pm, bus_no, dev_no, fn_no, is_mf);
 }
 
 static int vdev_add_INTEL_CPU_I2C(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
@@ -180,7 +198,7 @@ static int vdev_add_INTEL_CPU_SMBUS(unsigned char bus_no, unsigned char dev_no,
     dev_dsc->class = U16_CLASS_TO_U8_CLASS(PCI_CLASS_SERIAL_SMBUS);
     dev_dsc->subclass = U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_SERIAL_SMBUS);
 
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
+    return add_vdev(dev_dsc, NULL, bus_no, dev_no, fn_no, is_mf);
 }
 
 static int (*dev_type_handler_map[])(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf) = {
@@ -198,45 +216,77 @@ static int (*dev_type_handler_map[])(unsigned char bus_no, unsigned char dev_no,
         [VPD_INTEL_CPU_SMBUS] = vdev_add_INTEL_CPU_SMBUS,
 };
 
+bool pci_shim_is_needed(const struct hw_config *hw)
+{
+    return hw_cfg(hw, pci_stubs_num) > 0;
+}
+
+static void free_vpci_dev_dscs(void)
+{
+    for (int i = 0; i < free_dev_idx; i++) {
+        pr_loc_dbg("Free PCI dev %d @ %p", i, devices[i]);
+        rp_kfree(devices[i], RP_MEM_VPCI);
+    }
+    rp_kfree(devices, RP_MEM_VPCI);
+    devices = NULL;
+    free_dev_idx = 0;
+    max_devs = 0;
+}
+
 int register_pci_shim(const struct hw_config *hw)
 {
     shim_reg_in();
 
-    pr_loc_dbg("Creating vPCI devices for %s", hw->name);
-    int out;
-    for (int i = 0; i < MAX_VPCI_DEVS; i++) {
-        if (hw->pci_stubs[i].type == __VPD_TERMINATOR__)
-            break;
+    unsigned int stubs_num = hw_cfg(hw, pci_stubs_num);
+    pr_loc_dbg("Creating %u vPCI devices for %s", stubs_num, hw_cfg(hw, name));
+    if (stubs_num == 0) {
+        shim_reg_ok();
+        return 0;
+    }
+
+    kzalloc_or_exit_int(devices, sizeof(void *) * stubs_num, RP_MEM_VPCI);
+    max_devs = stubs_num;
 
-        pr_loc_dbg("Calling %ps with B:D:F=%02x:%02x:%02x mf=%d", dev_type_handler_map[hw->pci_stubs[i].type],
-                   hw->pci_stubs[i].bus, hw->pci_stubs[i].dev, hw->pci_stubs[i].fn,
-                   hw->pci_stubs[i].multifunction ? 1 : 0);
+    //All stubs are added at once so that every vBUS is scanned only once
+    int out = vpci_begin();
+    if (out != 0)
+        goto out_free;
 
-        out = dev_type_handler_map[hw->pci_stubs[i].type](hw->pci_stubs[i].bus, hw->pci_stubs[i].dev,
-                                                          hw->pci_stubs[i].fn, hw->pci_stubs[i].multifunction);
+    for (int i = 0; i < stubs_num; i++) {
+        const struct vpci_device_stub *stub = &hw_cfg(hw, pci_stubs)[i];
+        pr_loc_dbg("Calling %ps with B:D:F=%02x:%02x:%02x mf=%d", dev_type_handler_map[stub->type], stub->bus,
+                   stub->dev, stub->fn, stub->multifunction ? 1 : 0);
+
+        out = dev_type_handler_map[stub->type](stub->bus, stub->dev, stub->fn, stub->multifunction);
 
         if (out != 0) {
-            pr_loc_err("Failed to create vPCI device B:D:F=%02x:%02x:%02x - error=%d", hw->pci_stubs[i].bus,
-                       hw->pci_stubs[i].dev, hw->pci_stubs[i].fn, out);
-            return out;
+            pr_loc_err("Failed to create vPCI device B:D:F=%02x:%02x:%02x - error=%d", stub->bus, stub->dev,
+                       stub->fn, out);
+            vpci_abort(); //nothing was visible to the kernel yet, so nothing half-configured is left behind
+            goto out_free;
         }
 
-        pr_loc_dbg("vPCI device %d created successfully", i+1);
+        pr_loc_dbg("vPCI device %d queued successfully", i+1);
+    }
+
+    if ((out = vpci_commit()) != 0) {
+        pr_loc_err("Failed to commit vPCI devices - error=%d", out);
+        return out; //some devices may be already visible - descriptors must stay until unregister
     }
 
     shim_reg_ok();
     return 0;
+
+    out_free:
+    free_vpci_dev_dscs();
+    return out;
 }
 
 int unregister_pci_shim(void)
 {
     shim_ureg_in();
     vpci_remove_all_devices_and_buses();
-
-    for (int i = 0; i < free_dev_idx; i++) {
-        pr_loc_dbg("Free PCI dev %d @ %p", i, devices[i]);
-        kfree(devices[i]);
-    }
+    free_vpci_dev_dscs();
 
     shim_ureg_ok();
     return -EIO; //vpci_remove_all_devices_and_buses has a bug - this is a canary to not forget
@@ -1,6 +1,8 @@
 #ifndef REDPILL_PCI_SHIM_H
 #define REDPILL_PCI_SHIM_H
 
+#include <linux/types.h> //bool
+
 enum pci_shim_device_type {
     __VPD_TERMINATOR__,
     VPD_MARVELL_88SE9235, //1b4b:9235
@@ -18,6 +20,10 @@ enum pci_shim_device_type {
 };
 
 typedef struct hw_config hw_config_;
+/**
+ * Checks if the platform needs any vPCI devices, i.e. if registering the shim would do anything
+ */
+bool pci_shim_is_needed(const struct hw_config *hw);
 int register_pci_shim(const struct hw_config *hw);
 int unregister_pci_shim(void);
 
@@ -4,18 +4,36 @@
 #include "shim_base.h"
 #include "../common.h"
 #include "../internal/uart/virtual_uart.h"
+#include "../internal/metrics.h" //RP_METRIC(), rp_metric_*()
+#include "../config/platform_types.h" //hw_cfg()
+#include "../compat/kfifo_compat.h" //kfifo_put_val()
+#include "../debug/debug_pmu_trace.h" //pmu_trace_*(); noop unless built with DBG_PMU_TRACE
 #include <linux/kfifo.h> //kfifo_*
+#include <linux/workqueue.h> //deferred execution of commands
 
 #define PMU_TTYS_LINE 1 //so far this is hardcoded by syno, so we doubt it will ever change
-#define WORK_BUFFER_LEN VUART_FIFO_LEN
-#define to_hex_buf_len(len) ((len)*3+1) //2 chars for each hex + space + NULL terminator
-#define HEX_BUFFER_LEN to_hex_buf_len(VUART_FIFO_LEN)
+#define PMU_VUART_CHIP VUART_CHIP_16750 //deep FIFO; mfgBIOS bursts will be delivered in fewer callbacks
+#define WORK_BUFFER_LEN 512 //ring; must be a power of 2 and bigger than VUART_FIFO_LEN_MAX
+#define CMD_BUFFER_LEN VUART_FIFO_LEN_MAX //longest command we're able to route (its also plenty for unknown ones)
+#define HEX_PRINT_MAX_LEN 64 //printk() "%*ph" prints up to 64 bytes
 
 //PMU packets are at minimum 2 bytes long (PMU_CMD_HEAD + 1-3 bytes command + optional data). If this is set to a high
 // value (e.g. VUART_FIFO_LEN) in practice commands will only be delivered when the client indicates end-of-transmission)
 // which may not be bad...
 #define PMU_MIN_PACKET 2
 #define PMU_CMD_HEAD 0x2d //every PMU packet is delimited by containing 0x2d (ASCII "-"/dash) as its first character
+#define PMU_CMD_QUEUE_LEN 16 //max number of commands waiting for execution; must be a power of 2
+#define PMU_CMD_WQ_NAME "pmu_cmd"
+#define PMU_RESP_MAX_LEN 64 //including head and echoed command signature
+#define PMU_RESP_TIMEOUT (HZ / 2) //how long we wait for space in the vUART to send a response
+
+//Values of emulated PMU properties; these can be overridden during build
+//There's no public documentation of PMU responses and this value wasn't captured from a real unit. It's a placeholder
+// which is only meant to be non-empty so that the query is answered (with PMU_RESPOND=y) - if you know the value of your
+// platform's PMU set it with e.g. `make PMU_RESPOND=y EXTRA_CFLAGS='-DPMU_FW_VERSION=\"x.y\"'`.
+#ifndef PMU_FW_VERSION
+#define PMU_FW_VERSION "1.0"
+#endif
 
 typedef struct command_definition command_definition;
 
@@ -26,17 +44,21 @@ struct command_definition {
     void (*fn) (const command_definition *t, const char *data, u8 data_len);
     const u8 length; //commands are realistically 1-3 chars only
     const char *name;
+    const char *signature; //only for multibyte commands; single byte ones are identified by their index
+    int (*respond) (char *buf, unsigned int size); //only for queries; generates response payload (see cmd_shim_respond)
 } __packed;
 
 /**
  * Result for matching of command signature against known list
  */
 typedef enum {
-    PMU_CMD_AMBIGUOUS = -1,
+    PMU_CMD_AMBIGUOUS = -1, //signature is a prefix of a known command (or commands) - more data is needed to decide
     PMU_CMD_NOT_FOUND =  0,
     PMU_CMD_FOUND     =  1,
 } pmu_match_status;
 
+#define PMU_CMD_MAX_SIG_LEN 3 //the longest signature of any command (see multi_byte_cmds)
+
 /**
  * Default/noop shim for a PMU command. It simply prints the command received.
  */
@@ -45,6 +67,62 @@ static void cmd_shim_noop(const command_definition *t, const char *data, u8 data
     pr_loc_dbg("vPMU received %s using %d bytes - NOOP", t->name, data_len);
 }
 
+static const struct hw_config *pmu_hw = NULL; //platform we're emulating PMU for
+static char *resp_buffer = NULL; //only used from cmd_wq (which is ordered) so it needs no locking
+
+#ifdef RP_PMU_RESPOND
+/**
+ * Shim for PMU queries: sends a response back to the kernel (PMU=>kernel direction)
+ *
+ * Without responses mfgBIOS falls into retry & time-out loops, which cost seconds during boot. A response consists of
+ * the head, the signature of the query and a payload generated by command_definition.respond. It is injected into the
+ * vUART RX right away. This function is called from the command workqueue so it's allowed to sleep waiting for space.
+ *
+ * Note: this framing isn't taken from any specification or capture of a real PMU - it simply mirrors the framing of
+ *       kernel=>PMU packets (PMU_CMD_HEAD + command signature, see process_work_buffer()) as that's the only
+ *       part of the protocol we know. Verify it against a real unit before relying on payloads of new queries.
+ */
+static void cmd_shim_respond(const command_definition *t, const char *data, u8 data_len)
+{
+    unsigned int sig_len = min_t(unsigned int, t->length, data_len); //data may contain CRLF after the signature
+    resp_buffer[0] = PMU_CMD_HEAD;
+    memcpy(&resp_buffer[1], data, sig_len);
+
+    int payload_len = t->respond(&resp_buffer[1 + sig_len], PMU_RESP_MAX_LEN - 1 - sig_len);
+    if (unlikely(payload_len < 0)) {
+        pr_loc_err("Failed to generate vPMU response to %s - error=%d", t->name, payload_len);
+        return;
+    }
+
+    int resp_len = 1 + sig_len + payload_len;
+    int out = vuart_inject_rx_wait(PMU_TTYS_LINE, resp_buffer, resp_len, PMU_RESP_TIMEOUT);
+    if (unlikely(out != resp_len)) {
+        pr_loc_err("Failed to send vPMU response to %s - sent=%d/%d", t->name, out, resp_len);
+        return;
+    }
+
+    pr_loc_dbg("vPMU responded to %s with %d bytes: ascii=\"%.*s\"", t->name, resp_len, resp_len, resp_buffer);
+}
+
+/**
+ * Note: snprintf() returns the length it would've written; the payload must fit without truncation
+ */
+#define respond_with_str(buf, size, ...) ({ \
+    int __len = snprintf(buf, size, __VA_ARGS__); \
+    __len >= (size) ? -ENOSPC : __len; \
+})
+
+static int resp_get_uniq(char *buf, unsigned int size)
+{
+    return respond_with_str(buf, size, "%s", hw_cfg(pmu_hw, name));
+}
+
+static int resp_switch_up_ver(char *buf, unsigned int size)
+{
+    return respond_with_str(buf, size, "%s", PMU_FW_VERSION);
+}
+#endif //RP_PMU_RESPOND
+
 //@todo when we get the physical PMU emulator we can move this to a separate library so that shim contacts an internal
 // routing routine for commands which aren't shimmed here. Then we will add all PMU=>kernel commands as well. Currently
 // we only define kernel=>PMU ones as these are the ones we need to listen for.
@@ -55,6 +133,13 @@ static void cmd_shim_noop(const command_definition *t, const char *data, u8 data
 #define has_single_byte_cmd(id) \
     (likely((id) >= PMU_CMD__MIN_CODE) && likely((id) <= PMU_CMD__MAX_CODE) && get_single_byte_cmd(id).length != 0)
 #define DEFINE_SINGLE_BYTE_CMD(cnm, fp) [single_byte_idx(PMU_CMD_ ## cnm)] = { .name = #cnm, .length = 1, .fn = fp }
+//Responses are unverified (see cmd_shim_respond()) so by default queries are only listened to, like all other commands
+#ifdef RP_PMU_RESPOND
+#define DEFINE_SINGLE_BYTE_QUERY(cnm, rfp) \
+    [single_byte_idx(PMU_CMD_ ## cnm)] = { .name = #cnm, .length = 1, .fn = cmd_shim_respond, .respond = rfp }
+#else
+#define DEFINE_SINGLE_BYTE_QUERY(cnm, rfp) DEFINE_SINGLE_BYTE_CMD(cnm, cmd_shim_noop)
+#endif
 
 #define PMU_CMD_OUT_HW_POWER_OFF 0x31 //"1"
 #define PMU_CMD_OUT_BUZ_SHORT 0x32 //"2"
@@ -83,7 +168,7 @@ static void cmd_shim_noop(const command_definition *t, const char *data, u8 data
 #define PMU_CMD_OUT_SWITCH_UP_VER 0x4f //"O"
 #define PMU_CMD_OUT_MIR_LED_OFF 0x50 //"P"
 //0x51-55 unknown (except 52)
-#define PMU_CMD_OUT_GET_UNIQ 0x52 //"P"
+#define PMU_CMD_OUT_GET_UNIQ 0x52 //"R"
 #define PMU_CMD_OUT_PWM_CYCLE 0x56 //"V"
 #define PMU_CMD_OUT_PWM_HZ 0x57 //"W"
 //0x58-59 unknown
@@ -114,9 +199,9 @@ static const command_definition single_byte_cmds[single_byte_idx(PMU_CMD__MAX_CO
     DEFINE_SINGLE_BYTE_CMD(OUT_10G_LED_ON, cmd_shim_noop),
     DEFINE_SINGLE_BYTE_CMD(OUT_10G_LED_OFF, cmd_shim_noop),
     DEFINE_SINGLE_BYTE_CMD(OUT_LED_TOG_PWR_STAT, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_SWITCH_UP_VER, cmd_shim_noop),
+    DEFINE_SINGLE_BYTE_QUERY(OUT_SWITCH_UP_VER, resp_switch_up_ver),
     DEFINE_SINGLE_BYTE_CMD(OUT_MIR_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_GET_UNIQ, cmd_shim_noop),
+    DEFINE_SINGLE_BYTE_QUERY(OUT_GET_UNIQ, resp_get_uniq),
     DEFINE_SINGLE_BYTE_CMD(OUT_PWM_CYCLE, cmd_shim_noop),
     DEFINE_SINGLE_BYTE_CMD(OUT_PWM_HZ, cmd_shim_noop),
     DEFINE_SINGLE_BYTE_CMD(OUT_WOL_ON, cmd_shim_noop),
@@ -126,13 +211,51 @@ static const command_definition single_byte_cmds[single_byte_idx(PMU_CMD__MAX_CO
     DEFINE_SINGLE_BYTE_CMD(OUT_FAN_HEALTH_ON, cmd_shim_noop),
 };
 
+//Multibyte commands are matched using cmd_trie; they can share prefixes with each other AND with single byte ones
+#define DEFINE_MULTI_BYTE_CMD(cnm, fp) \
+    { .name = #cnm, .signature = PMU_CMD_ ## cnm, .length = strlen_static(PMU_CMD_ ## cnm), .fn = fp }
+#define PMU_CMD_OUT_SW1 "SW1" //sent by mfgBIOS as "-SW1"; purpose unknown (but it's "-S" which makes it ambiguous)
+
+static const command_definition multi_byte_cmds[] = {
+    DEFINE_MULTI_BYTE_CMD(OUT_SW1, cmd_shim_noop),
+};
+
+/**
+ * Prefix tree of all known commands
+ *
+ * The first level is a direct lookup table indexed by the first byte of a signature (as most commands are single byte
+ * ones), while deeper levels are short lists of siblings. This way matching takes O(len) and we can tell as soon as a
+ * signature cannot be anything else than a given command (=node with a command and no children), without waiting for
+ * the transmitter to go idle.
+ * The tree is built from single_byte_cmds & multi_byte_cmds during registration; its size is known at compile time.
+ */
+struct cmd_trie_node {
+    const command_definition *cmd; //command which ends at this node (if any)
+    s16 child; //first child node index or -1
+    s16 sibling; //next sibling node index or -1
+    char byte;
+};
+#define CMD_TRIE_MAX_NODES (ARRAY_SIZE(multi_byte_cmds) * PMU_CMD_MAX_SIG_LEN)
+static s16 cmd_trie_root[256]; //first-level nodes (-1 if there's no command starting with a given byte)
+static struct cmd_trie_node cmd_trie[ARRAY_SIZE(single_byte_cmds) + CMD_TRIE_MAX_NODES];
+static unsigned int cmd_trie_len = 0;
+
 
-static char *uart_buffer = NULL; //keeps data streamed directly by the vUART... todo: vUART should manage this buffer
-static char *work_buffer = NULL; //collecting & operatint on the data received from vUART
-static char *work_buffer_curr = NULL; //pointer to the current free space in work_buffer
-static char *hex_print_buffer = NULL; //helper buffer to print char arrays in hex
+/**
+ * Work buffer is a ring collecting data received from vUART
+ *
+ * Both indexes are free-running: work_buffer_head is where new data is written, work_buffer_tail is the parse cursor
+ * (i.e. the first byte which wasn't processed yet). Nothing is ever moved around - processing just advances the tail.
+ */
+static char *work_buffer = NULL;
+static unsigned int work_buffer_head = 0;
+static unsigned int work_buffer_tail = 0;
+static char *cmd_buffer = NULL; //used to linearize commands which wrap around the end of the work buffer
 
-#define work_buffer_fill() ((unsigned int)(work_buffer_curr - work_buffer))
+#define work_buffer_fill() (work_buffer_head - work_buffer_tail)
+#define work_buffer_space() (WORK_BUFFER_LEN - work_buffer_fill())
+#define work_buffer_idx(pos) ((pos) & (WORK_BUFFER_LEN - 1))
+#define work_buffer_at(pos) work_buffer[work_buffer_idx(pos)]
 
 /**
  * Free all buffers used by this submodule
@@ -141,19 +264,19 @@ static char *hex_print_buffer = NULL; //helper buffer to print char arrays in he
  */
 static void free_buffers(void)
 {
-    if (likely(uart_buffer))
-        kfree(uart_buffer);
-
     if (likely(work_buffer))
-        kfree(work_buffer);
+        rp_kfree(work_buffer, RP_MEM_PMU);
+
+    if (likely(cmd_buffer))
+        rp_kfree(cmd_buffer, RP_MEM_PMU);
 
-    if (likely(hex_print_buffer))
-        kfree(hex_print_buffer);
+    if (likely(resp_buffer))
+        rp_kfree(resp_buffer, RP_MEM_PMU);
 
-    uart_buffer = NULL;
     work_buffer = NULL;
-    work_buffer_curr = NULL;
-    hex_print_buffer = NULL;
+    work_buffer_head = work_buffer_tail = 0;
+    cmd_buffer = NULL;
+    resp_buffer = NULL;
 }
 
 /**
@@ -161,83 +284,300 @@ static void free_buffers(void)
  */
 static int alloc_buffers(void)
 {
-    kmalloc_or_exit_int(uart_buffer, VUART_FIFO_LEN);
-    kmalloc_or_exit_int(work_buffer, WORK_BUFFER_LEN);
-    kmalloc_or_exit_int(hex_print_buffer, HEX_BUFFER_LEN);
+    BUILD_BUG_ON_NOT_POWER_OF_2(WORK_BUFFER_LEN);
+    BUILD_BUG_ON(WORK_BUFFER_LEN <= VUART_FIFO_LEN_MAX);
+
+    kmalloc_or_exit_int(work_buffer, WORK_BUFFER_LEN, RP_MEM_PMU);
+    kmalloc_or_exit_int(cmd_buffer, CMD_BUFFER_LEN, RP_MEM_PMU);
+#ifdef RP_PMU_RESPOND
+    kmalloc_or_exit_int(resp_buffer, PMU_RESP_MAX_LEN, RP_MEM_PMU);
+#endif
 
-    work_buffer_curr = work_buffer;
+    work_buffer_head = work_buffer_tail = 0;
 
     return 0;
 }
 
 /**
- * Converts passed char buffer into user-readable hex print of it
+ * Gets a contiguous view of a part of the work buffer
  *
- * @todo this should probably be extracted
+ * Most of the time this is simply a pointer into the ring. Only data wrapping around its end is copied (and possibly
+ * truncated to CMD_BUFFER_LEN).
+ *
+ * @param len Number of bytes requested; it will be updated if the data had to be truncated
  */
-static __used const char *get_hex_print(const char *buffer, int len)
+static const char *get_work_buffer_view(unsigned int pos, unsigned int *len)
 {
-    if (unlikely(len == 0)) {
-        hex_print_buffer[0] = '\0';
-        return hex_print_buffer;
-    } else if (unlikely(to_hex_buf_len(len) > HEX_BUFFER_LEN)) {
-        pr_loc_bug("Printing %d bytes as hex requires %d bytes in buffer - buffer is %d bytes", len,
-                   to_hex_buf_len(len), HEX_BUFFER_LEN);
-        hex_print_buffer[0] = '\0';
-        return hex_print_buffer;
+    unsigned int idx = work_buffer_idx(pos);
+    if (likely(idx + *len <= WORK_BUFFER_LEN))
+        return &work_buffer[idx];
+
+    if (unlikely(*len > CMD_BUFFER_LEN)) {
+        pr_loc_wrn("Command of %u bytes is too long - truncating to %d", *len, CMD_BUFFER_LEN);
+        *len = CMD_BUFFER_LEN;
     }
 
-    int hex_len = 0;
-    for (int i = 0; i < len; ++i) {
-        sprintf(&hex_print_buffer[i * 3], "%02x ", buffer[i]);
-        hex_len += 3;
+    unsigned int first = min(*len, WORK_BUFFER_LEN - idx);
+    memcpy(cmd_buffer, &work_buffer[idx], first);
+    memcpy(cmd_buffer + first, work_buffer, *len - first);
+
+    return cmd_buffer;
+}
+
+/**
+ * Adds a new node to the tree
+ *
+ * @return node index or -E on error
+ */
+static int cmd_trie_new_node(char byte)
+{
+    if (unlikely(cmd_trie_len >= ARRAY_SIZE(cmd_trie))) {
+        pr_loc_bug("PMU command tree is full - PMU_CMD_MAX_SIG_LEN is probably too small");
+        return -ENOSPC;
+    }
+
+    cmd_trie[cmd_trie_len].cmd = NULL;
+    cmd_trie[cmd_trie_len].child = -1;
+    cmd_trie[cmd_trie_len].sibling = -1;
+    cmd_trie[cmd_trie_len].byte = byte;
+
+    return cmd_trie_len++;
+}
+
+/**
+ * Inserts a single command into the tree
+ */
+static int cmd_trie_insert(const command_definition *cmd, const char *signature, unsigned int sig_len)
+{
+    int node = cmd_trie_root[(u8)signature[0]];
+    if (node == -1) {
+        if ((node = cmd_trie_new_node(signature[0])) < 0)
+            return node;
+        cmd_trie_root[(u8)signature[0]] = node;
+    }
+
+    for (unsigned int i = 1; i < sig_len; ++i) {
+        int child = cmd_trie[node].child;
+        while (child != -1 && cmd_trie[child].byte != signature[i])
+            child = cmd_trie[child].sibling;
+
+        if (child == -1) {
+            if ((child = cmd_trie_new_node(signature[i])) < 0)
+                return child;
+            cmd_trie[child].sibling = cmd_trie[node].child;
+            cmd_trie[node].child = child;
+        }
+
+        node = child;
     }
 
-    hex_print_buffer[hex_len-1] = '\0';
-    return hex_print_buffer;
+    if (unlikely(cmd_trie[node].cmd)) {
+        pr_loc_bug("Duplicated PMU command signature for %s and %s", cmd_trie[node].cmd->name, cmd->name);
+        return -EEXIST;
+    }
+
+    cmd_trie[node].cmd = cmd;
+    return 0;
+}
+
+/**
+ * Builds the prefix tree from all known commands (see cmd_trie)
+ */
+static int build_cmd_trie(void)
+{
+    int out;
+    char sig;
+
+    memset(cmd_trie_root, 0xff, sizeof(cmd_trie_root)); //all -1
+    cmd_trie_len = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(single_byte_cmds); ++i) {
+        if (single_byte_cmds[i].length == 0)
+            continue;
+
+        sig = (char)(i + PMU_CMD__MIN_CODE);
+        if ((out = cmd_trie_insert(&single_byte_cmds[i], &sig, 1)) != 0)
+            return out;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(multi_byte_cmds); ++i) {
+        if ((out = cmd_trie_insert(&multi_byte_cmds[i], multi_byte_cmds[i].signature, multi_byte_cmds[i].length)) != 0)
+            return out;
+    }
+
+    pr_loc_dbg("Built PMU command tree with %u nodes", cmd_trie_len);
+    return 0;
+}
+
+/**
+ * Checks if the passed data consists only of CR and/or LF chars (which some mfgBIOS versions attach to commands)
+ */
+static inline bool is_crlf_tail(const char *data, unsigned int len)
+{
+    for (unsigned int i = 0; i < len; ++i) {
+        if (data[i] != 0x0d && data[i] != 0x0a)
+            return false;
+    }
+
+    return true;
 }
 
 /**
  * Matches command against a list of known ones based on the signature specified
  *
  * @param cmd pointer to a pointer where address of command structure can be saved if found
+ * @param complete Whether the signature is known to be complete (i.e. nothing else will follow it); if it isn't a
+ *                 command which is a prefix of some longer one will be reported as PMU_CMD_AMBIGUOUS
  */
 static pmu_match_status noinline
-match_command(const command_definition **cmd, const char *signature, const unsigned int sig_len)
+match_command(const command_definition **cmd, const char *signature, const unsigned int sig_len, bool complete)
 {
     if (unlikely(sig_len == 0)) {
+        if (!complete)
+            return PMU_CMD_AMBIGUOUS; //we only got the head so far
+
         pr_loc_dbg("Invalid zero-length command (stray head without command signature) - discarding");
         return PMU_CMD_NOT_FOUND;
     }
 
-    if (likely(sig_len == 1) //regular 1 byte
-        || (sig_len == 3 && signature[1] == 0x0d && signature[2] == 0x0a) //1 byte with CRLF (sic!)
-       ) {
-        if (!has_single_byte_cmd(signature[0]))
-            return PMU_CMD_NOT_FOUND;
+    int node = cmd_trie_root[(u8)signature[0]];
+    unsigned int pos = 1;
+    while (node != -1 && pos < sig_len) {
+        int child = cmd_trie[node].child;
+        while (child != -1 && cmd_trie[child].byte != signature[pos])
+            child = cmd_trie[child].sibling;
+
+        if (child == -1)
+            break;
+
+        node = child;
+        ++pos;
+    }
+
+    if (node == -1)
+        return PMU_CMD_NOT_FOUND;
+
+    if (pos < sig_len) { //we've got more data than the deepest matching node
+        //Command followed by CRLF (sic!)
+        if (cmd_trie[node].cmd && is_crlf_tail(&signature[pos], sig_len - pos)) {
+            *cmd = cmd_trie[node].cmd;
+            return PMU_CMD_FOUND;
+        }
+
+        return PMU_CMD_NOT_FOUND;
+    }
+
+    //We've consumed the whole signature. It can be a complete command, a prefix of a longer one, or both
+    if (!cmd_trie[node].cmd)
+        return complete ? PMU_CMD_NOT_FOUND : PMU_CMD_AMBIGUOUS;
+
+    if (!complete && cmd_trie[node].child != -1)
+        return PMU_CMD_AMBIGUOUS;
+
+    *cmd = cmd_trie[node].cmd;
+    return PMU_CMD_FOUND;
+}
+
+/**
+ * Commands are executed on a dedicated ordered workqueue
+ *
+ * Matching happens in pmu_rx_callback() which runs under the vUART lock. Command handlers (LEDs, buzzer, fans...) can
+ * be slow, so they're only queued there and executed later in the order they were received. The queue has exactly one
+ * producer (the vUART callback) and one consumer (cmd_work) so kfifo doesn't need any locking.
+ */
+struct queued_command {
+    const command_definition *cmd;
+    u8 data_len;
+    char data[CMD_BUFFER_LEN];
+};
+
+static DECLARE_KFIFO(cmd_queue, struct queued_command, PMU_CMD_QUEUE_LEN);
+static struct workqueue_struct *cmd_wq = NULL;
+static void execute_queued_commands(struct work_struct *work);
+static DECLARE_WORK(cmd_work, execute_queued_commands);
+
+static void execute_queued_commands(struct work_struct *work)
+{
+    struct queued_command qcmd;
+
+    while (kfifo_get(&cmd_queue, &qcmd)) {
+        pr_loc_dbg("Executing cmd %s handler %pF", qcmd.cmd->name, qcmd.cmd->fn);
+        qcmd.cmd->fn(qcmd.cmd, qcmd.data, qcmd.data_len);
+    }
+}
+
+static RP_METRIC(pmu_rx_bytes, RP_MG_PMU, RP_METRIC_COUNTER);
+static RP_METRIC(pmu_commands, RP_MG_PMU, RP_METRIC_COUNTER);
+static RP_METRIC(pmu_commands_unknown, RP_MG_PMU, RP_METRIC_COUNTER);
+static RP_METRIC(pmu_commands_dropped, RP_MG_PMU, RP_METRIC_COUNTER); //queue full
+static RP_METRIC(pmu_work_buffer_overflows, RP_MG_PMU, RP_METRIC_COUNTER);
+static struct rp_metric *const pmu_metrics[] = {
+    &pmu_rx_bytes, &pmu_commands, &pmu_commands_unknown, &pmu_commands_dropped, &pmu_work_buffer_overflows
+};
 
-        *cmd = &get_single_byte_cmd(signature[0]);
-        return PMU_CMD_FOUND;
+/**
+ * Puts command on the execution queue; it's safe to call this in an atomic context
+ */
+static void queue_command(const command_definition *cmd, const char *data, unsigned int data_len)
+{
+    if (pmu_trace_cmd(data, data_len)) //replayed commands are only counted
+        return;
+
+    struct queued_command qcmd = {
+        .cmd = cmd,
+        .data_len = min_t(unsigned int, data_len, CMD_BUFFER_LEN),
+    };
+    memcpy(qcmd.data, data, qcmd.data_len);
+
+    if (unlikely(!kfifo_put_val(&cmd_queue, qcmd))) {
+        rp_metric_inc(&pmu_commands_dropped);
+        pr_loc_err("PMU command queue is full - dropping cmd %s", cmd->name);
+        return;
     }
 
-    return PMU_CMD_NOT_FOUND; //@todo Currently we don't handle multibyte commands; it has to be a full iteration
+    rp_metric_inc(&pmu_commands);
+
+    queue_work(cmd_wq, &cmd_work);
 }
 
 /**
  * Finds command based on its signature and execute its callback if found
+ *
+ * @param complete See match_command()
+ *
+ * @return PMU_CMD_AMBIGUOUS if nothing was done as more data is needed to decide; any other value means the data has
+ *         been dealt with (either executed or discarded as unknown)
  */
-static void route_command(const char *buffer, const unsigned int len)
+static pmu_match_status route_command(const char *buffer, const unsigned int len, bool complete)
 {
     const command_definition *cmd = NULL;
 
-    if (match_command(&cmd, buffer, len) != PMU_CMD_FOUND) {
-        pr_loc_wrn("Unknown %d byte PMU command with signature hex=\"%s\" ascii=\"%.*s\"", len,
-                   get_hex_print(buffer, len), len, buffer);
-        return;
+    pmu_match_status status = match_command(&cmd, buffer, len, complete);
+    if (status == PMU_CMD_AMBIGUOUS)
+        return status;
+
+    if (status != PMU_CMD_FOUND) {
+        if (pmu_trace_unknown(buffer, len))
+            return status;
+
+        rp_metric_inc(&pmu_commands_unknown);
+        unsigned int print_len = min_t(unsigned int, len, HEX_PRINT_MAX_LEN); //garbage can be longer than any command
+        pr_loc_wrn_rl("Unknown %d byte PMU command with signature hex=\"%*ph\" ascii=\"%.*s\"", len, print_len,
+                      buffer, print_len, buffer);
+        return status;
     }
 
-    pr_loc_dbg("Executing cmd %s handler %pF", cmd->name, cmd->fn);
-    cmd->fn(cmd, buffer, len);
+    queue_command(cmd, buffer, len);
+    return status;
+}
+
+/**
+ * Routes a command located in the work buffer; see route_command()
+ */
+static pmu_match_status route_work_buffer_command(unsigned int pos, unsigned int len, bool complete)
+{
+    const char *data = get_work_buffer_view(pos, &len);
+    return route_command(data, len, complete);
 }
 
 /**
@@ -250,31 +590,36 @@ static void route_command(const char *buffer, const unsigned int len)
  *                      will be a multibyte command (but we possibly didn't get all the bytes YET) or this is single or
  *                      multibyte command which we don't know.
  *
- * This function makes an assumption that when it's called that the buffer represents the whole state of the command
+ * Everything up to the last (possibly incomplete) command is consumed by moving the parse cursor. The last command is
+ * either executed too or left in place (with its head) to be rescanned when more data arrives.
  * If this becomes to take too long we can move it to a separate thread, but this will require a lock.
  */
 static noinline void process_work_buffer(bool end_of_packet)
 {
-    if (unlikely(work_buffer == work_buffer_curr)) {
+    if (unlikely(work_buffer_fill() == 0)) {
         //this can happen if kernel sends no data but we get IDLE... shouldn't logically happen
         pr_loc_wrn("%s called on empty buffer?!", __FUNCTION__);
         return;
     }
 
     int cmd_len = -1; //number of bytes in the command (excluding header)
-    for(char *curr = work_buffer; curr < work_buffer_curr; ++curr) {
-        if (*curr == PMU_CMD_HEAD) { //got the beginning of a new command
+    unsigned int cmd_start = 0; //position of the first byte of the command (after header)
+    for (unsigned int pos = work_buffer_tail; pos != work_buffer_head; ++pos) {
+        char curr = work_buffer_at(pos);
+        if (curr == PMU_CMD_HEAD) { //got the beginning of a new command
             //we've found a new command in the buffer - lets check if the previously collected data matches anything
-            if (cmd_len != -1) { //we only want to call it if this isn't the first byte after last cmd (or 1st in buf)
-                route_command(curr-cmd_len, cmd_len);
-                cmd_len = 0; //we've got the head so 0 and not -1
-            } else {
-                ++cmd_len; //We've read the buffer containing head, we then expect to get something which is non-head
-            }
+            if (cmd_len != -1) //we only want to call it if this isn't the first byte after last cmd (or 1st in buf)
+                route_work_buffer_command(cmd_start, cmd_len, true); //next head terminates the previous command
+
+            cmd_len = 0;
+            cmd_start = pos + 1;
         } else {
             if (cmd_len == -1) { //we don't expect data before head
-                pr_loc_wrn("Found garbage data in PMU buffer before cmd head (\"%c\" / 0x%02x) - ignoring", *curr,
-                           *curr);
+                if (is_crlf_tail(&curr, 1)) //tail of a command which was already executed early
+                    continue;
+
+                pr_loc_wrn("Found garbage data in PMU buffer before cmd head (\"%c\" / 0x%02x) - ignoring", curr,
+                           curr);
                 continue;
             }
 
@@ -283,60 +628,96 @@ static noinline void process_work_buffer(bool end_of_packet)
     }
 
     //We've finished processing the buffer. Now we need to decide what to do with that last piece of data
-    unsigned int processed = work_buffer_fill();
-    if (cmd_len != -1) { //if it's -1 it means we didn't find any heading so we're just discarding all data
-        if (end_of_packet) {
-            route_command(work_buffer_curr-cmd_len, cmd_len);
-        } else { //if the packed didn't end we need to keep that piece of buffer for the next run
-            processed -= cmd_len + 1; //we also keep head
-        }
-    }
-
-    unsigned int left = work_buffer_fill() - processed;
-    if (likely(left != 0)) {
-        memmove(work_buffer, work_buffer+processed, left);
-    }
-    work_buffer_curr = work_buffer + left;
-
-//    pr_loc_dbg("Left buffer %p curr=%p with %d bytes in it (ascii=\"%.*s\" hex={%s})", work_buffer, work_buffer_curr, left, left, work_buffer,
-//               get_hex_print(work_buffer, left));
+    //If it's -1 it means we didn't find any heading so we're just discarding all data. If the packet didn't end we can
+    // still execute the command if it cannot be anything else (it's not a prefix of any longer command). Otherwise we
+    // need to keep that piece of buffer (with its head) for the next run.
+    if (cmd_len != -1 && route_work_buffer_command(cmd_start, cmd_len, end_of_packet) == PMU_CMD_AMBIGUOUS)
+        work_buffer_tail = cmd_start - 1;
+    else
+        work_buffer_tail = work_buffer_head;
 }
 
 /**
- * Callback passed to vUART. It will be called any time some data is available.
+ * Zero-copy callback passed to vUART. It will be called any time some data is available.
+ *
+ * Data is copied straight from the vUART TX FIFO into the work buffer ring. Since the buffer is processed on every
+ * delivery it only holds an incomplete command between calls, so it will never overflow in practice.
  */
-static noinline void pmu_rx_callback(int line, const char *buffer, unsigned int len, vuart_flush_reason reason)
+static noinline unsigned int pmu_rx_callback(int line, const struct vuart_tx_segment *segs, unsigned int nsegs,
+                                             unsigned int len, vuart_flush_reason reason)
 {
-    pr_loc_dbg("Got %d bytes from PMU: reason=%d hex={%s} ascii=\"%.*s\"", len, reason, get_hex_print(buffer, len), len, buffer);
-
-    int buffer_space = WORK_BUFFER_LEN - work_buffer_fill();
-    if (unlikely(work_buffer_curr + len > work_buffer + WORK_BUFFER_LEN)) { //todo just remove as much as needed from the buffer to fit more data
-        pr_loc_err("Work buffer is full! Only %d of %d bytes will be copied from receiver", len, buffer_space);
-        len = buffer_space;
+    pmu_trace_rx(segs, nsegs, len, reason);
+    rp_metric_add(&pmu_rx_bytes, len);
+    if (unlikely(work_buffer_space() < len)) { //a never-ending ambiguous command?
+        rp_metric_inc(&pmu_work_buffer_overflows);
+        pr_loc_wrn_rl("Work buffer is full - forcefully processing %u bytes left", work_buffer_fill());
+        process_work_buffer(true);
     }
 
-    memcpy(work_buffer_curr, buffer, len);
-    work_buffer_curr += len;
-//    pr_loc_dbg("Copied data to work buffer, now with %d bytes in it (cur=%p)",
-//               (unsigned int)(work_buffer_curr - work_buffer), work_buffer_curr);
+    for (unsigned int i = 0; i < nsegs; ++i) {
+        unsigned int idx = work_buffer_idx(work_buffer_head);
+        unsigned int first = min(segs[i].len, WORK_BUFFER_LEN - idx);
+        memcpy(&work_buffer[idx], segs[i].data, first);
+        memcpy(work_buffer, segs[i].data + first, segs[i].len - first);
+        work_buffer_head += segs[i].len;
 
-    //We only want to analyze the buffer when we are sure we have the full command to process. This is because commands
-    // are variable length and have no end delimiter not length specified with prefixes of short commands conflicting
-    // with longer commands (sic!)
+        pr_loc_dbg("Got %d bytes from PMU: reason=%d hex={%*ph} ascii=\"%.*s\"", segs[i].len, reason,
+                   min_t(int, segs[i].len, HEX_PRINT_MAX_LEN), segs[i].data, segs[i].len, segs[i].data);
+    }
+
+    //Commands are variable length and have no end delimiter not length specified with prefixes of short commands
+    // conflicting with longer commands (sic!)
     //For example, you have "SW1" command which when sent will look like "-SW1" (0x2d 0x53 0x57 0x31). We can capture
     // this when VUART_FLUSH_IDLE happens. We can also easily capture this when multiple commands are sent at once
     // (unlikely but possible) since it will be something like "-SW1-3". However, we CANNOT distinguish "-S" from
-    // incomplete "-SW1". So we need to rely on IDLE - if we got "-S" with IDLE it means it was "-S" and not the
-    // beginning of "-SW1".
-    //We also forcefully flush on full buffer even if no IDLE was specified, as it's technically possible for the
-    // software to send a long sequence of commands at once totaling more than our buffer (extremely unlikely).
-    //Additionally, we only process IDLE-signalled buffers when they have at least a single byte of data as some
-    // versions of the mfgBIOS attach head AND THEN in a separate packet send the actual commands (sic!)
+    // incomplete "-SW1". The command tree (see match_command()) tells us whether what we have is unambiguous, so we can
+    // scan the buffer on every delivery and execute all commands which cannot be anything else. Only ambiguous
+    // leftovers are kept until IDLE - if we got "-S" with IDLE it means it was "-S" and not the beginning of "-SW1".
+    //Additionally, we only process IDLE-signalled buffers as complete when they have at least a single byte of data as
+    // some versions of the mfgBIOS attach head AND THEN in a separate packet send the actual commands (sic!)
     if (reason == VUART_FLUSH_IDLE && work_buffer_fill() > 1)
         process_work_buffer(true);
-    //our buffer is full [we must process] or vUART buffer was full [we should process]
-    else if (buffer_space <= len || reason == VUART_FLUSH_FULL)
+    else if (work_buffer_fill() > 0)
         process_work_buffer(false);
+
+    return len;
+}
+
+#ifdef RPDBG_PMU_TRACE
+int pmu_shim_replay_begin(void)
+{
+    if (unlikely(!work_buffer))
+        return -ENODEV;
+
+    int out = vuart_set_tx_zc_callback(PMU_TTYS_LINE, NULL, 0);
+    if (unlikely(out != 0))
+        return out;
+
+    work_buffer_head = work_buffer_tail = 0; //a partial live command cannot be mixed with replayed data
+    return 0;
+}
+
+void pmu_shim_replay_feed(const char *data, unsigned int len, vuart_flush_reason reason)
+{
+    struct vuart_tx_segment seg = { .data = data, .len = len };
+    pmu_rx_callback(PMU_TTYS_LINE, &seg, 1, len, reason);
+}
+
+int pmu_shim_replay_end(void)
+{
+    work_buffer_head = work_buffer_tail = 0;
+
+    int out = vuart_set_tx_zc_callback(PMU_TTYS_LINE, pmu_rx_callback, VUART_THRESHOLD_MAX);
+    if (unlikely(out != 0))
+        pr_loc_err("Failed to re-register RX callback after replay - error=%d", out);
+
+    return out;
+}
+#endif //RPDBG_PMU_TRACE
+
+bool pmu_shim_is_needed(const struct hw_config *hw)
+{
+    return !hw_cfg(hw, no_pmu);
 }
 
 int register_pmu_shim(const struct hw_config *hw)
@@ -344,16 +725,31 @@ int register_pmu_shim(const struct hw_config *hw)
     shim_reg_in();
 
     int out;
-    if ((out = vuart_add_device(PMU_TTYS_LINE) != 0)) {
+    pmu_hw = hw;
+    rp_metrics_register(pmu_metrics, ARRAY_SIZE(pmu_metrics));
+    if ((out = vuart_set_chip_model(PMU_TTYS_LINE, PMU_VUART_CHIP)) != 0) {
+        pr_loc_err("Failed to set vUART chip model for PMU at ttyS%d", PMU_TTYS_LINE);
+        return out;
+    }
+
+    if ((out = vuart_add_device(PMU_TTYS_LINE)) != 0) {
         pr_loc_err("Failed to initialize vUART for PMU at ttyS%d", PMU_TTYS_LINE);
         return out;
     }
 
-    if ((out = alloc_buffers()) != 0)
+    if ((out = alloc_buffers()) != 0 || (out = build_cmd_trie()) != 0)
+        goto error_out;
+
+    INIT_KFIFO(cmd_queue);
+    cmd_wq = alloc_ordered_workqueue(PMU_CMD_WQ_NAME, 0);
+    if (unlikely(!cmd_wq)) {
+        pr_loc_err("Failed to create PMU command workqueue");
+        out = -ENOMEM;
         goto error_out;
+    }
 
     //We don't set the threshold as some commands are variable length but the "packets" are properly split
-    if ((out = vuart_set_tx_callback(PMU_TTYS_LINE, pmu_rx_callback, uart_buffer, VUART_THRESHOLD_MAX))) {
+    if ((out = vuart_set_tx_zc_callback(PMU_TTYS_LINE, pmu_rx_callback, VUART_THRESHOLD_MAX))) {
         pr_loc_err("Failed to register RX callback");
         goto error_out;
     }
@@ -362,8 +758,12 @@ int register_pmu_shim(const struct hw_config *hw)
     return 0;
 
     error_out:
-    free_buffers();
     vuart_remove_device(PMU_TTYS_LINE); //this also removes callback (if set)
+    if (cmd_wq) {
+        destroy_workqueue(cmd_wq);
+        cmd_wq = NULL;
+    }
+    free_buffers();
     return out;
 }
 
@@ -372,15 +772,21 @@ int unregister_pmu_shim(void)
     shim_ureg_in();
 
     int out = 0;
-    if (unlikely(!uart_buffer)) {
+    if (unlikely(!work_buffer)) {
         pr_loc_bug("Attempted to %s while it's not registered", __FUNCTION__);
         return 0; //Technically it succeeded
     }
 
+    //Commands still queued may need to send responses, so the vUART must stay until they're done
+    vuart_set_tx_zc_callback(PMU_TTYS_LINE, NULL, 0);
+    destroy_workqueue(cmd_wq); //this will execute all commands which are still queued
+    cmd_wq = NULL;
+
     if ((out = vuart_remove_device(PMU_TTYS_LINE)) != 0)
         pr_loc_err("Failed to remove vUART for line=%d", PMU_TTYS_LINE);
 
     free_buffers();
+    pmu_hw = NULL;
 
     shim_ureg_ok();
     return out;
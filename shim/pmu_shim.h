@@ -1,8 +1,39 @@
 #ifndef REDPILL_PMU_SHIM_H
 #define REDPILL_PMU_SHIM_H
 
+#include <linux/types.h> //bool
+
 typedef struct hw_config hw_config_;
+/**
+ * Checks if the platform expects a PMU (so that there will be any traffic to emulate)
+ */
+bool pmu_shim_is_needed(const struct hw_config *hw);
 int register_pmu_shim(const struct hw_config *hw);
 int unregister_pmu_shim(void);
 
+#ifdef RPDBG_PMU_TRACE
+#include "../internal/uart/virtual_uart.h" //vuart_flush_reason
+
+/**
+ * Detaches the shim from its vUART & resets its parser so that a trace can be replayed (see debug/debug_pmu_trace.c)
+ *
+ * @return 0 on success, -ENODEV if the shim isn't registered or other -E on error
+ */
+int pmu_shim_replay_begin(void);
+
+/**
+ * Processes data like it was delivered by the vUART; it can only be called between begin & end of a replay
+ *
+ * @param len Number of bytes (up to VUART_FIFO_LEN_MAX)
+ */
+void pmu_shim_replay_feed(const char *data, unsigned int len, vuart_flush_reason reason);
+
+/**
+ * Attaches the shim back to its vUART after pmu_shim_replay_begin()
+ *
+ * @return 0 on success or -E on error
+ */
+int pmu_shim_replay_end(void);
+#endif //RPDBG_PMU_TRACE
+
 #endif //REDPILL_PMU_SHIM_H
@@ -0,0 +1,223 @@
+/**
+ * Picks I/O scheduler (elevator) and queue parameters per disk, depending on what kind of disk it is
+ *
+ * WHY THIS SHIM?
+ * The ioscheduler_fixer resets the "elevator=" to the kernel default, which on 3.10/4.4 kernels is almost always CFQ.
+ * While CFQ is a decent choice for spinning disks, it's a poor one for SSDs and even worse for virtual disks: the
+ * hypervisor (or the SSD controller) does its own reordering, so idling & seek-based heuristics of CFQ only add latency
+ * and burn CPU. The same applies to nr_requests and read-ahead which should differ between these classes.
+ * Virtual disks additionally report themselves as rotational (so the block layer applies seek heuristics to them),
+ * feed the entropy pool with completion timings which are deterministic-ish on a hypervisor anyway, and complete
+ * requests on whichever CPU got the interrupt. For them the queue is marked non-rotational, add_random is disabled,
+ * and completions are steered back to the submitting CPU group (rq_affinity=1) to keep the cache hot.
+ *
+ * HOW DOES IT WORK?
+ * It subscribes to SCSI notifier and every disk which was successfully probed (as well as disks which were already
+ * present when the shim was registered) is classified as virtual, SSD (non-rotational), or HDD. Then its queue is
+ * tuned using the policy for that class (see io_policies). All values are set via the queue's own sysfs handlers (see
+ * scsi_set_queue_attr()) exactly like the userspace would do it.
+ * The tuning cannot be done from the notifier directly: the sd driver finishes probing (incl. reading whether a disk
+ * is rotational and registering its queue in sysfs) asynchronously. Because of that every disk is queued to be tuned
+ * from a workqueue, after all asynchronous sd probes finished. Nothing is restored when the shim is unregistered, as
+ * the values set are just sane defaults which userspace can freely change.
+ *
+ * References
+ *   - block/blk-sysfs.c & block/elevator.c in Linux sources
+ */
+#include "io_scheduler_shim.h"
+#include "../shim_base.h"
+#include "../../common.h"
+#include "../../internal/scsi/scsi_toolbox.h" //is_virtual_scsi_disk(), scsi_set_queue_attr(), for_each_scsi_disk()
+#include "../../internal/scsi/scsi_notifier.h"
+#include <linux/async.h> //async_synchronize_full_domain()
+#include <linux/blkdev.h> //blk_queue_nonrot()
+#include <linux/workqueue.h> //alloc_ordered_workqueue(), queue_work()
+#include <scsi/scsi_device.h> //struct scsi_device, scsi_device_get(), scsi_device_put()
+
+#define SHIM_NAME "I/O scheduler tuner"
+#define IO_TUNING_WQ_NAME "rp_io_tuning"
+
+extern struct async_domain scsi_sd_probe_domain; //exported but declared only in drivers/scsi/scsi_priv.h
+
+enum io_disk_class {
+    IO_DISK_HDD,
+    IO_DISK_SSD,
+    IO_DISK_VIRTUAL,
+};
+
+struct io_policy {
+    const char *name;
+    const char *elevator;
+    const char *nr_requests;
+    const char *read_ahead_kb;
+    const char *rotational; //NULL leaves what the driver detected
+    const char *add_random; //NULL leaves the kernel default
+    const char *rq_affinity; //NULL leaves the kernel default
+};
+
+//Values are strings as they're written just like from the userspace; not set (NULL) values aren't changed
+static const struct io_policy io_policies[] = {
+    [IO_DISK_HDD] = { .name = "HDD", .elevator = "cfq", .nr_requests = "128", .read_ahead_kb = "512" },
+    [IO_DISK_SSD] = { .name = "SSD", .elevator = "deadline", .nr_requests = "256", .read_ahead_kb = "128" },
+    [IO_DISK_VIRTUAL] = { .name = "virtual", .elevator = "noop", .nr_requests = "256", .read_ahead_kb = "128",
+                          .rotational = "0", .add_random = "0", .rq_affinity = "1" },
+};
+
+struct io_tuning_work {
+    struct work_struct work;
+    struct scsi_device *sdp; //referenced with scsi_device_get()
+};
+
+static struct workqueue_struct *io_tuning_wq = NULL;
+
+static enum io_disk_class classify_disk(struct scsi_device *sdp)
+{
+    if (is_virtual_scsi_disk(sdp))
+        return IO_DISK_VIRTUAL;
+
+    return blk_queue_nonrot(sdp->request_queue) ? IO_DISK_SSD : IO_DISK_HDD;
+}
+
+static void set_disk_queue_attr(struct scsi_device *sdp, const char *attr, const char *value)
+{
+    if (!value)
+        return;
+
+    int out = scsi_set_queue_attr(sdp, attr, value);
+    if (unlikely(out != 0))
+        pr_loc_wrn("Failed to set %s=%s for disk vendor=\"%s\" model=\"%s\" - error=%d", attr, value, sdp->vendor,
+                   sdp->model, out);
+}
+
+static void apply_io_policy(struct scsi_device *sdp)
+{
+    const struct io_policy *policy = &io_policies[classify_disk(sdp)];
+
+    pr_loc_dbg("Tuning %s disk vendor=\"%s\" model=\"%s\" to elevator=%s nr_requests=%s read_ahead_kb=%s",
+               policy->name, sdp->vendor, sdp->model, policy->elevator, policy->nr_requests, policy->read_ahead_kb);
+
+    //elevator goes first as e.g. CFQ in older kernels caps the nr_requests set before switching to it
+    set_disk_queue_attr(sdp, "scheduler", policy->elevator);
+    set_disk_queue_attr(sdp, "nr_requests", policy->nr_requests);
+    set_disk_queue_attr(sdp, "read_ahead_kb", policy->read_ahead_kb);
+    set_disk_queue_attr(sdp, "rotational", policy->rotational);
+    set_disk_queue_attr(sdp, "add_random", policy->add_random);
+    set_disk_queue_attr(sdp, "rq_affinity", policy->rq_affinity);
+}
+
+static void io_tuning_work_fn(struct work_struct *work)
+{
+    struct io_tuning_work *tw = container_of(work, struct io_tuning_work, work);
+
+    async_synchronize_full_domain(&scsi_sd_probe_domain); //see file header
+    apply_io_policy(tw->sdp);
+
+    scsi_device_put(tw->sdp);
+    kfree(tw);
+}
+
+/**
+ * Queues a disk to be tuned (see file header for why it's not done synchronously)
+ *
+ * @return 0 on success, -E on error
+ */
+static int queue_disk_tuning(struct scsi_device *sdp)
+{
+    if (unlikely(scsi_device_get(sdp) != 0)) {
+        pr_loc_wrn("Failed to get disk vendor=\"%s\" model=\"%s\" - it will not be tuned", sdp->vendor, sdp->model);
+        return 0; //the device is going away - it's not an error
+    }
+
+    //we can sleep here, we're called with SRCU or from the caller's context
+    struct io_tuning_work *tw = kmalloc(sizeof(*tw), GFP_KERNEL);
+    if (unlikely(!tw)) {
+        scsi_device_put(sdp);
+        kalloc_error_int(tw, sizeof(*tw));
+    }
+
+    INIT_WORK(&tw->work, io_tuning_work_fn);
+    tw->sdp = sdp;
+    queue_work(io_tuning_wq, &tw->work);
+
+    return 0;
+}
+
+static int scsi_disk_probed_handler(struct notifier_block *self, unsigned long state, void *data)
+{
+    struct scsi_device *sdp = data;
+    if (!is_scsi_disk(sdp))
+        return NOTIFY_DONE;
+
+    queue_disk_tuning(sdp);
+    return NOTIFY_OK;
+}
+
+/**
+ * Called for every disk existing when the shim is registered
+ *
+ * @return 0 on success, -E on error
+ */
+static int on_existing_scsi_disk_device(struct scsi_device *sdp)
+{
+    queue_disk_tuning(sdp);
+    return 0; //even if this disk failed others can still be tuned
+}
+
+static struct scsi_disk_subscriber scsi_disk_sub = {
+    .nb = {
+        .notifier_call = scsi_disk_probed_handler,
+        .priority = INT_MAX, //we don't change anything others may want to see - we can go last
+    },
+    .event_mask = SCSI_EVT_MASK(SCSI_EVT_DEV_PROBED_OK),
+};
+
+int register_io_scheduler_shim(void)
+{
+    shim_reg_in();
+
+    if (unlikely(io_tuning_wq))
+        shim_reg_already();
+
+    io_tuning_wq = alloc_ordered_workqueue(IO_TUNING_WQ_NAME, 0);
+    if (unlikely(!io_tuning_wq)) {
+        pr_loc_err("Failed to allocate %s workqueue", IO_TUNING_WQ_NAME);
+        return -ENOMEM;
+    }
+
+    int out = subscribe_scsi_disk_events(&scsi_disk_sub);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to register for SCSI disks notifications - error=%d", out);
+        goto error_destroy_wq;
+    }
+
+    out = for_each_scsi_disk(on_existing_scsi_disk_device);
+    if (unlikely(out != 0 && out != -ENXIO)) { //-ENXIO means the driver isn't loaded yet - nothing to tune now
+        pr_loc_err("Failed to enumerate current SCSI disks - error=%d", out);
+        goto error_unsubscribe;
+    }
+
+    shim_reg_ok();
+    return 0;
+
+    error_unsubscribe:
+    unsubscribe_scsi_disk_events(&scsi_disk_sub);
+    error_destroy_wq:
+    destroy_workqueue(io_tuning_wq); //drains all works queued already
+    io_tuning_wq = NULL;
+    return out;
+}
+
+int unregister_io_scheduler_shim(void)
+{
+    shim_ureg_in();
+
+    if (unlikely(!io_tuning_wq))
+        shim_ureg_nreg();
+
+    unsubscribe_scsi_disk_events(&scsi_disk_sub);
+    destroy_workqueue(io_tuning_wq); //drains all works queued already
+    io_tuning_wq = NULL;
+
+    shim_ureg_ok();
+    return 0;
+}
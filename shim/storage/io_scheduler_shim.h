@@ -0,0 +1,7 @@
+#ifndef REDPILL_IO_SCHEDULER_SHIM_H
+#define REDPILL_IO_SCHEDULER_SHIM_H
+
+int register_io_scheduler_shim(void);
+int unregister_io_scheduler_shim(void);
+
+#endif //REDPILL_IO_SCHEDULER_SHIM_H
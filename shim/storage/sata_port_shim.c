@@ -31,7 +31,7 @@
 #include "sata_port_shim.h"
 #include "../shim_base.h"
 #include "../../common.h"
-#include "../../internal/scsi/scsi_toolbox.h" //scsi_force_replug()
+#include "../../internal/scsi/scsi_toolbox.h" //scsi_replug_batch_*()
 #include "../../internal/scsi/scsi_notifier.h"
 #include <scsi/scsi_device.h> //struct scsi_device
 #include <scsi/scsi_host.h> //struct Scsi_Host, SYNO_PORT_TYPE_*
@@ -46,7 +46,7 @@
  */
 static bool is_fixable(struct scsi_device *sdp)
 {
-    return current_config.hw_config->is_dt == false &&                 // Device-tree models causes a kernel panic if type is changed
+    return hw_cfg(current_config.hw_config, is_dt) == false &&                 // Device-tree models causes a kernel panic if type is changed
         (sdp->host->hostt->syno_port_type == SYNO_PORT_TYPE_SAS ||
            (sdp->host->hostt->syno_port_type != SYNO_PORT_TYPE_SATA &&
             strcmp(sdp->host->hostt->name, VIRTIO_HOST_ID) == 0));
@@ -73,11 +73,13 @@ static int on_new_scsi_disk_device(struct scsi_device *sdp)
     return 0;
 }
 
+static struct scsi_replug_batch replug_batch; //existing disks to be replugged at once
+
 /**
  * Called for every existing SCSI-based disk to determine if there are any fixable devices which are already connected
  *
  * Every device which is fixable but still connected it will be forcefully re-connected, as this is the only way to fix
- * existing device properly.
+ * existing device properly. All of them are unplugged first and replugged together (see register_sata_port_shim()).
  *
  * @return 0 on success, -E on error
  */
@@ -91,8 +93,10 @@ static int on_existing_scsi_disk_device(struct scsi_device *sdp)
             " It must be auto-replugged to fix it.", sdp->vendor, sdp->model, sdp->host->hostt->name,
             sdp->host->hostt->syno_port_type);
 
-    //After that it will land in on_new_scsi_disk_device()
-    scsi_force_replug(sdp);
+    //After the batch runs it will land in on_new_scsi_disk_device()
+    int out = scsi_replug_batch_add(&replug_batch, sdp);
+    if (unlikely(out != 0))
+        pr_loc_err("Failed to unplug disk vendor=\"%s\" model=\"%s\" - error=%d", sdp->vendor, sdp->model, out);
 
     return 0;
 }
@@ -109,9 +113,12 @@ static int scsi_disk_probe_handler(struct notifier_block *self, unsigned long st
     return NOTIFY_OK;
 }
 
-static struct notifier_block scsi_disk_nb = {
-    .notifier_call = scsi_disk_probe_handler,
-    .priority = INT_MIN, //we want to be FIRST so that we other things can get the correct drive type
+static struct scsi_disk_subscriber scsi_disk_sub = {
+    .nb = {
+        .notifier_call = scsi_disk_probe_handler,
+        .priority = INT_MIN, //we want to be FIRST so that we other things can get the correct drive type
+    },
+    .event_mask = SCSI_EVT_MASK(SCSI_EVT_DEV_PROBING),
 };
 
 int register_sata_port_shim(void)
@@ -121,18 +128,25 @@ int register_sata_port_shim(void)
     int out;
 
     pr_loc_dbg("Registering for new devices notifications");
-    out = subscribe_scsi_disk_events(&scsi_disk_nb);
+    out = subscribe_scsi_disk_events(&scsi_disk_sub);
     if (unlikely(out != 0)) {
         pr_loc_err("Failed to register for SCSI disks notifications - error=%d", out);
         return out;
     }
 
     pr_loc_dbg("Iterating over existing devices");
+    scsi_replug_batch_init(&replug_batch);
     out = for_each_scsi_disk(on_existing_scsi_disk_device);
+    int replug_out = scsi_replug_batch_run(&replug_batch); //even on error - some disks may be already unplugged
     if (unlikely(out != 0 && out != -ENXIO)) {
         pr_loc_err("Failed to enumerate current SCSI disks - error=%d", out);
         return out;
     }
+
+    if (unlikely(replug_out != 0)) {
+        pr_loc_err("Failed to replug some of the existing SCSI disks - error=%d", replug_out);
+        return replug_out;
+    }
     
     shim_reg_ok();
     return 0;
@@ -142,7 +156,7 @@ int unregister_sata_port_shim(void)
 {
     shim_ureg_in();
 
-    unsubscribe_scsi_disk_events(&scsi_disk_nb);
+    unsubscribe_scsi_disk_events(&scsi_disk_sub);
 
     shim_ureg_ok();
     return 0; //noop
@@ -33,6 +33,7 @@
  *       - ATA_SMART_ENABLE (ask drive to enable SMART, it shouldn't really be delivered but we respond with "OK")
  *       - WIN_FT_SMART_READ_LOG_SECTOR (use WIN_SMART interface to read stored logs, see populate_win_smart_log())
  *       - WIN_FT_SMART_IMMEDIATE_OFFLINE (use WIN_SMART iface to run SMART test, see populate_win_smart_exec_test())
+ *         # self-tests run "in the background" for a short while, see start_self_test()
  *
  *  - HDIO_DRIVE_TASK (ioctl, see handle_hdio_drive_task_ioctl() & Documentation/ioctl/hdio.txt)
  *    - WIN_CMD_SMART (use WIN_SMART to read data from SMART subsystem, see handle_ata_task_smart())
@@ -42,31 +43,36 @@
  *      - WIN_FT_SMART_AUTOSAVE
  *      - WIN_FT_SMART_AUTO_OFFLINE
  *
+ *  - SG_IO (ioctl, see handle_sg_io_ioctl())
+ *    - only SAT ATA PASS-THROUGH (12) & (16) CDBs carrying ATA_CMD_ID_ATA or ATA_CMD_SMART are looked at
+ *      # this is what modern smartctl & DSM tools use by default, so all the commands listed above are answered here as
+ *        well (with the same data) if the device rejected them
+ *
+ *  - NVME_IOCTL_ADMIN_CMD (ioctl to NVMe namespaces, see nvme_ioctl_smart_shim())
+ *    - only GET LOG PAGE of the SMART / Health Information log is looked at; it's emulated only if the device completes
+ *      it with an error status
+ *
  * Note: Most of the commands are using the standard ATA/ATAPI interface, few are using (legacy?) WIN_SMART interface.
  *       While WIN_SMART can theoretically be used to read values etc no tool from this century will do that (they will
  *       use the ATA/ATAPI interface). This shim emulates WIN_SMART only when needed.
  *
  *
  * LIMITATIONS
- *   - Values are always static and the same for all drives
- *   - Power-on hours & other counters (e.g. start-stop count) are static
- *     - Ideally values should be calculated as hours from some date to ensure they increase
- *     - Start-stop counter (and others) can be derived from power-on hours using linear regression
+ *   - Values are always static and the same for all drives, except for counters (see update_smart_counters())
+ *   - Power-on hours are calculated as hours from SMART_POH_EPOCH (so they increase, even between reboots) and the
+ *     start-stop & power cycle counters are derived from them; other counters are static
+ *   - Self-test logs are kept only in memory, unless "smart_state=<path>" is used; with it they're saved together with
+ *     power-on hours (which then never go backwards, even if the wall clock does) - see smart_state.c
  *
  *
  * SEQUENCE OF ACTIONS FOR IOCTL REPLACEMENT
- * This submodule has a rather unintuitive initialization sequence (it's multistage). It works in the following order:
+ * This submodule works in the following order:
  *   1. Checks if "sd" driver is loaded
- *      - if not loaded it verifies if it exists in the kernel and overrides sd_ioctl() [see 2.]
- *      - it SHOULD wait for the driver instead but due to current notifier limitations we can't do that
- *   2. Temporarily installs trampoline in sd_ioctl() [drivers/scsi/sd.c] to sd_ioctl_canary()
- *   3. Awaits any IOCTL from userspace
- *      - it simply waits until sd_ioctl_canary() is called
- *      - sd_ioctl_canary's only role is to install a fast and permanent shim of sd_ioctl() by replacing the ioctl
- *        routing in SCSI driver (see details in the comment for sd_ioctl_canary()) to point to sd_ioctl_smart_shim()
- *      - sd_ioctl() trampoline is removed
- *      - after installation it triggers sd_ioctl_smart_shim() to handle that IOCTL which canary captured
- *   4. sd_ioctl_smart_shim() is triggered for every ioctl to a /dev/sdX device coming from the userspace
+ *      - if loaded (or compiled-in) it locates sd_fops [drivers/scsi/sd.c] and replaces its ->ioctl with
+ *        sd_ioctl_smart_shim() using a single atomic store (see sd_ioctl_smart_shim_install())
+ *      - if not loaded it waits for the driver using a driver watcher and does the same once the driver is live
+ *      - the driver module is pinned as long as the shim is installed, as sd_fops go away with it
+ *   2. sd_ioctl_smart_shim() is triggered for every ioctl to a /dev/sdX device coming from the userspace
  *      - it filters commands which are SMART-related (or at least what smartmontools uses as nobody uses anything else)
  *      - all non-SMART commands are forwarded as-is
  *      - SMART commands are forwarded to the drive if the drive supports SMART, if not a sensible values are faked
@@ -78,19 +84,45 @@
  *  - https://github.com/qemu/qemu/blob/266469947161aa10b1d36843580d369d5aa38589/hw/ide/core.c#L1826 (qemu SMART)
  */
 #include "smart_shim.h"
+#include "smart_state.h" //smart_state_*(), register_smart_state(), unregister_smart_state()
 #include "../shim_base.h"
 #include "../../common.h"
 #include "../../internal/intercept_driver_register.h" //waiting for "sd" driver to load
-#include "../../internal/helper/memory_helper.h" //set_mem_addr_ro(), set_mem_addr_rw()
-#include "../../internal/helper/symbol_helper.h" //kernel_has_symbol()
+#include "../../internal/helper/memory_helper.h" //WITH_MEM_UNLOCKED
+#include "../../internal/helper/symbol_helper.h" //kernel_has_symbol(), kln_cached()
+#include "../../internal/helper/ata_helper.h" //ata_calc_sector_checksum(), ata_calc_integrity_word(), set_ata_string()
 #include "../../internal/scsi/hdparam.h" //a ton of ATA constants
-#include "../../internal/scsi/scsi_toolbox.h" //checking for "sd" driver load state
-#include "../../internal/override/override_symbol.h" //installing sd_ioctl_canary()
+#include "../../internal/scsi/scsi_toolbox.h" //on_scsi_driver_ready()
+#include "../../internal/scsi/scsi_notifier.h" //subscribe_scsi_disk_events(); invalidating fake IDENTIFY of removed disks
+#include "../../debug/debug_ovs_stats.h" //ovs_stats_*(); noop unless DBG_OVS_STATS
+#include "../../compat/static_key_compat.h" //RP_DEFINE_STATIC_KEY_FALSE, rp_static_branch_*
+#include "../../internal/metrics.h" //RP_METRIC(), rp_metric_*()
+#include "../../config/runtime_config.h" //current_config.smart_state
 #include <linux/fs.h> //struct block_device
 #include <linux/genhd.h> //struct gendisk
 #include <linux/blkdev.h> //struct block_device_operations
-#include <linux/spinlock.h> //spinlock_t, spin_*
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+#include <linux/list.h> //LIST_HEAD, list_*
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_*
+#include <linux/rcupdate.h> //rcu_read_lock(), kfree_rcu()
+#include <linux/slab.h> //kmem_cache_create(), kmem_cache_destroy()
+#include <linux/mempool.h> //mempool_*
+#include <linux/pci.h> //pci_bus_type
+#include <linux/module.h> //try_module_get(), __module_get(), module_put()
+#include <linux/device.h> //struct class_interface, class_interface_register(), class_interface_unregister()
+#include <scsi/scsi_device.h> //struct scsi_device
+#include <scsi/scsi.h> //SAM_STAT_*, sense keys
+#include <scsi/sg.h> //SG_IO, struct sg_io_hdr
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
 #include <linux/ata.h> //ATA_*
+#include <asm/unaligned.h> //put_unaligned_le*()
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+#include <linux/nvme_ioctl.h> //struct nvme_admin_cmd, NVME_IOCTL_ADMIN_CMD
+#else
+#include <linux/nvme.h> //struct nvme_admin_cmd, NVME_IOCTL_ADMIN_CMD
+#endif
+#include <linux/jiffies.h> //jiffies, HZ
+#include <linux/time.h> //get_seconds(), ktime_get_real_seconds()
 
 #define SHIM_NAME "SMART emulator"
 
@@ -105,11 +137,13 @@
 #define pr_loc_dbg_ioctl_unk(cmd_hex, subcmd_hex, bdev) //noop
 #endif
 
-//address of original and unmodified sd_ioctl(); populated by the canary and after the canary trampoline is removed
-static int (*sd_ioctl_org) (struct block_device *, fmode_t, unsigned, unsigned long) = NULL;
-struct block_device_operations *sd_fops = NULL; //ptr to drivers/scsi/sd.c:sd_fops [to restore sd_ioctl on removal]
-static struct override_symbol_inst* sd_ioctl_canary_ovs = NULL; //sd_ioctl() override for canary
-static spinlock_t sd_ioctl_canary_lock;
+//address of original and unmodified sd_ioctl(); populated when the shim is installed in sd_fops & never cleared, as
+// ioctls in flight may still call it (they read it once on entry - see handle_sd_ioctl())
+typedef int (sd_ioctl_fn) (struct block_device *, fmode_t, unsigned, unsigned long);
+static sd_ioctl_fn *sd_ioctl_org = NULL;
+static struct block_device_operations *sd_fops = NULL; //ptr to drivers/scsi/sd.c:sd_fops [to restore sd_ioctl]
+extern struct bus_type scsi_bus_type; //used by on_scsi_driver_ready()
+static driver_ready_request *sd_driver_req = NULL; //set when waiting for "sd" module to load
 
 /********************************************* Fake SMART data definition *********************************************/
 //see "Table 4: SMART Attribute Summary" in micron.com document for a nice summary
@@ -166,94 +200,119 @@ static const int fake_smart[][ATA_SMART_RECORD_LEN] = {
 #define WIN_SMART_COMP_LOG_VERSION 0x01 //WIN_SMART comprehensive log version; ALWAYS 1 as per ATAPI/6 sec. 8.55.6.8.3.1
 #define WIN_SMART_TEST_LOG_VERSION 0x01 //WIN_SMART self-test log version; ALWAYS 1 as per ATAPI/6 sec. 8.55.6.8.4.1
 
+#define ATA_ID_LBA28_MAX_SECTORS 0x0fffffff //max value of IDENTIFY words 60-61; larger disks use words 100-103
+
+//Dynamic counters (see update_smart_counters())
+#define SMART_RAW_OFFSET 5 //offset of RAW_DATA in fake_smart rows
+#define SMART_ATTR_START_STOP 4
+#define SMART_ATTR_POH 9
+#define SMART_ATTR_POWER_CYCLE 12
+#define SMART_POH_EPOCH 1577836800L //2020-01-01 00:00:00 UTC; power-on hours are counted from that date...
+#define SMART_POH_BASE 0x32ad //...plus the static value which used to be in fake_smart
+#define SMART_POH_PER_START_STOP 24 //a spin-up a day
+#define SMART_POH_PER_POWER_CYCLE 168 //a power cycle a week
+
+//Emulated self-tests (see start_self_test())
+#define SMART_TEST_SHORT_MINUTES 1 //how long a fake off-line short self-test runs (also reported as polling time)
+#define SMART_TEST_LONG_MINUTES 2 //same for the extended self-test
+#define SMART_VAL_TEST_STATUS 363 //"Self-test execution status" byte in SMART values; see Table 61 in ATA/ATAPI-6
+#define SMART_TEST_STATUS_OK 0x00 //completed without error (or no test was ever run)
+#define SMART_TEST_STATUS_ABORTED 0x10 //aborted by the host
+#define SMART_TEST_STATUS_RUNNING 0xf0 //in progress; low nibble is remaining time in 10% steps
+#define SMART_TEST_LOG_ADDR 0x06 //see "Table 62 − Log address definition"
+#define SMART_TEST_LOG_DESC_OFFSET 2 //see "Table 66 − Self-test log data structure"
+#define SMART_TEST_LOG_DESC_LEN 24
+#define SMART_TEST_LOG_DESC_NUM 21
+#define SMART_TEST_LOG_INDEX 508
+#define SMART_TEST_OFFLINE 0x00 //test types being values of LBA Low register; see Table 58 in ATA/ATAPI-6
+#define SMART_TEST_SHORT 0x01
+#define SMART_TEST_LONG 0x02
+#define SMART_TEST_ABORT 0x7f
+#define SMART_TEST_SHORT_CAPTIVE 0x81
+#define SMART_TEST_LONG_CAPTIVE 0x82
+
 
 /********************************************* ATA/IOCTL helper functions *********************************************/
 /**
- * Calculates a standard per-sector ATA checksum
- * 
- * ATA/ATAPI-6 standard contains the same checksum references in many places. It's always saved in the last byte of a
- * sector (index 511). It is described e.g. in "Table 5: SMART Attribute Entry Format". It's defined as "Two's 
- * complement checksum of preceding 511B[ytes]". Wikipedia has a great article about that as well.
- * 
- * @param buff A single-sector sized buffer to compute & save checksum to
+ * Pool of kernel-space copies of ioctl() buffers
+ *
+ * Every IDENTIFY (which is issued by smartctl & syno tools over and over) needs a kernel copy of the user buffer. All
+ * of them are a single sector (+ header) so they're taken from a dedicated cache. A few buffers are reserved upfront,
+ * so that under memory pressure the SMART path waits for a buffer to be returned instead of failing with -ENOMEM.
  */
-static void ata_calc_sector_checksum(u8 *buff)
-{
-    for (int i = 0; i < (ATA_SECT_SIZE-1); i++) {
-        buff[(ATA_SECT_SIZE-1)] += buff[i];
-    }
-    
-    buff[(ATA_SECT_SIZE-1)] = 256 - buff[(ATA_SECT_SIZE-1)];
-}
+#define IOCTL_BUF_CACHE_NAME "rp_smart_iobuf"
+#define IOCTL_BUF_SIZE ata_ioctl_buf_size(1)
+#define IOCTL_BUF_POOL_RESERVED 4 //there's rarely more than one SMART tool running at a time
+static struct kmem_cache *ioctl_buf_cache = NULL;
+static mempool_t *ioctl_buf_pool = NULL;
 
 /**
- * Calculates a standard per-worded structure ATA checksum
- *
- * In principal it's almost the same thing as ata_calc_sector_checksum() but with some constant added to be 16 bits.
- * See "8.16.64 Word 255: Integrity word". Checksum is always saved in word 255.
- *
- * @param word_buff A 255-word (each 16 bits) sized buffer to compute & save checksum to
+ * @return 0 on success, -E on error
  */
-static void ata_calc_integrity_word(u16 *word_buff)
+static int create_ioctl_buf_pool(void)
 {
-    u8 *byte_buff = (u8 *)word_buff;
+    ioctl_buf_cache = kmem_cache_create(IOCTL_BUF_CACHE_NAME, IOCTL_BUF_SIZE, 0, 0, NULL);
+    if (unlikely(!ioctl_buf_cache)) {
+        pr_loc_err("Failed to create %s cache", IOCTL_BUF_CACHE_NAME);
+        return -ENOMEM;
+    }
 
-    for (int i = 0; i < (ATA_SECT_SIZE-2); i++) {
-        byte_buff[(ATA_SECT_SIZE-2)] += byte_buff[i];
+    ioctl_buf_pool = mempool_create_slab_pool(IOCTL_BUF_POOL_RESERVED, ioctl_buf_cache);
+    if (unlikely(!ioctl_buf_pool)) {
+        pr_loc_err("Failed to create pool of %d ioctl buffers", IOCTL_BUF_POOL_RESERVED);
+        kmem_cache_destroy(ioctl_buf_cache);
+        ioctl_buf_cache = NULL;
+        return -ENOMEM;
     }
+    rp_mem_add(RP_MEM_SMART, IOCTL_BUF_POOL_RESERVED * kmem_cache_size(ioctl_buf_cache)); //only reserved ones
 
-    byte_buff[(ATA_SECT_SIZE-2)] = 256 - byte_buff[(ATA_SECT_SIZE-2)];
-    byte_buff[(ATA_SECT_SIZE-1)] = 0xa5;
+    return 0;
 }
 
-/**
- * ATA/ATAPI uses "strings" which are LE arranged 8 bit characters into 16 bit words padded with spaces to full length
- *
- * Example of 10 character ATA field:
- *  =normal=> "TEST12"
- *  =ATA====> "ETTS21    "
- *
- * @param dst buffer to copy the string to
- * @param src standard NULL-byte terminated text
- * @param length ATA field length; must be even
- */
-static void set_ata_string(u8 *dst, const char *src, u8 length)
+static void destroy_ioctl_buf_pool(void)
 {
-    if (unlikely(length % 2 != 0)) {
-        pr_loc_bug("Length must be even but got %d", length);
-        --length;
+    if (ioctl_buf_pool) {
+        mempool_destroy(ioctl_buf_pool);
+        ioctl_buf_pool = NULL;
+        rp_mem_add(RP_MEM_SMART, -(s64)(IOCTL_BUF_POOL_RESERVED * kmem_cache_size(ioctl_buf_cache)));
     }
 
-    memset(dst, 0x20, length); //fields in ATA/ATAPI are space-padded and not terminated by \0
-    for (u8 i = 0; i < length; i += 2)
-    {
-        if (src[i] == '\0')
-            break;
-
-        dst[i + 1] = src[i];
-        dst[i] = src[i + 1];
+    if (ioctl_buf_cache) {
+        kmem_cache_destroy(ioctl_buf_cache);
+        ioctl_buf_cache = NULL;
     }
 }
 
+/**
+ * Gets an uninitialized IOCTL_BUF_SIZE buffer; it never fails as it can sleep waiting for a reserved one
+ */
+static __always_inline unsigned char *get_ioctl_buffer(void)
+{
+    return mempool_alloc(ioctl_buf_pool, GFP_KERNEL);
+}
+
 /**
  * Duplicates a user-supplied ioctl() buffer into kernel space to safely read data from it
  *
  * This pointer returned here is... peculiar. First 4 bytes are a header (as defined by UAPI "struct hd_drive_cmd_hdr"
  * in hdreg.h). Remaining 512 bytes are 16 bits words.
  *
- * @param sectors How many sectors to copy
+ * @param sectors How many sectors to copy (it must fit IOCTL_BUF_SIZE)
  * @param src User buffer to copy from
  *
  * @return Pointer to a new kernel-space buffer or ERR_PTR; you need to free/put-it-back using put_ioctl_buffer
  */
 static unsigned char* get_ioctl_buffer_kcopy(u8 sectors, const __user void *src)
 {
-    unsigned char *kbuf;
+    if (unlikely(ata_ioctl_buf_size(sectors) > IOCTL_BUF_SIZE)) {
+        pr_loc_bug("Requested ioctl buffer of %d sector(s) exceeds pool buffer of %d bytes", sectors, IOCTL_BUF_SIZE);
+        return ERR_PTR(-EINVAL);
+    }
 
-    kmalloc_or_exit_ptr(kbuf, ata_ioctl_buf_size(sectors));
+    unsigned char *kbuf = get_ioctl_buffer();
     if(unlikely(copy_from_user(kbuf, src, ata_ioctl_buf_size(sectors)) != 0)) {
         pr_loc_err("Failed to copy ATA user buffer from ptr=%p to kspace=%p", src, kbuf);
-        kfree(kbuf);
+        mempool_free(kbuf, ioctl_buf_pool);
         return ERR_PTR(-EFAULT);
     }
 
@@ -261,145 +320,28 @@ static unsigned char* get_ioctl_buffer_kcopy(u8 sectors, const __user void *src)
 }
 
 /**
- * Releases buffer obtained from get_ioctl_buffer_*()
+ * Releases buffer obtained from get_ioctl_buffer*()
  */
 static __always_inline void put_ioctl_buffer(unsigned char *buffer)
 {
-    kfree(buffer);
-}
-
-/*************************************** ATAPI/WIN command interface handling *****************************************/
-static int populate_ata_id(const u8 *req_header, void __user *buff_ptr, const char* const disk_name)
-{
-    pr_loc_dbg("Generating completely fake ATA IDENTITY");
-
-    unsigned char *kbuf;
-    char disk_serial[DISK_NAME_LEN];
-    kzalloc_or_exit_int(kbuf, HDIO_DRIVE_CMD_HDR_OFFSET + sizeof(struct rp_hd_driveid));
-    struct rp_hd_driveid *did = (void *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET); //did=drive ID
-
-    //First write response header
-    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_CMD_ID_ATA_SECTORS;
-
-    did->config = 0x0000; //15th bit = ATA device, rest is reserved/obsolete
-    strscpy(disk_serial, disk_name, DISK_NAME_LEN > 20 ? 20 : DISK_NAME_LEN);
-    set_ata_string(did->serial_no, disk_serial, 20);
-    set_ata_string(did->fw_rev, "1.13.2", 8);
-    set_ata_string(did->model, "Virtual HDD", 40);
-    did->reserved50 = (1 << 14); //"shall be set to one"
-    did->major_rev_num = 0xffff;
-    did->minor_rev_num = 0xffff;
-    did->command_set_1 = (1 << 3 | 1 << 0); //PM, SMART supported
-    did->command_set_2 = (1 << 14); //"shall be set to one"
-    did->cfsse = (1 << 14 | 1 << 1 | 1 << 0); //14: "shall be set to one" ; smart self-test supported ; smart error-log
-    did->cfs_enable_1 = (1 << 3 | 1 << 0); //PM, SMART
-    did->cfs_enable_2 = (1 << 14); //"shall be set to one"
-    did->csf_default = (1 << 14 | 1 << 1 | 1 << 0); //"shall be one" ; SMART self-test, SMART error-test
-    did->hw_config = (1 << 14 | 1 << 0); //both "shall be one"
-    did->lba_capacity = 0xffffffff; //maybe we can get away with not reading capacity?
-
-    ata_calc_integrity_word((void *)did);
-
-    if (unlikely(copy_to_user(buff_ptr, kbuf, HDIO_DRIVE_CMD_HDR_OFFSET + sizeof(struct rp_hd_driveid)) != 0)) {
-        pr_loc_err("Failed to copy fake ATA IDENTIFY packet to user ptr=%p", (void *)buff_ptr);
-        kfree(kbuf);
-        return -EFAULT;
-    }
-
-    kfree(kbuf);
-    return 0;
+    mempool_free(buffer, ioctl_buf_pool);
 }
 
-/**
- * Handles on-the-fly modification of data related to ATA IDENTIFY DEVICE command
- *
- * See "8.16 IDENTIFY DEVICE" section in the ATA/ATAPI-6 manual.
- *
- * @param org_ioctl_exec_result exit code of the original ioctl() call which reached the drive (done by
- *                              handle_hdio_drive_cmd_ioctl()). This command shouldn't normally fail for any drive.
- * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
- * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be read and possibly altered
- *
- * @return definitive exit code for the ioctl(); in practice 0 when succedded [regardless of the modifications made] or
- *         the same error code as org_ioctl_exec_result passed
- */
-static int handle_ata_cmd_identify(int org_ioctl_exec_result, const u8 *req_header, void __user *buff_ptr, const char* const disk_name)
-{
-    //ATA IDENTIFY should not fail - it may mean a problem with a disk or the "disk" is a adapter (e.g. IDE>SATA) with
-    // no disk connected, or if executed against a USB flash drive... or it's an VirtIO SCSI disk read as ATA
-    if (unlikely(org_ioctl_exec_result != 0)) {
-        pr_loc_dbg("sd_ioctl(HDIO_DRIVE_CMD ; ATA_CMD_ID_ATA) failed with error=%d, attempting to emulate something",
-                   org_ioctl_exec_result);
-        return populate_ata_id(req_header, buff_ptr, disk_name);
-    }
-
-    //sanity check if requested ATA IDENTIFY sector count is really what we're planning to copy
-    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_CMD_ID_ATA_SECTORS) {
-        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA IDENTIFY DEVICE, got %d",
-                   ATA_CMD_ID_ATA_SECTORS, ata_ioctl_buf_size(ATA_CMD_ID_ATA_SECTORS),
-                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
-        return -EIO;
-    }
-
-    //if the identity succeeded we need to check if SMART is supported & enabled. For that we need to clone
-    // normally user buffer from ioctl (reading it directly is risky)
-    unsigned char *kbuf = get_ioctl_buffer_kcopy(ATA_CMD_ID_ATA_SECTORS, buff_ptr);
-    if (unlikely(IS_ERR(kbuf)))
-        return PTR_ERR(kbuf); //it will already log error in kcopy
-
-    u16 *ata_identity = (u16 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
-    if (ata_is_smart_supported(ata_identity) && ata_is_smart_enabled(ata_identity)) {
-        pr_loc_dbg("ATA_CMD_ID_ATA confirmed SMART support - noop");
-        put_ioctl_buffer(kbuf); //we no longer need the buffer as we're not touching it, we've only read it
-        return 0; //SMART supported, pass identity as-is
-    }
-
-    //if SMART is not supported we modify the response, retaining the original response header but changing
-    // SMART flags & recalculating checksum
-    pr_loc_dbg("ATA_CMD_ID_ATA confirmed *no* SMART support - pretending it's there");
-    ata_set_smart_supported(ata_identity);
-    ata_set_smart_enabled(ata_identity);
-    ata_calc_integrity_word(ata_identity);
-
-    if (unlikely(copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_CMD_ID_ATA_SECTORS)) != 0)) {
-        pr_loc_err("Failed to copy ATA IDENTIFY packet to user ptr=%p", (void *)buff_ptr);
-        put_ioctl_buffer(kbuf);
-        return -EFAULT;
-    }
-
-    put_ioctl_buffer(kbuf);
-    return 0;
-}
+/********************************************* Prebuilt fake SMART responses *****************************************/
+//Fake SMART data is the same for every disk & every request, so responses (incl. checksums) are built only once when
+// the shim registers and then just copied to the user
+static unsigned char smart_values_tpl[ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS)];
+static unsigned char smart_thresholds_tpl[ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS)];
+static const u8 smart_log_addrs[] = { 0x00, 0x01, 0x02, SMART_TEST_LOG_ADDR }; //directory, summary, comprehensive, test
+static unsigned char smart_logs_tpl[ARRAY_SIZE(smart_log_addrs)][ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS)];
 
 /**
- * Populates user ioctl() buffer with fake SMART snapshot values
- *
- * This function is responsible for the generation of data which you see in a usual tabular format as a result of
- * "smartctl -A" command. The data is formated from the "fake_smart" constant array present on the top of this file.
- *
- * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
- * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
- *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * Builds fake SMART snapshot values response (see populate_ata_smart_values())
  */
-static int populate_ata_smart_values(const u8 *req_header, void __user *buff_ptr)
+static void build_ata_smart_values(void)
 {
-    pr_loc_dbg("Generating fake SMART values");
-
-    //sanity check if requested SMART READ VALUES sector count is really what we're planning to copy
-    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_SMART_READ_VALUES_SECTORS) {
-        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA SMART READ VALUES, got %d",
-                   ATA_SMART_READ_VALUES_SECTORS, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS),
-                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
-        return -EIO;
-    }
-
     int i, j;
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS));
+    unsigned char *kbuf = smart_values_tpl;
     u8 *smart_values = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
 
     //First write response header
@@ -428,45 +370,19 @@ static int populate_ata_smart_values(const u8 *req_header, void __user *buff_ptr
     smart_values[368] = (1 << 0 | 1 << 1); //bitfield, see sec. 8.55.5.8.5 in ATA/ATAPI-6 PDF
     smart_values[369] = 0x01; //vendor-specific, rel. to sec. 8.55.5.8.5 in ATA/ATAPI-6 PDF
     smart_values[370] = 0x01; //bitfield, current only 1st bit used for error logging (Table 59)
-    smart_values[372] = 0x05; //short self-test polling time (minutes), see Table 59
-    smart_values[373] = 0x4B; //long self-test polling time (minutes), see Table 59
+    smart_values[372] = SMART_TEST_SHORT_MINUTES; //short self-test polling time (minutes), see Table 59
+    smart_values[373] = SMART_TEST_LONG_MINUTES; //long self-test polling time (minutes), see Table 59
 
     ata_calc_sector_checksum(smart_values);
-
-    if (copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS)) != 0) {
-        pr_loc_err("Failed to copy SMART VALUES packet to user ptr=%p", buff_ptr);
-        kfree(kbuf);
-        return -EFAULT;
-    }
-
-    kfree(kbuf);
-    return 0;
 }
 
 /**
- * Populates user ioctl() buffer with a subset of fake SMART snapshot values, containing only thresholds
- *
- * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
- * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
- *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * Builds fake SMART thresholds response (see populate_ata_smart_thresholds())
  */
-static int populate_ata_smart_thresholds(const u8 *req_header, void __user *buff_ptr)
+static void build_ata_smart_thresholds(void)
 {
-    pr_loc_dbg("Generating fake SMART thresholds");
-
-    //sanity check if requested SMART READ THRESHOLDS sector count is really what we're planning to copy
-    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_SMART_READ_THRESHOLDS_SECTORS) {
-        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA SMART READ THRESHOLDS, got %d",
-                   ATA_SMART_READ_THRESHOLDS_SECTORS, ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS),
-                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
-        return -EIO;
-    }
-
     int i;
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS));
+    unsigned char *kbuf = smart_thresholds_tpl;
     u8 *smart_thresholds = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
 
     //First write response header
@@ -486,45 +402,13 @@ static int populate_ata_smart_thresholds(const u8 *req_header, void __user *buff
     }
 
     ata_calc_sector_checksum(smart_thresholds);
-
-    if (copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS)) != 0) {
-        pr_loc_err("Failed to copy SMART THRESHOLDS packet to user ptr=%p", buff_ptr);
-        kfree(kbuf);
-        return -EFAULT;
-    }
-
-    kfree(kbuf);
-    return 0;
 }
 
 /**
- * Read stored SMART log using WIN_SMART interface
- *
- * This is a special command from the "WIN_SMART" subset to read the SMART offline log. To understand it see the
- * "8.55.6 SMART READ LOG" in ATA/ATAPI-6 specs. It describes it as"Command code B0h with the content of the Features
- * register equal to D5h" (B0h = 0xb0 = ATA_CMD_SMART; D5h = 0x05 = WIN_FT_SMART_READ_LOG_SECTOR).
- * There are multiple types of logs. This function implements all non-vendor ones.
- *
- * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
- * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
- *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * Builds fake WIN_SMART log response for a given log address (see populate_win_smart_log())
  */
-static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr)
+static void build_win_smart_log(unsigned char *kbuf, u8 log_addr)
 {
-    pr_loc_dbg("Generating fake WIN_SMART log=%d entries", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
-
-    //sanity check if requested SMART READ LOG sector count is really what we're planning to copy
-    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_WIN_SMART_READ_LOG_SECTORS) {
-        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA WIN_SMART READ LOG, got %d",
-                   ATA_WIN_SMART_READ_LOG_SECTORS, ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS),
-                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
-        return -EIO;
-    }
-
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS));
     u8 *smart_log = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
 
     //First write response header
@@ -533,7 +417,7 @@ static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr)
     kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_WIN_SMART_READ_LOG_SECTORS;
 
     //See "Table 62 − Log address definition" in ATAPI/6 docs
-    switch (req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]) {
+    switch (log_addr) {
         case 0x00: //log directory. While the spec says it's optional supporting it means fewer calls to other ones
             //we're indicating that we DO support multi-sector logging to avoid further log-read logic complexity. If
             // the support is indicated as absent all reads to logs at index 0 must return "command aborted" response
@@ -558,7 +442,7 @@ static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr)
             ata_calc_sector_checksum(smart_log);
             break;
 
-        case 0x06: //SMART self-test log
+        case SMART_TEST_LOG_ADDR: //SMART self-test log (template of per-disk logs, see log_self_test())
             smart_log[0] = WIN_SMART_TEST_LOG_VERSION;
             smart_log[1] = 0x00; //revision (2nd byte, also defined by 8.55.6.8.4.1)
             smart_log[508] = 0x00; //no errors
@@ -566,122 +450,810 @@ static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr)
             break;
 
         default: //other ones are reserved/vendor/etc
-            pr_loc_err("Unexpected WIN_FT_SMART_READ_LOG_SECTOR with log_addr=%d",
-                       req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
-            kfree(kbuf);
-            return -EIO;
-    }
-
-    if (copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS)) != 0) {
-        pr_loc_err("Failed to copy WIN_SMART LOG packet to user ptr=%p", buff_ptr);
-        kfree(kbuf);
-        return -EFAULT;
+            pr_loc_bug("No fake WIN_SMART log for log_addr=%d", log_addr);
+            break;
     }
-
-    kfree(kbuf);
-    return 0;
 }
 
 /**
- * Dispatches an drive-internal SMART test using WIN_SMART interface
- *
- * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
- * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
- *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * @return prebuilt WIN_SMART log response (incl. header) or NULL if there's no such log
  */
-static int populate_win_smart_exec_test(const u8 *req_header, void __user *buff_ptr)
+static const unsigned char *get_smart_log_tpl(u8 log_addr)
 {
-    pr_loc_dbg("Generating fake WIN_SMART offline test type=%d", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
-
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, HDIO_DRIVE_CMD_HDR_OFFSET);
+    for (int i = 0; i < ARRAY_SIZE(smart_log_addrs); i++) {
+        if (smart_log_addrs[i] == log_addr)
+            return smart_logs_tpl[i];
+    }
 
-    //First write response header
-    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_WIN_SMART_EXEC_TEST;
+    return NULL;
+}
 
-    //See "Table 58 − SMART EXECUTE OFF-LINE IMMEDIATE LBA Low register values" in ATAPI/6 docs
-    switch (req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]) {
-        case 0x00: //off-line in off-line mode
-        case 0x01: //short in off-line mode
-        case 0x02: //long in off-line mode
-        case 0x7f: //abort previous test
-        case 0x81: //short in captive mode
-        case 0x82: //long in captive mode
-            break; //we only need to populate the response header
+static void build_smart_templates(void)
+{
+    memset(smart_values_tpl, 0, sizeof(smart_values_tpl));
+    build_ata_smart_values();
 
-        default: //other ones are reserved/vendor/etc
-            pr_loc_err("Unexpected WIN_FT_SMART_READ_LOG_SECTOR with log_addr=%d",
-                       req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
-            kfree(kbuf);
-            return -EIO;
-    }
+    memset(smart_thresholds_tpl, 0, sizeof(smart_thresholds_tpl));
+    build_ata_smart_thresholds();
 
-    if (copy_to_user(buff_ptr, kbuf, HDIO_DRIVE_CMD_HDR_OFFSET) != 0) {
-        pr_loc_err("Failed to copy WIN_SMART TEST header to user ptr=%p", buff_ptr);
-        kfree(kbuf);
-        return -EFAULT;
+    for (int i = 0; i < ARRAY_SIZE(smart_log_addrs); i++) {
+        memset(smart_logs_tpl[i], 0, sizeof(smart_logs_tpl[i]));
+        build_win_smart_log(smart_logs_tpl[i], smart_log_addrs[i]);
     }
-
-    kfree(kbuf);
-    return 0;
 }
 
+/*************************************** ATAPI/WIN command interface handling *****************************************/
 /**
- * Emulates various SMART data requested via ATA_CMD_SMART method
- *
- * SMART responses here assume that original ioctl() failed (since otherwise it would be no point to emulate them). If
- * you call this function on a drive with functioning SMART it will be ignored and fake smart will be generated for it.
+ * Fake responses (header + data) of a single disk
  *
- * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
- * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
- *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * Generating IDENTIFY requires filling & checksumming the whole structure. Since it changes only when the disk is
+ * renamed or resized it's built once and then just copied to the user. SMART values are the template (smart_values_tpl)
+ * with counters which are updated only when they're read (see update_smart_counters()). Self-tests are tracked the
+ * same lazy way (see update_self_test()). Entries are removed when the disk goes away (see on_scsi_disk_removed).
  */
-static int __always_inline handle_ata_cmd_smart(const u8 *req_header, void __user *buff_ptr)
-{
-    pr_loc_dbg("Got SMART *command* - looking for feature=0x%x", req_header[HDIO_DRIVE_CMD_HDR_FEATURE]);
-
-    switch (req_header[HDIO_DRIVE_CMD_HDR_FEATURE]) {
-        case ATA_SMART_READ_VALUES: //read all SMART values snapshot
-            return populate_ata_smart_values(req_header, buff_ptr);
-
-        case ATA_SMART_READ_THRESHOLDS: //read all SMART thresholds snapshot
-            return populate_ata_smart_thresholds(req_header, buff_ptr);
-
-        case ATA_SMART_ENABLE: //enable previously disabled SMART support
-            pr_loc_wrn("Attempted ATA_SMART_ENABLE modification!");\
-            return 0;
-
-        case WIN_FT_SMART_READ_LOG_SECTOR: //reads offline-stored drive logs
-            return populate_win_smart_log(req_header, buff_ptr);
+struct emulated_disk {
+    struct list_head list;
+    struct device *dev; //parent device of the disk (i.e. the SCSI device)
+    char disk_name[DISK_NAME_LEN];
+    sector_t capacity; //in 512-byte sectors, as reported in ata_id
+    unsigned char ata_id[HDIO_DRIVE_CMD_HDR_OFFSET + sizeof(struct rp_hd_driveid)];
+    unsigned char smart_values[ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS)];
+    unsigned long base_jiffies; //when the base_poh was calculated
+    u32 base_poh; //power-on hours at base_jiffies
+    u32 values_poh; //power-on hours currently in smart_values
+    unsigned char test_log[ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS)]; //self-test log (SMART_TEST_LOG_ADDR)
+    unsigned long test_start; //jiffies when the running self-test started
+    unsigned long test_duration; //in jiffies; 0 = no self-test is running
+    u8 test_type; //SMART_TEST_* of the running self-test
+    bool state_restored; //whether the state saved during previous boots was applied (or there was none)
+};
 
-        case WIN_FT_SMART_IMMEDIATE_OFFLINE: //execute a SMART test
-            return populate_win_smart_exec_test(req_header, buff_ptr);
+static LIST_HEAD(emulated_disks);
+static DEFINE_MUTEX(emulated_disks_lock); //copy_to_user() happens under it so it cannot be a spinlock
 
-        default:
-            pr_loc_dbg("Unknown SMART *command* read w/feature=0x%02x", req_header[HDIO_DRIVE_CMD_HDR_FEATURE]);
-            return -EIO;
-    }
+/**
+ * Fake serial numbers are derived from disk names; it's what DSM identifies disks by (e.g. to keep their SMART history)
+ */
+static __always_inline void get_fake_serial(char *serial, const char *disk_name)
+{
+    strscpy(serial, disk_name, SMART_STATE_SERIAL_LEN);
 }
 
 /**
- * Shims various commands launched via HDIO_DRIVE_CMD interface, routing them to individual shims
- *
- * This function will shim calls which need to be modified or replaced. All ioctl()s routed here are first executed and
- * then routed to individual shims. If a given ioctl() is not a one which we're interested in altering the result of a
- * real ioctl() call to the driver will be returned unaltered.
+ * Builds fake IDENTIFY response
  *
- * To fully understand this function make sure to read HDIO_DRIVE_CMD description provided by kernel developers at
- * https://www.kernel.org/doc/Documentation/ioctl/hdio.txt
+ * @param capacity Capacity in 512-byte sectors; it's reported in both 28-bit and 48-bit LBA words, so that tools don't
+ *                 need to ask for it separately (e.g. with READ CAPACITY)
  */
-static int handle_hdio_drive_cmd_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, void __user *buff_ptr)
+static void build_fake_ata_id(unsigned char *kbuf, const char *disk_name, sector_t capacity)
 {
-    //Before we execute ioctl we need to save the original header as ioctl will override it (they share buffer)
+    pr_loc_dbg("Generating completely fake ATA IDENTITY");
+
+    char disk_serial[SMART_STATE_SERIAL_LEN];
+    memset(kbuf, 0, HDIO_DRIVE_CMD_HDR_OFFSET + sizeof(struct rp_hd_driveid));
+    struct rp_hd_driveid *did = (void *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET); //did=drive ID
+
+    //First write response header
+    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_CMD_ID_ATA_SECTORS;
+
+    did->config = 0x0000; //15th bit = ATA device, rest is reserved/obsolete
+    did->capability = (1 << 1); //LBA supported
+    get_fake_serial(disk_serial, disk_name);
+    set_ata_string(did->serial_no, disk_serial, SMART_STATE_SERIAL_LEN);
+    set_ata_string(did->fw_rev, "1.13.2", 8);
+    set_ata_string(did->model, "Virtual HDD", 40);
+    did->reserved50 = (1 << 14); //"shall be set to one"
+    did->major_rev_num = 0xffff;
+    did->minor_rev_num = 0xffff;
+    did->command_set_1 = (1 << 3 | 1 << 0); //PM, SMART supported
+    did->command_set_2 = (1 << 14 | 1 << 10); //"shall be set to one" ; 48-bit LBA supported
+    did->cfsse = (1 << 14 | 1 << 1 | 1 << 0); //14: "shall be set to one" ; smart self-test supported ; smart error-log
+    did->cfs_enable_1 = (1 << 3 | 1 << 0); //PM, SMART
+    did->cfs_enable_2 = (1 << 14 | 1 << 10); //"shall be set to one" ; 48-bit LBA enabled
+    did->csf_default = (1 << 14 | 1 << 1 | 1 << 0); //"shall be one" ; SMART self-test, SMART error-test
+    did->hw_config = (1 << 14 | 1 << 0); //both "shall be one"
+    did->lba_capacity = min_t(sector_t, capacity, ATA_ID_LBA28_MAX_SECTORS); //capped as per ATA/ATAPI-6 sec. 6.2.1
+    did->lba_capacity_2 = capacity;
+
+    ata_calc_integrity_word((void *)did);
+}
+
+/**
+ * Calculates power-on hours based on the current wall clock (see SMART_POH_EPOCH)
+ */
+static u32 get_base_poh(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+    time64_t now = ktime_get_real_seconds();
+#else
+    unsigned long now = get_seconds();
+#endif
+    return (now > SMART_POH_EPOCH) ? SMART_POH_BASE + (u32)((now - SMART_POH_EPOCH) / 3600) : SMART_POH_BASE;
+}
+
+/**
+ * Sets raw value of a SMART attribute in SMART values response (which must already have a valid checksum)
+ */
+static void set_smart_raw_value(u8 *smart_values, u8 attr_id, u32 value)
+{
+    for (int i = 0; i < ARRAY_SIZE(fake_smart); i++) {
+        if (fake_smart[i][0] != attr_id)
+            continue;
+
+        u8 raw[6];
+        raw[0] = value & 0xff; //raw values are little-endian 48-bit numbers
+        raw[1] = (value >> 8) & 0xff;
+        raw[2] = (value >> 16) & 0xff;
+        raw[3] = (value >> 24) & 0xff;
+        raw[4] = 0x00;
+        raw[5] = 0x00;
+        ata_patch_sector(smart_values, 2 + (ATA_SMART_RECORD_LEN * i) + SMART_RAW_OFFSET, raw, sizeof(raw));
+        return;
+    }
+}
+
+/**
+ * Updates counters in SMART values of a disk; emulated_disks_lock must be held
+ *
+ * There are no timers involved - counters are calculated from jiffies only when someone reads them. Since they change
+ * at most once an hour most reads are just a comparison.
+ */
+static inline u32 get_disk_poh(const struct emulated_disk *entry)
+{
+    return entry->base_poh + (u32)((jiffies - entry->base_jiffies) / (3600UL * HZ));
+}
+
+/**
+ * Saves counters & self-test log of a disk in the persistent state (if used); emulated_disks_lock must be held
+ */
+static void save_disk_state(struct emulated_disk *entry)
+{
+    if (!entry->state_restored) //it would overwrite the state saved during the previous boot
+        return;
+
+    char serial[SMART_STATE_SERIAL_LEN];
+    get_fake_serial(serial, entry->disk_name);
+    smart_state_put(serial, get_disk_poh(entry), entry->test_log + HDIO_DRIVE_CMD_HDR_OFFSET);
+}
+
+/**
+ * Applies the state saved during previous boots (see smart_state.c) to a disk; emulated_disks_lock must be held
+ *
+ * It's retried on every access until the state is loaded. Power-on hours are taken from the state only if they're
+ * higher than the ones based on the wall clock. The self-test log is restored only if no self-test was logged yet.
+ */
+static void restore_disk_state(struct emulated_disk *entry)
+{
+    char serial[SMART_STATE_SERIAL_LEN];
+    u8 *test_log = entry->test_log + HDIO_DRIVE_CMD_HDR_OFFSET;
+    u32 poh;
+
+    get_fake_serial(serial, entry->disk_name);
+    int out = smart_state_get(serial, &poh, test_log[SMART_TEST_LOG_INDEX] == 0 ? test_log : NULL);
+    if (out == -EAGAIN)
+        return;
+
+    entry->state_restored = true;
+    if (out != 0)
+        return;
+
+    if (poh > get_disk_poh(entry)) {
+        entry->base_jiffies = jiffies;
+        entry->base_poh = poh;
+    }
+    pr_loc_dbg("Restored SMART state of %s (poh=%u)", entry->disk_name, get_disk_poh(entry));
+}
+
+static void update_smart_counters(struct emulated_disk *entry)
+{
+    u32 poh = get_disk_poh(entry);
+    if (likely(poh == entry->values_poh))
+        return;
+
+    u8 *smart_values = entry->smart_values + HDIO_DRIVE_CMD_HDR_OFFSET;
+    set_smart_raw_value(smart_values, SMART_ATTR_POH, poh);
+    set_smart_raw_value(smart_values, SMART_ATTR_START_STOP, 1 + poh / SMART_POH_PER_START_STOP);
+    set_smart_raw_value(smart_values, SMART_ATTR_POWER_CYCLE, 1 + poh / SMART_POH_PER_POWER_CYCLE);
+    entry->values_poh = poh;
+    save_disk_state(entry);
+}
+
+static void set_self_test_status(struct emulated_disk *entry, u8 status)
+{
+    u8 *smart_values = entry->smart_values + HDIO_DRIVE_CMD_HDR_OFFSET;
+    if (smart_values[SMART_VAL_TEST_STATUS] != status)
+        ata_patch_sector(smart_values, SMART_VAL_TEST_STATUS, &status, 1);
+}
+
+/**
+ * Adds a descriptor of a finished self-test to the self-test log of a disk; emulated_disks_lock must be held
+ *
+ * See "8.55.6.8.4 Self-test log" in ATA/ATAPI-6 - the log is a circular buffer of descriptors with 1-based index of
+ * the most recent one (0 = the log is empty).
+ */
+static void log_self_test(struct emulated_disk *entry, u8 type, u8 status)
+{
+    u8 *test_log = entry->test_log + HDIO_DRIVE_CMD_HDR_OFFSET;
+    u8 idx = (test_log[SMART_TEST_LOG_INDEX] >= SMART_TEST_LOG_DESC_NUM) ? 1 : test_log[SMART_TEST_LOG_INDEX] + 1;
+    u8 desc[SMART_TEST_LOG_DESC_LEN] = { 0 }; //no failing LBA & no vendor data
+    u32 poh = get_disk_poh(entry);
+
+    desc[0] = type; //content of LBA Low register when the test was started
+    desc[1] = status;
+    desc[2] = poh & 0xff; //life timestamp (power-on hours) is 16-bit LE
+    desc[3] = (poh >> 8) & 0xff;
+    ata_patch_sector(test_log, SMART_TEST_LOG_DESC_OFFSET + (idx - 1) * SMART_TEST_LOG_DESC_LEN, desc, sizeof(desc));
+    ata_patch_sector(test_log, SMART_TEST_LOG_INDEX, &idx, 1);
+    save_disk_state(entry);
+}
+
+/**
+ * Advances the running self-test of a disk (if any); emulated_disks_lock must be held
+ *
+ * Like counters there are no timers involved - progress is calculated from jiffies whenever someone looks at SMART
+ * values or the self-test log.
+ */
+static void update_self_test(struct emulated_disk *entry)
+{
+    if (likely(!entry->test_duration))
+        return;
+
+    unsigned long elapsed = jiffies - entry->test_start;
+    if (elapsed >= entry->test_duration) {
+        entry->test_duration = 0;
+        set_self_test_status(entry, SMART_TEST_STATUS_OK);
+        log_self_test(entry, entry->test_type, SMART_TEST_STATUS_OK);
+        return;
+    }
+
+    //spec defines 0-9 as remaining 0-90%; it cannot be 0 here as the test would be already done
+    unsigned int remaining = ((entry->test_duration - elapsed) * 10) / entry->test_duration;
+    set_self_test_status(entry, SMART_TEST_STATUS_RUNNING | min_t(unsigned int, max_t(unsigned int, remaining, 1), 9));
+}
+
+/**
+ * Handles SMART EXECUTE OFF-LINE IMMEDIATE for a disk; emulated_disks_lock must be held
+ *
+ * Off-line data collection is reported as done right away (it was always done as far as SMART values go). Off-line
+ * self-tests run for SMART_TEST_*_MINUTES and report progress in the SMART values in the meantime, so that pollers
+ * (e.g. DSM scheduled tests) see them progressing and finishing. Captive self-tests complete before the command
+ * returns, as they would on a real drive. Starting a new test aborts the running one.
+ *
+ * @return 0 on success, -EINVAL when the test type is not supported
+ */
+static int start_self_test(struct emulated_disk *entry, u8 type)
+{
+    unsigned long duration;
+
+    switch (type) {
+        case SMART_TEST_OFFLINE:
+            return 0;
+        case SMART_TEST_SHORT:
+            duration = SMART_TEST_SHORT_MINUTES * 60 * HZ;
+            break;
+        case SMART_TEST_LONG:
+            duration = SMART_TEST_LONG_MINUTES * 60 * HZ;
+            break;
+        case SMART_TEST_ABORT:
+        case SMART_TEST_SHORT_CAPTIVE:
+        case SMART_TEST_LONG_CAPTIVE:
+            duration = 0;
+            break;
+        default: //other ones are reserved/vendor/etc
+            return -EINVAL;
+    }
+
+    update_self_test(entry); //it may have just finished
+    if (entry->test_duration) {
+        pr_loc_dbg("Aborting fake self-test type=0x%02x on %s", entry->test_type, entry->disk_name);
+        entry->test_duration = 0;
+        set_self_test_status(entry, SMART_TEST_STATUS_ABORTED);
+        log_self_test(entry, entry->test_type, SMART_TEST_STATUS_ABORTED);
+    }
+
+    if (type == SMART_TEST_ABORT)
+        return 0;
+
+    if (!duration) { //captive
+        set_self_test_status(entry, SMART_TEST_STATUS_OK);
+        log_self_test(entry, type, SMART_TEST_STATUS_OK);
+        return 0;
+    }
+
+    pr_loc_dbg("Starting fake self-test type=0x%02x on %s for %lus", type, entry->disk_name, duration / HZ);
+    entry->test_type = type;
+    entry->test_start = jiffies;
+    entry->test_duration = duration;
+    update_self_test(entry);
+
+    return 0;
+}
+
+/**
+ * Gets (building if needed) fake IDENTIFY of a disk; emulated_disks_lock must be held
+ *
+ * @return entry or ERR_PTR(-E) on error
+ */
+static struct emulated_disk *get_emulated_disk(struct gendisk *disk)
+{
+    struct device *dev = disk_to_dev(disk)->parent;
+    struct emulated_disk *entry;
+    list_for_each_entry(entry, &emulated_disks, list) {
+        if (entry->dev != dev)
+            continue;
+
+        //unlikely but the serial is based on name & disks can be resized (e.g. virtual ones)
+        if (unlikely(strcmp(entry->disk_name, disk->disk_name) != 0 || entry->capacity != get_capacity(disk))) {
+            strscpy(entry->disk_name, disk->disk_name, DISK_NAME_LEN);
+            entry->capacity = get_capacity(disk);
+            build_fake_ata_id(entry->ata_id, entry->disk_name, entry->capacity);
+            entry->state_restored = false; //it's a different serial now
+        }
+
+        if (unlikely(!entry->state_restored))
+            restore_disk_state(entry);
+
+        return entry;
+    }
+
+    kmalloc_or_exit_ptr(entry, sizeof(struct emulated_disk), RP_MEM_SMART);
+    entry->dev = dev;
+    strscpy(entry->disk_name, disk->disk_name, DISK_NAME_LEN);
+    entry->capacity = get_capacity(disk); //sd already knows it - no need to issue READ CAPACITY
+    build_fake_ata_id(entry->ata_id, entry->disk_name, entry->capacity);
+    memcpy(entry->smart_values, smart_values_tpl, sizeof(smart_values_tpl));
+    entry->base_jiffies = jiffies;
+    entry->base_poh = get_base_poh();
+    entry->values_poh = 0; //template contains (static) counters which are not updated yet
+    memcpy(entry->test_log, get_smart_log_tpl(SMART_TEST_LOG_ADDR), sizeof(entry->test_log));
+    entry->test_duration = 0;
+    entry->state_restored = false;
+    restore_disk_state(entry);
+    list_add(&entry->list, &emulated_disks);
+
+    return entry;
+}
+
+static int populate_ata_id(const u8 *req_header, void __user *buff_ptr, struct gendisk *disk)
+{
+    int out = 0;
+
+    mutex_lock(&emulated_disks_lock);
+    struct emulated_disk *entry = get_emulated_disk(disk);
+    if (unlikely(IS_ERR(entry))) {
+        out = PTR_ERR(entry);
+    } else if (unlikely(copy_to_user(buff_ptr, entry->ata_id, sizeof(entry->ata_id)) != 0)) {
+        pr_loc_err("Failed to copy fake ATA IDENTIFY packet to user ptr=%p", (void *)buff_ptr);
+        out = -EFAULT;
+    }
+    mutex_unlock(&emulated_disks_lock);
+
+    return out;
+}
+
+/**
+ * Disks confirmed to support SMART natively
+ *
+ * Once the first IDENTIFY confirms that a disk supports SMART there's nothing to emulate for it, so all further
+ * HDIO_DRIVE_* ioctl()s go straight to the original sd_ioctl() without copying or inspecting anything. This is checked
+ * for every ioctl() so lookups are lock-less (RCU). Most systems have no such disks (that's why the shim is used) - the
+ * lookup is skipped altogether (it's just a NOP) until the first one is found.
+ */
+#define NATIVE_SMART_BITS 5
+struct native_smart_disk {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    struct gendisk *disk;
+    struct device *dev; //parent device of the disk (i.e. the SCSI device)
+};
+
+static DEFINE_HASHTABLE(native_smart_disks, NATIVE_SMART_BITS);
+static unsigned int native_smart_disks_num = 0;
+static RP_METRIC(smart_native_disks, RP_MG_SMART, RP_METRIC_GAUGE);
+static DEFINE_MUTEX(native_smart_disks_lock); //only for writers; it's a mutex as flipping the key may sleep
+static RP_DEFINE_STATIC_KEY_FALSE(native_smart_disks_present);
+
+static bool is_native_smart(struct gendisk *disk)
+{
+    if (!rp_static_branch_unlikely(&native_smart_disks_present))
+        return false;
+
+    struct native_smart_disk *entry;
+    bool found = false;
+
+    rcu_read_lock();
+    hash_for_each_possible_rcu(native_smart_disks, entry, node, (unsigned long)disk) {
+        if (entry->disk == disk) {
+            found = true;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return found;
+}
+
+static void mark_native_smart(struct gendisk *disk)
+{
+    if (is_native_smart(disk))
+        return;
+
+    struct native_smart_disk *entry = kmalloc(sizeof(struct native_smart_disk), GFP_KERNEL);
+    if (unlikely(!entry)) {
+        pr_loc_wrn("Failed to remember native SMART support of /dev/%s", disk->disk_name);
+        return; //not critical - IDENTIFY will just be inspected again next time
+    }
+    rp_mem_alloced(RP_MEM_SMART, entry);
+
+    entry->disk = disk;
+    entry->dev = disk_to_dev(disk)->parent;
+
+    mutex_lock(&native_smart_disks_lock);
+    hash_add_rcu(native_smart_disks, &entry->node, (unsigned long)disk);
+    if (native_smart_disks_num++ == 0)
+        rp_static_branch_enable(&native_smart_disks_present);
+    rp_metric_gauge_set(&smart_native_disks, native_smart_disks_num);
+    mutex_unlock(&native_smart_disks_lock); //duplicate can only come from a race of two IDENTIFYs and it's harmless
+
+    pr_loc_dbg("/dev/%s supports SMART natively - it will not be emulated", disk->disk_name);
+}
+
+/**
+ * Removes native SMART flag of disks with given parent device (or all disks if NULL)
+ */
+static void forget_native_smart(struct device *dev)
+{
+    struct native_smart_disk *entry;
+    struct hlist_node *tmp;
+    unsigned int bkt;
+
+    mutex_lock(&native_smart_disks_lock);
+    hash_for_each_safe(native_smart_disks, bkt, tmp, entry, node) {
+        if (!dev || entry->dev == dev) {
+            hash_del_rcu(&entry->node);
+            rp_mem_freeing(RP_MEM_SMART, entry);
+            kfree_rcu(entry, rcu);
+            native_smart_disks_num--;
+        }
+    }
+    if (native_smart_disks_num == 0)
+        rp_static_branch_disable(&native_smart_disks_present);
+    rp_metric_gauge_set(&smart_native_disks, native_smart_disks_num);
+    mutex_unlock(&native_smart_disks_lock);
+}
+
+/**
+ * Removes cached fake IDENTIFY & native SMART flag of disks which went away
+ */
+static int on_scsi_disk_removed(struct notifier_block *self, unsigned long state, void *data)
+{
+    struct scsi_device *sdp = data;
+    struct emulated_disk *entry, *tmp;
+
+    forget_native_smart(&sdp->sdev_gendev);
+
+    mutex_lock(&emulated_disks_lock);
+    list_for_each_entry_safe(entry, tmp, &emulated_disks, list) {
+        if (entry->dev == &sdp->sdev_gendev) {
+            pr_loc_dbg("Removing cached fake ATA IDENTITY of /dev/%s", entry->disk_name);
+            list_del(&entry->list);
+            rp_kfree(entry, RP_MEM_SMART);
+        }
+    }
+    mutex_unlock(&emulated_disks_lock);
+
+    return NOTIFY_OK;
+}
+
+static struct scsi_disk_subscriber scsi_disk_sub = {
+    .nb = {
+        .notifier_call = on_scsi_disk_removed,
+    },
+    .event_mask = SCSI_EVT_MASK(SCSI_EVT_DEV_REMOVED),
+};
+
+static void free_emulated_disks(void)
+{
+    struct emulated_disk *entry, *tmp;
+
+    mutex_lock(&emulated_disks_lock);
+    list_for_each_entry_safe(entry, tmp, &emulated_disks, list) {
+        list_del(&entry->list);
+        rp_kfree(entry, RP_MEM_SMART);
+    }
+    mutex_unlock(&emulated_disks_lock);
+}
+
+/**
+ * Handles on-the-fly modification of data related to ATA IDENTIFY DEVICE command
+ *
+ * See "8.16 IDENTIFY DEVICE" section in the ATA/ATAPI-6 manual.
+ *
+ * @param org_ioctl_exec_result exit code of the original ioctl() call which reached the drive (done by
+ *                              handle_hdio_drive_cmd_ioctl()). This command shouldn't normally fail for any drive.
+ * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
+ * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be read and possibly altered
+ *
+ * @return definitive exit code for the ioctl(); in practice 0 when succedded [regardless of the modifications made] or
+ *         the same error code as org_ioctl_exec_result passed
+ */
+static int handle_ata_cmd_identify(int org_ioctl_exec_result, const u8 *req_header, void __user *buff_ptr,
+                                   struct gendisk *disk)
+{
+    //ATA IDENTIFY should not fail - it may mean a problem with a disk or the "disk" is a adapter (e.g. IDE>SATA) with
+    // no disk connected, or if executed against a USB flash drive... or it's an VirtIO SCSI disk read as ATA
+    if (unlikely(org_ioctl_exec_result != 0)) {
+        pr_loc_dbg("sd_ioctl(HDIO_DRIVE_CMD ; ATA_CMD_ID_ATA) failed with error=%d, attempting to emulate something",
+                   org_ioctl_exec_result);
+        return populate_ata_id(req_header, buff_ptr, disk);
+    }
+
+    //sanity check if requested ATA IDENTIFY sector count is really what we're planning to copy
+    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_CMD_ID_ATA_SECTORS) {
+        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA IDENTIFY DEVICE, got %d",
+                   ATA_CMD_ID_ATA_SECTORS, ata_ioctl_buf_size(ATA_CMD_ID_ATA_SECTORS),
+                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
+        return -EIO;
+    }
+
+    //if the identity succeeded we need to check if SMART is supported & enabled. For that we need to clone
+    // normally user buffer from ioctl (reading it directly is risky)
+    unsigned char *kbuf = get_ioctl_buffer_kcopy(ATA_CMD_ID_ATA_SECTORS, buff_ptr);
+    if (unlikely(IS_ERR(kbuf)))
+        return PTR_ERR(kbuf); //it will already log error in kcopy
+
+    u16 *ata_identity = (u16 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
+    if (ata_is_smart_supported(ata_identity) && ata_is_smart_enabled(ata_identity)) {
+        pr_loc_dbg("ATA_CMD_ID_ATA confirmed SMART support - noop");
+        put_ioctl_buffer(kbuf); //we no longer need the buffer as we're not touching it, we've only read it
+        mark_native_smart(disk); //no need to even look at any further ioctl()s
+        return 0; //SMART supported, pass identity as-is
+    }
+
+    //if SMART is not supported we modify the response, retaining the original response header but changing
+    // SMART flags & recalculating checksum
+    pr_loc_dbg("ATA_CMD_ID_ATA confirmed *no* SMART support - pretending it's there");
+    ata_set_smart_supported(ata_identity);
+    ata_set_smart_enabled(ata_identity);
+    ata_calc_integrity_word(ata_identity);
+
+    if (unlikely(copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_CMD_ID_ATA_SECTORS)) != 0)) {
+        pr_loc_err("Failed to copy ATA IDENTIFY packet to user ptr=%p", (void *)buff_ptr);
+        put_ioctl_buffer(kbuf);
+        return -EFAULT;
+    }
+
+    put_ioctl_buffer(kbuf);
+    return 0;
+}
+
+/**
+ * Populates user ioctl() buffer with fake SMART snapshot values
+ *
+ * This function is responsible for the generation of data which you see in a usual tabular format as a result of
+ * "smartctl -A" command. The data is formated from the "fake_smart" constant array present on the top of this file.
+ *
+ * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
+ * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
+ *
+ * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
+ *         copy to user buffer
+ */
+static int populate_ata_smart_values(const u8 *req_header, void __user *buff_ptr, struct gendisk *disk)
+{
+    pr_loc_dbg("Sending fake SMART values");
+
+    //sanity check if requested SMART READ VALUES sector count is really what we're planning to copy
+    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_SMART_READ_VALUES_SECTORS) {
+        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA SMART READ VALUES, got %d",
+                   ATA_SMART_READ_VALUES_SECTORS, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS),
+                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
+        return -EIO;
+    }
+
+    int out = 0;
+    mutex_lock(&emulated_disks_lock);
+    struct emulated_disk *entry = get_emulated_disk(disk);
+    if (unlikely(IS_ERR(entry))) {
+        out = PTR_ERR(entry);
+    } else {
+        update_smart_counters(entry);
+        update_self_test(entry);
+        if (copy_to_user(buff_ptr, entry->smart_values, sizeof(entry->smart_values)) != 0) {
+            pr_loc_err("Failed to copy SMART VALUES packet to user ptr=%p", buff_ptr);
+            out = -EFAULT;
+        }
+    }
+    mutex_unlock(&emulated_disks_lock);
+
+    return out;
+}
+
+/**
+ * Populates user ioctl() buffer with a subset of fake SMART snapshot values, containing only thresholds
+ *
+ * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
+ * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
+ *
+ * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
+ *         copy to user buffer
+ */
+static int populate_ata_smart_thresholds(const u8 *req_header, void __user *buff_ptr)
+{
+    pr_loc_dbg("Sending fake SMART thresholds");
+
+    //sanity check if requested SMART READ THRESHOLDS sector count is really what we're planning to copy
+    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_SMART_READ_THRESHOLDS_SECTORS) {
+        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA SMART READ THRESHOLDS, got %d",
+                   ATA_SMART_READ_THRESHOLDS_SECTORS, ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS),
+                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
+        return -EIO;
+    }
+
+    if (copy_to_user(buff_ptr, smart_thresholds_tpl, sizeof(smart_thresholds_tpl)) != 0) {
+        pr_loc_err("Failed to copy SMART THRESHOLDS packet to user ptr=%p", buff_ptr);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/**
+ * Read stored SMART log using WIN_SMART interface
+ *
+ * This is a special command from the "WIN_SMART" subset to read the SMART offline log. To understand it see the
+ * "8.55.6 SMART READ LOG" in ATA/ATAPI-6 specs. It describes it as"Command code B0h with the content of the Features
+ * register equal to D5h" (B0h = 0xb0 = ATA_CMD_SMART; D5h = 0x05 = WIN_FT_SMART_READ_LOG_SECTOR).
+ * There are multiple types of logs. This function implements all non-vendor ones.
+ *
+ * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
+ * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
+ *
+ * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
+ *         copy to user buffer
+ */
+static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr, struct gendisk *disk)
+{
+    pr_loc_dbg("Sending fake WIN_SMART log=%d entries", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
+
+    //sanity check if requested SMART READ LOG sector count is really what we're planning to copy
+    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_WIN_SMART_READ_LOG_SECTORS) {
+        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA WIN_SMART READ LOG, got %d",
+                   ATA_WIN_SMART_READ_LOG_SECTORS, ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS),
+                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
+        return -EIO;
+    }
+
+    if (req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM] == SMART_TEST_LOG_ADDR) { //the only per-disk log
+        int out = 0;
+        mutex_lock(&emulated_disks_lock);
+        struct emulated_disk *entry = get_emulated_disk(disk);
+        if (unlikely(IS_ERR(entry))) {
+            out = PTR_ERR(entry);
+        } else {
+            update_self_test(entry);
+            if (copy_to_user(buff_ptr, entry->test_log, sizeof(entry->test_log)) != 0) {
+                pr_loc_err("Failed to copy WIN_SMART self-test LOG packet to user ptr=%p", buff_ptr);
+                out = -EFAULT;
+            }
+        }
+        mutex_unlock(&emulated_disks_lock);
+
+        return out;
+    }
+
+    //See "Table 62 − Log address definition" in ATAPI/6 docs; other ones are reserved/vendor/etc
+    const unsigned char *log_tpl = get_smart_log_tpl(req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
+    if (!log_tpl) {
+        pr_loc_err("Unexpected WIN_FT_SMART_READ_LOG_SECTOR with log_addr=%d", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
+        return -EIO;
+    }
+
+    if (copy_to_user(buff_ptr, log_tpl, ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS)) != 0) {
+        pr_loc_err("Failed to copy WIN_SMART LOG packet to user ptr=%p", buff_ptr);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/**
+ * Dispatches an drive-internal SMART test using WIN_SMART interface (see start_self_test())
+ *
+ * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
+ * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
+ *
+ * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
+ *         copy to user buffer
+ */
+static int populate_win_smart_exec_test(const u8 *req_header, void __user *buff_ptr, struct gendisk *disk)
+{
+    pr_loc_dbg("Generating fake WIN_SMART offline test type=%d", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
+
+    unsigned char kbuf[HDIO_DRIVE_CMD_HDR_OFFSET] = { 0 }; //it's just a header; no need to allocate anything
+
+    //First write response header
+    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_WIN_SMART_EXEC_TEST;
+
+    //See "Table 58 − SMART EXECUTE OFF-LINE IMMEDIATE LBA Low register values" in ATAPI/6 docs
+    mutex_lock(&emulated_disks_lock);
+    struct emulated_disk *entry = get_emulated_disk(disk);
+    int out = unlikely(IS_ERR(entry)) ? PTR_ERR(entry) : start_self_test(entry, req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
+    mutex_unlock(&emulated_disks_lock);
+
+    if (unlikely(out == -EINVAL)) {
+        pr_loc_err("Unexpected WIN_FT_SMART_IMMEDIATE_OFFLINE with test type=%d",
+                   req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
+        return -EIO;
+    } else if (unlikely(out != 0)) {
+        return out;
+    }
+
+    if (copy_to_user(buff_ptr, kbuf, HDIO_DRIVE_CMD_HDR_OFFSET) != 0) {
+        pr_loc_err("Failed to copy WIN_SMART TEST header to user ptr=%p", buff_ptr);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/**
+ * Emulates various SMART data requested via ATA_CMD_SMART method
+ *
+ * SMART responses here assume that original ioctl() failed (since otherwise it would be no point to emulate them). If
+ * you call this function on a drive with functioning SMART it will be ignored and fake smart will be generated for it.
+ *
+ * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
+ * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
+ *
+ * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
+ *         copy to user buffer
+ */
+static int __always_inline handle_ata_cmd_smart(const u8 *req_header, void __user *buff_ptr, struct gendisk *disk)
+{
+    pr_loc_dbg("Got SMART *command* - looking for feature=0x%x", req_header[HDIO_DRIVE_CMD_HDR_FEATURE]);
+
+    switch (req_header[HDIO_DRIVE_CMD_HDR_FEATURE]) {
+        case ATA_SMART_READ_VALUES: //read all SMART values snapshot
+            return populate_ata_smart_values(req_header, buff_ptr, disk);
+
+        case ATA_SMART_READ_THRESHOLDS: //read all SMART thresholds snapshot
+            return populate_ata_smart_thresholds(req_header, buff_ptr);
+
+        case ATA_SMART_ENABLE: //enable previously disabled SMART support
+            pr_loc_wrn("Attempted ATA_SMART_ENABLE modification!");\
+            return 0;
+
+        case WIN_FT_SMART_READ_LOG_SECTOR: //reads offline-stored drive logs
+            return populate_win_smart_log(req_header, buff_ptr, disk);
+
+        case WIN_FT_SMART_IMMEDIATE_OFFLINE: //execute a SMART test
+            return populate_win_smart_exec_test(req_header, buff_ptr, disk);
+
+        default:
+            pr_loc_dbg("Unknown SMART *command* read w/feature=0x%02x", req_header[HDIO_DRIVE_CMD_HDR_FEATURE]);
+            return -EIO;
+    }
+}
+
+/**
+ * Shims various commands launched via HDIO_DRIVE_CMD interface, routing them to individual shims
+ *
+ * This function will shim calls which need to be modified or replaced. All ioctl()s routed here are first executed and
+ * then routed to individual shims. If a given ioctl() is not a one which we're interested in altering the result of a
+ * real ioctl() call to the driver will be returned unaltered.
+ *
+ * To fully understand this function make sure to read HDIO_DRIVE_CMD description provided by kernel developers at
+ * https://www.kernel.org/doc/Documentation/ioctl/hdio.txt
+ */
+static int handle_hdio_drive_cmd_ioctl(sd_ioctl_fn *org, struct block_device *bdev, fmode_t mode, unsigned int cmd,
+                                       void __user *buff_ptr)
+{
+    //Before we execute ioctl we need to save the original header as ioctl will override it (they share buffer)
     u8 req_header[HDIO_DRIVE_CMD_HDR_OFFSET];
     if(unlikely(copy_from_user(req_header, buff_ptr, HDIO_DRIVE_CMD_HDR_OFFSET) != 0)) {
         pr_loc_err("Expected to copy HDIO_DRIVE_CMD header of %d bytes from %p - it failed", HDIO_DRIVE_CMD_HDR_OFFSET,
@@ -689,18 +1261,18 @@ static int handle_hdio_drive_cmd_ioctl(struct block_device *bdev, fmode_t mode,
         return -EIO;
     }
 
-    int ioctl_out = sd_ioctl_org(bdev, mode, cmd, (unsigned long)buff_ptr);
+    int ioctl_out = org(bdev, mode, cmd, (unsigned long)buff_ptr);
     switch (req_header[HDIO_DRIVE_CMD_HDR_CMD]) {
         //this command probes the disk for its overall capabilities; it may have nothing to do with SMART reading but
         // we need to modify it to indicate SMART support
         case ATA_CMD_ID_ATA:
             pr_loc_dbg_ioctl(cmd, "ATA_CMD_ID_ATA", bdev);
-            return handle_ata_cmd_identify(ioctl_out, req_header, buff_ptr, bdev->bd_disk->disk_name);
+            return handle_ata_cmd_identify(ioctl_out, req_header, buff_ptr, bdev->bd_disk);
 
         //this command asks directly for the SMART data of the drive and will fail on drives with no real SMART support
         case ATA_CMD_SMART: //if the drive supports SMART it will just return the data as-is, no need to proxy
             pr_loc_dbg_ioctl(cmd, "ATA_CMD_SMART", bdev);
-            return (ioctl_out == 0) ? 0 : handle_ata_cmd_smart(req_header, buff_ptr);
+            return (ioctl_out == 0) ? 0 : handle_ata_cmd_smart(req_header, buff_ptr, bdev->bd_disk);
 
         //We're only interested in a subset of commands - rest are simply redirected back
         default:
@@ -727,147 +1299,497 @@ static int handle_hdio_drive_cmd_ioctl(struct block_device *bdev, fmode_t mode,
  */
 static int __always_inline handle_ata_task_smart(const u8 *req_header, void __user *buff_ptr)
 {
-    pr_loc_dbg("Got SMART *task* - looking for feature=0x%x", req_header[HDIO_DRIVE_TASK_HDR_FEATURE]);
+    pr_loc_dbg("Got SMART *task* - looking for feature=0x%x", req_header[HDIO_DRIVE_TASK_HDR_FEATURE]);
+
+    switch (req_header[HDIO_DRIVE_TASK_HDR_FEATURE]) {
+        case WIN_FT_SMART_STATUS:
+        case WIN_FT_SMART_AUTOSAVE:
+        case WIN_FT_SMART_AUTO_OFFLINE: { //this must be in brackets, see https://stackoverflow.com/a/18496437
+            //Status-checking commands in WIN_SMART officially work in such a way that if the buffer was unchanged it
+            // means that SMART is OK. However, two static values of 0x4f/0xc2 are used for OK. Here we're taking the
+            // easy (and probably safer) approach by returning the same values.
+            //Smartmontools actually verifies if it's the same as req header as well:
+            // https://github.com/mirror/smartmontools/blob/b63206bc12efb2ae543040b9008f42c037eb1f04/os_linux.cpp#L405
+            u8 rsp_header[HDIO_DRIVE_TASK_HDR_OFFSET] = {
+                [HDIO_DRIVE_TASK_RET_STATUS]  = 0x00,
+                [HDIO_DRIVE_TASK_RET_ERROR]   = 0x00,
+                [HDIO_DRIVE_TASK_RET_SEC_CNT] = req_header[HDIO_DRIVE_TASK_HDR_SEC_CNT],
+                [HDIO_DRIVE_TASK_RET_SEC_NUM] = req_header[HDIO_DRIVE_TASK_HDR_SEC_NUM],
+                [HDIO_DRIVE_TASK_RET_LCYL]    = req_header[HDIO_DRIVE_TASK_HDR_LCYL],
+                [HDIO_DRIVE_TASK_RET_HCYL]    = req_header[HDIO_DRIVE_TASK_HDR_HCYL],
+                [HDIO_DRIVE_TASK_RET_SEL]     = req_header[HDIO_DRIVE_TASK_HDR_SEL],
+            };
+
+            if (copy_to_user(buff_ptr, rsp_header, HDIO_DRIVE_TASK_HDR_OFFSET) != 0) {
+                pr_loc_err("Failed to copy WIN_SMART feature=0x%02x task result packet to user ptr=%p",
+                           req_header[HDIO_DRIVE_TASK_HDR_FEATURE], buff_ptr);
+                return -EFAULT;
+            }
+            return 0;
+        }
+        default:
+            pr_loc_dbg("Unknown SMART *task* read w/feature=0x%02x", req_header[HDIO_DRIVE_TASK_HDR_FEATURE]);
+            return -EIO; //We INTENTIONALLY error-out here as there shouldn't be any other ATA SMART *tasks* requested
+    }
+}
+
+/**
+ * Shims various commands launched via HDIO_DRIVE_TASK interface, routing them to individual shims
+ *
+ * This function will shim calls which need to be modified or replaced. All ioctl()s routed here are first executed and
+ * then routed to individual shims. If a given ioctl() is not a one which we're interested in altering the result of a
+ * real ioctl() call to the driver will be returned unaltered.
+ * This function is used to a very limited subset of commands in the normal circumstances, as see in the smartmontools
+ * code: https://github.com/mirror/smartmontools/blob/b63206bc12efb2ae543040b9008f42c037eb1f04/os_linux.cpp#L379
+ *
+ * To fully understand this function make sure to read HDIO_DRIVE_TASK description provided by kernel developers at
+ * https://www.kernel.org/doc/Documentation/ioctl/hdio.txt
+ */
+static int handle_hdio_drive_task_ioctl(sd_ioctl_fn *org, struct block_device *bdev, fmode_t mode, unsigned int cmd,
+                                        void __user *buff_ptr)
+{
+    //Before we execute ioctl we need to save the original header as ioctl will override it (they share buffer)
+    u8 req_header[HDIO_DRIVE_TASK_HDR_OFFSET];
+    if (unlikely(copy_from_user(req_header, buff_ptr, HDIO_DRIVE_TASK_HDR_OFFSET) != 0)) {
+        pr_loc_err("Expected to copy HDIO_DRIVE_TASK_HDR_OFFSET header of %d bytes from %p - it failed",
+                   HDIO_DRIVE_TASK_HDR_OFFSET,
+                   buff_ptr);
+        return -EIO;
+    }
+
+    int ioctl_out = org(bdev, mode, cmd, (unsigned long)buff_ptr);
+    switch (req_header[HDIO_DRIVE_TASK_HDR_CMD]) {
+        //this command asks directly for the SMART data. From our understanding it's only used for a small subset of
+        // commands. The normal SMART reads/logs/etc are going through HDIO_DRIVE_CMD instead. The only thing [so far]
+        // is the SMART self-reported status which goes via HDIO_DRIVE_TASK route
+        case WIN_CMD_SMART: //if the drive supports SMART it will just return the data as-is, no need to proxy
+            pr_loc_dbg_ioctl(cmd, "WIN_CMD_SMART", bdev);
+            return (ioctl_out == 0) ? 0 : handle_ata_task_smart(req_header, buff_ptr);
+
+        //We're only interested in a subset of commands run via task IOCTL - rest are simply redirected back
+        default:
+            pr_loc_dbg("sd_ioctl(HDIO_DRIVE_TASK ; cmd=0x%02x) => %d - not a hooked cmd, noop",
+                       req_header[HDIO_DRIVE_TASK_HDR_CMD], ioctl_out);
+            return ioctl_out;
+    }
+}
+
+/*********************************** SG_IO with SAT ATA PASS-THROUGH CDBs handling ************************************/
+/**
+ * ATA command decoded from ATA PASS-THROUGH CDB; fields are named after ATA registers
+ */
+struct sat_ata_cmd {
+    u8 command;
+    u8 feature;
+    u8 sec_cnt;
+    u8 lba_low;
+    u8 lba_mid;
+    u8 lba_high;
+    bool ck_cond;
+};
+
+/**
+ * @return true if the CDB is an ATA PASS-THROUGH one (and it was decoded to ata), false otherwise
+ */
+static bool decode_sat_cdb(const u8 *cdb, u8 cdb_len, struct sat_ata_cmd *ata)
+{
+    if (cdb_len >= SAT_ATA_16_LEN && cdb[0] == SAT_ATA_16_OPCODE) { //we don't care about EXTEND (HOB) registers
+        ata->feature = cdb[4];
+        ata->sec_cnt = cdb[6];
+        ata->lba_low = cdb[8];
+        ata->lba_mid = cdb[10];
+        ata->lba_high = cdb[12];
+        ata->command = cdb[14];
+    } else if (cdb_len >= SAT_ATA_12_LEN && cdb[0] == SAT_ATA_12_OPCODE) {
+        ata->feature = cdb[3];
+        ata->sec_cnt = cdb[4];
+        ata->lba_low = cdb[5];
+        ata->lba_mid = cdb[6];
+        ata->lba_high = cdb[7];
+        ata->command = cdb[9];
+    } else {
+        return false;
+    }
+
+    ata->ck_cond = (cdb[SAT_CDB_FLAGS] & SAT_CDB_CK_COND) != 0;
+    return true;
+}
+
+/**
+ * Checks if the device rejected the ATA command (as opposed to e.g. returning ATA registers via CHECK CONDITION)
+ *
+ * @param hdr SG_IO header as returned by the original sd_ioctl()
+ */
+static bool is_sat_cmd_rejected(const struct sg_io_hdr *hdr)
+{
+    if (hdr->host_status != 0)
+        return true;
+
+    if (hdr->status != SAM_STAT_CHECK_CONDITION)
+        return hdr->status != SAM_STAT_GOOD;
+
+    u8 sense[SAT_SENSE_LEN];
+    u8 sense_len = min_t(u8, hdr->sb_len_wr, sizeof(sense));
+    if (sense_len < 3 || copy_from_user(sense, hdr->sbp, sense_len) != 0)
+        return true; //CHECK CONDITION without any sense data is not what a working ATA PASS-THROUGH returns
+
+    u8 sense_key = ((sense[0] & 0x7f) >= 0x72) ? sense[1] & 0x0f : sense[2] & 0x0f; //descriptor vs fixed format
+    return sense_key == ILLEGAL_REQUEST || sense_key == ABORTED_COMMAND;
+}
+
+/**
+ * Completes SG_IO request successfully with given data, the way a SAT-compliant device would
+ *
+ * @param hdr SG_IO header as passed by the user (it will be modified & copied back to arg)
+ * @param data Data to return (w/o any HDIO headers) or NULL if the command has no data
+ */
+static int complete_sat_cmd(struct sg_io_hdr *hdr, void __user *arg, const struct sat_ata_cmd *ata,
+                            const unsigned char *data, unsigned int data_len)
+{
+    if (data) {
+        if (unlikely(hdr->dxfer_direction != SG_DXFER_FROM_DEV || hdr->dxfer_len < data_len)) {
+            pr_loc_err("SG_IO for ATA cmd=0x%02x expects %u bytes of data to be read but got buffer of %u (dir=%d)",
+                       ata->command, data_len, hdr->dxfer_len, hdr->dxfer_direction);
+            return -EINVAL;
+        }
+
+        if (unlikely(copy_to_user(hdr->dxferp, data, data_len) != 0)) {
+            pr_loc_err("Failed to copy ATA cmd=0x%02x data to user ptr=%p", ata->command, hdr->dxferp);
+            return -EFAULT;
+        }
+    } else {
+        data_len = 0;
+    }
+
+    hdr->resid = hdr->dxfer_len - data_len;
+    hdr->status = SAM_STAT_GOOD;
+    hdr->masked_status = 0;
+    hdr->msg_status = 0;
+    hdr->host_status = 0;
+    hdr->driver_status = 0;
+    hdr->sb_len_wr = 0;
+    hdr->info = SG_INFO_OK;
+    hdr->duration = 0;
+
+    //ATA registers are returned as-is, which is what e.g. WIN_FT_SMART_STATUS expects (0x4f/0xc2 = OK)
+    if (ata->ck_cond && hdr->mx_sb_len > 0) {
+        u8 sense[SAT_SENSE_LEN] = {
+            [0] = 0x72, //current error, descriptor format
+            [1] = RECOVERED_ERROR,
+            [3] = SAT_SENSE_ASCQ_ATA_PT_INFO,
+            [7] = SAT_SENSE_LEN - 8, //additional length
+            [8] = SAT_SENSE_DESC_ATA_RET,
+            [9] = SAT_SENSE_LEN - 8 - 2, //descriptor additional length
+            [13] = ata->sec_cnt,
+            [15] = ata->lba_low,
+            [17] = ata->lba_mid,
+            [19] = ata->lba_high,
+            [21] = ATA_DRDY | ATA_DSC, //status: ready, no error
+        };
+
+        hdr->sb_len_wr = min_t(u8, hdr->mx_sb_len, sizeof(sense));
+        if (unlikely(copy_to_user(hdr->sbp, sense, hdr->sb_len_wr) != 0)) {
+            pr_loc_err("Failed to copy ATA cmd=0x%02x sense to user ptr=%p", ata->command, hdr->sbp);
+            return -EFAULT;
+        }
+
+        hdr->status = SAM_STAT_CHECK_CONDITION;
+        hdr->masked_status = SG_MASKED_STATUS_CHECK_CONDITION;
+        hdr->driver_status = SG_DRIVER_SENSE;
+        hdr->info |= SG_INFO_CHECK;
+    }
+
+    if (unlikely(copy_to_user(arg, hdr, sizeof(struct sg_io_hdr)) != 0)) {
+        pr_loc_err("Failed to copy SG_IO header to user ptr=%p", arg);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/**
+ * Inspects IDENTIFY which succeeded on the device, pretending SMART is there (like handle_ata_cmd_identify() does)
+ */
+static int handle_sat_identify_ok(struct gendisk *disk, const struct sg_io_hdr *hdr)
+{
+    if (hdr->dxfer_direction != SG_DXFER_FROM_DEV || hdr->dxfer_len < ATA_SECT_SIZE)
+        return 0; //not something we can (or should) look at
+
+    unsigned char *kbuf = get_ioctl_buffer(); //it's the same object as HDIO IDENTIFY, just without the header
+    if (unlikely(copy_from_user(kbuf, hdr->dxferp, ATA_SECT_SIZE) != 0)) {
+        pr_loc_err("Failed to copy ATA IDENTIFY data from user ptr=%p", hdr->dxferp);
+        put_ioctl_buffer(kbuf);
+        return -EFAULT;
+    }
+
+    int out = 0;
+    u16 *ata_identity = (u16 *)kbuf;
+    if (ata_is_smart_supported(ata_identity) && ata_is_smart_enabled(ata_identity)) {
+        pr_loc_dbg("SG_IO ATA_CMD_ID_ATA confirmed SMART support - noop");
+        mark_native_smart(disk);
+    } else {
+        pr_loc_dbg("SG_IO ATA_CMD_ID_ATA confirmed *no* SMART support - pretending it's there");
+        ata_set_smart_supported(ata_identity);
+        ata_set_smart_enabled(ata_identity);
+        ata_calc_integrity_word(ata_identity);
+        if (unlikely(copy_to_user(hdr->dxferp, kbuf, ATA_SECT_SIZE) != 0)) {
+            pr_loc_err("Failed to copy ATA IDENTIFY data to user ptr=%p", hdr->dxferp);
+            out = -EFAULT;
+        }
+    }
+
+    put_ioctl_buffer(kbuf);
+    return out;
+}
+
+/**
+ * Answers ATA command which was rejected by the device using the same data as HDIO_DRIVE_* emulation
+ *
+ * @return 0 on success, -ENOTTY if the command is not emulated, or -E on error
+ */
+static int emulate_sat_cmd(struct gendisk *disk, struct sg_io_hdr *hdr, void __user *arg,
+                           const struct sat_ata_cmd *ata)
+{
+    if (ata->command == ATA_CMD_ID_ATA || ata->feature == ATA_SMART_READ_VALUES ||
+        ata->feature == WIN_FT_SMART_IMMEDIATE_OFFLINE ||
+        (ata->feature == WIN_FT_SMART_READ_LOG_SECTOR && ata->lba_low == SMART_TEST_LOG_ADDR)) { //per-disk responses
+        mutex_lock(&emulated_disks_lock);
+        struct emulated_disk *entry = get_emulated_disk(disk);
+        int out;
+        if (unlikely(IS_ERR(entry))) {
+            out = PTR_ERR(entry);
+        } else if (ata->command == ATA_CMD_ID_ATA) {
+            out = complete_sat_cmd(hdr, arg, ata, entry->ata_id + HDIO_DRIVE_CMD_HDR_OFFSET, ATA_SECT_SIZE);
+        } else if (ata->feature == ATA_SMART_READ_VALUES) {
+            update_smart_counters(entry);
+            update_self_test(entry);
+            out = complete_sat_cmd(hdr, arg, ata, entry->smart_values + HDIO_DRIVE_CMD_HDR_OFFSET, ATA_SECT_SIZE);
+        } else if (ata->feature == WIN_FT_SMART_IMMEDIATE_OFFLINE) {
+            out = start_self_test(entry, ata->lba_low);
+            if (unlikely(out == -EINVAL)) {
+                pr_loc_dbg("Unexpected SG_IO SMART EXECUTE OFF-LINE with test type=%d", ata->lba_low);
+                out = -ENOTTY;
+            } else if (likely(out == 0)) {
+                out = complete_sat_cmd(hdr, arg, ata, NULL, 0);
+            }
+        } else {
+            update_self_test(entry);
+            out = complete_sat_cmd(hdr, arg, ata, entry->test_log + HDIO_DRIVE_CMD_HDR_OFFSET, ATA_SECT_SIZE);
+        }
+        mutex_unlock(&emulated_disks_lock);
 
-    switch (req_header[HDIO_DRIVE_TASK_HDR_FEATURE]) {
-        case WIN_FT_SMART_STATUS:
-        case WIN_FT_SMART_AUTOSAVE:
-        case WIN_FT_SMART_AUTO_OFFLINE: { //this must be in brackets, see https://stackoverflow.com/a/18496437
-            //Status-checking commands in WIN_SMART officially work in such a way that if the buffer was unchanged it
-            // means that SMART is OK. However, two static values of 0x4f/0xc2 are used for OK. Here we're taking the
-            // easy (and probably safer) approach by returning the same values.
-            //Smartmontools actually verifies if it's the same as req header as well:
-            // https://github.com/mirror/smartmontools/blob/b63206bc12efb2ae543040b9008f42c037eb1f04/os_linux.cpp#L405
-            u8 rsp_header[HDIO_DRIVE_TASK_HDR_OFFSET] = {
-                [HDIO_DRIVE_TASK_RET_STATUS]  = 0x00,
-                [HDIO_DRIVE_TASK_RET_ERROR]   = 0x00,
-                [HDIO_DRIVE_TASK_RET_SEC_CNT] = req_header[HDIO_DRIVE_TASK_HDR_SEC_CNT],
-                [HDIO_DRIVE_TASK_RET_SEC_NUM] = req_header[HDIO_DRIVE_TASK_HDR_SEC_NUM],
-                [HDIO_DRIVE_TASK_RET_LCYL]    = req_header[HDIO_DRIVE_TASK_HDR_LCYL],
-                [HDIO_DRIVE_TASK_RET_HCYL]    = req_header[HDIO_DRIVE_TASK_HDR_HCYL],
-                [HDIO_DRIVE_TASK_RET_SEL]     = req_header[HDIO_DRIVE_TASK_HDR_SEL],
-            };
+        return out;
+    }
 
-            if (copy_to_user(buff_ptr, rsp_header, HDIO_DRIVE_TASK_HDR_OFFSET) != 0) {
-                pr_loc_err("Failed to copy WIN_SMART feature=0x%02x task result packet to user ptr=%p",
-                           req_header[HDIO_DRIVE_TASK_HDR_FEATURE], buff_ptr);
-                return -EFAULT;
+    //only ATA_CMD_SMART is left, see handle_sg_io_ioctl()
+    switch (ata->feature) {
+
+        case ATA_SMART_READ_THRESHOLDS:
+            return complete_sat_cmd(hdr, arg, ata, smart_thresholds_tpl + HDIO_DRIVE_CMD_HDR_OFFSET, ATA_SECT_SIZE);
+
+        case WIN_FT_SMART_READ_LOG_SECTOR: {
+            const unsigned char *log_tpl = get_smart_log_tpl(ata->lba_low);
+            if (!log_tpl) {
+                pr_loc_dbg("Unexpected SG_IO SMART READ LOG with log_addr=%d", ata->lba_low);
+                return -ENOTTY;
             }
-            return 0;
+
+            return complete_sat_cmd(hdr, arg, ata, log_tpl + HDIO_DRIVE_CMD_HDR_OFFSET, ATA_SECT_SIZE);
         }
+
+        case ATA_SMART_ENABLE:
+        case WIN_FT_SMART_STATUS:
+        case WIN_FT_SMART_AUTOSAVE:
+        case WIN_FT_SMART_AUTO_OFFLINE:
+            return complete_sat_cmd(hdr, arg, ata, NULL, 0);
+
         default:
-            pr_loc_dbg("Unknown SMART *task* read w/feature=0x%02x", req_header[HDIO_DRIVE_TASK_HDR_FEATURE]);
-            return -EIO; //We INTENTIONALLY error-out here as there shouldn't be any other ATA SMART *tasks* requested
+            pr_loc_dbg("Unknown SG_IO SMART command w/feature=0x%02x", ata->feature);
+            return -ENOTTY;
     }
 }
 
 /**
- * Shims various commands launched via HDIO_DRIVE_TASK interface, routing them to individual shims
- *
- * This function will shim calls which need to be modified or replaced. All ioctl()s routed here are first executed and
- * then routed to individual shims. If a given ioctl() is not a one which we're interested in altering the result of a
- * real ioctl() call to the driver will be returned unaltered.
- * This function is used to a very limited subset of commands in the normal circumstances, as see in the smartmontools
- * code: https://github.com/mirror/smartmontools/blob/b63206bc12efb2ae543040b9008f42c037eb1f04/os_linux.cpp#L379
+ * Shims SG_IO carrying SAT ATA PASS-THROUGH CDBs, answering SMART-related ATA commands rejected by the device
  *
- * To fully understand this function make sure to read HDIO_DRIVE_TASK description provided by kernel developers at
- * https://www.kernel.org/doc/Documentation/ioctl/hdio.txt
+ * Like with HDIO_DRIVE_* the ioctl() is always executed first. Only when it completed (i.e. it wasn't e.g. denied) but
+ * the device rejected the ATA command the response is emulated. All other SG_IO calls are passed as-is.
  */
-static int
-handle_hdio_drive_task_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, void __user *buff_ptr)
+static int handle_sg_io_ioctl(sd_ioctl_fn *org, struct block_device *bdev, fmode_t mode, unsigned int cmd,
+                              void __user *arg)
 {
-    //Before we execute ioctl we need to save the original header as ioctl will override it (they share buffer)
-    u8 req_header[HDIO_DRIVE_TASK_HDR_OFFSET];
-    if (unlikely(copy_from_user(req_header, buff_ptr, HDIO_DRIVE_TASK_HDR_OFFSET) != 0)) {
-        pr_loc_err("Expected to copy HDIO_DRIVE_TASK_HDR_OFFSET header of %d bytes from %p - it failed",
-                   HDIO_DRIVE_TASK_HDR_OFFSET,
-                   buff_ptr);
-        return -EIO;
-    }
+    struct sg_io_hdr hdr;
+    struct sat_ata_cmd ata;
+    u8 cdb[SAT_ATA_16_LEN];
+
+    //Anything which doesn't look like ATA PASS-THROUGH goes to the driver, which will also complain about bad requests
+    if (copy_from_user(&hdr, arg, sizeof(hdr)) != 0 || hdr.interface_id != 'S' || hdr.iovec_count != 0 ||
+        hdr.cmd_len < SAT_ATA_12_LEN || hdr.cmd_len > sizeof(cdb) || copy_from_user(cdb, hdr.cmdp, hdr.cmd_len) != 0 ||
+        !decode_sat_cdb(cdb, hdr.cmd_len, &ata) || (ata.command != ATA_CMD_ID_ATA && ata.command != ATA_CMD_SMART))
+        return org(bdev, mode, cmd, (unsigned long)arg);
+
+    pr_loc_dbg_ioctl(cmd, "SG_IO ATA PASS-THROUGH", bdev);
+    int ioctl_out = org(bdev, mode, cmd, (unsigned long)arg);
+    if (ioctl_out != 0)
+        return ioctl_out; //e.g. permissions - we shouldn't pretend anything
+
+    struct sg_io_hdr rsp_hdr;
+    if (unlikely(copy_from_user(&rsp_hdr, arg, sizeof(rsp_hdr)) != 0))
+        return -EFAULT;
 
-    int ioctl_out = sd_ioctl_org(bdev, mode, cmd, (unsigned long)buff_ptr);
-    switch (req_header[HDIO_DRIVE_TASK_HDR_CMD]) {
-        //this command asks directly for the SMART data. From our understanding it's only used for a small subset of
-        // commands. The normal SMART reads/logs/etc are going through HDIO_DRIVE_CMD instead. The only thing [so far]
-        // is the SMART self-reported status which goes via HDIO_DRIVE_TASK route
-        case WIN_CMD_SMART: //if the drive supports SMART it will just return the data as-is, no need to proxy
-            pr_loc_dbg_ioctl(cmd, "WIN_CMD_SMART", bdev);
-            return (ioctl_out == 0) ? 0 : handle_ata_task_smart(req_header, buff_ptr);
+    if (!is_sat_cmd_rejected(&rsp_hdr))
+        return (ata.command == ATA_CMD_ID_ATA) ? handle_sat_identify_ok(bdev->bd_disk, &rsp_hdr) : 0;
 
-        //We're only interested in a subset of commands run via task IOCTL - rest are simply redirected back
-        default:
-            pr_loc_dbg("sd_ioctl(HDIO_DRIVE_TASK ; cmd=0x%02x) => %d - not a hooked cmd, noop",
-                       req_header[HDIO_DRIVE_TASK_HDR_CMD], ioctl_out);
-            return ioctl_out;
-    }
+    pr_loc_dbg("SG_IO ATA cmd=0x%02x feature=0x%02x rejected by /dev/%s - emulating", ata.command, ata.feature,
+               bdev->bd_disk->disk_name);
+    int out = emulate_sat_cmd(bdev->bd_disk, &hdr, arg, &ata);
+
+    return (out == -ENOTTY) ? ioctl_out : out; //not emulated = leave the device response as-is
 }
 
 /********************************** ioctl() handling re-routing from driver to shim ***********************************/
-//These are called from each other so we need to predeclare them
-int sd_ioctl_canary_install(void);
-int sd_ioctl_canary_uninstall(void);
+/**
+ * Pins the module owning block device ops before the shim is installed into them
+ *
+ * The ops (and the original ioctl) go away with the driver module, while open block devices hold it only as long as
+ * they're open. The shim is usually installed as soon as the driver registers, i.e. while its module is still being
+ * initialized, and try_module_get() refuses such modules.
+ *
+ * @return true if pinned (or compiled-in), false if the module is going away
+ */
+static bool pin_fops_owner(const struct block_device_operations *fops)
+{
+    struct module *owner = fops->owner;
+    if (!owner || try_module_get(owner))
+        return true;
+
+    if (owner->state != MODULE_STATE_COMING)
+        return false;
+
+    __module_get(owner);
+    return true;
+}
 
 /**
  * Filters/proxies/emulates device IOCTLs as needed for emulating SMART
  *
- * This shim is installed just before the first IOCTL from the userspace.
+ * This shim is installed in sd_fops as soon as the "sd" driver is available (see sd_ioctl_smart_shim_install()).
  */
-static int sd_ioctl_smart_shim(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg)
+static int handle_sd_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg)
 {
 #ifdef DBG_SMART_PRINT_ALL_IOCTL
     pr_loc_dbg("Handling ioctl(0x%02x) for /dev/%s", cmd, bdev->bd_disk->disk_name);
 #endif
 
-    if (unlikely(!sd_ioctl_org)) {
+    //Uninstalling the shim doesn't wait for ioctls in flight, so the original must be read only once
+    sd_ioctl_fn *org = READ_ONCE(sd_ioctl_org);
+    if (unlikely(!org)) {
         pr_loc_bug("Called %s but no original sd_ioctl() address is known", __FUNCTION__);
         return -EIO;
     }
 
     switch (cmd) {
         case HDIO_DRIVE_CMD: //"a special drive command" as per hdreg.h
-            return handle_hdio_drive_cmd_ioctl(bdev, mode, cmd, (void *)arg);
+            if (is_native_smart(bdev->bd_disk))
+                return org(bdev, mode, cmd, arg);
+
+            return handle_hdio_drive_cmd_ioctl(org, bdev, mode, cmd, (void *)arg);
 
         case HDIO_DRIVE_TASK: //"execute task and special drive command" as per Documentation/ioctl/hdio.txt
-            return handle_hdio_drive_task_ioctl(bdev, mode, cmd, (void *)arg);
+            if (is_native_smart(bdev->bd_disk))
+                return org(bdev, mode, cmd, arg);
+
+            return handle_hdio_drive_task_ioctl(org, bdev, mode, cmd, (void *)arg);
+
+        case SG_IO: //used by modern tools with SAT ATA PASS-THROUGH CDBs
+            if (is_native_smart(bdev->bd_disk))
+                return org(bdev, mode, cmd, arg);
+
+            return handle_sg_io_ioctl(org, bdev, mode, cmd, (void *)arg);
 
         default: //any other ioctls are proxied as-is
 #       ifdef DBG_SMART_PRINT_ALL_IOCTL
             pr_loc_dbg("sd_ioctl(0x%02x) - not a hooked ioctl, noop", cmd);
 #       endif
-            return sd_ioctl_org(bdev, mode, cmd, arg);
+            return org(bdev, mode, cmd, arg);
     }
 }
 
+static RP_METRIC(smart_sd_ioctls, RP_MG_SMART, RP_METRIC_COUNTER);
+static RP_METRIC(smart_sd_ioctl_ns, RP_MG_SMART, RP_METRIC_HISTOGRAM);
+static struct rp_metric *const smart_metrics[] = { &smart_sd_ioctls, &smart_sd_ioctl_ns, &smart_native_disks };
+
+//like sd_ioctl_org it outlives the uninstall (ioctls in flight may still use it) and is reused by the next install
+static struct ovs_stats *sd_ioctl_stats = NULL;
+static int sd_ioctl_smart_shim(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg)
+{
+    struct ovs_stats *stats = READ_ONCE(sd_ioctl_stats);
+    ovs_stats_time_begin(start);
+    rp_metric_time_begin(metric_start);
+    int out = handle_sd_ioctl(bdev, mode, cmd, arg);
+    rp_metric_time_end(&smart_sd_ioctl_ns, metric_start);
+    rp_metric_inc(&smart_sd_ioctls);
+    ovs_stats_time_end(stats, start);
+
+    return out;
+}
+
 /**
  * Installs a permanent shim into the sd driver ops
  *
- * Keep in mind this function works only if the sd_fops address has been populated. It's normally done by the canary
- * (sd_ioctl_canary()) which is installed by sd_ioctl_canary_install().
+ * The sd_fops (drivers/scsi/sd.c) are shared by all sd disks, so replacing ->ioctl there reroutes every ioctl() to a
+ * /dev/sdX device without any trampolines. The pointer is swapped with a single atomic store, so every ioctl() either
+ * lands in the original sd_ioctl() or in the shim - there's no window where the ops are half-modified.
+ * This function works only if the sd_fops symbol is available, i.e. after the "sd" driver is loaded (or when it's
+ * compiled-in).
  *
  * @return 0 on success; -E on error
  */
-int sd_ioctl_smart_shim_install(void)
+static int sd_ioctl_smart_shim_install(void)
 {
-    if (unlikely(!sd_fops)) {
-        pr_loc_bug("Gendisk has no ops (yet?)"); //this could happen if IOCTL somehow arrived before sd_probe_async()
-        return -EIO;
+    if (unlikely(sd_fops)) {
+        pr_loc_bug("sd_ioctl() SMART shim was already installed");
+        return 0;
+    }
+
+    struct block_device_operations *fops = (void *)kln_cached("sd_fops"); //forcefully remove "const" protection here
+    if (unlikely(!fops)) {
+        pr_loc_err("Failed to locate sd_fops - the \"%s\" driver is not loaded", SCSI_DRV_NAME);
+        return -ENOENT;
     }
 
     //This shouldn't happen - it can only be the case if LKM is unloaded without cleanup (or cleanup is broken)
-    if (unlikely(sd_fops->ioctl == sd_ioctl_smart_shim)) {
-        pr_loc_bug("sd_ioctl() SMART shim was already installed");
-        return 0;
+    if (unlikely(fops->ioctl == sd_ioctl_smart_shim)) {
+        pr_loc_bug("sd_ioctl() SMART shim was already installed by someone else");
+        return -EEXIST;
+    }
+
+    if (unlikely(!pin_fops_owner(fops))) {
+        pr_loc_err("The \"%s\" driver is being unloaded", SCSI_DRV_NAME);
+        return -ENOENT;
     }
 
-    pr_loc_dbg("Rerouting sd_fops->ioctl<%p>=%pF<%p> to %pF<%p>", &sd_fops->ioctl, sd_fops->ioctl, sd_fops->ioctl,
+    pr_loc_dbg("Rerouting sd_fops->ioctl<%p>=%pF<%p> to %pF<%p>", &fops->ioctl, fops->ioctl, fops->ioctl,
                sd_ioctl_smart_shim, sd_ioctl_smart_shim);
-    sd_ioctl_org = sd_fops->ioctl;
+    sd_ioctl_org = fops->ioctl;
+    if (!sd_ioctl_stats)
+        sd_ioctl_stats = ovs_stats_create("sd_ioctl_smart_shim", sd_ioctl_smart_shim);
+    smp_wmb(); //sd_ioctl_org must be visible before the first call lands in the shim
 
+    typeof(sd_ioctl_org) prev_ioctl;
     WITH_MEM_UNLOCKED(
-        &sd_fops->ioctl, sizeof(void *),
-        sd_fops->ioctl = sd_ioctl_smart_shim;
+        &fops->ioctl, sizeof(void *),
+        prev_ioctl = cmpxchg(&fops->ioctl, sd_ioctl_org, sd_ioctl_smart_shim);
     );
 
+    if (unlikely(prev_ioctl != sd_ioctl_org)) {
+        pr_loc_err("sd_fops->ioctl changed to %pF<%p> while installing the shim", prev_ioctl, prev_ioctl);
+        sd_ioctl_org = NULL;
+        module_put(fops->owner);
+        return -EBUSY;
+    }
+
+    sd_fops = fops;
     return 0;
 }
 
@@ -878,7 +1800,7 @@ int sd_ioctl_smart_shim_install(void)
  *
  * @return 0 on success or noop; -E on error
  */
-int sd_ioctl_smart_shim_uninstall(void)
+static int sd_ioctl_smart_shim_uninstall(void)
 {
     //sd_fops is not saved - nothing to restore
     if (unlikely(!sd_fops))
@@ -892,192 +1814,528 @@ int sd_ioctl_smart_shim_uninstall(void)
     pr_loc_dbg("Restoring sd_fops->ioctl<%p>=%pF<%p> to %pF<%p>", &sd_fops->ioctl, sd_fops->ioctl, sd_fops->ioctl,
                sd_ioctl_org, sd_ioctl_org);
 
+    typeof(sd_ioctl_org) prev_ioctl;
     WITH_MEM_UNLOCKED(
         &sd_fops->ioctl, sizeof(void *),
-        sd_fops->ioctl = sd_ioctl_org;
+        prev_ioctl = cmpxchg(&sd_fops->ioctl, sd_ioctl_smart_shim, sd_ioctl_org);
     );
 
-    sd_ioctl_org = NULL;
+    if (unlikely(prev_ioctl != sd_ioctl_smart_shim)) {
+        //somebody replaced us - restoring would break them; sd_ioctl_org must stay as they may be calling the shim
+        pr_loc_err("sd_fops->ioctl was changed to %pF<%p> by someone else - cannot restore", prev_ioctl, prev_ioctl);
+        return -EBUSY; //the module stays pinned as the shim may still be called
+    }
+
+    //sd_ioctl_org & sd_ioctl_stats are deliberately left in place: ioctls can sleep, so there's no grace period to
+    // wait for before the ones already in the shim are done with them
+    module_put(sd_fops->owner);
     sd_fops = NULL;
 
     return 0;
 }
 
 /**
- * Awaits any SCSI ioctl() to override the ioctl handler in sd_fops.ioctl (drivers/scsi/sd.c)
- *
- * What is essentially does it awaits the first call from the userspace to trigger chain landing in sd_ioctl(), which
- * will be any program attempting to do an ioctl() on /dev/sdX. Then it gets gendisk from block_device passed, which in
- * turn contains a pointer to the same-for-all sd_fops. Having this pointer lets us replace ->ioctl pointer to finally
- * shim the sd_ioctl() pathway. This is done to AVOID using override_symbol:call_overridden_symbol() which isn't really
- * that multi-thread safe and actually pretty slow. The last thing we want is slowing down IOCTLs on a storage system.
- * Using this strange routine above installs a fast IOCTL filter to e.g. respond to SMARTs.
- *
- * While this method isn't really clear other ones are even worse. To find sd_fops we need to get at least one
- * FULLY INITIALIZED gendisk, which is complicated. During sd_probe() the gendisk is only partially built (i.e. it lacks
- * sd_fops...). These other parts are populated in delayed/scheduled sd_probe_async(). So the number of permutations is
- * quite large, as we need to consider the following states of the system:
- *  - no driver loaded
- *  - driver loaded, no drives yet
- *  - driver loaded, 1 drive which is not initialized yet
- *  - driver loaded, >1 drive, one initialized and one not
- *  - driver loaded, 1 drive which is initialized
- *  - ...... you see the point?
- *
- *  This whole thing would be much easier if we could get scsi_disk structure, but it's a private one (and heavily
- *  modified with MY_ABC_HERE).
+ * Installs the shim when the "sd" driver is loaded as a module after this shim was registered
  */
-static int sd_ioctl_canary(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg)
+static void sd_ready(struct device_driver *drv, void *data)
 {
-    int out;
-    spin_lock(&sd_ioctl_canary_lock);
-
-    pr_loc_dbg("%s triggered for first ioctl()", __FUNCTION__);
-    //if the override of the symbol is no longer present it means that before we've got the lock another canary was
-    // processing another IOCTL and did what the canary needed to do - we can safely redirect
-    if (unlikely(!sd_ioctl_canary_ovs)) {
-        if (unlikely(!sd_fops)) {
-            pr_loc_bug("Canary is already processed after obtaining lock BUT fops aren't here - the canary is broken");
-            return -EIO; //we don't really know the state
+    pr_loc_dbg("%s driver loaded - installing SMART shim", SCSI_DRV_NAME);
+    sd_ioctl_smart_shim_install(); //it will log what's wrong
+}
+
+/******************************************* NVMe SMART/Health log emulation ******************************************/
+//NVMe namespaces don't go through the sd driver. Tools ask them for the SMART/Health log using the admin GET LOG PAGE
+// command sent over NVME_IOCTL_ADMIN_CMD ioctl to the namespace block device. When the controller doesn't support it
+// (e.g. an emulated/passed-through one) the command fails and is retried over and over.
+#define NVME_DRV_NAME "nvme"
+#define NVME_ADMIN_GET_LOG_PAGE 0x02 //as per NVMe 1.2 sec. 5.10
+#define NVME_LOG_SMART 0x02 //SMART / Health Information log identifier
+#define NVME_SMART_LOG_SIZE 512
+#define NVME_SMART_TEMP_KELVIN 313 //40C
+#define NVME_SMART_SPARE 100 //%
+#define NVME_SMART_SPARE_THRESH 10 //%
+
+static unsigned char nvme_smart_log_tpl[NVME_SMART_LOG_SIZE];
+
+/**
+ * Builds fake SMART / Health Information log page; see Figure 79 in NVMe 1.2 specs
+ */
+static void build_nvme_smart_log(void)
+{
+    memset(nvme_smart_log_tpl, 0, sizeof(nvme_smart_log_tpl));
+    nvme_smart_log_tpl[0] = 0x00; //critical warning: none
+    put_unaligned_le16(NVME_SMART_TEMP_KELVIN, &nvme_smart_log_tpl[1]);
+    nvme_smart_log_tpl[3] = NVME_SMART_SPARE;
+    nvme_smart_log_tpl[4] = NVME_SMART_SPARE_THRESH;
+    nvme_smart_log_tpl[5] = 0; //percentage used
+    //everything else are 128-bit counters - power cycles & power on hours are set by update_nvme_smart_counters()
+}
+
+/**
+ * Fake SMART log of a single NVMe namespace
+ *
+ * Entries are created only for namespaces which failed to respond to GET LOG PAGE natively. NVMe namespaces are not
+ * visible to the SCSI notifier, so entries are removed when their disk is removed from the "block" class (see
+ * on_block_dev_removed()); otherwise a new namespace could get a gendisk of the removed one & inherit its log.
+ */
+struct emulated_nvme_ns {
+    struct list_head list;
+    struct gendisk *disk;
+    char disk_name[DISK_NAME_LEN];
+    unsigned char smart_log[NVME_SMART_LOG_SIZE];
+    unsigned long base_jiffies; //when the base_poh was calculated
+    u32 base_poh; //power-on hours at base_jiffies
+    u32 log_poh; //power-on hours currently in smart_log
+    bool state_restored; //see restore_nvme_ns_state()
+};
+
+static LIST_HEAD(emulated_nvme_ns_list); //protected with emulated_disks_lock
+
+static inline u32 get_nvme_ns_poh(const struct emulated_nvme_ns *entry)
+{
+    return entry->base_poh + (u32)((jiffies - entry->base_jiffies) / (3600UL * HZ));
+}
+
+/**
+ * Works the same way as restore_disk_state() for ATA disks; emulated_disks_lock must be held
+ *
+ * Real IDENTIFY of a namespace is passed through as-is, so the state is keyed by the namespace name and not its serial.
+ */
+static void restore_nvme_ns_state(struct emulated_nvme_ns *entry)
+{
+    u32 poh;
+    int out = smart_state_get(entry->disk_name, &poh, NULL);
+    if (out == -EAGAIN)
+        return;
+
+    entry->state_restored = true;
+    if (out == 0 && poh > get_nvme_ns_poh(entry)) {
+        entry->base_jiffies = jiffies;
+        entry->base_poh = poh;
+    }
+}
+
+/**
+ * Gets fake SMART log of a namespace; emulated_disks_lock must be held
+ *
+ * @param create Whether to create the entry if it doesn't exist
+ *
+ * @return entry, NULL if not found (and create=false), or ERR_PTR(-E) on error
+ */
+static struct emulated_nvme_ns *get_emulated_nvme_ns(struct gendisk *disk, bool create)
+{
+    struct emulated_nvme_ns *entry;
+    list_for_each_entry(entry, &emulated_nvme_ns_list, list) {
+        if (entry->disk == disk && strcmp(entry->disk_name, disk->disk_name) == 0) {
+            if (unlikely(!entry->state_restored))
+                restore_nvme_ns_state(entry);
+            return entry;
         }
+    }
+
+    if (!create)
+        return NULL;
+
+    kmalloc_or_exit_ptr(entry, sizeof(struct emulated_nvme_ns), RP_MEM_SMART);
+    entry->disk = disk;
+    strscpy(entry->disk_name, disk->disk_name, DISK_NAME_LEN);
+    memcpy(entry->smart_log, nvme_smart_log_tpl, sizeof(nvme_smart_log_tpl));
+    entry->base_jiffies = jiffies;
+    entry->base_poh = get_base_poh();
+    entry->log_poh = 0;
+    entry->state_restored = false;
+    restore_nvme_ns_state(entry);
+    list_add(&entry->list, &emulated_nvme_ns_list);
+
+    return entry;
+}
+
+/**
+ * Updates counters in SMART log of a namespace; emulated_disks_lock must be held
+ *
+ * Works the same way as update_smart_counters() for ATA disks. Counters are 128-bit LE numbers but we use only 32 bits.
+ */
+static void update_nvme_smart_counters(struct emulated_nvme_ns *entry)
+{
+    u32 poh = get_nvme_ns_poh(entry);
+    if (likely(poh == entry->log_poh))
+        return;
+
+    put_unaligned_le32(1 + poh / SMART_POH_PER_POWER_CYCLE, &entry->smart_log[112]); //power cycles
+    put_unaligned_le32(poh, &entry->smart_log[128]); //power on hours
+    entry->log_poh = poh;
+    if (entry->state_restored)
+        smart_state_put(entry->disk_name, poh, NULL);
+}
+
+static void free_emulated_nvme_ns(void)
+{
+    struct emulated_nvme_ns *entry, *tmp;
 
-        pr_loc_dbg("Canary is already processed after obtaining lock - proxying to sd_fops->ioctl directly");
-        goto proxy_ioctl;
+    mutex_lock(&emulated_disks_lock);
+    list_for_each_entry_safe(entry, tmp, &emulated_nvme_ns_list, list) {
+        list_del(&entry->list);
+        rp_kfree(entry, RP_MEM_SMART);
     }
+    mutex_unlock(&emulated_disks_lock);
+}
 
-    if (unlikely(!bdev)) {
-        pr_loc_bug("NULL block_device passed to %s", __FUNCTION__);
-        return -EIO;
+/**
+ * Removes fake SMART logs of namespaces which went away
+ */
+static void on_block_dev_removed(struct device *dev, struct class_interface *intf)
+{
+    struct gendisk *disk = dev_to_disk(dev); //partitions are in the class too - these will simply not match
+    struct emulated_nvme_ns *entry, *tmp;
+
+    mutex_lock(&emulated_disks_lock);
+    list_for_each_entry_safe(entry, tmp, &emulated_nvme_ns_list, list) {
+        if (entry->disk == disk) {
+            pr_loc_dbg("Removing cached fake SMART log of /dev/%s", entry->disk_name);
+            list_del(&entry->list);
+            rp_kfree(entry, RP_MEM_SMART);
+        }
     }
+    mutex_unlock(&emulated_disks_lock);
+}
 
-    struct gendisk *disk = bdev->bd_disk;
-    if (unlikely(!disk)) {
-        pr_loc_bug("block_device w/o gendisk found");
-        return -EIO;
+static struct class_interface block_dev_watcher = {
+    .remove_dev = on_block_dev_removed,
+};
+static bool block_dev_watched = false;
+
+/**
+ * Starts watching for removal of namespaces (see struct emulated_nvme_ns)
+ *
+ * @return 0 on success or -E on error
+ */
+static int watch_nvme_ns_removal(void)
+{
+    struct class *block_class_ptr = (void *)kln_cached("block_class"); //not exported
+    if (unlikely(!block_class_ptr)) {
+        pr_loc_err("Failed to locate block_class");
+        return -ENOENT;
     }
 
-    sd_fops = (void *)disk->fops; //forcefully remove "const" protection here
-    out = sd_ioctl_smart_shim_install();
-    if (out != 0) {
-        pr_loc_err("Failed to install proper SMART shim");
-        return -EIO;
+    block_dev_watcher.class = block_class_ptr;
+    int out = class_interface_register(&block_dev_watcher);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to register block class interface - error=%d", out);
+        return out;
     }
 
-    out = sd_ioctl_canary_uninstall(); //it will log what's wrong
-    spin_unlock(&sd_ioctl_canary_lock);
-    if (out != 0)
-        return -EIO; //we cannot continue as the sd_ioctl() wasn't restored and calling the shim can cause infinite loop
+    block_dev_watched = true;
+    return 0;
+}
+
+static void unwatch_nvme_ns_removal(void)
+{
+    if (!block_dev_watched)
+        return;
+
+    class_interface_unregister(&block_dev_watcher);
+    block_dev_watched = false;
+}
+
+/**
+ * Completes GET LOG PAGE admin command from the namespace fake SMART log; emulated_disks_lock must be held
+ *
+ * @return 0 on success or -E on error
+ */
+static int complete_nvme_smart_log_cmd(struct emulated_nvme_ns *entry, struct nvme_admin_cmd *cmd,
+                                       struct nvme_admin_cmd __user *ucmd)
+{
+    update_nvme_smart_counters(entry);
+
+    //NUMD is 0-based count of dwords (bits 27:16 of CDW10)
+    u32 len = min_t(u32, cmd->data_len, (((cmd->cdw10 >> 16) & 0xfff) + 1) * 4);
+    if (copy_to_user((void __user *)(uintptr_t)cmd->addr, entry->smart_log, min_t(u32, len, NVME_SMART_LOG_SIZE))) {
+        pr_loc_err("Failed to copy NVMe SMART log to user ptr=%p", (void *)(uintptr_t)cmd->addr);
+        return -EFAULT;
+    }
 
-    proxy_ioctl:
-    pr_loc_dbg("Canary finished - routing to sd_fops->ioctl = %pF<%p>", sd_fops->ioctl, sd_fops->ioctl);
-    return sd_fops->ioctl(bdev, mode, cmd, arg);
+    if (unlikely(put_user(0, &ucmd->result) != 0))
+        return -EFAULT;
+
+    return 0;
 }
 
+static int (*nvme_ioctl_org) (struct block_device *, fmode_t, unsigned, unsigned long) = NULL;
+static struct block_device_operations *nvme_fops = NULL; //ptr to nvme driver nvme_fops [to restore nvme_ioctl]
+static driver_ready_request *nvme_driver_req = NULL; //set when waiting for "nvme" module to load
+
 /**
- * Installs a temporary sd_ioctl() replacement to capture sd_fops used to install permanent shim
+ * Emulates SMART / Health log GET LOG PAGE for namespaces which don't support it; other commands are proxied as-is
  *
- * This function is used to replace sd_ioctl() with sd_ioctl_canary(). The purpose of this is to capture sd_fops on a
- * first ioctl() from userspace. Then this temporary canary is replaced with a real one (the sd_ioctl_smart_shim()).
- * That two-step process is here because we don't have a sane way of obtaining sd_fops (see the function comment for
- * sd_ioctl_canary() to learn about the details) and using override_symbol method makes calls to the original sd_ioctl()
- * slow and potentially prone to multithreading problems.
+ * The command is first sent to the device. Only when the device completes it with an error status (positive return
+ * value) the namespace is remembered and all subsequent requests for the log are served from the cache without touching
+ * the device. Negative errors (permissions, copy faults, timeouts, resets...) are not a proof the log isn't supported.
+ */
+static int nvme_ioctl_smart_shim(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg)
+{
+    if (cmd != NVME_IOCTL_ADMIN_CMD)
+        return nvme_ioctl_org(bdev, mode, cmd, arg);
+
+    struct nvme_admin_cmd __user *ucmd = (void __user *)arg;
+    struct nvme_admin_cmd admin_cmd;
+    if (copy_from_user(&admin_cmd, ucmd, sizeof(admin_cmd)) != 0 || admin_cmd.opcode != NVME_ADMIN_GET_LOG_PAGE ||
+        (admin_cmd.cdw10 & 0xff) != NVME_LOG_SMART)
+        return nvme_ioctl_org(bdev, mode, cmd, arg); //it will handle copy errors too
+
+    int out;
+    mutex_lock(&emulated_disks_lock);
+    struct emulated_nvme_ns *entry = get_emulated_nvme_ns(bdev->bd_disk, false);
+    mutex_unlock(&emulated_disks_lock); //entry is only checked for existence - it's looked up again below
+
+    if (likely(!entry)) {
+        out = nvme_ioctl_org(bdev, mode, cmd, arg);
+        if (out <= 0)
+            return out;
+
+        pr_loc_dbg("GET LOG PAGE for SMART log failed on /dev/%s (status=%d) - emulating", bdev->bd_disk->disk_name,
+                   out);
+    }
+
+    mutex_lock(&emulated_disks_lock);
+    entry = get_emulated_nvme_ns(bdev->bd_disk, true);
+    out = IS_ERR(entry) ? PTR_ERR(entry) : complete_nvme_smart_log_cmd(entry, &admin_cmd, ucmd);
+    mutex_unlock(&emulated_disks_lock);
+
+    return out;
+}
+
+/**
+ * Installs the shim into NVMe driver block device ops; see sd_ioctl_smart_shim_install() for details
  *
  * @return 0 on success; -E on error
  */
-int sd_ioctl_canary_install(void)
+static int nvme_ioctl_smart_shim_install(void)
 {
-    if (unlikely(sd_ioctl_canary_ovs)) {
-        pr_loc_bug("Canary already installed");
-        return 0; //technically not a full-blown failure
+    if (unlikely(nvme_fops)) {
+        pr_loc_bug("nvme_ioctl() SMART shim was already installed");
+        return 0;
     }
 
-    spin_lock_init(&sd_ioctl_canary_lock);
-    sd_ioctl_canary_ovs = override_symbol("sd_ioctl", sd_ioctl_canary);
-    if (IS_ERR(sd_ioctl_canary_ovs)) {
-        pr_loc_err("Failed to install sd_ioctl() canary");
-        int out = PTR_ERR(sd_ioctl_canary_ovs);
-        sd_ioctl_canary_ovs = NULL;
-        return out;
+    struct block_device_operations *fops = (void *)kln_cached("nvme_fops");
+    if (unlikely(!fops)) {
+        pr_loc_err("Failed to locate nvme_fops - the \"%s\" driver is not loaded", NVME_DRV_NAME);
+        return -ENOENT;
+    }
+
+    if (unlikely(!pin_fops_owner(fops))) {
+        pr_loc_err("The \"%s\" driver is being unloaded", NVME_DRV_NAME);
+        return -ENOENT;
+    }
+
+    nvme_ioctl_org = fops->ioctl;
+    smp_wmb(); //nvme_ioctl_org must be visible before the first call lands in the shim
+
+    typeof(nvme_ioctl_org) prev_ioctl;
+    WITH_MEM_UNLOCKED(
+        &fops->ioctl, sizeof(void *),
+        prev_ioctl = cmpxchg(&fops->ioctl, nvme_ioctl_org, nvme_ioctl_smart_shim);
+    );
+
+    if (unlikely(prev_ioctl != nvme_ioctl_org)) {
+        pr_loc_err("nvme_fops->ioctl changed to %pF<%p> while installing the shim", prev_ioctl, prev_ioctl);
+        nvme_ioctl_org = NULL;
+        module_put(fops->owner);
+        return -EBUSY;
     }
 
+    pr_loc_dbg("Rerouted nvme_fops->ioctl<%p>=%pF<%p> to %pF<%p>", &fops->ioctl, nvme_ioctl_org, nvme_ioctl_org,
+               nvme_ioctl_smart_shim, nvme_ioctl_smart_shim);
+    nvme_fops = fops;
     return 0;
 }
 
 /**
- * Removes the temporary shim installed via sd_ioctl_canary_install() (if installed)
- *
- * If called with shim not installed it will noop by design. It will noop if the shim was never installed or if it was
- * already replaced with the permanent shim.
+ * Removes the shim installed by nvme_ioctl_smart_shim_install() (if installed)
  *
  * @return 0 on success or noop; -E on error
  */
-int sd_ioctl_canary_uninstall(void)
+static int nvme_ioctl_smart_shim_uninstall(void)
 {
-    //this isn't an error failure - it will most likely happen when unregistering this shim after first ioctl
-    if (unlikely(!sd_ioctl_canary_ovs))
+    if (!nvme_fops)
         return 0;
 
-    int out = restore_symbol(sd_ioctl_canary_ovs);
-    if (out != 0) {
-        pr_loc_err("Failed to uninstall sd_ioctl() canary");
-        return out;
+    typeof(nvme_ioctl_org) prev_ioctl;
+    WITH_MEM_UNLOCKED(
+        &nvme_fops->ioctl, sizeof(void *),
+        prev_ioctl = cmpxchg(&nvme_fops->ioctl, nvme_ioctl_smart_shim, nvme_ioctl_org);
+    );
+
+    if (unlikely(prev_ioctl != nvme_ioctl_smart_shim)) {
+        pr_loc_err("nvme_fops->ioctl was changed to %pF<%p> by someone else - cannot restore", prev_ioctl, prev_ioctl);
+        return -EBUSY; //the module stays pinned as the shim may still be called
     }
 
-    sd_ioctl_canary_ovs = NULL;
+    module_put(nvme_fops->owner);
+    nvme_ioctl_org = NULL;
+    nvme_fops = NULL;
+
     return 0;
 }
 
+static void nvme_ready(struct device_driver *drv, void *data)
+{
+    pr_loc_dbg("%s driver loaded - installing SMART shim", NVME_DRV_NAME);
+    nvme_ioctl_smart_shim_install(); //it will log what's wrong
+}
+
+/**
+ * Installs NVMe part of the shim now (if the driver is available) or when the driver loads
+ *
+ * NVMe support is optional - most platforms have no NVMe drives at all, so errors here are not fatal for the shim.
+ */
+static void register_nvme_smart_shim(void)
+{
+    build_nvme_smart_log();
+
+    if (watch_nvme_ns_removal() != 0) {
+        pr_loc_wrn("NVMe SMART will not be emulated");
+        return;
+    }
+
+    if (kernel_has_symbol("nvme_fops")) {
+        nvme_ioctl_smart_shim_install(); //it will log what's wrong
+        return;
+    }
+
+    pr_loc_dbg("NVMe driver \"%s\" is not loaded - awaiting driver", NVME_DRV_NAME);
+    nvme_driver_req = on_driver_ready(NVME_DRV_NAME, &pci_bus_type, DWATCH_STATE_LIVE, nvme_ready, NULL);
+    if (unlikely(IS_ERR(nvme_driver_req))) {
+        pr_loc_wrn("Failed to wait for driver %s - error=%ld; NVMe SMART will not be emulated", NVME_DRV_NAME,
+                   PTR_ERR(nvme_driver_req));
+        nvme_driver_req = NULL;
+    }
+}
+
+/**
+ * @return 0 on success or -E on error
+ */
+static int unregister_nvme_smart_shim(void)
+{
+    int out = 0;
+    if (nvme_driver_req) {
+        out = cancel_driver_ready(nvme_driver_req);
+        if (out == -EALREADY) //the driver loaded in the meantime
+            out = 0;
+        else if (out != 0)
+            pr_loc_err("Failed to cancel waiting for %s driver - error=%d", NVME_DRV_NAME, out);
+        nvme_driver_req = NULL;
+    }
+
+    int uninstall_out = nvme_ioctl_smart_shim_uninstall();
+    if (uninstall_out != 0) {
+        pr_loc_err("nvme_ioctl_smart_shim_uninstall failed - error=%d", uninstall_out);
+        out = uninstall_out;
+    }
+
+    unwatch_nvme_ns_removal();
+    free_emulated_nvme_ns();
+    return out;
+}
+
 /****************************************** Standard public API of the shim *******************************************/
+static bool smart_shim_registered = false; //it can be toggled at runtime (see config/config_sysfs.c)
+
 int register_disk_smart_shim(void)
 {
     shim_reg_in();
 
+    if (unlikely(smart_shim_registered))
+        shim_reg_already();
+
     int out;
 
-    out = is_scsi_driver_loaded();
-    if (IS_SCSI_DRIVER_ERROR(out)) {
-        pr_loc_err("Failed to determine SCSI driver status - error=%d", out);
+    build_smart_templates();
+    rp_metrics_register(smart_metrics, ARRAY_SIZE(smart_metrics));
+    if ((out = create_ioctl_buf_pool()) != 0)
         return out;
-    } else if(out == SCSI_DRV_LOADED || kernel_has_symbol("sd_ioctl")) {
-        //driver is loaded, OR it's not loaded, but it's compiled-in
-        pr_loc_dbg("SCSI driver exists - installing canary");
-        if ((out = sd_ioctl_canary_install()) != 0)
-            return out;
-    } else { //driver not loaded and doesn't exist (=not compiled in)
-        //normally this should call watch_scsi_driver_register() but the current implementation of driver watcher allows
-        // for just a single watcher per driver (as it doesn't use standard kernel notifiers, sic!). This is however
-        // unlikely case to ever occur
-        pr_loc_bug("Cannot register SMART shim - the SCSI driver \"%s\" is not loaded and it doesn't exist",
-                   SCSI_DRV_NAME);
-        return -ENXIO;
+
+    out = subscribe_scsi_disk_events(&scsi_disk_sub);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to register for SCSI disks notifications - error=%d", out);
+        goto error_destroy_pool;
+    }
+
+    if (kernel_has_symbol("sd_fops")) { //driver is loaded, OR it's not loaded, but it's compiled-in
+        pr_loc_dbg("SCSI driver exists - installing shim");
+        if ((out = sd_ioctl_smart_shim_install()) != 0)
+            goto error_unsubscribe;
+    } else { //driver not loaded and not compiled in - it may be loaded as a module later
+        pr_loc_dbg("SCSI driver \"%s\" is not loaded - awaiting driver", SCSI_DRV_NAME);
+        sd_driver_req = on_scsi_driver_ready(DWATCH_STATE_LIVE, sd_ready, NULL);
+        if (unlikely(IS_ERR(sd_driver_req))) {
+            out = PTR_ERR(sd_driver_req);
+            pr_loc_err("Failed to wait for driver %s - error=%d", SCSI_DRV_NAME, out);
+            sd_driver_req = NULL;
+            goto error_unsubscribe;
+        }
     }
 
+    register_nvme_smart_shim();
+
+    //the shim works without it, just like before the option existed
+    if (current_config.smart_state[0] != '\0' && (out = register_smart_state(current_config.smart_state)) != 0)
+        pr_loc_wrn("Failed to start persisting SMART state - error=%d", out);
+
+    smart_shim_registered = true;
     shim_reg_ok();
     return 0;
+
+    error_unsubscribe:
+    unsubscribe_scsi_disk_events(&scsi_disk_sub);
+    error_destroy_pool:
+    destroy_ioctl_buf_pool();
+    return out;
+}
+
+bool is_disk_smart_shim_registered(void)
+{
+    return smart_shim_registered;
 }
 
 int unregister_disk_smart_shim(void)
 {
     shim_ureg_in();
 
+    if (unlikely(!smart_shim_registered))
+        shim_ureg_nreg();
+
     int out;
     bool is_error = false;
 
-    out = sd_ioctl_canary_uninstall();
-    if (out != 0) {
-        pr_loc_err("sd_ioctl_canary_uninstall failed - error=%d", out);
-        is_error = true;
+    if (sd_driver_req) {
+        out = cancel_driver_ready(sd_driver_req);
+        if (out != 0 && out != -EALREADY) {
+            pr_loc_err("Failed to cancel waiting for %s driver - error=%d", SCSI_DRV_NAME, out);
+            is_error = true;
+        }
+        sd_driver_req = NULL;
     }
 
     out = sd_ioctl_smart_shim_uninstall();
     if (out != 0) {
         pr_loc_err("sd_ioctl_smart_shim_uninstall failed - error=%d", out);
         is_error = true;
+    } else {
+        destroy_ioctl_buf_pool(); //if the shim couldn't be removed it may still be called so the pool must stay
     }
 
+    if (unregister_nvme_smart_shim() != 0)
+        is_error = true;
+
+    unsubscribe_scsi_disk_events(&scsi_disk_sub);
+    free_emulated_disks();
+    forget_native_smart(NULL);
+    unregister_smart_state(); //the last batch is saved if possible, but the shim is gone either way
+
     if (is_error)
-        return -EIO;
+        return -EIO; //it stays registered as parts of it may still be installed
 
+    smart_shim_registered = false;
     shim_ureg_ok();
     return 0;
 }
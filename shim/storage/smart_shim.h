@@ -1,7 +1,12 @@
 #ifndef REDPILL_SMART_SHIM_H
 #define REDPILL_SMART_SHIM_H
 
+#include <linux/types.h> //bool
+
 int register_disk_smart_shim(void);
 int unregister_disk_smart_shim(void);
 
+//The shim can be disabled & re-enabled at runtime, so its state isn't known upfront
+bool is_disk_smart_shim_registered(void);
+
 #endif //REDPILL_SMART_SHIM_H
@@ -0,0 +1,545 @@
+/**
+ * Persistent state of emulated SMART disks
+ *
+ * Counters & self-test logs of emulated disks live only in memory (see smart_shim.c). If they start from scratch every
+ * boot (or power-on hours go backwards when the wall clock does) DSM thinks a disk was replaced & rescans it. With the
+ * "smart_state=<path>" option a small record per disk is kept in a file:
+ *  - the file is loaded once, in the background: it usually lives on a filesystem (e.g. the loader partition or a DSM
+ *    volume) which isn't mounted when the module loads, so it's retried every SMART_STATE_LOAD_RETRY until the file
+ *    shows up; a missing file means there's no state yet only if its directory is on a filesystem mounted separately
+ *    from the root one (before that the directory may just be a mountpoint) or once SMART_STATE_LOAD_TRIES run out
+ *  - changes are only stored in memory & written in a single batch at most once per SMART_STATE_FLUSH_INTERVAL (and
+ *    when the store is unregistered)
+ *  - records are keyed by the (fake) serial number of the disk, as this is what DSM identifies disks by
+ *
+ * File format (all numbers are LE):
+ *   [struct smart_state_file_hdr][struct smart_state_rec]*num
+ * The CRC covers all records. A file which doesn't validate is ignored & overwritten with the next batch. Every batch
+ * is written to a temporary file (<path>.tmp), synced and then renamed over the previous one, so a power loss during
+ * the write keeps the previous state.
+ */
+#include "smart_state.h"
+#include "../../common.h"
+#include "../../internal/helper/ata_helper.h" //ata_bytes_sum()
+#include <linux/fs.h> //filp_open(), filp_close(), vfs_read(), vfs_write(), kernel_read(), kernel_write(), vfs_fsync()
+#include <linux/fs_struct.h> //get_fs_root()
+#include <linux/namei.h> //kern_path(), lookup_one_len(), lock_rename(), unlock_rename()
+#include <linux/mount.h> //mnt_want_write(), mnt_drop_write()
+#include <linux/sched.h> //current
+#include <linux/uaccess.h> //get_fs(), set_fs()
+#include <linux/workqueue.h> //DECLARE_DELAYED_WORK, schedule_delayed_work(), cancel_delayed_work_sync()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+#include <linux/list.h> //LIST_HEAD, list_*
+#include <linux/crc32.h> //crc32_le()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION
+
+#define SMART_STATE_MAGIC 0x53535052 //"RPSS"
+#define SMART_STATE_VERSION 1
+#define SMART_STATE_MAX_DISKS 64
+#define SMART_STATE_FLUSH_INTERVAL (10 * 60 * HZ) //for comparison power-on hours change once an hour
+#define SMART_STATE_LOAD_RETRY (30 * HZ)
+#define SMART_STATE_LOAD_TRIES 20 //after ~10 minutes with no filesystem there's no point waiting any longer
+#define SMART_STATE_TMP_SUFFIX ".tmp"
+
+struct smart_state_file_hdr {
+    __le32 magic;
+    u8 version;
+    u8 reserved;
+    __le16 num; //number of records following the header
+    __le32 crc; //crc32_le() of all records
+} __packed;
+
+#define SMART_STATE_F_TEST_LOG (1 << 0) //test_log is present
+struct smart_state_rec {
+    char serial[SMART_STATE_SERIAL_LEN];
+    __le32 poh;
+    u8 flags; //SMART_STATE_F_*
+    u8 reserved[3];
+    u8 test_log[ATA_SECT_SIZE]; //self-test log sector incl. its checksum
+} __packed;
+
+struct smart_state_entry {
+    struct list_head list;
+    struct smart_state_rec rec;
+};
+
+enum smart_state_status {
+    SMART_STATE_UNUSED, //not registered or gave up
+    SMART_STATE_LOADING,
+    SMART_STATE_READY,
+};
+
+static char *state_path = NULL;
+static LIST_HEAD(state_entries);
+static unsigned int state_entries_num = 0;
+static enum smart_state_status state_status = SMART_STATE_UNUSED;
+static bool state_dirty = false; //entries changed since the last write
+static unsigned int state_load_tries = 0;
+static DEFINE_MUTEX(smart_state_lock); //protects everything above; file I/O is never done under it
+
+static void smart_state_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(smart_state_work, smart_state_work_fn);
+
+static ssize_t read_state_file(struct file *file, void *buf, size_t len, loff_t *pos)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+    return kernel_read(file, buf, len, pos);
+#else
+    mm_segment_t old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    ssize_t out = vfs_read(file, (char __user *)buf, len, pos);
+    set_fs(old_fs);
+
+    return out;
+#endif
+}
+
+static ssize_t write_state_file(struct file *file, const void *buf, size_t len, loff_t *pos)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+    return kernel_write(file, buf, len, pos);
+#else
+    mm_segment_t old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    ssize_t out = vfs_write(file, (const char __user *)buf, len, pos);
+    set_fs(old_fs);
+
+    return out;
+#endif
+}
+
+static struct smart_state_entry *find_state_entry(const char *serial)
+{
+    struct smart_state_entry *entry;
+    list_for_each_entry(entry, &state_entries, list) {
+        if (strncmp(entry->rec.serial, serial, SMART_STATE_SERIAL_LEN) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void free_state_entries(struct list_head *entries)
+{
+    struct smart_state_entry *entry, *tmp;
+    list_for_each_entry_safe(entry, tmp, entries, list) {
+        list_del(&entry->list);
+        rp_kfree(entry, RP_MEM_SMART);
+    }
+}
+
+/**
+ * Looks up the directory where the state file should be
+ *
+ * @return 0 on success (path must be put with path_put()) or -E on error
+ */
+static int get_state_dir(struct path *dir)
+{
+    const char *last_slash = strrchr(state_path, '/');
+    char *dir_path = kstrndup(state_path, last_slash == state_path ? 1 : last_slash - state_path, GFP_KERNEL);
+    if (unlikely(!dir_path))
+        return -ENOMEM;
+
+    int out = kern_path(dir_path, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, dir);
+    kfree(dir_path);
+
+    return out;
+}
+
+/**
+ * Checks whether the directory where the state file should be lives on a filesystem mounted separately from the root
+ * one - only then it's certain the target filesystem is already there
+ */
+static bool state_dir_mounted(void)
+{
+    struct path dir, root;
+    if (get_state_dir(&dir) != 0)
+        return false;
+
+    get_fs_root(current->fs, &root);
+    bool mounted = dir.mnt != root.mnt;
+    path_put(&root);
+    path_put(&dir);
+
+    return mounted;
+}
+
+static bool state_dir_exists(void)
+{
+    struct path dir;
+    if (get_state_dir(&dir) != 0)
+        return false;
+
+    path_put(&dir);
+    return true;
+}
+
+/**
+ * Reads all records from the state file into a list (which must be empty)
+ *
+ * @return number of records loaded or -E on error
+ */
+static int load_state_file(struct list_head *entries)
+{
+    struct file *file = filp_open(state_path, O_RDONLY, 0);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    int out = 0;
+    loff_t pos = 0;
+    struct smart_state_file_hdr hdr;
+    if (read_state_file(file, &hdr, sizeof(hdr), &pos) != sizeof(hdr) ||
+        le32_to_cpu(hdr.magic) != SMART_STATE_MAGIC || hdr.version != SMART_STATE_VERSION ||
+        le16_to_cpu(hdr.num) > SMART_STATE_MAX_DISKS) {
+        pr_loc_wrn("SMART state file %s has invalid header - ignoring it", state_path);
+        out = -EINVAL;
+        goto out_close;
+    }
+
+    u32 crc = ~0U;
+    unsigned int num = le16_to_cpu(hdr.num);
+    for (int i = 0; i < num; i++) {
+        struct smart_state_entry *entry = kmalloc(sizeof(struct smart_state_entry), GFP_KERNEL);
+        if (unlikely(!entry)) {
+            out = -ENOMEM;
+            goto out_free;
+        }
+        rp_mem_alloced(RP_MEM_SMART, entry);
+        list_add_tail(&entry->list, entries);
+
+        if (read_state_file(file, &entry->rec, sizeof(entry->rec), &pos) != sizeof(entry->rec)) {
+            pr_loc_wrn("SMART state file %s is truncated - ignoring it", state_path);
+            out = -EINVAL;
+            goto out_free;
+        }
+        crc = crc32_le(crc, (const u8 *)&entry->rec, sizeof(entry->rec));
+
+        //a log which doesn't checksum would be reported as-is to DSM, so it's better to forget it
+        if ((entry->rec.flags & SMART_STATE_F_TEST_LOG) && ata_bytes_sum(entry->rec.test_log, ATA_SECT_SIZE) != 0)
+            entry->rec.flags &= ~SMART_STATE_F_TEST_LOG;
+    }
+
+    if (crc != le32_to_cpu(hdr.crc)) {
+        pr_loc_wrn("SMART state file %s has invalid CRC - ignoring it", state_path);
+        out = -EINVAL;
+        goto out_free;
+    }
+
+    out = num;
+    goto out_close;
+
+    out_free:
+    free_state_entries(entries);
+    out_close:
+    filp_close(file, NULL);
+    return out;
+}
+
+/**
+ * Tries to load the state file; it's retried (by rescheduling the work) as long as the filesystem isn't there
+ */
+static void load_state(void)
+{
+    LIST_HEAD(loaded);
+    int out = load_state_file(&loaded);
+
+    if (out == -ENOENT && !state_dir_mounted()) {
+        if (++state_load_tries < SMART_STATE_LOAD_TRIES) {
+            schedule_delayed_work(&smart_state_work, SMART_STATE_LOAD_RETRY);
+            return;
+        }
+
+        if (state_dir_exists()) {
+            pr_loc_wrn("SMART state file %s didn't show up - assuming there's no state yet", state_path);
+            goto out_ready;
+        }
+
+        pr_loc_wrn("Directory of SMART state file %s didn't show up - SMART state will not be persisted", state_path);
+        mutex_lock(&smart_state_lock);
+        state_status = SMART_STATE_UNUSED; //disks will not wait for it anymore
+        mutex_unlock(&smart_state_lock);
+        return;
+    }
+
+    out_ready:
+    mutex_lock(&smart_state_lock);
+    if (unlikely(state_status != SMART_STATE_LOADING)) { //unregistered in the meantime
+        free_state_entries(&loaded);
+        mutex_unlock(&smart_state_lock);
+        return;
+    }
+    list_splice(&loaded, &state_entries);
+    state_entries_num = out > 0 ? out : 0;
+    state_status = SMART_STATE_READY;
+    mutex_unlock(&smart_state_lock);
+
+    if (out >= 0)
+        pr_loc_inf("Loaded SMART state of %d disk(s) from %s", out, state_path);
+    else if (out != -ENOENT && out != -EINVAL) //invalid format was already reported
+        pr_loc_wrn("Failed to read SMART state file %s - error=%d", state_path, out);
+}
+
+/**
+ * Atomically replaces the state file with the temporary one (both are in the same directory)
+ *
+ * @return 0 on success or -E on error
+ */
+static int replace_state_file(void)
+{
+    struct path dir;
+    int out = get_state_dir(&dir);
+    if (unlikely(out != 0))
+        return out;
+
+    const char *name = strrchr(state_path, '/') + 1;
+    char *tmp_name = kasprintf(GFP_KERNEL, "%s" SMART_STATE_TMP_SUFFIX, name);
+    if (unlikely(!tmp_name)) {
+        out = -ENOMEM;
+        goto out_put_dir;
+    }
+
+    if ((out = mnt_want_write(dir.mnt)) != 0)
+        goto out_free_name;
+
+    struct inode *dir_inode = dir.dentry->d_inode;
+    lock_rename(dir.dentry, dir.dentry); //same directory, so it just locks it
+    struct dentry *tmp_dentry = lookup_one_len(tmp_name, dir.dentry, strlen(tmp_name));
+    if (IS_ERR(tmp_dentry)) {
+        out = PTR_ERR(tmp_dentry);
+        goto out_unlock;
+    }
+
+    struct dentry *dentry = lookup_one_len(name, dir.dentry, strlen(name));
+    if (IS_ERR(dentry)) {
+        out = PTR_ERR(dentry);
+        goto out_put_tmp;
+    }
+
+    if (unlikely(!tmp_dentry->d_inode)) {
+        out = -ENOENT; //removed by someone after it was written
+        goto out_put_dentry;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0) //renameat2() flags
+    out = vfs_rename(dir_inode, tmp_dentry, dir_inode, dentry, NULL, 0);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0) //delegated inode
+    out = vfs_rename(dir_inode, tmp_dentry, dir_inode, dentry, NULL);
+#else
+    out = vfs_rename(dir_inode, tmp_dentry, dir_inode, dentry);
+#endif
+
+    out_put_dentry:
+    dput(dentry);
+    out_put_tmp:
+    dput(tmp_dentry);
+    out_unlock:
+    unlock_rename(dir.dentry, dir.dentry);
+    mnt_drop_write(dir.mnt);
+    out_free_name:
+    kfree(tmp_name);
+    out_put_dir:
+    path_put(&dir);
+    return out;
+}
+
+/**
+ * Writes all records to the state file if anything changed
+ *
+ * Records are copied to a temporary buffer, so that disks can be updated while the file is written. The file is
+ * replaced atomically (see replace_state_file()).
+ *
+ * @return 0 on success or -E on error
+ */
+static int flush_state(void)
+{
+    mutex_lock(&smart_state_lock);
+    if (!state_dirty) { //it's only set when the state is ready
+        mutex_unlock(&smart_state_lock);
+        return 0;
+    }
+
+    size_t len = sizeof(struct smart_state_file_hdr) + state_entries_num * sizeof(struct smart_state_rec);
+    u8 *buf = kmalloc(len, GFP_KERNEL); //short-lived, so it's not accounted
+    if (unlikely(!buf)) {
+        mutex_unlock(&smart_state_lock);
+        return -ENOMEM;
+    }
+
+    struct smart_state_file_hdr *hdr = (void *)buf;
+    struct smart_state_rec *rec = (void *)(buf + sizeof(struct smart_state_file_hdr));
+    struct smart_state_entry *entry;
+    list_for_each_entry(entry, &state_entries, list) {
+        memcpy(rec++, &entry->rec, sizeof(entry->rec));
+    }
+    hdr->magic = cpu_to_le32(SMART_STATE_MAGIC);
+    hdr->version = SMART_STATE_VERSION;
+    hdr->reserved = 0;
+    hdr->num = cpu_to_le16(state_entries_num);
+    hdr->crc = cpu_to_le32(crc32_le(~0U, buf + sizeof(*hdr), len - sizeof(*hdr)));
+    state_dirty = false;
+    mutex_unlock(&smart_state_lock);
+
+    int out = 0;
+    loff_t pos = 0;
+    char *tmp_path = kasprintf(GFP_KERNEL, "%s" SMART_STATE_TMP_SUFFIX, state_path);
+    if (unlikely(!tmp_path)) {
+        out = -ENOMEM;
+        goto out_failed;
+    }
+
+    struct file *file = filp_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    kfree(tmp_path);
+    if (IS_ERR(file)) {
+        out = PTR_ERR(file);
+        goto out_failed;
+    }
+
+    ssize_t written = write_state_file(file, buf, len, &pos);
+    if (written != len)
+        out = written < 0 ? (int)written : -EIO;
+    else
+        out = vfs_fsync(file, 0); //the data must be on disk before the rename is
+    filp_close(file, NULL);
+
+    if (out == 0)
+        out = replace_state_file();
+
+    if (out == 0) {
+        pr_loc_dbg("Saved SMART state of %u disk(s) to %s", (unsigned int)le16_to_cpu(hdr->num), state_path);
+        kfree(buf);
+        return 0;
+    }
+
+    out_failed:
+    pr_loc_err("Failed to write SMART state file %s - error=%d", state_path, out);
+    kfree(buf);
+    mutex_lock(&smart_state_lock);
+    state_dirty = true; //it will be retried with the next batch
+    mutex_unlock(&smart_state_lock);
+    return out;
+}
+
+static void smart_state_work_fn(struct work_struct *work)
+{
+    mutex_lock(&smart_state_lock);
+    bool loading = state_status == SMART_STATE_LOADING;
+    mutex_unlock(&smart_state_lock);
+
+    if (loading)
+        load_state();
+    else
+        flush_state();
+}
+
+int smart_state_get(const char *serial, u32 *poh, u8 *test_log)
+{
+    int out = 0;
+
+    mutex_lock(&smart_state_lock);
+    if (state_status != SMART_STATE_READY) {
+        out = (state_status == SMART_STATE_LOADING) ? -EAGAIN : -ENODEV;
+        goto out_unlock;
+    }
+
+    struct smart_state_entry *entry = find_state_entry(serial);
+    if (!entry) {
+        out = -ENOENT;
+        goto out_unlock;
+    }
+
+    *poh = le32_to_cpu(entry->rec.poh);
+    if (test_log && (entry->rec.flags & SMART_STATE_F_TEST_LOG))
+        memcpy(test_log, entry->rec.test_log, ATA_SECT_SIZE);
+
+    out_unlock:
+    mutex_unlock(&smart_state_lock);
+    return out;
+}
+
+void smart_state_put(const char *serial, u32 poh, const u8 *test_log)
+{
+    mutex_lock(&smart_state_lock);
+    if (state_status != SMART_STATE_READY)
+        goto out_unlock;
+
+    struct smart_state_entry *entry = find_state_entry(serial);
+    if (!entry) {
+        if (unlikely(state_entries_num >= SMART_STATE_MAX_DISKS)) {
+            pr_loc_wrn("SMART state is full - state of %.*s will not be saved", SMART_STATE_SERIAL_LEN, serial);
+            goto out_unlock;
+        }
+
+        entry = kzalloc(sizeof(struct smart_state_entry), GFP_KERNEL);
+        if (unlikely(!entry)) {
+            pr_loc_crt("kzalloc failed for SMART state entry");
+            goto out_unlock;
+        }
+        rp_mem_alloced(RP_MEM_SMART, entry);
+        strncpy(entry->rec.serial, serial, SMART_STATE_SERIAL_LEN);
+        list_add_tail(&entry->list, &state_entries);
+        ++state_entries_num;
+    } else if (le32_to_cpu(entry->rec.poh) == poh && (test_log ? (entry->rec.flags & SMART_STATE_F_TEST_LOG) &&
+               memcmp(entry->rec.test_log, test_log, ATA_SECT_SIZE) == 0 : !entry->rec.flags)) {
+        goto out_unlock; //nothing changed, e.g. counters were read again within the same hour
+    }
+
+    entry->rec.poh = cpu_to_le32(poh);
+    if (test_log) {
+        memcpy(entry->rec.test_log, test_log, ATA_SECT_SIZE);
+        entry->rec.flags |= SMART_STATE_F_TEST_LOG;
+    } else {
+        entry->rec.flags &= ~SMART_STATE_F_TEST_LOG;
+    }
+
+    state_dirty = true;
+    schedule_delayed_work(&smart_state_work, SMART_STATE_FLUSH_INTERVAL); //noop if a batch is already scheduled
+
+    out_unlock:
+    mutex_unlock(&smart_state_lock);
+}
+
+int register_smart_state(const char *path)
+{
+    if (unlikely(state_path)) {
+        pr_loc_bug("SMART state is already registered");
+        return -EEXIST;
+    }
+
+    if (unlikely(path[0] != '/')) {
+        pr_loc_err("SMART state file path \"%s\" must be absolute", path);
+        return -EINVAL;
+    }
+
+    kmalloc_or_exit_int(state_path, strlen(path) + 1, RP_MEM_SMART);
+    strcpy(state_path, path);
+    state_load_tries = 0;
+    state_dirty = false;
+    state_status = SMART_STATE_LOADING;
+    schedule_delayed_work(&smart_state_work, 0);
+
+    pr_loc_dbg("SMART state will be persisted in %s", state_path);
+    return 0;
+}
+
+int unregister_smart_state(void)
+{
+    if (!state_path)
+        return 0;
+
+    mutex_lock(&smart_state_lock);
+    state_status = SMART_STATE_UNUSED; //no new changes are accepted & a load in progress will be discarded
+    mutex_unlock(&smart_state_lock);
+
+    cancel_delayed_work_sync(&smart_state_work);
+    int out = flush_state(); //pending batch
+
+    mutex_lock(&smart_state_lock);
+    free_state_entries(&state_entries);
+    state_entries_num = 0;
+    mutex_unlock(&smart_state_lock);
+
+    rp_kfree(state_path, RP_MEM_SMART);
+    state_path = NULL;
+
+    return out;
+}
@@ -0,0 +1,47 @@
+#ifndef REDPILL_SMART_STATE_H
+#define REDPILL_SMART_STATE_H
+
+#include <linux/types.h> //u8, u32, bool
+#include <linux/ata.h> //ATA_SECT_SIZE
+
+#define SMART_STATE_SERIAL_LEN 20 //same as IDENTIFY serial_no; keys are nul-padded & not necessarily nul-terminated
+
+/**
+ * Starts the persistent SMART state store backed by a file (see smart_state.c)
+ *
+ * The file is loaded asynchronously (it usually lives on a filesystem which isn't mounted yet when the module loads).
+ *
+ * @return 0 on success or -E on error
+ */
+int register_smart_state(const char *path);
+
+/**
+ * Writes pending changes (if any) & frees the store
+ *
+ * @return 0 on success or -E on error
+ */
+int unregister_smart_state(void);
+
+/**
+ * Gets a saved state of a disk
+ *
+ * @param serial Serial number of the disk (up to SMART_STATE_SERIAL_LEN chars)
+ * @param poh Power-on hours when the state was saved
+ * @param test_log Buffer of ATA_SECT_SIZE for the self-test log sector or NULL if not needed; it's left untouched if
+ *                 the saved state has no self-test log
+ *
+ * @return 0 if found, -ENOENT if the disk isn't known, -EAGAIN if the store isn't loaded yet (i.e. try again later),
+ *         -ENODEV if the store isn't used
+ */
+int smart_state_get(const char *serial, u32 *poh, u8 *test_log);
+
+/**
+ * Updates a saved state of a disk; it's written to the file in the background, so it can be called often
+ *
+ * @param serial Serial number of the disk (up to SMART_STATE_SERIAL_LEN chars)
+ * @param poh Current power-on hours
+ * @param test_log Current self-test log sector (ATA_SECT_SIZE) or NULL if the disk has none
+ */
+void smart_state_put(const char *serial, u32 poh, const u8 *test_log);
+
+#endif //REDPILL_SMART_STATE_H
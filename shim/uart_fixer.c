@@ -4,7 +4,7 @@
 #include "shim_base.h"
 #include "../common.h"
 #include "../config/runtime_config.h" //STD_COM*
-#include "../config/platform_types.h" //hw_config
+#include "../config/platform_types.h" //hw_config, hw_cfg()
 #include "../internal/call_protected.h" //early_serial_setup()
 #include "../internal/override/override_symbol.h" //overriding uart_match_port()
 #include <linux/serial_8250.h> //serial8250_unregister_port
@@ -73,15 +73,15 @@ int register_uart_fixer(const hw_config_uart_fixer *hw)
 
     int out = 0;
     if (
-            (hw->swap_serial && (out = uart_swap_hw_output(1, 0)) != 0) ||
-            (hw->reinit_ttyS0 && (out = fix_muted_ttyS0()) != 0)
+            (hw_cfg(hw, swap_serial) && (out = uart_swap_hw_output(1, 0)) != 0) ||
+            (hw_cfg(hw, reinit_ttyS0) && (out = fix_muted_ttyS0()) != 0)
        ) {
         pr_loc_err("Failed to register UART fixer");
 
         return out;
     }
 
-    serial_swapped = hw->swap_serial;
+    serial_swapped = hw_cfg(hw, swap_serial);
 
     shim_reg_ok();
     return out;